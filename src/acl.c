@@ -213,6 +213,9 @@ user *ACLCreateUser(const char *name, size_t namelen) {
     listSetFreeMethod(u->patterns,ACLListFreeSds);
     listSetDupMethod(u->patterns,ACLListDupSds);
     memset(u->allowed_commands,0,sizeof(u->allowed_commands));
+    u->key_prefixes = NULL;
+    u->key_globs = NULL;
+    u->compiled_generation = 0;
     raxInsert(Users,(unsigned char*)name,namelen,u,NULL);
     return u;
 }
@@ -240,6 +243,8 @@ void ACLFreeUser(user *u) {
     sdsfree(u->name);
     listRelease(u->passwords);
     listRelease(u->patterns);
+    if (u->key_prefixes) raxFree(u->key_prefixes);
+    if (u->key_globs) listRelease(u->key_globs);
     ACLResetSubcommands(u);
     zfree(u);
 }
@@ -250,6 +255,7 @@ void ACLFreeUser(user *u) {
 void ACLFreeUserAndKillClients(user *u) {
     listIter li;
     listNode *ln;
+    server.acl_generation++;
     listRewind(server.clients,&li);
     while ((ln = listNext(&li)) != NULL) {
         client *c = listNodeValue(ln);
@@ -698,6 +704,9 @@ void ACLAddAllowedSubcommand(user *u, unsigned long id, const char *sub) {
  * EBADMSG: The hash you are trying to add is not a valid hash. 
  */
 int ACLSetUser(user *u, const char *op, ssize_t oplen) {
+    /* Whatever the op will be, permission checks cached before this call
+     * can no longer be trusted. */
+    server.acl_generation++;
     if (oplen == -1) oplen = strlen(op);
     if (!strcasecmp(op,"on")) {
         u->flags |= USER_FLAG_ENABLED;
@@ -1024,6 +1033,81 @@ user *ACLGetUserByName(const char *name, size_t namelen) {
     return myuser;
 }
 
+/* Compile the key patterns of 'u' into a form that is cheaper to match:
+ * patterns composed of a literal prefix followed by a single final "*",
+ * like the "tenant:*" style rules typical of multi tenant setups, are
+ * collected into a radix tree keyed by the prefix, so that a key is
+ * checked against all of them at once. Every other pattern goes to the
+ * 'key_globs' list and is still matched with stringmatchlen().
+ *
+ * The compiled form is shared by all the clients authenticated with the
+ * user, and is rebuilt here (lazily, on the first check needing it) when
+ * it is out of date with respect to server.acl_generation. */
+void ACLCompileUserPatterns(user *u) {
+    if (u->compiled_generation == server.acl_generation) return;
+    if (u->key_prefixes) raxFree(u->key_prefixes);
+    if (u->key_globs) listRelease(u->key_globs);
+    u->key_prefixes = raxNew();
+    u->key_globs = listCreate(); /* References 'patterns' strings: no free
+                                    method, and rebuilt before any use that
+                                    follows a change of the user. */
+
+    listIter li;
+    listNode *ln;
+    listRewind(u->patterns,&li);
+    while((ln = listNext(&li))) {
+        sds pattern = listNodeValue(ln);
+        size_t plen = sdslen(pattern);
+        size_t j;
+
+        for (j = 0; j < plen; j++) {
+            if (pattern[j] == '*' || pattern[j] == '?' ||
+                pattern[j] == '[' || pattern[j] == '\\') break;
+        }
+        if (j == plen-1 && pattern[j] == '*' && plen > 1) {
+            raxInsert(u->key_prefixes,(unsigned char*)pattern,plen-1,
+                      NULL,NULL);
+        } else {
+            listAddNodeTail(u->key_globs,pattern);
+        }
+    }
+    u->compiled_generation = server.acl_generation;
+}
+
+/* Return 1 if any of the prefixes stored in the 'prefixes' radix tree is
+ * a prefix of the 'keylen' bytes key 'key', otherwise 0.
+ *
+ * The lookup seeks the greatest stored string not greater than the key:
+ * if it is not a prefix of the key, every stored prefix of the key can
+ * only be as long as the bytes the two strings have in common, so the
+ * search is repeated on the key truncated at that length, until a match
+ * is found or no common bytes are left. */
+static int ACLPrefixTrieMatch(rax *prefixes, unsigned char *key,
+                              size_t keylen)
+{
+    raxIterator ri;
+    size_t seeklen = keylen;
+    int match = 0;
+
+    if (raxSize(prefixes) == 0) return 0;
+    raxStart(&ri,prefixes);
+    while(1) {
+        raxSeek(&ri,"<=",key,seeklen);
+        if (!raxNext(&ri)) break;
+        if (ri.key_len <= keylen && memcmp(ri.key,key,ri.key_len) == 0) {
+            match = 1;
+            break;
+        }
+        size_t common = 0;
+        while (common < ri.key_len && common < seeklen &&
+               ri.key[common] == key[common]) common++;
+        if (common == 0) break;
+        seeklen = common;
+    }
+    raxStop(&ri);
+    return match;
+}
+
 /* Check if the command is ready to be executed in the client 'c', already
  * referenced by c->cmd, and can be executed by this client according to the
  * ACLs associated to the client user c->user.
@@ -1040,8 +1124,22 @@ int ACLCheckCommandPerm(client *c) {
     /* If there is no associated user, the connection can run anything. */
     if (u == NULL) return ACL_OK;
 
+    /* Users with both "allcommands" and "allkeys", like the default user
+     * in its default configuration, pass every check below: skip them
+     * with a single test. */
+    if ((u->flags & USER_FLAG_FULLACCESS) == USER_FLAG_FULLACCESS)
+        return ACL_OK;
+
+    /* Consult the per client cache of command verdicts: a set bit means
+     * we already verified the user can run this command with any
+     * arguments, so only the key patterns are left to check. */
+    int cmd_cached = c->acl_cmd_generation == server.acl_generation &&
+                     c->acl_cmd_user == u &&
+                     (c->acl_cmd_allowed[id/64] & (1ULL<<(id%64)));
+
     /* Check if the user can execute this command. */
-    if (!(u->flags & USER_FLAG_ALLCOMMANDS) &&
+    if (!cmd_cached &&
+        !(u->flags & USER_FLAG_ALLCOMMANDS) &&
         c->cmd->proc != authCommand)
     {
         /* If the bit is not set we have to check further, in case the
@@ -1064,32 +1162,52 @@ int ACLCheckCommandPerm(client *c) {
                     break; /* Subcommand match found. Stop here. */
                 subid++;
             }
+            /* Verdicts depending on the subcommand argument cannot be
+             * cached: pretend we got a cache hit not to populate the
+             * cache below. */
+            cmd_cached = 1;
         }
     }
 
+    /* Remember argument independent positive verdicts. The cache is
+     * reset when it was filled for a different user or before the last
+     * ACL change. */
+    if (!cmd_cached) {
+        if (c->acl_cmd_generation != server.acl_generation ||
+            c->acl_cmd_user != u)
+        {
+            memset(c->acl_cmd_allowed,0,sizeof(c->acl_cmd_allowed));
+            c->acl_cmd_generation = server.acl_generation;
+            c->acl_cmd_user = u;
+        }
+        c->acl_cmd_allowed[id/64] |= 1ULL<<(id%64);
+    }
+
     /* Check if the user can execute commands explicitly touching the keys
      * mentioned in the command arguments. */
     if (!(c->user->flags & USER_FLAG_ALLKEYS) &&
         (c->cmd->getkeys_proc || c->cmd->firstkey))
     {
+        ACLCompileUserPatterns(u);
         int numkeys;
         int *keyidx = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
         for (int j = 0; j < numkeys; j++) {
             listIter li;
             listNode *ln;
-            listRewind(u->patterns,&li);
-
-            /* Test this key against every pattern. */
-            int match = 0;
-            while((ln = listNext(&li))) {
+            int idx = keyidx[j];
+            sds key = c->argv[idx]->ptr;
+
+            /* Test this key against the prefix patterns all at once, and
+             * then against every remaining pattern. */
+            int match = ACLPrefixTrieMatch(u->key_prefixes,
+                                           (unsigned char*)key,sdslen(key));
+            listRewind(u->key_globs,&li);
+            while(!match && (ln = listNext(&li))) {
                 sds pattern = listNodeValue(ln);
-                size_t plen = sdslen(pattern);
-                int idx = keyidx[j];
-                if (stringmatchlen(pattern,plen,c->argv[idx]->ptr,
-                                   sdslen(c->argv[idx]->ptr),0))
+                if (stringmatchlen(pattern,sdslen(pattern),key,
+                                   sdslen(key),0))
                 {
                     match = 1;
-                    break;
                 }
             }
             if (!match) {
@@ -46,6 +46,9 @@
 
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
+#ifdef HAVE_IO_URING
+#include "ae_iouring.c"
+#else
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
@@ -59,6 +62,7 @@
         #endif
     #endif
 #endif
+#endif
 
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
@@ -77,6 +81,8 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->beforesleep = NULL;
     eventLoop->aftersleep = NULL;
     eventLoop->flags = 0;
+    eventLoop->busypoll_usec = 0;
+    eventLoop->busypoll_armed = 0;
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -106,6 +112,13 @@ void aeSetDontWait(aeEventLoop *eventLoop, int noWait) {
         eventLoop->flags &= ~AE_DONT_WAIT;
 }
 
+/* Set for how many microseconds aeProcessEvents() may poll with a zero
+ * timeout before falling back to a blocking wait, when the previous
+ * iteration processed events. Zero (the default) disables busy polling. */
+void aeSetBusyPollDuration(aeEventLoop *eventLoop, long long usec) {
+    eventLoop->busypoll_usec = usec;
+}
+
 /* Resize the maximum set size of the event loop.
  * If the requested set size is smaller than the current set size, but
  * there is already a file descriptor in use that is >= the requested
@@ -420,9 +433,46 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             tvp = &tv;
         }
 
+        /* Busy polling: when the previous iteration returned events, more
+         * work is likely to arrive shortly, so instead of blocking right
+         * away we poll with a zero timeout for a small time budget, saving
+         * the wakeup latency of the kernel sleep at the price of burning
+         * CPU. The budget never extends past the next time event. */
+        numevents = 0;
+        if (eventLoop->busypoll_usec && eventLoop->busypoll_armed &&
+            !(flags & AE_DONT_WAIT) && !(eventLoop->flags & AE_DONT_WAIT) &&
+            (tvp == NULL || tvp->tv_sec || tvp->tv_usec))
+        {
+            struct timeval zero = {0, 0}, start, now;
+            long long budget = eventLoop->busypoll_usec, spinned = 0;
+
+            if (tvp) {
+                long long until_timer = tvp->tv_sec*1000000LL + tvp->tv_usec;
+                if (budget > until_timer) budget = until_timer;
+            }
+            gettimeofday(&start, NULL);
+            while ((numevents = aeApiPoll(eventLoop, &zero)) == 0) {
+                gettimeofday(&now, NULL);
+                spinned = (now.tv_sec - start.tv_sec)*1000000LL +
+                          (now.tv_usec - start.tv_usec);
+                if (spinned >= budget) break;
+            }
+            /* Nothing arrived in the budget: block for the remaining time
+             * before the next time event, if any. */
+            if (numevents == 0 && tvp) {
+                long long left = tvp->tv_sec*1000000LL + tvp->tv_usec
+                                 - spinned;
+                if (left < 0) left = 0;
+                tv.tv_sec = left / 1000000;
+                tv.tv_usec = left % 1000000;
+            }
+        }
+
         /* Call the multiplexing API, will return only on timeout or when
          * some event fires. */
-        numevents = aeApiPoll(eventLoop, tvp);
+        if (numevents == 0)
+            numevents = aeApiPoll(eventLoop, tvp);
+        eventLoop->busypoll_armed = (numevents > 0);
 
         /* After sleep callback. */
         if (eventLoop->aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
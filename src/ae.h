@@ -107,6 +107,8 @@ typedef struct aeEventLoop {
     aeBeforeSleepProc *beforesleep;
     aeBeforeSleepProc *aftersleep;
     int flags;
+    long long busypoll_usec; /* Busy poll budget before blocking (0=off). */
+    int busypoll_armed;      /* True if the last poll returned events. */
 } aeEventLoop;
 
 /* Prototypes */
@@ -130,5 +132,6 @@ void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
+void aeSetBusyPollDuration(aeEventLoop *eventLoop, long long usec);
 
 #endif
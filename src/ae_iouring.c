@@ -0,0 +1,304 @@
+/* Linux io_uring based ae.c module
+ *
+ * Implements the ae API on top of the io_uring poll family of operations
+ * (IORING_OP_POLL_ADD / IORING_OP_POLL_REMOVE). Readiness for every
+ * monitored fd is obtained draining the completion queue, so a single
+ * io_uring_enter(2) call can collect thousands of events, while interest
+ * (un)registration is just an SQE append that is flushed in batch on the
+ * next poll: under heavy pipelining this removes almost all the
+ * epoll_ctl(2)/epoll_wait(2) traffic.
+ *
+ * The ring is accessed with raw syscalls and mmap(2), so no dependency
+ * on liburing is introduced. Requires Linux 5.1 or greater and is only
+ * compiled in when the server is built with USE_IO_URING=yes.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define AE_RING_ENTRIES 1024 /* SQ size: CQ is sized 2x by the kernel. */
+
+/* The fd a completion refers to is stored in the low 32 bits of the
+ * SQE user_data, the operation kind in the high bits, so that stale
+ * completions of cancelled or internal operations can be skipped. */
+#define AE_RING_OP_POLL 0ULL
+#define AE_RING_OP_CANCEL (1ULL << 32)
+#define AE_RING_OP_TIMEOUT (2ULL << 32)
+#define AE_RING_OP_MASK (0xffffffffULL << 32)
+#define AE_RING_FD_MASK 0xffffffffULL
+
+typedef struct aeApiState {
+    int ringfd;
+    unsigned sqe_pending;  /* SQEs appended but not yet submitted. */
+    unsigned char *armed;  /* Outstanding POLL_ADD count, one per fd. */
+
+    /* Submission queue mapping. */
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    void *sq_ring;
+    size_t sq_ring_sz, sqes_sz;
+
+    /* Completion queue mapping. */
+    struct io_uring_cqe *cqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cq_ring;
+    size_t cq_ring_sz;
+} aeApiState;
+
+static int aeRingSetup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeRingEnter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    struct io_uring_params p;
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+
+    if (!state) return -1;
+    memset(state,0,sizeof(*state));
+    memset(&p,0,sizeof(p));
+    state->ringfd = aeRingSetup(AE_RING_ENTRIES,&p);
+    if (state->ringfd == -1) {
+        zfree(state);
+        return -1;
+    }
+
+    state->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    state->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    state->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->sq_ring = mmap(NULL,state->sq_ring_sz,PROT_READ|PROT_WRITE,
+                          MAP_SHARED,state->ringfd,
+                          IORING_OFF_SQ_RING);
+    state->cq_ring = mmap(NULL,state->cq_ring_sz,PROT_READ|PROT_WRITE,
+                          MAP_SHARED,state->ringfd,
+                          IORING_OFF_CQ_RING);
+    state->sqes = mmap(NULL,state->sqes_sz,PROT_READ|PROT_WRITE,
+                       MAP_SHARED,state->ringfd,
+                       IORING_OFF_SQES);
+    if (state->sq_ring == MAP_FAILED || state->cq_ring == MAP_FAILED ||
+        state->sqes == MAP_FAILED)
+    {
+        if (state->sq_ring != MAP_FAILED) munmap(state->sq_ring,state->sq_ring_sz);
+        if (state->cq_ring != MAP_FAILED) munmap(state->cq_ring,state->cq_ring_sz);
+        if (state->sqes != (void*)MAP_FAILED) munmap(state->sqes,state->sqes_sz);
+        close(state->ringfd);
+        zfree(state);
+        return -1;
+    }
+
+    state->sq_head = (unsigned*)((char*)state->sq_ring + p.sq_off.head);
+    state->sq_tail = (unsigned*)((char*)state->sq_ring + p.sq_off.tail);
+    state->sq_mask = (unsigned*)((char*)state->sq_ring + p.sq_off.ring_mask);
+    state->sq_array = (unsigned*)((char*)state->sq_ring + p.sq_off.array);
+    state->cq_head = (unsigned*)((char*)state->cq_ring + p.cq_off.head);
+    state->cq_tail = (unsigned*)((char*)state->cq_ring + p.cq_off.tail);
+    state->cq_mask = (unsigned*)((char*)state->cq_ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cq_ring + p.cq_off.cqes);
+
+    state->armed = zcalloc(eventLoop->setsize);
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+
+    state->armed = zrealloc(state->armed,setsize);
+    if (setsize > eventLoop->setsize)
+        memset(state->armed+eventLoop->setsize,0,setsize-eventLoop->setsize);
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    munmap(state->sq_ring,state->sq_ring_sz);
+    munmap(state->cq_ring,state->cq_ring_sz);
+    munmap(state->sqes,state->sqes_sz);
+    close(state->ringfd);
+    zfree(state->armed);
+    zfree(state);
+}
+
+/* Flush every SQE appended so far without waiting for completions. */
+static void aeRingSubmit(aeApiState *state) {
+    if (state->sqe_pending) {
+        aeRingEnter(state->ringfd,state->sqe_pending,0,0);
+        state->sqe_pending = 0;
+    }
+}
+
+/* Return the next free SQE, flushing the submission queue if full. */
+static struct io_uring_sqe *aeRingGetSqe(aeApiState *state) {
+    unsigned tail = *state->sq_tail;
+    unsigned head = __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+
+    if (tail - head >= AE_RING_ENTRIES) {
+        aeRingSubmit(state);
+        head = __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+        if (tail - head >= AE_RING_ENTRIES) return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &state->sqes[tail & *state->sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    state->sq_array[tail & *state->sq_mask] = tail & *state->sq_mask;
+    __atomic_store_n(state->sq_tail,tail+1,__ATOMIC_RELEASE);
+    state->sqe_pending++;
+    return sqe;
+}
+
+static unsigned short aeRingPollMask(int mask) {
+    unsigned short events = 0;
+
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+    return events;
+}
+
+/* Queue a one-shot poll request for 'fd'. The request is re-armed every
+ * time a completion for the fd is drained, emulating the level triggered
+ * behavior of the other backends. */
+static int aeRingArmPoll(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeRingGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = aeRingPollMask(mask);
+    sqe->user_data = AE_RING_OP_POLL | (unsigned)fd;
+    state->armed[fd]++;
+    return 0;
+}
+
+/* Cancel the outstanding poll request for 'fd', if any. The cancelled
+ * request completes with -ECANCELED and is skipped when draining. */
+static int aeRingCancelPoll(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (!state->armed[fd]) return 0;
+    if ((sqe = aeRingGetSqe(state)) == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = AE_RING_OP_POLL | (unsigned)fd;
+    sqe->user_data = AE_RING_OP_CANCEL | (unsigned)fd;
+    return 0;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    /* If the fd was already monitored replace the old request, as the
+     * events a poll SQE waits for can't be updated in place. */
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    if (aeRingCancelPoll(state,fd) == -1) return -1;
+    return aeRingArmPoll(state,fd,mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    int mask = eventLoop->events[fd].mask & (~delmask);
+
+    aeRingCancelPoll(state,fd);
+    if (mask != AE_NONE) aeRingArmPoll(state,fd,mask);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct __kernel_timespec ts;
+    int numevents = 0;
+    unsigned min_complete = 1;
+
+    /* The enter timeout is expressed submitting a timeout operation
+     * whose completion, if no fd fires first, wakes us up. */
+    if (tvp) {
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) {
+            min_complete = 0;
+        } else {
+            struct io_uring_sqe *sqe = aeRingGetSqe(state);
+            if (sqe) {
+                ts.tv_sec = tvp->tv_sec;
+                ts.tv_nsec = tvp->tv_usec * 1000;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)(uintptr_t)&ts;
+                sqe->len = 1;
+                sqe->user_data = AE_RING_OP_TIMEOUT;
+            }
+        }
+    }
+
+    unsigned to_submit = state->sqe_pending;
+    state->sqe_pending = 0;
+    if (aeRingEnter(state->ringfd,to_submit,min_complete,
+                    IORING_ENTER_GETEVENTS) == -1) return 0;
+
+    unsigned head = *state->cq_head;
+    unsigned tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        uint64_t op = cqe->user_data & AE_RING_OP_MASK;
+        int fd = cqe->user_data & AE_RING_FD_MASK;
+
+        head++;
+        if (op != AE_RING_OP_POLL) continue; /* Timeout or cancellation. */
+        state->armed[fd]--;
+        if (cqe->res < 0) continue; /* Cancelled or failed request. */
+
+        int mask = 0;
+        if (cqe->res & POLLIN) mask |= AE_READABLE;
+        if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+        if (cqe->res & POLLERR) mask |= AE_WRITABLE|AE_READABLE;
+        if (cqe->res & POLLHUP) mask |= AE_WRITABLE|AE_READABLE;
+        if (mask == 0) continue;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+
+        /* One-shot completion consumed the interest: re-arm it if the
+         * fd is still monitored and no replacement was queued. */
+        if (!state->armed[fd] && eventLoop->events[fd].mask != AE_NONE)
+            aeRingArmPoll(state,fd,eventLoop->events[fd].mask);
+    }
+    __atomic_store_n(state->cq_head,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+static char *aeApiName(void) {
+    return "io_uring";
+}
@@ -64,6 +64,30 @@ typedef struct aofrwblock {
     char buf[AOF_RW_BUF_BLOCK_SIZE];
 } aofrwblock;
 
+/* Commands that fully overwrite a single key (a plain SET, or a DEL of
+ * one key) absorb every previous buffered record of that key: during a
+ * rewrite they are held back in the index below, one record per key,
+ * instead of being appended to the blocks right away, so a hot key
+ * rewritten over and over contributes a single record to the rewrite
+ * buffer instead of growing it without bound. The held back records are
+ * spliced into the stream as soon as ordering requires it (another
+ * command touches the key, a multi key or keyless command shows up, or
+ * the buffer is finally written), see aofRewriteBufferFeedCommand(). */
+#define AOF_RW_COALESCE_MAX_KEYS 8192
+
+static dict *aof_coalesce_index = NULL;     /* key -> serialized record */
+static unsigned long aof_coalesce_bytes = 0;    /* Held back bytes. */
+static unsigned long long aof_coalesce_saved = 0; /* Absorbed bytes. */
+
+static dictType aofCoalesceDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictSdsDestructor           /* val destructor */
+};
+
 /* This function free the old AOF rewrite buffer if needed, and initialize
  * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
  * so can be used for the first initialization as well. */
@@ -73,13 +97,20 @@ void aofRewriteBufferReset(void) {
 
     server.aof_rewrite_buf_blocks = listCreate();
     listSetFreeMethod(server.aof_rewrite_buf_blocks,zfree);
+
+    if (aof_coalesce_index == NULL)
+        aof_coalesce_index = dictCreate(&aofCoalesceDictType,NULL);
+    else
+        dictEmpty(aof_coalesce_index,NULL);
+    aof_coalesce_bytes = 0;
+    aof_coalesce_saved = 0;
 }
 
 /* Return the current size of the AOF rewrite buffer. */
 unsigned long aofRewriteBufferSize(void) {
     listNode *ln;
     listIter li;
-    unsigned long size = 0;
+    unsigned long size = aof_coalesce_bytes;
 
     listRewind(server.aof_rewrite_buf_blocks,&li);
     while((ln = listNext(&li))) {
@@ -168,6 +199,96 @@ void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
     }
 }
 
+/* Splice into the blocks the record held back for 'key', if any. */
+static void aofRewriteBufferFlushCoalescedKey(sds key) {
+    dictEntry *de;
+
+    if ((de = dictFind(aof_coalesce_index,key)) == NULL) return;
+    sds rec = dictGetVal(de);
+    aofRewriteBufferAppend((unsigned char*)rec,sdslen(rec));
+    aof_coalesce_bytes -= sdslen(rec);
+    dictDelete(aof_coalesce_index,key);
+}
+
+/* Splice into the blocks every held back record. The records target
+ * distinct keys and were each the latest write of their own key, so they
+ * commute: any order is correct. */
+static void aofRewriteBufferFlushCoalesced(void) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (aof_coalesce_index == NULL || dictSize(aof_coalesce_index) == 0)
+        return;
+    di = dictGetIterator(aof_coalesce_index);
+    while ((de = dictNext(di)) != NULL) {
+        sds rec = dictGetVal(de);
+        aofRewriteBufferAppend((unsigned char*)rec,sdslen(rec));
+    }
+    dictReleaseIterator(di);
+    dictEmpty(aof_coalesce_index,NULL);
+    aof_coalesce_bytes = 0;
+}
+
+/* Feed one serialized command to the rewrite buffer, holding it back in
+ * the coalescing index when possible (see the comment above
+ * AOF_RW_COALESCE_MAX_KEYS). 'had_select' tells that 's' carries a
+ * SELECT prefix: such records are barriers, since every held back record
+ * was serialized against the previously selected DB. */
+static void aofRewriteBufferFeedCommand(struct redisCommand *cmd, robj **argv,
+                                        int argc, int had_select,
+                                        unsigned char *s, unsigned long len)
+{
+    if (had_select) {
+        aofRewriteBufferFlushCoalesced();
+        aofRewriteBufferAppend(s,len);
+        return;
+    }
+
+    /* Full single key overwrites: the whole serialized record (including
+     * the PEXPIREAT the SETEX/PSETEX/SET EX translation may have added)
+     * determines the final state of the key no matter what was buffered
+     * before, so it absorbs the previously held back record. Note that
+     * a multi key DEL is not eligible: it could not be dropped later
+     * without losing the deletion of its other keys. */
+    if (cmd->proc == setCommand || cmd->proc == setexCommand ||
+        cmd->proc == psetexCommand ||
+        ((cmd->proc == delCommand || cmd->proc == unlinkCommand) &&
+         argc == 2))
+    {
+        robj *key = getDecodedObject(argv[1]);
+        dictEntry *de = dictFind(aof_coalesce_index,key->ptr);
+
+        if (de) {
+            sds old = dictGetVal(de);
+            aof_coalesce_bytes -= sdslen(old);
+            aof_coalesce_saved += sdslen(old);
+            sdsfree(old);
+            dictSetVal(aof_coalesce_index,de,sdsnewlen(s,len));
+        } else {
+            if (dictSize(aof_coalesce_index) >= AOF_RW_COALESCE_MAX_KEYS)
+                aofRewriteBufferFlushCoalesced();
+            dictAdd(aof_coalesce_index,sdsdup(key->ptr),sdsnewlen(s,len));
+        }
+        aof_coalesce_bytes += len;
+        decrRefCount(key);
+        return;
+    }
+
+    /* Everything else goes straight to the blocks, but first the held
+     * back records it must be ordered after are spliced in: just the one
+     * of the touched key for single key commands, all of them when the
+     * command table can't tell the keys apart (multi key commands,
+     * FLUSHALL, MULTI/EXEC, ...). */
+    if (cmd->firstkey == 1 && cmd->lastkey == 1) {
+        robj *key = getDecodedObject(argv[1]);
+        aofRewriteBufferFlushCoalescedKey(key->ptr);
+        decrRefCount(key);
+    } else {
+        aofRewriteBufferFlushCoalesced();
+    }
+    aofRewriteBufferAppend(s,len);
+}
+
 /* Write the buffer (possibly composed of multiple blocks) into the specified
  * fd. If a short write or any other error happens -1 is returned,
  * otherwise the number of bytes written is returned. */
@@ -176,6 +297,13 @@ ssize_t aofRewriteBufferWrite(int fd) {
     listIter li;
     ssize_t count = 0;
 
+    aofRewriteBufferFlushCoalesced();
+    if (aof_coalesce_saved) {
+        serverLog(LL_NOTICE,
+            "AOF rewrite buffer coalescing absorbed %.2f MB of overwritten "
+            "commands", (double)aof_coalesce_saved/(1024*1024));
+    }
+
     listRewind(server.aof_rewrite_buf_blocks,&li);
     while((ln = listNext(&li))) {
         aofrwblock *block = listNodeValue(ln);
@@ -209,6 +337,107 @@ void aof_background_fsync(int fd) {
     bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,NULL,NULL);
 }
 
+/* ----------------------------------------------------------------------------
+ * Background AOF writes (aof-async-write)
+ *
+ * With aof-async-write enabled the accumulated AOF buffer is handed to a
+ * bio thread that performs both the write and, when due, the fsync after
+ * it, so the main thread never blocks on AOF I/O even when the kernel
+ * throttles dirty pages. The state below is shared with the bio thread and
+ * protected by aof_bio_mutex: after a failed write the bio thread stops
+ * touching the file and accumulates every buffer it receives in
+ * aof_bio_rescue_buf, preserving the append order, until the main thread
+ * folds the rescued data back into server.aof_buf and retries the write
+ * synchronously with the usual error handling.
+ * ------------------------------------------------------------------------- */
+static pthread_mutex_t aof_bio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int aof_bio_write_status = C_OK;
+static int aof_bio_write_errno = 0;
+static sds aof_bio_rescue_buf = NULL;
+
+ssize_t aofWrite(int fd, const char *buf, size_t len);
+
+/* Perform an AOF write, and the fsync after it if 'dofsync' is true, from
+ * a bio thread. Takes the ownership of 'buf'. */
+void aofWriteFromBioThread(int fd, sds buf, int dofsync) {
+    ssize_t nwritten;
+
+    pthread_mutex_lock(&aof_bio_mutex);
+    if (aof_bio_write_status == C_ERR) {
+        /* A previous background write failed and the main thread did not
+         * yet recover the data: writing now would create a hole in the
+         * file, so just keep the buffer aside, in order. */
+        if (aof_bio_rescue_buf) {
+            aof_bio_rescue_buf = sdscatsds(aof_bio_rescue_buf,buf);
+            sdsfree(buf);
+        } else {
+            aof_bio_rescue_buf = buf;
+        }
+        pthread_mutex_unlock(&aof_bio_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&aof_bio_mutex);
+
+    nwritten = aofWrite(fd,buf,sdslen(buf));
+    if (nwritten != (ssize_t)sdslen(buf)) {
+        /* Keep the part that did not reach the file for the main thread
+         * to retry, and stop performing writes until it does. */
+        size_t written = nwritten > 0 ? (size_t)nwritten : 0;
+        pthread_mutex_lock(&aof_bio_mutex);
+        aof_bio_write_status = C_ERR;
+        aof_bio_write_errno = nwritten == -1 ? errno : ENOSPC;
+        aof_bio_rescue_buf = sdsnewlen(buf+written,sdslen(buf)-written);
+        pthread_mutex_unlock(&aof_bio_mutex);
+        sdsfree(buf);
+        return;
+    }
+    sdsfree(buf);
+    if (dofsync) redis_fsync(fd);
+}
+
+/* Check if the bio thread reported a failed background AOF write and, if
+ * so, fold the rescued (unwritten) data back in front of the AOF buffer so
+ * that the synchronous path can retry it, and put the AOF in write error
+ * state. Returns 1 when an error was collected. Main thread only. */
+int aofCollectBackgroundWriteError(void) {
+    int collected = 0;
+
+    pthread_mutex_lock(&aof_bio_mutex);
+    if (aof_bio_write_status == C_ERR) {
+        collected = 1;
+        server.aof_last_write_errno = aof_bio_write_errno;
+        if (aof_bio_rescue_buf) {
+            /* The rescued bytes never reached the file: prepend them to
+             * the current buffer and discount them from the file size. */
+            server.aof_current_size -= sdslen(aof_bio_rescue_buf);
+            aof_bio_rescue_buf = sdscatsds(aof_bio_rescue_buf,server.aof_buf);
+            sdsfree(server.aof_buf);
+            server.aof_buf = aof_bio_rescue_buf;
+            aof_bio_rescue_buf = NULL;
+        }
+        aof_bio_write_status = C_OK; /* The main thread took over. */
+    }
+    pthread_mutex_unlock(&aof_bio_mutex);
+
+    if (collected) {
+        server.aof_last_write_status = C_ERR;
+        serverLog(LL_WARNING,
+            "Background AOF write failed: %s. The unwritten data was "
+            "recovered and will be retried by the main thread.",
+            strerror(server.aof_last_write_errno));
+    }
+    return collected;
+}
+
+/* Wait for the completion of every pending background AOF write. Must be
+ * called before any operation that needs the on-disk content or the file
+ * offset to be up to date: synchronous writes, fsync(), ftruncate(), or
+ * closing / replacing the AOF file descriptor. */
+void aofDrainBackgroundWrites(void) {
+    while (bioPendingJobsOfType(BIO_AOF_WRITE))
+        bioWaitStepOfType(BIO_AOF_WRITE);
+}
+
 /* Kills an AOFRW child process if exists */
 void killAppendOnlyChild(void) {
     int statloc;
@@ -243,6 +472,7 @@ void stopAppendOnly(void) {
     server.aof_selected_db = -1;
     server.aof_state = AOF_OFF;
     killAppendOnlyChild();
+    aofNoForkRewriteAbort();
 }
 
 /* Called when the user switches from "appendonly no" to "appendonly yes"
@@ -358,6 +588,43 @@ void flushAppendOnlyFile(int force) {
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
         sync_in_progress = aofFsyncInProgress();
 
+    /* Note: aof_bio_write_status is read without the mutex just as a hint:
+     * when async writes are off and the queue is drained the bio thread is
+     * not touching it. */
+    if (server.aof_async_write || bioPendingJobsOfType(BIO_AOF_WRITE) ||
+        aof_bio_write_status == C_ERR)
+    {
+        if (server.aof_async_write && server.aof_fsync != AOF_FSYNC_ALWAYS &&
+            !force && server.aof_last_write_status == C_OK &&
+            !aofCollectBackgroundWriteError())
+        {
+            /* Hand the buffer to the bio thread, together with the fsync
+             * to perform after the write when the policy requires one:
+             * both happen there in order and the event loop never blocks
+             * on the disk. */
+            int dofsync = server.aof_fsync == AOF_FSYNC_EVERYSEC &&
+                          server.unixtime > server.aof_last_fsync &&
+                          !(server.aof_no_fsync_on_rewrite &&
+                            hasActiveChildProcess());
+            server.aof_current_size += sdslen(server.aof_buf);
+            bioCreateBackgroundJob(BIO_AOF_WRITE,
+                (void*)(long)server.aof_fd,server.aof_buf,
+                (void*)(long)dofsync);
+            server.aof_buf = sdsempty();
+            server.aof_flush_postponed_start = 0;
+            if (dofsync) {
+                server.aof_fsync_offset = server.aof_current_size;
+                server.aof_last_fsync = server.unixtime;
+            }
+            return;
+        }
+        /* Forced flush, 'always' fsync policy, or a background write
+         * error: take the synchronous path below, after waiting for the
+         * queued writes so that the file keeps the append order. */
+        aofDrainBackgroundWrites();
+        aofCollectBackgroundWriteError();
+    }
+
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC && !force) {
         /* With this append fsync policy we do background fsyncing.
          * If the fsync is still in progress we can try to delay
@@ -583,6 +850,7 @@ sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, r
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
     sds buf = sdsempty();
     robj *tmpargv[3];
+    int had_select = 0;
 
     /* The DB this command was targeting is not the same as the last command
      * we appended. To issue a SELECT command is needed. */
@@ -593,6 +861,7 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
         buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
             (unsigned long)strlen(seldb),seldb);
         server.aof_selected_db = dictid;
+        had_select = 1;
     }
 
     if (cmd->proc == expireCommand || cmd->proc == pexpireCommand ||
@@ -639,9 +908,12 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
     /* If a background append only file rewriting is in progress we want to
      * accumulate the differences between the child DB and the current one
      * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+     * can append the differences to the new append only file. The same
+     * buffer accumulates the tail of mutations spliced at the end of a
+     * forkless rewrite. */
+    if (server.aof_child_pid != -1 || aofNoForkRewriteInProgress())
+        aofRewriteBufferFeedCommand(cmd,argv,argc,had_select,
+                                    (unsigned char*)buf,sdslen(buf));
 
     sdsfree(buf);
 }
@@ -698,6 +970,88 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
+/* The AOF is replayed parsing commands in place from a big buffer refilled
+ * with large reads, instead of calling fgets()/fread() a few times for every
+ * single command: with the stdio per-call overhead gone, parsing is no
+ * longer a visible cost when loading large files. */
+#define AOF_LOAD_CHUNK_SIZE (1024*1024)
+
+/* Outcome of the buffered readers below. */
+#define AOF_LOAD_OK 1
+#define AOF_LOAD_EOF 0      /* Clean end of file, no pending bytes. */
+#define AOF_LOAD_SHORT -1   /* Truncated data or read error. */
+
+typedef struct aofLoadBuffer {
+    FILE *fp;       /* Underlying AOF file. */
+    char *buf;      /* AOF_LOAD_CHUNK_SIZE bytes of read buffer. */
+    size_t len;     /* Valid bytes inside buf. */
+    size_t pos;     /* Consumed bytes inside buf. */
+    off_t base;     /* File offset corresponding to buf[0]. */
+    int eof;        /* True once the underlying file hit EOF. */
+} aofLoadBuffer;
+
+/* Discard the consumed prefix of the buffer and read more data from the
+ * file. Returns the number of new bytes read, 0 on end of file or full
+ * buffer, -1 on read error. */
+static ssize_t aofLoadBufferFill(aofLoadBuffer *b) {
+    size_t nread, space;
+
+    if (b->pos) {
+        memmove(b->buf,b->buf+b->pos,b->len-b->pos);
+        b->base += b->pos;
+        b->len -= b->pos;
+        b->pos = 0;
+    }
+    space = AOF_LOAD_CHUNK_SIZE - b->len;
+    if (b->eof || space == 0) return 0;
+    nread = fread(b->buf+b->len,1,space,b->fp);
+    if (nread == 0) {
+        if (ferror(b->fp)) return -1;
+        b->eof = 1;
+    }
+    b->len += nread;
+    return nread;
+}
+
+/* Consume a newline terminated line, returning it NUL terminated (the
+ * newline itself is overwritten). The returned pointer is only valid up to
+ * the next read from the buffer. */
+static int aofLoadBufferLine(aofLoadBuffer *b, char **line, size_t *linelen) {
+    while(1) {
+        char *nl = memchr(b->buf+b->pos,'\n',b->len-b->pos);
+        if (nl) {
+            *line = b->buf+b->pos;
+            *linelen = nl - *line;
+            *nl = '\0';
+            b->pos = (nl-b->buf)+1;
+            return AOF_LOAD_OK;
+        }
+        if (b->eof)
+            return (b->len - b->pos) ? AOF_LOAD_SHORT : AOF_LOAD_EOF;
+        if (b->len - b->pos == AOF_LOAD_CHUNK_SIZE)
+            return AOF_LOAD_SHORT; /* Line longer than the whole buffer. */
+        if (aofLoadBufferFill(b) == -1) return AOF_LOAD_SHORT;
+    }
+}
+
+/* Copy 'len' bytes of bulk payload into 'dst', refilling as needed: bulks
+ * larger than the read buffer are copied chunk by chunk. */
+static int aofLoadBufferCopy(aofLoadBuffer *b, char *dst, unsigned long len) {
+    while (len) {
+        size_t avail = b->len - b->pos, n;
+        if (avail == 0) {
+            if (b->eof || aofLoadBufferFill(b) == -1) return AOF_LOAD_SHORT;
+            continue;
+        }
+        n = (avail < len) ? avail : len;
+        memcpy(dst,b->buf+b->pos,n);
+        dst += n;
+        b->pos += n;
+        len -= n;
+    }
+    return AOF_LOAD_OK;
+}
+
 /* Replay the append log file. On success C_OK is returned. On non fatal
  * error (the append only file is zero-length) C_ERR is returned. On
  * fatal error an error message is logged and the program exists. */
@@ -709,6 +1063,9 @@ int loadAppendOnlyFile(char *filename) {
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of latest well-formed command loaded. */
     off_t valid_before_multi = 0; /* Offset before MULTI command loaded. */
+    aofLoadBuffer rb = {NULL,NULL,0,0,0,0};
+    robj **argv = NULL; /* Reusable argv vector, see the loop below. */
+    int argv_size = 0;
 
     if (fp == NULL) {
         serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
@@ -754,56 +1111,64 @@ int loadAppendOnlyFile(char *filename) {
         }
     }
 
-    /* Read the actual AOF file, in REPL format, command by command. */
+    /* Read the actual AOF file, in REPL format, command by command. The
+     * commands are parsed in place from large buffered reads, and the argv
+     * vector is reused across commands whenever possible. */
+    rb.fp = fp;
+    rb.buf = zmalloc(AOF_LOAD_CHUNK_SIZE);
+    rb.base = ftello(fp); /* Account for a possible RDB preamble. */
     while(1) {
-        int argc, j;
+        int argc, j, res;
         unsigned long len;
-        robj **argv;
-        char buf[128];
+        char *line, crlf[2];
+        size_t linelen;
         sds argsds;
         struct redisCommand *cmd;
 
         /* Serve the clients from time to time */
         if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
+            loadingProgress(rb.base+rb.pos);
             processEventsWhileBlocked();
             processModuleLoadingProgressEvent(1);
         }
 
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
-            if (feof(fp))
-                break;
-            else
-                goto readerr;
-        }
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        argc = atoi(buf+1);
+        res = aofLoadBufferLine(&rb,&line,&linelen);
+        if (res == AOF_LOAD_EOF) break;
+        if (res == AOF_LOAD_SHORT) goto readerr;
+        if (line[0] != '*') goto fmterr;
+        if (linelen < 2) goto readerr;
+        argc = atoi(line+1);
         if (argc < 1) goto fmterr;
 
-        argv = zmalloc(sizeof(robj*)*argc);
+        if (argc > argv_size) {
+            argv = zrealloc(argv,sizeof(robj*)*argc);
+            argv_size = argc;
+        }
         fakeClient->argc = argc;
         fakeClient->argv = argv;
 
         for (j = 0; j < argc; j++) {
-            if (fgets(buf,sizeof(buf),fp) == NULL) {
+            if (aofLoadBufferLine(&rb,&line,&linelen) != AOF_LOAD_OK) {
                 fakeClient->argc = j; /* Free up to j-1. */
                 freeFakeClientArgv(fakeClient);
+                argv = NULL;
                 goto readerr;
             }
-            if (buf[0] != '$') goto fmterr;
-            len = strtol(buf+1,NULL,10);
+            if (line[0] != '$') goto fmterr;
+            len = strtol(line+1,NULL,10);
             argsds = sdsnewlen(SDS_NOINIT,len);
-            if (len && fread(argsds,len,1,fp) == 0) {
+            if (aofLoadBufferCopy(&rb,argsds,len) != AOF_LOAD_OK) {
                 sdsfree(argsds);
                 fakeClient->argc = j; /* Free up to j-1. */
                 freeFakeClientArgv(fakeClient);
+                argv = NULL;
                 goto readerr;
             }
             argv[j] = createObject(OBJ_STRING,argsds);
-            if (fread(buf,2,1,fp) == 0) {
+            if (aofLoadBufferCopy(&rb,crlf,2) != AOF_LOAD_OK) {
                 fakeClient->argc = j+1; /* Free up to j. */
                 freeFakeClientArgv(fakeClient);
+                argv = NULL;
                 goto readerr; /* discard CRLF */
             }
         }
@@ -836,11 +1201,22 @@ int loadAppendOnlyFile(char *filename) {
         /* The fake client should never get blocked */
         serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
 
-        /* Clean up. Command code may have changed argv/argc so we use the
-         * argv/argc of the client instead of the local variables. */
-        freeFakeClientArgv(fakeClient);
+        /* Clean up. Command code may have changed argv/argc
+         * (rewriteClientCommandVector() frees the original vector): in that
+         * case release the replacement and reallocate next iteration,
+         * otherwise just release the objects and keep the vector. */
+        if (fakeClient->argv == argv) {
+            for (j = 0; j < fakeClient->argc; j++)
+                decrRefCount(argv[j]);
+        } else {
+            freeFakeClientArgv(fakeClient);
+            argv = NULL;
+            argv_size = 0;
+        }
+        fakeClient->argv = NULL;
+        fakeClient->argc = 0;
         fakeClient->cmd = NULL;
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
+        if (server.aof_load_truncated) valid_up_to = rb.base+rb.pos;
         if (server.key_load_delay)
             usleep(server.key_load_delay);
     }
@@ -859,6 +1235,8 @@ int loadAppendOnlyFile(char *filename) {
 loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
     fclose(fp);
     freeFakeClient(fakeClient);
+    zfree(argv);
+    zfree(rb.buf);
     server.aof_state = old_aof_state;
     stopLoading(1);
     aofUpdateCurrentSize();
@@ -1015,7 +1393,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1023,13 +1401,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1086,12 +1464,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1298,8 +1676,126 @@ ssize_t aofReadDiffFromParent(void) {
     return total;
 }
 
+/* Emit one HPEXPIREAT <key> <ms> FIELDS 1 <field> command for every
+ * (field,deadline) pair in the hash field expires listpack 'lp' of the
+ * hash 'key'. Returns C_OK on success, C_ERR on write error. */
+static int rewriteHashFieldExpires(rio *aof, robj *key, unsigned char *lp) {
+    unsigned char *p = lpFirst(lp);
+    while (p) {
+        unsigned char *vstr, intbuf[LP_INTBUF_SIZE];
+        int64_t vlen;
+        long long when;
+        unsigned char *q = lpNext(lp,p);
+
+        vstr = lpGet(p,&vlen,intbuf);
+        serverAssert(lpGetValue(q,NULL,&when) == NULL);
+        char cmd[]="*6\r\n$10\r\nHPEXPIREAT\r\n";
+        if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) return C_ERR;
+        if (rioWriteBulkObject(aof,key) == 0) return C_ERR;
+        if (rioWriteBulkLongLong(aof,when) == 0) return C_ERR;
+        if (rioWriteBulkString(aof,"FIELDS",6) == 0) return C_ERR;
+        if (rioWriteBulkLongLong(aof,1) == 0) return C_ERR;
+        if (rioWriteBulkString(aof,(char*)vstr,vlen) == 0) return C_ERR;
+        p = lpNext(lp,q);
+    }
+    return C_OK;
+}
+
+/* The RDB preamble of a rewritten AOF does not carry the hash field
+ * expires: append them as plain HPEXPIREAT commands right after the
+ * preamble, so that loading the file restores them. */
+static int rewriteHashExpiresRio(rio *aof) {
+    for (int j = 0; j < server.dbnum; j++) {
+        char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
+        redisDb *db = server.db+j;
+        if (dictSize(db->hexpires) == 0) continue;
+
+        if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) return C_ERR;
+        if (rioWriteBulkLongLong(aof,j) == 0) return C_ERR;
+
+        dictIterator *di = dictGetIterator(db->hexpires);
+        dictEntry *de;
+        while ((de = dictNext(di)) != NULL) {
+            robj key;
+            initStaticStringObject(key,dictGetKey(de));
+            if (rewriteHashFieldExpires(aof,&key,dictGetVal(de)) == C_ERR) {
+                dictReleaseIterator(di);
+                return C_ERR;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+    return C_OK;
+}
+
+/* Write the sequence of commands able to fully rebuild the key 'keystr'
+ * with value 'o' and its expire, if any, into the rio 'aof'. Returns C_OK
+ * on success, C_ERR on write error. */
+int rewriteAppendOnlyFileKey(rio *aof, redisDb *db, sds keystr, robj *o) {
+    robj key;
+    robj *materialized = NULL;
+    long long expiretime;
+
+    initStaticStringObject(key,keystr);
+    expiretime = getExpire(db,&key);
+
+    /* A value still pointing into a memory mapped RDB file must be
+     * deserialized to be rewritten as commands. We work on a temporary
+     * copy, without touching the keyspace: the rewrite may run in a
+     * child process or from the serialization cursor of the no-fork
+     * rewrite, and the entry will be materialized on access as usual. */
+    if (o->encoding == OBJ_ENCODING_LAZY)
+        o = materialized = rdbLazyValueLoad(&key,o);
+
+    /* The same applies to values demoted to the cold tier. */
+    if (o->encoding == OBJ_ENCODING_COLD)
+        o = materialized = coldValueLoad(&key,o);
+
+    /* Save the key and associated value */
+    if (o->type == OBJ_STRING) {
+        /* Emit a SET command */
+        char cmd[]="*3\r\n$3\r\nSET\r\n";
+        if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+        /* Key and value */
+        if (rioWriteBulkObject(aof,&key) == 0) goto werr;
+        if (rioWriteBulkObject(aof,o) == 0) goto werr;
+    } else if (o->type == OBJ_LIST) {
+        if (rewriteListObject(aof,&key,o) == 0) goto werr;
+    } else if (o->type == OBJ_SET) {
+        if (rewriteSetObject(aof,&key,o) == 0) goto werr;
+    } else if (o->type == OBJ_ZSET) {
+        if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
+    } else if (o->type == OBJ_HASH) {
+        if (rewriteHashObject(aof,&key,o) == 0) goto werr;
+    } else if (o->type == OBJ_STREAM) {
+        if (rewriteStreamObject(aof,&key,o) == 0) goto werr;
+    } else if (o->type == OBJ_MODULE) {
+        if (rewriteModuleObject(aof,&key,o) == 0) goto werr;
+    } else {
+        serverPanic("Unknown object type");
+    }
+    /* Save the expire time */
+    if (expiretime != -1) {
+        char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
+        if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+        if (rioWriteBulkObject(aof,&key) == 0) goto werr;
+        if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
+    }
+    /* Save the hash field expire times, if any. */
+    if (o->type == OBJ_HASH) {
+        unsigned char *lp = hashExpiresLookup(db,keystr);
+        if (lp && rewriteHashFieldExpires(aof,&key,lp) == C_ERR) goto werr;
+    }
+    if (materialized) decrRefCount(materialized);
+    return C_OK;
+
+werr:
+    if (materialized) decrRefCount(materialized);
+    return C_ERR;
+}
+
 int rewriteAppendOnlyFileRio(rio *aof) {
-    dictIterator *di = NULL;
+    dbIterator *di = NULL;
     dictEntry *de;
     size_t processed = 0;
     int j;
@@ -1307,69 +1803,35 @@ int rewriteAppendOnlyFileRio(rio *aof) {
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
+        if (dbSize(db) == 0) continue;
+        di = dbGetSafeIterator(db);
 
         /* SELECT the new DB */
         if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
         if (rioWriteBulkLongLong(aof,j) == 0) goto werr;
 
         /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
-            sds keystr;
-            robj key, *o;
-            long long expiretime;
-
-            keystr = dictGetKey(de);
-            o = dictGetVal(de);
-            initStaticStringObject(key,keystr);
-
-            expiretime = getExpire(db,&key);
-
-            /* Save the key and associated value */
-            if (o->type == OBJ_STRING) {
-                /* Emit a SET command */
-                char cmd[]="*3\r\n$3\r\nSET\r\n";
-                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                /* Key and value */
-                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
-                if (rioWriteBulkObject(aof,o) == 0) goto werr;
-            } else if (o->type == OBJ_LIST) {
-                if (rewriteListObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_SET) {
-                if (rewriteSetObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_ZSET) {
-                if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_HASH) {
-                if (rewriteHashObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_STREAM) {
-                if (rewriteStreamObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_MODULE) {
-                if (rewriteModuleObject(aof,&key,o) == 0) goto werr;
-            } else {
-                serverPanic("Unknown object type");
-            }
-            /* Save the expire time */
-            if (expiretime != -1) {
-                char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
-                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
-                if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
-            }
+        while((de = dbIteratorNext(di)) != NULL) {
+            if (rewriteAppendOnlyFileKey(aof,db,dictGetKey(de),
+                                         dictGetVal(de)) == C_ERR)
+                goto werr;
             /* Read some diff from the parent process from time to time. */
             if (aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES) {
                 processed = aof->processed_bytes;
                 aofReadDiffFromParent();
             }
+            /* Periodically report to the parent the copy on write consumed
+             * so far, it is exported in the INFO persistence section. */
+            if (server.in_fork_child)
+                sendChildCOWInfoIfNeeded(CHILD_INFO_TYPE_AOF);
         }
-        dictReleaseIterator(di);
+        dbReleaseIterator(di);
         di = NULL;
     }
     return C_OK;
 
 werr:
-    if (di) dictReleaseIterator(di);
+    if (di) dbReleaseIterator(di);
     return C_ERR;
 }
 
@@ -1409,6 +1871,7 @@ int rewriteAppendOnlyFile(char *filename) {
             errno = error;
             goto werr;
         }
+        if (rewriteHashExpiresRio(&aof) == C_ERR) goto werr;
     } else {
         if (rewriteAppendOnlyFileRio(&aof) == C_ERR) goto werr;
     }
@@ -1576,7 +2039,14 @@ void aofClosePipes(void) {
 int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
 
-    if (hasActiveChildProcess()) return C_ERR;
+    if (hasActiveChildProcess() || aofNoForkRewriteInProgress()) return C_ERR;
+    /* When the forkless mode is enabled and the AOF is active (so that
+     * feedAppendOnlyFile() accumulates the tail of concurrent mutations)
+     * rewrite incrementally in this same process. A one time BGREWRITEAOF
+     * with the AOF disabled still uses the fork, that provides a
+     * consistent snapshot for free. */
+    if (server.aof_rewrite_no_fork && server.aof_state != AOF_OFF)
+        return aofNoForkRewriteStart();
     if (aofCreatePipes() != C_OK) return C_ERR;
     openChildInfoPipe();
     if ((childpid = redisFork()) == 0) {
@@ -1584,6 +2054,7 @@ int rewriteAppendOnlyFileBackground(void) {
 
         /* Child */
         redisSetProcTitle("redis-aof-rewrite");
+        redisSetCpuAffinity(server.aof_rewrite_cpulist);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof", (int) getpid());
         if (rewriteAppendOnlyFile(tmpfile) == C_OK) {
             sendChildCOWInfo(CHILD_INFO_TYPE_AOF, "AOF rewrite");
@@ -1618,7 +2089,7 @@ int rewriteAppendOnlyFileBackground(void) {
 }
 
 void bgrewriteaofCommand(client *c) {
-    if (server.aof_child_pid != -1) {
+    if (server.aof_child_pid != -1 || aofNoForkRewriteInProgress()) {
         addReplyError(c,"Background append only file rewriting already in progress");
     } else if (hasActiveChildProcess()) {
         server.aof_rewrite_scheduled = 1;
@@ -1723,6 +2194,15 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
          * guarantee atomicity for this switch has already happened by then, so
          * we don't care what the outcome or duration of that close operation
          * is, as long as the file descriptor is released again. */
+        /* Make sure no background AOF write is still in flight against the
+         * old descriptor before switching it. Rescued data, if a background
+         * write failed, can be dropped here: the whole diff was accumulated
+         * by the rewrite buffer just flushed to the new file. */
+        if (server.aof_fd != -1) {
+            aofDrainBackgroundWrites();
+            aofCollectBackgroundWriteError();
+        }
+
         if (server.aof_fd == -1) {
             /* AOF disabled */
 
@@ -1811,3 +2291,334 @@ cleanup:
     if (server.aof_state == AOF_WAIT_REWRITE)
         server.aof_rewrite_scheduled = 1;
 }
+
+/* ----------------------------------------------------------------------------
+ * Forkless incremental AOF rewrite
+ *
+ * When aof-rewrite-no-fork is enabled the AOF is rewritten by the main
+ * process itself, a few dictionary buckets at a time from serverCron(),
+ * instead of forking a child. This trades the copy-on-write memory spike
+ * and the fork() latency for a longer, but fully incremental, rewrite.
+ *
+ * The protocol that keeps the rewritten file consistent while clients
+ * keep writing is the following:
+ *
+ * 1. A cursor scan (dbScan) walks each database and appends, for every
+ *    key it visits, the commands able to rebuild it, exactly like the
+ *    fork based rewrite does.
+ * 2. Before a write command executes, every key it is about to touch
+ *    that the scan did not consume yet is serialized with its current
+ *    value and added to a per-database "touched" set, so the scan will
+ *    skip it later.
+ * 3. Every mutation performed while the rewrite is active is also
+ *    accumulated in the usual rewrite buffer and spliced at the end of
+ *    the new file, so replaying "snapshot of each key at first touch"
+ *    followed by the whole tail rebuilds the exact dataset.
+ *
+ * Every dump is preceded by a DEL of the key: the cursor may visit an
+ * element twice while the hash table is rehashing, and the write hook
+ * may serialize a key the scan already emitted, so dumps must be
+ * idempotent. Operations that invalidate the per-database bookkeeping
+ * (MOVE, SWAPDB, flushing or reloading the dataset) abort the rewrite
+ * and schedule a new one. Note that this mode always produces a pure
+ * command stream: aof-use-rdb-preamble cannot be honored because an RDB
+ * snapshot cannot be generated incrementally without a fork.
+ * ------------------------------------------------------------------------- */
+
+/* Max microseconds per serverCron() call spent advancing the scan. */
+#define AOF_NOFORK_CYCLE_TIME_LIMIT 1000
+
+static struct {
+    int active;             /* A forkless rewrite is in progress. */
+    FILE *fp;               /* Temp file receiving the rewritten dataset. */
+    rio aof;                /* rio stream writing to 'fp'. */
+    char tmpfile[256];      /* Name of the temp file, for cleanup. */
+    int scan_db;            /* Database the cursor is currently walking. */
+    unsigned long cursor;   /* dbScan() cursor inside 'scan_db'. */
+    int select_db;          /* DB of the last key dumped, to emit SELECT. */
+    dict **touched;         /* Per-db set of keys serialized by the write
+                               hook: the scan must skip them because the
+                               tail buffer carries their later history. */
+    int werr;               /* A write error occurred: abort at next cycle. */
+} aof_nofork;
+
+int aofNoForkRewriteInProgress(void) {
+    return aof_nofork.active;
+}
+
+/* Release every resource held by the forkless rewrite and mark it as not
+ * active. Does not unlink the temp file: the success path renamed it. */
+static void aofNoForkRewriteCleanup(void) {
+    int j;
+
+    if (aof_nofork.fp) fclose(aof_nofork.fp);
+    aof_nofork.fp = NULL;
+    if (aof_nofork.touched) {
+        for (j = 0; j < server.dbnum; j++)
+            if (aof_nofork.touched[j]) dictRelease(aof_nofork.touched[j]);
+        zfree(aof_nofork.touched);
+        aof_nofork.touched = NULL;
+    }
+    aofRewriteBufferReset();
+    aof_nofork.active = 0;
+    aof_nofork.werr = 0;
+}
+
+/* Abort an in progress forkless rewrite, removing the temporary file.
+ * Callers that need the rewrite to happen anyway should also set
+ * server.aof_rewrite_scheduled. */
+void aofNoForkRewriteAbort(void) {
+    if (!aof_nofork.active) return;
+    serverLog(LL_NOTICE,"Forkless AOF rewrite aborted");
+    aofNoForkRewriteCleanup();
+    unlink(aof_nofork.tmpfile);
+    server.aof_rewrite_time_start = -1;
+    stopSaving(0);
+}
+
+/* Start a forkless rewrite. Returns C_OK on success, C_ERR if the
+ * temporary file can't be created. */
+int aofNoForkRewriteStart(void) {
+    int j;
+
+    serverAssert(!aof_nofork.active);
+    snprintf(aof_nofork.tmpfile,sizeof(aof_nofork.tmpfile),
+        "temp-rewriteaof-nofork-%d.aof",(int)getpid());
+    aof_nofork.fp = fopen(aof_nofork.tmpfile,"w");
+    if (aof_nofork.fp == NULL) {
+        serverLog(LL_WARNING,
+            "Opening the temp file for the forkless AOF rewrite: %s",
+            strerror(errno));
+        return C_ERR;
+    }
+    rioInitWithFile(&aof_nofork.aof,aof_nofork.fp);
+    if (server.aof_rewrite_incremental_fsync)
+        rioSetAutoSync(&aof_nofork.aof,REDIS_AUTOSYNC_BYTES);
+
+    aof_nofork.touched = zcalloc(sizeof(dict*)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++)
+        aof_nofork.touched[j] = dictCreate(&setDictType,NULL);
+    aof_nofork.scan_db = 0;
+    aof_nofork.cursor = 0;
+    aof_nofork.select_db = -1;
+    aof_nofork.werr = 0;
+    aof_nofork.active = 1;
+
+    /* The tail accumulated in the rewrite buffer is appended after dumps
+     * possibly targeting other databases: force it to start with an
+     * explicit SELECT so the merge is safe. */
+    aofRewriteBufferReset();
+    server.aof_selected_db = -1;
+    replicationScriptCacheFlush();
+    server.aof_rewrite_scheduled = 0;
+    server.aof_rewrite_time_start = time(NULL);
+    startSaving(RDBFLAGS_AOF_PREAMBLE);
+    serverLog(LL_NOTICE,"Forkless incremental AOF rewrite started");
+    return C_OK;
+}
+
+/* Append to the rewrite file the commands able to rebuild 'keystr', with
+ * a SELECT if the last dump targeted a different DB and a DEL making the
+ * dump idempotent. On error the 'werr' flag is raised so that the next
+ * cycle aborts the rewrite. */
+static int aofNoForkDumpKey(redisDb *db, sds keystr, robj *o) {
+    rio *aof = &aof_nofork.aof;
+    robj key;
+
+    if (aof_nofork.werr) return C_ERR;
+    if (db->id != aof_nofork.select_db) {
+        char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
+        if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
+        if (rioWriteBulkLongLong(aof,db->id) == 0) goto werr;
+        aof_nofork.select_db = db->id;
+    }
+    char delcmd[] = "*2\r\n$3\r\nDEL\r\n";
+    if (rioWrite(aof,delcmd,sizeof(delcmd)-1) == 0) goto werr;
+    initStaticStringObject(key,keystr);
+    if (rioWriteBulkObject(aof,&key) == 0) goto werr;
+    if (rewriteAppendOnlyFileKey(aof,db,keystr,o) == C_ERR) goto werr;
+    return C_OK;
+
+werr:
+    serverLog(LL_WARNING,
+        "Error writing the forkless AOF rewrite temp file: %s",
+        strerror(errno));
+    aof_nofork.werr = 1;
+    return C_ERR;
+}
+
+/* Called by call() before a write command executes while a forkless
+ * rewrite is active: serialize the current value of every key the
+ * command is about to touch, unless the scan already consumed the key's
+ * database or the key was serialized before. From this point on the
+ * key's history lives in the tail buffer. */
+void aofNoForkRewriteBeforeCommand(client *c) {
+    int numkeys = 0, j;
+    int *keyindex;
+
+    if (!aof_nofork.active) return;
+
+    /* Commands that move keys across databases would invalidate the
+     * per-database bookkeeping: restart the rewrite from scratch. */
+    if (c->cmd->proc == moveCommand || c->cmd->proc == swapdbCommand) {
+        serverLog(LL_NOTICE,
+            "MOVE or SWAPDB during a forkless AOF rewrite: the rewrite "
+            "will be restarted");
+        aofNoForkRewriteAbort();
+        server.aof_rewrite_scheduled = 1;
+        return;
+    }
+
+    /* Databases the scan completed are fully covered by the tail. */
+    if (c->db->id < aof_nofork.scan_db) return;
+
+    keyindex = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+    for (j = 0; j < numkeys; j++) {
+        sds keystr = c->argv[keyindex[j]]->ptr;
+        dict *touched = aof_nofork.touched[c->db->id];
+        dictEntry *de;
+
+        if (dictFind(touched,keystr) != NULL) continue;
+        serverAssert(dictAdd(touched,sdsdup(keystr),NULL) == DICT_OK);
+        de = dictFind(dbGetDict(c->db,keystr),keystr);
+        /* Keys the command is about to create are fully described by the
+         * tail, nothing to serialize. */
+        if (de == NULL) continue;
+        if (aofNoForkDumpKey(c->db,dictGetKey(de),dictGetVal(de)) == C_ERR)
+            break;
+    }
+    getKeysFreeResult(keyindex);
+}
+
+/* dbScan() callback for the rewrite cursor. */
+static void aofNoForkScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    sds keystr = dictGetKey(de);
+
+    if (aof_nofork.werr) return;
+    if (dictFind(aof_nofork.touched[db->id],keystr) != NULL) return;
+    aofNoForkDumpKey(db,keystr,dictGetVal(de));
+}
+
+/* Every database was scanned: splice the tail of mutations accumulated
+ * while the scan was running, then install the new file exactly like
+ * backgroundRewriteDoneHandler() does for the fork based rewrite. */
+static void aofNoForkRewriteFinalize(void) {
+    int newfd, oldfd;
+    mstime_t latency;
+
+    serverAssert(server.aof_fd != -1);
+    if (fflush(aof_nofork.fp) == EOF) goto werr;
+
+    latencyStartMonitor(latency);
+    if (aofRewriteBufferWrite(fileno(aof_nofork.fp)) == -1) goto werr;
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("aof-rewrite-diff-write",latency);
+    serverLog(LL_NOTICE,
+        "Concatenated %.2f MB of writes accumulated during the forkless "
+        "AOF rewrite", (double) aofRewriteBufferSize() / (1024*1024));
+
+    if (fsync(fileno(aof_nofork.fp)) == -1) goto werr;
+    if (fclose(aof_nofork.fp) == EOF) {
+        aof_nofork.fp = NULL;
+        goto werr;
+    }
+    aof_nofork.fp = NULL;
+
+    newfd = open(aof_nofork.tmpfile,O_WRONLY|O_APPEND);
+    if (newfd == -1) goto werr;
+
+    /* Make sure no background AOF write is still in flight against the
+     * old descriptor before replacing it. Rescued data, if a background
+     * write failed, can be dropped: the rewrite buffer covered every
+     * mutation performed since the rewrite started. */
+    aofDrainBackgroundWrites();
+    aofCollectBackgroundWriteError();
+
+    /* Rename the temporary file and switch the descriptor used for AOF
+     * writes, closing the overwritten file in a background thread (see
+     * backgroundRewriteDoneHandler for the rationale). */
+    latencyStartMonitor(latency);
+    if (rename(aof_nofork.tmpfile,server.aof_filename) == -1) {
+        serverLog(LL_WARNING,
+            "Error trying to rename the temporary AOF file %s into %s: %s",
+            aof_nofork.tmpfile, server.aof_filename, strerror(errno));
+        close(newfd);
+        goto werr;
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("aof-rename",latency);
+
+    oldfd = server.aof_fd;
+    server.aof_fd = newfd;
+    if (server.aof_fsync == AOF_FSYNC_ALWAYS)
+        redis_fsync(newfd);
+    else if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
+        aof_background_fsync(newfd);
+    server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    server.aof_fsync_offset = server.aof_current_size;
+
+    /* Clear regular AOF buffer since its contents was just written to
+     * the new AOF from the rewrite buffer. */
+    sdsfree(server.aof_buf);
+    server.aof_buf = sdsempty();
+
+    server.aof_lastbgrewrite_status = C_OK;
+    if (server.aof_state == AOF_WAIT_REWRITE)
+        server.aof_state = AOF_ON;
+    bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,NULL,NULL);
+
+    server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
+    server.aof_rewrite_time_start = -1;
+    aofNoForkRewriteCleanup();
+    stopSaving(1);
+    serverLog(LL_NOTICE, "Forkless AOF rewrite finished successfully");
+    return;
+
+werr:
+    serverLog(LL_WARNING,
+        "Error finalizing the forkless AOF rewrite: %s", strerror(errno));
+    server.aof_lastbgrewrite_status = C_ERR;
+    server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
+    aofNoForkRewriteAbort();
+}
+
+/* Advance the forkless rewrite from serverCron(): walk the keyspace with
+ * dbScan() for at most AOF_NOFORK_CYCLE_TIME_LIMIT microseconds per
+ * call, and finalize the rewrite once every database was visited. */
+void aofNoForkRewriteCycle(void) {
+    long long start = ustime();
+    int iterations = 0;
+
+    if (!aof_nofork.active) return;
+
+    while (aof_nofork.scan_db < server.dbnum) {
+        redisDb *db = server.db+aof_nofork.scan_db;
+
+        do {
+            aof_nofork.cursor = dbScan(db,aof_nofork.cursor,
+                                       aofNoForkScanCallback,NULL,db);
+            if (aof_nofork.werr) {
+                server.aof_lastbgrewrite_status = C_ERR;
+                server.aof_rewrite_time_last =
+                    time(NULL)-server.aof_rewrite_time_start;
+                aofNoForkRewriteAbort();
+                return;
+            }
+            if (++iterations > 16) {
+                if (ustime()-start > AOF_NOFORK_CYCLE_TIME_LIMIT) return;
+                iterations = 0;
+            }
+        } while (aof_nofork.cursor != 0);
+
+        /* This database is fully written: from now on the tail buffer
+         * alone covers every change, the touched set is not needed. */
+        dictRelease(aof_nofork.touched[aof_nofork.scan_db]);
+        aof_nofork.touched[aof_nofork.scan_db] = NULL;
+        aof_nofork.scan_db++;
+        aof_nofork.cursor = 0;
+    }
+    aofNoForkRewriteFinalize();
+}
@@ -0,0 +1,476 @@
+/* audit.c -- Shared binary ring of executed commands.
+ *
+ * MONITOR used to format a fresh human readable string for every command
+ * and every attached monitor, in the command execution path: a single
+ * monitor was enough to cut the throughput of a loaded server by a large
+ * factor. Here the command execution path instead appends every command
+ * ONCE, in a compact binary form, to a ring of reference counted chunks
+ * (same design as the shared replication buffer), and the consumers drain
+ * the ring at their own pace, turning the binary records into text only
+ * at consumption time:
+ *
+ * - Every MONITOR client is a consumer, served from beforeSleep().
+ * - If the "audit-log" directive is set, a file writer consumer slices
+ *   the pending binary bytes and hands them to the BIO_AUDIT_WRITE
+ *   thread, that does the formatting and the write(2) calls, so an
+ *   always-on command audit costs the command path just the binary
+ *   append.
+ *
+ * When nobody consumes (no monitors, no audit file) the feed function is
+ * a single test and a return.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bio.h"
+
+#include <sys/time.h>
+#include <fcntl.h>
+
+/* Usual size of a ring chunk. A record larger than this gets a chunk of
+ * its own: records are never split across chunks, so that a consumer can
+ * always parse a whole record with a single pointer into the chunk. */
+#define AUDIT_BLOCK_SIZE (16*1024)
+
+/* Where the command came from, for the "[<db> <source>]" part of the
+ * formatted line. */
+#define AUDIT_ORIGIN_PEER 0     /* TCP client, source is the peer id. */
+#define AUDIT_ORIGIN_LUA 1      /* Lua script, no source string. */
+#define AUDIT_ORIGIN_UNIX 2     /* Unix socket, source is its path. */
+
+/* Binary record layout, everything in host byte order since the records
+ * never leave the process:
+ *
+ * [u32 reclen][i64 usec][i32 dictid][u8 origin][u32 srclen][src bytes]
+ * [u32 argc] then for every argument [u32 len][bytes]
+ *
+ * 'reclen' is the total record length, header included, so a consumer
+ * skips to the next record without parsing the arguments. */
+
+typedef struct auditBlock {
+    int refcount;           /* Consumers whose cursor is inside this
+                               chunk. Chunks are freed from the head of
+                               the ring when it drops to zero. */
+    size_t size, used;
+    char buf[];
+} auditBlock;
+
+/* A consumer is a cursor into the ring. 'node' is NULL only while the
+ * ring is empty: the cursor is attached to the first record appended
+ * after the consumer registered, so nobody sees commands executed before
+ * it joined (the historical MONITOR behavior). */
+typedef struct auditConsumer {
+    client *c;              /* Monitor client, or NULL for the audit file
+                               writer. */
+    listNode *node;         /* Ring chunk the cursor is in. */
+    size_t pos;             /* Offset of the next record in the chunk. */
+} auditConsumer;
+
+static list *audit_blocks = NULL;       /* Ring of auditBlock chunks. */
+static list *audit_consumers = NULL;    /* List of auditConsumer. */
+static int audit_unattached = 0;        /* Consumers with a NULL cursor. */
+static size_t audit_mem = 0;            /* Total ring allocation. */
+static int audit_fd = -1;               /* Audit file, or -1. */
+static long long audit_dropped = 0;     /* Bytes evicted before the file
+                                           writer could consume them. */
+
+/* ----------------------------- Ring feeding ------------------------------ */
+
+/* True if appending to the ring would reach somebody: the guard the
+ * command execution path tests before paying for the serialization. */
+int auditEnabled(void) {
+    return audit_consumers && listLength(audit_consumers) != 0;
+}
+
+static void auditPutU32(char **p, uint32_t v) {
+    memcpy(*p,&v,sizeof(v)); *p += sizeof(v);
+}
+
+/* Return the tail chunk with at least 'needed' free bytes, appending a
+ * new chunk to the ring if the current tail is too full. */
+static auditBlock *auditGetTailBlock(size_t needed) {
+    listNode *tail = listLast(audit_blocks);
+    auditBlock *b = tail ? listNodeValue(tail) : NULL;
+
+    if (b == NULL || b->size - b->used < needed) {
+        size_t size = needed > AUDIT_BLOCK_SIZE ? needed : AUDIT_BLOCK_SIZE;
+        b = zmalloc(sizeof(auditBlock)+size);
+        b->refcount = 0;
+        b->size = size;
+        b->used = 0;
+        listAddNodeTail(audit_blocks,b);
+        audit_mem += sizeof(auditBlock)+size;
+    }
+    return b;
+}
+
+/* If the ring outgrew audit-buffer-limit, evict chunks from the head:
+ * monitors still referencing an evicted chunk are too slow to keep up
+ * and get disconnected (as a slow monitor always was, just by the output
+ * buffer limits instead), while the file writer cursor jumps forward and
+ * the skipped bytes are accounted as dropped. */
+static void auditEnforceMemoryLimit(void) {
+    static time_t last_warning = 0;
+
+    while (audit_mem > server.audit_buffer_limit &&
+           listLength(audit_blocks) > 1)
+    {
+        listNode *head = listFirst(audit_blocks);
+        auditBlock *b = listNodeValue(head);
+
+        if (b->refcount) {
+            listIter li;
+            listNode *ln;
+            listRewind(audit_consumers,&li);
+            while ((ln = listNext(&li))) {
+                auditConsumer *ac = listNodeValue(ln);
+                if (ac->node != head) continue;
+                b->refcount--;
+                if (ac->c) {
+                    freeClientAsync(ac->c);
+                    listDelNode(audit_consumers,ln);
+                    zfree(ac);
+                } else {
+                    audit_dropped += b->used - ac->pos;
+                    ac->node = listNextNode(head);
+                    ac->pos = 0;
+                    ((auditBlock*)listNodeValue(ac->node))->refcount++;
+                }
+            }
+        }
+        audit_mem -= sizeof(auditBlock)+b->size;
+        listDelNode(audit_blocks,head);
+        if (server.unixtime != last_warning) {
+            last_warning = server.unixtime;
+            serverLog(LL_WARNING,
+                "Audit ring reached audit-buffer-limit: slow consumers "
+                "evicted (%lld bytes dropped so far).", audit_dropped);
+        }
+    }
+}
+
+/* Append the executed command to the ring as a single binary record.
+ * Callers are expected to test auditEnabled() first. */
+void auditFeedCommand(client *c, int dictid, robj **argv, int argc) {
+    struct timeval tv;
+    int origin;
+    const char *src;
+    size_t srclen, reclen;
+    char *p;
+    int j;
+
+    if (!auditEnabled()) return;
+
+    if (c->flags & CLIENT_LUA) {
+        origin = AUDIT_ORIGIN_LUA;
+        src = ""; srclen = 0;
+    } else if (c->flags & CLIENT_UNIX_SOCKET) {
+        origin = AUDIT_ORIGIN_UNIX;
+        src = server.unixsocket; srclen = strlen(src);
+    } else {
+        origin = AUDIT_ORIGIN_PEER;
+        src = getClientPeerId(c); srclen = strlen(src);
+    }
+
+    /* Size the record. Shared integer objects are stored as the string
+     * they decode to, so consumers never look at robj internals. */
+    reclen = 4+8+4+1+4+srclen+4;
+    for (j = 0; j < argc; j++) {
+        reclen += 4;
+        if (argv[j]->encoding == OBJ_ENCODING_INT)
+            reclen += sdigits10((long long)argv[j]->ptr);
+        else
+            reclen += sdslen(argv[j]->ptr);
+    }
+
+    auditBlock *b = auditGetTailBlock(reclen);
+    listNode *tail = listLast(audit_blocks);
+    size_t start = b->used;
+    p = b->buf + start;
+
+    gettimeofday(&tv,NULL);
+    int64_t usec = (int64_t)tv.tv_sec*1000000 + tv.tv_usec;
+    auditPutU32(&p,reclen);
+    memcpy(p,&usec,8); p += 8;
+    int32_t did = dictid;
+    memcpy(p,&did,4); p += 4;
+    *p++ = origin;
+    auditPutU32(&p,srclen);
+    memcpy(p,src,srclen); p += srclen;
+    auditPutU32(&p,argc);
+    for (j = 0; j < argc; j++) {
+        if (argv[j]->encoding == OBJ_ENCODING_INT) {
+            char buf[LONG_STR_SIZE];
+            int len = ll2string(buf,sizeof(buf),(long)argv[j]->ptr);
+            auditPutU32(&p,len);
+            memcpy(p,buf,len); p += len;
+        } else {
+            auditPutU32(&p,sdslen(argv[j]->ptr));
+            memcpy(p,argv[j]->ptr,sdslen(argv[j]->ptr));
+            p += sdslen(argv[j]->ptr);
+        }
+    }
+    serverAssert((size_t)(p - (b->buf+start)) == reclen);
+    b->used += reclen;
+
+    /* Attach the consumers that registered while the ring was empty to
+     * this record, the first one executed since they joined. */
+    if (audit_unattached) {
+        listIter li;
+        listNode *ln;
+        listRewind(audit_consumers,&li);
+        while ((ln = listNext(&li))) {
+            auditConsumer *ac = listNodeValue(ln);
+            if (ac->node != NULL) continue;
+            ac->node = tail;
+            ac->pos = start;
+            b->refcount++;
+        }
+        audit_unattached = 0;
+    }
+
+    auditEnforceMemoryLimit();
+}
+
+/* ---------------------------- Record formatting -------------------------- */
+
+/* Append to 'dst' the human readable form of the binary record at 'rec',
+ * without line terminator: the exact text MONITOR always produced. */
+static sds auditCatRecord(sds dst, const char *rec) {
+    const char *p = rec+4; /* Skip reclen. */
+    int64_t usec;
+    int32_t dictid;
+    uint32_t srclen, argc, len, j;
+    uint8_t origin;
+
+    memcpy(&usec,p,8); p += 8;
+    memcpy(&dictid,p,4); p += 4;
+    origin = *p++;
+    memcpy(&srclen,p,4); p += 4;
+
+    dst = sdscatprintf(dst,"%ld.%06ld ",
+        (long)(usec/1000000),(long)(usec%1000000));
+    if (origin == AUDIT_ORIGIN_LUA) {
+        dst = sdscatprintf(dst,"[%d lua] ",dictid);
+    } else if (origin == AUDIT_ORIGIN_UNIX) {
+        dst = sdscatprintf(dst,"[%d unix:%.*s] ",dictid,(int)srclen,p);
+    } else {
+        dst = sdscatprintf(dst,"[%d %.*s] ",dictid,(int)srclen,p);
+    }
+    p += srclen;
+
+    memcpy(&argc,p,4); p += 4;
+    for (j = 0; j < argc; j++) {
+        memcpy(&len,p,4); p += 4;
+        dst = sdscatrepr(dst,p,len);
+        p += len;
+        if (j != argc-1) dst = sdscatlen(dst," ",1);
+    }
+    return dst;
+}
+
+/* -------------------------------- Draining ------------------------------- */
+
+/* Advance 'ac' past the record it points at, moving the reference to the
+ * next chunk when the current one is fully consumed and there is a next
+ * one (the cursor parks at the end of the tail chunk otherwise). */
+static void auditConsumerAdvance(auditConsumer *ac, uint32_t reclen) {
+    auditBlock *b = listNodeValue(ac->node);
+
+    ac->pos += reclen;
+    serverAssert(ac->pos <= b->used);
+    if (ac->pos == b->used && listNextNode(ac->node)) {
+        b->refcount--;
+        ac->node = listNextNode(ac->node);
+        ac->pos = 0;
+        ((auditBlock*)listNodeValue(ac->node))->refcount++;
+    }
+}
+
+/* Feed a monitor client everything it did not consume yet, formatting
+ * each record once for it. */
+static void auditDrainMonitor(auditConsumer *ac) {
+    while (ac->node) {
+        auditBlock *b = listNodeValue(ac->node);
+        if (ac->pos == b->used) break; /* Parked at the tail end. */
+
+        uint32_t reclen;
+        memcpy(&reclen,b->buf+ac->pos,4);
+        sds line = auditCatRecord(sdsnew("+"),b->buf+ac->pos);
+        line = sdscatlen(line,"\r\n",2);
+        addReplySds(ac->c,line);
+        auditConsumerAdvance(ac,reclen);
+    }
+}
+
+/* Slice the binary bytes the file writer did not consume yet and queue
+ * them to the audit write bio thread, that formats and writes them to
+ * the audit file without ever touching the ring. */
+static void auditDrainFile(auditConsumer *ac) {
+    sds slice = NULL;
+
+    while (ac->node) {
+        auditBlock *b = listNodeValue(ac->node);
+        if (b->used > ac->pos) {
+            if (slice == NULL) slice = sdsempty();
+            slice = sdscatlen(slice,b->buf+ac->pos,b->used-ac->pos);
+        }
+        if (listNextNode(ac->node) == NULL) {
+            ac->pos = b->used;
+            break;
+        }
+        b->refcount--;
+        ac->node = listNextNode(ac->node);
+        ac->pos = 0;
+        ((auditBlock*)listNodeValue(ac->node))->refcount++;
+    }
+    if (slice)
+        bioCreateBackgroundJob(BIO_AUDIT_WRITE,
+            (void*)(long)audit_fd,slice,NULL);
+}
+
+/* Serve every consumer and release the fully consumed head chunks.
+ * Called from beforeSleep(). */
+void auditFlush(void) {
+    listIter li;
+    listNode *ln;
+
+    if (!auditEnabled()) return;
+
+    listRewind(audit_consumers,&li);
+    while ((ln = listNext(&li))) {
+        auditConsumer *ac = listNodeValue(ln);
+        if (ac->c)
+            auditDrainMonitor(ac);
+        else
+            auditDrainFile(ac);
+    }
+
+    /* Cursors only move forward, so unreferenced chunks accumulate at
+     * the head of the ring. */
+    while ((ln = listFirst(audit_blocks)) != NULL) {
+        auditBlock *b = listNodeValue(ln);
+        if (b->refcount) break;
+        audit_mem -= sizeof(auditBlock)+b->size;
+        listDelNode(audit_blocks,ln);
+    }
+}
+
+/* --------------------------- Consumer lifecycle -------------------------- */
+
+static auditConsumer *auditConsumerCreate(client *c) {
+    auditConsumer *ac = zmalloc(sizeof(*ac));
+    listNode *tail = listLast(audit_blocks);
+
+    ac->c = c;
+    if (tail) {
+        auditBlock *b = listNodeValue(tail);
+        ac->node = tail;
+        ac->pos = b->used;
+        b->refcount++;
+    } else {
+        ac->node = NULL;
+        ac->pos = 0;
+        audit_unattached++;
+    }
+    listAddNodeTail(audit_consumers,ac);
+    return ac;
+}
+
+/* Register the client that just turned into a MONITOR as a ring
+ * consumer. */
+void auditMonitorAttach(client *c) {
+    auditConsumerCreate(c);
+}
+
+/* Drop the ring cursor of a MONITOR client that is being freed. The
+ * cursor may be gone already if the memory limit evicted it. */
+void auditMonitorRelease(client *c) {
+    listIter li;
+    listNode *ln;
+
+    if (audit_consumers == NULL) return;
+    listRewind(audit_consumers,&li);
+    while ((ln = listNext(&li))) {
+        auditConsumer *ac = listNodeValue(ln);
+        if (ac->c != c) continue;
+        if (ac->node)
+            ((auditBlock*)listNodeValue(ac->node))->refcount--;
+        else
+            audit_unattached--;
+        listDelNode(audit_consumers,ln);
+        zfree(ac);
+        return;
+    }
+}
+
+/* ------------------------------- Audit file ------------------------------ */
+
+/* Executed by the BIO_AUDIT_WRITE thread: turn a slice of binary records
+ * into text and append it to the audit file. The slice is owned by the
+ * job and released here. */
+void auditWriteFromBioThread(int fd, sds buf) {
+    sds text = sdsempty();
+    size_t pos = 0;
+
+    while (pos < sdslen(buf)) {
+        uint32_t reclen;
+        memcpy(&reclen,buf+pos,4);
+        text = auditCatRecord(text,buf+pos);
+        text = sdscatlen(text,"\n",1);
+        pos += reclen;
+    }
+    if (write(fd,text,sdslen(text)) != (ssize_t)sdslen(text)) {
+        serverLog(LL_WARNING,"Error writing to the audit log: %s",
+            strerror(errno));
+    }
+    sdsfree(text);
+    sdsfree(buf);
+}
+
+/* ------------------------------ Initialization --------------------------- */
+
+/* Create the ring and, if audit-log is configured, open the file and
+ * register its writer consumer. Called at startup after bioInit(). */
+void auditInit(void) {
+    audit_blocks = listCreate();
+    audit_consumers = listCreate();
+
+    if (server.audit_log == NULL) return;
+    audit_fd = open(server.audit_log,O_WRONLY|O_APPEND|O_CREAT,0644);
+    if (audit_fd == -1) {
+        serverLog(LL_WARNING,
+            "Fatal: can't open the audit log file %s: %s",
+            server.audit_log,strerror(errno));
+        exit(1);
+    }
+    auditConsumerCreate(NULL);
+}
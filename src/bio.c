@@ -24,6 +24,12 @@
  * recently inserted to the most recently inserted (older jobs processed
  * first).
  *
+ * The only exception is BIO_LAZY_FREE, that may be serviced by more than
+ * one thread (see the "lazyfree-threads" config directive), and that has
+ * an additional low priority queue for jobs known to be expensive: for
+ * that type the ordering guarantee only holds among jobs of the same
+ * queue picked by the same thread.
+ *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
  *
@@ -61,11 +67,18 @@
 #include "server.h"
 #include "bio.h"
 
-static pthread_t bio_threads[BIO_NUM_OPS];
+static pthread_t bio_threads[BIO_NUM_OPS+BIO_LAZYFREE_MAX_THREADS-1];
+static int bio_threads_num; /* Total threads spawned by bioInit(). */
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
 static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
 static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
 static list *bio_jobs[BIO_NUM_OPS];
+/* Lazy free jobs expected to take a long time (huge objects, whole
+ * databases) are queued apart, and only picked up when the main queue is
+ * empty: this way the small frees produced by eviction are not stuck
+ * behind the release of a single giant object. Protected by the
+ * BIO_LAZY_FREE mutex, and accounted in bio_pending[BIO_LAZY_FREE]. */
+static list *bio_jobs_lazyfree_large;
 /* The following array is used to hold the number of pending jobs for every
  * OP type. This allows us to export the bioPendingJobsOfType() API that is
  * useful when the main thread wants to perform some operation that may involve
@@ -78,15 +91,14 @@ static unsigned long long bio_pending[BIO_NUM_OPS];
  * file as the API does not expose the internals at all. */
 struct bio_job {
     time_t time; /* Time at which the job was created. */
+    lazy_free_fn *free_fn; /* Release function, BIO_LAZY_FREE jobs only. */
     /* Job specific arguments pointers. If we need to pass more than three
      * arguments we can just pass a pointer to a structure or alike. */
     void *arg1, *arg2, *arg3;
 };
 
 void *bioProcessBackgroundJobs(void *arg);
-void lazyfreeFreeObjectFromBioThread(robj *o);
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
-void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+void aofWriteFromBioThread(int fd, sds buf, int dofsync);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -107,6 +119,7 @@ void bioInit(void) {
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
     }
+    bio_jobs_lazyfree_large = listCreate();
 
     /* Set the stack size as by default it may be small in some system */
     pthread_attr_init(&attr);
@@ -126,12 +139,27 @@ void bioInit(void) {
         }
         bio_threads[j] = thread;
     }
+    bio_threads_num = BIO_NUM_OPS;
+
+    /* Spawn the additional lazy free workers, if configured. All the
+     * workers of a type share the queue, mutex and condition variables
+     * of that type, so the only difference with the threads above is
+     * that BIO_LAZY_FREE may be serviced by more than one of them. */
+    for (j = 1; j < server.lazyfree_threads; j++) {
+        void *arg = (void*)(unsigned long) BIO_LAZY_FREE;
+        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+            exit(1);
+        }
+        bio_threads[bio_threads_num++] = thread;
+    }
 }
 
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3) {
     struct bio_job *job = zmalloc(sizeof(*job));
 
     job->time = time(NULL);
+    job->free_fn = NULL;
     job->arg1 = arg1;
     job->arg2 = arg2;
     job->arg3 = arg3;
@@ -142,6 +170,28 @@ void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3) {
     pthread_mutex_unlock(&bio_mutex[type]);
 }
 
+/* Queue a lazy free job: 'free_fn' will be called with the three argument
+ * pointers from one of the lazy free workers. Jobs with 'large' set are
+ * routed to the low priority queue, so that the many small frees produced
+ * under eviction pressure are not delayed by the release of huge objects. */
+void bioCreateLazyFreeJob(lazy_free_fn *free_fn, int large, void *arg1,
+                          void *arg2, void *arg3)
+{
+    struct bio_job *job = zmalloc(sizeof(*job));
+
+    job->time = time(NULL);
+    job->free_fn = free_fn;
+    job->arg1 = arg1;
+    job->arg2 = arg2;
+    job->arg3 = arg3;
+    pthread_mutex_lock(&bio_mutex[BIO_LAZY_FREE]);
+    listAddNodeTail(large ? bio_jobs_lazyfree_large : bio_jobs[BIO_LAZY_FREE],
+                    job);
+    bio_pending[BIO_LAZY_FREE]++;
+    pthread_cond_signal(&bio_newjob_cond[BIO_LAZY_FREE]);
+    pthread_mutex_unlock(&bio_mutex[BIO_LAZY_FREE]);
+}
+
 void *bioProcessBackgroundJobs(void *arg) {
     struct bio_job *job;
     unsigned long type = (unsigned long) arg;
@@ -154,6 +204,8 @@ void *bioProcessBackgroundJobs(void *arg) {
         return NULL;
     }
 
+    redisSetCpuAffinity(server.bio_cpulist);
+
     /* Make the thread killable at any time, so that bioKillThreads()
      * can work reliably. */
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
@@ -170,15 +222,25 @@ void *bioProcessBackgroundJobs(void *arg) {
 
     while(1) {
         listNode *ln;
+        list *queue;
 
-        /* The loop always starts with the lock hold. */
-        if (listLength(bio_jobs[type]) == 0) {
+        /* The loop always starts with the lock hold. Lazy free workers
+         * drain the normal queue first, and fall back to the low priority
+         * one only when there is nothing else to do. */
+        queue = bio_jobs[type];
+        if (type == BIO_LAZY_FREE && listLength(queue) == 0)
+            queue = bio_jobs_lazyfree_large;
+        if (listLength(queue) == 0) {
             pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
             continue;
         }
-        /* Pop the job from the queue. */
-        ln = listFirst(bio_jobs[type]);
+        /* Pop the job from the queue. The node is removed while still
+         * holding the lock: several threads may serve BIO_LAZY_FREE, and
+         * a job left at the head of the list would be picked twice. The
+         * job is still accounted in bio_pending[] until processed. */
+        ln = listFirst(queue);
         job = ln->value;
+        listDelNode(queue,ln);
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[type]);
@@ -189,16 +251,19 @@ void *bioProcessBackgroundJobs(void *arg) {
         } else if (type == BIO_AOF_FSYNC) {
             redis_fsync((long)job->arg1);
         } else if (type == BIO_LAZY_FREE) {
-            /* What we free changes depending on what arguments are set:
-             * arg1 -> free the object at pointer.
-             * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the skiplist. */
-            if (job->arg1)
-                lazyfreeFreeObjectFromBioThread(job->arg1);
-            else if (job->arg2 && job->arg3)
-                lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
-            else if (job->arg3)
-                lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+            job->free_fn(job->arg1,job->arg2,job->arg3);
+        } else if (type == BIO_AOF_WRITE) {
+            aofWriteFromBioThread((long)job->arg1,job->arg2,(long)job->arg3);
+        } else if (type == BIO_LIST_COMPRESS) {
+            quicklistCompressFromBioThread(job->arg1);
+        } else if (type == BIO_OBJ_CONVERT) {
+            objConvertFromBioThread(job->arg1);
+        } else if (type == BIO_COLD_WRITE) {
+            coldTierBioWrite(job->arg1);
+        } else if (type == BIO_COLD_READ) {
+            coldTierBioRead(job->arg1);
+        } else if (type == BIO_AUDIT_WRITE) {
+            auditWriteFromBioThread((long)job->arg1,job->arg2);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -207,7 +272,6 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
-        listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
 
         /* Unblock threads blocked on bioWaitStepOfType() if any. */
@@ -253,15 +317,15 @@ unsigned long long bioWaitStepOfType(int type) {
 void bioKillThreads(void) {
     int err, j;
 
-    for (j = 0; j < BIO_NUM_OPS; j++) {
+    for (j = 0; j < bio_threads_num; j++) {
         if (pthread_cancel(bio_threads[j]) == 0) {
             if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
                 serverLog(LL_WARNING,
-                    "Bio thread for job type #%d can be joined: %s",
+                    "Bio thread #%d can be joined: %s",
                         j, strerror(err));
             } else {
                 serverLog(LL_WARNING,
-                    "Bio thread for job type #%d terminated",j);
+                    "Bio thread #%d terminated",j);
             }
         }
     }
@@ -30,9 +30,16 @@
 #ifndef __BIO_H
 #define __BIO_H
 
+/* Lazy free jobs carry the function that knows how to release their
+ * payload, so that new kinds of deferred frees don't need to overload
+ * the meaning of the generic argument pointers. */
+typedef void lazy_free_fn(void *arg1, void *arg2, void *arg3);
+
 /* Exported API */
 void bioInit(void);
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3);
+void bioCreateLazyFreeJob(lazy_free_fn *free_fn, int large, void *arg1,
+                          void *arg2, void *arg3);
 unsigned long long bioPendingJobsOfType(int type);
 unsigned long long bioWaitStepOfType(int type);
 time_t bioOlderJobOfType(int type);
@@ -42,6 +49,16 @@ void bioKillThreads(void);
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_AOF_WRITE     3 /* Deferred AOF write (and fsync after it). */
+#define BIO_LIST_COMPRESS 4 /* Background quicklist node compression. */
+#define BIO_OBJ_CONVERT   5 /* Background object encoding conversion. */
+#define BIO_COLD_WRITE    6 /* Append a demoted value to the cold tier log. */
+#define BIO_COLD_READ     7 /* Read a cold value back for a parked client. */
+#define BIO_AUDIT_WRITE   8 /* Format and append audit ring records. */
+#define BIO_NUM_OPS       9
+
+/* Maximum number of threads servicing BIO_LAZY_FREE: the upper bound of
+ * the "lazyfree-threads" config directive. */
+#define BIO_LAZYFREE_MAX_THREADS 8
 
 #endif
@@ -30,10 +30,211 @@
 
 #include "server.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_BITOPS_AVX2 1
+#include <immintrin.h>
+#endif
+
 /* -----------------------------------------------------------------------------
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
+#ifdef HAVE_BITOPS_AVX2
+/* Check once if the CPU can run the AVX2 bitmap kernels below: large
+ * BITCOUNT / BITOP calls against big bitmaps are memory streaming loads
+ * where the scalar loops leave most of the available bandwidth unused. */
+static int bitopsAvx2Supported(void) {
+    static int supported = -1;
+    if (supported == -1) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2");
+    }
+    return supported;
+}
+
+/* Population count of 'count' bytes using the Harley-Seal approach: a
+ * carry-save adder network compresses 16 input vectors per iteration so
+ * only one vector out of sixteen goes through the (comparatively slow)
+ * in-register nibble lookup popcount. Handles the unaligned tail with
+ * scalar code, so it can be used on a whole buffer. */
+__attribute__((target("avx2")))
+static __m256i popcountVec256(__m256i v) {
+    const __m256i lut = _mm256_setr_epi8(
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut,_mm256_and_si256(v,low));
+    __m256i hi = _mm256_shuffle_epi8(lut,
+        _mm256_and_si256(_mm256_srli_epi16(v,4),low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo,hi),_mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static void csa256(__m256i *h, __m256i *l, __m256i a, __m256i b, __m256i c) {
+    __m256i u = _mm256_xor_si256(a,b);
+    *h = _mm256_or_si256(_mm256_and_si256(a,b),_mm256_and_si256(u,c));
+    *l = _mm256_xor_si256(u,c);
+}
+
+__attribute__((target("avx2")))
+static size_t redisPopcountAvx2(const unsigned char *p, long count) {
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256();
+    __m256i twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256();
+    __m256i eights = _mm256_setzero_si256();
+    __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+    size_t bits = 0;
+
+    /* Harley-Seal main loop: 16 vectors (512 bytes) per iteration. */
+    while (count >= 512) {
+        #define LD(n) _mm256_loadu_si256((const __m256i*)(p+(n)*32))
+        csa256(&twosA,&ones,ones,LD(0),LD(1));
+        csa256(&twosB,&ones,ones,LD(2),LD(3));
+        csa256(&foursA,&twos,twos,twosA,twosB);
+        csa256(&twosA,&ones,ones,LD(4),LD(5));
+        csa256(&twosB,&ones,ones,LD(6),LD(7));
+        csa256(&foursB,&twos,twos,twosA,twosB);
+        csa256(&eightsA,&fours,fours,foursA,foursB);
+        csa256(&twosA,&ones,ones,LD(8),LD(9));
+        csa256(&twosB,&ones,ones,LD(10),LD(11));
+        csa256(&foursA,&twos,twos,twosA,twosB);
+        csa256(&twosA,&ones,ones,LD(12),LD(13));
+        csa256(&twosB,&ones,ones,LD(14),LD(15));
+        csa256(&foursB,&twos,twos,twosA,twosB);
+        csa256(&eightsB,&fours,fours,foursA,foursB);
+        csa256(&sixteens,&eights,eights,eightsA,eightsB);
+        total = _mm256_add_epi64(total,popcountVec256(sixteens));
+        #undef LD
+        p += 512;
+        count -= 512;
+    }
+
+    /* Each counted bit in 'sixteens' stands for 16 input bits, and so on
+     * down the adder tree. */
+    total = _mm256_slli_epi64(total,4);
+    total = _mm256_add_epi64(total,
+        _mm256_slli_epi64(popcountVec256(eights),3));
+    total = _mm256_add_epi64(total,
+        _mm256_slli_epi64(popcountVec256(fours),2));
+    total = _mm256_add_epi64(total,
+        _mm256_slli_epi64(popcountVec256(twos),1));
+    total = _mm256_add_epi64(total,popcountVec256(ones));
+
+    while (count >= 32) {
+        total = _mm256_add_epi64(total,
+            popcountVec256(_mm256_loadu_si256((const __m256i*)p)));
+        p += 32;
+        count -= 32;
+    }
+    bits += (uint64_t)_mm256_extract_epi64(total,0);
+    bits += (uint64_t)_mm256_extract_epi64(total,1);
+    bits += (uint64_t)_mm256_extract_epi64(total,2);
+    bits += (uint64_t)_mm256_extract_epi64(total,3);
+
+    /* Scalar tail. */
+    while (count >= 8) {
+        uint64_t w;
+        memcpy(&w,p,8);
+        bits += __builtin_popcountll(w);
+        p += 8;
+        count -= 8;
+    }
+    while (count-- > 0) bits += __builtin_popcount(*p++);
+    return bits;
+}
+
+/* Return how many leading bytes of 's' are all equal to 'skipval'
+ * (0x00 or 0xff), scanning 32 bytes per step. The returned count is a
+ * multiple of 32 so the caller keeps its word alignment. Used by
+ * redisBitpos() to skip long runs of clear/set bits. */
+__attribute__((target("avx2")))
+static unsigned long bitposSkipAvx2(const unsigned char *s,
+                                    unsigned long count,
+                                    int skipval)
+{
+    const __m256i skip = _mm256_set1_epi8((char)skipval);
+    unsigned long skipped = 0;
+    while (count >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s+skipped));
+        __m256i eq = _mm256_cmpeq_epi8(v,skip);
+        if (_mm256_movemask_epi8(eq) != -1) break;
+        skipped += 32;
+        count -= 32;
+    }
+    return skipped;
+}
+
+/* Compute a BITOP over the first 'minlen' bytes of the 'numkeys' operands
+ * in 'src', storing into 'res'. Returns the number of bytes actually
+ * processed (a multiple of 32, possibly less than 'minlen'): the caller
+ * completes the job with the byte-at-time loop.
+ *
+ * The output is processed in L1-sized tiles: for each tile we combine
+ * every operand before moving on, so the accumulator stays cache resident
+ * and every operand byte is streamed from memory exactly once, instead of
+ * walking all the operands over the full (possibly hundreds of MBs)
+ * length repeatedly. */
+#define BITOP_TILE_BYTES (16*1024)
+__attribute__((target("avx2")))
+static unsigned long bitopTilesAvx2(unsigned long op, unsigned char *res,
+                                    unsigned char **src,
+                                    unsigned long numkeys,
+                                    unsigned long minlen)
+{
+    unsigned long total = minlen & ~((unsigned long)31);
+    unsigned long done = 0, i, k;
+
+    while (done < total) {
+        unsigned long tile = total - done;
+        if (tile > BITOP_TILE_BYTES) tile = BITOP_TILE_BYTES;
+        memcpy(res+done,src[0]+done,tile);
+        if (op == BITOP_NOT) {
+            const __m256i allones = _mm256_set1_epi8((char)0xff);
+            for (k = done; k < done+tile; k += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(res+k));
+                _mm256_storeu_si256((__m256i*)(res+k),
+                                    _mm256_xor_si256(v,allones));
+            }
+        } else if (op == BITOP_AND) {
+            for (i = 1; i < numkeys; i++) {
+                for (k = done; k < done+tile; k += 32) {
+                    __m256i a = _mm256_loadu_si256((const __m256i*)(res+k));
+                    __m256i b = _mm256_loadu_si256((const __m256i*)(src[i]+k));
+                    _mm256_storeu_si256((__m256i*)(res+k),
+                                        _mm256_and_si256(a,b));
+                }
+            }
+        } else if (op == BITOP_OR) {
+            for (i = 1; i < numkeys; i++) {
+                for (k = done; k < done+tile; k += 32) {
+                    __m256i a = _mm256_loadu_si256((const __m256i*)(res+k));
+                    __m256i b = _mm256_loadu_si256((const __m256i*)(src[i]+k));
+                    _mm256_storeu_si256((__m256i*)(res+k),
+                                        _mm256_or_si256(a,b));
+                }
+            }
+        } else {
+            for (i = 1; i < numkeys; i++) {
+                for (k = done; k < done+tile; k += 32) {
+                    __m256i a = _mm256_loadu_si256((const __m256i*)(res+k));
+                    __m256i b = _mm256_loadu_si256((const __m256i*)(src[i]+k));
+                    _mm256_storeu_si256((__m256i*)(res+k),
+                                        _mm256_xor_si256(a,b));
+                }
+            }
+        }
+        done += tile;
+    }
+    return total;
+}
+#endif /* HAVE_BITOPS_AVX2 */
+
 /* Count number of bits set in the binary array pointed by 's' and long
  * 'count' bytes. The implementation of this function is required to
  * work with a input string length up to 512 MB. */
@@ -41,6 +242,13 @@ size_t redisPopcount(void *s, long count) {
     size_t bits = 0;
     unsigned char *p = s;
     uint32_t *p4;
+
+#ifdef HAVE_BITOPS_AVX2
+    /* For big enough inputs the vector kernel is worth the dispatch
+     * overhead: it handles the whole buffer, tail included. */
+    if (count >= 256 && bitopsAvx2Supported())
+        return redisPopcountAvx2(p,count);
+#endif
     static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
     /* Count initial bytes not aligned to 32 bit. */
@@ -129,6 +337,18 @@ long redisBitpos(void *s, unsigned long count, int bit) {
         pos += 8;
     }
 
+#ifdef HAVE_BITOPS_AVX2
+    /* Skip long runs of "uninteresting" bytes 32 at a time. Only whole
+     * 32 byte blocks are consumed so the word alignment gained above is
+     * preserved. */
+    if (!found && count >= 64 && bitopsAvx2Supported()) {
+        unsigned long skipped = bitposSkipAvx2(c,count,bit ? 0 : UCHAR_MAX);
+        c += skipped;
+        count -= skipped;
+        pos += skipped*8;
+    }
+#endif
+
     /* Skip bits with full word step. */
     l = (unsigned long*) c;
     if (!found) {
@@ -392,11 +612,6 @@ void printBits(unsigned char *p, unsigned long count) {
  * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
-
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
 #define BITFIELDOP_INCRBY 2
@@ -665,8 +880,18 @@ void bitopCommand(client *c) {
          * result in GCC compiling the code using multiple-words load/store
          * operations that are not supported even in ARM >= v6. */
         j = 0;
+        #ifdef HAVE_BITOPS_AVX2
+        /* Wider fast path: combine the operands with 32 byte vectors,
+         * walking the output in cache sized tiles so that each operand
+         * is streamed from memory only once. Unlike the fast path below
+         * there is no limit on the number of keys. */
+        if (minlen >= 64 && bitopsAvx2Supported()) {
+            j = bitopTilesAvx2(op,res,src,numkeys,minlen);
+            minlen -= j;
+        }
+        #endif
         #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
+        if (j == 0 && minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
             unsigned long *lp[16];
             unsigned long *lres = (unsigned long*) res;
 
@@ -103,6 +103,133 @@ int getTimeoutFromObjectOrReply(client *c, robj *object, mstime_t *timeout, int
     return C_OK;
 }
 
+/* ----------------------------------------------------------------------------
+ * Client timeout table
+ * ----------------------------------------------------------------------------
+ *
+ * Both the idle client timeout (the "timeout" directive) and the timeout
+ * of blocking commands are enforced through a single radix tree indexed
+ * by deadline, so that the due clients are found in sorted order without
+ * scanning the whole client list: with tens of thousands of mostly idle
+ * connections the old linear scan burned CPU every cron cycle just to
+ * find out nothing was due.
+ *
+ * Each client has at most one entry in the tree, remembered in
+ * c->timeout_deadline. Blocking with a timeout retargets the entry to the
+ * exact blocking deadline; unblocking retargets it back to the idle
+ * deadline. Idle deadlines are handled lazily: the entry is NOT updated
+ * at every command, instead when it fires the client's last interaction
+ * time is checked again and, if the client was active meanwhile or is of
+ * a kind that never times out, the entry is simply pushed forward. This
+ * way an active client costs one reinsertion per timeout period instead
+ * of one tree update per command. */
+
+/* The tree key is the 8 byte big endian deadline (so that raxSeek() finds
+ * deadlines in time order) followed by the client pointer, to tell apart
+ * clients with the same deadline. */
+#define CLIENT_TO_KEYLEN (8+sizeof(client*))
+static void encodeTimeoutKey(unsigned char *buf, uint64_t deadline,
+                             client *c)
+{
+    deadline = htonu64(deadline);
+    memcpy(buf,&deadline,sizeof(deadline));
+    memcpy(buf+8,&c,sizeof(c));
+}
+
+/* Add the client to the timeout table with the specified deadline in
+ * milliseconds, replacing the current entry if there is one. */
+void addClientToTimeoutTable(client *c, mstime_t deadline) {
+    unsigned char buf[CLIENT_TO_KEYLEN];
+
+    if (c->timeout_deadline == deadline) return;
+    removeClientFromTimeoutTable(c);
+    encodeTimeoutKey(buf,deadline,c);
+    raxInsert(server.clients_timeout_table,buf,sizeof(buf),NULL,NULL);
+    c->timeout_deadline = deadline;
+}
+
+/* Remove the client from the timeout table, if it has an entry. */
+void removeClientFromTimeoutTable(client *c) {
+    unsigned char buf[CLIENT_TO_KEYLEN];
+
+    if (c->timeout_deadline == 0) return;
+    encodeTimeoutKey(buf,c->timeout_deadline,c);
+    raxRemove(server.clients_timeout_table,buf,sizeof(buf),NULL);
+    c->timeout_deadline = 0;
+}
+
+/* Return the deadline at which an idle client should be checked again.
+ * The result is clamped one second into the future, both to guarantee
+ * progress when the nominal deadline is already in the past (clients that
+ * never time out, like replicas, are still visited periodically so that
+ * their state is re-evaluated when their flags change), and to leave a
+ * timed out blocking command the chance to deliver its reply before the
+ * idle timeout considers the client again. */
+static mstime_t clientIdleDeadline(client *c) {
+    mstime_t deadline = ((mstime_t)c->lastinteraction +
+                         server.maxidletime) * 1000;
+    if (deadline < server.mstime + 1000) deadline = server.mstime + 1000;
+    return deadline;
+}
+
+/* Handle the client whose timeout table entry is due: time out a blocked
+ * client whose blocking deadline expired, close a client idle for more
+ * than the configured limit, or just reschedule the entry. Returns 1 if
+ * the client was freed. */
+static int handleClientTimeout(client *c, mstime_t now) {
+    if (c->flags & CLIENT_BLOCKED) {
+        if (c->bpop.timeout != 0 && c->bpop.timeout <= now) {
+            replyToBlockedClientTimedOut(c);
+            unblockClient(c); /* Retargets the entry to the idle deadline. */
+        } else {
+            addClientToTimeoutTable(c,clientIdleDeadline(c));
+        }
+    } else if (server.maxidletime &&
+               !(c->flags & CLIENT_SLAVE) &&  /* no timeout for slaves */
+               !(c->flags & CLIENT_MASTER) && /* no timeout for masters */
+               !(c->flags & CLIENT_PUBSUB) && /* no timeout for Pub/Sub */
+               (now/1000 - c->lastinteraction > server.maxidletime))
+    {
+        serverLog(LL_VERBOSE,"Closing idle client");
+        freeClient(c); /* Removes the entry. */
+        return 1;
+    } else if (server.maxidletime == 0) {
+        /* Timeouts were disabled at runtime: drop the entry, the config
+         * update hook re-adds one if they get enabled again. */
+        removeClientFromTimeoutTable(c);
+    } else {
+        addClientToTimeoutTable(c,clientIdleDeadline(c));
+    }
+    return 0;
+}
+
+/* Called by beforeSleep(): process the timeout table entries that are
+ * due. Only due clients are visited, so this is a cheap no-op while
+ * nothing is expiring. */
+void handleClientsTimeout(void) {
+    mstime_t now = mstime();
+
+    while (raxSize(server.clients_timeout_table) != 0) {
+        uint64_t deadline;
+        client *c;
+        raxIterator ri;
+
+        /* Handling a client reshapes the tree (the entry is removed or
+         * pushed forward), so the first element is looked up again at
+         * every step instead of keeping an iterator across changes. */
+        raxStart(&ri,server.clients_timeout_table);
+        raxSeek(&ri,"^",NULL,0);
+        raxNext(&ri);
+        memcpy(&deadline,ri.key,sizeof(deadline));
+        deadline = ntohu64(deadline);
+        memcpy(&c,ri.key+8,sizeof(c));
+        raxStop(&ri);
+
+        if ((mstime_t)deadline > now) break;
+        handleClientTimeout(c,now);
+    }
+}
+
 /* Block a client for the specific operation type. Once the CLIENT_BLOCKED
  * flag is set client query buffer is not longer processed, but accumulated,
  * and will be processed when the client is unblocked. */
@@ -111,6 +238,10 @@ void blockClient(client *c, int btype) {
     c->btype = btype;
     server.blocked_clients++;
     server.blocked_clients_by_type[btype]++;
+    /* Blocking deadlines are exact: retarget the client's timeout table
+     * entry, the idle timeout does not apply while blocked. */
+    if (c->bpop.timeout != 0 && c->conn)
+        addClientToTimeoutTable(c,c->bpop.timeout);
 }
 
 /* This function is called in the beforeSleep() function of the event loop
@@ -176,6 +307,18 @@ void unblockClient(client *c) {
     } else if (c->btype == BLOCKED_MODULE) {
         if (moduleClientIsBlockedOnKeys(c)) unblockClientWaitingData(c);
         unblockClientFromModule(c);
+    } else if (c->btype == BLOCKED_KEYSEXPORT) {
+        keysAsyncUnblockClient(c);
+    } else if (c->btype == BLOCKED_RESUMABLE) {
+        hgetallAsyncUnblockClient(c);
+    } else if (c->btype == BLOCKED_SNAPSHOT) {
+        snapshotDigestUnblockClient(c);
+    } else if (c->btype == BLOCKED_COLD) {
+        coldTierUnblockClient(c);
+    } else if (c->btype == BLOCKED_CENSUS) {
+        memoryCensusUnblockClient(c);
+    } else if (c->btype == BLOCKED_FORWARD) {
+        clusterForwardUnblockClient(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -185,6 +328,14 @@ void unblockClient(client *c) {
     server.blocked_clients_by_type[c->btype]--;
     c->flags &= ~CLIENT_BLOCKED;
     c->btype = BLOCKED_NONE;
+    /* Back under the idle timeout: retarget the timeout table entry that
+     * the blocking deadline may have been using. */
+    if (c->conn) {
+        if (server.maxidletime)
+            addClientToTimeoutTable(c,clientIdleDeadline(c));
+        else
+            removeClientFromTimeoutTable(c);
+    }
     queueClientForReprocessing(c);
 }
 
@@ -200,6 +351,25 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->btype == BLOCKED_KEYSEXPORT) {
+        /* Exports block with no timeout, but handle a forced one by
+         * replying as a timed out blocking command would. */
+        addReplyNullArray(c);
+    } else if (c->btype == BLOCKED_RESUMABLE) {
+        /* Resumable reads block with no timeout, but handle a forced one
+         * by replying as a timed out blocking command would. */
+        addReplyNullArray(c);
+    } else if (c->btype == BLOCKED_SNAPSHOT) {
+        addReplyNull(c);
+    } else if (c->btype == BLOCKED_COLD) {
+        /* Cold tier faults block with no timeout, but handle a forced one
+         * by replying as a timed out blocking command would. */
+        addReplyNull(c);
+    } else if (c->btype == BLOCKED_CENSUS) {
+        addReplyNull(c);
+    } else if (c->btype == BLOCKED_FORWARD) {
+        addReplySds(c,sdsnew(
+            "-TRYAGAIN Timeout forwarding to the import target\r\n"));
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
@@ -233,6 +403,11 @@ void disconnectAllBlockedClients(void) {
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
  * when there may be clients blocked on a list key, and there may be new
  * data to fetch (the key is ready). */
+
+/* How many blocked clients we serve with a single traversal of the list:
+ * bounds the stack array of popped values. */
+#define LIST_SERVE_BATCH 128
+
 void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
     /* We serve clients in the same order they blocked for
      * this key, from the first blocked to the last. */
@@ -241,7 +416,7 @@ void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
         list *clients = dictGetVal(de);
         int numclients = listLength(clients);
 
-        while(numclients--) {
+        while(numclients > 0 && listTypeLength(o) > 0) {
             listNode *clientnode = listFirst(clients);
             client *receiver = clientnode->value;
 
@@ -250,35 +425,72 @@ void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
                  * we'll not run into it again. */
                 listDelNode(clients,clientnode);
                 listAddNodeTail(clients,receiver);
+                numclients--;
                 continue;
             }
 
-            robj *dstkey = receiver->bpop.target;
+            /* When a burst of pushes wakes up many clients at once,
+             * popping one element per client re-locates the end of the
+             * quicklist every time. Instead we group the run of
+             * consecutive clients popping from the same end, pop one
+             * element for each of them in a single traversal, and hand
+             * the values out directly. */
             int where = (receiver->lastcmd &&
                          receiver->lastcmd->proc == blpopCommand) ?
                          LIST_HEAD : LIST_TAIL;
-            robj *value = listTypePop(o,where);
+            int run = 0, j;
+            listNode *ln = clientnode;
+            while (ln && run < numclients && run < LIST_SERVE_BATCH) {
+                client *peer = ln->value;
+                if (peer->btype != BLOCKED_LIST) break;
+                int peerwhere = (peer->lastcmd &&
+                                 peer->lastcmd->proc == blpopCommand) ?
+                                 LIST_HEAD : LIST_TAIL;
+                if (peerwhere != where) break;
+                run++;
+                ln = ln->next;
+            }
+
+            robj *values[LIST_SERVE_BATCH];
+            int count = run;
+            if ((unsigned long)count > listTypeLength(o))
+                count = listTypeLength(o);
+            count = listTypePopBatch(o,where,values,count);
+            if (count == 0) break;
+
+            for (j = 0; j < count; j++) {
+                /* Unblocking the previous receiver removed it from the
+                 * clients list, so the head is always the next client
+                 * of the run. */
+                receiver = listFirst(clients)->value;
+                robj *value = values[j];
+                robj *dstkey = receiver->bpop.target;
 
-            if (value) {
                 /* Protect receiver->bpop.target, that will be
                  * freed by the next unblockClient()
                  * call. */
                 if (dstkey) incrRefCount(dstkey);
                 unblockClient(receiver);
+                numclients--;
 
                 if (serveClientBlockedOnList(receiver,
                     rl->key,dstkey,rl->db,value,
                     where) == C_ERR)
                 {
-                    /* If we failed serving the client we need
-                     * to also undo the POP operation. */
-                    listTypePush(o,value,where);
+                    /* If we failed serving the client we need to undo
+                     * the POP operation: give back this value and the
+                     * ones not handed out yet, restoring the original
+                     * order, then retry with the next blocked client. */
+                    int k;
+                    for (k = count-1; k >= j; k--)
+                        listTypePush(o,values[k],where);
+                    for (k = j; k < count; k++) decrRefCount(values[k]);
+                    if (dstkey) decrRefCount(dstkey);
+                    break;
                 }
 
                 if (dstkey) decrRefCount(dstkey);
                 decrRefCount(value);
-            } else {
-                break;
             }
         }
     }
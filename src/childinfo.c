@@ -29,6 +29,7 @@
 
 #include "server.h"
 #include <unistd.h>
+#include <fcntl.h>
 
 /* Open a child-parent channel used in order to move information about the
  * RDB / AOF saving process from the child to the parent (for instance
@@ -69,13 +70,233 @@ void sendChildInfo(int ptype) {
     }
 }
 
-/* Receive COW data from parent. */
+/* While the fork is still running, periodically sample the current copy on
+ * write size and send it to the parent, that reports it in the INFO
+ * persistence section. Sampling means scanning the process smaps file, so
+ * this is rate limited to once per second. */
+void sendChildCOWInfoIfNeeded(int ptype) {
+    static mstime_t last_update = 0;
+    mstime_t now = mstime();
+
+    if (now - last_update < 1000) return;
+    last_update = now;
+    server.child_info_data.cow_size = zmalloc_get_private_dirty(-1);
+    server.child_info_data.final = 0;
+    sendChildInfo(ptype);
+}
+
+/* ----------------------------------------------------------------------------
+ * Parent side dirty page ledger.
+ *
+ * The child reports how much copy on write memory the fork cost in total,
+ * but not who caused it: to target the real COW drivers we also track, on
+ * the parent side, which subsystems dirtied how many pages while the
+ * child was alive. When a fork starts the kernel soft dirty bits are
+ * cleared (/proc/self/clear_refs), and when the child is reaped the
+ * /proc/self/pagemap soft dirty bits are read back for the memory regions
+ * whose owner we know: the keyspace hash table bucket arrays, the
+ * replication backlog, and the client structures with their buffers.
+ * The scattered small allocations (dict entries, key sds strings, value
+ * objects) cannot be enumerated exhaustively, so a few hundred random
+ * keys are sampled instead and the fraction of them sitting on dirty
+ * pages is reported. Everything is exposed in the INFO persistence
+ * section next to the child reported COW size.
+ *
+ * Reading the pagemap is one sequential 8 bytes-per-page scan per region,
+ * so the whole ledger costs well under a millisecond per fork even on
+ * large heaps, and it is collected once, from the main thread, when the
+ * child is reaped. On kernels without soft dirty tracking the ledger
+ * just reports itself as unsupported. */
+
+/* Count the dirty bytes of the pages overlapping [ptr, ptr+len) by
+ * reading their soft dirty bits (bit 55) from the pagemap at 'fd'.
+ * If 'anydirty' is not NULL it is incremented when at least one page of
+ * the range is dirty, which is what the object sampling cares about. */
+static size_t cowLedgerRegionDirty(int fd, void *ptr, size_t len, int *anydirty) {
+    static long psz = 0;
+    uint64_t entries[512];
+    size_t dirty = 0;
+
+    if (psz == 0) psz = sysconf(_SC_PAGESIZE);
+    if (ptr == NULL || len == 0) return 0;
+    uint64_t first = (uint64_t)(uintptr_t)ptr / psz;
+    uint64_t last = ((uint64_t)(uintptr_t)ptr + len - 1) / psz;
+    while (first <= last) {
+        uint64_t n = last - first + 1;
+        if (n > sizeof(entries)/sizeof(entries[0]))
+            n = sizeof(entries)/sizeof(entries[0]);
+        ssize_t r = pread(fd, entries, n*8, first*8);
+        if (r <= 0) break;
+        for (ssize_t j = 0; j < r/8; j++)
+            if (entries[j] & (1ULL<<55)) dirty += psz;
+        first += r/8;
+        if ((size_t)r < n*8) break;
+    }
+    if (dirty > len) dirty = len;
+    if (anydirty && dirty) (*anydirty)++;
+    return dirty;
+}
+
+/* Called right after a successful fork, on the parent side: clear the
+ * soft dirty bits so that cowLedgerChildDone() measures only the pages
+ * the parent dirtied during the life of this child. */
+void cowLedgerForkStarted(void) {
+    static int probed = 0;
+    static volatile char probe_page;
+
+    if (server.cow_ledger.state == COW_LEDGER_UNSUPPORTED) return;
+    int fd = open("/proc/self/clear_refs",O_WRONLY);
+    if (fd == -1 || write(fd,"4",1) != 1) {
+        server.cow_ledger.state = COW_LEDGER_UNSUPPORTED;
+        if (fd != -1) close(fd);
+        return;
+    }
+    close(fd);
+
+    /* On kernels built without soft dirty tracking the clear_refs write
+     * above still succeeds but the pagemap bit is never raised, so the
+     * first time around dirty a page on purpose and check that we can
+     * see it. */
+    if (!probed) {
+        probed = 1;
+        probe_page = 1;
+        int pm = open("/proc/self/pagemap",O_RDONLY);
+        if (pm == -1 ||
+            cowLedgerRegionDirty(pm,(void*)&probe_page,1,NULL) == 0)
+        {
+            server.cow_ledger.state = COW_LEDGER_UNSUPPORTED;
+            serverLog(LL_VERBOSE,
+                "Soft dirty page tracking not available, "
+                "the fork dirty page ledger is disabled");
+        }
+        if (pm != -1) close(pm);
+    }
+}
+
+/* Called when a child is reaped: walk the known regions and sample the
+ * keyspace, populating server.cow_ledger for the INFO output. */
+void cowLedgerChildDone(void) {
+    if (server.cow_ledger.state == COW_LEDGER_UNSUPPORTED) return;
+    int fd = open("/proc/self/pagemap",O_RDONLY);
+    if (fd == -1) {
+        server.cow_ledger.state = COW_LEDGER_UNSUPPORTED;
+        return;
+    }
+
+    server.cow_ledger.dict_bytes = 0;
+    server.cow_ledger.backlog_bytes = 0;
+    server.cow_ledger.clientbufs_bytes = 0;
+
+    /* Keyspace and expires hash table bucket arrays: the addresses and
+     * sizes are known exactly. */
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        for (int s = 0; s < server.db_dict_shards; s++) {
+            dict *d = db->dict[s];
+            for (int t = 0; t < 2; t++) {
+                if (d->ht[t].table == NULL) continue;
+                server.cow_ledger.dict_bytes += cowLedgerRegionDirty(fd,
+                    d->ht[t].table, d->ht[t].size*sizeof(dictEntry*), NULL);
+            }
+        }
+        for (int t = 0; t < 2; t++) {
+            if (db->expires->ht[t].table == NULL) continue;
+            server.cow_ledger.dict_bytes += cowLedgerRegionDirty(fd,
+                db->expires->ht[t].table,
+                db->expires->ht[t].size*sizeof(dictEntry*), NULL);
+        }
+    }
+
+    /* Replication backlog. */
+    if (server.repl_backlog)
+        server.cow_ledger.backlog_bytes = cowLedgerRegionDirty(fd,
+            server.repl_backlog, server.repl_backlog_size, NULL);
+
+    /* Client structures, query buffers and pending reply blocks. */
+    listIter li;
+    listNode *ln;
+    listRewind(server.clients,&li);
+    while ((ln = listNext(&li))) {
+        client *c = ln->value;
+        server.cow_ledger.clientbufs_bytes +=
+            cowLedgerRegionDirty(fd, c, sizeof(client), NULL);
+        if (c->querybuf)
+            server.cow_ledger.clientbufs_bytes += cowLedgerRegionDirty(fd,
+                sdsAllocPtr(c->querybuf), sdsAllocSize(c->querybuf), NULL);
+        listIter ri;
+        listNode *rn;
+        listRewind(c->reply,&ri);
+        while ((rn = listNext(&ri))) {
+            clientReplyBlock *blk = rn->value;
+            if (blk == NULL) continue; /* Deferred length placeholder. */
+            server.cow_ledger.clientbufs_bytes += cowLedgerRegionDirty(fd,
+                blk, sizeof(clientReplyBlock)+blk->size, NULL);
+        }
+    }
+
+    /* Sample random keys of the first database and check what part of
+     * them (hash table entry, key string, value object with its compact
+     * payload when there is one) sits on pages the parent dirtied. */
+    int samples = 0, entries_dirty = 0, keys_dirty = 0, values_dirty = 0;
+    for (int i = 0; i < 256; i++) {
+        dict *d = server.db[0].dict[rand() % server.db_dict_shards];
+        dictEntry *de = dictGetRandomKey(d);
+        if (de == NULL) continue;
+        samples++;
+        cowLedgerRegionDirty(fd, de, sizeof(*de), &entries_dirty);
+        sds key = dictGetKey(de);
+        cowLedgerRegionDirty(fd, sdsAllocPtr(key), sdsAllocSize(key),
+                             &keys_dirty);
+        robj *o = dictGetVal(de);
+        int value_was_dirty = values_dirty;
+        cowLedgerRegionDirty(fd, o, sizeof(*o), &values_dirty);
+        if (values_dirty != value_was_dirty) continue;
+        /* The object struct is clean: also check the payload when its
+         * location and size are known. */
+        if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_RAW) {
+            cowLedgerRegionDirty(fd, sdsAllocPtr(o->ptr),
+                                 sdsAllocSize(o->ptr), &values_dirty);
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            cowLedgerRegionDirty(fd, o->ptr, lpBytes(o->ptr), &values_dirty);
+        } else if (o->encoding == OBJ_ENCODING_INTSET) {
+            cowLedgerRegionDirty(fd, o->ptr, intsetBlobLen(o->ptr),
+                                 &values_dirty);
+        }
+    }
+    server.cow_ledger.sampled_keys = samples;
+    server.cow_ledger.entries_dirty_pct =
+        samples ? 100.0*entries_dirty/samples : 0;
+    server.cow_ledger.keys_dirty_pct =
+        samples ? 100.0*keys_dirty/samples : 0;
+    server.cow_ledger.values_dirty_pct =
+        samples ? 100.0*values_dirty/samples : 0;
+    server.cow_ledger.state = COW_LEDGER_OK;
+    close(fd);
+
+    serverLog(LL_NOTICE,
+        "Fork dirty page ledger: dict=%zuKB backlog=%zuKB clientbufs=%zuKB, "
+        "sampled keyspace: entries %.0f%%, keys %.0f%%, values %.0f%% on "
+        "dirty pages",
+        server.cow_ledger.dict_bytes/1024,
+        server.cow_ledger.backlog_bytes/1024,
+        server.cow_ledger.clientbufs_bytes/1024,
+        server.cow_ledger.entries_dirty_pct,
+        server.cow_ledger.keys_dirty_pct,
+        server.cow_ledger.values_dirty_pct);
+}
+
+/* Receive COW data from the child. The pipe is non blocking and the child
+ * may have sent multiple periodic updates since the last call: drain them
+ * all, the last one is the most recent. Only the final update a child sends
+ * when its work is done is used to populate the per-type last-save stats. */
 void receiveChildInfo(void) {
     if (server.child_info_pipe[0] == -1) return;
     ssize_t wlen = sizeof(server.child_info_data);
-    if (read(server.child_info_pipe[0],&server.child_info_data,wlen) == wlen &&
-        server.child_info_data.magic == CHILD_INFO_MAGIC)
+    while (read(server.child_info_pipe[0],&server.child_info_data,wlen) == wlen &&
+           server.child_info_data.magic == CHILD_INFO_MAGIC)
     {
+        server.stat_current_cow_bytes = server.child_info_data.cow_size;
+        if (!server.child_info_data.final) continue;
         if (server.child_info_data.process_type == CHILD_INFO_TYPE_RDB) {
             server.stat_rdb_cow_bytes = server.child_info_data.cow_size;
         } else if (server.child_info_data.process_type == CHILD_INFO_TYPE_AOF) {
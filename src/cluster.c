@@ -46,6 +46,11 @@
  * that represents this node. */
 clusterNode *myself = NULL;
 
+/* ASK redirect offload counters, reported by CLUSTER INFO. See the
+ * "proxy commands for migrating slots" section below. */
+static long long forward_commands = 0;  /* Commands proxied so far. */
+static long long forward_errors = 0;    /* Commands failed by link errors. */
+
 clusterNode *createClusterNode(char *nodename, int flags);
 int clusterAddNode(clusterNode *node);
 void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -76,6 +81,8 @@ sds representClusterNodeFlags(sds ci, uint16_t flags);
 uint64_t clusterGetMaxEpoch(void);
 int clusterBumpConfigEpochWithoutConsensus(void);
 void moduleCallClusterReceivers(const char *sender_id, uint64_t module_id, uint8_t type, const unsigned char *payload, uint32_t len);
+void slotMigrationCycle(void);
+void clusterMigrateSlotCommand(client *c);
 
 /* -----------------------------------------------------------------------------
  * Initialization
@@ -501,10 +508,11 @@ void clusterInit(void) {
         }
     }
 
-    /* The slots -> keys map is a radix tree. Initialize it here. */
-    server.cluster->slots_to_keys = raxNew();
+    /* Reset the per-slot key counters. */
     memset(server.cluster->slots_keys_count,0,
            sizeof(server.cluster->slots_keys_count));
+    memset(server.cluster->slot_stats,0,
+           sizeof(server.cluster->slot_stats));
 
     /* Set myself->port / cport to my listening ports, we'll just need to
      * discover the IP address via MEET messages. */
@@ -905,6 +913,7 @@ void freeClusterNode(clusterNode *n) {
 
     /* Release link and associated data structures. */
     if (n->link) freeClusterLink(n->link);
+    clusterForwardDropNodeLinks(n);
     listRelease(n->fail_reports);
     zfree(n->slaves);
     zfree(n);
@@ -2054,7 +2063,7 @@ int clusterProcessPacket(clusterLink *link) {
         /* Don't bother creating useless objects if there are no
          * Pub/Sub subscribers. */
         if (dictSize(server.pubsub_channels) ||
-           listLength(server.pubsub_patterns))
+           dictSize(server.pubsub_patterns))
         {
             channel_len = ntohl(hdr->data.publish.msg.channel_len);
             message_len = ntohl(hdr->data.publish.msg.message_len);
@@ -2387,23 +2396,23 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* For PING, PONG, and MEET, fixing the totlen field is up to the caller. */
 }
 
-/* Return non zero if the node is already present in the gossip section of the
- * message pointed by 'hdr' and having 'count' gossip entries. Otherwise
- * zero is returned. Helper for clusterSendPing(). */
-int clusterNodeIsInGossipSection(clusterMsg *hdr, int count, clusterNode *n) {
+/* Return non zero if the node is already present in the gossip section
+ * pointed by 'gossip' and having 'count' entries. Otherwise zero is
+ * returned. Helper for clusterBuildGossipSection(). */
+int clusterNodeIsInGossipSection(clusterMsgDataGossip *gossip, int count,
+                                 clusterNode *n)
+{
     int j;
     for (j = 0; j < count; j++) {
-        if (memcmp(hdr->data.ping.gossip[j].nodename,n->name,
-                CLUSTER_NAMELEN) == 0) break;
+        if (memcmp(gossip[j].nodename,n->name,CLUSTER_NAMELEN) == 0) break;
     }
     return j != count;
 }
 
-/* Set the i-th entry of the gossip section in the message pointed by 'hdr'
- * to the info of the specified node 'n'. */
-void clusterSetGossipEntry(clusterMsg *hdr, int i, clusterNode *n) {
-    clusterMsgDataGossip *gossip;
-    gossip = &(hdr->data.ping.gossip[i]);
+/* Set the i-th entry of the gossip section pointed by 'gossip' to the info
+ * of the specified node 'n'. */
+void clusterSetGossipEntry(clusterMsgDataGossip *gossip, int i, clusterNode *n) {
+    gossip += i;
     memcpy(gossip->nodename,n->name,CLUSTER_NAMELEN);
     gossip->ping_sent = htonl(n->ping_sent/1000);
     gossip->pong_received = htonl(n->pong_received/1000);
@@ -2414,69 +2423,40 @@ void clusterSetGossipEntry(clusterMsg *hdr, int i, clusterNode *n) {
     gossip->notused1 = 0;
 }
 
-/* Send a PING or PONG packet to the specified node, making sure to add enough
- * gossip informations. */
-void clusterSendPing(clusterLink *link, int type) {
-    unsigned char *buf;
-    clusterMsg *hdr;
-    int gossipcount = 0; /* Number of gossip sections added so far. */
-    int wanted; /* Number of gossip sections we want to append if possible. */
-    int totlen; /* Total packet length. */
+/* Gossip section cache: building the random sample of the node table is
+ * the expensive part of clusterSendPing(), and within a short window every
+ * destination can perfectly well receive the same sample. So the section
+ * is built once and reused by every PING/PONG sent until it expires or the
+ * node table visibly changes (size or number of PFAIL nodes), turning a
+ * storm of per-destination sampling passes into a single build plus
+ * memcpys. The on-wire times have one second granularity, so a cache
+ * lifetime well below that does not degrade failure detection. */
+#define CLUSTER_GOSSIP_CACHE_TTL 500 /* Milliseconds. */
+static struct {
+    clusterMsgDataGossip *entries;  /* The prebuilt gossip section. */
+    int count;                      /* Entries actually in the section. */
+    int alloc;                      /* Entries allocated. */
+    unsigned long nodes;            /* Node table size when built. */
+    int pfail;                      /* stats_pfail_nodes when built. */
+    mstime_t build_time;            /* When the section was built. */
+} gossip_cache = {NULL,0,0,0,0,0};
+
+/* Build the gossip section for PING/PONG packets into the cache, sampling
+ * 'wanted' random nodes plus every PFAIL node ('pfail_wanted'). */
+void clusterBuildGossipSection(int wanted, int pfail_wanted) {
+    int gossipcount = 0;
     /* freshnodes is the max number of nodes we can hope to append at all:
      * nodes available minus two (ourself and the node we are sending the
      * message to). However practically there may be less valid nodes since
      * nodes in handshake state, disconnected, are not considered. */
     int freshnodes = dictSize(server.cluster->nodes)-2;
 
-    /* How many gossip sections we want to add? 1/10 of the number of nodes
-     * and anyway at least 3. Why 1/10?
-     *
-     * If we have N masters, with N/10 entries, and we consider that in
-     * node_timeout we exchange with each other node at least 4 packets
-     * (we ping in the worst case in node_timeout/2 time, and we also
-     * receive two pings from the host), we have a total of 8 packets
-     * in the node_timeout*2 falure reports validity time. So we have
-     * that, for a single PFAIL node, we can expect to receive the following
-     * number of failure reports (in the specified window of time):
-     *
-     * PROB * GOSSIP_ENTRIES_PER_PACKET * TOTAL_PACKETS:
-     *
-     * PROB = probability of being featured in a single gossip entry,
-     *        which is 1 / NUM_OF_NODES.
-     * ENTRIES = 10.
-     * TOTAL_PACKETS = 2 * 4 * NUM_OF_MASTERS.
-     *
-     * If we assume we have just masters (so num of nodes and num of masters
-     * is the same), with 1/10 we always get over the majority, and specifically
-     * 80% of the number of nodes, to account for many masters failing at the
-     * same time.
-     *
-     * Since we have non-voting slaves that lower the probability of an entry
-     * to feature our node, we set the number of entries per packet as
-     * 10% of the total nodes we have. */
-    wanted = floor(dictSize(server.cluster->nodes)/10);
-    if (wanted < 3) wanted = 3;
-    if (wanted > freshnodes) wanted = freshnodes;
-
-    /* Include all the nodes in PFAIL state, so that failure reports are
-     * faster to propagate to go from PFAIL to FAIL state. */
-    int pfail_wanted = server.cluster->stats_pfail_nodes;
-
-    /* Compute the maxium totlen to allocate our buffer. We'll fix the totlen
-     * later according to the number of gossip sections we really were able
-     * to put inside the packet. */
-    totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
-    totlen += (sizeof(clusterMsgDataGossip)*(wanted+pfail_wanted));
-    /* Note: clusterBuildMessageHdr() expects the buffer to be always at least
-     * sizeof(clusterMsg) or more. */
-    if (totlen < (int)sizeof(clusterMsg)) totlen = sizeof(clusterMsg);
-    buf = zcalloc(totlen);
-    hdr = (clusterMsg*) buf;
-
-    /* Populate the header. */
-    if (link->node && type == CLUSTERMSG_TYPE_PING)
-        link->node->ping_sent = mstime();
-    clusterBuildMessageHdr(hdr,type);
+    if (wanted+pfail_wanted > gossip_cache.alloc) {
+        gossip_cache.alloc = wanted+pfail_wanted;
+        gossip_cache.entries = zrealloc(gossip_cache.entries,
+            sizeof(clusterMsgDataGossip)*gossip_cache.alloc);
+    }
+    clusterMsgDataGossip *gossip = gossip_cache.entries;
 
     /* Populate the gossip fields */
     int maxiterations = wanted*3;
@@ -2504,10 +2484,10 @@ void clusterSendPing(clusterLink *link, int type) {
         }
 
         /* Do not add a node we already have. */
-        if (clusterNodeIsInGossipSection(hdr,gossipcount,this)) continue;
+        if (clusterNodeIsInGossipSection(gossip,gossipcount,this)) continue;
 
         /* Add it */
-        clusterSetGossipEntry(hdr,gossipcount,this);
+        clusterSetGossipEntry(gossip,gossipcount,this);
         freshnodes--;
         gossipcount++;
     }
@@ -2523,7 +2503,7 @@ void clusterSendPing(clusterLink *link, int type) {
             if (node->flags & CLUSTER_NODE_HANDSHAKE) continue;
             if (node->flags & CLUSTER_NODE_NOADDR) continue;
             if (!(node->flags & CLUSTER_NODE_PFAIL)) continue;
-            clusterSetGossipEntry(hdr,gossipcount,node);
+            clusterSetGossipEntry(gossip,gossipcount,node);
             freshnodes--;
             gossipcount++;
             /* We take the count of the slots we allocated, since the
@@ -2534,10 +2514,85 @@ void clusterSendPing(clusterLink *link, int type) {
         dictReleaseIterator(di);
     }
 
-    /* Ready to send... fix the totlen fiend and queue the message in the
-     * output buffer. */
+    gossip_cache.count = gossipcount;
+    gossip_cache.nodes = dictSize(server.cluster->nodes);
+    gossip_cache.pfail = server.cluster->stats_pfail_nodes;
+    gossip_cache.build_time = mstime();
+}
+
+/* Send a PING or PONG packet to the specified node, making sure to add enough
+ * gossip informations. */
+void clusterSendPing(clusterLink *link, int type) {
+    unsigned char *buf;
+    clusterMsg *hdr;
+    int gossipcount;    /* Number of gossip sections in the packet. */
+    int wanted; /* Number of gossip sections we want to append if possible. */
+    int totlen; /* Total packet length. */
+
+    /* How many gossip sections we want to add? 1/10 of the number of nodes
+     * and anyway at least 3. Why 1/10?
+     *
+     * If we have N masters, with N/10 entries, and we consider that in
+     * node_timeout we exchange with each other node at least 4 packets
+     * (we ping in the worst case in node_timeout/2 time, and we also
+     * receive two pings from the host), we have a total of 8 packets
+     * in the node_timeout*2 falure reports validity time. So we have
+     * that, for a single PFAIL node, we can expect to receive the following
+     * number of failure reports (in the specified window of time):
+     *
+     * PROB * GOSSIP_ENTRIES_PER_PACKET * TOTAL_PACKETS:
+     *
+     * PROB = probability of being featured in a single gossip entry,
+     *        which is 1 / NUM_OF_NODES.
+     * ENTRIES = 10.
+     * TOTAL_PACKETS = 2 * 4 * NUM_OF_MASTERS.
+     *
+     * If we assume we have just masters (so num of nodes and num of masters
+     * is the same), with 1/10 we always get over the majority, and specifically
+     * 80% of the number of nodes, to account for many masters failing at the
+     * same time.
+     *
+     * Since we have non-voting slaves that lower the probability of an entry
+     * to feature our node, we set the number of entries per packet as
+     * 10% of the total nodes we have. */
+    wanted = floor(dictSize(server.cluster->nodes)/10);
+    if (wanted < 3) wanted = 3;
+    if (wanted > (int)dictSize(server.cluster->nodes)-2)
+        wanted = dictSize(server.cluster->nodes)-2;
+
+    /* Include all the nodes in PFAIL state, so that failure reports are
+     * faster to propagate to go from PFAIL to FAIL state. */
+    int pfail_wanted = server.cluster->stats_pfail_nodes;
+
+    /* Reuse the cached gossip section when it is still representative,
+     * otherwise build a fresh one. */
+    if (gossip_cache.entries == NULL ||
+        gossip_cache.nodes != dictSize(server.cluster->nodes) ||
+        gossip_cache.pfail != server.cluster->stats_pfail_nodes ||
+        mstime() - gossip_cache.build_time > CLUSTER_GOSSIP_CACHE_TTL)
+    {
+        clusterBuildGossipSection(wanted,pfail_wanted);
+    }
+    gossipcount = gossip_cache.count;
+
     totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
     totlen += (sizeof(clusterMsgDataGossip)*gossipcount);
+    /* Note: clusterBuildMessageHdr() expects the buffer to be always at least
+     * sizeof(clusterMsg) or more. */
+    int buflen = totlen;
+    if (buflen < (int)sizeof(clusterMsg)) buflen = sizeof(clusterMsg);
+    buf = zcalloc(buflen);
+    hdr = (clusterMsg*) buf;
+
+    /* Populate the header. */
+    if (link->node && type == CLUSTERMSG_TYPE_PING)
+        link->node->ping_sent = mstime();
+    clusterBuildMessageHdr(hdr,type);
+
+    /* Copy the prebuilt gossip section and queue the message in the
+     * output buffer. */
+    memcpy(hdr->data.ping.gossip,gossip_cache.entries,
+           sizeof(clusterMsgDataGossip)*gossipcount);
     hdr->count = htons(gossipcount);
     hdr->totlen = htonl(totlen);
     clusterSendMessage(link,buf,totlen);
@@ -3627,6 +3682,9 @@ void clusterCron(void) {
 
     if (update_state || server.cluster->state == CLUSTER_FAIL)
         clusterUpdateState();
+
+    /* Time out or retire the ASK redirect offload links. */
+    clusterForwardCron();
 }
 
 /* This function is called before the event handler returns to sleep for
@@ -3635,6 +3693,11 @@ void clusterCron(void) {
  * handlers, or to perform potentially expansive tasks that we need to do
  * a single time before replying to clients. */
 void clusterBeforeSleep(void) {
+    /* If a background slot migration is in progress, move a time-bounded
+     * batch of keys to the target node. The function is a cheap no-op when
+     * no migration is active. */
+    slotMigrationCycle();
+
     /* Handle failover, this is needed when it is likely that there is already
      * the quorum from masters in order to react fast. */
     if (server.cluster->todo_before_sleep & CLUSTER_TODO_HANDLE_FAILOVER)
@@ -3932,7 +3995,7 @@ int verifyClusterConfigWithData(void) {
 
     /* Make sure we only have keys in DB0. */
     for (j = 1; j < server.dbnum; j++) {
-        if (dictSize(server.db[j].dict)) return C_ERR;
+        if (dbSize(&server.db[j])) return C_ERR;
     }
 
     /* Check that all the slots we see populated memory have a corresponding
@@ -4129,6 +4192,64 @@ sds clusterGenNodesDescription(int filter) {
  * CLUSTER command
  * -------------------------------------------------------------------------- */
 
+/* Account one dispatched command for 'slot'. Called from processCommand()
+ * right after command execution, where the slot was already computed by
+ * getNodeByQuery(): 'netout' is the number of reply payload bytes produced
+ * by the command. Bytes are payload estimates, protocol framing excluded. */
+void clusterSlotStatsAddCommand(int slot, client *c, unsigned long long netout) {
+    clusterSlotStat *st = &server.cluster->slot_stats[slot];
+
+    if (c->cmd->flags & CMD_WRITE)
+        st->writes++;
+    else
+        st->reads++;
+    for (int j = 0; j < c->argc; j++)
+        st->bytes_in += stringObjectLen(c->argv[j]);
+    st->bytes_out += netout;
+}
+
+/* Estimate the memory used by the keys of 'slot', sampling a few of them
+ * with objectComputeSize() and scaling the average by the slot key count.
+ * Used by CLUSTER SLOT-STATS: cheap enough to run per reported slot. */
+#define CLUSTER_SLOT_MEM_SAMPLES 16
+static unsigned long long clusterSlotMemoryEstimate(int slot) {
+    unsigned int numkeys = countKeysInSlot(slot);
+    if (numkeys == 0) return 0;
+
+    robj *keys[CLUSTER_SLOT_MEM_SAMPLES];
+    unsigned int tosample = numkeys < CLUSTER_SLOT_MEM_SAMPLES ?
+                            numkeys : CLUSTER_SLOT_MEM_SAMPLES;
+    unsigned int sampled = getKeysInSlot(slot,keys,tosample);
+    unsigned long long total = 0;
+    unsigned int used = 0;
+
+    for (unsigned int j = 0; j < sampled; j++) {
+        dictEntry *de = dictFind(dbGetDict(&server.db[0],keys[j]->ptr),
+                                 keys[j]->ptr);
+        if (de) {
+            total += objectComputeSize(dictGetVal(de),5) +
+                     sdsAllocSize(dictGetKey(de)) + sizeof(dictEntry);
+            used++;
+        }
+        decrRefCount(keys[j]);
+    }
+    if (used == 0) return 0;
+    return total / used * numkeys;
+}
+
+/* qsort() helper sorting slot numbers by dispatched commands, descending:
+ * used to implement the TOP filter of CLUSTER SLOT-STATS. */
+static int clusterSlotStatsOpsCmp(const void *a, const void *b) {
+    int sa = *(const int*)a, sb = *(const int*)b;
+    uint64_t oa = server.cluster->slot_stats[sa].reads +
+                  server.cluster->slot_stats[sa].writes;
+    uint64_t ob = server.cluster->slot_stats[sb].reads +
+                  server.cluster->slot_stats[sb].writes;
+
+    if (oa != ob) return oa > ob ? -1 : 1;
+    return sa - sb;
+}
+
 const char *clusterGetMessageTypeString(int type) {
     switch(type) {
     case CLUSTERMSG_TYPE_PING: return "ping";
@@ -4251,6 +4372,9 @@ void clusterCommand(client *c) {
 "INFO - Return onformation about the cluster.",
 "KEYSLOT <key> -- Return the hash slot for <key>.",
 "MEET <ip> <port> [bus-port] -- Connect nodes into a working cluster.",
+"MIGRATESLOT <slot> <node-id> [TIMEOUT <ms>] [AUTH <password>] -- Move the",
+"    keys of <slot> to <node-id> incrementally in the background.",
+"MIGRATESLOT CANCEL -- Abort the background slot migration in progress.",
 "MYID -- Return the node id.",
 "NODES -- Return cluster configuration seen by node. Output format:",
 "    <id> <ip:port> <flags> <master> <pings> <pongs> <epoch> <link> <slot> ... <slot>",
@@ -4258,6 +4382,8 @@ void clusterCommand(client *c) {
 "RESET [hard|soft] -- Reset current node (default: soft).",
 "SET-config-epoch <epoch> - Set config epoch of current node.",
 "SETSLOT <slot> (importing|migrating|stable|node <node-id>) -- Set slot state.",
+"SLOT-STATS [TOP <count>] -- Return per slot traffic counters, key count and",
+"    memory estimate, optionally only for the <count> busiest slots.",
 "REPLICAS <node-id> -- Return <node-id> replicas.",
 "SLOTS -- Return information about slots range mappings. Each range is made of:",
 "    start, end, master and replicas IP addresses, ports and ids",
@@ -4305,7 +4431,7 @@ NULL
         clusterReplyMultiBulkSlots(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"flushslots") && c->argc == 2) {
         /* CLUSTER FLUSHSLOTS */
-        if (dictSize(server.db[0].dict) != 0) {
+        if (dbSize(&server.db[0]) != 0) {
             addReplyError(c,"DB must be empty to perform CLUSTER FLUSHSLOTS.");
             return;
         }
@@ -4459,6 +4585,10 @@ NULL
         }
         clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"migrateslot") && c->argc >= 3) {
+        /* CLUSTER MIGRATESLOT <slot> <node-id> [TIMEOUT <ms>] [AUTH <pw>]
+         * CLUSTER MIGRATESLOT CANCEL */
+        clusterMigrateSlotCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"bumpepoch") && c->argc == 2) {
         /* CLUSTER BUMPEPOCH */
         int retval = clusterBumpConfigEpochWithoutConsensus();
@@ -4537,6 +4667,11 @@ NULL
         info = sdscatprintf(info,
             "cluster_stats_messages_received:%lld\r\n", tot_msg_received);
 
+        info = sdscatprintf(info,
+            "cluster_forwarded_commands:%lld\r\n"
+            "cluster_forward_errors:%lld\r\n",
+            forward_commands, forward_errors);
+
         /* Produce the reply protocol. */
         addReplyVerbatim(c,info,sdslen(info),"txt");
         sdsfree(info);
@@ -4564,6 +4699,60 @@ NULL
             return;
         }
         addReplyLongLong(c,countKeysInSlot(slot));
+    } else if (!strcasecmp(c->argv[1]->ptr,"slot-stats") &&
+               (c->argc == 2 || c->argc == 4))
+    {
+        /* CLUSTER SLOT-STATS [TOP <count>] */
+        long long topk = 0;
+
+        if (c->argc == 4) {
+            if (strcasecmp(c->argv[2]->ptr,"top")) {
+                addReplySubcommandSyntaxError(c);
+                return;
+            }
+            if (getLongLongFromObjectOrReply(c,c->argv[3],&topk,NULL) != C_OK)
+                return;
+            if (topk <= 0) {
+                addReplyError(c,"Invalid count");
+                return;
+            }
+        }
+
+        /* Collect the slots worth reporting: anything with recorded
+         * traffic or at least one key. */
+        int *slots = zmalloc(sizeof(int)*CLUSTER_SLOTS);
+        int numslots = 0;
+        for (int j = 0; j < CLUSTER_SLOTS; j++) {
+            clusterSlotStat *st = &server.cluster->slot_stats[j];
+            if (st->reads == 0 && st->writes == 0 &&
+                countKeysInSlot(j) == 0) continue;
+            slots[numslots++] = j;
+        }
+        if (topk) {
+            qsort(slots,numslots,sizeof(int),clusterSlotStatsOpsCmp);
+            if (topk < numslots) numslots = topk;
+        }
+
+        addReplyArrayLen(c,numslots);
+        for (int j = 0; j < numslots; j++) {
+            clusterSlotStat *st = &server.cluster->slot_stats[slots[j]];
+            addReplyArrayLen(c,2);
+            addReplyLongLong(c,slots[j]);
+            addReplyMapLen(c,6);
+            addReplyBulkCString(c,"reads");
+            addReplyLongLong(c,st->reads);
+            addReplyBulkCString(c,"writes");
+            addReplyLongLong(c,st->writes);
+            addReplyBulkCString(c,"bytes-in");
+            addReplyLongLong(c,st->bytes_in);
+            addReplyBulkCString(c,"bytes-out");
+            addReplyLongLong(c,st->bytes_out);
+            addReplyBulkCString(c,"keys");
+            addReplyLongLong(c,countKeysInSlot(slots[j]));
+            addReplyBulkCString(c,"memory");
+            addReplyLongLong(c,clusterSlotMemoryEstimate(slots[j]));
+        }
+        zfree(slots);
     } else if (!strcasecmp(c->argv[1]->ptr,"getkeysinslot") && c->argc == 4) {
         /* CLUSTER GETKEYSINSLOT <slot> <count> */
         long long maxkeys, slot;
@@ -4638,7 +4827,7 @@ NULL
          * slots nor keys to accept to replicate some other node.
          * Slaves can switch to another master without issues. */
         if (nodeIsMaster(myself) &&
-            (myself->numslots != 0 || dictSize(server.db[0].dict) != 0)) {
+            (myself->numslots != 0 || dbSize(&server.db[0]) != 0)) {
             addReplyError(c,
                 "To set a master the node must be empty and "
                 "without assigned slots.");
@@ -4795,7 +4984,7 @@ NULL
 
         /* Slaves can be reset while containing data, but not master nodes
          * that must be empty. */
-        if (nodeIsMaster(myself) && dictSize(c->db->dict) != 0) {
+        if (nodeIsMaster(myself) && dbSize(c->db) != 0) {
             addReplyError(c,"CLUSTER RESET can't be called with "
                             "master nodes containing keys");
             return;
@@ -4951,7 +5140,7 @@ void restoreCommand(client *c) {
 
     rioInitWithBuffer(&payload,c->argv[3]->ptr);
     if (((type = rdbLoadObjectType(&payload)) == -1) ||
-        ((obj = rdbLoadObject(type,&payload,c->argv[1])) == NULL))
+        ((obj = rdbLoadObject(type,&payload,c->argv[1],1)) == NULL))
     {
         addReplyError(c,"Bad data format");
         return;
@@ -5411,6 +5600,710 @@ socket_err:
     return;
 }
 
+/* -----------------------------------------------------------------------------
+ * Background slot migration
+ *
+ * MIGRATE moves an explicit list of keys and blocks the caller for the whole
+ * DUMP / RESTORE round trip, so resharding a populated slot keeps the event
+ * loop busy for as long as the slot takes to drain. The engine implemented
+ * here moves a whole hash slot instead: once started with CLUSTER MIGRATESLOT
+ * it transfers time-bounded, pipelined batches of RESTORE-ASKING commands
+ * from beforeSleep(), so normal clients keep being served between batches.
+ *
+ * Keys are pulled from the slot's keyspace shard until the slot is empty:
+ * since batches run on the main thread no client write can interleave with
+ * the dump / delete of a key, and keys written into the slot while the
+ * migration is in progress simply show up in a later batch. When the last
+ * key is gone the slot ownership is flipped atomically: we issue CLUSTER
+ * SETSLOT <slot> NODE <target> to the target (that, being in importing
+ * state, bumps its config epoch) and apply the same slot change locally.
+ *
+ * As with manual resharding, the administrator is expected to set the
+ * importing state on the target node before starting the migration. */
+
+/* Keys serialized per pipelined batch. */
+#define SLOT_MIGRATION_BATCH_KEYS 64
+/* Max milliseconds spent migrating per event loop iteration. */
+#define SLOT_MIGRATION_CYCLE_BUDGET 5
+/* Minimum milliseconds between two migration cycles. */
+#define SLOT_MIGRATION_CYCLE_PERIOD 10
+
+static struct slotMigrationState {
+    int active;             /* True if a slot migration is in progress. */
+    int slot;               /* Slot we are migrating. */
+    clusterNode *target;    /* Node receiving the slot. */
+    connection *conn;       /* Private connection to the target. */
+    long timeout;           /* Sync I/O timeout in milliseconds. */
+    unsigned long long keys_migrated; /* Keys moved so far. */
+    mstime_t start_time;    /* When the migration was started. */
+    mstime_t last_cycle;    /* Last time we ran a migration cycle. */
+} slot_migration = {0,0,NULL,NULL,0,0,0,0};
+
+/* Terminate the current slot migration because of an error or an explicit
+ * cancellation. The migrating tag on the slot is left untouched so that the
+ * administrator can inspect the situation and either restart the migration
+ * or clear the state with CLUSTER SETSLOT <slot> STABLE. */
+static void slotMigrationAbort(const char *reason) {
+    serverLog(LL_WARNING,
+        "Background migration of slot %d to %.40s aborted: %s "
+        "(%llu keys were moved)",
+        slot_migration.slot, slot_migration.target->name, reason,
+        slot_migration.keys_migrated);
+    if (slot_migration.conn) connClose(slot_migration.conn);
+    slot_migration.conn = NULL;
+    slot_migration.active = 0;
+}
+
+/* Serialize and transfer up to SLOT_MIGRATION_BATCH_KEYS keys of the
+ * migrating slot, removing from the local database the keys acknowledged
+ * by the target. Returns C_OK if the migration can continue, C_ERR if it
+ * was aborted because of an I/O error or an error reply. */
+static int slotMigrationSendBatch(void) {
+    robj *keys[SLOT_MIGRATION_BATCH_KEYS];
+    robj *sent[SLOT_MIGRATION_BATCH_KEYS];
+    unsigned int numkeys, j, numsent = 0;
+    rio cmd, payload;
+    long timeout = slot_migration.timeout;
+
+    numkeys = getKeysInSlot(slot_migration.slot, keys,
+                            SLOT_MIGRATION_BATCH_KEYS);
+    if (numkeys == 0) return C_OK;
+
+    /* Generate the pipelined RESTORE-ASKING commands. REPLACE is always
+     * used since a previous aborted attempt may have left some of the keys
+     * on the target. */
+    rioInitWithBuffer(&cmd,sdsempty());
+    for (j = 0; j < numkeys; j++) {
+        long long ttl = 0;
+        robj *o = lookupKeyRead(&server.db[0],keys[j]);
+
+        if (o == NULL) {
+            decrRefCount(keys[j]);
+            continue;
+        }
+        long long expireat = getExpire(&server.db[0],keys[j]);
+        if (expireat != -1) {
+            ttl = expireat-mstime();
+            if (ttl < 0) {
+                decrRefCount(keys[j]);
+                continue;
+            }
+            if (ttl < 1) ttl = 1;
+        }
+
+        serverAssert(rioWriteBulkCount(&cmd,'*',5));
+        serverAssert(rioWriteBulkString(&cmd,"RESTORE-ASKING",14));
+        serverAssert(rioWriteBulkString(&cmd,keys[j]->ptr,
+            sdslen(keys[j]->ptr)));
+        serverAssert(rioWriteBulkLongLong(&cmd,ttl));
+        createDumpPayload(&payload,o,keys[j]);
+        serverAssert(rioWriteBulkString(&cmd,payload.io.buffer.ptr,
+            sdslen(payload.io.buffer.ptr)));
+        sdsfree(payload.io.buffer.ptr);
+        serverAssert(rioWriteBulkString(&cmd,"REPLACE",7));
+        sent[numsent++] = keys[j];
+    }
+
+    /* Transfer the query to the target node in 64K chunks. */
+    {
+        sds buf = cmd.io.buffer.ptr;
+        size_t pos = 0, towrite;
+        int nwritten = 0;
+
+        while ((towrite = sdslen(buf)-pos) > 0) {
+            towrite = (towrite > (64*1024) ? (64*1024) : towrite);
+            nwritten = connSyncWrite(slot_migration.conn,buf+pos,towrite,
+                                     timeout);
+            if (nwritten != (signed)towrite) {
+                sdsfree(cmd.io.buffer.ptr);
+                for (j = 0; j < numsent; j++) decrRefCount(sent[j]);
+                slotMigrationAbort("I/O error writing to target");
+                return C_ERR;
+            }
+            pos += nwritten;
+        }
+    }
+    sdsfree(cmd.io.buffer.ptr);
+
+    /* Read the RESTORE replies, removing the acknowledged keys from the
+     * local database. */
+    int error_from_target = 0;
+    robj *delargv[SLOT_MIGRATION_BATCH_KEYS+1];
+    int delargc = 1;
+
+    for (j = 0; j < numsent; j++) {
+        char buf[1024];
+
+        if (connSyncReadLine(slot_migration.conn,buf,sizeof(buf),timeout)
+            <= 0)
+        {
+            error_from_target = 1; /* Keys from here on were not confirmed. */
+            break;
+        }
+        if (buf[0] == '-') {
+            serverLog(LL_WARNING,
+                "Slot migration target replied with error: %s", buf+1);
+            error_from_target = 1;
+            break;
+        }
+        dbDelete(&server.db[0],sent[j]);
+        signalModifiedKey(&server.db[0],sent[j]);
+        server.dirty++;
+        slot_migration.keys_migrated++;
+        delargv[delargc++] = sent[j];
+    }
+
+    /* Propagate the removal of the transferred keys as a single DEL, in
+     * the same way MIGRATE does for the keys it moves. */
+    if (delargc > 1) {
+        delargv[0] = shared.del;
+        if (server.aof_state != AOF_OFF)
+            feedAppendOnlyFile(server.delCommand,0,delargv,delargc);
+        replicationFeedSlaves(server.slaves,0,delargv,delargc);
+    }
+    for (j = 0; j < numsent; j++) decrRefCount(sent[j]);
+
+    if (error_from_target) {
+        slotMigrationAbort("error or timeout reading target replies");
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Called when the migrating slot has no more local keys: atomically flip
+ * the slot ownership by issuing SETSLOT NODE to the target (that bumps its
+ * config epoch being in importing state) and mirroring the change locally. */
+static void slotMigrationFinalize(void) {
+    char buf[1024];
+    sds setslot = sdscatprintf(sdsempty(),
+        "*5\r\n$7\r\nCLUSTER\r\n$7\r\nSETSLOT\r\n$%d\r\n%d\r\n$4\r\nNODE\r\n"
+        "$40\r\n%.40s\r\n",
+        (slot_migration.slot >= 10000) ? 5 :
+        (slot_migration.slot >= 1000)  ? 4 :
+        (slot_migration.slot >= 100)   ? 3 :
+        (slot_migration.slot >= 10)    ? 2 : 1,
+        slot_migration.slot, slot_migration.target->name);
+
+    if (connSyncWrite(slot_migration.conn,setslot,sdslen(setslot),
+                      slot_migration.timeout) != (ssize_t)sdslen(setslot))
+    {
+        sdsfree(setslot);
+        slotMigrationAbort("I/O error finalizing slot handoff");
+        return;
+    }
+    sdsfree(setslot);
+    if (connSyncReadLine(slot_migration.conn,buf,sizeof(buf),
+                         slot_migration.timeout) <= 0)
+    {
+        slotMigrationAbort("I/O error finalizing slot handoff");
+        return;
+    }
+    if (buf[0] == '-') {
+        serverLog(LL_WARNING,
+            "Slot migration target refused SETSLOT: %s", buf+1);
+        slotMigrationAbort("target refused the slot handoff");
+        return;
+    }
+
+    /* Apply the ownership change locally as well: the target configEpoch
+     * bump will make the new configuration win when broadcasted. */
+    int slot = slot_migration.slot;
+    clusterNode *target = slot_migration.target;
+    server.cluster->migrating_slots_to[slot] = NULL;
+    clusterDelSlot(slot);
+    clusterAddSlot(target,slot);
+    clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
+
+    serverLog(LL_NOTICE,
+        "Background migration of slot %d to %.40s completed: "
+        "%llu keys moved in %lld milliseconds",
+        slot, target->name, slot_migration.keys_migrated,
+        (long long)(mstime()-slot_migration.start_time));
+    connClose(slot_migration.conn);
+    slot_migration.conn = NULL;
+    slot_migration.active = 0;
+}
+
+/* Run a time-bounded slot migration cycle. Called from clusterBeforeSleep()
+ * on every event loop iteration: a cheap no-op when no migration is active,
+ * otherwise it transfers batches until the per-cycle time budget is spent
+ * or the slot is drained. */
+void slotMigrationCycle(void) {
+    if (!slot_migration.active) return;
+
+    mstime_t now = mstime();
+    if (now - slot_migration.last_cycle < SLOT_MIGRATION_CYCLE_PERIOD) return;
+    slot_migration.last_cycle = now;
+
+    /* If the target node was removed or demoted while we were migrating
+     * there is no point in continuing. */
+    if (clusterLookupNode(slot_migration.target->name) == NULL ||
+        nodeIsSlave(slot_migration.target))
+    {
+        slotMigrationAbort("target node no longer available");
+        return;
+    }
+
+    mstime_t deadline = now + SLOT_MIGRATION_CYCLE_BUDGET;
+    do {
+        if (countKeysInSlot(slot_migration.slot) == 0) {
+            slotMigrationFinalize();
+            return;
+        }
+        if (slotMigrationSendBatch() == C_ERR) return;
+    } while (mstime() < deadline);
+}
+
+/* CLUSTER MIGRATESLOT <slot> <node-id> [TIMEOUT <ms>] [AUTH <password>]
+ * CLUSTER MIGRATESLOT CANCEL
+ *
+ * Start (or cancel) the background migration of a hash slot. */
+void clusterMigrateSlotCommand(client *c) {
+    long long timeout = 10000; /* Default sync I/O timeout. */
+    sds auth = NULL;
+    clusterNode *n;
+    int slot, j;
+
+    if (!strcasecmp(c->argv[2]->ptr,"cancel") && c->argc == 3) {
+        if (!slot_migration.active) {
+            addReplyError(c,"No slot migration in progress");
+            return;
+        }
+        slotMigrationAbort("canceled by user");
+        addReply(c,shared.ok);
+        return;
+    }
+
+    if (c->argc < 4) {
+        addReplyError(c,
+            "Invalid CLUSTER MIGRATESLOT arguments. Try CLUSTER HELP");
+        return;
+    }
+    if ((slot = getSlotOrReply(c,c->argv[2])) == -1) return;
+    for (j = 4; j < c->argc; j += 2) {
+        int moreargs = j < c->argc-1;
+        if (!strcasecmp(c->argv[j]->ptr,"timeout") && moreargs) {
+            if (getLongLongFromObjectOrReply(c,c->argv[j+1],&timeout,NULL)
+                != C_OK) return;
+            if (timeout <= 0) timeout = 10000;
+        } else if (!strcasecmp(c->argv[j]->ptr,"auth") && moreargs) {
+            auth = c->argv[j+1]->ptr;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    if (slot_migration.active) {
+        addReplyErrorFormat(c,
+            "A migration of slot %d is already in progress",
+            slot_migration.slot);
+        return;
+    }
+    if (nodeIsSlave(myself)) {
+        addReplyError(c,"Only masters can migrate slots");
+        return;
+    }
+    if (server.cluster->slots[slot] != myself) {
+        addReplyErrorFormat(c,"I'm not the owner of hash slot %u",slot);
+        return;
+    }
+    if ((n = clusterLookupNode(c->argv[3]->ptr)) == NULL) {
+        addReplyErrorFormat(c,"I don't know about node %s",
+            (char*)c->argv[3]->ptr);
+        return;
+    }
+    if (n == myself) {
+        addReplyError(c,"I'm already the owner of that hash slot");
+        return;
+    }
+    if (nodeIsSlave(n)) {
+        addReplyError(c,"The specified node is not a master");
+        return;
+    }
+
+    /* Connect to the target with a private connection: the migration is
+     * long lived and must not share state with the MIGRATE socket cache. */
+    connection *conn = server.tls_cluster ?
+        connCreateTLS() : connCreateSocket();
+    if (connBlockingConnect(conn,n->ip,n->port,timeout) != C_OK) {
+        connClose(conn);
+        addReplySds(c,
+            sdsnew("-IOERR error or timeout connecting to the target\r\n"));
+        return;
+    }
+    connEnableTcpNoDelay(conn);
+
+    /* Authenticate now so that later cycles can assume a ready connection. */
+    if (auth) {
+        char buf[1024];
+        sds authcmd = sdscatprintf(sdsempty(),
+            "*2\r\n$4\r\nAUTH\r\n$%lu\r\n%s\r\n",
+            (unsigned long)sdslen(auth), auth);
+        ssize_t authlen = sdslen(authcmd);
+        ssize_t res = connSyncWrite(conn,authcmd,authlen,timeout);
+        sdsfree(authcmd);
+        if (res != authlen ||
+            connSyncReadLine(conn,buf,sizeof(buf),timeout) <= 0 ||
+            buf[0] == '-')
+        {
+            connClose(conn);
+            addReplyError(c,"Unable to authenticate with the target node");
+            return;
+        }
+    }
+
+    slot_migration.active = 1;
+    slot_migration.slot = slot;
+    slot_migration.target = n;
+    slot_migration.conn = conn;
+    slot_migration.timeout = timeout;
+    slot_migration.keys_migrated = 0;
+    slot_migration.start_time = mstime();
+    slot_migration.last_cycle = 0;
+
+    /* Tag the slot as migrating so that clients accessing missing keys of
+     * the slot are redirected with -ASK, exactly as with manual
+     * resharding. The importing side must be set by the administrator. */
+    server.cluster->migrating_slots_to[slot] = n;
+    serverLog(LL_NOTICE,
+        "Background migration of slot %d to %.40s started (%d keys)",
+        slot, n->name, countKeysInSlot(slot));
+    addReply(c,shared.ok);
+}
+
+/* -----------------------------------------------------------------------------
+ * ASK redirect offload: proxy commands for migrating slots
+ * -----------------------------------------------------------------------------
+ *
+ * While a slot is migrating, clients pay two round trips for every key
+ * that already moved: the -ASK redirect, then ASKING plus the command
+ * re-issued against the import target. With cluster-forward-asking
+ * enabled the node owning the migrating slot proxies the command
+ * itself: it opens an ordinary client connection to the import target,
+ * pipelines ASKING plus the original command on it, and relays the raw
+ * reply bytes back to the issuing client, which stays blocked in the
+ * meantime. A single link per target node is shared by every forwarded
+ * client, so during a resharding the extra hop is amortized by
+ * pipelining and client-visible latency stays flat. */
+
+#define FORWARD_LINK_IDLE_TIMEOUT 10000 /* Drop unused links after 10s. */
+
+typedef struct forwardRequest {
+    uint64_t client_id;     /* Waiting client id, or 0 when the reply is
+                               just discarded (ASKING, AUTH). */
+    mstime_t ctime;         /* When the request was queued. */
+} forwardRequest;
+
+typedef struct forwardLink {
+    clusterNode *node;      /* Import target this link points to. */
+    connection *conn;
+    sds sndbuf;             /* Commands not yet written to the socket. */
+    sds rcvbuf;             /* Reply bytes not yet parsed. */
+    list *requests;         /* forwardRequest FIFO, one per expected reply. */
+    int connected;          /* Connect handshake completed. */
+    mstime_t last_use;      /* Last time a command was queued. */
+} forwardLink;
+
+static list *forward_links = NULL;      /* Every active forwardLink. */
+
+/* Return the number of bytes of the first complete RESP reply inside
+ * 'buf', 0 if the reply is still incomplete, -1 on protocol errors. */
+static ssize_t forwardReplyLength(const char *buf, size_t len) {
+    const char *nl;
+    long long count, j;
+    size_t consumed;
+
+    if (len == 0) return 0;
+    nl = memchr(buf,'\n',len);
+    if (nl == NULL) return (len > PROTO_INLINE_MAX_SIZE) ? -1 : 0;
+    switch (buf[0]) {
+    case '+':
+    case '-':
+    case ':':
+        return (nl-buf)+1;
+    case '$':
+        if (!string2ll(buf+1,(nl-1)-(buf+1),&count)) return -1;
+        if (count < 0) return (nl-buf)+1; /* Null bulk. */
+        consumed = (nl-buf)+1+count+2;
+        return (len >= consumed) ? (ssize_t)consumed : 0;
+    case '*':
+        if (!string2ll(buf+1,(nl-1)-(buf+1),&count)) return -1;
+        consumed = (nl-buf)+1;
+        if (count < 0) return consumed; /* Null array. */
+        for (j = 0; j < count; j++) {
+            ssize_t elen = forwardReplyLength(buf+consumed,len-consumed);
+            if (elen <= 0) return elen;
+            consumed += elen;
+        }
+        return consumed;
+    default:
+        return -1;
+    }
+}
+
+/* Fail every request still waiting on 'link' replying -TRYAGAIN, so the
+ * client retries and gets the plain -ASK redirect, then free the link. */
+static void forwardLinkFail(forwardLink *link, const char *reason) {
+    listNode *ln;
+
+    serverLog(LL_VERBOSE,"Forward link to %.40s failed: %s",
+        link->node->name, reason);
+    while ((ln = listFirst(link->requests)) != NULL) {
+        forwardRequest *req = ln->value;
+        uint64_t id = req->client_id;
+
+        zfree(req);
+        listDelNode(link->requests,ln);
+        if (id == 0) continue;
+        forward_errors++;
+        client *c = lookupClientByID(id);
+        if (c && (c->flags & CLIENT_BLOCKED) && c->btype == BLOCKED_FORWARD) {
+            addReplySds(c,sdscatprintf(sdsempty(),
+                "-TRYAGAIN Forwarding to the import target failed (%s)\r\n",
+                reason));
+            unblockClient(c);
+        }
+    }
+    listRelease(link->requests);
+    sdsfree(link->sndbuf);
+    sdsfree(link->rcvbuf);
+    connClose(link->conn);
+    listDelNode(forward_links,listSearchKey(forward_links,link));
+    zfree(link);
+}
+
+static void forwardLinkWriteHandler(connection *conn) {
+    forwardLink *link = connGetPrivateData(conn);
+    ssize_t nwritten;
+
+    nwritten = connWrite(conn,link->sndbuf,sdslen(link->sndbuf));
+    if (nwritten <= 0) {
+        forwardLinkFail(link,"I/O error writing to the import target");
+        return;
+    }
+    sdsrange(link->sndbuf,nwritten,-1);
+    if (sdslen(link->sndbuf) == 0)
+        connSetWriteHandler(conn,NULL);
+}
+
+/* Consume the reply stream of the link: every complete reply resolves
+ * the oldest queued request, relaying the raw protocol verbatim to the
+ * blocked client that is waiting for it. */
+static void forwardLinkReadHandler(connection *conn) {
+    forwardLink *link = connGetPrivateData(conn);
+    char buf[PROTO_IOBUF_LEN];
+    ssize_t nread;
+
+    nread = connRead(conn,buf,sizeof(buf));
+    if (nread == -1) {
+        if (connGetState(conn) == CONN_STATE_CONNECTED) return;
+        forwardLinkFail(link,"I/O error reading from the import target");
+        return;
+    } else if (nread == 0) {
+        forwardLinkFail(link,"connection with the import target closed");
+        return;
+    }
+
+    link->rcvbuf = sdscatlen(link->rcvbuf,buf,nread);
+    while (sdslen(link->rcvbuf)) {
+        ssize_t framelen = forwardReplyLength(link->rcvbuf,
+                                              sdslen(link->rcvbuf));
+        if (framelen == 0) break;
+        if (framelen < 0 || listLength(link->requests) == 0) {
+            forwardLinkFail(link,"protocol error from the import target");
+            return;
+        }
+
+        listNode *ln = listFirst(link->requests);
+        forwardRequest *req = ln->value;
+        uint64_t id = req->client_id;
+
+        /* Remove the request before unblocking, so that the unblock
+         * hook finds nothing left to clean up for this client. */
+        zfree(req);
+        listDelNode(link->requests,ln);
+        if (id) {
+            client *c = lookupClientByID(id);
+            if (c && (c->flags & CLIENT_BLOCKED) &&
+                c->btype == BLOCKED_FORWARD)
+            {
+                addReplyProto(c,link->rcvbuf,framelen);
+                unblockClient(c);
+            }
+        }
+        sdsrange(link->rcvbuf,framelen,-1);
+    }
+}
+
+static void forwardLinkConnectHandler(connection *conn) {
+    forwardLink *link = connGetPrivateData(conn);
+
+    if (connGetState(conn) != CONN_STATE_CONNECTED) {
+        forwardLinkFail(link,"can't connect to the import target");
+        return;
+    }
+    link->connected = 1;
+    connEnableTcpNoDelay(conn);
+    connSetReadHandler(conn,forwardLinkReadHandler);
+    if (sdslen(link->sndbuf))
+        connSetWriteHandler(conn,forwardLinkWriteHandler);
+}
+
+/* Append 'len' bytes of commands expecting a single reply to the link,
+ * to be delivered to 'client_id' (or discarded if zero). */
+static void forwardLinkQueue(forwardLink *link, uint64_t client_id,
+                             const char *buf, size_t len)
+{
+    forwardRequest *req = zmalloc(sizeof(*req));
+
+    req->client_id = client_id;
+    req->ctime = mstime();
+    listAddNodeTail(link->requests,req);
+    if (link->connected && sdslen(link->sndbuf) == 0)
+        connSetWriteHandler(link->conn,forwardLinkWriteHandler);
+    link->sndbuf = sdscatlen(link->sndbuf,buf,len);
+    link->last_use = mstime();
+}
+
+/* Return the forward link with 'node', creating and connecting it if
+ * this is the first forwarded command, or NULL if the connection can't
+ * even be initiated. */
+static forwardLink *getForwardLink(clusterNode *node) {
+    listIter li;
+    listNode *ln;
+    forwardLink *link;
+
+    if (forward_links == NULL) forward_links = listCreate();
+    listRewind(forward_links,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        link = ln->value;
+        if (link->node == node) return link;
+    }
+
+    link = zmalloc(sizeof(*link));
+    link->node = node;
+    link->sndbuf = sdsempty();
+    link->rcvbuf = sdsempty();
+    link->requests = listCreate();
+    link->connected = 0;
+    link->last_use = mstime();
+    link->conn = server.tls_cluster ? connCreateTLS() : connCreateSocket();
+    connSetPrivateData(link->conn,link);
+    if (connConnect(link->conn,node->ip,node->port,NET_FIRST_BIND_ADDR,
+                    forwardLinkConnectHandler) == -1)
+    {
+        connClose(link->conn);
+        listRelease(link->requests);
+        sdsfree(link->sndbuf);
+        sdsfree(link->rcvbuf);
+        zfree(link);
+        return NULL;
+    }
+    listAddNodeTail(forward_links,link);
+
+    /* The target checks credentials on this ordinary client connection:
+     * authenticate like a replica would with its master. */
+    if (server.masterauth) {
+        sds auth;
+        if (server.masteruser) {
+            auth = sdscatprintf(sdsempty(),
+                "*3\r\n$4\r\nAUTH\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n",
+                strlen(server.masteruser), server.masteruser,
+                strlen(server.masterauth), server.masterauth);
+        } else {
+            auth = sdscatprintf(sdsempty(),
+                "*2\r\n$4\r\nAUTH\r\n$%zu\r\n%s\r\n",
+                strlen(server.masterauth), server.masterauth);
+        }
+        forwardLinkQueue(link,0,auth,sdslen(auth));
+        sdsfree(auth);
+    }
+    return link;
+}
+
+/* Try to forward the current command of 'c' to the import target 'n'
+ * instead of replying -ASK. On C_OK the client is blocked waiting for
+ * the relayed reply; on C_ERR the caller falls back to the redirect. */
+int clusterForwardCommand(client *c, clusterNode *n) {
+    forwardLink *link;
+
+    if (!server.cluster_forward_asking) return C_ERR;
+    /* Transactions, scripts and replication links have execution
+     * guarantees a proxied command can't honor; commands that may block
+     * would stall every request pipelined behind them on the link. */
+    if (c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE|
+                    CLIENT_MASTER|CLIENT_SLAVE)) return C_ERR;
+    if (commandMayBlockClient(c->cmd)) return C_ERR;
+    if (nodeFailed(n) || nodeTimedOut(n)) return C_ERR;
+    if ((link = getForwardLink(n)) == NULL) return C_ERR;
+
+    forwardLinkQueue(link,0,"*1\r\n$6\r\nASKING\r\n",16);
+    sds cmdbuf = catAppendOnlyGenericCommand(sdsempty(),c->argc,c->argv);
+    forwardLinkQueue(link,c->id,cmdbuf,sdslen(cmdbuf));
+    sdsfree(cmdbuf);
+    forward_commands++;
+
+    c->bpop.timeout = mstime()+server.cluster_node_timeout;
+    blockClient(c,BLOCKED_FORWARD);
+    return C_OK;
+}
+
+/* Called by unblockClient() when a client blocked on a forwarded
+ * command goes away (or times out) before the reply arrives: detach it
+ * from the request so the late reply is discarded. */
+void clusterForwardUnblockClient(client *c) {
+    listIter li, ri;
+    listNode *ln, *rn;
+
+    if (forward_links == NULL) return;
+    listRewind(forward_links,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        forwardLink *link = ln->value;
+        listRewind(link->requests,&ri);
+        while ((rn = listNext(&ri)) != NULL) {
+            forwardRequest *req = rn->value;
+            if (req->client_id == c->id) req->client_id = 0;
+        }
+    }
+}
+
+/* Called from clusterCron(): fail links whose oldest request waited
+ * longer than the node timeout, and drop links idle for too long. */
+void clusterForwardCron(void) {
+    listIter li;
+    listNode *ln;
+    mstime_t now = mstime();
+
+    if (forward_links == NULL) return;
+    listRewind(forward_links,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        forwardLink *link = ln->value;
+        if (listLength(link->requests)) {
+            forwardRequest *req = listFirst(link->requests)->value;
+            if (now - req->ctime > server.cluster_node_timeout)
+                forwardLinkFail(link,"timeout waiting for the import target");
+        } else if (now - link->last_use > FORWARD_LINK_IDLE_TIMEOUT) {
+            forwardLinkFail(link,"idle"); /* Nothing pending: just closes. */
+        }
+    }
+}
+
+/* Called when 'node' is deleted from the nodes table: its link (if any)
+ * can't be trusted anymore. */
+void clusterForwardDropNodeLinks(clusterNode *node) {
+    listIter li;
+    listNode *ln;
+
+    if (forward_links == NULL) return;
+    listRewind(forward_links,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        forwardLink *link = ln->value;
+        if (link->node == node)
+            forwardLinkFail(link,"the import target was removed");
+    }
+}
+
 /* -----------------------------------------------------------------------------
  * Cluster functions related to serving / redirecting clients
  * -------------------------------------------------------------------------- */
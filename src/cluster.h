@@ -135,6 +135,16 @@ typedef struct clusterNode {
     list *fail_reports;         /* List of nodes signaling this as failing */
 } clusterNode;
 
+/* Per-slot traffic counters, maintained at command dispatch time and
+ * reported by CLUSTER SLOT-STATS so that rebalancing tools can move hot
+ * slots instead of just evenly sized slot ranges. */
+typedef struct clusterSlotStat {
+    uint64_t reads;     /* Non-write commands dispatched to the slot. */
+    uint64_t writes;    /* Write commands dispatched to the slot. */
+    uint64_t bytes_in;  /* Payload bytes of the command arguments. */
+    uint64_t bytes_out; /* Payload bytes of the generated replies. */
+} clusterSlotStat;
+
 typedef struct clusterState {
     clusterNode *myself;  /* This node */
     uint64_t currentEpoch;
@@ -146,7 +156,7 @@ typedef struct clusterState {
     clusterNode *importing_slots_from[CLUSTER_SLOTS];
     clusterNode *slots[CLUSTER_SLOTS];
     uint64_t slots_keys_count[CLUSTER_SLOTS];
-    rax *slots_to_keys;
+    clusterSlotStat slot_stats[CLUSTER_SLOTS];
     /* The following fields are used to take the slave state on elections. */
     mstime_t failover_auth_time; /* Time of previous or next election. */
     int failover_auth_count;    /* Number of votes received so far. */
@@ -280,6 +290,11 @@ typedef struct {
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
 int clusterRedirectBlockedClientIfNeeded(client *c);
+void clusterSlotStatsAddCommand(int slot, client *c, unsigned long long netout);
 void clusterRedirectClient(client *c, clusterNode *n, int hashslot, int error_code);
+int clusterForwardCommand(client *c, clusterNode *n);
+void clusterForwardUnblockClient(client *c);
+void clusterForwardCron(void);
+void clusterForwardDropNodeLinks(clusterNode *node);
 
 #endif /* __CLUSTER_H */
@@ -0,0 +1,553 @@
+/* coldtier.c -- Off-heap value tiering for cold data.
+ *
+ * With an LFU maxmemory policy, values whose frequency counter decayed to
+ * zero are demoted to an append-only log on disk (ideally NVMe backed):
+ * the serialized payload is written by a bio thread and the value in the
+ * keyspace is replaced with a small stub (OBJ_ENCODING_COLD). The key,
+ * the expire and all the metadata stay in RAM, so the keyspace remains
+ * fully addressable and only the value bytes tier out.
+ *
+ * When a command touches a cold value the client is parked like blocked.c
+ * does for blocking operations, a bio thread reads the payload back, and
+ * the command is executed in beforeSleep() once the value is resident
+ * again. Contexts that cannot block (scripts, MULTI, replication) fault
+ * the value in synchronously instead.
+ *
+ * The log is append only and never compacted in place: it is recreated
+ * empty at startup, since a fresh boot reloads every value from the RDB
+ * or AOF file anyway (persistence always stores the real payload, never
+ * the stubs).
+ *
+ * Copyright (c) 2024, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be
+ *     used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bio.h"
+#include "rdb.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Values whose serialized payload is smaller than this are not demoted:
+ * the stub plus the log entry would save close to nothing. */
+#define COLD_TIER_MIN_PAYLOAD 64
+
+/* Keys sampled from each database per cron cycle. */
+#define COLD_TIER_CRON_SAMPLES 20
+
+/* A payload queued to a bio thread for appending to the log. The record
+ * owns the payload buffer; the stub points back at it through 'cv' so
+ * that faults arriving before the write completed are served from
+ * memory. 'cv' is NULL when the stub was freed in the meantime. Only the
+ * bio thread touches 'payload' and 'offset' while the job is in flight,
+ * everything else is main thread only. */
+typedef struct coldPendingWrite {
+    sds payload;
+    uint64_t offset;
+    struct coldValue *cv;
+    int failed;             /* Write error: keep the payload resident. */
+} coldPendingWrite;
+
+/* robj->ptr of an OBJ_ENCODING_COLD stub. */
+typedef struct coldValue {
+    uint64_t offset;        /* Payload offset inside the log. */
+    uint64_t len;           /* Payload length in bytes. */
+    int rdbtype;            /* RDB_TYPE_* of the serialized payload. */
+    coldPendingWrite *pw;   /* Not yet durable payload, or NULL. */
+} coldValue;
+
+/* A background fault: the payload bytes a parked client is waiting for.
+ * The buffer is allocated by the main thread, filled by the bio thread,
+ * and consumed by coldTierHandleCompletions(). */
+typedef struct coldFault {
+    uint64_t client_id;     /* Parked client, resolved by ID since the
+                             * client may be freed while we read. */
+    int db_id;
+    sds key;
+    uint64_t offset;
+    uint64_t len;
+    sds buf;                /* Payload destination, cv->len bytes. */
+    int failed;             /* Read error: leave the value cold. */
+} coldFault;
+
+static struct {
+    int fd;                     /* Log file, -1 when the tier is off. */
+    uint64_t tail;              /* Next append offset. */
+    list *completed;            /* coldPendingWrite/coldFault done by bio
+                                 * threads, drained in beforeSleep(). The
+                                 * two types are told apart by the lists
+                                 * they live in. */
+    list *completed_faults;
+    pthread_mutex_t lock;       /* Guards the two lists above. */
+    long long keys;             /* Stubs alive in the keyspace. */
+    long long bytes;            /* Payload bytes tiered out. */
+    long long demotions;        /* Values demoted since startup. */
+    long long faults;           /* Values faulted back since startup. */
+} cold_tier = {-1,0,NULL,NULL,PTHREAD_MUTEX_INITIALIZER,0,0,0,0};
+
+int coldTierEnabled(void) {
+    return cold_tier.fd != -1;
+}
+
+/* Open (truncating) the log file at startup. On failure the tier is just
+ * disabled: it is an optimization, not a dependency. */
+void coldTierInit(void) {
+    if (server.cold_tier_file == NULL) return;
+    cold_tier.fd = open(server.cold_tier_file,
+                        O_CREAT|O_RDWR|O_TRUNC,0644);
+    if (cold_tier.fd == -1) {
+        serverLog(LL_WARNING,
+            "Can't open the cold tier file %s (%s): cold tiering disabled.",
+            server.cold_tier_file,strerror(errno));
+        return;
+    }
+    cold_tier.completed = listCreate();
+    cold_tier.completed_faults = listCreate();
+    serverLog(LL_NOTICE,"Cold value tier active at %s",
+        server.cold_tier_file);
+}
+
+/* ------------------------------ Demotion --------------------------------- */
+
+/* Called from a bio thread: append the payload at its reserved offset. */
+void coldTierBioWrite(void *arg) {
+    coldPendingWrite *pw = arg;
+    size_t len = sdslen(pw->payload), written = 0;
+
+    while (written < len) {
+        ssize_t n = pwrite(cold_tier.fd,pw->payload+written,
+                           len-written,pw->offset+written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            pw->failed = 1;
+            break;
+        }
+        written += n;
+    }
+    pthread_mutex_lock(&cold_tier.lock);
+    listAddNodeTail(cold_tier.completed,pw);
+    pthread_mutex_unlock(&cold_tier.lock);
+}
+
+/* Demote the value at 'de' (an entry of the dict 'd' of database 'db'):
+ * serialize it, reserve space in the log, queue the write to a bio
+ * thread, and swap a stub into the keyspace. The payload stays resident
+ * (owned by the pending write record) until the bio thread confirms it
+ * reached the log, so faults can always be served.
+ *
+ * Returns 1 if the value was demoted. */
+static int coldTierDemoteEntry(dict *d, dictEntry *de) {
+    robj *val = dictGetVal(de);
+    robj keyobj;
+    rio payload;
+    unsigned char typebuf[1];
+
+    initStaticStringObject(keyobj,dictGetKey(de));
+    rioInitWithBuffer(&payload,sdsempty());
+    if (rdbSaveObject(&payload,val,&keyobj) == -1) {
+        sdsfree(payload.io.buffer.ptr);
+        return 0;
+    }
+    if (sdslen(payload.io.buffer.ptr) < COLD_TIER_MIN_PAYLOAD) {
+        sdsfree(payload.io.buffer.ptr);
+        return 0;
+    }
+    /* Fetch the RDB type byte the payload will be loaded back with. */
+    rio typerio;
+    rioInitWithBuffer(&typerio,sdsempty());
+    if (rdbSaveObjectType(&typerio,val) == -1) {
+        sdsfree(typerio.io.buffer.ptr);
+        sdsfree(payload.io.buffer.ptr);
+        return 0;
+    }
+    typebuf[0] = ((unsigned char*)typerio.io.buffer.ptr)[0];
+    sdsfree(typerio.io.buffer.ptr);
+
+    coldValue *cv = zmalloc(sizeof(*cv));
+    coldPendingWrite *pw = zmalloc(sizeof(*pw));
+    pw->payload = payload.io.buffer.ptr;
+    pw->offset = cold_tier.tail;
+    pw->cv = cv;
+    pw->failed = 0;
+    cv->offset = pw->offset;
+    cv->len = sdslen(pw->payload);
+    cv->rdbtype = typebuf[0];
+    cv->pw = pw;
+    cold_tier.tail += cv->len;
+
+    robj *stub = createObject(val->type,cv);
+    stub->encoding = OBJ_ENCODING_COLD;
+    stub->lru = val->lru;
+    dictSetVal(d,de,stub);
+    decrRefCount(val);
+
+    cold_tier.keys++;
+    cold_tier.bytes += cv->len;
+    cold_tier.demotions++;
+    bioCreateBackgroundJob(BIO_COLD_WRITE,pw,NULL,NULL);
+    return 1;
+}
+
+/* Cron cycle: sample random keys and demote the ones whose LFU counter
+ * decayed to zero. Registered as a cron task, 'budget_usec' bounds the
+ * time spent per call. */
+void coldTierCron(long long budget_usec) {
+    long long start = ustime();
+
+    if (!coldTierEnabled()) return;
+    if (!(server.maxmemory_policy & MAXMEMORY_FLAG_LFU)) return;
+    /* Swapping values while a child is saving would trigger copy on
+     * write for no benefit: the sample will still be cold later. */
+    if (hasActiveChildProcess()) return;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dict *d = db->dict[rand() % server.db_dict_shards];
+        dictEntry *des[COLD_TIER_CRON_SAMPLES];
+        unsigned int count, i;
+
+        if (dictSize(d) == 0) continue;
+        count = dictGetSomeKeys(d,des,COLD_TIER_CRON_SAMPLES);
+        for (i = 0; i < count; i++) {
+            robj *val = dictGetVal(des[i]);
+
+            if (val->refcount != 1) continue; /* Shared objects. */
+            if (val->encoding == OBJ_ENCODING_COLD ||
+                val->encoding == OBJ_ENCODING_LAZY) continue;
+            if (val->type == OBJ_MODULE) continue;
+            if (LFUDecrAndReturn(val) != 0) continue;
+            coldTierDemoteEntry(d,des[i]);
+        }
+        if (ustime()-start > budget_usec) break;
+    }
+}
+
+/* ---------------------------- Faulting back ------------------------------ */
+
+/* Read 'len' bytes of payload at 'offset' into 'buf'. Returns C_OK. */
+static int coldTierReadAt(char *buf, uint64_t offset, uint64_t len) {
+    uint64_t nread = 0;
+
+    while (nread < len) {
+        ssize_t n = pread(cold_tier.fd,buf+nread,len-nread,offset+nread);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            return C_ERR;
+        }
+        nread += n;
+    }
+    return C_OK;
+}
+
+/* Deserialize the payload of the stub 'o' from the buffer 'payload'
+ * ('cv->len' bytes) and return the materialized value. */
+static robj *coldValueDecode(robj *key, robj *o, char *payload) {
+    coldValue *cv = o->ptr;
+    rio r;
+    sds buf = sdsnewlen(payload,cv->len);
+
+    rioInitWithBuffer(&r,buf);
+    robj *val = rdbLoadObject(cv->rdbtype,&r,key,0);
+    sdsfree(buf);
+    if (val == NULL)
+        serverPanic("Corrupted cold tier payload for key '%s'",
+            (char*)key->ptr);
+    return val;
+}
+
+/* Materialize the cold value stored at the dict entry 'de' of 'db',
+ * replace it in place, and return the materialized object. The payload
+ * is read synchronously when it is not resident anymore: this is the
+ * fallback for every context that cannot park the client. */
+robj *coldValueMaterialize(redisDb *db, robj *key, dictEntry *de) {
+    robj *o = dictGetVal(de);
+    robj *val = coldValueLoad(key,o);
+
+    val->lru = o->lru;
+    dictSetVal(dbGetDict(db,key->ptr),de,val);
+    decrRefCount(o);
+    cold_tier.faults++;
+    return val;
+}
+
+/* As coldValueMaterialize(), but returns a fresh object WITHOUT touching
+ * the keyspace: the stub stays in place. Used by readers that work on a
+ * temporary copy, like the AOF rewrite (possibly in the child process). */
+robj *coldValueLoad(robj *key, robj *o) {
+    coldValue *cv = o->ptr;
+    robj *val;
+
+    if (cv->pw) {
+        val = coldValueDecode(key,o,cv->pw->payload);
+    } else {
+        char *buf = zmalloc(cv->len);
+        if (coldTierReadAt(buf,cv->offset,cv->len) != C_OK)
+            serverPanic("Can't read the cold tier payload for key '%s'",
+                (char*)key->ptr);
+        val = coldValueDecode(key,o,buf);
+        zfree(buf);
+    }
+    return val;
+}
+
+/* Called from a bio thread: fill the fault buffer from the log. */
+void coldTierBioRead(void *arg) {
+    coldFault *cf = arg;
+
+    if (coldTierReadAt(cf->buf,cf->offset,cf->len) != C_OK)
+        cf->failed = 1;
+    pthread_mutex_lock(&cold_tier.lock);
+    listAddNodeTail(cold_tier.completed_faults,cf);
+    pthread_mutex_unlock(&cold_tier.lock);
+}
+
+/* If the command parsed into c->argv reads or writes values currently in
+ * the cold tier, queue a background fault for each of them and park the
+ * client (BLOCKED_COLD). Returns 1 if the client was parked: the command
+ * is executed by coldTierHandleCompletions() once every payload is
+ * resident. Returns 0 when there is nothing to wait for.
+ *
+ * Clients that cannot block (scripts, MULTI, masters, modules) are never
+ * parked here: lookupKey() materializes synchronously for them. */
+int coldTierBlockClientIfNeeded(client *c) {
+    int *keys, numkeys, j, faults = 0;
+
+    if (!coldTierEnabled() || cold_tier.keys == 0) return 0;
+    if (c->flags & (CLIENT_MASTER|CLIENT_LUA|CLIENT_MULTI|CLIENT_MODULE))
+        return 0;
+    if (server.loading) return 0;
+    if (c->cmd->firstkey == 0 && c->cmd->getkeys_proc == NULL) return 0;
+
+    keys = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+    for (j = 0; j < numkeys; j++) {
+        sds keyname = c->argv[keys[j]]->ptr;
+        dictEntry *de = dictFind(dbGetDict(c->db,keyname),keyname);
+        robj *val;
+        coldValue *cv;
+
+        if (de == NULL) continue;
+        val = dictGetVal(de);
+        if (val->encoding != OBJ_ENCODING_COLD) continue;
+        cv = val->ptr;
+        /* The payload is still resident while the demotion write is in
+         * flight: materializing is a memory copy, no need to park. */
+        if (cv->pw) {
+            coldValueMaterialize(c->db,c->argv[keys[j]],de);
+            continue;
+        }
+        coldFault *cf = zmalloc(sizeof(*cf));
+        cf->client_id = c->id;
+        cf->db_id = c->db->id;
+        cf->key = sdsdup(keyname);
+        cf->offset = cv->offset;
+        cf->len = cv->len;
+        cf->buf = sdsnewlen(SDS_NOINIT,cv->len);
+        cf->failed = 0;
+        faults++;
+        bioCreateBackgroundJob(BIO_COLD_READ,cf,NULL,NULL);
+    }
+    getKeysFreeResult(keys);
+    if (faults == 0) return 0;
+
+    c->cold_faults = faults;
+    c->bpop.timeout = 0; /* Disk reads complete: no timeout needed. */
+    blockClient(c,BLOCKED_COLD);
+    return 1;
+}
+
+/* unblockClient() hook for BLOCKED_COLD: forget the outstanding faults.
+ * Their completions will still warm the values, they just won't find a
+ * parked client anymore. */
+void coldTierUnblockClient(client *c) {
+    c->cold_faults = 0;
+}
+
+/* Drain the work completed by the bio threads: release (or retain, on
+ * write errors) demotion payloads, install faulted values back into the
+ * keyspace, and execute the commands of the clients that were parked on
+ * them. Called from beforeSleep(). */
+void coldTierHandleCompletions(void) {
+    list *writes = NULL, *faults = NULL;
+    listNode *ln;
+
+    if (!coldTierEnabled()) return;
+    if (listLength(cold_tier.completed) == 0 &&
+        listLength(cold_tier.completed_faults) == 0)
+    {
+        /* Both lists are only ever filled by bio threads: peeking at the
+         * length without the lock can only miss fresh completions, that
+         * the next iteration will pick up. */
+        return;
+    }
+
+    pthread_mutex_lock(&cold_tier.lock);
+    if (listLength(cold_tier.completed)) {
+        writes = cold_tier.completed;
+        cold_tier.completed = listCreate();
+    }
+    if (listLength(cold_tier.completed_faults)) {
+        faults = cold_tier.completed_faults;
+        cold_tier.completed_faults = listCreate();
+    }
+    pthread_mutex_unlock(&cold_tier.lock);
+
+    while (writes && (ln = listFirst(writes)) != NULL) {
+        coldPendingWrite *pw = ln->value;
+        listDelNode(writes,ln);
+        if (pw->failed) {
+            serverLog(LL_WARNING,
+                "Cold tier write failed: keeping the payload in memory.");
+            /* The stub keeps pointing at the resident payload through
+             * 'pw': freed together with the stub. */
+            if (pw->cv == NULL) {
+                sdsfree(pw->payload);
+                zfree(pw);
+            }
+        } else {
+            if (pw->cv) pw->cv->pw = NULL;
+            sdsfree(pw->payload);
+            zfree(pw);
+        }
+    }
+    if (writes) listRelease(writes);
+
+    while (faults && (ln = listFirst(faults)) != NULL) {
+        coldFault *cf = ln->value;
+        listDelNode(faults,ln);
+
+        /* Install the value, unless the key was deleted, rewritten or
+         * already faulted back in the meantime: the offset check tells a
+         * re-demoted key apart from the entry we queued the read for. */
+        if (cf->db_id < server.dbnum) {
+            redisDb *db = server.db+cf->db_id;
+            dictEntry *de = dictFind(dbGetDict(db,cf->key),cf->key);
+            if (de) {
+                robj *val = dictGetVal(de);
+                if (val->encoding == OBJ_ENCODING_COLD &&
+                    ((coldValue*)val->ptr)->offset == cf->offset &&
+                    ((coldValue*)val->ptr)->pw == NULL)
+                {
+                    /* An unreadable payload that is still referenced is
+                     * lost data, exactly as in the synchronous path. */
+                    if (cf->failed)
+                        serverPanic(
+                            "Can't read the cold tier payload for key '%s'",
+                            cf->key);
+                    robj keyobj;
+                    initStaticStringObject(keyobj,cf->key);
+                    robj *warm = coldValueDecode(&keyobj,val,cf->buf);
+                    warm->lru = val->lru;
+                    dictSetVal(dbGetDict(db,cf->key),de,warm);
+                    decrRefCount(val);
+                    cold_tier.faults++;
+                }
+            }
+        }
+
+        /* Wake the parked client up once its last fault completed. A
+         * failed read is handled by the synchronous path when the
+         * command runs again. */
+        client *c = lookupClientByID(cf->client_id);
+        if (c && (c->flags & CLIENT_BLOCKED) && c->btype == BLOCKED_COLD) {
+            if (--c->cold_faults == 0) {
+                unblockClient(c);
+                processCommandAndResetClient(c);
+            }
+        }
+        sdsfree(cf->key);
+        sdsfree(cf->buf);
+        zfree(cf);
+    }
+    if (faults) listRelease(faults);
+}
+
+/* ------------------------- Object plumbing ------------------------------- */
+
+/* Free a cold stub: called by decrRefCount() in place of the per-type
+ * free functions. Runs on the main thread (cold stubs are never handed
+ * to the lazy free path: they are a few dozen bytes). */
+void coldValueFree(robj *o) {
+    coldValue *cv = o->ptr;
+
+    if (cv->pw) {
+        /* The write is still in flight (or failed): the record now only
+         * has to release the payload once the bio thread is done. On a
+         * failed write the record was already drained, free it here. */
+        if (cv->pw->failed) {
+            sdsfree(cv->pw->payload);
+            zfree(cv->pw);
+        } else {
+            cv->pw->cv = NULL;
+        }
+    }
+    cold_tier.keys--;
+    cold_tier.bytes -= cv->len;
+    zfree(cv);
+}
+
+/* Memory reported for a cold stub: the payload lives on disk. */
+size_t coldValueMemUsage(robj *o) {
+    UNUSED(o);
+    return sizeof(coldValue);
+}
+
+/* The RDB type byte and the raw payload of a cold stub, for the save
+ * code to copy the serialization verbatim instead of faulting the value
+ * in. The returned sds is owned by the caller. Also safe in the fork
+ * child: pread() does not move the shared file offset. */
+int coldValueRdbType(robj *o) {
+    return ((coldValue*)o->ptr)->rdbtype;
+}
+
+sds coldValueGetPayload(robj *o) {
+    coldValue *cv = o->ptr;
+
+    if (cv->pw) return sdsdup(cv->pw->payload);
+    sds buf = sdsnewlen(SDS_NOINIT,cv->len);
+    if (coldTierReadAt(buf,cv->offset,cv->len) != C_OK) {
+        sdsfree(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* INFO fields, appended to the Stats section. */
+sds coldTierAppendInfo(sds info) {
+    return sdscatprintf(info,
+        "cold_tier_keys:%lld\r\n"
+        "cold_tier_bytes:%lld\r\n"
+        "cold_tier_log_bytes:%llu\r\n"
+        "cold_tier_demotions:%lld\r\n"
+        "cold_tier_faults:%lld\r\n",
+        cold_tier.keys,
+        cold_tier.bytes,
+        (unsigned long long) cold_tier.tail,
+        cold_tier.demotions,
+        cold_tier.faults);
+}
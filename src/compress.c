@@ -0,0 +1,130 @@
+/* compress.c -- Pluggable compression codecs.
+ *
+ * Historically both the RDB code and the quicklist only knew about LZF.
+ * This file turns the compressor into a small engine so that alternative
+ * codecs with different speed/ratio trade offs can be selected per
+ * subsystem via the configuration, without every call site hardcoding a
+ * specific library. All the codecs share the same calling convention,
+ * documented in compress.h.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "compress.h"
+#include "lzf.h"
+
+#include <string.h>
+#include <strings.h>
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+/* ----------------------------- LZF backend ------------------------------- */
+
+static size_t lzfCodecCompress(const void *in, size_t inlen, void *out,
+                               size_t outlen)
+{
+    return lzf_compress(in, inlen, out, outlen);
+}
+
+static size_t lzfCodecDecompress(const void *in, size_t inlen, void *out,
+                                 size_t outlen)
+{
+    return lzf_decompress(in, inlen, out, outlen);
+}
+
+/* ----------------------------- LZ4 backend ------------------------------- */
+
+#ifdef USE_LZ4
+static size_t lz4CodecCompress(const void *in, size_t inlen, void *out,
+                               size_t outlen)
+{
+    if (inlen > LZ4_MAX_INPUT_SIZE) return 0;
+    int clen = LZ4_compress_default(in, out, inlen, outlen);
+    return clen <= 0 ? 0 : (size_t)clen;
+}
+
+static size_t lz4CodecDecompress(const void *in, size_t inlen, void *out,
+                                 size_t outlen)
+{
+    int dlen = LZ4_decompress_safe(in, out, inlen, outlen);
+    return dlen <= 0 ? 0 : (size_t)dlen;
+}
+#endif
+
+/* ---------------------------- Zstandard backend -------------------------- */
+
+#ifdef USE_ZSTD
+static size_t zstdCodecCompress(const void *in, size_t inlen, void *out,
+                                size_t outlen)
+{
+    size_t clen = ZSTD_compress(out, outlen, in, inlen, ZSTD_CLEVEL_DEFAULT);
+    return ZSTD_isError(clen) ? 0 : clen;
+}
+
+static size_t zstdCodecDecompress(const void *in, size_t inlen, void *out,
+                                  size_t outlen)
+{
+    size_t dlen = ZSTD_decompress(out, outlen, in, inlen);
+    return ZSTD_isError(dlen) ? 0 : dlen;
+}
+#endif
+
+/* ------------------------------ Codec table ------------------------------ */
+
+static compressCodec codecs[] = {
+    {COMPRESS_CODEC_LZF, "lzf", lzfCodecCompress, lzfCodecDecompress},
+#ifdef USE_LZ4
+    {COMPRESS_CODEC_LZ4, "lz4", lz4CodecCompress, lz4CodecDecompress},
+#endif
+#ifdef USE_ZSTD
+    {COMPRESS_CODEC_ZSTD, "zstd", zstdCodecCompress, zstdCodecDecompress},
+#endif
+};
+
+#define COMPRESS_CODECS_NUM (sizeof(codecs)/sizeof(codecs[0]))
+
+/* Return the codec with the given identifier, or NULL if the codec is
+ * unknown or was not compiled in. */
+compressCodec *compressCodecById(int id) {
+    for (unsigned int j = 0; j < COMPRESS_CODECS_NUM; j++)
+        if (codecs[j].id == id) return &codecs[j];
+    return NULL;
+}
+
+/* Return the codec with the given name, or NULL if the codec is unknown
+ * or was not compiled in. */
+compressCodec *compressCodecByName(const char *name) {
+    for (unsigned int j = 0; j < COMPRESS_CODECS_NUM; j++)
+        if (!strcasecmp(codecs[j].name, name)) return &codecs[j];
+    return NULL;
+}
@@ -0,0 +1,62 @@
+/* compress.h -- Pluggable compression codecs used by the RDB and quicklist
+ * code. LZF is always compiled in and remains the default; LZ4 and Zstandard
+ * are optional and only available when the server is built with USE_LZ4=yes
+ * or USE_ZSTD=yes against the system libraries.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <stddef.h>
+
+/* Codec identifiers. The identifier of the codec used to compress a blob
+ * is persisted on disk (see RDB_ENC_CODEC in rdb.h), so the values below
+ * must never be changed or reused. */
+#define COMPRESS_CODEC_LZF 0
+#define COMPRESS_CODEC_LZ4 1
+#define COMPRESS_CODEC_ZSTD 2
+
+typedef struct compressCodec {
+    int id;             /* One of the COMPRESS_CODEC_* identifiers. */
+    const char *name;   /* Codec name as exposed in the configuration. */
+    /* Compress 'inlen' bytes from 'in' into 'out', that has room for
+     * 'outlen' bytes. Return the compressed length, or 0 if the input is
+     * not compressible within 'outlen' bytes. */
+    size_t (*compress)(const void *in, size_t inlen, void *out, size_t outlen);
+    /* Decompress 'inlen' bytes from 'in' into 'out', that has room for
+     * the original 'outlen' bytes. Return the decompressed length, or 0
+     * if the input is corrupted. */
+    size_t (*decompress)(const void *in, size_t inlen, void *out, size_t outlen);
+} compressCodec;
+
+compressCodec *compressCodecById(int id);
+compressCodec *compressCodecByName(const char *name);
+
+#endif
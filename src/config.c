@@ -30,6 +30,8 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "compress.h"
+#include "bio.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -98,6 +100,23 @@ configEnum repl_diskless_load_enum[] = {
     {NULL, 0}
 };
 
+configEnum compress_codec_enum[] = {
+    {"lzf", COMPRESS_CODEC_LZF},
+    {"lz4", COMPRESS_CODEC_LZ4},
+    {"zstd", COMPRESS_CODEC_ZSTD},
+    {NULL, 0}
+};
+
+/* Like compress_codec_enum but with an extra entry to disable the
+ * feature, used by repl-stream-compression. */
+configEnum repl_stream_compression_enum[] = {
+    {"no", -1},
+    {"lzf", COMPRESS_CODEC_LZF},
+    {"lz4", COMPRESS_CODEC_LZ4},
+    {"zstd", COMPRESS_CODEC_ZSTD},
+    {NULL, 0}
+};
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -435,6 +454,7 @@ void loadServerConfigFromString(char *config) {
                     err = "Target command name already exists"; goto loaderr;
                 }
             }
+            rebuildCommandLookupFastTable();
         } else if (!strcasecmp(argv[0],"cluster-config-file") && argc == 2) {
             zfree(server.cluster_configfile);
             server.cluster_configfile = zstrdup(argv[1]);
@@ -2013,6 +2033,21 @@ static int isValidActiveDefrag(int val, char **err) {
     return 1;
 }
 
+static int isValidCompressCodec(int val, char **err) {
+    if (compressCodecById(val) == NULL) {
+        *err = "The selected compression codec was not compiled in: "
+               "rebuild the server with USE_LZ4=yes and/or USE_ZSTD=yes "
+               "to enable the lz4 and zstd codecs";
+        return 0;
+    }
+    return 1;
+}
+
+static int isValidReplStreamCompression(int val, char **err) {
+    if (val == -1) return 1; /* Compression disabled. */
+    return isValidCompressCodec(val,err);
+}
+
 static int isValidDBfilename(char *val, char **err) {
     if (!pathIsBaseName(val)) {
         *err = "dbfilename can't be a path, just a filename";
@@ -2029,6 +2064,13 @@ static int isValidAOFfilename(char *val, char **err) {
     return 1;
 }
 
+static int updateBusyPollMaxUsec(long long val, long long prev, char **err) {
+    UNUSED(prev);
+    UNUSED(err);
+    aeSetBusyPollDuration(server.el, val);
+    return 1;
+}
+
 static int updateHZ(long long val, long long prev, char **err) {
     UNUSED(prev);
     UNUSED(err);
@@ -2041,6 +2083,23 @@ static int updateHZ(long long val, long long prev, char **err) {
     return 1;
 }
 
+static int updateSharedObjectCacheSize(long long val, long long prev, char **err) {
+    UNUSED(prev);
+    UNUSED(err);
+    sharedObjectCacheResize(val);
+    return 1;
+}
+
+static int updateRdbIncremental(int val, int prev, char **err) {
+    UNUSED(val);
+    UNUSED(err);
+    /* Turning the option on or off makes the tracked key sets no longer
+     * cover every change since the base snapshot: a new full save is
+     * needed before delta saves can work (again). */
+    if (val != prev) rdbDeltaInvalidate();
+    return 1;
+}
+
 static int updateJemallocBgThread(int val, int prev, char **err) {
     UNUSED(prev);
     UNUSED(err);
@@ -2048,6 +2107,56 @@ static int updateJemallocBgThread(int val, int prev, char **err) {
     return 1;
 }
 
+static int updateListCompressAsync(int val, int prev, char **err) {
+    UNUSED(prev);
+    UNUSED(err);
+    quicklistSetAsyncCompression(val);
+    return 1;
+}
+
+static int updateReplyCacheSize(long long val, long long prev, char **err) {
+    UNUSED(err);
+    /* Shrinking (or disabling) the cache just drops all the entries:
+     * they are rebuilt on demand by the next GETs. */
+    if (val < prev) replyCacheFlush(-1);
+    return 1;
+}
+
+static int updateReplyCacheCmdBytes(long long val, long long prev, char **err) {
+    UNUSED(err);
+    /* Disabling drops everything at once; a mere shrink is enforced
+     * lazily by the LRU eviction on the next insertion. */
+    if (val == 0 && prev != 0) replyCacheFlush(-1);
+    return 1;
+}
+
+static int updateEncodingConvertAsync(int val, int prev, char **err) {
+    UNUSED(prev);
+    UNUSED(err);
+    objConvertSetAsync(val);
+    return 1;
+}
+
+static int updateIOThreadsNum(long long val, long long prev, char **err) {
+    if (resizeIOThreads(val) == C_ERR) {
+        /* Retire any worker we managed to spawn before failing. */
+        resizeIOThreads(prev);
+        *err = "Unable to spawn the new I/O threads, check server logs";
+        return 0;
+    }
+    return 1;
+}
+
+static int updateTcpBacklog(long long val, long long prev, char **err) {
+    UNUSED(val);
+    UNUSED(prev);
+    if (applyTcpBacklog() == C_ERR) {
+        *err = "Unable to update the backlog on the listening sockets";
+        return 0;
+    }
+    return 1;
+}
+
 static int updateReplBacklogSize(long long val, long long prev, char **err) {
     /* resizeReplicationBacklog sets server.repl_backlog_size, and relies on
      * being able to tell when the size changes, so restore prev becore calling it. */
@@ -2057,6 +2166,32 @@ static int updateReplBacklogSize(long long val, long long prev, char **err) {
     return 1;
 }
 
+static int updateMaxidletime(long long val, long long prev, char **err) {
+    UNUSED(prev);
+    UNUSED(err);
+    /* Retarget the timeout table entries of the connected clients so that
+     * the new limit takes effect promptly, both when it is raised and when
+     * it is lowered, and so that clients created while the timeout was
+     * disabled get an entry. Blocked clients are skipped: their entry
+     * tracks the blocking deadline and is retargeted on unblock. */
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+        if (c->conn == NULL || c->flags & CLIENT_BLOCKED) continue;
+        if (val == 0) {
+            removeClientFromTimeoutTable(c);
+        } else {
+            mstime_t deadline = ((mstime_t)c->lastinteraction + val) * 1000;
+            if (deadline < server.mstime+1000) deadline = server.mstime+1000;
+            addClientToTimeoutTable(c,deadline);
+        }
+    }
+    return 1;
+}
+
 static int updateMaxmemory(long long val, long long prev, char **err) {
     UNUSED(prev);
     UNUSED(err);
@@ -2137,32 +2272,55 @@ standardConfig configs[] = {
     createBoolConfig("rdbchecksum", NULL, IMMUTABLE_CONFIG, server.rdb_checksum, 1, NULL, NULL),
     createBoolConfig("daemonize", NULL, IMMUTABLE_CONFIG, server.daemonize, 0, NULL, NULL),
     createBoolConfig("io-threads-do-reads", NULL, IMMUTABLE_CONFIG, server.io_threads_do_reads, 0,NULL, NULL), /* Read + parse from threads? */
+    createBoolConfig("io-threads-do-execute", NULL, IMMUTABLE_CONFIG, server.io_threads_do_execute, 0,NULL, NULL), /* Run fast read-only commands from threads? */
+    createBoolConfig("io-threads-do-lookups", NULL, MODIFIABLE_CONFIG, server.io_threads_do_lookups, 0,NULL, NULL), /* Parallelize large MGET lookups? */
+    createBoolConfig("tcp-reuseport", NULL, IMMUTABLE_CONFIG, server.tcp_reuseport, 0, NULL, NULL), /* Accept clients on SO_REUSEPORT sharded listeners? */
+    createBoolConfig("fast-path-commands", NULL, MODIFIABLE_CONFIG, server.fast_path_commands, 0, NULL, NULL), /* Specialized GET/SET/EXISTS/INCR dispatch. */
     createBoolConfig("lua-replicate-commands", NULL, IMMUTABLE_CONFIG, server.lua_always_replicate_commands, 1, NULL, NULL),
+    createBoolConfig("propagate-coalescing", NULL, MODIFIABLE_CONFIG, server.propagate_coalescing, 1, NULL, NULL),
     createBoolConfig("always-show-logo", NULL, IMMUTABLE_CONFIG, server.always_show_logo, 0, NULL, NULL),
     createBoolConfig("protected-mode", NULL, MODIFIABLE_CONFIG, server.protected_mode, 1, NULL, NULL),
     createBoolConfig("rdbcompression", NULL, MODIFIABLE_CONFIG, server.rdb_compression, 1, NULL, NULL),
+    createBoolConfig("rdb-mmap-format", NULL, MODIFIABLE_CONFIG, server.rdb_mmap_format, 0, NULL, NULL),
+    createBoolConfig("startup-warmup", NULL, MODIFIABLE_CONFIG, server.startup_warmup, 0, NULL, NULL),
+    createBoolConfig("rdb-incremental", NULL, MODIFIABLE_CONFIG, server.rdb_incremental, 0, NULL, updateRdbIncremental),
     createBoolConfig("activerehashing", NULL, MODIFIABLE_CONFIG, server.activerehashing, 1, NULL, NULL),
+    createBoolConfig("background-rehashing", NULL, MODIFIABLE_CONFIG, server.background_rehashing, 0, NULL, NULL),
+    createBoolConfig("list-compress-async", NULL, MODIFIABLE_CONFIG, server.list_compress_async, 1, NULL, updateListCompressAsync), /* Compress quicklist nodes in a bio thread. */
+    createBoolConfig("encoding-convert-async", NULL, MODIFIABLE_CONFIG, server.encoding_convert_async, 0, NULL, updateEncodingConvertAsync), /* Convert hash/set encodings in a bio thread. */
     createBoolConfig("stop-writes-on-bgsave-error", NULL, MODIFIABLE_CONFIG, server.stop_writes_on_bgsave_err, 1, NULL, NULL),
     createBoolConfig("dynamic-hz", NULL, MODIFIABLE_CONFIG, server.dynamic_hz, 1, NULL, NULL), /* Adapt hz to # of clients.*/
+    createBoolConfig("client-output-buffer-backpressure", NULL, MODIFIABLE_CONFIG, server.obuf_backpressure, 0, NULL, NULL), /* Suspend slow clients instead of closing them. */
+    createBoolConfig("lru-ghost-second-chance", NULL, MODIFIABLE_CONFIG, server.lru_ghost_second_chance, 0, NULL, NULL), /* Second chance for evicted-then-recreated keys. */
     createBoolConfig("lazyfree-lazy-eviction", NULL, MODIFIABLE_CONFIG, server.lazyfree_lazy_eviction, 0, NULL, NULL),
     createBoolConfig("lazyfree-lazy-expire", NULL, MODIFIABLE_CONFIG, server.lazyfree_lazy_expire, 0, NULL, NULL),
     createBoolConfig("lazyfree-lazy-server-del", NULL, MODIFIABLE_CONFIG, server.lazyfree_lazy_server_del, 0, NULL, NULL),
+    createBoolConfig("lazyfree-lazy-user-flush", NULL, MODIFIABLE_CONFIG, server.lazyfree_lazy_user_flush, 0, NULL, NULL),
+    createIntConfig("lazyfree-threads", NULL, IMMUTABLE_CONFIG, 1, BIO_LAZYFREE_MAX_THREADS, server.lazyfree_threads, 1, INTEGER_CONFIG, NULL, NULL), /* Single lazy free worker by default. */
+    createBoolConfig("notify-keyspace-batch", NULL, MODIFIABLE_CONFIG, server.notify_keyspace_batch, 0, NULL, NULL),
     createBoolConfig("repl-disable-tcp-nodelay", NULL, MODIFIABLE_CONFIG, server.repl_disable_tcp_nodelay, 0, NULL, NULL),
     createBoolConfig("repl-diskless-sync", NULL, MODIFIABLE_CONFIG, server.repl_diskless_sync, 0, NULL, NULL),
     createBoolConfig("gopher-enabled", NULL, MODIFIABLE_CONFIG, server.gopher_enabled, 0, NULL, NULL),
+    createBoolConfig("inline-commands", NULL, MODIFIABLE_CONFIG, server.inline_commands, 1, NULL, NULL),
+    createBoolConfig("resp-protocol-lock", NULL, MODIFIABLE_CONFIG, server.resp_protocol_lock, 0, NULL, NULL), /* Lock RESP connections to the multibulk protocol. */
     createBoolConfig("aof-rewrite-incremental-fsync", NULL, MODIFIABLE_CONFIG, server.aof_rewrite_incremental_fsync, 1, NULL, NULL),
     createBoolConfig("no-appendfsync-on-rewrite", NULL, MODIFIABLE_CONFIG, server.aof_no_fsync_on_rewrite, 0, NULL, NULL),
     createBoolConfig("cluster-require-full-coverage", NULL, MODIFIABLE_CONFIG, server.cluster_require_full_coverage, 1, NULL, NULL),
+    createBoolConfig("cluster-forward-asking", NULL, MODIFIABLE_CONFIG, server.cluster_forward_asking, 0, NULL, NULL),
     createBoolConfig("rdb-save-incremental-fsync", NULL, MODIFIABLE_CONFIG, server.rdb_save_incremental_fsync, 1, NULL, NULL),
     createBoolConfig("aof-load-truncated", NULL, MODIFIABLE_CONFIG, server.aof_load_truncated, 1, NULL, NULL),
     createBoolConfig("aof-use-rdb-preamble", NULL, MODIFIABLE_CONFIG, server.aof_use_rdb_preamble, 1, NULL, NULL),
+    createBoolConfig("aof-async-write", NULL, MODIFIABLE_CONFIG, server.aof_async_write, 0, NULL, NULL),
+    createBoolConfig("aof-rewrite-no-fork", NULL, MODIFIABLE_CONFIG, server.aof_rewrite_no_fork, 0, NULL, NULL),
     createBoolConfig("cluster-replica-no-failover", "cluster-slave-no-failover", MODIFIABLE_CONFIG, server.cluster_slave_no_failover, 0, NULL, NULL), /* Failover by default. */
     createBoolConfig("replica-lazy-flush", "slave-lazy-flush", MODIFIABLE_CONFIG, server.repl_slave_lazy_flush, 0, NULL, NULL),
+    createBoolConfig("replica-free-expired-values", NULL, MODIFIABLE_CONFIG, server.replica_free_expired_values, 0, NULL, NULL),
     createBoolConfig("replica-serve-stale-data", "slave-serve-stale-data", MODIFIABLE_CONFIG, server.repl_serve_stale_data, 1, NULL, NULL),
     createBoolConfig("replica-read-only", "slave-read-only", MODIFIABLE_CONFIG, server.repl_slave_ro, 1, NULL, NULL),
     createBoolConfig("replica-ignore-maxmemory", "slave-ignore-maxmemory", MODIFIABLE_CONFIG, server.repl_slave_ignore_maxmemory, 1, NULL, NULL),
     createBoolConfig("jemalloc-bg-thread", NULL, MODIFIABLE_CONFIG, server.jemalloc_bg_thread, 1, NULL, updateJemallocBgThread),
     createBoolConfig("activedefrag", NULL, MODIFIABLE_CONFIG, server.active_defrag_enabled, 0, isValidActiveDefrag, NULL),
+    createBoolConfig("active-defrag-forecast", NULL, MODIFIABLE_CONFIG, server.active_defrag_forecast, 1, NULL, NULL),
     createBoolConfig("syslog-enabled", NULL, IMMUTABLE_CONFIG, server.syslog_enabled, 0, NULL, NULL),
     createBoolConfig("cluster-enabled", NULL, IMMUTABLE_CONFIG, server.cluster_enabled, 0, NULL, NULL),
     createBoolConfig("appendonly", NULL, MODIFIABLE_CONFIG, server.aof_enabled, 0, NULL, updateAppendonly),
@@ -2171,6 +2329,14 @@ standardConfig configs[] = {
     createStringConfig("aclfile", NULL, IMMUTABLE_CONFIG, ALLOW_EMPTY_STRING, server.acl_filename, "", NULL, NULL),
     createStringConfig("unixsocket", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.unixsocket, NULL, NULL, NULL),
     createStringConfig("pidfile", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.pidfile, NULL, NULL, NULL),
+    createStringConfig("cold-tier-file", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.cold_tier_file, NULL, NULL, NULL),
+    createStringConfig("repl-backlog-file", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.repl_backlog_file, NULL, NULL, NULL),
+    createStringConfig("audit-log", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.audit_log, NULL, NULL, NULL),
+    createStringConfig("server_cpulist", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.server_cpulist, NULL, NULL, NULL),
+    createStringConfig("pubsub-conflation-channels", NULL, MODIFIABLE_CONFIG, EMPTY_STRING_IS_NULL, server.pubsub_conflation_channels, NULL, NULL, NULL),
+    createStringConfig("bio_cpulist", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.bio_cpulist, NULL, NULL, NULL),
+    createStringConfig("aof_rewrite_cpulist", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.aof_rewrite_cpulist, NULL, NULL, NULL),
+    createStringConfig("bgsave_cpulist", NULL, IMMUTABLE_CONFIG, EMPTY_STRING_IS_NULL, server.bgsave_cpulist, NULL, NULL, NULL),
     createStringConfig("replica-announce-ip", "slave-announce-ip", MODIFIABLE_CONFIG, EMPTY_STRING_IS_NULL, server.slave_announce_ip, NULL, NULL, NULL),
     createStringConfig("masteruser", NULL, MODIFIABLE_CONFIG, EMPTY_STRING_IS_NULL, server.masteruser, NULL, NULL, NULL),
     createStringConfig("masterauth", NULL, MODIFIABLE_CONFIG, EMPTY_STRING_IS_NULL, server.masterauth, NULL, NULL, NULL),
@@ -2186,11 +2352,20 @@ standardConfig configs[] = {
     createEnumConfig("loglevel", NULL, MODIFIABLE_CONFIG, loglevel_enum, server.verbosity, LL_NOTICE, NULL, NULL),
     createEnumConfig("maxmemory-policy", NULL, MODIFIABLE_CONFIG, maxmemory_policy_enum, server.maxmemory_policy, MAXMEMORY_NO_EVICTION, NULL, NULL),
     createEnumConfig("appendfsync", NULL, MODIFIABLE_CONFIG, aof_fsync_enum, server.aof_fsync, AOF_FSYNC_EVERYSEC, NULL, NULL),
+    createEnumConfig("rdb-compress-codec", NULL, MODIFIABLE_CONFIG, compress_codec_enum, server.rdb_compress_codec, COMPRESS_CODEC_LZF, isValidCompressCodec, NULL),
+    createEnumConfig("repl-stream-compression", NULL, MODIFIABLE_CONFIG, repl_stream_compression_enum, server.repl_stream_compression, -1, isValidReplStreamCompression, NULL),
+    createEnumConfig("list-compress-codec", NULL, IMMUTABLE_CONFIG, compress_codec_enum, server.list_compress_codec, COMPRESS_CODEC_LZF, isValidCompressCodec, NULL),
 
     /* Integer configs */
     createIntConfig("databases", NULL, IMMUTABLE_CONFIG, 1, INT_MAX, server.dbnum, 16, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("db-dict-shards", NULL, IMMUTABLE_CONFIG, 1, 16384, server.db_dict_shards, 1, INTEGER_CONFIG, NULL, NULL), /* Keyspace hash table shards per DB. */
     createIntConfig("port", NULL, IMMUTABLE_CONFIG, 0, 65535, server.port, 6379, INTEGER_CONFIG, NULL, NULL), /* TCP port. */
-    createIntConfig("io-threads", NULL, IMMUTABLE_CONFIG, 1, 512, server.io_threads_num, 1, INTEGER_CONFIG, NULL, NULL), /* Single threaded by default */
+    createIntConfig("admin-port", NULL, IMMUTABLE_CONFIG, 0, 65535, server.admin_port, 0, INTEGER_CONFIG, NULL, NULL), /* Inline-friendly admin TCP port. */
+    createIntConfig("io-threads", NULL, MODIFIABLE_CONFIG, 1, 128, server.io_threads_num, 1, INTEGER_CONFIG, NULL, updateIOThreadsNum), /* Single threaded by default. Max is IO_THREADS_MAX_NUM. */
+    createIntConfig("shared-object-cache-size", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.shared_object_cache_size, 0, INTEGER_CONFIG, NULL, updateSharedObjectCacheSize), /* Disabled by default */
+    createIntConfig("reply-cache-size", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.reply_cache_size, 0, INTEGER_CONFIG, NULL, updateReplyCacheSize), /* Disabled by default */
+    createSizeTConfig("reply-cache-command-bytes", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.reply_cache_cmd_bytes, 0, MEMORY_CONFIG, NULL, updateReplyCacheCmdBytes), /* Disabled by default */
+    createIntConfig("scan-sessions-max", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.scan_sessions_max, 0, INTEGER_CONFIG, NULL, NULL), /* Disabled by default */
     createIntConfig("auto-aof-rewrite-percentage", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.aof_rewrite_perc, 100, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("cluster-replica-validity-factor", "cluster-slave-validity-factor", MODIFIABLE_CONFIG, 0, INT_MAX, server.cluster_slave_validity_factor, 10, INTEGER_CONFIG, NULL, NULL), /* Slave max data age factor. */
     createIntConfig("list-max-ziplist-size", NULL, MODIFIABLE_CONFIG, INT_MIN, INT_MAX, server.list_max_ziplist_size, -2, INTEGER_CONFIG, NULL, NULL),
@@ -2200,24 +2375,38 @@ standardConfig configs[] = {
     createIntConfig("active-defrag-cycle-max", NULL, MODIFIABLE_CONFIG, 1, 99, server.active_defrag_cycle_max, 25, INTEGER_CONFIG, NULL, NULL), /* Default: 25% CPU max (at upper threshold) */
     createIntConfig("active-defrag-threshold-lower", NULL, MODIFIABLE_CONFIG, 0, 1000, server.active_defrag_threshold_lower, 10, INTEGER_CONFIG, NULL, NULL), /* Default: don't defrag when fragmentation is below 10% */
     createIntConfig("active-defrag-threshold-upper", NULL, MODIFIABLE_CONFIG, 0, 1000, server.active_defrag_threshold_upper, 100, INTEGER_CONFIG, NULL, NULL), /* Default: maximum defrag force at 100% fragmentation */
+    createIntConfig("active-defrag-forecast-traffic-pct", NULL, MODIFIABLE_CONFIG, 0, 100, server.active_defrag_forecast_traffic_pct, 25, INTEGER_CONFIG, NULL, NULL), /* Default: proactive defrag below 25% of the traffic peak */
     createIntConfig("lfu-log-factor", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.lfu_log_factor, 10, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("lfu-decay-time", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.lfu_decay_time, 1, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("replica-priority", "slave-priority", MODIFIABLE_CONFIG, 0, INT_MAX, server.slave_priority, 100, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("repl-diskless-sync-delay", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.repl_diskless_sync_delay, 5, INTEGER_CONFIG, NULL, NULL),
+    createSizeTConfig("repl-diskless-sync-buffer", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.repl_diskless_sync_buffer, 64*1024*1024, MEMORY_CONFIG, NULL, NULL), /* Default: 64mb */
+    createSizeTConfig("audit-buffer-limit", NULL, MODIFIABLE_CONFIG, 1024*1024, LONG_MAX, server.audit_buffer_limit, 64*1024*1024, MEMORY_CONFIG, NULL, NULL), /* Default: 64mb */
     createIntConfig("maxmemory-samples", NULL, MODIFIABLE_CONFIG, 1, INT_MAX, server.maxmemory_samples, 5, INTEGER_CONFIG, NULL, NULL),
-    createIntConfig("timeout", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.maxidletime, 0, INTEGER_CONFIG, NULL, NULL), /* Default client timeout: infinite */
+    createIntConfig("lru-clock-resolution", NULL, IMMUTABLE_CONFIG, 10, 1000, server.lru_clock_resolution, LRU_CLOCK_DEFAULT_RESOLUTION, INTEGER_CONFIG, NULL, NULL), /* Milliseconds per LRU tick. */
+    createIntConfig("maxmemory-eviction-time-limit", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.maxmemory_eviction_time_limit, 0, INTEGER_CONFIG, NULL, NULL), /* Milliseconds. 0 = unbounded. */
+    createIntConfig("maxmemory-eviction-watermark", NULL, MODIFIABLE_CONFIG, 0, 99, server.maxmemory_eviction_watermark, 0, INTEGER_CONFIG, NULL, NULL), /* Percent of maxmemory. 0 = disabled. */
+    createIntConfig("timeout", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.maxidletime, 0, INTEGER_CONFIG, NULL, updateMaxidletime), /* Default client timeout: infinite */
     createIntConfig("replica-announce-port", "slave-announce-port", MODIFIABLE_CONFIG, 0, 65535, server.slave_announce_port, 0, INTEGER_CONFIG, NULL, NULL),
-    createIntConfig("tcp-backlog", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.tcp_backlog, 511, INTEGER_CONFIG, NULL, NULL), /* TCP listen backlog. */
+    createIntConfig("tcp-backlog", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.tcp_backlog, 511, INTEGER_CONFIG, NULL, updateTcpBacklog), /* TCP listen backlog. */
     createIntConfig("cluster-announce-bus-port", NULL, MODIFIABLE_CONFIG, 0, 65535, server.cluster_announce_bus_port, 0, INTEGER_CONFIG, NULL, NULL), /* Default: Use +10000 offset. */
     createIntConfig("cluster-announce-port", NULL, MODIFIABLE_CONFIG, 0, 65535, server.cluster_announce_port, 0, INTEGER_CONFIG, NULL, NULL), /* Use server.port */
     createIntConfig("repl-timeout", NULL, MODIFIABLE_CONFIG, 1, INT_MAX, server.repl_timeout, 60, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("repl-ping-replica-period", "repl-ping-slave-period", MODIFIABLE_CONFIG, 1, INT_MAX, server.repl_ping_slave_period, 10, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("list-compress-depth", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.list_compress_depth, 0, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("rdb-key-save-delay", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.rdb_key_save_delay, 0, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("hotkeys-sample-rate", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.hotkeys_sample_rate, 0, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("hotkeys-report-period", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.hotkeys_report_period, 10, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("rdb-save-threads", NULL, MODIFIABLE_CONFIG, 1, 128, server.rdb_save_threads, 1, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("rdb-load-threads", NULL, MODIFIABLE_CONFIG, 1, 128, server.rdb_load_threads, 1, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("sort-threads", NULL, MODIFIABLE_CONFIG, 1, 128, server.sort_threads, 1, INTEGER_CONFIG, NULL, NULL), /* Threads sorting big SORT vectors. */
     createIntConfig("key-load-delay", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.key_load_delay, 0, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("tracking-table-max-fill", NULL, MODIFIABLE_CONFIG, 0, 100, server.tracking_table_max_fill, 10, INTEGER_CONFIG, NULL, NULL), /* Default: 10% tracking table max fill. */
+    createLongLongConfig("tracking-fingerprint-entries", NULL, IMMUTABLE_CONFIG, 0, LONG_MAX, server.tracking_fp_entries, 0, INTEGER_CONFIG, NULL, NULL), /* Default: 0, exact tracking. */
     createIntConfig("active-expire-effort", NULL, MODIFIABLE_CONFIG, 1, 10, server.active_expire_effort, 1, INTEGER_CONFIG, NULL, NULL), /* From 1 to 10. */
     createIntConfig("hz", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.config_hz, CONFIG_DEFAULT_HZ, INTEGER_CONFIG, NULL, updateHZ),
+    createIntConfig("busy-poll-max-usec", NULL, MODIFIABLE_CONFIG, 0, 1000000, server.busy_poll_max_usec, 0, INTEGER_CONFIG, NULL, updateBusyPollMaxUsec), /* Event loop busy polling is disabled by default. */
+    createIntConfig("batch-priority-budget-usec", NULL, MODIFIABLE_CONFIG, 0, 1000000, server.batch_priority_budget_usec, 500, INTEGER_CONFIG, NULL, NULL), /* Time budget per event loop iteration for deferred commands. */
     createIntConfig("min-replicas-to-write", "min-slaves-to-write", MODIFIABLE_CONFIG, 0, INT_MAX, server.repl_min_slaves_to_write, 0, INTEGER_CONFIG, NULL, updateGoodSlaves),
     createIntConfig("min-replicas-max-lag", "min-slaves-max-lag", MODIFIABLE_CONFIG, 0, INT_MAX, server.repl_min_slaves_max_lag, 10, INTEGER_CONFIG, NULL, updateGoodSlaves),
 
@@ -2229,11 +2418,13 @@ standardConfig configs[] = {
     createULongConfig("slowlog-max-len", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.slowlog_max_len, 128, INTEGER_CONFIG, NULL, NULL),
 
     /* Long Long configs */
+    createLongLongConfig("command-time-limit", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.command_time_limit, 0, INTEGER_CONFIG, NULL, NULL), /* Disabled by default, milliseconds */
     createLongLongConfig("lua-time-limit", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.lua_time_limit, 5000, INTEGER_CONFIG, NULL, NULL),/* milliseconds */
     createLongLongConfig("cluster-node-timeout", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.cluster_node_timeout, 15000, INTEGER_CONFIG, NULL, NULL),
     createLongLongConfig("slowlog-log-slower-than", NULL, MODIFIABLE_CONFIG, -1, LLONG_MAX, server.slowlog_log_slower_than, 10000, INTEGER_CONFIG, NULL, NULL),
     createLongLongConfig("latency-monitor-threshold", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.latency_monitor_threshold, 0, INTEGER_CONFIG, NULL, NULL),
     createLongLongConfig("proto-max-bulk-len", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.proto_max_bulk_len, 512ll*1024*1024, MEMORY_CONFIG, NULL, NULL), /* Bulk request max size */
+    createSizeTConfig("reply-stream-bytes", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.reply_stream_bytes, 0, MEMORY_CONFIG, NULL, NULL), /* Mid-command reply flush threshold, 0 = disabled */
     createLongLongConfig("stream-node-max-entries", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.stream_node_max_entries, 100, INTEGER_CONFIG, NULL, NULL),
     createLongLongConfig("repl-backlog-size", NULL, MODIFIABLE_CONFIG, 1, LONG_MAX, server.repl_backlog_size, 1024*1024, MEMORY_CONFIG, NULL, updateReplBacklogSize), /* Default: 1mb */
 
@@ -2243,6 +2434,9 @@ standardConfig configs[] = {
     /* Size_t configs */
     createSizeTConfig("hash-max-ziplist-entries", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.hash_max_ziplist_entries, 512, INTEGER_CONFIG, NULL, NULL),
     createSizeTConfig("set-max-intset-entries", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.set_max_intset_entries, 512, INTEGER_CONFIG, NULL, NULL),
+    createBoolConfig("set-dense-sampling", NULL, MODIFIABLE_CONFIG, server.set_dense_sampling, 1, NULL, NULL),
+    createIntConfig("key-inline-max-size", NULL, MODIFIABLE_CONFIG, 0, 255, server.key_inline_max_size, 15, INTEGER_CONFIG, NULL, NULL), /* Keyspace entries embed keys up to this length. */
+    createSizeTConfig("resumable-read-threshold", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.resumable_read_threshold, 0, INTEGER_CONFIG, NULL, NULL), /* Resumable reads are disabled by default. */
     createSizeTConfig("zset-max-ziplist-entries", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.zset_max_ziplist_entries, 128, INTEGER_CONFIG, NULL, NULL),
     createSizeTConfig("active-defrag-ignore-bytes", NULL, MODIFIABLE_CONFIG, 1, LONG_MAX, server.active_defrag_ignore_bytes, 100<<20, MEMORY_CONFIG, NULL, NULL), /* Default: don't defrag if frag overhead is below 100mb */
     createSizeTConfig("hash-max-ziplist-value", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.hash_max_ziplist_value, 64, MEMORY_CONFIG, NULL, NULL),
@@ -2260,6 +2454,7 @@ standardConfig configs[] = {
     createBoolConfig("tls-replication", NULL, MODIFIABLE_CONFIG, server.tls_replication, 0, NULL, NULL),
     createBoolConfig("tls-auth-clients", NULL, MODIFIABLE_CONFIG, server.tls_auth_clients, 1, NULL, NULL),
     createBoolConfig("tls-prefer-server-ciphers", NULL, MODIFIABLE_CONFIG, server.tls_ctx_config.prefer_server_ciphers, 0, NULL, updateTlsCfgBool),
+    createBoolConfig("tls-ktls", NULL, MODIFIABLE_CONFIG, server.tls_ctx_config.ktls, 0, NULL, updateTlsCfgBool),
     createStringConfig("tls-cert-file", NULL, MODIFIABLE_CONFIG, EMPTY_STRING_IS_NULL, server.tls_ctx_config.cert_file, NULL, NULL, updateTlsCfg),
     createStringConfig("tls-key-file", NULL, MODIFIABLE_CONFIG, EMPTY_STRING_IS_NULL, server.tls_ctx_config.key_file, NULL, NULL, updateTlsCfg),
     createStringConfig("tls-dh-params-file", NULL, MODIFIABLE_CONFIG, EMPTY_STRING_IS_NULL, server.tls_ctx_config.dh_params_file, NULL, NULL, updateTlsCfg),
@@ -78,6 +78,12 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* Test for io_uring: only used as event loop backend when explicitly
+ * requested at build time, since it needs Linux 5.1 or greater. */
+#if defined(__linux__) && defined(USE_IO_URING)
+#define HAVE_IO_URING 1
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -30,6 +30,10 @@
 #include "server.h"
 #include "connhelpers.h"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 /* The connections module provides a lean abstraction of network connections
  * to avoid direct socket and async event management across the Redis code base.
  *
@@ -170,6 +174,39 @@ static int connSocketWrite(connection *conn, const void *data, size_t data_len)
     return ret;
 }
 
+static int connSocketWritev(connection *conn, const struct iovec *iov, int iovcnt) {
+    int ret = writev(conn->fd, iov, iovcnt);
+    if (ret < 0 && errno != EAGAIN) {
+        conn->last_errno = errno;
+        conn->state = CONN_STATE_ERROR;
+    }
+
+    return ret;
+}
+
+/* Zero copy transfer from a file descriptor to the socket, see
+ * connSendFile(). Only available on Linux: other platforms take the
+ * ENOTSUP fallback like the TLS transport. */
+static ssize_t connSocketSendFile(connection *conn, int in_fd, off_t offset,
+                                  size_t count)
+{
+#ifdef __linux__
+    ssize_t ret = sendfile(conn->fd, in_fd, &offset, count);
+    if (ret < 0 && errno != EAGAIN) {
+        conn->last_errno = errno;
+        conn->state = CONN_STATE_ERROR;
+    }
+    return ret;
+#else
+    UNUSED(conn);
+    UNUSED(in_fd);
+    UNUSED(offset);
+    UNUSED(count);
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 static int connSocketRead(connection *conn, void *buf, size_t buf_len) {
     int ret = read(conn->fd, buf, buf_len);
     if (!ret) {
@@ -324,6 +361,8 @@ ConnectionType CT_Socket = {
     .ae_handler = connSocketEventHandler,
     .close = connSocketClose,
     .write = connSocketWrite,
+    .writev = connSocketWritev,
+    .sendfile = connSocketSendFile,
     .read = connSocketRead,
     .accept = connSocketAccept,
     .connect = connSocketConnect,
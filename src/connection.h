@@ -31,6 +31,9 @@
 #ifndef __REDIS_CONNECTION_H
 #define __REDIS_CONNECTION_H
 
+#include <sys/uio.h>
+#include <errno.h>
+
 #define CONN_INFO_LEN   32
 
 struct aeEventLoop;
@@ -55,6 +58,8 @@ typedef struct ConnectionType {
     void (*ae_handler)(struct aeEventLoop *el, int fd, void *clientData, int mask);
     int (*connect)(struct connection *conn, const char *addr, int port, const char *source_addr, ConnectionCallbackFunc connect_handler);
     int (*write)(struct connection *conn, const void *data, size_t data_len);
+    int (*writev)(struct connection *conn, const struct iovec *iov, int iovcnt);
+    ssize_t (*sendfile)(struct connection *conn, int in_fd, off_t offset, size_t count);
     int (*read)(struct connection *conn, void *buf, size_t buf_len);
     void (*close)(struct connection *conn);
     int (*accept)(struct connection *conn, ConnectionCallbackFunc accept_handler);
@@ -129,6 +134,34 @@ static inline int connWrite(connection *conn, const void *data, size_t data_len)
     return conn->type->write(conn, data, data_len);
 }
 
+/* Gather-write the vector to the connection, behaves the same as writev(2).
+ *
+ * Like writev(2), a short write is possible. A -1 return indicates an error.
+ *
+ * The caller should NOT rely on errno. Testing for an EAGAIN-like condition, use
+ * connGetState() to see if the connection state is still CONN_STATE_CONNECTED.
+ */
+static inline int connWritev(connection *conn, const struct iovec *iov, int iovcnt) {
+    return conn->type->writev(conn, iov, iovcnt);
+}
+
+/* Send 'count' bytes of the file 'in_fd', starting at 'offset', to the
+ * connection without passing through userspace buffers, when the
+ * transport has a zero copy path (plain TCP sockets, via sendfile(2)).
+ *
+ * Like write(2), a short transfer is possible and -1 indicates an error:
+ * use connGetState() to tell an EAGAIN-like condition apart. Transports
+ * without a zero copy path (e.g. TLS, that must encrypt the data in
+ * userspace) return -1 with errno set to ENOTSUP, and the caller must
+ * fall back to read(2) + connWrite(). */
+static inline ssize_t connSendFile(connection *conn, int in_fd, off_t offset, size_t count) {
+    if (conn->type->sendfile == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return conn->type->sendfile(conn, in_fd, offset, count);
+}
+
 /* Read from the connection, behaves the same as read(2).
  * 
  * Like read(2), a short read is possible.  A return value of 0 will indicate the
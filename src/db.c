@@ -30,6 +30,7 @@
 #include "server.h"
 #include "cluster.h"
 #include "atomicvar.h"
+#include "endianconv.h"
 
 #include <signal.h>
 #include <ctype.h>
@@ -40,6 +41,102 @@
 
 int keyIsExpired(redisDb *db, robj *key);
 
+/* Return the keyspace shard (hash table) the specified key name hashes
+ * to. Shards are selected with the same slot hashing used by Redis
+ * Cluster, so in cluster mode all the keys of a given slot live in the
+ * same shard. With the default single shard configuration this is free. */
+dict *dbGetDict(redisDb *db, const void *key) {
+    if (server.db_dict_shards == 1) return db->dict[0];
+    unsigned int slot = keyHashSlot((char*)key,sdslen((sds)key));
+    return db->dict[slot & (server.db_dict_shards-1)];
+}
+
+/* dbGetDict() for a key that is not an sds string: returns the shard that
+ * would store a key with the given bytes. */
+dict *dbGetDictKeylen(redisDb *db, const char *key, size_t len) {
+    if (server.db_dict_shards == 1) return db->dict[0];
+    unsigned int slot = keyHashSlot((char*)key,len);
+    return db->dict[slot & (server.db_dict_shards-1)];
+}
+
+/* Total number of keys stored in every shard of the specified DB. */
+unsigned long dbSize(redisDb *db) {
+    unsigned long size = 0;
+    for (int i = 0; i < server.db_dict_shards; i++)
+        size += dictSize(db->dict[i]);
+    return size;
+}
+
+/* Incrementally iterate the whole keyspace of 'db', visiting one bucket
+ * per call like dictScan() does. With a sharded keyspace the shard index
+ * is stored in the lowest bits of the cursor and the position inside the
+ * shard in the remaining ones: when a shard is exhausted (its cursor
+ * wraps to zero) the iteration continues from the start of the next one.
+ * A return value of zero means the iteration is complete. */
+unsigned long dbScan(redisDb *db, unsigned long cursor,
+                     dictScanFunction *fn,
+                     dictScanBucketFunction *bucketfn, void *privdata)
+{
+    if (server.db_dict_shards == 1)
+        return dictScan(db->dict[0], cursor, fn, bucketfn, privdata);
+
+    int shard_bits = 0;
+    while ((1 << shard_bits) < server.db_dict_shards) shard_bits++;
+    unsigned long shard = cursor & (server.db_dict_shards-1);
+    unsigned long inner = cursor >> shard_bits;
+
+    inner = dictScan(db->dict[shard], inner, fn, bucketfn, privdata);
+    if (inner == 0) {
+        if (++shard == (unsigned long)server.db_dict_shards) return 0;
+    }
+    return (inner << shard_bits) | shard;
+}
+
+/* Return a safe iterator over the whole keyspace of a DB, crossing
+ * shard boundaries transparently. Must be released with
+ * dbReleaseIterator(). */
+dbIterator *dbGetSafeIterator(redisDb *db) {
+    dbIterator *dbit = zmalloc(sizeof(*dbit));
+    dbit->db = db;
+    dbit->shard = 0;
+    dbit->di = dictGetSafeIterator(db->dict[0]);
+    return dbit;
+}
+
+/* Return the next entry of a keyspace iteration, or NULL when every
+ * shard has been consumed. */
+dictEntry *dbIteratorNext(dbIterator *dbit) {
+    dictEntry *de = dictNext(dbit->di);
+    while (de == NULL) {
+        if (++dbit->shard >= server.db_dict_shards) return NULL;
+        dictReleaseIterator(dbit->di);
+        dbit->di = dictGetSafeIterator(dbit->db->dict[dbit->shard]);
+        de = dictNext(dbit->di);
+    }
+    return de;
+}
+
+void dbReleaseIterator(dbIterator *dbit) {
+    dictReleaseIterator(dbit->di);
+    zfree(dbit);
+}
+
+/* Return a random shard of the DB, selected with probability
+ * proportional to the number of keys it stores, or NULL if the DB is
+ * empty. Used by the functions that need to sample random keys. */
+dict *dbRandomShard(redisDb *db) {
+    unsigned long size = dbSize(db);
+    if (size == 0) return NULL;
+    if (server.db_dict_shards == 1) return db->dict[0];
+    unsigned long r = ((unsigned long)random()) % size;
+    for (int i = 0; i < server.db_dict_shards; i++) {
+        unsigned long s = dictSize(db->dict[i]);
+        if (r < s) return db->dict[i];
+        r -= s;
+    }
+    return NULL; /* Unreachable. */
+}
+
 /* Update LFU when an object is accessed.
  * Firstly, decrement the counter if the decrement time is reached.
  * Then logarithmically increment the counter, and update the access time. */
@@ -53,19 +150,40 @@ void updateLFU(robj *val) {
  * implementations that should instead rely on lookupKeyRead(),
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dictEntry *de = dictFind(dbGetDict(db,key->ptr),key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
 
+        /* Values loaded from a memory mapped RDB file are deserialized
+         * on their first access. */
+        if (val->encoding == OBJ_ENCODING_LAZY)
+            val = rdbLazyValueMaterialize(db,key,de);
+
+        /* Values demoted to the cold tier are faulted back on access.
+         * Clients usually don't get here with a cold value: they are
+         * parked by coldTierBlockClientIfNeeded() while a bio thread
+         * reads it. This synchronous path serves every other context
+         * (scripts, MULTI, expires, replication). */
+        if (val->encoding == OBJ_ENCODING_COLD)
+            val = coldValueMaterialize(db,key,de);
+
         /* Update the access time for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
-            if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-                updateLFU(val);
-            } else {
-                val->lru = LRU_CLOCK();
+         * a copy on write madness. Clients in CLIENT NO-TOUCH mode (bulk
+         * scans and the like) don't alter the access time either, so they
+         * don't trash the recency of the actual working set. */
+        if (!(flags & LOOKUP_NOTOUCH) &&
+            !(server.current_client &&
+              server.current_client->flags & CLIENT_NO_TOUCH))
+        {
+            if (!hasActiveChildProcess()) {
+                if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+                    updateLFU(val);
+                } else {
+                    val->lru = LRU_CLOCK();
+                }
             }
+            hotkeysSampleIfNeeded(db,key->ptr);
         }
         return val;
     } else {
@@ -98,6 +216,30 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
     robj *val;
 
+    /* When we are executing a read-only command directly from an I/O
+     * thread the keyspace must be treated as strictly read only: no
+     * incremental rehash steps, no lazy expiration (logically expired keys
+     * are just reported as missing, active expiration will collect them
+     * later), no access time update and no keymiss notifications. The
+     * main thread is parked waiting for the I/O threads, so the dicts are
+     * guaranteed not to change under us. */
+    if (io_threads_executing_command) {
+        dictEntry *de = dictFindNoRehash(dbGetDict(db,key->ptr),key->ptr);
+        if (de && dictSize(db->expires) && mstime() >= db->min_expire) {
+            /* Note: we just read the min_expire bound without refreshing
+             * it (it is only written by the main thread, parked right
+             * now), so this is a fast path only while it holds. */
+            dictEntry *ede = dictFindNoRehash(db->expires,key->ptr);
+            if (ede && dictGetSignedIntegerVal(ede) < mstime()) de = NULL;
+        }
+        if (de == NULL) {
+            atomicIncr(server.stat_keyspace_misses,1);
+            return NULL;
+        }
+        atomicIncr(server.stat_keyspace_hits,1);
+        return dictGetVal(de);
+    }
+
     if (expireIfNeeded(db,key) == 1) {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
          * returns 0 only when the key does not exist at all, so it's safe
@@ -178,37 +320,86 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
     sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    int retval = dictAdd(dbGetDict(db,key->ptr), copy, val);
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    db->type_count[val->type]++;
     if (val->type == OBJ_LIST ||
         val->type == OBJ_ZSET)
         signalKeyAsReady(db, key);
     if (server.cluster_enabled) slotToKeyAdd(key);
 }
 
+/* Bulk variant of dbAdd(): insert 'count' key / value pairs, feeding runs
+ * of consecutive keys mapping to the same shard into dictAddBatch(), that
+ * sizes the destination table once and amortizes the incremental rehash
+ * work across the batch. Unlike dbAdd() the keys are allowed to exist
+ * already (or to appear more than once in the batch): in that case the
+ * value is overwritten, so the last occurrence wins. As with dbAdd(),
+ * incrementing the reference count of the values is up to the caller. */
+#define DB_ADD_BATCH_SIZE 32
+void dbAddBatch(redisDb *db, robj **keys, robj **vals, int count) {
+    int i = 0, j;
+
+    while (i < count) {
+        void *bkeys[DB_ADD_BATCH_SIZE], *bvals[DB_ADD_BATCH_SIZE];
+        dictEntry *existing[DB_ADD_BATCH_SIZE];
+        dict *d = dbGetDict(db,keys[i]->ptr);
+        int n = 1;
+
+        while (i+n < count && n < DB_ADD_BATCH_SIZE &&
+               dbGetDict(db,keys[i+n]->ptr) == d) n++;
+        for (j = 0; j < n; j++) {
+            bkeys[j] = sdsdup(keys[i+j]->ptr);
+            bvals[j] = vals[i+j];
+        }
+        dictAddBatch(d,bkeys,bvals,n,existing);
+        for (j = 0; j < n; j++) {
+            robj *key = keys[i+j], *val = vals[i+j];
+
+            if (existing[j]) {
+                /* Already present (or a duplicate inside the batch):
+                 * overwrite through the usual path. */
+                sdsfree(bkeys[j]);
+                dbOverwrite(db,key,val);
+                continue;
+            }
+            db->type_count[val->type]++;
+            if (val->type == OBJ_LIST ||
+                val->type == OBJ_ZSET)
+                signalKeyAsReady(db, key);
+            if (server.cluster_enabled) slotToKeyAdd(key);
+        }
+        i += n;
+    }
+}
+
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  * This function does not modify the expire time of the existing key.
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dict *d = dbGetDict(db,key->ptr);
+    dictEntry *de = dictFind(d,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
+    hashExpiresDelete(db,key->ptr);
     dictEntry auxentry = *de;
     robj *old = dictGetVal(de);
+    db->type_count[old->type]--;
+    db->type_count[val->type]++;
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         val->lru = old->lru;
     }
-    dictSetVal(db->dict, de, val);
+    dictSetVal(d, de, val);
 
     if (server.lazyfree_lazy_server_del) {
         freeObjAsync(old);
-        dictSetVal(db->dict, &auxentry, NULL);
+        dictSetVal(d, &auxentry, NULL);
     }
 
-    dictFreeVal(db->dict, &auxentry);
+    dictFreeVal(d, &auxentry);
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -231,7 +422,7 @@ void setKey(redisDb *db, robj *key, robj *val) {
 }
 
 int dbExists(redisDb *db, robj *key) {
-    return dictFind(db->dict,key->ptr) != NULL;
+    return dictFind(dbGetDict(db,key->ptr),key->ptr) != NULL;
 }
 
 /* Return a random key, in form of a Redis object.
@@ -241,13 +432,14 @@ int dbExists(redisDb *db, robj *key) {
 robj *dbRandomKey(redisDb *db) {
     dictEntry *de;
     int maxtries = 100;
-    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
+    int allvolatile = dbSize(db) == dictSize(db->expires);
 
     while(1) {
         sds key;
         robj *keyobj;
 
-        de = dictGetFairRandomKey(db->dict);
+        dict *d = dbRandomShard(db);
+        de = d ? dictGetFairRandomKey(d) : NULL;
         if (de == NULL) return NULL;
 
         key = dictGetKey(de);
@@ -275,10 +467,22 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    /* Expired and evicted keys are deleted without a modification
+     * signal: drop a cached reply here so a recreated key cannot be
+     * served from it. Scan sessions must not outlive their container
+     * either. */
+    replyCacheInvalidate(db,key);
+    scanSessionInvalidateKey(db,key);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
+    dbDeleteExpire(db,key->ptr);
+    hashExpiresDelete(db,key->ptr);
+    dict *d = dbGetDict(db,key->ptr);
+    dictEntry *de = dictUnlink(d,key->ptr);
+    if (de) {
+        db->type_count[((robj*)dictGetVal(de))->type]--;
+        dictFreeUnlinkedEntry(d,de);
         if (server.cluster_enabled) slotToKeyDel(key);
         return 1;
     } else {
@@ -354,6 +558,13 @@ long long emptyDbGeneric(redisDb *dbarray, int dbnum, int flags, void(callback)(
         return -1;
     }
 
+    /* A forkless AOF rewrite cannot survive the dataset being flushed or
+     * reloaded under its cursor: restart it from scratch. */
+    if (dbarray == server.db && aofNoForkRewriteInProgress()) {
+        aofNoForkRewriteAbort();
+        server.aof_rewrite_scheduled = 1;
+    }
+
     /* Fire the flushdb modules event. */
     RedisModuleFlushInfoV1 fi = {REDISMODULE_FLUSHINFO_VERSION,!async,dbnum};
     moduleFireServerEvent(REDISMODULE_EVENT_FLUSHDB,
@@ -374,21 +585,24 @@ long long emptyDbGeneric(redisDb *dbarray, int dbnum, int flags, void(callback)(
     }
 
     for (int j = startdb; j <= enddb; j++) {
-        removed += dictSize(dbarray[j].dict);
+        removed += dbSize(&dbarray[j]);
         if (async) {
             emptyDbAsync(&dbarray[j]);
         } else {
-            dictEmpty(dbarray[j].dict,callback);
+            for (int i = 0; i < server.db_dict_shards; i++)
+                dictEmpty(dbarray[j].dict[i],callback);
             dictEmpty(dbarray[j].expires,callback);
+            raxFree(dbarray[j].expires_index);
+            dbarray[j].expires_index = raxNew();
         }
+        dictEmpty(dbarray[j].hexpires,callback);
+        raxFree(dbarray[j].hexpires_index);
+        dbarray[j].hexpires_index = raxNew();
+        dbarray[j].min_expire = LLONG_MAX;
+        dbarray[j].reclaimed_upto = 0;
+        memset(dbarray[j].type_count,0,sizeof(dbarray[j].type_count));
     }
-    if (server.cluster_enabled) {
-        if (async) {
-            slotToKeyFlushAsync();
-        } else {
-            slotToKeyFlush();
-        }
-    }
+    if (server.cluster_enabled) slotToKeyFlush();
     if (dbnum == -1) flushSlaveKeysWithExpireList();
 
     /* Also fire the end event. Note that this event will fire almost
@@ -415,7 +629,7 @@ long long dbTotalServerKeyCount() {
     long long total = 0;
     int j;
     for (j = 0; j < server.dbnum; j++) {
-        total += dictSize(server.db[j].dict);
+        total += dbSize(&server.db[j]);
     }
     return total;
 }
@@ -432,11 +646,19 @@ long long dbTotalServerKeyCount() {
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
     trackingInvalidateKey(key);
+    replyCacheInvalidate(db,key);
+    scanSessionInvalidateKey(db,key);
+    rdbDeltaTrackKey(db,key);
 }
 
 void signalFlushedDb(int dbid) {
     touchWatchedKeysOnFlush(dbid);
     trackingInvalidateKeysOnFlush(dbid);
+    replyCacheFlush(dbid);
+    scanSessionInvalidateDb(dbid);
+    /* A flush cannot be expressed in a delta RDB file: invalidate the
+     * chain until the next full snapshot. */
+    rdbDeltaInvalidate();
 }
 
 /*-----------------------------------------------------------------------------
@@ -452,15 +674,22 @@ void signalFlushedDb(int dbid) {
  * On success C_OK is returned and the flags are stored in *flags, otherwise
  * C_ERR is returned and the function sends an error to the client. */
 int getFlushCommandFlags(client *c, int *flags) {
-    /* Parse the optional ASYNC option. */
-    if (c->argc > 1) {
-        if (c->argc > 2 || strcasecmp(c->argv[1]->ptr,"async")) {
-            addReply(c,shared.syntaxerr);
-            return C_ERR;
-        }
+    /* Parse the optional ASYNC/SYNC option. */
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"sync")) {
+        *flags = EMPTYDB_NO_FLAGS;
+    } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"async")) {
         *flags = EMPTYDB_ASYNC;
+    } else if (c->argc == 1) {
+        /* Without an explicit option the behavior is driven by the
+         * lazyfree-lazy-user-flush configuration: flushing asynchronously
+         * swaps in fresh dicts, so the command latency does not depend on
+         * the keyspace size, and the old entries are reclaimed by the
+         * lazy free background threads. */
+        *flags = server.lazyfree_lazy_user_flush ? EMPTYDB_ASYNC :
+                                                   EMPTYDB_NO_FLAGS;
     } else {
-        *flags = EMPTYDB_NO_FLAGS;
+        addReply(c,shared.syntaxerr);
+        return C_ERR;
     }
     return C_OK;
 }
@@ -488,7 +717,7 @@ void flushAllDataAndResetRDB(int flags) {
 #endif
 }
 
-/* FLUSHDB [ASYNC]
+/* FLUSHDB [ASYNC|SYNC]
  *
  * Flushes the currently SELECTed Redis DB. */
 void flushdbCommand(client *c) {
@@ -506,7 +735,7 @@ void flushdbCommand(client *c) {
 #endif
 }
 
-/* FLUSHALL [ASYNC]
+/* FLUSHALL [ASYNC|SYNC]
  *
  * Flushes the whole server data set. */
 void flushallCommand(client *c) {
@@ -590,36 +819,457 @@ void keysCommand(client *c) {
     dictEntry *de;
     sds pattern = c->argv[1]->ptr;
     int plen = sdslen(pattern), allkeys;
-    unsigned long numkeys = 0;
+    unsigned long numkeys = 0, scanned = 0;
+    replyCheckpoint cp;
+
+    /* The keyspace walk may be aborted by the execution deadline: the
+     * partial output is rewound back to here and replaced by the error. */
+    replyCheckpointSet(c,&cp);
     void *replylen = addReplyDeferredLen(c);
 
-    di = dictGetSafeIterator(c->db->dict);
     allkeys = (pattern[0] == '*' && pattern[1] == '\0');
-    while((de = dictNext(di)) != NULL) {
-        sds key = dictGetKey(de);
-        robj *keyobj;
-
-        if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
-            keyobj = createStringObject(key,sdslen(key));
-            if (!keyIsExpired(c->db,keyobj)) {
-                addReplyBulk(c,keyobj);
-                numkeys++;
+    for (int i = 0; i < server.db_dict_shards; i++) {
+        di = dictGetSafeIterator(c->db->dict[i]);
+        while((de = dictNext(di)) != NULL) {
+            sds key = dictGetKey(de);
+            robj *keyobj;
+
+            if ((++scanned & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                dictReleaseIterator(di);
+                addReply(c,shared.timeouterr);
+                return;
+            }
+            if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
+                keyobj = createStringObject(key,sdslen(key));
+                if (!keyIsExpired(c->db,keyobj)) {
+                    addReplyBulk(c,keyobj);
+                    numkeys++;
+                }
+                decrRefCount(keyobj);
             }
-            decrRefCount(keyobj);
         }
+        dictReleaseIterator(di);
     }
-    dictReleaseIterator(di);
     setDeferredArrayLen(c,replylen,numkeys);
 }
 
+/* ----------------------------------------------------------------------------
+ * Background keyspace export: KEYSASYNC
+ * ----------------------------------------------------------------------------
+ *
+ * KEYSASYNC produces the same reply of KEYS, but instead of walking the
+ * whole keyspace in a single shot while the event loop waits, the client
+ * is blocked and the dictionaries are iterated with dictScan() from
+ * serverCron(), a bounded amount of buckets for each tick. The guarantees
+ * are the ones of SCAN: keys present for the whole duration of the
+ * iteration are always reported, keys added or removed while it is in
+ * progress may or may not be. This is good enough for auditing jobs that
+ * need a full keyspace listing, without the multi second event loop
+ * stalls of KEYS against a big keyspace. */
+
+typedef struct keysAsyncJob {
+    client *c;              /* Owner: the blocked client. */
+    redisDb *db;            /* Database selected when the command ran. */
+    sds pattern;            /* Pattern to match (private copy). */
+    int allkeys;            /* True if the pattern is just "*". */
+    int shard;              /* Keyspace shard being scanned. */
+    unsigned long cursor;   /* dictScan() cursor inside the shard. */
+    unsigned long numkeys;  /* Matching keys collected so far. */
+    sds payload;            /* Collected keys, already in protocol form. */
+} keysAsyncJob;
+
+static list *keys_async_jobs = NULL;    /* Active jobs, oldest first. */
+
+static void keysAsyncJobFree(listNode *ln) {
+    keysAsyncJob *job = ln->value;
+    sdsfree(job->pattern);
+    sdsfree(job->payload);
+    zfree(job);
+    listDelNode(keys_async_jobs,ln);
+}
+
+/* dictScan() callback: append the key to the job payload if it matches
+ * the pattern and is not already logically expired. */
+static void keysAsyncScanCallback(void *privdata, const dictEntry *de) {
+    keysAsyncJob *job = privdata;
+    sds key = dictGetKey(de);
+
+    if (!job->allkeys &&
+        !stringmatchlen(job->pattern,sdslen(job->pattern),
+                        key,sdslen(key),0)) return;
+
+    robj *keyobj = createStringObject(key,sdslen(key));
+    if (!keyIsExpired(job->db,keyobj)) {
+        job->payload = sdscatfmt(job->payload,"$%u\r\n",
+                                 (unsigned int)sdslen(key));
+        job->payload = sdscatlen(job->payload,key,sdslen(key));
+        job->payload = sdscatlen(job->payload,"\r\n",2);
+        job->numkeys++;
+    }
+    decrRefCount(keyobj);
+}
+
+/* Perform a bounded amount of work for the oldest pending export. Called
+ * by serverCron(): buckets are scanned in small chunks, checking the
+ * clock between one chunk and the other, and we yield as soon as the
+ * time budget for this tick is over, the way activeDefragCycle()
+ * limits itself. */
+#define KEYS_ASYNC_CHUNK_BUCKETS 128
+#define KEYS_ASYNC_TICK_US 1000
+void keysAsyncCron(void) {
+    if (keys_async_jobs == NULL || listLength(keys_async_jobs) == 0) return;
+
+    listNode *ln = listFirst(keys_async_jobs);
+    keysAsyncJob *job = ln->value;
+    long long start = ustime();
+
+    while(1) {
+        for (int i = 0; i < KEYS_ASYNC_CHUNK_BUCKETS; i++) {
+            job->cursor = dictScan(job->db->dict[job->shard],job->cursor,
+                                   keysAsyncScanCallback,NULL,job);
+            if (job->cursor == 0 && ++job->shard == server.db_dict_shards) {
+                /* Iteration complete: deliver the reply and unblock the
+                 * owner. The payload is handed over as a single reply
+                 * node, so the delivery is O(1) too. */
+                client *c = job->c;
+                addReplyArrayLen(c,job->numkeys);
+                if (sdslen(job->payload)) {
+                    addReplySds(c,job->payload);
+                    job->payload = NULL;
+                }
+                keysAsyncJobFree(ln);
+                unblockClient(c);
+                return;
+            }
+        }
+        if (ustime()-start > KEYS_ASYNC_TICK_US) return;
+    }
+}
+
+/* Called by unblockClient() when a client blocked on KEYSASYNC goes away
+ * before its job is done (it disconnected, or was force-unblocked):
+ * discard the pending job still attached to it, if any. */
+void keysAsyncUnblockClient(client *c) {
+    listIter li;
+    listNode *ln;
+
+    if (keys_async_jobs == NULL) return;
+    listRewind(keys_async_jobs,&li);
+    while((ln = listNext(&li))) {
+        keysAsyncJob *job = ln->value;
+        if (job->c == c) {
+            keysAsyncJobFree(ln);
+            return;
+        }
+    }
+}
+
+/* KEYSASYNC pattern */
+void keysasyncCommand(client *c) {
+    sds pattern = c->argv[1]->ptr;
+    keysAsyncJob *job;
+
+    /* Inside MULTI we can't block: fall back to the synchronous
+     * behavior, that is what EXEC semantics require anyway. */
+    if (c->flags & (CLIENT_MULTI|CLIENT_LUA)) {
+        keysCommand(c);
+        return;
+    }
+
+    job = zmalloc(sizeof(*job));
+    job->c = c;
+    job->db = c->db;
+    job->pattern = sdsdup(pattern);
+    job->allkeys = (pattern[0] == '*' && pattern[1] == '\0');
+    job->shard = 0;
+    job->cursor = 0;
+    job->numkeys = 0;
+    job->payload = sdsempty();
+
+    if (keys_async_jobs == NULL) keys_async_jobs = listCreate();
+    listAddNodeTail(keys_async_jobs,job);
+
+    c->bpop.timeout = 0; /* No timeout: the job always completes. */
+    blockClient(c,BLOCKED_KEYSEXPORT);
+}
+
+/* Compiled form of the MATCH pattern of a SCAN call. The glob is analyzed
+ * once when the command arguments are parsed so that the per-element test
+ * can use a plain prefix memcmp() for the common "literal", "literal*" and
+ * "literal<glob>" shapes instead of re-interpreting the whole pattern with
+ * stringmatchlen() for every visited element. */
+typedef struct scanMatcher {
+    const char *pat;    /* The original pattern. */
+    int patlen;
+    int prefixlen;      /* Length of the leading literal part of the glob. */
+    int exact;          /* No special chars at all: exact string compare. */
+    int prefix_only;    /* Pattern is "<literal>*": prefix compare is enough. */
+} scanMatcher;
+
+/* Initialize 'm' from the given pattern, extracting the literal prefix. */
+static void scanMatcherInit(scanMatcher *m, const char *pat, int patlen) {
+    int j;
+
+    for (j = 0; j < patlen; j++) {
+        char c = pat[j];
+        if (c == '*' || c == '?' || c == '[' || c == '\\') break;
+    }
+    m->pat = pat;
+    m->patlen = patlen;
+    m->prefixlen = j;
+    m->exact = (j == patlen);
+    m->prefix_only = (j == patlen-1 && pat[j] == '*');
+}
+
+/* Return non-zero if 'key' matches the compiled pattern. The literal prefix
+ * is checked with memcmp() and only the remainder of the pattern, if any,
+ * goes through the glob matcher. */
+static int scanMatcherMatch(scanMatcher *m, const char *key, int klen) {
+    if (klen < m->prefixlen || memcmp(m->pat,key,m->prefixlen)) return 0;
+    if (m->exact) return klen == m->prefixlen;
+    if (m->prefix_only) return 1;
+    return stringmatchlen(m->pat+m->prefixlen, m->patlen-m->prefixlen,
+                          key+m->prefixlen, klen-m->prefixlen, 0);
+}
+
+/* ----------------------------------------------------------------------------
+ * Background pattern delete: UNLINKMATCH
+ * ----------------------------------------------------------------------------
+ *
+ * UNLINKMATCH START runs the usual "SCAN MATCH + pipelined UNLINK" dance
+ * entirely server side: a job walks the keyspace with dictScan() from
+ * serverCron(), a bounded amount of buckets per tick like the KEYSASYNC
+ * export above, and unlinks every key matching the compiled pattern.
+ * Deletions are propagated as plain UNLINK commands, the way expired
+ * keys are, so replicas and the AOF just see a stream of deletes. The
+ * job id returned by START can be polled with STATUS and aborted with
+ * CANCEL. */
+
+typedef struct unlinkMatchJob {
+    uint64_t id;            /* Job id reported to the client. */
+    redisDb *db;            /* Database selected when the job started. */
+    sds pattern;            /* Pattern to match (private copy). */
+    scanMatcher matcher;    /* Compiled form of 'pattern'. */
+    int shard;              /* Keyspace shard being scanned. */
+    unsigned long cursor;   /* dictScan() cursor inside the shard. */
+    int done;               /* Non zero once the walk is complete. */
+    unsigned long scanned;  /* Keys visited so far. */
+    unsigned long deleted;  /* Keys unlinked so far. */
+    list *batch;            /* Matches of the current chunk (sds names):
+                               they are unlinked right after the
+                               dictScan() call returns, since the
+                               keyspace must not change under it. */
+} unlinkMatchJob;
+
+static list *unlink_match_jobs = NULL;  /* All jobs, oldest first. */
+static uint64_t unlink_match_next_id = 1;
+
+static void unlinkMatchJobFree(listNode *ln) {
+    unlinkMatchJob *job = ln->value;
+    listNode *bn;
+
+    while ((bn = listFirst(job->batch)) != NULL) {
+        sdsfree(bn->value);
+        listDelNode(job->batch,bn);
+    }
+    listRelease(job->batch);
+    sdsfree(job->pattern);
+    zfree(job);
+    listDelNode(unlink_match_jobs,ln);
+}
+
+/* Return the job with the given id, also storing its list node in
+ * '*lnptr' when not NULL. NULL if no such job exists. */
+static unlinkMatchJob *unlinkMatchJobById(uint64_t id, listNode **lnptr) {
+    listIter li;
+    listNode *ln;
+
+    if (unlink_match_jobs == NULL) return NULL;
+    listRewind(unlink_match_jobs,&li);
+    while ((ln = listNext(&li))) {
+        unlinkMatchJob *job = ln->value;
+        if (job->id == id) {
+            if (lnptr) *lnptr = ln;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/* dictScan() callback: collect the matching key names into the job batch.
+ * The actual delete happens after the scan call returns. */
+static void unlinkMatchScanCallback(void *privdata, const dictEntry *de) {
+    unlinkMatchJob *job = privdata;
+    sds key = dictGetKey(de);
+
+    job->scanned++;
+    if (!scanMatcherMatch(&job->matcher,key,sdslen(key))) return;
+    listAddNodeTail(job->batch,sdsdup(key));
+}
+
+/* Unlink the keys collected by the last scan chunk, propagating every
+ * delete the way expired keys are propagated. */
+static void unlinkMatchFlushBatch(unlinkMatchJob *job) {
+    listNode *bn;
+
+    while ((bn = listFirst(job->batch)) != NULL) {
+        sds key = bn->value;
+        robj *keyobj = createStringObject(key,sdslen(key));
+
+        if (dbAsyncDelete(job->db,keyobj)) {
+            propagateExpire(job->db,keyobj,1); /* Propagates an UNLINK. */
+            signalModifiedKey(job->db,keyobj);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"unlink",keyobj,job->db->id);
+            trackingInvalidateKey(keyobj);
+            rdbDeltaTrackKey(job->db,keyobj);
+            server.dirty++;
+            job->deleted++;
+        }
+        decrRefCount(keyobj);
+        sdsfree(key);
+        listDelNode(job->batch,bn);
+    }
+}
+
+/* Perform a bounded amount of work for the oldest job still running.
+ * Called by serverCron() with the same budgeting of keysAsyncCron():
+ * buckets are scanned in small chunks and we yield as soon as the time
+ * budget for this tick is over. Finished jobs are kept around for
+ * STATUS, pruning the oldest ones beyond a fixed cap. */
+#define UNLINK_MATCH_CHUNK_BUCKETS 128
+#define UNLINK_MATCH_TICK_US 1000
+#define UNLINK_MATCH_DONE_HISTORY 16
+void unlinkMatchCron(void) {
+    listIter li;
+    listNode *ln;
+    unlinkMatchJob *job = NULL;
+
+    if (unlink_match_jobs == NULL || listLength(unlink_match_jobs) == 0)
+        return;
+
+    long done = 0;
+    listRewind(unlink_match_jobs,&li);
+    while ((ln = listNext(&li))) {
+        unlinkMatchJob *j = ln->value;
+        if (j->done) {
+            done++;
+        } else {
+            job = j;
+            break;
+        }
+    }
+    if (job == NULL) return;
+
+    long long start = ustime();
+    while(1) {
+        for (int i = 0; i < UNLINK_MATCH_CHUNK_BUCKETS; i++) {
+            job->cursor = dictScan(job->db->dict[job->shard],job->cursor,
+                                   unlinkMatchScanCallback,NULL,job);
+            unlinkMatchFlushBatch(job);
+            if (job->cursor == 0 && ++job->shard == server.db_dict_shards) {
+                /* Jobs complete in submission order, so the finished ones
+                 * form a prefix of the list: prune from the head. */
+                job->done = 1;
+                while (done-- >= UNLINK_MATCH_DONE_HISTORY)
+                    unlinkMatchJobFree(listFirst(unlink_match_jobs));
+                return;
+            }
+        }
+        if (ustime()-start > UNLINK_MATCH_TICK_US) return;
+    }
+}
+
+/* UNLINKMATCH START <pattern>
+ * UNLINKMATCH STATUS <job-id>
+ * UNLINKMATCH CANCEL <job-id> */
+void unlinkmatchCommand(client *c) {
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
+        const char *help[] = {
+"START <pattern>  -- Unlink the keys matching <pattern> in the background, a bounded amount of work per server tick. Returns the job id.",
+"STATUS <job-id>  -- Return the state and the progress counters of the job.",
+"CANCEL <job-id>  -- Stop the job. Keys already unlinked stay deleted.",
+NULL
+        };
+        addReplyHelp(c, help);
+    } else if (c->argc == 3 && !strcasecmp(c->argv[1]->ptr,"start")) {
+        sds pattern = c->argv[2]->ptr;
+        unlinkMatchJob *job = zmalloc(sizeof(*job));
+
+        job->id = unlink_match_next_id++;
+        job->db = c->db;
+        job->pattern = sdsdup(pattern);
+        scanMatcherInit(&job->matcher,job->pattern,sdslen(job->pattern));
+        job->shard = 0;
+        job->cursor = 0;
+        job->done = 0;
+        job->scanned = 0;
+        job->deleted = 0;
+        job->batch = listCreate();
+
+        if (unlink_match_jobs == NULL) unlink_match_jobs = listCreate();
+        listAddNodeTail(unlink_match_jobs,job);
+        addReplyLongLong(c,job->id);
+    } else if (c->argc == 3 && (!strcasecmp(c->argv[1]->ptr,"status") ||
+                                !strcasecmp(c->argv[1]->ptr,"cancel")))
+    {
+        long long id;
+        listNode *ln = NULL;
+        unlinkMatchJob *job;
+
+        if (getLongLongFromObjectOrReply(c,c->argv[2],&id,NULL) != C_OK)
+            return;
+        if (id < 1 || (job = unlinkMatchJobById(id,&ln)) == NULL) {
+            addReplyError(c,"No such job id");
+            return;
+        }
+        if (!strcasecmp(c->argv[1]->ptr,"cancel")) {
+            unlinkMatchJobFree(ln);
+            addReply(c,shared.ok);
+            return;
+        }
+        addReplyMapLen(c,4);
+        addReplyBulkCString(c,"state");
+        addReplyBulkCString(c,job->done ? "done" : "running");
+        addReplyBulkCString(c,"pattern");
+        addReplyBulkCBuffer(c,job->pattern,sdslen(job->pattern));
+        addReplyBulkCString(c,"scanned");
+        addReplyLongLong(c,job->scanned);
+        addReplyBulkCString(c,"deleted");
+        addReplyLongLong(c,job->deleted);
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
+
 /* This callback is used by scanGenericCommand in order to collect elements
- * returned by the dictionary iterator into a list. */
+ * returned by the dictionary iterator into a list. Pattern and type
+ * filtering is performed here, before any copy of the element is made. */
 void scanCallback(void *privdata, const dictEntry *de) {
     void **pd = (void**) privdata;
     list *keys = pd[0];
     robj *o = pd[1];
+    scanMatcher *matcher = pd[2];
+    sds typename = pd[3];
     robj *key, *val = NULL;
 
+    /* Filter by pattern while the element is still a plain sds: this
+     * avoids creating (and then destroying) objects for elements that
+     * won't be returned. Every dictionary backed container stores the
+     * element name as the entry key. */
+    if (matcher) {
+        sds sdskey = dictGetKey(de);
+        if (!scanMatcherMatch(matcher,sdskey,sdslen(sdskey))) return;
+    }
+
+    /* Filter by type using the value stored in the main dictionary: no
+     * key lookup is needed, and for values not yet loaded in memory the
+     * object header already carries the logical type. */
+    if (typename && o == NULL) {
+        if (strcasecmp(typename,getObjectTypeName(dictGetVal(de)))) return;
+    }
+
     if (o == NULL) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey, sdslen(sdskey));
@@ -680,7 +1330,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     long count = 10;
     sds pat = NULL;
     sds typename = NULL;
-    int patlen = 0, use_pattern = 0;
+    int patlen = 0, use_pattern = 0, filtered_in_scan = 0, stateful = 0;
+    scanMatcher matcher;
     dict *ht;
 
     /* Object must be NULL (to iterate keys names), or the type of the object
@@ -714,12 +1365,20 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             /* The pattern always matches if it is exactly "*", so it is
              * equivalent to disabling it. */
             use_pattern = !(pat[0] == '*' && patlen == 1);
+            if (use_pattern) scanMatcherInit(&matcher,pat,patlen);
 
             i += 2;
         } else if (!strcasecmp(c->argv[i]->ptr, "type") && o == NULL && j >= 2) {
             /* SCAN for a particular type only applies to the db dict */
             typename = c->argv[i+1]->ptr;
             i+= 2;
+        } else if (!strcasecmp(c->argv[i]->ptr, "stateful") && o != NULL) {
+            /* Keep the iteration state in a server side session instead
+             * of the cursor: see scansession.c. Not offered for SCAN
+             * itself, as pinning the keyspace dicts would pause their
+             * rehash globally. */
+            stateful = 1;
+            i++;
         } else {
             addReply(c,shared.syntaxerr);
             goto cleanup;
@@ -734,10 +1393,13 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
      * just return everything inside the object in a single call, setting the
      * cursor to zero to signal the end of the iteration. */
 
-    /* Handle the case of a hash table. */
+    /* Handle the case of a hash table. A sharded keyspace leaves 'ht' set
+     * to NULL and is iterated with dbScan() instead, which walks the
+     * shards one after the other keeping the shard index in the lowest
+     * bits of the cursor. */
     ht = NULL;
     if (o == NULL) {
-        ht = c->db->dict;
+        if (server.db_dict_shards == 1) ht = c->db->dict[0];
     } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
@@ -749,24 +1411,57 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         count *= 2; /* We return key / value for this type. */
     }
 
-    if (ht) {
-        void *privdata[2];
+    /* Stateful sessions only make sense for the hash table encodings:
+     * the compact ones are returned whole in a single batch anyway, so
+     * for them the option just degrades to the regular behavior. */
+    if (stateful && ht && o) {
+        if (use_pattern) {
+            addReplyError(c,"MATCH is not supported with STATEFUL");
+            goto cleanup;
+        }
+        scanSessionGenericCommand(c,o,ht,cursor,count);
+        goto cleanup;
+    }
+
+    if (o == NULL || ht) {
+        /* We pass four pointers to the callback: the list to which it
+         * will add new elements, the object containing the dictionary so
+         * that it is possible to fetch more data in a type-dependent way,
+         * and the pattern / type filters, applied inside the callback
+         * before any copy of the element is made. */
+        void *privdata[4];
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
          * sparsely populated) we avoid to block too much time at the cost
          * of returning no or very few elements. */
         long maxiterations = count*10;
+        long long timelimit = 0;
+
+        if (use_pattern || typename) {
+            /* When elements are filtered inside the scan callback the
+             * bucket count is a poor proxy for the work performed: a
+             * selective pattern may need to visit many buckets before
+             * COUNT matching elements are found. In that case the loop is
+             * budgeted by time, so that every call makes real progress
+             * over the keyspace while the event loop stays responsive. */
+            maxiterations = count*1000;
+            timelimit = ustime()+1000; /* 1 millisecond. */
+            filtered_in_scan = 1;
+        }
 
-        /* We pass two pointers to the callback: the list to which it will
-         * add new elements, and the object containing the dictionary so that
-         * it is possible to fetch more data in a type-dependent way. */
         privdata[0] = keys;
         privdata[1] = o;
+        privdata[2] = use_pattern ? &matcher : NULL;
+        privdata[3] = typename;
         do {
-            cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
+            if (ht)
+                cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
+            else
+                cursor = dbScan(c->db, cursor, scanCallback, NULL, privdata);
         } while (cursor &&
               maxiterations-- &&
-              listLength(keys) < (unsigned long)count);
+              listLength(keys) < (unsigned long)count &&
+              (!timelimit || ustime() < timelimit));
     } else if (o->type == OBJ_SET) {
         int pos = 0;
         int64_t ll;
@@ -775,17 +1470,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpFirst(o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -799,10 +1494,12 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         nextnode = listNextNode(node);
         int filter = 0;
 
-        /* Filter element if it does not match the pattern. */
-        if (!filter && use_pattern) {
+        /* Filter element if it does not match the pattern. The scan
+         * callback already did it for hash table iterations, so this only
+         * applies to the intset / listpack paths above. */
+        if (!filter && use_pattern && !filtered_in_scan) {
             if (sdsEncodedObject(kobj)) {
-                if (!stringmatchlen(pat, patlen, kobj->ptr, sdslen(kobj->ptr), 0))
+                if (!scanMatcherMatch(&matcher, kobj->ptr, sdslen(kobj->ptr)))
                     filter = 1;
             } else {
                 char buf[LONG_STR_SIZE];
@@ -810,17 +1507,10 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
                 serverAssert(kobj->encoding == OBJ_ENCODING_INT);
                 len = ll2string(buf,sizeof(buf),(long)kobj->ptr);
-                if (!stringmatchlen(pat, patlen, buf, len, 0)) filter = 1;
+                if (!scanMatcherMatch(&matcher, buf, len)) filter = 1;
             }
         }
 
-        /* Filter an element if it isn't the type we want. */
-        if (!filter && o == NULL && typename){
-            robj* typecheck = lookupKeyReadWithFlags(c->db, kobj, LOOKUP_NOTOUCH);
-            char* type = getObjectTypeName(typecheck);
-            if (strcasecmp((char*) typename, type)) filter = 1;
-        }
-
         /* Filter element if it is an expired key. */
         if (!filter && o == NULL && expireIfNeeded(c->db, kobj)) filter = 1;
 
@@ -870,7 +1560,7 @@ void scanCommand(client *c) {
 }
 
 void dbsizeCommand(client *c) {
-    addReplyLongLong(c,dictSize(c->db->dict));
+    addReplyLongLong(c,dbSize(c->db));
 }
 
 void lastsaveCommand(client *c) {
@@ -905,6 +1595,67 @@ void typeCommand(client *c) {
     addReplyStatus(c, getObjectTypeName(o));
 }
 
+/* KEYINFO key [key ...]
+ *
+ * Reply with one map per key carrying the metadata that clients
+ * otherwise gather with an EXISTS + TYPE + TTL + OBJECT ENCODING
+ * pipeline, four dispatches and four lookups of the same key. Here each
+ * key is resolved once (without touching its LRU information, like the
+ * individual commands) and the answers come out of that single lookup:
+ *
+ *   "exists"   0 or 1
+ *   "type"     as TYPE ("none" for missing keys)
+ *   "ttl"      in seconds as TTL (-1 no expire, -2 missing key)
+ *   "encoding" as OBJECT ENCODING (nil for missing keys)
+ */
+void keyinfoCommand(client *c) {
+    int j;
+
+#if defined(__GNUC__)
+    /* The keys come from random buckets: issue the bucket prefetches
+     * first so the lookup misses overlap, as evictionPoolPopulate()
+     * does when sampling. */
+    for (j = 1; j < c->argc; j++) {
+        sds key = c->argv[j]->ptr;
+        dict *d = dbGetDict(c->db,key);
+        uint64_t hash = dictHashKey(d,key);
+        __builtin_prefetch(&d->ht[0].table[hash & d->ht[0].sizemask]);
+        if (dictIsRehashing(d))
+            __builtin_prefetch(&d->ht[1].table[hash & d->ht[1].sizemask]);
+    }
+#endif
+
+    addReplyArrayLen(c,c->argc-1);
+    for (j = 1; j < c->argc; j++) {
+        robj *o = lookupKeyReadWithFlags(c->db,c->argv[j],LOOKUP_NOTOUCH);
+        long long ttl = -2;
+
+        if (o) {
+            long long expire = getExpire(c->db,c->argv[j]);
+            if (expire != -1) {
+                ttl = expire-mstime();
+                if (ttl < 0) ttl = 0;
+                ttl = (ttl+500)/1000;
+            } else {
+                ttl = -1;
+            }
+        }
+
+        addReplyMapLen(c,4);
+        addReplyBulkCString(c,"exists");
+        addReplyLongLong(c,o != NULL);
+        addReplyBulkCString(c,"type");
+        addReplyBulkCString(c,getObjectTypeName(o));
+        addReplyBulkCString(c,"ttl");
+        addReplyLongLong(c,ttl);
+        addReplyBulkCString(c,"encoding");
+        if (o)
+            addReplyBulkCString(c,strEncoding(o->encoding));
+        else
+            addReplyNull(c);
+    }
+}
+
 void shutdownCommand(client *c) {
     int flags = 0;
 
@@ -964,6 +1715,9 @@ void renameGenericCommand(client *c, int nx) {
     }
     dbAdd(c->db,c->argv[2],o);
     if (expire != -1) setExpire(c,c->db,c->argv[2],expire);
+    /* Hash field TTLs follow the value to its new name. */
+    if (o->type == OBJ_HASH)
+        hashExpiresMove(c->db,c->argv[1]->ptr,c->db,c->argv[2]->ptr);
     dbDelete(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[2]);
@@ -1030,6 +1784,9 @@ void moveCommand(client *c) {
     }
     dbAdd(dst,c->argv[1],o);
     if (expire != -1) setExpire(c,dst,c->argv[1],expire);
+    /* Hash field TTLs follow the value into the target DB. */
+    if (o->type == OBJ_HASH)
+        hashExpiresMove(src,c->argv[1]->ptr,dst,c->argv[1]->ptr);
     incrRefCount(o);
 
     /* OK! key moved, free the entry in the source DB */
@@ -1083,13 +1840,23 @@ int dbSwapDatabases(long id1, long id2) {
      * remain in the same DB they were. */
     db1->dict = db2->dict;
     db1->expires = db2->expires;
+    db1->expires_index = db2->expires_index;
+    db1->hexpires = db2->hexpires;
+    db1->hexpires_index = db2->hexpires_index;
     db1->avg_ttl = db2->avg_ttl;
-    db1->expires_cursor = db2->expires_cursor;
+    db1->min_expire = db2->min_expire;
+    db1->reclaimed_upto = db2->reclaimed_upto;
+    memcpy(db1->type_count,db2->type_count,sizeof(db1->type_count));
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
+    db2->expires_index = aux.expires_index;
+    db2->hexpires = aux.hexpires;
+    db2->hexpires_index = aux.hexpires_index;
     db2->avg_ttl = aux.avg_ttl;
-    db2->expires_cursor = aux.expires_cursor;
+    db2->min_expire = aux.min_expire;
+    db2->reclaimed_upto = aux.reclaimed_upto;
+    memcpy(db2->type_count,aux.type_count,sizeof(db2->type_count));
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1102,6 +1869,17 @@ int dbSwapDatabases(long id1, long id2) {
      * if needed. */
     scanDatabaseForReadyLists(db1);
     scanDatabaseForReadyLists(db2);
+
+    /* Cached replies are tracked by DB index, which now points to the
+     * other keyspace: drop both sides. Ditto for the scan sessions. */
+    replyCacheFlush(id1);
+    replyCacheFlush(id2);
+    scanSessionInvalidateDb(id1);
+    scanSessionInvalidateDb(id2);
+
+    /* The keys tracked for delta RDB saves are per DB index too, and a
+     * swap cannot be expressed in a delta file. */
+    rdbDeltaInvalidate();
     return C_OK;
 }
 
@@ -1138,11 +1916,281 @@ void swapdbCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* The helpers below maintain db->expires_index, a radix tree indexing the
+ * volatile keys by expire time. Every entry is the 8 bytes big endian expire
+ * unix time in milliseconds followed by the key name, so that a
+ * lexicographical walk of the tree visits the keys in the order they'll
+ * expire. This way the active expire cycle can collect exactly the keys that
+ * are already logically dead, doing work proportional to their number
+ * instead of randomly sampling the whole expires dictionary. */
+
+/* Build the expires_index entry for 'key' expiring at 'when'. The entry is
+ * written into 'stackbuf' (of size 'stacklen') when it fits, otherwise into
+ * a heap allocated buffer the caller needs to free. The entry length is
+ * returned by reference in 'ikeylen'. */
+static unsigned char *expiresIndexKey(unsigned char *stackbuf, size_t stacklen,
+                                      size_t *ikeylen, sds key, long long when)
+{
+    size_t len = 8+sdslen(key);
+    unsigned char *ikey = stackbuf;
+    uint64_t enc = htonu64((uint64_t)when);
+
+    if (len > stacklen) ikey = zmalloc(len);
+    memcpy(ikey,&enc,8);
+    memcpy(ikey+8,key,sdslen(key));
+    *ikeylen = len;
+    return ikey;
+}
+
+static void expiresIndexInsert(redisDb *db, sds key, long long when) {
+    unsigned char stackbuf[128], *ikey;
+    size_t ikeylen;
+
+    ikey = expiresIndexKey(stackbuf,sizeof(stackbuf),&ikeylen,key,when);
+    raxInsert(db->expires_index,ikey,ikeylen,NULL,NULL);
+    if (ikey != stackbuf) zfree(ikey);
+    if (when < db->min_expire) db->min_expire = when;
+}
+
+static void expiresIndexRemove(redisDb *db, sds key, long long when) {
+    unsigned char stackbuf[128], *ikey;
+    size_t ikeylen;
+
+    ikey = expiresIndexKey(stackbuf,sizeof(stackbuf),&ikeylen,key,when);
+    raxRemove(db->expires_index,ikey,ikeylen,NULL);
+    if (ikey != stackbuf) zfree(ikey);
+}
+
+/* Delete the expire of 'key', if any, from both the expires dictionary and
+ * the expires time index. Returns 1 if the key had an expire associated. */
+int dbDeleteExpire(redisDb *db, sds key) {
+    dictEntry *de;
+
+    if (dictSize(db->expires) == 0 ||
+        (de = dictFind(db->expires,key)) == NULL) return 0;
+    expiresIndexRemove(db,key,dictGetSignedIntegerVal(de));
+    dictDelete(db->expires,key);
+    return 1;
+}
+
+/* Return the number of keys of 'db' that are already logically expired at
+ * time 'now' but are still in memory, by walking the head of the expires
+ * time index. The cost is proportional to the returned count. */
+long long dbPendingExpires(redisDb *db, long long now) {
+    raxIterator ri;
+    long long count = 0;
+
+    if (raxSize(db->expires_index) == 0) return 0;
+    raxStart(&ri,db->expires_index);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri)) {
+        uint64_t enc;
+        memcpy(&enc,ri.key,sizeof(enc));
+        if ((long long)ntohu64(enc) >= now) break;
+        count++;
+    }
+    raxStop(&ri);
+    return count;
+}
+
+/* Recompute db->min_expire, the cached lower bound on the nearest expire
+ * time of the DB, from the head of the expires time index. The bound is
+ * only lowered eagerly (by expiresIndexInsert()), so once a volatile key
+ * is deleted or touched the bound may be stale: this function is called
+ * by keyIsExpired() when the bound trips, and is rate limited to once per
+ * millisecond since while a logically expired key lingers (as it happens
+ * on replicas waiting for the master DEL) the bound keeps tripping. */
+void dbUpdateMinExpire(redisDb *db) {
+    raxIterator ri;
+
+    db->min_expire_at = mstime();
+    db->min_expire = LLONG_MAX;
+    if (raxSize(db->expires_index) == 0) return;
+    raxStart(&ri,db->expires_index);
+    raxSeek(&ri,"^",NULL,0);
+    if (raxNext(&ri)) {
+        uint64_t enc;
+        memcpy(&enc,ri.key,sizeof(enc));
+        db->min_expire = (mstime_t)ntohu64(enc);
+    }
+    raxStop(&ri);
+}
+
+/* ----------------------------- Hash field expires ------------------------
+ * Hashes may have per-field TTLs (HEXPIRE and friends). To avoid growing
+ * every hash entry, the TTLs live in a per database side structure: the
+ * db->hexpires dictionary maps the key name to a compact listpack of
+ * (field, expire mstime) pairs, and only hashes that actually use field
+ * TTLs have an entry. The db->hexpires_index radix tree orders those
+ * hashes by their nearest field deadline, with the same entry layout as
+ * expires_index, so the active expire cycle can pop exactly the hashes
+ * with dead fields. */
+
+/* Return the listpack with the (field, expire time) pairs of 'key', or
+ * NULL when the hash has no field TTLs. */
+unsigned char *hashExpiresLookup(redisDb *db, sds key) {
+    dictEntry *de;
+
+    if (dictSize(db->hexpires) == 0 ||
+        (de = dictFind(db->hexpires,key)) == NULL) return NULL;
+    return dictGetVal(de);
+}
+
+/* Return the nearest deadline among the pairs of 'lp', or -1 when the
+ * listpack is empty. The listpacks are small by design, so the linear
+ * scan is fine. */
+static long long hashExpiresMinDeadline(unsigned char *lp) {
+    long long min = -1;
+    unsigned char *p = lpFirst(lp);
+
+    while (p) {
+        long long when;
+        unsigned char *q = lpNext(lp,p); /* Deadline of the field at 'p'. */
+        serverAssert(q != NULL);
+        serverAssert(lpGetValue(q,NULL,&when) == NULL);
+        if (min == -1 || when < min) min = when;
+        p = lpNext(lp,q);
+    }
+    return min;
+}
+
+static void hashExpiresIndexInsert(redisDb *db, sds key, long long when) {
+    unsigned char stackbuf[128], *ikey;
+    size_t ikeylen;
+
+    ikey = expiresIndexKey(stackbuf,sizeof(stackbuf),&ikeylen,key,when);
+    raxInsert(db->hexpires_index,ikey,ikeylen,NULL,NULL);
+    if (ikey != stackbuf) zfree(ikey);
+}
+
+static void hashExpiresIndexRemove(redisDb *db, sds key, long long when) {
+    unsigned char stackbuf[128], *ikey;
+    size_t ikeylen;
+
+    ikey = expiresIndexKey(stackbuf,sizeof(stackbuf),&ikeylen,key,when);
+    raxRemove(db->hexpires_index,ikey,ikeylen,NULL);
+    if (ikey != stackbuf) zfree(ikey);
+}
+
+/* Set or update the expire time of 'field' in the hash 'key' to the
+ * absolute unix time 'when' in milliseconds. */
+void hashExpiresSetField(redisDb *db, sds key, sds field, long long when) {
+    dictEntry *de = dictFind(db->hexpires,key);
+    unsigned char *lp;
+    long long oldmin = -1, newmin;
+    char buf[LONG_STR_SIZE];
+    int buflen = ll2string(buf,sizeof(buf),when);
+
+    if (de == NULL) {
+        lp = lpNew();
+        de = dictAddRaw(db->hexpires,sdsdup(key),NULL);
+    } else {
+        lp = dictGetVal(de);
+        oldmin = hashExpiresMinDeadline(lp);
+        unsigned char *p = lpFind(lp,lpFirst(lp),(unsigned char*)field,
+                                  sdslen(field),1);
+        if (p) {
+            /* The field had a deadline already: replace it in place. */
+            unsigned char *q = lpNext(lp,p);
+            lp = lpReplace(lp,&q,(unsigned char*)buf,buflen);
+            dictSetVal(db->hexpires,de,lp);
+            newmin = hashExpiresMinDeadline(lp);
+            goto updateindex;
+        }
+    }
+    lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
+    lp = lpAppend(lp,(unsigned char*)buf,buflen);
+    dictSetVal(db->hexpires,de,lp);
+    newmin = (oldmin == -1 || when < oldmin) ? when : oldmin;
+
+updateindex:
+    if (newmin != oldmin) {
+        if (oldmin != -1) hashExpiresIndexRemove(db,key,oldmin);
+        hashExpiresIndexInsert(db,key,newmin);
+    }
+}
+
+/* Remove the expire time of 'field' in the hash 'key', if any. Returns 1
+ * when the field had a deadline that was removed, 0 otherwise. */
+int hashExpiresRemoveField(redisDb *db, sds key, sds field) {
+    dictEntry *de;
+    unsigned char *lp, *p;
+    long long oldmin, newmin;
+
+    if (dictSize(db->hexpires) == 0 ||
+        (de = dictFind(db->hexpires,key)) == NULL) return 0;
+    lp = dictGetVal(de);
+    p = lpFind(lp,lpFirst(lp),(unsigned char*)field,sdslen(field),1);
+    if (p == NULL) return 0;
+    oldmin = hashExpiresMinDeadline(lp);
+    lp = lpDelete(lp,p,&p); /* Field name: 'p' lands on the deadline. */
+    lp = lpDelete(lp,p,NULL);
+    if (lpLength(lp) == 0) {
+        hashExpiresIndexRemove(db,key,oldmin);
+        dictSetVal(db->hexpires,de,lp);
+        dictDelete(db->hexpires,key);
+        return 1;
+    }
+    dictSetVal(db->hexpires,de,lp);
+    newmin = hashExpiresMinDeadline(lp);
+    if (newmin != oldmin) {
+        hashExpiresIndexRemove(db,key,oldmin);
+        hashExpiresIndexInsert(db,key,newmin);
+    }
+    return 1;
+}
+
+/* Return the expire time of 'field' in the hash 'key' in absolute unix
+ * time milliseconds, or -1 when the field has no deadline. */
+long long hashExpiresGetField(redisDb *db, sds key, sds field) {
+    unsigned char *lp = hashExpiresLookup(db,key);
+    unsigned char *p;
+    long long when;
+
+    if (lp == NULL) return -1;
+    p = lpFind(lp,lpFirst(lp),(unsigned char*)field,sdslen(field),1);
+    if (p == NULL) return -1;
+    serverAssert(lpGetValue(lpNext(lp,p),NULL,&when) == NULL);
+    return when;
+}
+
+/* Drop all the field TTLs of 'key', used when the key itself goes away
+ * or is overwritten by a different value. */
+void hashExpiresDelete(redisDb *db, sds key) {
+    dictEntry *de;
+
+    if (dictSize(db->hexpires) == 0 ||
+        (de = dictFind(db->hexpires,key)) == NULL) return;
+    hashExpiresIndexRemove(db,key,hashExpiresMinDeadline(dictGetVal(de)));
+    dictDelete(db->hexpires,key);
+}
+
+/* Move the field TTLs of 'srckey' in 'src' to 'dstkey' in 'dst', used by
+ * RENAME and MOVE. Any field TTLs the destination had are dropped, like
+ * the destination value itself. */
+void hashExpiresMove(redisDb *src, sds srckey, redisDb *dst, sds dstkey) {
+    dictEntry *de;
+    unsigned char *lp;
+    long long min;
+
+    if (dictSize(src->hexpires) == 0 ||
+        (de = dictUnlink(src->hexpires,srckey)) == NULL) return;
+    lp = dictGetVal(de);
+    dictSetVal(src->hexpires,de,NULL); /* Steal the listpack. */
+    dictFreeUnlinkedEntry(src->hexpires,de);
+    min = hashExpiresMinDeadline(lp);
+    hashExpiresIndexRemove(src,srckey,min);
+
+    hashExpiresDelete(dst,dstkey);
+    dictAdd(dst->hexpires,sdsdup(dstkey),lp);
+    hashExpiresIndexInsert(dst,dstkey,min);
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    serverAssertWithInfo(NULL,key,dictFind(dbGetDict(db,key->ptr),key->ptr) != NULL);
+    return dbDeleteExpire(db,key->ptr);
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1153,10 +2201,17 @@ void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
     /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
+    kde = dictFind(dbGetDict(db,key->ptr),key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
+    de = dictFind(db->expires,dictGetKey(kde));
+    if (de) {
+        /* The key already had an expire: drop the old index entry. */
+        expiresIndexRemove(db,dictGetKey(kde),dictGetSignedIntegerVal(de));
+    } else {
+        de = dictAddOrFind(db->expires,dictGetKey(kde));
+    }
     dictSetSignedIntegerVal(de,when);
+    expiresIndexInsert(db,dictGetKey(kde),when);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1174,7 +2229,7 @@ long long getExpire(redisDb *db, robj *key) {
 
     /* The entry was found in the expire dict, this means it should also
      * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+    serverAssertWithInfo(NULL,key,dictFind(dbGetDict(db,key->ptr),key->ptr) != NULL);
     return dictGetSignedIntegerVal(de);
 }
 
@@ -1204,10 +2259,9 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
 
 /* Check if the key is expired. */
 int keyIsExpired(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
-    mstime_t now;
+    mstime_t when, now;
 
-    if (when < 0) return 0; /* No expire for this key */
+    if (dictSize(db->expires) == 0) return 0; /* No volatile keys at all. */
 
     /* Don't expire anything while loading. It will be done later. */
     if (server.loading) return 0;
@@ -1235,6 +2289,20 @@ int keyIsExpired(redisDb *db, robj *key) {
         now = mstime();
     }
 
+    /* Fast path: if no key of the DB can be expired at 'now' we don't even
+     * need to check if this one has an expire, at the cost of a single
+     * comparison. The bound is conservative, so when it trips we refresh
+     * it from the expires index head and check again before falling back
+     * to the expires dictionary lookup. */
+    if (now < db->min_expire) return 0;
+    if (now != db->min_expire_at) {
+        dbUpdateMinExpire(db);
+        if (now < db->min_expire) return 0;
+    }
+
+    when = getExpire(db,key);
+    if (when < 0) return 0; /* No expire for this key */
+
     /* The key expired if the current (virtual or real) time is greater
      * than the expire time of the key. */
     return now > when;
@@ -1277,6 +2345,8 @@ int expireIfNeeded(redisDb *db, robj *key) {
     propagateExpire(db,key,server.lazyfree_lazy_expire);
     notifyKeyspaceEvent(NOTIFY_EXPIRED,
         "expired",key,db->id);
+    trackingInvalidateKey(key);
+    rdbDeltaTrackKey(db,key);
     return server.lazyfree_lazy_expire ? dbAsyncDelete(db,key) :
                                          dbSyncDelete(db,key);
 }
@@ -1376,6 +2446,26 @@ int *zunionInterGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *nu
     return keys;
 }
 
+/* Helper function to extract keys from the following command:
+ * SINTERCARD <num-keys> <key> <key> ... <key> [LIMIT <limit>] */
+int *sintercardGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys) {
+    int i, num, *keys;
+    UNUSED(cmd);
+
+    num = atoi(argv[1]->ptr);
+    /* Sanity check. Don't return any key if the command is going to
+     * reply with syntax error. */
+    if (num < 1 || num > (argc-2)) {
+        *numkeys = 0;
+        return NULL;
+    }
+
+    keys = zmalloc(sizeof(int)*num);
+    for (i = 0; i < num; i++) keys[i] = 2+i;
+    *numkeys = num;
+    return keys;
+}
+
 /* Helper function to extract keys from the following commands:
  * EVAL <script> <num-keys> <key> <key> ... <key> [more stuff]
  * EVALSHA <script> <num-keys> <key> <key> ... <key> [more stuff] */
@@ -1559,26 +2649,15 @@ int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
 }
 
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
- * a fast way a key that belongs to a specified hash slot. This is useful
- * while rehashing the cluster and in other conditions when we need to
- * understand if we have keys for a given hash slot. */
+ * a fast way the keys that belong to a specified hash slot. Since the
+ * keyspace shards are selected with the cluster slot hashing (see
+ * dbGetDict()), all the keys of a slot live in a single shard and can be
+ * enumerated by walking it: the only dedicated state we keep is the
+ * per-slot key count. */
 void slotToKeyUpdateKey(robj *key, int add) {
     unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-    unsigned char buf[64];
-    unsigned char *indexed = buf;
-    size_t keylen = sdslen(key->ptr);
 
     server.cluster->slots_keys_count[hashslot] += add ? 1 : -1;
-    if (keylen+2 > 64) indexed = zmalloc(keylen+2);
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    memcpy(indexed+2,key->ptr,keylen);
-    if (add) {
-        raxInsert(server.cluster->slots_to_keys,indexed,keylen+2,NULL,NULL);
-    } else {
-        raxRemove(server.cluster->slots_to_keys,indexed,keylen+2,NULL);
-    }
-    if (indexed != buf) zfree(indexed);
 }
 
 void slotToKeyAdd(robj *key) {
@@ -1590,52 +2669,56 @@ void slotToKeyDel(robj *key) {
 }
 
 void slotToKeyFlush(void) {
-    raxFree(server.cluster->slots_to_keys);
-    server.cluster->slots_to_keys = raxNew();
     memset(server.cluster->slots_keys_count,0,
            sizeof(server.cluster->slots_keys_count));
 }
 
+/* Return the keyspace shard storing the keys of the specified hash slot.
+ * In cluster mode there is a single DB, so only DB 0 is considered. */
+static dict *slotToKeyGetDict(unsigned int hashslot) {
+    return server.db[0].dict[hashslot & (server.db_dict_shards-1)];
+}
+
 /* Pupulate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
  * decrement the reference count to release the keys names. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    raxSeek(&iter,">=",indexed,2);
-    while(count-- && raxNext(&iter)) {
-        if (iter.key[0] != indexed[0] || iter.key[1] != indexed[1]) break;
-        keys[j++] = createStringObject((char*)iter.key+2,iter.key_len-2);
-    }
-    raxStop(&iter);
+    dictIterator *di;
+    dictEntry *de;
+    unsigned int j = 0;
+    unsigned int remaining = countKeysInSlot(hashslot);
+
+    if (remaining == 0) return 0;
+    if (count > remaining) count = remaining;
+    di = dictGetIterator(slotToKeyGetDict(hashslot));
+    while(j < count && (de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+        if (keyHashSlot(key,sdslen(key)) != hashslot) continue;
+        keys[j++] = createStringObject(key,sdslen(key));
+    }
+    dictReleaseIterator(di);
     return j;
 }
 
 /* Remove all the keys in the specified hash slot.
  * The number of removed items is returned. */
 unsigned int delKeysInSlot(unsigned int hashslot) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    while(server.cluster->slots_keys_count[hashslot]) {
-        raxSeek(&iter,">=",indexed,2);
-        raxNext(&iter);
-
-        robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
-        dbDelete(&server.db[0],key);
-        decrRefCount(key);
+    dictIterator *di;
+    dictEntry *de;
+    unsigned int j = 0;
+
+    if (countKeysInSlot(hashslot) == 0) return 0;
+    di = dictGetSafeIterator(slotToKeyGetDict(hashslot));
+    while((de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+        if (keyHashSlot(key,sdslen(key)) != hashslot) continue;
+
+        robj *keyobj = createStringObject(key,sdslen(key));
+        dbDelete(&server.db[0],keyobj);
+        decrRefCount(keyobj);
         j++;
     }
-    raxStop(&iter);
+    dictReleaseIterator(di);
     return j;
 }
 
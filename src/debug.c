@@ -30,6 +30,7 @@
 #include "server.h"
 #include "sha1.h"   /* SHA1 is used for DEBUG DIGEST */
 #include "crc64.h"
+#include "anet.h"   /* Digest snapshot pipe is non blocking */
 
 #include <arpa/inet.h>
 #include <signal.h>
@@ -147,7 +148,7 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
     } else if (o->type == OBJ_ZSET) {
         unsigned char eledigest[20];
 
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = o->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -155,13 +156,13 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
             long long vll;
             double score;
 
-            eptr = ziplistIndex(zl,0);
+            eptr = lpSeek(zl,0);
             serverAssert(eptr != NULL);
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssert(sptr != NULL);
 
             while (eptr != NULL) {
-                serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                vstr = lpGetValue(eptr,&vlen,&vll);
                 score = zzlGetScore(sptr);
 
                 memset(eledigest,0,20);
@@ -257,7 +258,7 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
  * a different digest. */
 void computeDatasetDigest(unsigned char *final) {
     unsigned char digest[20];
-    dictIterator *di = NULL;
+    dbIterator *di = NULL;
     dictEntry *de;
     int j;
     uint32_t aux;
@@ -267,8 +268,8 @@ void computeDatasetDigest(unsigned char *final) {
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
 
-        if (dictSize(db->dict) == 0) continue;
-        di = dictGetSafeIterator(db->dict);
+        if (dbSize(db) == 0) continue;
+        di = dbGetSafeIterator(db);
 
         /* hash the DB id, so the same dataset moved in a different
          * DB will lead to a different digest */
@@ -276,7 +277,7 @@ void computeDatasetDigest(unsigned char *final) {
         mixDigest(final,&aux,sizeof(aux));
 
         /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
+        while((de = dbIteratorNext(di)) != NULL) {
             sds key;
             robj *keyobj, *o;
 
@@ -287,13 +288,187 @@ void computeDatasetDigest(unsigned char *final) {
             mixDigest(digest,key,sdslen(key));
 
             o = dictGetVal(de);
+            if (o->encoding == OBJ_ENCODING_LAZY)
+                o = rdbLazyValueMaterialize(db,keyobj,de);
+            if (o->encoding == OBJ_ENCODING_COLD)
+                o = coldValueMaterialize(db,keyobj,de);
             xorObjectDigest(db,keyobj,digest,o);
 
             /* We can finally xor the key-val digest to the final digest */
             xorDigest(final,digest,20);
             decrRefCount(keyobj);
         }
-        dictReleaseIterator(di);
+        dbReleaseIterator(di);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * In-memory snapshot handles: DEBUG DIGEST ASYNC
+ * ----------------------------------------------------------------------------
+ *
+ * DEBUG DIGEST walks the whole dataset in a single shot while the event
+ * loop waits, and DEBUG RELOAD pays a full rdbSave() plus rdbLoad() cycle
+ * just to verify a round trip. For consistency checks against a big
+ * dataset we can get the same point-in-time guarantees from fork():
+ * the child sees an immutable copy-on-write snapshot of the keyspace
+ * and can iterate it at leisure, without serializing anything to disk
+ * and without stalling the parent.
+ *
+ * The client issuing DEBUG DIGEST ASYNC is blocked, the child computes
+ * the digest against its frozen view and writes the 20 raw bytes to a
+ * pipe, and the parent delivers the reply from a read handler on the
+ * event loop. Only one snapshot child at a time, like any other fork. */
+
+typedef struct snapshotDigestJob {
+    client *c;              /* Blocked owner, NULL if it went away. */
+    int pipe_rd;            /* Read end of the digest pipe. */
+    unsigned char buf[20];  /* Digest bytes received so far. */
+    size_t nread;
+} snapshotDigestJob;
+
+static snapshotDigestJob *snapshot_digest_job = NULL;
+
+/* Release the current job, closing the pipe. If 'kill_child' is true and
+ * the child is still running it is signaled to terminate: its output is
+ * no longer needed. Does not touch the owner client. */
+static void snapshotDigestJobFree(int kill_child) {
+    snapshotDigestJob *job = snapshot_digest_job;
+    if (job == NULL) return;
+    aeDeleteFileEvent(server.el,job->pipe_rd,AE_READABLE);
+    close(job->pipe_rd);
+    if (kill_child && server.snapshot_child_pid != -1)
+        kill(server.snapshot_child_pid,SIGUSR1);
+    zfree(job);
+    snapshot_digest_job = NULL;
+}
+
+/* Read handler of the digest pipe: accumulate the digest bytes and
+ * deliver the reply to the blocked client once all of them arrived. */
+static void snapshotDigestReadHandler(aeEventLoop *el, int fd, void *privdata,
+                                      int mask)
+{
+    snapshotDigestJob *job = privdata;
+    UNUSED(el);
+    UNUSED(mask);
+
+    ssize_t nread = read(fd,job->buf+job->nread,sizeof(job->buf)-job->nread);
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        nread = 0; /* Treat errors as an EOF: the child is gone. */
+    }
+    job->nread += nread;
+    if (nread > 0 && job->nread < sizeof(job->buf)) return;
+
+    client *c = job->c;
+    if (c) {
+        if (job->nread == sizeof(job->buf)) {
+            sds d = sdsempty();
+            for (int i = 0; i < 20; i++)
+                d = sdscatprintf(d,"%02x",job->buf[i]);
+            addReplyStatus(c,d);
+            sdsfree(d);
+        } else {
+            addReplyError(c,"Snapshot child terminated without producing "
+                            "a digest");
+        }
+    }
+    /* Free the job before unblocking, so that the unblock hook finds
+     * nothing left to clean up. The child already wrote everything it
+     * had to write: just let checkChildrenDone() collect it. */
+    snapshotDigestJobFree(0);
+    if (c) unblockClient(c);
+}
+
+/* Called by unblockClient() when a client blocked on a snapshot job goes
+ * away before the digest is delivered: the child output is no longer
+ * interesting, discard the whole job. */
+void snapshotDigestUnblockClient(client *c) {
+    if (snapshot_digest_job && snapshot_digest_job->c == c)
+        snapshotDigestJobFree(1);
+}
+
+/* Called by checkChildrenDone() when the snapshot child is collected.
+ * On a clean exit the digest is sitting in the pipe buffer and the read
+ * handler will deliver it; a child killed by a signal will never write
+ * it, so fail the pending job right away. */
+void snapshotDigestDoneHandler(int exitcode, int bysignal) {
+    server.snapshot_child_pid = -1;
+    if (!bysignal && exitcode == 0) return;
+    serverLog(LL_WARNING,"Snapshot digest child terminated with an error "
+        "condition (exit code %d, signal %d)", exitcode, bysignal);
+    snapshotDigestJob *job = snapshot_digest_job;
+    if (job) {
+        client *c = job->c;
+        if (c) addReplyError(c,"Snapshot child terminated abnormally");
+        snapshotDigestJobFree(0);
+        if (c) unblockClient(c);
+    }
+}
+
+/* DEBUG DIGEST ASYNC: fork a snapshot child computing the dataset digest
+ * and block the client until the result arrives over the pipe. */
+static void snapshotDigestStart(client *c) {
+    int pipefds[2];
+    pid_t childpid;
+
+    if (hasActiveChildProcess()) {
+        addReplyError(c,"Another child process is active (AOF, RDB, module "
+                        "or snapshot): can't take a snapshot now");
+        return;
+    }
+    if (pipe(pipefds) == -1) {
+        addReplyErrorFormat(c,"Can't create the snapshot pipe: %s",
+                            strerror(errno));
+        return;
+    }
+
+    if ((childpid = redisFork()) == 0) {
+        /* Child: the keyspace is frozen by copy-on-write, compute the
+         * digest and stream it back. */
+        unsigned char digest[20];
+        size_t written = 0;
+
+        close(pipefds[0]);
+        redisSetProcTitle("redis-snapshot-digest");
+        computeDatasetDigest(digest);
+        while (written < sizeof(digest)) {
+            ssize_t n = write(pipefds[1],digest+written,
+                              sizeof(digest)-written);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                exitFromChild(1);
+            }
+            written += n;
+        }
+        close(pipefds[1]);
+        exitFromChild(0);
+    } else if (childpid == -1) {
+        close(pipefds[0]);
+        close(pipefds[1]);
+        addReplyErrorFormat(c,"Can't fork the snapshot child: %s",
+                            strerror(errno));
+    } else {
+        /* Parent. */
+        close(pipefds[1]);
+        anetNonBlock(NULL,pipefds[0]);
+
+        snapshotDigestJob *job = zmalloc(sizeof(*job));
+        job->c = c;
+        job->pipe_rd = pipefds[0];
+        job->nread = 0;
+        snapshot_digest_job = job;
+        server.snapshot_child_pid = childpid;
+
+        if (aeCreateFileEvent(server.el,pipefds[0],AE_READABLE,
+                              snapshotDigestReadHandler,job) == AE_ERR)
+        {
+            addReplyError(c,"Can't register the snapshot pipe in the "
+                            "event loop");
+            snapshotDigestJobFree(1);
+            return;
+        }
+        c->bpop.timeout = 0; /* No timeout: the job always completes. */
+        blockClient(c,BLOCKED_SNAPSHOT);
     }
 }
 
@@ -353,7 +528,7 @@ void debugCommand(client *c) {
 "ASSERT -- Crash by assertion failed.",
 "CHANGE-REPL-ID -- Change the replication IDs of the instance. Dangerous, should be used only for testing the replication subsystem.",
 "CRASH-AND-RECOVER <milliseconds> -- Hard crash and restart after <milliseconds> delay.",
-"DIGEST -- Output a hex signature representing the current DB content.",
+"DIGEST [ASYNC] -- Output a hex signature representing the current DB content. With ASYNC the digest is computed by a forked child against a copy-on-write snapshot, without blocking the server.",
 "DIGEST-VALUE <key-1> ... <key-N>-- Output a hex signature of the values of all the specified keys.",
 "ERROR <string> -- Return a Redis protocol error with <string> as message. Useful for clients unit tests to simulate Redis errors.",
 "LOG <message> -- write message to the server log.",
@@ -368,11 +543,13 @@ void debugCommand(client *c) {
 "RESTART -- Graceful restart: save config, db, restart.",
 "SDSLEN <key> -- Show low level SDS string info representing key and value.",
 "SEGFAULT -- Crash the server with sigsegv.",
+"SELFBENCH <get|set|incr> <requests> [<keyspace>] -- Drive the command execution path in-process and report the sustained rate, bypassing the network.",
 "SET-ACTIVE-EXPIRE <0|1> -- Setting it to 0 disables expiring keys in background when they are not accessed (otherwise the Redis behavior). Setting it to 1 reenables back the default.",
 "AOF-FLUSH-SLEEP <microsec> -- Server will sleep before flushing the AOF, this is used for testing",
 "SLEEP <seconds> -- Stop the server for <seconds>. Decimals allowed.",
+"LOOPSTATS -- Return the per-second history of the event loop phase timings.",
 "STRUCTSIZE -- Return the size of different Redis core C structures.",
-"ZIPLIST <key> -- Show low level info about the ziplist encoding.",
+"LISTPACK <key> -- Show low level info about the listpack encoding.",
 "STRINGMATCH-TEST -- Run a fuzz tester against the stringmatchlen() function.",
 #ifdef USE_JEMALLOC
 "MALLCTL <key> [<val>] -- Get or set a malloc tunning integer.",
@@ -443,11 +620,15 @@ NULL
         robj *val;
         char *strenc;
 
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        if ((de = dictFind(dbGetDict(c->db,c->argv[2]->ptr),c->argv[2]->ptr)) == NULL) {
             addReply(c,shared.nokeyerr);
             return;
         }
         val = dictGetVal(de);
+        if (val->encoding == OBJ_ENCODING_LAZY)
+            val = rdbLazyValueMaterialize(c->db,c->argv[2],de);
+        if (val->encoding == OBJ_ENCODING_COLD)
+            val = coldValueMaterialize(c->db,c->argv[2],de);
         strenc = strEncoding(val->encoding);
 
         char extra[138] = {0};
@@ -495,7 +676,8 @@ NULL
         robj *val;
         sds key;
 
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        dict *d = dbGetDict(c->db,c->argv[2]->ptr);
+        if ((de = dictFind(d,c->argv[2]->ptr)) == NULL) {
             addReply(c,shared.nokeyerr);
             return;
         }
@@ -505,27 +687,31 @@ NULL
         if (val->type != OBJ_STRING || !sdsEncodedObject(val)) {
             addReplyError(c,"Not an sds encoded string.");
         } else {
+            /* Inline keys have no allocation of their own: report the
+             * bytes they take inside the dict entry instead. */
+            long long key_zmalloc = dictKeyIsInline(d,de) ?
+                (long long) (sdslen(key)+2) : (long long) sdsZmallocSize(key);
             addReplyStatusFormat(c,
                 "key_sds_len:%lld, key_sds_avail:%lld, key_zmalloc: %lld, "
                 "val_sds_len:%lld, val_sds_avail:%lld, val_zmalloc: %lld",
                 (long long) sdslen(key),
                 (long long) sdsavail(key),
-                (long long) sdsZmallocSize(key),
+                key_zmalloc,
                 (long long) sdslen(val->ptr),
                 (long long) sdsavail(val->ptr),
                 (long long) getStringObjectSdsUsedMemory(val));
         }
-    } else if (!strcasecmp(c->argv[1]->ptr,"ziplist") && c->argc == 3) {
+    } else if (!strcasecmp(c->argv[1]->ptr,"listpack") && c->argc == 3) {
         robj *o;
 
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nokeyerr))
                 == NULL) return;
 
-        if (o->encoding != OBJ_ENCODING_ZIPLIST) {
-            addReplyError(c,"Not an sds encoded string.");
+        if (o->encoding != OBJ_ENCODING_LISTPACK) {
+            addReplyError(c,"Not a listpack encoded object.");
         } else {
-            ziplistRepr(o->ptr);
-            addReplyStatus(c,"Ziplist structure printed on stdout");
+            lpRepr(o->ptr);
+            addReplyStatus(c,"Listpack structure printed on stdout");
         }
     } else if (!strcasecmp(c->argv[1]->ptr,"populate") &&
                c->argc >= 3 && c->argc <= 5) {
@@ -535,7 +721,8 @@ NULL
 
         if (getLongFromObjectOrReply(c, c->argv[2], &keys, NULL) != C_OK)
             return;
-        dictExpand(c->db->dict,keys);
+        for (int i = 0; i < server.db_dict_shards; i++)
+            dictExpand(c->db->dict[i],keys/server.db_dict_shards);
         for (j = 0; j < keys; j++) {
             long valsize = 0;
             snprintf(buf,sizeof(buf),"%s:%lu",
@@ -561,8 +748,145 @@ NULL
             decrRefCount(key);
         }
         addReply(c,shared.ok);
-    } else if (!strcasecmp(c->argv[1]->ptr,"digest") && c->argc == 2) {
-        /* DEBUG DIGEST (form without keys specified) */
+    } else if (!strcasecmp(c->argv[1]->ptr,"selfbench") &&
+               c->argc >= 4 && c->argc <= 5) {
+        /* DEBUG SELFBENCH <get|set|incr> <requests> [<keyspace>]
+         *
+         * Synthesize argv vectors and feed them straight into the command
+         * execution path using a fake client, the same way Lua scripts do.
+         * Since no socket is involved the reported rate is what the CPU and
+         * the memory subsystem of this host can sustain, which is useful to
+         * validate a machine before putting it in rotation. Beside the full
+         * dispatch rate, the key lookup and reply serialization steps are
+         * also measured in isolation to show where the time goes. */
+        long long requests, keyspace = 10000, j;
+        long long dispatch_us, lookup_us, reply_us;
+        char buf[64];
+        char *workload = c->argv[2]->ptr;
+        int is_set = !strcasecmp(workload,"set");
+
+        if (!is_set && strcasecmp(workload,"get") &&
+            strcasecmp(workload,"incr"))
+        {
+            addReplyError(c,"Valid SELFBENCH workloads are GET, SET, INCR");
+            return;
+        }
+        if (getLongLongFromObjectOrReply(c, c->argv[3], &requests, NULL)
+            != C_OK) return;
+        if (c->argc == 5 &&
+            getLongLongFromObjectOrReply(c, c->argv[4], &keyspace, NULL)
+            != C_OK) return;
+        if (requests <= 0 || keyspace <= 0) {
+            addReplyError(c,"requests and keyspace must be positive");
+            return;
+        }
+        struct redisCommand *cmd = lookupCommandByCString(workload);
+        serverAssert(cmd != NULL);
+
+        /* A GET workload over an empty keyspace would only measure misses,
+         * so make sure the keys exist before the timed runs. */
+        if (!is_set) {
+            for (j = 0; j < keyspace; j++) {
+                snprintf(buf,sizeof(buf),"selfbench:%lld",j);
+                robj *key = createStringObject(buf,strlen(buf));
+                if (lookupKeyWrite(c->db,key) == NULL) {
+                    dbAdd(c->db,key,createStringObjectFromLongLong(j));
+                    signalModifiedKey(c->db,key);
+                }
+                decrRefCount(key);
+            }
+        }
+
+        /* The fake client borrows the CLIENT_LUA flag so that the reply
+         * machinery serializes into its buffers despite the NULL
+         * connection (see prepareClientToWrite()). */
+        client *bc = createClient(NULL);
+        bc->flags |= CLIENT_LUA;
+        selectDb(bc,c->db->id);
+
+        /* Phase 1: full command dispatch. */
+        robj **argv = zmalloc(sizeof(robj*)*3);
+        long long start = ustime();
+        for (j = 0; j < requests; j++) {
+            int argc = 2;
+            snprintf(buf,sizeof(buf),"selfbench:%lld",
+                (long long) (random() % keyspace));
+            argv[0] = createStringObject(workload,strlen(workload));
+            argv[1] = createStringObject(buf,strlen(buf));
+            if (is_set) argv[argc++] = createStringObjectFromLongLong(j);
+            bc->argv = argv;
+            bc->argc = argc;
+            bc->cmd = bc->lastcmd = cmd;
+            call(bc,CMD_CALL_NONE);
+            for (int k = 0; k < bc->argc; k++) decrRefCount(bc->argv[k]);
+            /* Discard the accumulated reply. */
+            bc->bufpos = 0;
+            while (listLength(bc->reply))
+                listDelNode(bc->reply,listFirst(bc->reply));
+            bc->reply_bytes = 0;
+        }
+        dispatch_us = ustime()-start;
+        bc->argv = NULL;
+        bc->argc = 0;
+        zfree(argv);
+
+        /* Phase 2: key lookup only. */
+        start = ustime();
+        for (j = 0; j < requests; j++) {
+            snprintf(buf,sizeof(buf),"selfbench:%lld",
+                (long long) (random() % keyspace));
+            robj *key = createStringObject(buf,strlen(buf));
+            lookupKeyRead(bc->db,key);
+            decrRefCount(key);
+        }
+        lookup_us = ustime()-start;
+
+        /* Phase 3: reply serialization only. */
+        robj *val = createStringObject("selfbench-reply-payload",23);
+        start = ustime();
+        for (j = 0; j < requests; j++) {
+            addReplyBulk(bc,val);
+            if (bc->bufpos > PROTO_REPLY_CHUNK_BYTES/2 ||
+                listLength(bc->reply))
+            {
+                bc->bufpos = 0;
+                while (listLength(bc->reply))
+                    listDelNode(bc->reply,listFirst(bc->reply));
+                bc->reply_bytes = 0;
+            }
+        }
+        reply_us = ustime()-start;
+        decrRefCount(val);
+        freeClient(bc);
+
+        if (dispatch_us == 0) dispatch_us = 1;
+        if (lookup_us == 0) lookup_us = 1;
+        if (reply_us == 0) reply_us = 1;
+        sds info = sdscatprintf(sdsempty(),
+            "workload=%s requests=%lld keyspace=%lld\n"
+            "dispatch: %.0f ops/sec (%.0f ns/op)\n"
+            "lookup: %.0f ops/sec (%.0f ns/op)\n"
+            "reply: %.0f ops/sec (%.0f ns/op)\n",
+            workload, requests, keyspace,
+            (double)requests*1000000/dispatch_us,
+            (double)dispatch_us*1000/requests,
+            (double)requests*1000000/lookup_us,
+            (double)lookup_us*1000/requests,
+            (double)requests*1000000/reply_us,
+            (double)reply_us*1000/requests);
+        addReplyVerbatim(c,info,sdslen(info),"txt");
+        sdsfree(info);
+    } else if (!strcasecmp(c->argv[1]->ptr,"digest") &&
+               (c->argc == 2 ||
+                (c->argc == 3 && !strcasecmp(c->argv[2]->ptr,"async"))))
+    {
+        /* DEBUG DIGEST [ASYNC] (form without keys specified) */
+        if (c->argc == 3 && !(c->flags & (CLIENT_MULTI|CLIENT_LUA))) {
+            /* Inside MULTI and scripts we can't block: fall back to the
+             * synchronous digest below. */
+            snapshotDigestStart(c);
+            return;
+        }
         unsigned char digest[20];
         sds d = sdsempty();
 
@@ -636,6 +960,8 @@ NULL
         } else {
             addReplyError(c,"Wrong protocol type name. Please use one of the following: string|integer|double|bignum|null|array|set|map|attrib|push|verbatim|true|false|state|err|bloberr");
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"loopstats") && c->argc == 2) {
+        loopstatsReplyHistory(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"sleep") && c->argc == 3) {
         double dtime = strtod(c->argv[2]->ptr,NULL);
         long long utime = dtime*1000000;
@@ -690,9 +1016,14 @@ NULL
             return;
         }
 
-        stats = sdscatprintf(stats,"[Dictionary HT]\n");
-        dictGetStats(buf,sizeof(buf),server.db[dbid].dict);
-        stats = sdscat(stats,buf);
+        for (int i = 0; i < server.db_dict_shards; i++) {
+            if (server.db_dict_shards == 1)
+                stats = sdscatprintf(stats,"[Dictionary HT]\n");
+            else
+                stats = sdscatprintf(stats,"[Dictionary HT, shard %d]\n",i);
+            dictGetStats(buf,sizeof(buf),server.db[dbid].dict[i]);
+            stats = sdscat(stats,buf);
+        }
 
         stats = sdscatprintf(stats,"[Expires HT]\n");
         dictGetStats(buf,sizeof(buf),server.db[dbid].expires);
@@ -1289,7 +1620,7 @@ void logCurrentClient(void) {
         dictEntry *de;
 
         key = getDecodedObject(cc->argv[1]);
-        de = dictFind(cc->db->dict, key->ptr);
+        de = dictFind(dbGetDict(cc->db,key->ptr), key->ptr);
         if (de) {
             val = dictGetVal(de);
             serverLog(LL_WARNING,"key '%s' found in DB containing the following object:", (char*)key->ptr);
@@ -47,6 +47,7 @@ int je_get_defrag_hint(void* ptr, int *bin_util, int *run_util);
 
 /* forward declarations*/
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref);
+void defragDbDictBucketCallback(void *privdata, dictEntry **bucketref);
 dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, uint64_t hash, long *defragged);
 
 /* Defrag helper for generic allocations.
@@ -73,7 +74,7 @@ void* activeDefragAlloc(void *ptr) {
      * make sure not to use the thread cache. so that we don't get back the same
      * pointers we try to free */
     size = zmalloc_size(ptr);
-    newptr = zmalloc_no_tcache(size);
+    newptr = zmalloc_no_tcache_like(ptr,size);
     memcpy(newptr, ptr, size);
     zfree_no_tcache(ptr);
     return newptr;
@@ -150,6 +151,9 @@ long dictIterDefragEntry(dictIterator *iter) {
         dictEntry *newde = activeDefragAlloc(iter->nextEntry);
         if (newde) {
             defragged++;
+            if (dictKeyIsInline(iter->d,newde))
+                newde->key = (char*)newde +
+                    ((char*)newde->key - (char*)iter->nextEntry);
             iter->nextEntry = newde;
             iter->entry->next = newde;
         }
@@ -159,6 +163,9 @@ long dictIterDefragEntry(dictIterator *iter) {
     if (ht->table[iter->index] == iter->entry) {
         dictEntry *newde = activeDefragAlloc(iter->entry);
         if (newde) {
+            if (dictKeyIsInline(iter->d,newde))
+                newde->key = (char*)newde +
+                    ((char*)newde->key - (char*)iter->entry);
             iter->entry = newde;
             ht->table[iter->index] = newde;
             defragged++;
@@ -173,12 +180,15 @@ long dictIterDefragEntry(dictIterator *iter) {
 long dictDefragTables(dict* d) {
     dictEntry **newtable;
     long defragged = 0;
-    /* handle the first hash table */
-    newtable = activeDefragAlloc(d->ht[0].table);
-    if (newtable)
-        defragged++, d->ht[0].table = newtable;
+    /* handle the first hash table. Huge page backed tables are private
+     * mappings outside the allocator and cannot be defragged. */
+    if (!d->ht[0].table_hugepages) {
+        newtable = activeDefragAlloc(d->ht[0].table);
+        if (newtable)
+            defragged++, d->ht[0].table = newtable;
+    }
     /* handle the second hash table */
-    if (d->ht[1].table) {
+    if (d->ht[1].table && !d->ht[1].table_hugepages) {
         newtable = activeDefragAlloc(d->ht[1].table);
         if (newtable)
             defragged++, d->ht[1].table = newtable;
@@ -186,82 +196,6 @@ long dictDefragTables(dict* d) {
     return defragged;
 }
 
-/* Internal function used by zslDefrag */
-void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnode, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == oldnode)
-            update[i]->level[i].forward = newnode;
-    }
-    serverAssert(zsl->header!=oldnode);
-    if (newnode->level[0].forward) {
-        serverAssert(newnode->level[0].forward->backward==oldnode);
-        newnode->level[0].forward->backward = newnode;
-    } else {
-        serverAssert(zsl->tail==oldnode);
-        zsl->tail = newnode;
-    }
-}
-
-/* Defrag helper for sorted set.
- * Update the robj pointer, defrag the skiplist struct and return the new score
- * reference. We may not access oldele pointer (not even the pointer stored in
- * the skiplist), as it was already freed. Newele may be null, in which case we
- * only need to defrag the skiplist, but not update the obj pointer.
- * When return value is non-NULL, it is the score reference that must be updated
- * in the dict record. */
-double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
-    int i;
-    sds ele = newele? newele: oldele;
-
-    /* find the skiplist node referring to the object that was moved,
-     * and all pointers that need to be updated if we'll end up moving the skiplist node. */
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            x->level[i].forward->ele != oldele && /* make sure not to access the
-                                                     ->obj pointer if it matches
-                                                     oldele */
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) < 0)))
-            x = x->level[i].forward;
-        update[i] = x;
-    }
-
-    /* update the robj pointer inside the skip list record. */
-    x = x->level[0].forward;
-    serverAssert(x && score == x->score && x->ele==oldele);
-    if (newele)
-        x->ele = newele;
-
-    /* try to defrag the skiplist record itself */
-    newx = activeDefragAlloc(x);
-    if (newx) {
-        zslUpdateNode(zsl, x, newx, update);
-        return &newx->score;
-    }
-    return NULL;
-}
-
-/* Defrag helpler for sorted set.
- * Defrag a single dict entry key name, and corresponding skiplist struct */
-long activeDefragZsetEntry(zset *zs, dictEntry *de) {
-    sds newsds;
-    double* newscore;
-    long defragged = 0;
-    sds sdsele = dictGetKey(de);
-    if ((newsds = activeDefragSds(sdsele)))
-        defragged++, de->key = newsds;
-    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-    if (newscore) {
-        dictSetVal(zs->dict, de, newscore);
-        defragged++;
-    }
-    return defragged;
-}
-
 #define DEFRAG_SDS_DICT_NO_VAL 0
 #define DEFRAG_SDS_DICT_VAL_IS_SDS 1
 #define DEFRAG_SDS_DICT_VAL_IS_STROB 2
@@ -275,7 +209,9 @@ long activeDefragSdsDict(dict* d, int val_type) {
     di = dictGetIterator(d);
     while((de = dictNext(di)) != NULL) {
         sds sdsele = dictGetKey(de), newsds;
-        if ((newsds = activeDefragSds(sdsele)))
+        /* An inline key lives in the entry allocation: it moves with the
+         * entry (see dictIterDefragEntry()), never on its own. */
+        if (!dictKeyIsInline(d,de) && (newsds = activeDefragSds(sdsele)))
             de->key = newsds, defragged++;
         /* defrag the value */
         if (val_type == DEFRAG_SDS_DICT_VAL_IS_SDS) {
@@ -412,7 +348,13 @@ long activeDefragQuickListNodes(quicklist *ql) {
     quicklistNode *node = ql->head, *newnode;
     long defragged = 0;
     unsigned char *newzl;
+    /* Moving nodes leaves the skip index anchors dangling. */
+    quicklistSkipIndexInvalidate(ql);
     while (node) {
+        /* Moving the node or its ziplist would leave a queued background
+         * compression job with dangling pointers. */
+        if (node->compress_pending)
+            quicklistNodeAsyncCompressCancel(node);
         if ((newnode = activeDefragAlloc(node))) {
             if (newnode->prev)
                 newnode->prev->next = newnode;
@@ -448,33 +390,14 @@ long scanLaterList(robj *ob) {
     return activeDefragQuickListNodes(ql);
 }
 
-typedef struct {
-    zset *zs;
-    long defragged;
-} scanLaterZsetData;
-
-void scanLaterZsetCallback(void *privdata, const dictEntry *_de) {
-    dictEntry *de = (dictEntry*)_de;
-    scanLaterZsetData *data = privdata;
-    data->defragged += activeDefragZsetEntry(data->zs, de);
-    server.stat_active_defrag_scanned++;
-}
-
-long scanLaterZset(robj *ob, unsigned long *cursor) {
-    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_SKIPLIST)
-        return 0;
-    zset *zs = (zset*)ob->ptr;
-    dict *d = zs->dict;
-    scanLaterZsetData data = {zs, 0};
-    *cursor = dictScan(d, *cursor, scanLaterZsetCallback, defragDictBucketCallback, &data);
-    return data.defragged;
-}
-
 void scanLaterSetCallback(void *privdata, const dictEntry *_de) {
     dictEntry *de = (dictEntry*)_de;
     long *defragged = privdata;
     sds sdsele = dictGetKey(de), newsds;
-    if ((newsds = activeDefragSds(sdsele)))
+    /* Set dicts use the extended entry layout: inline elements move with
+     * the entry itself (see defragDictBucketCallback()). */
+    if (!((dictEntryEx*)de)->key_inline &&
+        (newsds = activeDefragSds(sdsele)))
         (*defragged)++, de->key = newsds;
     server.stat_active_defrag_scanned++;
 }
@@ -483,7 +406,11 @@ long scanLaterSet(robj *ob, unsigned long *cursor) {
     long defragged = 0;
     if (ob->type != OBJ_SET || ob->encoding != OBJ_ENCODING_HT)
         return 0;
+    scanSessionInvalidateObj(ob);
     dict *d = ob->ptr;
+    /* Moving entries and elements would break the dense sampling array:
+     * drop it, the next sampling command rebuilds it. */
+    setSamplerRelease(d);
     *cursor = dictScan(d, *cursor, scanLaterSetCallback, defragDictBucketCallback, &defragged);
     return defragged;
 }
@@ -492,7 +419,10 @@ void scanLaterHashCallback(void *privdata, const dictEntry *_de) {
     dictEntry *de = (dictEntry*)_de;
     long *defragged = privdata;
     sds sdsele = dictGetKey(de), newsds;
-    if ((newsds = activeDefragSds(sdsele)))
+    /* Hash dicts use the extended entry layout: inline fields move with
+     * the entry itself (see defragDictBucketCallback()). */
+    if (!((dictEntryEx*)de)->key_inline &&
+        (newsds = activeDefragSds(sdsele)))
         (*defragged)++, de->key = newsds;
     sdsele = dictGetVal(de);
     if ((newsds = activeDefragSds(sdsele)))
@@ -504,6 +434,7 @@ long scanLaterHash(robj *ob, unsigned long *cursor) {
     long defragged = 0;
     if (ob->type != OBJ_HASH || ob->encoding != OBJ_ENCODING_HT)
         return 0;
+    scanSessionInvalidateObj(ob);
     dict *d = ob->ptr;
     *cursor = dictScan(d, *cursor, scanLaterHashCallback, defragDictBucketCallback, &defragged);
     return defragged;
@@ -530,24 +461,19 @@ long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
     zset *newzs;
     zskiplist *newzsl;
     dict *newdict;
-    dictEntry *de;
-    struct zskiplistNode *newheader;
+    UNUSED(db);
     serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_SKIPLIST);
+    /* Relocating entries would break a pinned scan session iterator. */
+    scanSessionInvalidateObj(ob);
+    /* The skiplist nodes and their inline elements live in the skiplist
+     * arena, and both the dict keys and the score values point into the
+     * node storage: individual nodes cannot be moved, so only the
+     * surrounding structs and the dict tables are defragged here. The
+     * arena itself recycles the space of deleted nodes on its own. */
     if ((newzs = activeDefragAlloc(zs)))
         defragged++, ob->ptr = zs = newzs;
     if ((newzsl = activeDefragAlloc(zs->zsl)))
         defragged++, zs->zsl = newzsl;
-    if ((newheader = activeDefragAlloc(zs->zsl->header)))
-        defragged++, zs->zsl->header = newheader;
-    if (dictSize(zs->dict) > server.active_defrag_max_scan_fields)
-        defragLater(db, kde);
-    else {
-        dictIterator *di = dictGetIterator(zs->dict);
-        while((de = dictNext(di)) != NULL) {
-            defragged += activeDefragZsetEntry(zs, de);
-        }
-        dictReleaseIterator(di);
-    }
     /* handle the dict struct */
     if ((newdict = activeDefragAlloc(zs->dict)))
         defragged++, zs->dict = newdict;
@@ -561,6 +487,8 @@ long defragHash(redisDb *db, dictEntry *kde) {
     robj *ob = dictGetVal(kde);
     dict *d, *newd;
     serverAssert(ob->type == OBJ_HASH && ob->encoding == OBJ_ENCODING_HT);
+    /* Relocating entries would break a pinned scan session iterator. */
+    scanSessionInvalidateObj(ob);
     d = ob->ptr;
     if (dictSize(d) > server.active_defrag_max_scan_fields)
         defragLater(db, kde);
@@ -579,7 +507,12 @@ long defragSet(redisDb *db, dictEntry *kde) {
     robj *ob = dictGetVal(kde);
     dict *d, *newd;
     serverAssert(ob->type == OBJ_SET && ob->encoding == OBJ_ENCODING_HT);
+    /* Relocating entries would break a pinned scan session iterator. */
+    scanSessionInvalidateObj(ob);
     d = ob->ptr;
+    /* Moving entries and elements would break the dense sampling array:
+     * drop it, the next sampling command rebuilds it. */
+    setSamplerRelease(d);
     if (dictSize(d) > server.active_defrag_max_scan_fields)
         defragLater(db, kde);
     else
@@ -614,6 +547,7 @@ int scanLaterStraemListpacks(robj *ob, unsigned long *cursor, long long endtime,
     }
 
     stream *s = ob->ptr;
+    s->tail_lp = NULL; /* The listpacks may move: drop the XADD cursor. */
     raxStart(&ri,s->rax);
     if (*cursor == 0) {
         /* if cursor is 0, we start new iteration */
@@ -693,17 +627,12 @@ typedef struct {
 void* defragStreamConsumerPendingEntry(raxIterator *ri, void *privdata, long *defragged) {
     UNUSED(defragged);
     PendingEntryContext *ctx = privdata;
-    streamNACK *nack = ri->data, *newnack;
+    streamNACK *nack = ri->data;
     nack->consumer = ctx->c; /* update nack pointer to consumer */
-    newnack = activeDefragAlloc(nack);
-    if (newnack) {
-        /* update consumer group pointer to the nack */
-        void *prev;
-        raxInsert(ctx->cg->pel, ri->key, ri->key_len, newnack, &prev);
-        serverAssert(prev==nack);
-        /* note: we don't increment 'defragged' that's done by the caller */
-    }
-    return newnack;
+    /* The NACK itself is carved from the consumer group arena, not
+     * allocated on its own: it cannot be moved individually, and the
+     * arena blocks are packed anyway. */
+    return NULL;
 }
 
 void* defragStreamConsumer(raxIterator *ri, void *privdata, long *defragged) {
@@ -741,8 +670,12 @@ long defragStream(redisDb *db, dictEntry *kde) {
     stream *s = ob->ptr, *news;
 
     /* handle the main struct */
-    if ((news = activeDefragAlloc(s)))
+    if ((news = activeDefragAlloc(s))) {
         defragged++, ob->ptr = s = news;
+        /* The pending trim list may reference the old pointer. */
+        streamTrimPendingUpdate(s);
+    }
+    s->tail_lp = NULL; /* The listpacks may move: drop the XADD cursor. */
 
     if (raxSize(s->rax) > server.active_defrag_max_scan_fields) {
         rax *newrax = activeDefragAlloc(s->rax);
@@ -767,20 +700,32 @@ long defragKey(redisDb *db, dictEntry *de) {
     long defragged = 0;
     sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
+    /* Try to defrag the key name. Keys stored inline in the dict entry
+     * have no allocation of their own, and their pointer must be left
+     * alone. */
+    newsds = NULL;
+    if (!dictKeyIsInline(dbGetDict(db,keysds), de))
+        newsds = activeDefragSds(keysds);
     if (newsds)
         defragged++, de->key = newsds;
     if (dictSize(db->expires)) {
          /* Dirty code:
           * I can't search in db->expires for that key after i already released
           * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
+        uint64_t hash = dictGetHash(dbGetDict(db,de->key), de->key);
         replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
     }
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
+
+    /* Values not yet materialized from a memory mapped RDB file point into
+     * the mapping, not into the heap: nothing to defrag. */
+    if (ob->encoding == OBJ_ENCODING_LAZY) return defragged;
+
+    /* Cold tier stubs carry no per-type heap structure either. */
+    if (ob->encoding == OBJ_ENCODING_COLD) return defragged;
+
     if ((newob = activeDefragStringOb(ob, &defragged))) {
         de->v.val = newob;
         ob = newob;
@@ -808,7 +753,7 @@ long defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -817,9 +762,11 @@ long defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
-            if ((newzl = activeDefragAlloc(ob->ptr)))
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
+            if ((newzl = activeDefragAlloc(ob->ptr))) {
+                hashTypeIndexInvalidate(ob);
                 defragged++, ob->ptr = newzl;
+            }
         } else if (ob->encoding == OBJ_ENCODING_HT) {
             defragged += defragHash(db, de);
         } else {
@@ -828,8 +775,10 @@ long defragKey(redisDb *db, dictEntry *de) {
     } else if (ob->type == OBJ_STREAM) {
         defragged += defragStream(db, de);
     } else if (ob->type == OBJ_MODULE) {
-        /* Currently defragmenting modules private data types
-         * is not supported. */
+        robj keyobj;
+        initStaticStringObject(keyobj,dictGetKey(de));
+        if (!moduleDefragValue(&keyobj,ob,&defragged))
+            defragLater(db,de);
     } else {
         serverPanic("Unknown object type");
     }
@@ -848,13 +797,49 @@ void defragScanCallback(void *privdata, const dictEntry *de) {
 }
 
 /* Defrag scan callback for each hash table bicket,
- * used in order to defrag the dictEntry allocations. */
+ * used in order to defrag the dictEntry allocations. Note that both its
+ * users (scanLaterSet and scanLaterHash) scan dicts with the extended
+ * entry layout, so the inline key flag can be trusted here. */
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
     UNUSED(privdata); /* NOTE: this function is also used by both activeDefragCycle and scanLaterHash, etc. don't use privdata */
     while(*bucketref) {
         dictEntry *de = *bucketref, *newde;
         if ((newde = activeDefragAlloc(de))) {
             *bucketref = newde;
+            /* An inline key points into the old allocation: rebase it
+             * onto the new one (pointer arithmetic only, the old entry
+             * memory is already freed). */
+            if (((dictEntryEx*)newde)->key_inline)
+                newde->key = (char*)newde + ((char*)newde->key - (char*)de);
+        }
+        bucketref = &(*bucketref)->next;
+    }
+}
+
+/* Variant of defragDictBucketCallback for the main keyspace dict. Its
+ * entries embed short keys inline (see dictEntryEx in dict.h), so when the
+ * entry allocation is moved the key pointer must be rebased onto the new
+ * allocation, and the expires dict reference to that key updated too. */
+void defragDbDictBucketCallback(void *privdata, dictEntry **bucketref) {
+    redisDb *db = privdata;
+    while(*bucketref) {
+        dictEntry *de = *bucketref, *newde;
+        if ((newde = activeDefragAlloc(de))) {
+            *bucketref = newde;
+            if (((dictEntryEx*)newde)->key_inline) {
+                /* 'oldkey' points into the freed entry: only use it for
+                 * pointer arithmetic and identity, never dereference it. */
+                sds oldkey = newde->key;
+                sds newkey = (sds)((char*)newde + (oldkey - (char*)de));
+                newde->key = newkey;
+                if (dictSize(db->expires)) {
+                    uint64_t hash = dictGetHash(db->expires, newkey);
+                    long defragged = 0;
+                    replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires,
+                        oldkey, newkey, hash, &defragged);
+                    server.stat_active_defrag_hits += defragged;
+                }
+            }
         }
         bucketref = &(*bucketref)->next;
     }
@@ -904,12 +889,14 @@ int defragLaterItem(dictEntry *de, unsigned long *cursor, long long endtime) {
             *cursor = 0; /* list has no scan, we must finish it in one go */
         } else if (ob->type == OBJ_SET) {
             server.stat_active_defrag_hits += scanLaterSet(ob, cursor);
-        } else if (ob->type == OBJ_ZSET) {
-            server.stat_active_defrag_hits += scanLaterZset(ob, cursor);
         } else if (ob->type == OBJ_HASH) {
             server.stat_active_defrag_hits += scanLaterHash(ob, cursor);
         } else if (ob->type == OBJ_STREAM) {
             return scanLaterStraemListpacks(ob, cursor, endtime, &server.stat_active_defrag_hits);
+        } else if (ob->type == OBJ_MODULE) {
+            robj keyobj;
+            initStaticStringObject(keyobj,dictGetKey(de));
+            return moduleLateDefrag(&keyobj, ob, cursor, endtime, &server.stat_active_defrag_hits);
         } else {
             *cursor = 0; /* object type may have changed since we schedule it for later */
         }
@@ -954,7 +941,7 @@ int defragLaterStep(redisDb *db, long long endtime) {
         }
 
         /* each time we enter this function we need to fetch the key from the dict again (if it still exists) */
-        dictEntry *de = dictFind(db->dict, defrag_later_current_key);
+        dictEntry *de = dictFind(dbGetDict(db,defrag_later_current_key), defrag_later_current_key);
         key_defragged = server.stat_active_defrag_hits;
         do {
             int quit = 0;
@@ -991,6 +978,98 @@ int defragLaterStep(redisDb *db, long long endtime) {
     } while(1);
 }
 
+/* Fragmentation forecasting.
+ *
+ * computeDefragCycles() reacts to the fragmentation the allocator already
+ * accumulated, which means a scan typically kicks in right in the middle
+ * of the traffic peak that produced the fragmentation. To turn that
+ * reactive burst into scheduled maintenance we sample the fragmentation
+ * ratio over a few minutes, fit a linear trend through the samples, and
+ * when the trend predicts that the lower threshold will be crossed within
+ * the forecast horizon we start a minimum effort scan early -- but only
+ * while the command traffic is well below the recently observed peak, so
+ * that the extra CPU lands in a quiet window instead of on top of the
+ * very load that is fragmenting the heap. */
+
+#define DEFRAG_FORECAST_PERIOD 10   /* Seconds between two samples. */
+#define DEFRAG_FORECAST_SAMPLES 30  /* Five minutes of history. */
+#define DEFRAG_FORECAST_HORIZON 300 /* Predict this many seconds ahead. */
+
+static struct {
+    float samples[DEFRAG_FORECAST_SAMPLES]; /* Frag percentage ring buffer. */
+    int numsamples;
+    int idx;                    /* Next slot to write. */
+    time_t last_sample;
+    long long peak_ops;         /* Decaying ops/sec high watermark. */
+    time_t last_proactive;      /* Last forecast driven scan start. */
+} defrag_forecast;
+
+/* Feed the forecast with the fragmentation that computeDefragCycles()
+ * just measured. Called about once a second. */
+static void defragForecastUpdate(float frag_pct) {
+    long long ops = getInstantaneousMetric(STATS_METRIC_COMMAND);
+
+    /* Decay the traffic peak with a half life of roughly twelve minutes,
+     * so that the notion of "quiet" follows the workload over the day. */
+    defrag_forecast.peak_ops -= defrag_forecast.peak_ops/1024;
+    if (ops > defrag_forecast.peak_ops) defrag_forecast.peak_ops = ops;
+
+    if (server.unixtime - defrag_forecast.last_sample < DEFRAG_FORECAST_PERIOD)
+        return;
+    defrag_forecast.last_sample = server.unixtime;
+    defrag_forecast.samples[defrag_forecast.idx] = frag_pct;
+    defrag_forecast.idx = (defrag_forecast.idx+1) % DEFRAG_FORECAST_SAMPLES;
+    if (defrag_forecast.numsamples < DEFRAG_FORECAST_SAMPLES)
+        defrag_forecast.numsamples++;
+}
+
+/* Least squares slope of the sampled fragmentation, in percentage points
+ * per second, and the percentage extrapolated at the forecast horizon.
+ * Returns zero when there is not enough history to extrapolate yet (also
+ * consulted by the MEMORY DOCTOR report). */
+int defragForecast(float *slope, float *predicted) {
+    int n = defrag_forecast.numsamples;
+    float sx = 0, sy = 0, sxx = 0, sxy = 0, latest = 0;
+
+    if (n < DEFRAG_FORECAST_SAMPLES/2) return 0;
+    for (int i = 0; i < n; i++) {
+        int slot = (defrag_forecast.idx - n + i + DEFRAG_FORECAST_SAMPLES) %
+                   DEFRAG_FORECAST_SAMPLES;
+        float x = i * DEFRAG_FORECAST_PERIOD;
+        float y = defrag_forecast.samples[slot];
+        sx += x; sy += y; sxx += x*x; sxy += x*y;
+        latest = y;
+    }
+    float d = n*sxx - sx*sx;
+    if (d == 0) return 0;
+    *slope = (n*sxy - sx*sy) / d;
+    *predicted = latest + *slope * DEFRAG_FORECAST_HORIZON;
+    return 1;
+}
+
+/* Return non zero if the forecast justifies starting a scan before the
+ * thresholds are crossed: the trend predicts crossing the lower threshold
+ * within the horizon, the wasted bytes are already worth the trouble, and
+ * the instance is in a quiet traffic window. */
+static int defragForecastShouldStart(size_t frag_bytes) {
+    float slope, predicted;
+
+    if (!server.active_defrag_forecast) return 0;
+    if (frag_bytes < server.active_defrag_ignore_bytes) return 0;
+    if (server.unixtime - defrag_forecast.last_proactive <
+        DEFRAG_FORECAST_HORIZON) return 0;
+    if (!defragForecast(&slope, &predicted)) return 0;
+    if (slope <= 0 || predicted < server.active_defrag_threshold_lower)
+        return 0;
+
+    /* Only spend the CPU while traffic is well below the observed peak. */
+    long long ops = getInstantaneousMetric(STATS_METRIC_COMMAND);
+    if (defrag_forecast.peak_ops > 0 &&
+        ops > defrag_forecast.peak_ops *
+              server.active_defrag_forecast_traffic_pct / 100) return 0;
+    return 1;
+}
+
 #define INTERPOLATE(x, x1, x2, y1, y2) ( (y1) + ((x)-(x1)) * ((y2)-(y1)) / ((x2)-(x1)) )
 #define LIMIT(y, min, max) ((y)<(min)? min: ((y)>(max)? max: (y)))
 
@@ -998,10 +1077,20 @@ int defragLaterStep(redisDb *db, long long endtime) {
 void computeDefragCycles() {
     size_t frag_bytes;
     float frag_pct = getAllocatorFragmentation(&frag_bytes);
+    defragForecastUpdate(frag_pct);
     /* If we're not already running, and below the threshold, exit. */
     if (!server.active_defrag_running) {
-        if(frag_pct < server.active_defrag_threshold_lower || frag_bytes < server.active_defrag_ignore_bytes)
+        if(frag_pct < server.active_defrag_threshold_lower || frag_bytes < server.active_defrag_ignore_bytes) {
+            /* The thresholds are not crossed yet, but the trend may tell
+             * us they soon will be, while we are in a quiet window. */
+            if (!defragForecastShouldStart(frag_bytes)) return;
+            defrag_forecast.last_proactive = server.unixtime;
+            server.active_defrag_running = server.active_defrag_cycle_min;
+            serverLog(LL_VERBOSE,
+                "Starting proactive defrag ahead of the thresholds, frag=%.0f%%, frag_bytes=%zu, cpu=%d%%",
+                frag_pct, frag_bytes, server.active_defrag_running);
             return;
+        }
     }
 
     /* Calculate the adaptive aggressiveness of the defrag */
@@ -1122,7 +1211,7 @@ void activeDefragCycle(void) {
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            cursor = dbScan(db, cursor, defragScanCallback, defragDbDictBucketCallback, db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
@@ -1153,4 +1242,10 @@ void activeDefragCycle(void) {
     /* Not implemented yet. */
 }
 
+int defragForecast(float *slope, float *predicted) {
+    UNUSED(slope);
+    UNUSED(predicted);
+    return 0;
+}
+
 #endif
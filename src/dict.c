@@ -44,6 +44,7 @@
 #include <sys/time.h>
 
 #include "dict.h"
+#include "sds.h"
 #include "zmalloc.h"
 #ifndef DICT_BENCHMARK_MAIN
 #include "redisassert.h"
@@ -67,6 +68,7 @@ static unsigned int dict_force_resize_ratio = 5;
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
+static dictEntry *_dictAddEntry(dict *d, void *key, uint64_t h, long index);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
 
 /* -------------------------- hash functions -------------------------------- */
@@ -95,6 +97,29 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* ------------------------- type specialization ----------------------------
+ * The hottest dictionaries of the server (the keyspace, sets, sorted sets)
+ * all use plain sds keys hashed with dictGenHashFunction() and compared
+ * byte-wise. Their dictType carries the DICT_SPEC_SDS_KEY shape hint, so
+ * the lookup paths can hash and compare with inline code instead of going
+ * through the type callbacks: the indirect calls can't be inlined by the
+ * compiler and cost a measurable share of the probe loop at high lookup
+ * rates. Types without a hint keep using the callbacks. */
+
+static inline uint64_t dictSpecHashKey(dict *d, const void *key) {
+    if (d->type->spec == DICT_SPEC_SDS_KEY)
+        return dictGenHashFunction(key,sdslen((sds)key));
+    return dictHashKey(d,key);
+}
+
+static inline int dictSpecKeyEqual(dict *d, const void *key1, const void *key2) {
+    if (d->type->spec == DICT_SPEC_SDS_KEY) {
+        size_t l1 = sdslen((sds)key1);
+        return l1 == sdslen((sds)key2) && memcmp(key1,key2,l1) == 0;
+    }
+    return dictCompareKeys(d,key1,key2);
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -105,13 +130,43 @@ static void _dictReset(dictht *ht)
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->table_hugepages = 0;
+}
+
+/* Bucket arrays at least this large are allocated with explicit huge pages
+ * when available: with 2^19 or more buckets a lookup touching a random
+ * bucket almost always misses the dTLB on 4KB pages, while the array spans
+ * few enough 2MB pages to stay fully covered by the TLB. */
+#define DICT_HUGEPAGE_MIN_BYTES (4*1024*1024)
+
+/* Allocate a zeroed bucket array of 'bytes' bytes, trying huge pages for
+ * the large ones. '*hugepages' is set to reflect what was used, so that
+ * the table is later released with the matching free function. */
+static dictEntry **dictAllocTable(unsigned long bytes, int *hugepages) {
+    if (bytes >= DICT_HUGEPAGE_MIN_BYTES) {
+        dictEntry **table = zmalloc_hugepage(bytes);
+        if (table != NULL) {
+            *hugepages = 1;
+            return table;
+        }
+    }
+    *hugepages = 0;
+    return zcalloc_typed(ZMALLOC_TYPE_METADATA,bytes);
+}
+
+/* Release the bucket array of 'ht', if any. */
+static void dictFreeTable(dictht *ht) {
+    if (ht->table_hugepages)
+        zfree_hugepage(ht->table,ht->size*sizeof(dictEntry*));
+    else
+        zfree(ht->table);
 }
 
 /* Create a new hash table */
 dict *dictCreate(dictType *type,
         void *privDataPtr)
 {
-    dict *d = zmalloc(sizeof(*d));
+    dict *d = zmalloc_typed(ZMALLOC_TYPE_METADATA,sizeof(*d));
 
     _dictInit(d,type,privDataPtr);
     return d;
@@ -160,7 +215,7 @@ int dictExpand(dict *d, unsigned long size)
     /* Allocate the new hash table and initialize all pointers to NULL */
     n.size = realsize;
     n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
+    n.table = dictAllocTable(realsize*sizeof(dictEntry*),&n.table_hugepages);
     n.used = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
@@ -206,7 +261,7 @@ int dictRehash(dict *d, int n) {
 
             nextde = de->next;
             /* Get the index in the new hash table */
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
+            h = dictSpecHashKey(d, de->key) & d->ht[1].sizemask;
             de->next = d->ht[1].table[h];
             d->ht[1].table[h] = de;
             d->ht[0].used--;
@@ -219,7 +274,7 @@ int dictRehash(dict *d, int n) {
 
     /* Check if we already rehashed the whole table... */
     if (d->ht[0].used == 0) {
-        zfree(d->ht[0].table);
+        dictFreeTable(&d->ht[0]);
         d->ht[0] = d->ht[1];
         _dictReset(&d->ht[1]);
         d->rehashidx = -1;
@@ -256,9 +311,14 @@ int dictRehashMilliseconds(dict *d, int ms) {
  *
  * This function is called by common lookup or update operations in the
  * dictionary so that the hash table automatically migrates from H1 to H2
- * while it is actively used. */
+ * while it is actively used.
+ *
+ * Rehashing is also suspended while resizing is globally disabled (there
+ * is a fork running persistence): moving entries between the two tables
+ * dirties pages shared with the child for no urgent reason, lookups work
+ * fine with a partially rehashed table. */
 static void _dictRehashStep(dict *d) {
-    if (d->iterators == 0) dictRehash(d,1);
+    if (d->iterators == 0 && dict_can_resize) dictRehash(d,1);
 }
 
 /* Add an element to the target hash table */
@@ -271,6 +331,77 @@ int dictAdd(dict *d, void *key, void *val)
     return DICT_OK;
 }
 
+/* Bulk insert of 'count' key / value pairs.
+ *
+ * Compared with a loop of dictAdd() calls this amortizes the per insert
+ * bookkeeping: the table is expanded at most once, sized to fit the whole
+ * batch, key hashes are computed upfront so that the target buckets can
+ * be prefetched before they are probed, and when an incremental rehash is
+ * in progress a burst of steps proportional to the batch size replaces
+ * the one step per insert.
+ *
+ * Keys already present in the dictionary (including keys appearing twice
+ * in the batch) are not re-added and both keys[i] and vals[i] remain
+ * owned by the caller: when the optional 'existing' array is not NULL,
+ * existing[i] is set to the conflicting entry (NULL for the elements
+ * actually inserted) so that the caller can update values in place.
+ *
+ * Returns the number of elements added. */
+#define DICT_ADD_BATCH 32
+int dictAddBatch(dict *d, void **keys, void **vals, int count,
+                 dictEntry **existing)
+{
+    int i = 0, added = 0;
+
+    /* Size the table once for the whole batch instead of re-checking the
+     * fill ratio on every insert. The same policy of
+     * _dictExpandIfNeeded() applies, just computed against the final
+     * number of elements. */
+    if (!dictIsRehashing(d) &&
+        d->ht[0].used+count >= d->ht[0].size &&
+        (dict_can_resize ||
+         (d->ht[0].size &&
+          (d->ht[0].used+count)/d->ht[0].size > dict_force_resize_ratio)))
+    {
+        dictExpand(d,(d->ht[0].used+count)*2);
+    }
+
+    while (i < count) {
+        uint64_t hashes[DICT_ADD_BATCH];
+        int n = count-i, j;
+
+        if (n > DICT_ADD_BATCH) n = DICT_ADD_BATCH;
+
+        /* Amortize the incremental rehashing: one burst per chunk
+         * instead of one step per key. */
+        if (dictIsRehashing(d) && d->iterators == 0) dictRehash(d,n);
+
+        for (j = 0; j < n; j++) {
+            hashes[j] = dictSpecHashKey(d,keys[i+j]);
+#if defined(__GNUC__)
+            dictht *ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+            __builtin_prefetch(&ht->table[hashes[j] & ht->sizemask]);
+            if (dictIsRehashing(d))
+                __builtin_prefetch(
+                    &d->ht[0].table[hashes[j] & d->ht[0].sizemask]);
+#endif
+        }
+
+        for (j = 0; j < n; j++) {
+            dictEntry *exist = NULL;
+            long index = _dictKeyIndex(d,keys[i+j],hashes[j],&exist);
+
+            if (existing) existing[i+j] = exist;
+            if (index == -1) continue;
+            dictEntry *entry = _dictAddEntry(d,keys[i+j],hashes[j],index);
+            dictSetVal(d,entry,vals[i+j]);
+            added++;
+        }
+        i += n;
+    }
+    return added;
+}
+
 /* Low level add or find:
  * This function adds the entry but instead of setting a value returns the
  * dictEntry structure to the user, that will make sure to fill the value
@@ -292,28 +423,58 @@ int dictAdd(dict *d, void *key, void *val)
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 {
     long index;
-    dictEntry *entry;
-    dictht *ht;
+    uint64_t h;
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    h = dictSpecHashKey(d,key);
+    if ((index = _dictKeyIndex(d, key, h, existing)) == -1)
         return NULL;
 
+    return _dictAddEntry(d, key, h, index);
+}
+
+/* Helper of dictAddRaw() and dictAddBatch(): allocate a new entry holding
+ * 'key', whose hash is 'h', and link it into bucket 'index' of the
+ * current insert table. */
+static dictEntry *_dictAddEntry(dict *d, void *key, uint64_t h, long index)
+{
+    dictEntry *entry;
+    dictht *ht;
+
     /* Allocate the memory and store the new entry.
      * Insert the element in top, with the assumption that in a database
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    if (dictTypeInlineKeys(d)) {
+        /* Extended layout: cache the top hash bits, and when the type says
+         * the key fits, store the key inside the entry itself so that a
+         * lookup does not need to load a separate key allocation. */
+        size_t isize = d->type->keyInlineSize(key);
+        dictEntryEx *ex = zmalloc_typed(ZMALLOC_TYPE_METADATA,
+                                        sizeof(*ex)+isize);
+        ex->hashbits = h >> 56;
+        ex->key_inline = isize != 0;
+        entry = &ex->de;
+        if (isize) {
+            entry->key = d->type->keyInlineCopy(ex->buf,key);
+            /* The dict takes ownership of the key as usual: the caller's
+             * copy was consumed by the inline copy, so release it. */
+            if (d->type->keyDestructor)
+                d->type->keyDestructor(d->privdata,key);
+        } else {
+            dictSetKey(d, entry, key);
+        }
+    } else {
+        entry = zmalloc_typed(ZMALLOC_TYPE_METADATA,sizeof(*entry));
+        dictSetKey(d, entry, key);
+    }
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
-
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
     return entry;
 }
 
@@ -369,21 +530,26 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     if (d->ht[0].used == 0 && d->ht[1].used == 0) return NULL;
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
-    h = dictHashKey(d, key);
+    h = dictSpecHashKey(d, key);
+    int prefilter = dictTypeInlineKeys(d);
+    uint8_t hb = h >> 56;
 
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         prevHe = NULL;
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+            if (key==he->key ||
+                ((!prefilter || ((dictEntryEx*)he)->hashbits == hb) &&
+                 dictSpecKeyEqual(d, key, he->key)))
+            {
                 /* Unlink the element from the list */
                 if (prevHe)
                     prevHe->next = he->next;
                 else
                     d->ht[table].table[idx] = he->next;
                 if (!nofree) {
-                    dictFreeKey(d, he);
+                    if (!dictKeyIsInline(d, he)) dictFreeKey(d, he);
                     dictFreeVal(d, he);
                     zfree(he);
                 }
@@ -433,7 +599,7 @@ dictEntry *dictUnlink(dict *ht, const void *key) {
  * to dictUnlink(). It's safe to call this function with 'he' = NULL. */
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
     if (he == NULL) return;
-    dictFreeKey(d, he);
+    if (!dictKeyIsInline(d, he)) dictFreeKey(d, he);
     dictFreeVal(d, he);
     zfree(he);
 }
@@ -451,7 +617,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
             nextHe = he->next;
-            dictFreeKey(d, he);
+            if (!dictKeyIsInline(d, he)) dictFreeKey(d, he);
             dictFreeVal(d, he);
             zfree(he);
             ht->used--;
@@ -459,7 +625,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         }
     }
     /* Free the table and the allocated cache structure */
-    zfree(ht->table);
+    dictFreeTable(ht);
     /* Re-initialize the table */
     _dictReset(ht);
     return DICT_OK; /* never fails */
@@ -473,6 +639,73 @@ void dictRelease(dict *d)
     zfree(d);
 }
 
+/* Free all the entries stored in the buckets [start,end) of both hash
+ * tables of 'd', calling the type destructors as _dictClear() does.
+ * Ranges past the end of a table are silently clipped.
+ *
+ * No bookkeeping at all is performed: the 'used' counters, rehashing
+ * state and iterators are left untouched. This function is only meant to
+ * release a dictionary that was already detached from every accessor, by
+ * several threads working on disjoint bucket ranges in parallel. Once all
+ * the ranges were processed the caller must dispose of the remains with
+ * dictReleaseTables(). */
+void dictFreeBucketRange(dict *d, unsigned long start, unsigned long end) {
+    for (int table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        unsigned long stop = end < ht->size ? end : ht->size;
+
+        for (unsigned long i = start; i < stop; i++) {
+            dictEntry *he = ht->table[i], *nextHe;
+
+            while(he) {
+                nextHe = he->next;
+                if (!dictKeyIsInline(d, he)) dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                zfree(he);
+                he = nextHe;
+            }
+            ht->table[i] = NULL;
+        }
+    }
+}
+
+/* Release the bucket arrays and the dict structure itself without
+ * touching the entries: the final step after every bucket range of an
+ * orphaned dictionary was freed with dictFreeBucketRange(). */
+void dictReleaseTables(dict *d) {
+    dictFreeTable(&d->ht[0]);
+    dictFreeTable(&d->ht[1]);
+    zfree(d);
+}
+
+/* Issue a memory prefetch for the bucket where 'key' would be stored, so
+ * that a dictFind() performed shortly after for the same key is less
+ * likely to stall on a cache miss. This is just a hint: the dictionary
+ * is not modified and correctness never depends on it. */
+void dictPrefetch(dict *d, const void *key) {
+#if defined(__GNUC__)
+    if (d->ht[0].size == 0) return;
+    dictPrefetchByHash(d, dictSpecHashKey(d, key));
+#else
+    DICT_NOTUSED(d);
+    DICT_NOTUSED(key);
+#endif
+}
+
+/* Like dictPrefetch(), for callers that computed the key hash themselves,
+ * for instance because the key bytes are not held in an sds string yet. */
+void dictPrefetchByHash(dict *d, uint64_t h) {
+#if defined(__GNUC__)
+    if (d->ht[0].size == 0) return;
+    __builtin_prefetch(&d->ht[0].table[h & d->ht[0].sizemask]);
+    if (dictIsRehashing(d))
+        __builtin_prefetch(&d->ht[1].table[h & d->ht[1].sizemask]);
+#else
+    DICT_NOTUSED(d);
+    DICT_NOTUSED(h);
+#endif
+}
+
 dictEntry *dictFind(dict *d, const void *key)
 {
     dictEntry *he;
@@ -480,12 +713,43 @@ dictEntry *dictFind(dict *d, const void *key)
 
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     if (dictIsRehashing(d)) _dictRehashStep(d);
-    h = dictHashKey(d, key);
+    h = dictSpecHashKey(d, key);
+    int prefilter = dictTypeInlineKeys(d);
+    uint8_t hb = h >> 56;
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        he = d->ht[table].table[idx];
+        while(he) {
+            if (key==he->key ||
+                ((!prefilter || ((dictEntryEx*)he)->hashbits == hb) &&
+                 dictSpecKeyEqual(d, key, he->key)))
+                return he;
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
+/* Like dictFind(), but never performs a step of incremental rehashing:
+ * this makes it safe to call against a dictionary that other threads may
+ * be reading at the same time, as long as nobody is writing to it. */
+dictEntry *dictFindNoRehash(dict *d, const void *key)
+{
+    dictEntry *he;
+    uint64_t h, idx, table;
+
+    if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
+    h = dictSpecHashKey(d, key);
+    int prefilter = dictTypeInlineKeys(d);
+    uint8_t hb = h >> 56;
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key))
+            if (key==he->key ||
+                ((!prefilter || ((dictEntryEx*)he)->hashbits == hb) &&
+                 dictSpecKeyEqual(d, key, he->key)))
                 return he;
             he = he->next;
         }
@@ -993,12 +1257,17 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     /* Expand the hash table if needed */
     if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
+    int prefilter = dictTypeInlineKeys(d);
+    uint8_t hb = hash >> 56;
     for (table = 0; table <= 1; table++) {
         idx = hash & d->ht[table].sizemask;
         /* Search if this slot does not already contain the given key */
         he = d->ht[table].table[idx];
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+            if (key==he->key ||
+                ((!prefilter || ((dictEntryEx*)he)->hashbits == hb) &&
+                 dictSpecKeyEqual(d, key, he->key)))
+            {
                 if (existing) *existing = he;
                 return -1;
             }
@@ -1025,7 +1294,7 @@ void dictDisableResize(void) {
 }
 
 uint64_t dictGetHash(dict *d, const void *key) {
-    return dictHashKey(d, key);
+    return dictSpecHashKey(d, key);
 }
 
 /* Finds the dictEntry reference by using pointer and pre-calculated hash.
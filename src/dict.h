@@ -55,6 +55,29 @@ typedef struct dictEntry {
     struct dictEntry *next;
 } dictEntry;
 
+/* Extended entry layout used by dictionaries whose type provides a
+ * keyInlineSize() callback: short keys are copied into the entry itself
+ * right after the header, and the top byte of the key hash is cached so
+ * that most failed comparisons along a chain are resolved without
+ * dereferencing the key pointer at all. The plain dictEntry is the first
+ * member, so every code path that only reads key/v/next keeps working
+ * with entries of both layouts. */
+typedef struct dictEntryEx {
+    dictEntry de;       /* Must be the first member. */
+    uint8_t hashbits;   /* Top 8 bits of the key hash, used as prefilter. */
+    uint8_t key_inline; /* Non zero if the key is stored in buf[]. */
+    char buf[];         /* Inline key storage, format is up to the type. */
+} dictEntryEx;
+
+/* Key shape hints for the 'spec' field of the dictType. The hot lookup
+ * paths recognize well known key shapes and hash/compare them with inline
+ * code instead of going through the type callbacks, that being indirect
+ * calls can never be inlined. A hint MUST match the behavior of the
+ * hashFunction/keyCompare callbacks of the type exactly. */
+#define DICT_SPEC_NONE 0
+#define DICT_SPEC_SDS_KEY 1     /* sds keys, dictGenHashFunction() hashing,
+                                   binary safe comparison. */
+
 typedef struct dictType {
     uint64_t (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
@@ -62,6 +85,17 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Optional. When set, entries use the dictEntryEx layout: the callback
+     * returns the bytes of inline storage needed for 'key', or zero if the
+     * key must stay on the heap. */
+    size_t (*keyInlineSize)(const void *key);
+    /* Writes 'key' into 'buf' (keyInlineSize() bytes are available) and
+     * returns the pointer to store as the entry key. Only called when
+     * keyInlineSize() returned non zero. */
+    void *(*keyInlineCopy)(void *buf, const void *key);
+    /* Optional DICT_SPEC_* shape hint (see above). Zero initialized types
+     * just keep using the callbacks. */
+    unsigned spec;
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
@@ -71,6 +105,7 @@ typedef struct dictht {
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
+    int table_hugepages; /* Bucket array is an explicit huge page mapping. */
 } dictht;
 
 typedef struct dict {
@@ -146,11 +181,15 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictTypeInlineKeys(d) ((d)->type->keyInlineSize != NULL)
+#define dictKeyIsInline(d, he) \
+    (dictTypeInlineKeys(d) && ((dictEntryEx*)(he))->key_inline)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
 int dictAdd(dict *d, void *key, void *val);
+int dictAddBatch(dict *d, void **keys, void **vals, int count, dictEntry **existing);
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
 dictEntry *dictAddOrFind(dict *d, void *key);
 int dictReplace(dict *d, void *key, void *val);
@@ -158,7 +197,12 @@ int dictDelete(dict *d, const void *key);
 dictEntry *dictUnlink(dict *ht, const void *key);
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
 void dictRelease(dict *d);
+void dictFreeBucketRange(dict *d, unsigned long start, unsigned long end);
+void dictReleaseTables(dict *d);
+void dictPrefetch(dict *d, const void *key);
+void dictPrefetchByHash(dict *d, uint64_t h);
 dictEntry * dictFind(dict *d, const void *key);
+dictEntry *dictFindNoRehash(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
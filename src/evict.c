@@ -60,6 +60,66 @@ struct evictionPoolEntry {
 
 static struct evictionPoolEntry *EvictionPoolLRU;
 
+/* Ghost list used by the optional second chance eviction (the
+ * lru-ghost-second-chance config). When a key is evicted under an LRU
+ * policy we remember its hash here; if the key gets recreated and later
+ * shows up again as an eviction candidate, being in the ghost list proves
+ * it is re-fetched on miss, so it gets refreshed once instead of evicted.
+ * Keys accessed a single time (a keyspace-wide scan, say) are never in
+ * the list and go first. The table is a simple fixed size array of
+ * hashes: collisions and overwrites just degrade it to the behavior
+ * without the ghost list. */
+#define EVICTION_GHOST_SIZE 16384 /* Must be a power of two. */
+static uint64_t *EvictionGhostTable;
+
+static uint64_t evictionGhostHash(int dbid, sds key) {
+    uint64_t h = dictGenHashFunction(key,sdslen(key)) ^ dbid;
+    if (h == 0) h = 1; /* Zero marks a free slot. */
+    return h;
+}
+
+/* Remember that the key was just evicted. */
+static void evictionGhostRemember(int dbid, sds key) {
+    uint64_t h = evictionGhostHash(dbid,key);
+    EvictionGhostTable[h & (EVICTION_GHOST_SIZE-1)] = h;
+}
+
+/* Return non-zero if the key was evicted recently, consuming the ghost
+ * entry: a key gets a single second chance per eviction. */
+static int evictionGhostHit(int dbid, sds key) {
+    uint64_t h = evictionGhostHash(dbid,key);
+    uint64_t *slot = &EvictionGhostTable[h & (EVICTION_GHOST_SIZE-1)];
+    if (*slot != h) return 0;
+    *slot = 0;
+    return 1;
+}
+
+/* Max number of keys evicted in a single batch: after every sampling pass
+ * we drain up to this many victims from the pool and delete them in bulk,
+ * checking the memory usage again only once per batch instead of once
+ * per deleted key. */
+#define EVICTION_BATCH_KEYS 16
+
+/* A victim selected for the current eviction batch. The key name is
+ * copied into an object at selection time so that the batch remains
+ * valid while previous victims in the same batch are deleted. */
+struct evictionBatchEntry {
+    robj *keyobj;               /* Key name. */
+    int dbid;                   /* Key DB number. */
+};
+
+/* Microseconds spent inside freeMemoryIfNeeded() during the current
+ * event loop iteration, used to enforce maxmemory-eviction-time-limit.
+ * Reset by evictionProcessPendingWork() in beforeSleep(). */
+static long long EvictionTimeSpent = 0;
+
+/* True when the time limit interrupted an eviction cycle before we
+ * could free enough memory: the remaining work is carried over and
+ * performed on the next event loop iteration. */
+static int EvictionWorkPending = 0;
+
+static int freeMemoryAmount(size_t mem_tofree);
+
 /* ----------------------------------------------------------------------------
  * Implementation of eviction, aging and LRU
  * --------------------------------------------------------------------------*/
@@ -68,7 +128,7 @@ static struct evictionPoolEntry *EvictionPoolLRU;
  * in a reduced-bits format that can be used to set and check the
  * object->lru field of redisObject structures. */
 unsigned int getLRUClock(void) {
-    return (mstime()/LRU_CLOCK_RESOLUTION) & LRU_CLOCK_MAX;
+    return (mstime()/server.lru_clock_resolution) & LRU_CLOCK_MAX;
 }
 
 /* This function is used to obtain the current LRU clock.
@@ -77,7 +137,7 @@ unsigned int getLRUClock(void) {
  * precomputed value, otherwise we need to resort to a system call. */
 unsigned int LRU_CLOCK(void) {
     unsigned int lruclock;
-    if (1000/server.hz <= LRU_CLOCK_RESOLUTION) {
+    if (1000/server.hz <= server.lru_clock_resolution) {
         lruclock = server.lruclock;
     } else {
         lruclock = getLRUClock();
@@ -90,10 +150,10 @@ unsigned int LRU_CLOCK(void) {
 unsigned long long estimateObjectIdleTime(robj *o) {
     unsigned long long lruclock = LRU_CLOCK();
     if (lruclock >= o->lru) {
-        return (lruclock - o->lru) * LRU_CLOCK_RESOLUTION;
+        return (lruclock - o->lru) * server.lru_clock_resolution;
     } else {
         return (lruclock + (LRU_CLOCK_MAX - o->lru)) *
-                    LRU_CLOCK_RESOLUTION;
+                    server.lru_clock_resolution;
     }
 }
 
@@ -148,6 +208,7 @@ void evictionPoolAlloc(void) {
         ep[j].dbid = 0;
     }
     EvictionPoolLRU = ep;
+    EvictionGhostTable = zcalloc(sizeof(uint64_t)*EVICTION_GHOST_SIZE);
 }
 
 /* This is an helper function for freeMemoryIfNeeded(), it is used in order
@@ -159,28 +220,60 @@ void evictionPoolAlloc(void) {
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, dict *sampledict, redisDb *db, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
+    robj *values[server.maxmemory_samples];
 
     count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    if (!count) return;
+
+    /* Resolve the value objects of all the samples before scoring them.
+     * The samples come from random buckets, so every robj header we are
+     * about to read for the LRU / LFU metadata is a likely cache miss:
+     * issuing the prefetches first and scoring in a second pass lets the
+     * misses overlap instead of being paid one after the other. */
+    if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
+        if (sampledict == db->expires) {
+            /* If the dictionary we are sampling from is not the main
+             * dictionary (but the expires one) we need to lookup the key
+             * again in the key dictionary to obtain the value object.
+             * Prefetch the buckets those lookups will probe. */
+#if defined(__GNUC__)
+            for (j = 0; j < count; j++) {
+                sds key = dictGetKey(samples[j]);
+                dict *d = dbGetDict(db,key);
+                uint64_t hash = dictHashKey(d,key);
+                __builtin_prefetch(&d->ht[0].table[hash & d->ht[0].sizemask]);
+                if (dictIsRehashing(d))
+                    __builtin_prefetch(
+                        &d->ht[1].table[hash & d->ht[1].sizemask]);
+            }
+#endif
+            for (j = 0; j < count; j++) {
+                sds key = dictGetKey(samples[j]);
+                dictEntry *de = dictFind(dbGetDict(db,key), key);
+                values[j] = dictGetVal(de);
+            }
+        } else {
+            for (j = 0; j < count; j++)
+                values[j] = dictGetVal(samples[j]);
+        }
+#if defined(__GNUC__)
+        for (j = 0; j < count; j++) __builtin_prefetch(values[j]);
+#endif
+    }
+
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
-        robj *o;
+        robj *o = (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) ?
+                  values[j] : NULL;
         dictEntry *de;
 
         de = samples[j];
         key = dictGetKey(de);
 
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
-        }
-
         /* Calculate the idle time according to the policy. This is called
          * idle just because the code initially handled LRU, but is in fact
          * just a score where an higher score means better candidate. */
@@ -351,18 +444,14 @@ unsigned long LFUDecrAndReturn(robj *o) {
  * returns the sum of AOF and slaves buffer. */
 size_t freeMemoryGetNotCountedMemory(void) {
     size_t overhead = 0;
-    int slaves = listLength(server.slaves);
-
-    if (slaves) {
-        listIter li;
-        listNode *ln;
 
-        listRewind(server.slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = listNodeValue(ln);
-            overhead += getClientOutputBufferMemoryUsage(slave);
-        }
-    }
+    /* The slaves stream from the shared replication buffer, so its size
+     * is the amount of memory the slaves output accounts for. The blocks
+     * the backlog window retains are excluded as well, and not only while
+     * replicas are attached: otherwise disconnecting the last replica
+     * would suddenly turn the retained window into counted memory and
+     * trigger a spurious eviction burst. */
+    overhead += server.repl_buffer_mem;
     if (server.aof_state != AOF_OFF) {
         overhead += sdsalloc(server.aof_buf)+aofRewriteBufferSize();
     }
@@ -444,34 +533,60 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
  * Otehrwise if we are over the memory limit, but not enough memory
  * was freed to return back under the limit, the function returns C_ERR. */
 int freeMemoryIfNeeded(void) {
-    int keys_freed = 0;
     /* By default replicas should ignore maxmemory
      * and just be masters exact copies. */
     if (server.masterhost && server.repl_slave_ignore_maxmemory) return C_OK;
 
-    size_t mem_reported, mem_tofree, mem_freed;
-    mstime_t latency, eviction_latency;
-    long long delta;
-    int slaves = listLength(server.slaves);
-
     /* When clients are paused the dataset should be static not just from the
      * POV of clients not being able to write, but also from the POV of
      * expires and evictions of keys not being performed. */
     if (clientsArePaused()) return C_OK;
-    if (getMaxmemoryState(&mem_reported,NULL,&mem_tofree,NULL) == C_OK)
+
+    size_t mem_tofree;
+    if (getMaxmemoryState(NULL,NULL,&mem_tofree,NULL) == C_OK)
         return C_OK;
+    return freeMemoryAmount(mem_tofree);
+}
 
+/* Evict keys until 'mem_tofree' bytes of dataset memory have been released,
+ * honoring the configured maxmemory policy and the per-iteration eviction
+ * time budget. This is the core of freeMemoryIfNeeded(), split out so that
+ * evictionProactiveCron() can release an arbitrary amount of memory while
+ * the server is still below the hard limit. The amount freed is measured
+ * across the db*Delete() calls alone, like the main eviction cycle does. */
+static int freeMemoryAmount(size_t mem_tofree) {
+    int keys_freed = 0;
+    size_t mem_reported, mem_freed;
+    mstime_t latency, eviction_latency;
+    long long delta;
+    int slaves = listLength(server.slaves);
+
+    mem_reported = zmalloc_used_memory();
     mem_freed = 0;
+    long long start = ustime();
 
     if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION)
         goto cant_free; /* We need to free memory, but policy forbids. */
 
+    /* If a previous call during this same event loop iteration already
+     * used the whole time budget, don't start another cycle: just record
+     * that there is work to carry over to the next iteration. */
+    long long time_budget = 0;
+    if (server.maxmemory_eviction_time_limit) {
+        time_budget = (long long)server.maxmemory_eviction_time_limit*1000 -
+                      EvictionTimeSpent;
+        if (time_budget <= 0) {
+            EvictionWorkPending = 1;
+            return C_OK;
+        }
+    }
+
     latencyStartMonitor(latency);
     while (mem_freed < mem_tofree) {
         int j, k, i;
         static unsigned int next_db = 0;
-        sds bestkey = NULL;
-        int bestdbid;
+        struct evictionBatchEntry batch[EVICTION_BATCH_KEYS];
+        int batch_len = 0;
         redisDb *db;
         dict *dict;
         dictEntry *de;
@@ -481,7 +596,7 @@ int freeMemoryIfNeeded(void) {
         {
             struct evictionPoolEntry *pool = EvictionPoolLRU;
 
-            while(bestkey == NULL) {
+            while(batch_len == 0) {
                 unsigned long total_keys = 0, keys;
 
                 /* We don't want to make local-db choices when expiring keys,
@@ -489,25 +604,37 @@ int freeMemoryIfNeeded(void) {
                  * every DB. */
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
+                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+                        /* Sample from a random shard, selected with
+                         * probability proportional to its size. */
+                        dict = dbRandomShard(db);
+                        keys = dbSize(db);
+                    } else {
+                        dict = db->expires;
+                        keys = dictSize(dict);
+                    }
+                    if (keys != 0) {
+                        evictionPoolPopulate(i, dict, db, pool);
                         total_keys += keys;
                     }
                 }
                 if (!total_keys) break; /* No keys to evict. */
 
-                /* Go backward from best to worst element to evict. */
-                for (k = EVPOOL_SIZE-1; k >= 0; k--) {
+                /* Drain the pool going backward from the best to the worst
+                 * element, collecting a whole batch of victims out of the
+                 * single sampling pass above. */
+                for (k = EVPOOL_SIZE-1;
+                     k >= 0 && batch_len < EVICTION_BATCH_KEYS; k--)
+                {
                     if (pool[k].key == NULL) continue;
-                    bestdbid = pool[k].dbid;
+                    int dbid = pool[k].dbid;
 
                     if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
+                        de = dictFind(dbGetDict(&server.db[dbid],
+                                                 pool[k].key),
                             pool[k].key);
                     } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
+                        de = dictFind(server.db[dbid].expires,
                             pool[k].key);
                     }
 
@@ -517,13 +644,29 @@ int freeMemoryIfNeeded(void) {
                     pool[k].key = NULL;
                     pool[k].idle = 0;
 
-                    /* If the key exists, is our pick. Otherwise it is
-                     * a ghost and we need to try the next element. */
+                    /* If the key exists it joins the batch. Otherwise it
+                     * is a ghost and we try the next element. The key name
+                     * is copied so that the batch stays valid while its
+                     * previous victims are deleted. */
                     if (de) {
-                        bestkey = dictGetKey(de);
-                        break;
-                    } else {
-                        /* Ghost... Iterate again. */
+                        sds key = dictGetKey(de);
+
+                        /* Second chance: a candidate in the ghost list was
+                         * already evicted once and recreated since, so it
+                         * is re-fetched on miss. Refresh it and pick
+                         * another victim. */
+                        if (server.lru_ghost_second_chance &&
+                            (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) &&
+                            evictionGhostHit(dbid,key))
+                        {
+                            robj *val = dictGetVal(de);
+                            val->lru = LRU_CLOCK();
+                            continue;
+                        }
+                        batch[batch_len].keyobj =
+                            createStringObject(key,sdslen(key));
+                        batch[batch_len].dbid = dbid;
+                        batch_len++;
                     }
                 }
             }
@@ -533,52 +676,77 @@ int freeMemoryIfNeeded(void) {
         else if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ||
                  server.maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM)
         {
-            /* When evicting a random key, we try to evict a key for
-             * each DB, so we use the static 'next_db' variable to
-             * incrementally visit all DBs. */
-            for (i = 0; i < server.dbnum; i++) {
-                j = (++next_db) % server.dbnum;
-                db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
-                    bestkey = dictGetKey(de);
-                    bestdbid = j;
-                    break;
+            /* When evicting random keys, we try to pick every victim of
+             * the batch from a different DB, so we use the static
+             * 'next_db' variable to incrementally visit all DBs. */
+            while (batch_len < EVICTION_BATCH_KEYS) {
+                int found = 0;
+                for (i = 0; i < server.dbnum; i++) {
+                    j = (++next_db) % server.dbnum;
+                    db = server.db+j;
+                    dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
+                            dbRandomShard(db) : db->expires;
+                    if (dict && dictSize(dict) != 0) {
+                        de = dictGetRandomKey(dict);
+                        sds key = dictGetKey(de);
+                        batch[batch_len].keyobj =
+                            createStringObject(key,sdslen(key));
+                        batch[batch_len].dbid = j;
+                        batch_len++;
+                        found = 1;
+                        break;
+                    }
                 }
+                if (!found) break;
             }
         }
 
-        /* Finally remove the selected key. */
-        if (bestkey) {
-            db = server.db+bestdbid;
-            robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
-            propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
-            /* We compute the amount of memory freed by db*Delete() alone.
-             * It is possible that actually the memory needed to propagate
-             * the DEL in AOF and replication link is greater than the one
-             * we are freeing removing the key, but we can't account for
-             * that otherwise we would never exit the loop.
+        /* Finally remove the selected keys. */
+        if (batch_len) {
+            /* We compute the amount of memory freed by the db*Delete()
+             * calls alone, and only once for the whole batch: querying the
+             * allocator for every deleted key is a sensible part of the
+             * cost of an eviction cycle, and one of the reasons we batch.
+             * It is possible that actually the memory
+             * needed to propagate the DELs in AOF and replication link is
+             * greater than the one we are freeing removing the keys, but we
+             * can't account for that otherwise we would never exit the loop.
              *
              * AOF and Output buffer memory will be freed eventually so
              * we only care about memory used by the key space. */
             delta = (long long) zmalloc_used_memory();
             latencyStartMonitor(eviction_latency);
-            if (server.lazyfree_lazy_eviction)
-                dbAsyncDelete(db,keyobj);
-            else
-                dbSyncDelete(db,keyobj);
+            for (j = 0; j < batch_len; j++) {
+                robj *keyobj = batch[j].keyobj;
+                db = server.db+batch[j].dbid;
+
+                /* The pool does not deduplicate samples, so the same key
+                 * may appear twice in the batch: skip it if an earlier
+                 * victim already deleted it. */
+                if (dictFind(dbGetDict(db,keyobj->ptr),keyobj->ptr) == NULL) {
+                    decrRefCount(keyobj);
+                    continue;
+                }
+                propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
+                if (server.lazyfree_lazy_eviction)
+                    dbAsyncDelete(db,keyobj);
+                else
+                    dbSyncDelete(db,keyobj);
+                server.stat_evictedkeys++;
+                if (server.lru_ghost_second_chance &&
+                    (server.maxmemory_policy & MAXMEMORY_FLAG_LRU))
+                    evictionGhostRemember(db->id,keyobj->ptr);
+                notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
+                    keyobj, db->id);
+                rdbDeltaTrackKey(db,keyobj);
+                decrRefCount(keyobj);
+                keys_freed++;
+            }
             latencyEndMonitor(eviction_latency);
             latencyAddSampleIfNeeded("eviction-del",eviction_latency);
             latencyRemoveNestedEvent(latency,eviction_latency);
             delta -= (long long) zmalloc_used_memory();
             mem_freed += delta;
-            server.stat_evictedkeys++;
-            notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
-                keyobj, db->id);
-            decrRefCount(keyobj);
-            keys_freed++;
 
             /* When the memory to free starts to be big enough, we may
              * start spending so much time here that is impossible to
@@ -589,16 +757,27 @@ int freeMemoryIfNeeded(void) {
             /* Normally our stop condition is the ability to release
              * a fixed, pre-computed amount of memory. However when we
              * are deleting objects in another thread, it's better to
-             * check, from time to time, if we already reached our target
+             * check, once per batch, if we already reached our target
              * memory, since the "mem_freed" amount is computed only
-             * across the dbAsyncDelete() call, while the thread can
+             * across the dbAsyncDelete() calls, while the thread can
              * release the memory all the time. */
-            if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
+            if (server.lazyfree_lazy_eviction && keys_freed) {
                 if (getMaxmemoryState(NULL,NULL,NULL,NULL) == C_OK) {
                     /* Let's satisfy our stop condition. */
                     mem_freed = mem_tofree;
                 }
             }
+
+            /* Stop if this cycle exhausted what is left of the eviction
+             * time budget for this event loop iteration. The remaining
+             * work is carried over and resumed by
+             * evictionProcessPendingWork() on the next iteration. */
+            if (time_budget && mem_freed < mem_tofree &&
+                ustime()-start >= time_budget)
+            {
+                EvictionWorkPending = 1;
+                break;
+            }
         } else {
             latencyEndMonitor(latency);
             latencyAddSampleIfNeeded("eviction-cycle",latency);
@@ -607,6 +786,10 @@ int freeMemoryIfNeeded(void) {
     }
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("eviction-cycle",latency);
+    EvictionTimeSpent += ustime()-start;
+    /* Note that when we stop because of the time limit we may still be
+     * over the memory limit, but we report success anyway: failing the
+     * caller would turn a latency tradeoff we opted into write errors. */
     return C_OK;
 
 cant_free:
@@ -618,9 +801,21 @@ cant_free:
             break;
         usleep(1000);
     }
+    EvictionTimeSpent += ustime()-start;
     return C_ERR;
 }
 
+/* Called by beforeSleep() at the start of every event loop iteration:
+ * resets the per-iteration eviction time budget and, if the previous
+ * iteration had to stop evicting because of maxmemory-eviction-time-limit,
+ * resumes the work that was carried over. */
+void evictionProcessPendingWork(void) {
+    EvictionTimeSpent = 0;
+    if (!EvictionWorkPending) return;
+    EvictionWorkPending = 0;
+    freeMemoryIfNeededAndSafe();
+}
+
 /* This is a wrapper for freeMemoryIfNeeded() that only really calls the
  * function if right now there are the conditions to do so safely:
  *
@@ -632,3 +827,185 @@ int freeMemoryIfNeededAndSafe(void) {
     if (server.lua_timedout || server.loading) return C_OK;
     return freeMemoryIfNeeded();
 }
+
+/* Called from serverCron() every 100 milliseconds: starts evicting before
+ * the hard maxmemory limit is reached, so that the eviction work does not
+ * land synchronously in the command path exactly when traffic peaks.
+ *
+ * When memory usage crosses maxmemory-eviction-watermark percent of
+ * maxmemory, the cron evicts at the pace the server is allocating: each
+ * tick it frees at most the amount of memory allocated since the previous
+ * tick (and never more than the overshoot above the watermark). An idle
+ * server sitting above the watermark is left alone. Once usage reaches the
+ * hard limit the command path takes over as usual.
+ *
+ * Crossing the watermark in either direction also fires an 'e' class
+ * keyspace event ("maxmemory-watermark-reached" / "-cleared", with the
+ * current usage percentage as the key), delivered as a pubsub message or
+ * RESP3 push so that clients can start shedding load before writes get
+ * slow or fail. */
+void evictionProactiveCron(void) {
+    static size_t prev_used = 0;
+    static int above_watermark = 0;
+    size_t total;
+    float level;
+
+    if (!server.maxmemory || !server.maxmemory_eviction_watermark) {
+        prev_used = 0;
+        above_watermark = 0;
+        return;
+    }
+
+    getMaxmemoryState(&total,NULL,NULL,&level);
+    size_t alloc_delta = (prev_used && total > prev_used) ?
+                         total - prev_used : 0;
+    prev_used = total;
+
+    float watermark = (float)server.maxmemory_eviction_watermark/100;
+    if ((level >= watermark) != above_watermark) {
+        above_watermark = (level >= watermark);
+        robj *levelobj = createStringObjectFromLongLong((long long)(level*100));
+        notifyKeyspaceEvent(NOTIFY_EVICTED,
+            above_watermark ? "maxmemory-watermark-reached" :
+                              "maxmemory-watermark-cleared",
+            levelobj, 0);
+        decrRefCount(levelobj);
+    }
+
+    /* Over the hard limit the command path is already evicting
+     * synchronously: don't pile a second cycle on top of it. */
+    if (!above_watermark || level >= 1.0) return;
+    if (alloc_delta == 0) return;
+    if (server.masterhost && server.repl_slave_ignore_maxmemory) return;
+    if (clientsArePaused() || server.lua_timedout || server.loading) return;
+    if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION) return;
+
+    size_t overshoot = (size_t)((level-watermark)*server.maxmemory);
+    size_t mem_tofree = alloc_delta < overshoot ? alloc_delta : overshoot;
+    if (mem_tofree == 0) return;
+
+    long long evicted = server.stat_evictedkeys;
+    freeMemoryAmount(mem_tofree);
+    server.stat_proactive_evictedkeys += server.stat_evictedkeys - evicted;
+}
+
+/* EVICTION DRYRUN [COUNT <count>]
+ *
+ * Report the keys that the eviction cycle would pick as its next victims,
+ * without evicting anything. A scratch pool is populated with the very same
+ * sampling code that freeMemoryIfNeeded() uses, so the reply reflects the
+ * current policy, maxmemory-samples and the live LRU / LFU metadata, but
+ * the real pool and the ghost list are left untouched. */
+void evictionCommand(client *c) {
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
+        const char *help[] = {
+"DRYRUN [COUNT <count>] -- Return the keys the current policy would evict next, best candidate first, with their db and eviction score. Nothing is evicted.",
+NULL
+        };
+        addReplyHelp(c, help);
+    } else if (!strcasecmp(c->argv[1]->ptr,"dryrun") &&
+               (c->argc == 2 || c->argc == 4))
+    {
+        long count = 10;
+        int i, j, k, rounds;
+
+        if (c->argc == 4) {
+            if (strcasecmp(c->argv[2]->ptr,"count")) {
+                addReplySubcommandSyntaxError(c);
+                return;
+            }
+            if (getLongFromObjectOrReply(c,c->argv[3],&count,NULL) != C_OK)
+                return;
+            if (count < 1 || count > EVPOOL_SIZE) {
+                addReplyError(c,"COUNT must be between 1 and 16");
+                return;
+            }
+        }
+
+        if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION) {
+            addReplyError(c,"The noeviction policy never evicts keys");
+            return;
+        }
+        if (!(server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|
+                                         MAXMEMORY_FLAG_LFU)) &&
+            server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL)
+        {
+            addReplyError(c,"The current maxmemory policy picks victims at "
+                            "random and does not maintain an eviction pool");
+            return;
+        }
+
+        /* Populate a scratch pool so the live one is not disturbed. A few
+         * sampling rounds approximate the refinement that repeated
+         * eviction cycles apply to the real pool. */
+        struct evictionPoolEntry pool[EVPOOL_SIZE];
+        for (j = 0; j < EVPOOL_SIZE; j++) {
+            pool[j].idle = 0;
+            pool[j].key = NULL;
+            pool[j].cached = sdsnewlen(NULL,EVPOOL_CACHED_SDS_SIZE);
+            pool[j].dbid = 0;
+        }
+        for (rounds = 0; rounds < 4; rounds++) {
+            for (i = 0; i < server.dbnum; i++) {
+                redisDb *db = server.db+i;
+                dict *dict;
+
+                if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+                    dict = dbRandomShard(db);
+                    if (dbSize(db) == 0) continue;
+                } else {
+                    dict = db->expires;
+                    if (dictSize(dict) == 0) continue;
+                }
+                evictionPoolPopulate(i, dict, db, pool);
+            }
+        }
+
+        /* Reply best candidate first, like the eviction loop drains the
+         * pool. Entries whose key was deleted after sampling are skipped
+         * just like the real cycle skips them. Repeated sampling rounds
+         * can insert the same key more than once, so already replied
+         * entries are skipped too. */
+        long replied = 0;
+        int replied_idx[EVPOOL_SIZE];
+        void *replylen = addReplyDeferredLen(c);
+        for (k = EVPOOL_SIZE-1; k >= 0 && replied < count; k--) {
+            int dup = 0;
+
+            if (pool[k].key == NULL) continue;
+            redisDb *db = server.db+pool[k].dbid;
+            dict *d = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                      dbGetDict(db,pool[k].key) : db->expires;
+            if (dictFind(d,pool[k].key) == NULL) continue;
+            for (j = 0; j < replied; j++) {
+                int r = replied_idx[j];
+                if (pool[r].dbid == pool[k].dbid &&
+                    sdscmp(pool[r].key,pool[k].key) == 0)
+                {
+                    dup = 1;
+                    break;
+                }
+            }
+            if (dup) continue;
+            replied_idx[replied] = k;
+
+            addReplyArrayLen(c,3);
+            addReplyLongLong(c,pool[k].dbid);
+            addReplyBulkCBuffer(c,pool[k].key,sdslen(pool[k].key));
+            /* The pool stores a score where higher means evicted sooner:
+             * idle milliseconds for LRU, the inverted 0-255 counter for
+             * LFU, and the inverted expire time for volatile-ttl. */
+            addReplyLongLong(c,pool[k].idle);
+            replied++;
+        }
+        setDeferredArrayLen(c,replylen,replied);
+
+        for (j = 0; j < EVPOOL_SIZE; j++) {
+            if (pool[j].key && pool[j].key != pool[j].cached)
+                sdsfree(pool[j].key);
+            sdsfree(pool[j].cached);
+        }
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
@@ -31,6 +31,7 @@
  */
 
 #include "server.h"
+#include "endianconv.h"
 
 /*-----------------------------------------------------------------------------
  * Incremental collection of expired keys.
@@ -65,6 +66,7 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
         notifyKeyspaceEvent(NOTIFY_EXPIRED,
             "expired",keyobj,db->id);
         trackingInvalidateKey(keyobj);
+        rdbDeltaTrackKey(db,keyobj);
         decrRefCount(keyobj);
         server.stat_expiredkeys++;
         return 1;
@@ -186,15 +188,10 @@ void activeExpireCycle(int type) {
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
         timelimit = config_cycle_fast_duration; /* in microseconds. */
 
-    /* Accumulate some global stats as we expire keys, to have some idea
-     * about the number of keys that are already logically expired, but still
-     * existing inside the database. */
-    long total_sampled = 0;
-    long total_expired = 0;
 
     for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
-        /* Expired and checked in a single loop. */
-        unsigned long expired, sampled;
+        /* Number of keys collected in a single loop. */
+        unsigned long expired;
 
         redisDb *db = server.db+(current_db % server.dbnum);
 
@@ -203,85 +200,61 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle more than 25%
-         * of the keys were expired. */
+        /* Continue to expire as long as full batches of dead keys are
+         * collected, as in that case more may be pending. */
         do {
-            unsigned long num, slots;
             long long now, ttl_sum;
             int ttl_samples;
             iteration++;
 
             /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
+            if (dictSize(db->expires) == 0) {
                 db->avg_ttl = 0;
                 break;
             }
-            slots = dictSlots(db->expires);
             now = mstime();
 
-            /* When there are less than 1% filled slots, sampling the key
-             * space is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
-            /* The main collection cycle. Sample random keys among keys
-             * with an expire set, checking for expired ones. */
+            /* The main collection cycle. The index is ordered by expire
+             * time, so we pop keys from its head until we find the first
+             * key that is still alive: the work done is proportional to
+             * the number of logically dead keys, not to the size of the
+             * expires dictionary. */
             expired = 0;
-            sampled = 0;
-            ttl_sum = 0;
-            ttl_samples = 0;
 
-            if (num > config_keys_per_loop)
-                num = config_keys_per_loop;
-
-            /* Here we access the low level representation of the hash table
-             * for speed concerns: this makes this code coupled with dict.c,
-             * but it hardly changed in ten years.
-             *
-             * Note that certain places of the hash table may be empty,
-             * so we want also a stop condition about the number of
-             * buckets that we scanned. However scanning for free buckets
-             * is very fast: we are in the cache line scanning a sequential
-             * array of NULL pointers, so we can scan a lot more buckets
-             * than keys in the same time. */
-            long max_buckets = num*20;
-            long checked_buckets = 0;
-
-            while (sampled < num && checked_buckets < max_buckets) {
-                for (int table = 0; table < 2; table++) {
-                    if (table == 1 && !dictIsRehashing(db->expires)) break;
-
-                    unsigned long idx = db->expires_cursor;
-                    idx &= db->expires->ht[table].sizemask;
-                    dictEntry *de = db->expires->ht[table].table[idx];
-                    long long ttl;
-
-                    /* Scan the current bucket of the current table. */
-                    checked_buckets++;
-                    while(de) {
-                        /* Get the next entry now since this entry may get
-                         * deleted. */
-                        dictEntry *e = de;
-                        de = de->next;
-
-                        ttl = dictGetSignedIntegerVal(e)-now;
-                        if (activeExpireCycleTryExpire(db,e,now)) expired++;
-                        if (ttl > 0) {
-                            /* We want the average TTL of keys yet
-                             * not expired. */
-                            ttl_sum += ttl;
-                            ttl_samples++;
-                        }
-                        sampled++;
-                    }
-                }
-                db->expires_cursor++;
+            raxIterator ri;
+            raxStart(&ri,db->expires_index);
+            while (expired < config_keys_per_loop) {
+                /* Expiring the key removes its index entry, so we seek
+                 * the head of the tree again at every iteration. */
+                raxSeek(&ri,"^",NULL,0);
+                if (!raxNext(&ri)) break;
+
+                uint64_t enc;
+                memcpy(&enc,ri.key,sizeof(enc));
+                if ((long long)ntohu64(enc) >= now) break;
+
+                sds keyname = sdsnewlen(ri.key+8,ri.key_len-8);
+                dictEntry *de = dictFind(db->expires,keyname);
+                serverAssert(de != NULL);
+                if (activeExpireCycleTryExpire(db,de,now)) expired++;
+                sdsfree(keyname);
             }
-            total_expired += expired;
-            total_sampled += sampled;
+            raxStop(&ri);
 
-            /* Update the average TTL stats for this database. */
+            /* Update the average TTL stats for this database: the index
+             * head would only tell us about the nearest deadlines, so we
+             * sample a few random volatile keys instead. */
+            ttl_sum = 0;
+            ttl_samples = 0;
+            for (int i = 0; i < 16 && dictSize(db->expires); i++) {
+                dictEntry *de = dictGetRandomKey(db->expires);
+                long long ttl = dictGetSignedIntegerVal(de)-now;
+
+                /* We want the average TTL of keys yet not expired. */
+                if (ttl <= 0) continue;
+                ttl_sum += ttl;
+                ttl_samples++;
+            }
             if (ttl_samples) {
                 long long avg_ttl = ttl_sum/ttl_samples;
 
@@ -303,23 +276,48 @@ void activeExpireCycle(int type) {
                     break;
                 }
             }
-            /* We don't repeat the cycle for the current database if there are
-             * an acceptable amount of stale keys (logically expired but yet
-             * not reclained). */
-        } while ((expired*100/sampled) > config_cycle_acceptable_stale);
+        } while (expired == config_keys_per_loop);
+
+        /* Hash field TTLs: the hexpires index orders the hashes by their
+         * nearest field deadline, so pop from its head the hashes that
+         * have dead fields and sweep just those. Every sweep advances the
+         * head entry (either the deadline moves forward or the entry goes
+         * away), so the loop makes progress; the iteration cap bounds the
+         * work like the key loop above. */
+        if (dictSize(db->hexpires) != 0 && timelimit_exit == 0) {
+            mstime_t now = mstime();
+            unsigned long loops = 0;
+            raxIterator ri;
+
+            raxStart(&ri,db->hexpires_index);
+            while (loops < config_keys_per_loop) {
+                raxSeek(&ri,"^",NULL,0);
+                if (!raxNext(&ri)) break;
+
+                uint64_t enc;
+                memcpy(&enc,ri.key,sizeof(enc));
+                if ((long long)ntohu64(enc) >= now) break;
+
+                robj *keyobj = createStringObject((char*)ri.key+8,
+                                                  ri.key_len-8);
+                hashTypeExpireFields(db,keyobj,now);
+                decrRefCount(keyobj);
+                loops++;
+            }
+            raxStop(&ri);
+        }
     }
 
     elapsed = ustime()-start;
     server.stat_expire_cycle_time_used += elapsed;
     latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
 
-    /* Update our estimate of keys existing but yet to be expired.
+    /* Update our estimate of keys existing but yet to be expired. Since the
+     * cycle collects exactly the keys that are already dead, a completed run
+     * leaves no backlog behind: only a cycle interrupted by the time limit
+     * may leave stale keys around.
      * Running average with this sample accounting for 5%. */
-    double current_perc;
-    if (total_sampled) {
-        current_perc = (double)total_expired/total_sampled;
-    } else
-        current_perc = 0;
+    double current_perc = timelimit_exit ? 1 : 0;
     server.stat_expired_stale_perc = (current_perc*0.05)+
                                      (server.stat_expired_stale_perc*0.95);
 }
@@ -472,6 +470,85 @@ void flushSlaveKeysWithExpireList(void) {
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Reclaiming the values of expired keys on replicas
+ *
+ * Replicas never delete logically expired keys by themselves: they wait for
+ * the DEL the master synthesizes, so that both sides converge on the same
+ * dataset. The read path already hides such keys from read-only clients,
+ * but their values stay in memory, and on TTL-heavy datasets a lagging (or
+ * disconnected) master can leave gigabytes of dead values around.
+ *
+ * When replica-free-expired-values is enabled we walk the expires time
+ * index and free just the *value* of keys that expired a while ago,
+ * replacing it with a shared empty string acting as a tombstone: the key,
+ * its expire and its index entry are left in place, so the master DEL (and
+ * a possible promotion to master) applies exactly as before.
+ *
+ * The caveat, and the reason the feature is opt-in, is that a master that
+ * still considers one of these keys alive (clock skew, paused process) may
+ * write to it with something other than an overwrite, say an APPEND: the
+ * replica would apply the write to the tombstone and diverge until the key
+ * is fully rewritten. The reclaim delay below makes this unlikely but
+ * cannot exclude it.
+ *----------------------------------------------------------------------------*/
+
+/* Keys must be logically expired at least this long before their value is
+ * reclaimed, so that a master expiring on time always wins the race. */
+#define EXPIRED_VALUE_FREE_DELAY 5000 /* Milliseconds. */
+#define EXPIRED_VALUE_FREE_PER_DB 64  /* Max values reclaimed per call. */
+
+/* The value every reclaimed key points to. Created on first use. */
+static robj *expiredValueTombstone = NULL;
+
+/* Walk the head of each DB expires time index and reclaim the values of
+ * keys that expired more than EXPIRED_VALUE_FREE_DELAY milliseconds ago.
+ * Called from databasesCron() when replica-free-expired-values is set.
+ *
+ * Each DB remembers in reclaimed_upto the highest expire time already
+ * processed, so successive calls seek past the (still indexed) tombstones
+ * instead of rescanning them. */
+void replicaFreeExpiredValues(void) {
+    mstime_t now = mstime();
+
+    if (server.loading) return;
+    if (expiredValueTombstone == NULL)
+        expiredValueTombstone =
+            makeObjectShared(createObject(OBJ_STRING,sdsempty()));
+
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        raxIterator ri;
+        unsigned char seek[8];
+        uint64_t enc = htonu64((uint64_t)db->reclaimed_upto);
+        int freed = 0;
+
+        if (raxSize(db->expires_index) == 0) continue;
+        memcpy(seek,&enc,sizeof(seek));
+        raxStart(&ri,db->expires_index);
+        raxSeek(&ri,">",seek,sizeof(seek));
+        while (raxNext(&ri)) {
+            memcpy(&enc,ri.key,sizeof(enc));
+            mstime_t when = (mstime_t)ntohu64(enc);
+            if (when > now - EXPIRED_VALUE_FREE_DELAY) break;
+
+            sds keyname = sdsnewlen(ri.key+8,ri.key_len-8);
+            dict *d = dbGetDict(db,keyname);
+            dictEntry *de = dictFind(d,keyname);
+            sdsfree(keyname);
+            if (de && dictGetVal(de) != expiredValueTombstone) {
+                freeObjAsync(dictGetVal(de));
+                dictSetVal(d,de,expiredValueTombstone);
+                server.stat_expired_values_freed++;
+                freed++;
+            }
+            db->reclaimed_upto = when;
+            if (freed >= EXPIRED_VALUE_FREE_PER_DB) break;
+        }
+        raxStop(&ri);
+    }
+}
+
 /*-----------------------------------------------------------------------------
  * Expires Commands
  *----------------------------------------------------------------------------*/
@@ -0,0 +1,252 @@
+/* fastpath.c -- Monomorphic fast path for the hottest commands.
+ *
+ * processCommand() normally executes every command through call(), a
+ * fully general dispatcher that supports MONITOR feeds, Lua nesting,
+ * MULTI/EXEC propagation rewriting and so forth. For the commands that
+ * dominate real workloads (GET, SET, EXISTS, INCR on plain string
+ * values) almost none of that machinery is needed, yet the command
+ * still pays for it on every invocation: the indirect proc call, the
+ * generic lookup helpers, and for GET the creation of an intermediate
+ * reply object.
+ *
+ * This file implements specialized versions of those commands that
+ * inline the dict lookup, the expire check and the reply emission into
+ * one straight-line function, emitting replies directly from the stored
+ * value with no intermediate robj. Whenever a request doesn't fit the
+ * fast path exactly (unexpected arity, non-string value, a condition
+ * that needs the general dispatcher) the function bails out *before*
+ * producing any side effect and processCommand() falls back to call(),
+ * so the observable behavior is identical. The whole path is gated by
+ * the fast-path-commands config so the two code paths can be A/B
+ * compared on production traffic.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "latency.h"
+#include "slowlog.h"
+
+/* Return true if 'val' is a plain string the fast path knows how to
+ * reply with directly. Lazily loaded values and module/stream types must
+ * go through the general path that knows how to materialize them. */
+#define fastPathPlainString(_val) \
+    ((_val)->type == OBJ_STRING && \
+     ((_val)->encoding == OBJ_ENCODING_RAW || \
+      (_val)->encoding == OBJ_ENCODING_EMBSTR || \
+      (_val)->encoding == OBJ_ENCODING_INT))
+
+/* Update the access time / frequency of a value just returned to the
+ * client, exactly like lookupKey() does on the general path. */
+static void fastPathTouchKey(redisDb *db, robj *key, robj *val) {
+    if (!hasActiveChildProcess()) {
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+            updateLFU(val);
+        } else {
+            val->lru = LRU_CLOCK();
+        }
+    }
+    hotkeysSampleIfNeeded(db,key->ptr);
+}
+
+/* GET <key>: reply straight from the stored sds (or embedded long) with
+ * no intermediate object. Returns 0 (bail out to the general path) if
+ * the value is not a plain string. */
+static int fastPathGet(client *c) {
+    robj *key = c->argv[1];
+
+    expireIfNeeded(c->db,key);
+    dictEntry *de = dictFind(dbGetDict(c->db,key->ptr),key->ptr);
+    if (de == NULL) {
+        server.stat_keyspace_misses++;
+        notifyKeyspaceEvent(NOTIFY_KEY_MISS,"keymiss",key,c->db->id);
+        addReplyNull(c);
+        return 1;
+    }
+
+    robj *val = dictGetVal(de);
+    if (!fastPathPlainString(val)) return 0;
+    server.stat_keyspace_hits++;
+    fastPathTouchKey(c->db,key,val);
+    if (val->encoding == OBJ_ENCODING_INT)
+        addReplyBulkLongLong(c,(long)val->ptr);
+    else if (!replyCacheAddReply(c,c->db,key->ptr,val))
+        addReplyBulkCBuffer(c,val->ptr,sdslen(val->ptr));
+    return 1;
+}
+
+/* SET <key> <value> with no options: skip the option parsing of
+ * setGenericCommand() and the OBJ_SET_* flag checks entirely. */
+static int fastPathSet(client *c) {
+    c->argv[2] = tryObjectEncoding(c->argv[2]);
+    setKey(c->db,c->argv[1],c->argv[2]);
+    server.dirty++;
+    notifyKeyspaceEvent(NOTIFY_STRING,"set",c->argv[1],c->db->id);
+    addReply(c,shared.ok);
+    return 1;
+}
+
+/* EXISTS <key>: single key form, same hit/miss accounting as
+ * lookupKeyRead() but without the loop and counter of the generic
+ * implementation. */
+static int fastPathExists(client *c) {
+    robj *key = c->argv[1];
+
+    expireIfNeeded(c->db,key);
+    dictEntry *de = dictFind(dbGetDict(c->db,key->ptr),key->ptr);
+    if (de == NULL) {
+        server.stat_keyspace_misses++;
+        notifyKeyspaceEvent(NOTIFY_KEY_MISS,"keymiss",key,c->db->id);
+        addReply(c,shared.czero);
+        return 1;
+    }
+    robj *val = dictGetVal(de);
+    if (val->encoding == OBJ_ENCODING_LAZY ||
+        val->encoding == OBJ_ENCODING_COLD) return 0;
+    server.stat_keyspace_hits++;
+    fastPathTouchKey(c->db,key,val);
+    addReply(c,shared.cone);
+    return 1;
+}
+
+/* INCR <key>: only handles the common case of a missing key or an
+ * integer encoded string. Type errors, non numeric values and overflows
+ * bail out to incrCommand() which produces the usual error replies. */
+static int fastPathIncr(client *c) {
+    robj *key = c->argv[1];
+    long long value;
+
+    robj *o = lookupKeyWrite(c->db,key);
+    if (o) {
+        if (o->type != OBJ_STRING || o->encoding != OBJ_ENCODING_INT)
+            return 0;
+        value = (long)o->ptr;
+        if (value == LLONG_MAX) return 0; /* Would overflow. */
+    } else {
+        value = 0;
+    }
+    value++;
+
+    if (o && o->refcount == 1 &&
+        (value < 0 || value >= OBJ_SHARED_INTEGERS) &&
+        value >= LONG_MIN && value <= LONG_MAX)
+    {
+        o->ptr = (void*)((long)value);
+    } else {
+        robj *new = createStringObjectFromLongLongForValue(value);
+        if (o) {
+            dbOverwrite(c->db,key,new);
+        } else {
+            dbAdd(c->db,key,new);
+        }
+    }
+    signalModifiedKey(c->db,key);
+    notifyKeyspaceEvent(NOTIFY_STRING,"incrby",key,c->db->id);
+    server.dirty++;
+    addReplyLongLong(c,value);
+    return 1;
+}
+
+/* Execute c->cmd through the fast path if possible. Returns 1 if the
+ * command was fully executed (reply sent, stats and propagation
+ * handled), or 0 if the caller must run it through call() instead.
+ *
+ * The conditions checked here mirror the features of call() that the
+ * fast path does not reimplement: MONITOR feeds, cluster redirection,
+ * replica read semantics, Lua and forced propagation flags. They are
+ * all rare on the workloads this path targets. */
+int handleFastPathCommand(client *c) {
+    long long dirty;
+    ustime_t start, duration;
+    struct redisCommand *cmd = c->cmd;
+    int (*fastproc)(client *c);
+
+    if (cmd->proc == getCommand && c->argc == 2)
+        fastproc = fastPathGet;
+    else if (cmd->proc == setCommand && c->argc == 3)
+        fastproc = fastPathSet;
+    else if (cmd->proc == existsCommand && c->argc == 2)
+        fastproc = fastPathExists;
+    else if (cmd->proc == incrCommand && c->argc == 2)
+        fastproc = fastPathIncr;
+    else
+        return 0;
+
+    if (listLength(server.monitors) ||
+        server.cluster_enabled ||
+        server.masterhost != NULL ||
+        server.loading ||
+        (c->flags & (CLIENT_LUA|CLIENT_FORCE_AOF|CLIENT_FORCE_REPL|
+                     CLIENT_PREVENT_PROP)))
+    {
+        return 0;
+    }
+
+    /* A forkless AOF rewrite needs to serialize the old value before a
+     * write touches it: let call() handle that dance. */
+    if ((cmd->flags & CMD_WRITE) && aofNoForkRewriteInProgress()) return 0;
+
+    server.fixed_time_expire++;
+    dirty = server.dirty;
+    updateCachedTime(0);
+    start = server.ustime;
+    int executed = fastproc(c);
+    duration = ustime()-start;
+    dirty = server.dirty-dirty;
+
+    if (!executed) {
+        /* The specialized function bailed out before replying or
+         * modifying the dataset (expired key collection aside, which is
+         * idempotent): run the command through the general path. */
+        server.fixed_time_expire--;
+        return 0;
+    }
+
+    /* From here on, mirror the bookkeeping of call() for a plain
+     * top-level command: slowlog, latency, commandstats, AOF/replica
+     * propagation and client side caching. */
+    if (!(cmd->flags & CMD_SKIP_SLOWLOG)) {
+        latencyAddSampleIfNeeded("fast-command",duration/1000);
+        slowlogPushEntryIfNeeded(c,c->argv,c->argc,duration);
+    }
+    cmd->microseconds += duration;
+    cmd->calls++;
+    latencyHistogramRecord(cmd,duration);
+
+    if (dirty) propagate(cmd,c->db->id,c->argv,c->argc,
+                         PROPAGATE_AOF|PROPAGATE_REPL);
+
+    if ((cmd->flags & CMD_READONLY) && (c->flags & CLIENT_TRACKING))
+        trackingRememberKeys(c);
+
+    server.fixed_time_expire--;
+    server.stat_numcommands++;
+    return 1;
+}
@@ -183,22 +183,17 @@ void addReplyDoubleDistance(client *c, double d) {
 }
 
 /* Helper function for geoGetPointsInRange(): given a sorted set score
- * representing a point, and another point (the center of our search) and
- * a radius, appends this entry as a geoPoint into the specified geoArray
- * only if the point is within the search area.
+ * representing a point, and the precomputed search circle 'rc', appends
+ * this entry as a geoPoint into the specified geoArray only if the point
+ * is within the search area.
  *
  * returns C_OK if the point is included, or REIDS_ERR if it is outside. */
-int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius, double score, sds member) {
+int geoAppendIfWithinRadius(geoArray *ga, const GeoHashRadiusCheck *rc, double score, sds member) {
     double distance, xy[2];
 
     if (!decodeGeohash(score,xy)) return C_ERR; /* Can't decode. */
-    /* Note that geohashGetDistanceIfInRadiusWGS84() takes arguments in
-     * reverse order: longitude first, latitude later. */
-    if (!geohashGetDistanceIfInRadiusWGS84(lon,lat, xy[0], xy[1],
-                                           radius, &distance))
-    {
+    if (!geohashPointInRadiusCheck(rc, xy[0], xy[1], &distance))
         return C_ERR;
-    }
 
     /* Append the new element. */
     geoPoint *gp = geoArrayAppend(ga);
@@ -214,22 +209,22 @@ int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius,
  * 'max', appending them into the array of geoPoint structures 'gparray'.
  * The command returns the number of elements added to the array.
  *
- * Elements which are farest than 'radius' from the specified 'x' and 'y'
- * coordinates are not included.
+ * Elements which are farest than the radius of the search circle 'rc'
+ * are not included.
  *
  * The ability of this function to append to an existing set of points is
  * important for good performances because querying by radius is performed
  * using multiple queries to the sorted set, that we later need to sort
  * via qsort. Similarly we need to be able to reject points outside the search
  * radius area ASAP in order to allocate and process more points than needed. */
-int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double lat, double radius, geoArray *ga) {
+int geoGetPointsInRange(robj *zobj, double min, double max, const GeoHashRadiusCheck *rc, geoArray *ga) {
     /* minex 0 = include min in range; maxex 1 = exclude max in range */
     /* That's: min <= val < max */
     zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
     size_t origincount = ga->used;
     sds member;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr = NULL;
@@ -242,7 +237,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             return 0;
         }
 
-        sptr = ziplistNext(zl, eptr);
+        sptr = lpNext(zl, eptr);
         while (eptr) {
             score = zzlGetScore(sptr);
 
@@ -250,11 +245,11 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             if (!zslValueLteMax(score, &range))
                 break;
 
-            /* We know the element exists. ziplistGet should always succeed */
-            ziplistGet(eptr, &vstr, &vlen, &vlong);
+            /* We know the element exists. lpGetValue always succeeds. */
+            vstr = lpGetValue(eptr, &vlen, &vlong);
             member = (vstr == NULL) ? sdsfromlonglong(vlong) :
                                       sdsnewlen(vstr,vlen);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,member)
+            if (geoAppendIfWithinRadius(ga,rc,score,member)
                 == C_ERR) sdsfree(member);
             zzlNext(zl, &eptr, &sptr);
         }
@@ -275,7 +270,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
                 break;
 
             ele = sdsdup(ele);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,ln->score,ele)
+            if (geoAppendIfWithinRadius(ga,rc,ln->score,ele)
                 == C_ERR) sdsfree(ele);
             ln = ln->level[0].forward;
         }
@@ -315,19 +310,22 @@ void scoresOfGeoHashBox(GeoHashBits hash, GeoHashFix52Bits *min, GeoHashFix52Bit
 /* Obtain all members between the min/max of this geohash bounding box.
  * Populate a geoArray of GeoPoints by calling geoGetPointsInRange().
  * Return the number of points added to the array. */
-int membersOfGeoHashBox(robj *zobj, GeoHashBits hash, geoArray *ga, double lon, double lat, double radius) {
+int membersOfGeoHashBox(robj *zobj, GeoHashBits hash, geoArray *ga, const GeoHashRadiusCheck *rc) {
     GeoHashFix52Bits min, max;
 
     scoresOfGeoHashBox(hash,&min,&max);
-    return geoGetPointsInRange(zobj, min, max, lon, lat, radius, ga);
+    return geoGetPointsInRange(zobj, min, max, rc, ga);
 }
 
 /* Search all eight neighbors + self geohash box */
-int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, double radius, geoArray *ga) {
+int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, const GeoHashRadiusCheck *rc, geoArray *ga) {
     GeoHashBits neighbors[9];
+    GeoHashRange long_range, lat_range;
     unsigned int i, count = 0, last_processed = 0;
     int debugmsg = 0;
 
+    geohashGetCoordRange(&long_range,&lat_range);
+
     neighbors[0] = n.hash;
     neighbors[1] = n.neighbors.north;
     neighbors[2] = n.neighbors.south;
@@ -348,8 +346,6 @@ int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, d
 
         /* Debugging info. */
         if (debugmsg) {
-            GeoHashRange long_range, lat_range;
-            geohashGetCoordRange(&long_range,&lat_range);
             GeoHashArea myarea = {{0}};
             geohashDecode(long_range, lat_range, neighbors[i], &myarea);
 
@@ -374,7 +370,20 @@ int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, d
                 D("Skipping processing of %d, same as previous\n",i);
             continue;
         }
-        count += membersOfGeoHashBox(zobj, neighbors[i], ga, lon, lat, radius);
+
+        /* Skip the whole cell, and with it its sorted set range scan,
+         * when even its closest point is farther than the radius: this
+         * is often the case for the corner neighbors, that only touch
+         * the search circle bounding box by a corner. */
+        if (i > 0) {
+            GeoHashArea cellarea = {{0}};
+            geohashDecode(long_range, lat_range, neighbors[i], &cellarea);
+            if (geohashAreaOutsideRadiusCheck(&cellarea, rc)) {
+                if (debugmsg) D("Skipping cell %d, outside the radius\n",i);
+                continue;
+            }
+        }
+        count += membersOfGeoHashBox(zobj, neighbors[i], ga, rc);
         last_processed = i;
     }
     return count;
@@ -560,9 +569,12 @@ void georadiusGeneric(client *c, int flags) {
     GeoHashRadius georadius =
         geohashGetAreasByRadiusWGS84(xy[0], xy[1], radius_meters);
 
-    /* Search the zset for all matching points */
+    /* Search the zset for all matching points. The radius check state is
+     * built once here so the per candidate test is as cheap as possible. */
+    GeoHashRadiusCheck rc;
+    geohashInitRadiusCheck(&rc, xy[0], xy[1], radius_meters);
     geoArray *ga = geoArrayCreate();
-    membersOfAllNeighbors(zobj, georadius, xy[0], xy[1], radius_meters, ga);
+    membersOfAllNeighbors(zobj, georadius, &rc, ga);
 
     /* If no matching results, the user gets an empty reply. */
     if (ga->used == 0 && storekey == NULL) {
@@ -651,12 +663,13 @@ void georadiusGeneric(client *c, int flags) {
 
             if (maxelelen < elelen) maxelelen = elelen;
             znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            serverAssert(dictAdd(zs->dict,znode->ele,&znode->score) == DICT_OK);
+            sdsfree(gp->member);
             gp->member = NULL;
         }
 
         if (returned_items) {
-            zsetConvertToZiplistIfNeeded(zobj,maxelelen);
+            zsetConvertToListpackIfNeeded(zobj,maxelelen);
             setKey(c->db,storekey,zobj);
             decrRefCount(zobj);
             notifyKeyspaceEvent(NOTIFY_ZSET,"georadiusstore",storekey,
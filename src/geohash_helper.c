@@ -233,3 +233,92 @@ int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double *distance) {
     return geohashGetDistanceIfInRadius(x1, y1, x2, y2, radius, distance);
 }
+
+/* Initialize 'rc' to test candidate points against the circle centered at
+ * longitude,latitude (degrees) with the specified radius in meters.
+ *
+ * The haversine distance is d = 2R asin(sqrt(h)), with
+ * h = sin^2(dlat/2) + cos(lat1)cos(lat2)sin^2(dlon/2), so the radius test
+ * d <= r is equivalent to h <= sin^2(r/2R), both sides being monotonically
+ * related for angles up to half the circumference. By precomputing
+ * sin^2(r/2R) here, geohashPointInRadiusCheck() can reject a candidate
+ * comparing 'h' directly, without ever computing the asin() and the
+ * sqrt(): the exact distance is only needed for the points that are
+ * actually inside the circle. */
+void geohashInitRadiusCheck(GeoHashRadiusCheck *rc, double longitude,
+                            double latitude, double radius_meters)
+{
+    double a = radius_meters / (2.0 * EARTH_RADIUS_IN_METERS);
+
+    if (a > M_PI_2) a = M_PI_2; /* Radius covering the whole planet. */
+    rc->longitude = deg_rad(longitude);
+    rc->latitude = deg_rad(latitude);
+    rc->coslat = cos(rc->latitude);
+    rc->radius = radius_meters;
+    rc->hav_radius = sin(a) * sin(a);
+}
+
+/* Test if the point at longitude,latitude (degrees) is inside the circle
+ * described by 'rc'. Returns 1 and populates *distance with the haversine
+ * distance if it is, otherwise 0 is returned and *distance is not touched.
+ *
+ * This computes the same exact result as geohashGetDistanceIfInRadius(),
+ * but a rejected candidate costs three trigonometric calls instead of
+ * five plus an asin() and a sqrt(). Rejections are the common case since
+ * the search squares cover a much larger area than the inscribed circle. */
+int geohashPointInRadiusCheck(const GeoHashRadiusCheck *rc, double longitude,
+                              double latitude, double *distance)
+{
+    double latr = deg_rad(latitude);
+    double u = sin((latr - rc->latitude) / 2);
+    double v = sin((deg_rad(longitude) - rc->longitude) / 2);
+    double h = u * u + rc->coslat * cos(latr) * v * v;
+
+    if (h > rc->hav_radius) return 0;
+    *distance = 2.0 * EARTH_RADIUS_IN_METERS * asin(sqrt(h));
+    return 1;
+}
+
+/* Return 1 if no point of 'area' can be inside the circle described by
+ * 'rc', so that the whole cell, and with it the sorted set score range it
+ * maps to, can be skipped without inspecting its members. This often
+ * happens for the corner neighbors of a search area.
+ *
+ * The check relies on two lower bounds of the haversine distance that
+ * hold for every point of the cell (asin(x) >= x):
+ *
+ *   d >= 2R |sin(dlat/2)|
+ *   d >= 2R sqrt(cos(lat1) cos(lat2)) |sin(dlon/2)|
+ *
+ * using for dlat/dlon the angular gap between the center and the nearest
+ * cell edge, and for cos(lat2) its minimum over the cell latitudes. A
+ * return value of 0 does not imply the cell intersects the circle, but a
+ * return value of 1 guarantees that no member of the cell is within the
+ * radius. */
+int geohashAreaOutsideRadiusCheck(const GeoHashArea *area,
+                                  const GeoHashRadiusCheck *rc)
+{
+    double latmin = deg_rad(area->latitude.min);
+    double latmax = deg_rad(area->latitude.max);
+    double lonmin = deg_rad(area->longitude.min);
+    double lonmax = deg_rad(area->longitude.max);
+    double dlat = 0, dlon = 0;
+
+    if (rc->latitude < latmin) dlat = latmin - rc->latitude;
+    else if (rc->latitude > latmax) dlat = rc->latitude - latmax;
+    if (dlat > 0 &&
+        2.0 * EARTH_RADIUS_IN_METERS * sin(dlat/2) > rc->radius) return 1;
+
+    if (rc->longitude < lonmin) dlon = lonmin - rc->longitude;
+    else if (rc->longitude > lonmax) dlon = rc->longitude - lonmax;
+    if (dlon > M_PI) dlon = 2*M_PI - dlon; /* Antimeridian wrap. */
+    if (dlon > 0) {
+        /* The east-west bound shrinks with the cosine of the latitude:
+         * use the cell latitude farthest from the equator, where the
+         * cosine is smallest, so the bound holds for any cell point. */
+        double cosmin = cos(fabs(latmin) > fabs(latmax) ? latmin : latmax);
+        if (2.0 * EARTH_RADIUS_IN_METERS * sqrt(rc->coslat * cosmin) *
+            sin(dlon/2) > rc->radius) return 1;
+    }
+    return 0;
+}
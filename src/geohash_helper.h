@@ -67,4 +67,24 @@ int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double y2, double radius,
                                       double *distance);
 
+/* Precomputed state to test many candidate points against the same search
+ * circle, hoisting out of the candidates loop every term of the haversine
+ * formula that only depends on the center and the radius. Initialized by
+ * geohashInitRadiusCheck(). */
+typedef struct {
+    double longitude;  /* Center longitude in radians. */
+    double latitude;   /* Center latitude in radians. */
+    double coslat;     /* Cosine of the center latitude. */
+    double radius;     /* Radius in meters. */
+    double hav_radius; /* Haversine of the radius angle: candidates with a
+                          greater haversine are outside the circle. */
+} GeoHashRadiusCheck;
+
+void geohashInitRadiusCheck(GeoHashRadiusCheck *rc, double longitude,
+                            double latitude, double radius_meters);
+int geohashPointInRadiusCheck(const GeoHashRadiusCheck *rc, double longitude,
+                              double latitude, double *distance);
+int geohashAreaOutsideRadiusCheck(const GeoHashArea *area,
+                                  const GeoHashRadiusCheck *rc);
+
 #endif /* GEOHASH_HELPER_HPP_ */
@@ -0,0 +1,224 @@
+/* hotkeys.c -- Hot key detection.
+ *
+ * Tracking of the most frequently accessed keys using the SpaceSaving
+ * top-k algorithm over a sampled stream of lookups, so that traffic skew
+ * towards a few keys can be detected from inside Redis instead of with
+ * packet captures. The per-object LFU counter can tell how hot a given
+ * key is, but cannot answer "what are the hottest keys right now" without
+ * scanning the whole keyspace.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* Number of keys tracked by the SpaceSaving summary. The structure
+ * guarantees that any key accessed more than sampled-stream-length/SIZE
+ * times is in the table, so 16 entries are plenty for a "top 10". */
+#define HOTKEYS_TABLE_SIZE 16
+
+typedef struct hotkeyEntry {
+    sds key;            /* Key name (owned by this structure). */
+    int dbid;           /* Database the key belongs to. */
+    uint64_t count;     /* Estimated (sampled) access count. */
+    uint64_t error;     /* Max overestimation of 'count' (the count of the
+                           entry this one replaced). */
+} hotkeyEntry;
+
+static hotkeyEntry hotkeys_table[HOTKEYS_TABLE_SIZE];
+static int hotkeys_used = 0;            /* Number of populated entries. */
+static int hotkeys_countdown = 0;       /* Lookups until the next sample. */
+static mstime_t hotkeys_last_report = 0;
+
+/* Record a sampled access to 'key'. This is the slow path of
+ * hotkeysSampleIfNeeded(), taken once every hotkeys-sample-rate lookups. */
+void hotkeysRecordAccess(redisDb *db, sds key) {
+    int j, minidx = 0;
+
+    hotkeys_countdown = server.hotkeys_sample_rate;
+
+    /* If the key is already tracked just bump its counter. The table is
+     * small and this path is sampled, so a linear scan beats maintaining
+     * an index. */
+    for (j = 0; j < hotkeys_used; j++) {
+        hotkeyEntry *he = hotkeys_table+j;
+        if (he->dbid == db->id && sdslen(he->key) == sdslen(key) &&
+            memcmp(he->key,key,sdslen(key)) == 0)
+        {
+            he->count++;
+            return;
+        }
+        if (he->count < hotkeys_table[minidx].count) minidx = j;
+    }
+
+    /* Not tracked: take a free slot if there is one. */
+    if (hotkeys_used < HOTKEYS_TABLE_SIZE) {
+        hotkeyEntry *he = hotkeys_table+hotkeys_used++;
+        he->key = sdsdup(key);
+        he->dbid = db->id;
+        he->count = 1;
+        he->error = 0;
+        return;
+    }
+
+    /* Otherwise evict the entry with the smallest count, as SpaceSaving
+     * prescribes: the new key inherits that count as its error bound. */
+    hotkeyEntry *he = hotkeys_table+minidx;
+    sdsfree(he->key);
+    he->key = sdsdup(key);
+    he->dbid = db->id;
+    he->error = he->count;
+    he->count++;
+}
+
+/* Sample 1 out of every server.hotkeys_sample_rate lookups. Called from
+ * lookupKey() for every access: when the tracker is disabled, or the
+ * countdown has not elapsed yet, the cost is just this test. */
+void hotkeysSampleIfNeeded(redisDb *db, sds key) {
+    if (server.hotkeys_sample_rate == 0) return;
+    if (--hotkeys_countdown > 0) return;
+    hotkeysRecordAccess(db,key);
+}
+
+/* Forget everything tracked so far. */
+void hotkeysReset(void) {
+    int j;
+
+    for (j = 0; j < hotkeys_used; j++) sdsfree(hotkeys_table[j].key);
+    hotkeys_used = 0;
+    hotkeys_countdown = 0;
+}
+
+/* qsort() helper sorting entries by descending count. */
+static int hotkeysEntryCmp(const void *a, const void *b) {
+    const hotkeyEntry *ea = a, *eb = b;
+
+    if (eb->count > ea->count) return 1;
+    if (eb->count < ea->count) return -1;
+    return 0;
+}
+
+/* Called from serverCron(): once every hotkeys-report-period seconds the
+ * currently tracked keys are published as "hotkey" keyspace notifications
+ * (class 'n'), and every counter is halved so that the ranking reflects
+ * recent traffic instead of the whole process lifetime. Entries decayed
+ * to zero are dropped. */
+void hotkeysCron(void) {
+    int j;
+
+    if (server.hotkeys_sample_rate == 0 ||
+        server.hotkeys_report_period == 0 ||
+        hotkeys_used == 0) return;
+    if (server.mstime - hotkeys_last_report <
+        server.hotkeys_report_period*1000) return;
+    hotkeys_last_report = server.mstime;
+
+    qsort(hotkeys_table,hotkeys_used,sizeof(hotkeyEntry),hotkeysEntryCmp);
+    for (j = 0; j < hotkeys_used; j++) {
+        hotkeyEntry *he = hotkeys_table+j;
+        robj *keyobj = createStringObject(he->key,sdslen(he->key));
+        notifyKeyspaceEvent(NOTIFY_HOTKEY,"hotkey",keyobj,he->dbid);
+        decrRefCount(keyobj);
+    }
+
+    /* Decay. The table is sorted, so surviving entries stay compact at
+     * the front when zeroed ones are removed. */
+    int used = hotkeys_used;
+    hotkeys_used = 0;
+    for (j = 0; j < used; j++) {
+        hotkeys_table[j].count /= 2;
+        hotkeys_table[j].error /= 2;
+        if (hotkeys_table[j].count == 0) {
+            sdsfree(hotkeys_table[j].key);
+            continue;
+        }
+        hotkeys_table[hotkeys_used++] = hotkeys_table[j];
+    }
+}
+
+/* Append the "hotkeys" section to an INFO output. */
+sds hotkeysCatInfoString(sds info) {
+    hotkeyEntry sorted[HOTKEYS_TABLE_SIZE];
+    int j;
+
+    memcpy(sorted,hotkeys_table,sizeof(hotkeyEntry)*hotkeys_used);
+    qsort(sorted,hotkeys_used,sizeof(hotkeyEntry),hotkeysEntryCmp);
+    for (j = 0; j < hotkeys_used; j++) {
+        info = sdscatprintf(info,
+            "hotkey_%d:db=%d,key=%s,count=%llu,error=%llu\r\n",
+            j, sorted[j].dbid, sorted[j].key,
+            (unsigned long long) sorted[j].count,
+            (unsigned long long) sorted[j].error);
+    }
+    return info;
+}
+
+/* HOTKEYS [RESET]
+ *
+ * Reply with the currently tracked keys sorted by descending estimated
+ * access count. Every reply element is a key name, the database it
+ * belongs to, the estimated sampled access count and the maximum
+ * overestimation of that count. */
+void hotkeysCommand(client *c) {
+    const char *help[] = {
+"(no subcommand) -- Returns the hottest keys tracked so far.",
+"RESET           -- Resets the tracked keys.",
+"HELP            -- Prints this help.",
+NULL
+    };
+
+    if (c->argc == 1) {
+        hotkeyEntry sorted[HOTKEYS_TABLE_SIZE];
+        int j;
+
+        if (server.hotkeys_sample_rate == 0) {
+            addReplyError(c,"Hot key tracking is disabled. Enable it with: "
+                            "CONFIG SET hotkeys-sample-rate <N>");
+            return;
+        }
+        memcpy(sorted,hotkeys_table,sizeof(hotkeyEntry)*hotkeys_used);
+        qsort(sorted,hotkeys_used,sizeof(hotkeyEntry),hotkeysEntryCmp);
+        addReplyArrayLen(c,hotkeys_used);
+        for (j = 0; j < hotkeys_used; j++) {
+            addReplyArrayLen(c,4);
+            addReplyBulkCBuffer(c,sorted[j].key,sdslen(sorted[j].key));
+            addReplyLongLong(c,sorted[j].dbid);
+            addReplyLongLong(c,sorted[j].count);
+            addReplyLongLong(c,sorted[j].error);
+        }
+    } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"reset")) {
+        hotkeysReset();
+        addReply(c,shared.ok);
+    } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
+        addReplyHelp(c, help);
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
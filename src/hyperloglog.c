@@ -34,6 +34,11 @@
 #include <stdint.h>
 #include <math.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_HLL_AVX2 1
+#include <immintrin.h>
+#endif
+
 /* The Redis HyperLogLog implementation is based on the following ideas:
  *
  * * The use of a 64 bit hash function as proposed in [1], in order to don't
@@ -515,10 +520,131 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     return hllDenseSet(registers,index,count);
 }
 
+/* ================== Dense representation AVX2 kernels ===================== */
+
+#ifdef HAVE_HLL_AVX2
+/* The kernels below are compiled for AVX2 via the target attribute and
+ * selected at runtime, so no special build flags are needed and CPUs
+ * without AVX2 keep using the scalar code. They assume the default
+ * geometry of 16384 registers of 6 bits. */
+static int hllAvx2Supported(void) {
+    static int supported = -1;
+    if (supported == -1) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2");
+    }
+    return supported;
+}
+
+/* Unpack 32 consecutive registers, packed in the 24 bytes at 'r', into
+ * one byte each. Note that 32 bytes are loaded, so the last group of an
+ * HLL must be left to the scalar code not to read past the buffer. */
+__attribute__((target("avx2")))
+static inline __m256i hllDenseUnpack32(const uint8_t *r) {
+    /* Route the three bytes of every group of 4 registers into its own
+     * 32 bit lane: since registers are packed with the LSB first, lane
+     * 'j' then holds the value r0 | r1<<6 | r2<<12 | r3<<18. */
+    const __m256i shuf = _mm256_setr_epi8(
+        0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+        0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+    __m256i x = _mm256_loadu_si256((const __m256i*)r);
+    x = _mm256_permutevar8x32_epi32(x,_mm256_setr_epi32(0,1,2,2,3,4,5,5));
+    x = _mm256_shuffle_epi8(x,shuf);
+    /* Shift every register to the low bits of its destination byte and
+     * mask the neighbors away. */
+    return _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_and_si256(x,_mm256_set1_epi32(0x0000003F)),
+            _mm256_and_si256(_mm256_slli_epi32(x,2),
+                             _mm256_set1_epi32(0x00003F00))),
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_slli_epi32(x,4),
+                             _mm256_set1_epi32(0x003F0000)),
+            _mm256_and_si256(_mm256_slli_epi32(x,6),
+                             _mm256_set1_epi32(0x3F000000))));
+}
+
+/* AVX2 register histogram: registers are unpacked 32 at a time, and
+ * accumulated into four partial histograms so that runs of equal values
+ * don't serialize on the increment of a single counter. */
+__attribute__((target("avx2")))
+static void hllDenseRegHistoAvx2(uint8_t *registers, int *reghisto) {
+    int h0[64] = {0}, h1[64] = {0}, h2[64] = {0}, h3[64] = {0};
+    uint8_t buf[32];
+    uint8_t *r = registers;
+    int j, k;
+
+    for (j = 0; j < HLL_REGISTERS-32; j += 32) {
+        _mm256_storeu_si256((__m256i*)buf,hllDenseUnpack32(r));
+        for (k = 0; k < 32; k += 4) {
+            h0[buf[k]]++;
+            h1[buf[k+1]]++;
+            h2[buf[k+2]]++;
+            h3[buf[k+3]]++;
+        }
+        r += 24;
+    }
+    for (; j < HLL_REGISTERS; j++) {
+        unsigned long reg;
+        HLL_DENSE_GET_REGISTER(reg,registers,j);
+        h0[reg]++;
+    }
+    for (j = 0; j < 64; j++)
+        reghisto[j] += h0[j]+h1[j]+h2[j]+h3[j];
+}
+
+/* AVX2 merge of 'n' dense register arrays into the byte array 'max', in
+ * a single pass over the destination registers. */
+__attribute__((target("avx2")))
+static void hllMergeDenseBatchAvx2(uint8_t *max, uint8_t **regarrays, int n) {
+    int j, s;
+
+    for (j = 0; j < HLL_REGISTERS-32; j += 32) {
+        __m256i m = _mm256_loadu_si256((__m256i*)(max+j));
+        size_t off = (size_t)j/32*24;
+        for (s = 0; s < n; s++)
+            m = _mm256_max_epu8(m,hllDenseUnpack32(regarrays[s]+off));
+        _mm256_storeu_si256((__m256i*)(max+j),m);
+    }
+    for (; j < HLL_REGISTERS; j++) {
+        for (s = 0; s < n; s++) {
+            uint8_t val;
+            HLL_DENSE_GET_REGISTER(val,regarrays[s],j);
+            if (val > max[j]) max[j] = val;
+        }
+    }
+}
+#endif /* HAVE_HLL_AVX2 */
+
+/* Merge the dense register arrays 'regarrays[0..n-1]' into the byte
+ * array 'max' by taking the per register maximum. */
+static void hllMergeDenseBatch(uint8_t *max, uint8_t **regarrays, int n) {
+#ifdef HAVE_HLL_AVX2
+    if (HLL_REGISTERS == 16384 && HLL_BITS == 6 && hllAvx2Supported()) {
+        hllMergeDenseBatchAvx2(max,regarrays,n);
+        return;
+    }
+#endif
+    for (int s = 0; s < n; s++) {
+        for (int j = 0; j < HLL_REGISTERS; j++) {
+            uint8_t val;
+            HLL_DENSE_GET_REGISTER(val,regarrays[s],j);
+            if (val > max[j]) max[j] = val;
+        }
+    }
+}
+
 /* Compute the register histogram in the dense representation. */
 void hllDenseRegHisto(uint8_t *registers, int* reghisto) {
     int j;
 
+#ifdef HAVE_HLL_AVX2
+    if (HLL_REGISTERS == 16384 && HLL_BITS == 6 && hllAvx2Supported()) {
+        hllDenseRegHistoAvx2(registers,reghisto);
+        return;
+    }
+#endif
+
     /* Redis default is to use 16384 registers 6 bits each. The code works
      * with other values by modifying the defines, but for our target value
      * we take a faster path with unrolled loops. */
@@ -1070,12 +1196,8 @@ int hllMerge(uint8_t *max, robj *hll) {
     int i;
 
     if (hdr->encoding == HLL_DENSE) {
-        uint8_t val;
-
-        for (i = 0; i < HLL_REGISTERS; i++) {
-            HLL_DENSE_GET_REGISTER(val,hdr->registers,i);
-            if (val > max[i]) max[i] = val;
-        }
+        uint8_t *regarrays[1] = { hdr->registers };
+        hllMergeDenseBatch(max,regarrays,1);
     } else {
         uint8_t *p = hll->ptr, *end = p + sdslen(hll->ptr);
         long runlen, regval;
@@ -1229,7 +1351,8 @@ void pfcountCommand(client *c) {
      * the cardinality of the merge of the N HLLs specified. */
     if (c->argc > 2) {
         uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
-        int j;
+        uint8_t **dense = zmalloc(sizeof(uint8_t*)*(c->argc-1));
+        int j, ndense = 0;
 
         /* Compute an HLL with M[i] = MAX(M[i]_j). */
         memset(max,0,sizeof(max));
@@ -1240,15 +1363,26 @@ void pfcountCommand(client *c) {
             /* Check type and size. */
             robj *o = lookupKeyRead(c->db,c->argv[j]);
             if (o == NULL) continue; /* Assume empty HLL for non existing var.*/
-            if (isHLLObjectOrReply(c,o) != C_OK) return;
+            if (isHLLObjectOrReply(c,o) != C_OK) {
+                zfree(dense);
+                return;
+            }
 
             /* Merge with this HLL with our 'max' HLL by setting max[i]
-             * to MAX(max[i],hll[i]). */
-            if (hllMerge(registers,o) == C_ERR) {
+             * to MAX(max[i],hll[i]). Dense sources are just collected
+             * here and batched below, to merge them all with a single
+             * pass over the registers. */
+            struct hllhdr *shdr = o->ptr;
+            if (shdr->encoding == HLL_DENSE) {
+                dense[ndense++] = shdr->registers;
+            } else if (hllMerge(registers,o) == C_ERR) {
                 addReplySds(c,sdsnew(invalid_hll_err));
+                zfree(dense);
                 return;
             }
         }
+        if (ndense) hllMergeDenseBatch(registers,dense,ndense);
+        zfree(dense);
 
         /* Compute cardinality of the resulting set. */
         addReplyLongLong(c,hllCount(hdr,NULL));
@@ -1310,8 +1444,9 @@ void pfcountCommand(client *c) {
 /* PFMERGE dest src1 src2 src3 ... srcN => OK */
 void pfmergeCommand(client *c) {
     uint8_t max[HLL_REGISTERS];
+    uint8_t **dense = zmalloc(sizeof(uint8_t*)*(c->argc-1));
     struct hllhdr *hdr;
-    int j;
+    int j, ndense = 0;
     int use_dense = 0; /* Use dense representation as target? */
 
     /* Compute an HLL with M[i] = MAX(M[i]_j).
@@ -1322,7 +1457,10 @@ void pfmergeCommand(client *c) {
         /* Check type and size. */
         robj *o = lookupKeyRead(c->db,c->argv[j]);
         if (o == NULL) continue; /* Assume empty HLL for non existing var. */
-        if (isHLLObjectOrReply(c,o) != C_OK) return;
+        if (isHLLObjectOrReply(c,o) != C_OK) {
+            zfree(dense);
+            return;
+        }
 
         /* If at least one involved HLL is dense, use the dense representation
          * as target ASAP to save time and avoid the conversion step. */
@@ -1330,12 +1468,18 @@ void pfmergeCommand(client *c) {
         if (hdr->encoding == HLL_DENSE) use_dense = 1;
 
         /* Merge with this HLL with our 'max' HLL by setting max[i]
-         * to MAX(max[i],hll[i]). */
-        if (hllMerge(max,o) == C_ERR) {
+         * to MAX(max[i],hll[i]). Dense sources are collected and merged
+         * below in a single pass over the registers. */
+        if (hdr->encoding == HLL_DENSE) {
+            dense[ndense++] = hdr->registers;
+        } else if (hllMerge(max,o) == C_ERR) {
             addReplySds(c,sdsnew(invalid_hll_err));
+            zfree(dense);
             return;
         }
     }
+    if (ndense) hllMergeDenseBatch(max,dense,ndense);
+    zfree(dense);
 
     /* Create / unshare the destination key's value if needed. */
     robj *o = lookupKeyWrite(c->db,c->argv[1]);
@@ -95,7 +95,7 @@ static void _intsetSet(intset *is, int pos, int64_t value) {
 
 /* Create an empty intset. */
 intset *intsetNew(void) {
-    intset *is = zmalloc(sizeof(intset));
+    intset *is = zmalloc_typed(ZMALLOC_TYPE_VALUE,sizeof(intset));
     is->encoding = intrev32ifbe(INTSET_ENC_INT16);
     is->length = 0;
     return is;
@@ -104,17 +104,57 @@ intset *intsetNew(void) {
 /* Resize the intset */
 static intset *intsetResize(intset *is, uint32_t len) {
     uint32_t size = len*intrev32ifbe(is->encoding);
-    is = zrealloc(is,sizeof(intset)+size);
+    is = zrealloc_typed(ZMALLOC_TYPE_VALUE,is,sizeof(intset)+size);
     return is;
 }
 
+/* Number of elements under which the binary search switches to a linear
+ * block scan of the remaining range. */
+#define INTSET_LINEAR_SEARCH 64
+
+/* Count the elements in [start,end) that are smaller than "value", assuming
+ * "value" fits the intset encoding. The comparisons are accumulated without
+ * branching on the result, so each per-encoding loop is just sequential
+ * loads and compares that the compiler can vectorize: this is much faster
+ * than finishing a binary search with dependent random probes. */
+static uint32_t _intsetCountLess(intset *is, uint32_t start, uint32_t end,
+                                 int64_t value)
+{
+    uint32_t count = 0, i;
+    uint32_t encoding = intrev32ifbe(is->encoding);
+
+    if (encoding == INTSET_ENC_INT64) {
+        const int64_t *a = (const int64_t*)is->contents;
+        for (i = start; i < end; i++) {
+            int64_t v = a[i];
+            memrev64ifbe(&v);
+            count += (v < value);
+        }
+    } else if (encoding == INTSET_ENC_INT32) {
+        const int32_t *a = (const int32_t*)is->contents;
+        for (i = start; i < end; i++) {
+            int32_t v = a[i];
+            memrev32ifbe(&v);
+            count += (v < (int32_t)value);
+        }
+    } else {
+        const int16_t *a = (const int16_t*)is->contents;
+        for (i = start; i < end; i++) {
+            int16_t v = a[i];
+            memrev16ifbe(&v);
+            count += (v < (int16_t)value);
+        }
+    }
+    return count;
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
- * where "value" can be inserted. */
+ * where "value" can be inserted. The value is assumed to fit the current
+ * encoding of the intset: all the callers check or upgrade it first. */
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    int min = 0, max = intrev32ifbe(is->length)-1;
 
     /* The value can never be found when the set is empty */
     if (intrev32ifbe(is->length) == 0) {
@@ -132,20 +172,19 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
-    while(max >= min) {
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-        cur = _intsetGet(is,mid);
-        if (value > cur) {
+    /* Binary search until the candidate range is small, then resolve it
+     * with a single linear block scan. */
+    while(max - min >= INTSET_LINEAR_SEARCH) {
+        int mid = ((unsigned int)min + (unsigned int)max) >> 1;
+        if (value > _intsetGet(is,mid))
             min = mid+1;
-        } else if (value < cur) {
-            max = mid-1;
-        } else {
-            break;
-        }
+        else
+            max = mid;
     }
 
-    if (value == cur) {
-        if (pos) *pos = mid;
+    min += _intsetCountLess(is,min,max+1,value);
+    if (min <= max && value == _intsetGet(is,min)) {
+        if (pos) *pos = min;
         return 1;
     } else {
         if (pos) *pos = min;
@@ -256,6 +295,70 @@ uint8_t intsetFind(intset *is, int64_t value) {
     return valenc <= intrev32ifbe(is->encoding) && intsetSearch(is,value,NULL);
 }
 
+/* Return a newly allocated intset with the elements common to 'a' and 'b'.
+ *
+ * Both sets are sorted, so instead of probing every element of the smaller
+ * set into the bigger one with independent binary searches, we merge them:
+ * the smaller set is scanned sequentially and the position in the bigger
+ * set only moves forward, galloping (doubling the step) to skip runs with
+ * no matches and backtracking with a binary search within the last step.
+ * This makes the intersection of large sets a mostly sequential scan, and
+ * degrades gracefully to O(N*log(M)) when the sizes are very different. */
+intset *intsetInter(intset *a, intset *b) {
+    uint32_t alen, blen, i = 0, j = 0, found = 0;
+    intset *res;
+
+    /* Scan the smaller set, gallop into the bigger one. */
+    if (intrev32ifbe(a->length) > intrev32ifbe(b->length)) {
+        intset *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    alen = intrev32ifbe(a->length);
+    blen = intrev32ifbe(b->length);
+
+    /* Common elements fit the smaller of the two encodings. The result is
+     * sized for the worst case and trimmed once the cardinality is known. */
+    res = intsetNew();
+    res->encoding = intrev32ifbe(
+        intrev32ifbe(a->encoding) < intrev32ifbe(b->encoding) ?
+        intrev32ifbe(a->encoding) : intrev32ifbe(b->encoding));
+    res = intsetResize(res,alen);
+
+    while (i < alen && j < blen) {
+        int64_t av = _intsetGet(a,i);
+
+        /* Gallop forward in 'b' until the step overshoots 'av'... */
+        uint32_t step = 1, lo = j, hi;
+        while (j+step < blen && _intsetGet(b,j+step) < av) {
+            lo = j+step;
+            step <<= 1;
+        }
+        hi = (j+step < blen) ? j+step : blen-1;
+
+        /* ...then binary search the first element >= 'av' in (lo,hi]. */
+        while (lo < hi) {
+            uint32_t mid = (lo+hi) >> 1;
+            if (_intsetGet(b,mid) < av)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        j = lo;
+        if (_intsetGet(b,j) == av) {
+            _intsetSet(res,found++,av);
+            j++;
+        } else if (_intsetGet(b,j) < av) {
+            break; /* Tail of 'b' exhausted, no more matches possible. */
+        }
+        i++;
+    }
+
+    res = intsetResize(res,found);
+    res->length = intrev32ifbe(found);
+    return res;
+}
+
 /* Return random member */
 int64_t intsetRandom(intset *is) {
     return _intsetGet(is,rand()%intrev32ifbe(is->length));
@@ -281,6 +384,34 @@ size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
 }
 
+/* Validate the integrity of a serialized intset of 'size' bytes, so that
+ * it can be adopted as is from an untrusted source (a RESTORE payload).
+ * The header checks are constant time; when 'deep' is non zero the
+ * elements are also scanned to verify they are sorted and unique, as the
+ * binary search of intsetFind() expects. Returns 1 if the intset is
+ * valid, 0 otherwise. */
+int intsetValidateIntegrity(const unsigned char *p, size_t size, int deep) {
+    intset *is = (intset*)p;
+
+    /* Must be long enough to hold the header. */
+    if (size < sizeof(*is)) return 0;
+
+    /* The encoding must be one of the known ones, and the announced
+     * number of elements must match the buffer size exactly. */
+    uint32_t encoding = intrev32ifbe(is->encoding);
+    if (encoding != INTSET_ENC_INT16 && encoding != INTSET_ENC_INT32 &&
+        encoding != INTSET_ENC_INT64) return 0;
+    uint32_t len = intrev32ifbe(is->length);
+    if (size != sizeof(*is) + (size_t)len*encoding) return 0;
+
+    if (!deep) return 1;
+
+    /* Check that the elements are sorted and have no duplicates. */
+    for (uint32_t i = 1; i < len; i++)
+        if (_intsetGet(is,i-1) >= _intsetGet(is,i)) return 0;
+    return 1;
+}
+
 #ifdef REDIS_TEST
 #include <sys/time.h>
 #include <time.h>
@@ -471,6 +602,48 @@ int intsetTest(int argc, char **argv) {
                num,size,usec()-start);
     }
 
+    printf("Intersection: "); {
+        intset *a, *b, *res;
+        int i;
+
+        /* Intersect two random sets and check the result against
+         * per-element lookups in both operands. */
+        a = createSet(16,1024);
+        b = createSet(16,128);
+        res = intsetInter(a,b);
+        checkConsistency(res);
+        for (i = 0; i < (int)intrev32ifbe(res->length); i++) {
+            int64_t v = _intsetGet(res,i);
+            assert(intsetFind(a,v));
+            assert(intsetFind(b,v));
+        }
+        for (i = 0; i < (int)intrev32ifbe(b->length); i++) {
+            int64_t v = _intsetGet(b,i);
+            assert(intsetFind(a,v) == intsetFind(res,v));
+        }
+        zfree(res);
+
+        /* Mixed encodings: the common values fit the small one. */
+        a = intsetNew();
+        b = intsetNew();
+        a = intsetAdd(a,10,NULL);
+        a = intsetAdd(a,20,NULL);
+        a = intsetAdd(a,30,NULL);
+        b = intsetAdd(b,20,NULL);
+        b = intsetAdd(b,4294967295,NULL);
+        res = intsetInter(a,b);
+        assert(intrev32ifbe(res->length) == 1);
+        assert(intrev32ifbe(res->encoding) == INTSET_ENC_INT16);
+        assert(intsetFind(res,20));
+        zfree(res);
+
+        /* Empty operands. */
+        res = intsetInter(a,intsetNew());
+        assert(intrev32ifbe(res->length) == 0);
+        zfree(res);
+        ok();
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
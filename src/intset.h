@@ -42,10 +42,12 @@ intset *intsetNew(void);
 intset *intsetAdd(intset *is, int64_t value, uint8_t *success);
 intset *intsetRemove(intset *is, int64_t value, int *success);
 uint8_t intsetFind(intset *is, int64_t value);
+intset *intsetInter(intset *a, intset *b);
 int64_t intsetRandom(intset *is);
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);
 uint32_t intsetLen(const intset *is);
 size_t intsetBlobLen(intset *is);
+int intsetValidateIntegrity(const unsigned char *p, size_t size, int deep);
 
 #ifdef REDIS_TEST
 int intsetTest(int argc, char *argv[]);
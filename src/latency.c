@@ -34,6 +34,7 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 
 /* Dictionary type for latency events. */
 int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
@@ -91,6 +92,26 @@ void latencyMonitorInit(void) {
     server.latency_events = dictCreate(&latencyTimeSeriesDictType,NULL);
 }
 
+/* Merge a sample into the tier ring with buckets of 'res' seconds and
+ * 'len' slots. A bucket is addressed by its start time modulo the ring
+ * length: when the stored start time does not match, the slot holds a
+ * stale bucket that aged out and is overwritten. Writing every tier
+ * directly on each sample gives the same result of cascading expired
+ * high-res buckets into the coarser rings, at the same fixed cost. */
+static void latencyTierAdd(struct latencySample *ring, int len, int res,
+                           time_t now, mstime_t latency)
+{
+    time_t bucket = now - (now % res);
+    int slot = (bucket / res) % len;
+
+    if (ring[slot].time != bucket) {
+        ring[slot].time = bucket;
+        ring[slot].latency = latency;
+    } else if ((uint32_t)latency > ring[slot].latency) {
+        ring[slot].latency = latency;
+    }
+}
+
 /* Add the specified sample to the specified time series "event".
  * This function is usually called via latencyAddSampleIfNeeded(), that
  * is a macro that only adds the sample if the latency is higher than
@@ -106,11 +127,21 @@ void latencyAddSample(const char *event, mstime_t latency) {
         ts->idx = 0;
         ts->max = 0;
         memset(ts->samples,0,sizeof(ts->samples));
+        memset(ts->tier0,0,sizeof(ts->tier0));
+        memset(ts->tier1,0,sizeof(ts->tier1));
+        memset(ts->tier2,0,sizeof(ts->tier2));
         dictAdd(server.latency_events,zstrdup(event),ts);
     }
 
     if (latency > ts->max) ts->max = latency;
 
+    /* Update the tiered history before the same-second check below: the
+     * coarser buckets aggregate multiple seconds and must see every
+     * sample. */
+    latencyTierAdd(ts->tier0,LATENCY_TIER0_LEN,LATENCY_TIER0_RES,now,latency);
+    latencyTierAdd(ts->tier1,LATENCY_TIER1_LEN,LATENCY_TIER1_RES,now,latency);
+    latencyTierAdd(ts->tier2,LATENCY_TIER2_LEN,LATENCY_TIER2_RES,now,latency);
+
     /* If the previous sample is in the same second, we update our old sample
      * if this latency is > of the old one, or just return. */
     prev = (ts->idx + LATENCY_TS_LEN - 1) % LATENCY_TS_LEN;
@@ -491,6 +522,43 @@ void latencyCommandReplyWithSamples(client *c, struct latencyTimeSeries *ts) {
     setDeferredArrayLen(c,replylen,samples);
 }
 
+/* latencyCommand() helper for LATENCY HISTORY with a time range: reply
+ * with the (time,latency) pairs of the tiered history falling inside
+ * [from,to]. The finest tier whose retention still covers 'from' is
+ * selected, so recent ranges are returned at one second resolution while
+ * ranges reaching back hours degrade to ten seconds or five minutes
+ * buckets. Slots are emitted in chronological order. */
+void latencyCommandReplyWithRange(client *c, struct latencyTimeSeries *ts,
+                                  time_t from, time_t to)
+{
+    struct latencySample *ring;
+    int len, res, j, samples = 0;
+    time_t now = time(NULL);
+    void *replylen = addReplyDeferredLen(c);
+
+    if (from >= now-(time_t)LATENCY_TIER0_LEN*LATENCY_TIER0_RES) {
+        ring = ts->tier0; len = LATENCY_TIER0_LEN; res = LATENCY_TIER0_RES;
+    } else if (from >= now-(time_t)LATENCY_TIER1_LEN*LATENCY_TIER1_RES) {
+        ring = ts->tier1; len = LATENCY_TIER1_LEN; res = LATENCY_TIER1_RES;
+    } else {
+        ring = ts->tier2; len = LATENCY_TIER2_LEN; res = LATENCY_TIER2_RES;
+    }
+
+    /* Walk the ring starting at the oldest possible bucket: the slot
+     * after the one addressed by the current time. */
+    for (j = 1; j <= len; j++) {
+        int i = (now/res+j) % len;
+
+        if (ring[i].time == 0) continue;
+        if (ring[i].time < from || ring[i].time > to) continue;
+        addReplyArrayLen(c,2);
+        addReplyLongLong(c,ring[i].time);
+        addReplyLongLong(c,ring[i].latency);
+        samples++;
+    }
+    setDeferredArrayLen(c,replylen,samples);
+}
+
 /* latencyCommand() helper to produce the reply for the LATEST subcommand,
  * listing the last latency sample for every event type registered so far. */
 void latencyCommandReplyWithLatestEvents(client *c) {
@@ -558,19 +626,164 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
     return graph;
 }
 
+/* ---------------------- Per command latency histograms -------------------
+ *
+ * Unlike the event based latency monitor above, that only records samples
+ * crossing the configured threshold, every command execution is recorded
+ * into a per command log-linear histogram, so that accurate percentiles
+ * can be computed at any time without external sampling. Recording a
+ * sample costs one index computation and one relaxed atomic increment,
+ * which keeps the histograms safe when commands execute on I/O threads. */
+
+/* Return the histogram bucket index for a latency of 'usec' microseconds. */
+static inline int latencyHistogramIndex(uint64_t usec) {
+    int msb;
+
+    if (usec < (1<<LATENCY_HIST_SUB_BITS)) return usec;
+    if (usec >= (1ULL<<(LATENCY_HIST_MAX_MSB+1)))
+        usec = (1ULL<<(LATENCY_HIST_MAX_MSB+1))-1;
+#if defined(__GNUC__)
+    msb = 63 - __builtin_clzll(usec);
+#else
+    msb = LATENCY_HIST_SUB_BITS;
+    while (usec >> (msb+1)) msb++;
+#endif
+    return ((msb-LATENCY_HIST_SUB_BITS+1)<<LATENCY_HIST_SUB_BITS) +
+           ((usec >> (msb-LATENCY_HIST_SUB_BITS)) &
+            ((1<<LATENCY_HIST_SUB_BITS)-1));
+}
+
+/* Return the lowest latency value falling into the given bucket, that is
+ * the inverse of latencyHistogramIndex(). */
+static uint64_t latencyHistogramBucketMin(int idx) {
+    int msb, sub;
+
+    if (idx < (1<<LATENCY_HIST_SUB_BITS)) return idx;
+    msb = (idx>>LATENCY_HIST_SUB_BITS)+LATENCY_HIST_SUB_BITS-1;
+    sub = idx & ((1<<LATENCY_HIST_SUB_BITS)-1);
+    return (1ULL<<msb) | ((uint64_t)sub << (msb-LATENCY_HIST_SUB_BITS));
+}
+
+/* Record the execution time of a command. Called by call() for every
+ * command executed, possibly from an I/O thread. */
+void latencyHistogramRecord(struct redisCommand *cmd, uint64_t usec) {
+    atomicIncr(cmd->latency_histogram[latencyHistogramIndex(usec)],1);
+}
+
+/* Return the latency at the given percentile (0 < p <= 100) out of the
+ * histogram, reported with the precision of the bucket it falls into. */
+static uint64_t latencyHistogramPercentile(uint64_t *h, uint64_t total,
+                                           double p)
+{
+    uint64_t rank = (uint64_t)(total*p/100.0+0.5);
+    uint64_t seen = 0;
+    int j;
+
+    if (rank == 0) rank = 1;
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        seen += h[j];
+        if (seen >= rank) return latencyHistogramBucketMin(j);
+    }
+    return 0;
+}
+
+/* latencyCommand() helper to reply with the histogram of a single command,
+ * as a map with the number of recorded calls, a few precomputed
+ * percentiles, and the raw cumulative distribution, where each entry maps
+ * the lower bound of a bucket to the number of calls that took up to (and
+ * including) that bucket. */
+void latencyCommandReplyWithHistogram(client *c, struct redisCommand *cmd) {
+    uint64_t snapshot[LATENCY_HIST_BUCKETS];
+    uint64_t total = 0, cumulative = 0;
+    int j, nonempty = 0;
+
+    /* Take a snapshot of the histogram: I/O threads may keep recording
+     * samples while we build the reply, and the bucket counts must be
+     * consistent with the emitted map length. */
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        atomicGet(cmd->latency_histogram[j],snapshot[j]);
+        total += snapshot[j];
+        if (snapshot[j]) nonempty++;
+    }
+
+    addReplyBulkCString(c,cmd->name);
+    addReplyMapLen(c,5);
+    addReplyBulkCString(c,"calls");
+    addReplyLongLong(c,total);
+    addReplyBulkCString(c,"p50");
+    addReplyLongLong(c,latencyHistogramPercentile(snapshot,total,50));
+    addReplyBulkCString(c,"p99");
+    addReplyLongLong(c,latencyHistogramPercentile(snapshot,total,99));
+    addReplyBulkCString(c,"p99.9");
+    addReplyLongLong(c,latencyHistogramPercentile(snapshot,total,99.9));
+    addReplyBulkCString(c,"histogram_usec");
+    addReplyMapLen(c,nonempty);
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        if (snapshot[j] == 0) continue;
+        cumulative += snapshot[j];
+        addReplyLongLong(c,latencyHistogramBucketMin(j));
+        addReplyLongLong(c,cumulative);
+    }
+}
+
+/* LATENCY HISTOGRAM [command ...]: reply with the latency histogram of
+ * the specified commands, or of every command called at least once when
+ * no name is given. */
+void latencyCommandHistogram(client *c) {
+    if (c->argc > 2) {
+        int j;
+
+        /* Check every name before emitting any reply data. */
+        for (j = 2; j < c->argc; j++) {
+            if (dictFetchValue(server.commands,c->argv[j]->ptr) == NULL) {
+                addReplyErrorFormat(c,"Unknown command '%s'",
+                    (char*)c->argv[j]->ptr);
+                return;
+            }
+        }
+        addReplyMapLen(c,c->argc-2);
+        for (j = 2; j < c->argc; j++) {
+            latencyCommandReplyWithHistogram(c,
+                dictFetchValue(server.commands,c->argv[j]->ptr));
+        }
+    } else {
+        dictIterator *di = dictGetIterator(server.commands);
+        dictEntry *de;
+        void *replylen = addReplyDeferredLen(c);
+        int numcmds = 0;
+
+        while ((de = dictNext(di)) != NULL) {
+            struct redisCommand *cmd = dictGetVal(de);
+            if (cmd->calls == 0) continue;
+            latencyCommandReplyWithHistogram(c,cmd);
+            numcmds++;
+        }
+        dictReleaseIterator(di);
+        setDeferredMapLen(c,replylen,numcmds);
+    }
+}
+
 /* LATENCY command implementations.
  *
- * LATENCY HISTORY: return time-latency samples for the specified event.
+ * LATENCY HISTORY: return time-latency samples for the specified event,
+ *                  or the tiered bucket history when a range is given.
  * LATENCY LATEST: return the latest latency for all the events classes.
  * LATENCY DOCTOR: returns a human readable analysis of instance latency.
  * LATENCY GRAPH: provide an ASCII graph of the latency of the specified event.
+ * LATENCY HISTOGRAM: return per command execution time histograms.
  * LATENCY RESET: reset data of a specified event or all the data if no event provided.
  */
 void latencyCommand(client *c) {
     const char *help[] = {
 "DOCTOR              -- Returns a human readable latency analysis report.",
 "GRAPH   <event>     -- Returns an ASCII latency graph for the event class.",
+"HISTOGRAM [command ...] -- Returns the execution time histogram of the",
+"                       specified commands (default: all called commands).",
 "HISTORY <event>     -- Returns time-latency samples for the event class.",
+"HISTORY <event> <from> <to> -- Returns the bucketized history of the event",
+"                       class between the two unix times, using 1 sec, 10",
+"                       secs or 5 mins buckets depending on how far back",
+"                       <from> reaches (0 as <to> means now).",
 "LATEST              -- Returns the latest latency samples for all events.",
 "RESET   [event ...] -- Resets latency data of one or more event classes.",
 "                       (default: reset all data for all event classes)",
@@ -587,6 +800,20 @@ NULL
         } else {
             latencyCommandReplyWithSamples(c,ts);
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"history") && c->argc == 5) {
+        /* LATENCY HISTORY <event> <from> <to> */
+        long long from, to;
+
+        if (getLongLongFromObjectOrReply(c,c->argv[3],&from,NULL) != C_OK ||
+            getLongLongFromObjectOrReply(c,c->argv[4],&to,NULL) != C_OK)
+            return;
+        if (to == 0) to = time(NULL);
+        ts = dictFetchValue(server.latency_events,c->argv[2]->ptr);
+        if (ts == NULL) {
+            addReplyArrayLen(c,0);
+        } else {
+            latencyCommandReplyWithRange(c,ts,from,to);
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"graph") && c->argc == 3) {
         /* LATENCY GRAPH <event> */
         sds graph;
@@ -601,6 +828,9 @@ NULL
         graph = latencyCommandGenSparkeline(event,ts);
         addReplyVerbatim(c,graph,sdslen(graph),"txt");
         sdsfree(graph);
+    } else if (!strcasecmp(c->argv[1]->ptr,"histogram") && c->argc >= 2) {
+        /* LATENCY HISTOGRAM [command ...] */
+        latencyCommandHistogram(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"latest") && c->argc == 2) {
         /* LATENCY LATEST */
         latencyCommandReplyWithLatestEvents(c);
@@ -43,11 +43,29 @@ struct latencySample {
     uint32_t latency; /* Latency in milliseconds. */
 };
 
+/* Tiered history rings. On top of the classic samples[] ring, that holds
+ * one slot per event occurrence, every event keeps three fixed size rings
+ * of time buckets at decreasing resolution: five minutes of one second
+ * buckets, one hour of ten seconds buckets and one day of five minutes
+ * buckets. Each bucket stores the worst latency observed in its interval,
+ * so long-running collectors can fetch hours of history in a single
+ * LATENCY HISTORY call instead of polling every second. Memory is fixed
+ * (about 8KB per event) and updating a bucket is a single array write. */
+#define LATENCY_TIER0_RES 1     /* Seconds per bucket of each tier... */
+#define LATENCY_TIER1_RES 10
+#define LATENCY_TIER2_RES 300
+#define LATENCY_TIER0_LEN 300   /* ... and number of buckets retained. */
+#define LATENCY_TIER1_LEN 360
+#define LATENCY_TIER2_LEN 288
+
 /* The latency time series for a given event. */
 struct latencyTimeSeries {
     int idx; /* Index of the next sample to store. */
     uint32_t max; /* Max latency observed for this event. */
     struct latencySample samples[LATENCY_TS_LEN]; /* Latest history. */
+    struct latencySample tier0[LATENCY_TIER0_LEN]; /* 1s buckets, 5 min. */
+    struct latencySample tier1[LATENCY_TIER1_LEN]; /* 10s buckets, 1 hour. */
+    struct latencySample tier2[LATENCY_TIER2_LEN]; /* 5min buckets, 1 day. */
 };
 
 /* Latency statistics structure. */
@@ -65,6 +83,21 @@ void latencyMonitorInit(void);
 void latencyAddSample(const char *event, mstime_t latency);
 int THPIsEnabled(void);
 
+/* Per command latency histograms.
+ *
+ * Every command carries a log-linear histogram of its execution times in
+ * microseconds: values below 2^LATENCY_HIST_SUB_BITS are recorded exactly,
+ * then each power of two is split into 2^LATENCY_HIST_SUB_BITS linear sub
+ * buckets (about 6% relative precision). Values are capped at
+ * 2^(LATENCY_HIST_MAX_MSB+1)-1 microseconds, roughly 35 minutes. */
+#define LATENCY_HIST_SUB_BITS 4
+#define LATENCY_HIST_MAX_MSB 30
+#define LATENCY_HIST_BUCKETS \
+    ((LATENCY_HIST_MAX_MSB-LATENCY_HIST_SUB_BITS+2)<<LATENCY_HIST_SUB_BITS)
+
+struct redisCommand;
+void latencyHistogramRecord(struct redisCommand *cmd, uint64_t usec);
+
 /* Latency monitoring macros. */
 
 /* Start monitoring an event. We just set the current time. */
@@ -6,6 +6,11 @@
 static size_t lazyfree_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+void lazyfreeFreeObjectFromBioThread(void *arg1, void *arg2, void *arg3);
+void lazyfreeFreeDatabaseFromBioThread(void *arg1, void *arg2, void *arg3);
+void lazyfreeFreeSlotsMapFromBioThread(void *arg1, void *arg2, void *arg3);
+void lazyfreeFreeDictShardFromBioThread(void *arg1, void *arg2, void *arg3);
+
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
     size_t aux;
@@ -29,7 +34,14 @@ size_t lazyfreeGetPendingObjectsCount(void) {
  * For lists the function returns the number of elements in the quicklist
  * representing the list. */
 size_t lazyfreeGetFreeEffort(robj *obj) {
-    if (obj->type == OBJ_LIST) {
+    if (obj->encoding == OBJ_ENCODING_LAZY) {
+        /* Not yet materialized: freeing it just drops a reference on the
+         * file mapping, whatever the logical type is. */
+        return 1;
+    } else if (obj->encoding == OBJ_ENCODING_COLD) {
+        /* Demoted to the cold tier: the stub is a few dozen bytes. */
+        return 1;
+    } else if (obj->type == OBJ_LIST) {
         quicklist *ql = obj->ptr;
         return ql->len;
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
@@ -46,24 +58,110 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     }
 }
 
+/* Number of allocations under which freeing an object in the background
+ * is just slower than freeing it on the spot. */
+#define LAZYFREE_THRESHOLD 64
+
+/* Objects more expensive than this are queued in the bio.c low priority
+ * lazy free queue, so that under eviction pressure the stream of small
+ * frees is not delayed by the release of a single huge object. */
+#define LAZYFREE_LARGE_THRESHOLD (1024*16)
+
+/* Hash table backed objects more expensive than this are split in bucket
+ * ranges released in parallel by all the lazy free workers, when more
+ * than one is configured. */
+#define LAZYFREE_SHARDED_THRESHOLD (1024*1024)
+
+/* Context shared by the bio.c jobs cooperating to release a single huge
+ * dictionary: each job frees a disjoint range of buckets, and the one
+ * observing the shards counter reaching zero disposes of the remains. */
+typedef struct lazyfreeShardedDict {
+    dict *d;            /* The orphaned dictionary being released. */
+    robj *o;            /* The owning object, freed with the last shard. */
+    size_t numele;      /* Elements accounted in lazyfree_objects. */
+    int pending;        /* Shards still to process. */
+    pthread_mutex_t pending_mutex; /* Only used by the atomicvar mutex
+                                      fallback, see atomicvar.h. */
+} lazyfreeShardedDict;
+
+struct lazyfreeDictShard {
+    lazyfreeShardedDict *owner;
+    unsigned long start, end;   /* Bucket range [start,end) to free. */
+};
+
+/* Split the dictionary backing 'o' (an OBJ_ENCODING_HT set or hash with
+ * refcount 1, already unlinked from the keyspace) into one bucket range
+ * per lazy free worker, and queue a job for each of them. */
+static void lazyfreeShardedDictFree(robj *o) {
+    dict *d = o->ptr;
+    int shards = server.lazyfree_threads;
+    unsigned long size = d->ht[0].size > d->ht[1].size ? d->ht[0].size :
+                                                         d->ht[1].size;
+    unsigned long per = (size+shards-1) / shards;
+    lazyfreeShardedDict *ctx = zmalloc(sizeof(*ctx));
+
+    ctx->d = d;
+    ctx->o = o;
+    ctx->numele = dictSize(d);
+    ctx->pending = shards;
+    pthread_mutex_init(&ctx->pending_mutex,NULL);
+    atomicIncr(lazyfree_objects,ctx->numele);
+    for (int i = 0; i < shards; i++) {
+        struct lazyfreeDictShard *shard = zmalloc(sizeof(*shard));
+        shard->owner = ctx;
+        shard->start = per * i;
+        shard->end = shard->start+per < size ? shard->start+per : size;
+        bioCreateLazyFreeJob(lazyfreeFreeDictShardFromBioThread,1,
+                             shard,NULL,NULL);
+    }
+}
+
+/* Hand 'o' over to the lazy free workers. 'free_effort' is the value
+ * returned by lazyfreeGetFreeEffort() for it: the caller already checked
+ * it is above LAZYFREE_THRESHOLD and that the object is not shared. */
+static void lazyfreeEnqueueObject(robj *o, size_t free_effort) {
+    /* Huge sets and hashes can be released by all the workers together:
+     * their entries hang off independent hash buckets. Lists and sorted
+     * sets have no similar natural partition, so they are freed by a
+     * single worker like any other object, just at low priority. */
+    if (server.lazyfree_threads > 1 &&
+        free_effort > LAZYFREE_SHARDED_THRESHOLD &&
+        (o->type == OBJ_SET || o->type == OBJ_HASH) &&
+        o->encoding == OBJ_ENCODING_HT)
+    {
+        lazyfreeShardedDictFree(o);
+        return;
+    }
+    atomicIncr(lazyfree_objects,1);
+    bioCreateLazyFreeJob(lazyfreeFreeObjectFromBioThread,
+                         free_effort > LAZYFREE_LARGE_THRESHOLD,o,NULL,NULL);
+}
+
 /* Delete a key, value, and associated expiration entry if any, from the DB.
  * If there are enough allocations to free the value object may be put into
  * a lazy free list instead of being freed synchronously. The lazy free list
  * will be reclaimed in a different bio.c thread. */
-#define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
+    /* See the twin calls in dbSyncDelete(). */
+    replyCacheInvalidate(db,key);
+    scanSessionInvalidateKey(db,key);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    dbDeleteExpire(db,key->ptr);
+    hashExpiresDelete(db,key->ptr);
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
      * the object synchronously. */
-    dictEntry *de = dictUnlink(db->dict,key->ptr);
+    dict *d = dbGetDict(db,key->ptr);
+    dictEntry *de = dictUnlink(d,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
         size_t free_effort = lazyfreeGetFreeEffort(val);
 
+        db->type_count[val->type]--;
+
         /* If releasing the object is too much work, do it in the background
          * by adding the object to the lazy free list.
          * Note that if the object is shared, to reclaim it now it is not
@@ -73,16 +171,15 @@ int dbAsyncDelete(redisDb *db, robj *key) {
          * through and reach the dictFreeUnlinkedEntry() call, that will be
          * equivalent to just calling decrRefCount(). */
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
-            atomicIncr(lazyfree_objects,1);
-            bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
-            dictSetVal(db->dict,de,NULL);
+            lazyfreeEnqueueObject(val,free_effort);
+            dictSetVal(d,de,NULL);
         }
     }
 
     /* Release the key-val pair, or just the key if we set the val
      * field to NULL in order to lazy free it later. */
     if (de) {
-        dictFreeUnlinkedEntry(db->dict,de);
+        dictFreeUnlinkedEntry(d,de);
         if (server.cluster_enabled) slotToKeyDel(key);
         return 1;
     } else {
@@ -94,8 +191,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
 void freeObjAsync(robj *o) {
     size_t free_effort = lazyfreeGetFreeEffort(o);
     if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
-        atomicIncr(lazyfree_objects,1);
-        bioCreateBackgroundJob(BIO_LAZY_FREE,o,NULL,NULL);
+        lazyfreeEnqueueObject(o,free_effort);
     } else {
         decrRefCount(o);
     }
@@ -105,48 +201,84 @@ void freeObjAsync(robj *o) {
  * create a new empty set of hash tables and scheduling the old ones for
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
-    dict *oldht1 = db->dict, *oldht2 = db->expires;
-    db->dict = dictCreate(&dbDictType,NULL);
+    dict *oldht2 = db->expires;
+    rax *oldidx = db->expires_index;
     db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
-}
-
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one
- * and scheduiling the old for lazy freeing. */
-void slotToKeyFlushAsync(void) {
-    rax *old = server.cluster->slots_to_keys;
-
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-    atomicIncr(lazyfree_objects,old->numele);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
+    db->expires_index = raxNew();
+    for (int i = 0; i < server.db_dict_shards; i++) {
+        dict *oldht1 = db->dict[i];
+        db->dict[i] = dictCreate(&dbDictType,NULL);
+        atomicIncr(lazyfree_objects,dictSize(oldht1));
+        /* Flushing a whole database is never urgent: queue it at low
+         * priority so eviction driven frees keep being served. */
+        bioCreateLazyFreeJob(lazyfreeFreeDatabaseFromBioThread,1,oldht1,
+                             i == 0 ? oldht2 : NULL,NULL);
+    }
+    if (raxSize(oldidx) > 0) {
+        atomicIncr(lazyfree_objects,raxSize(oldidx));
+        bioCreateLazyFreeJob(lazyfreeFreeSlotsMapFromBioThread,1,
+                             oldidx,NULL,NULL);
+    } else {
+        raxFree(oldidx);
+    }
 }
 
 /* Release objects from the lazyfree thread. It's just decrRefCount()
  * updating the count of objects to release. */
-void lazyfreeFreeObjectFromBioThread(robj *o) {
+void lazyfreeFreeObjectFromBioThread(void *arg1, void *arg2, void *arg3) {
+    robj *o = arg1;
+    UNUSED(arg2);
+    UNUSED(arg3);
     decrRefCount(o);
     atomicDecr(lazyfree_objects,1);
 }
 
-/* Release a database from the lazyfree thread. The 'db' pointer is the
- * database which was substitutied with a fresh one in the main thread
- * when the database was logically deleted. 'sl' is a skiplist used by
- * Redis Cluster in order to take the hash slots -> keys mapping. This
- * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
+/* Release a database from the lazyfree thread. 'arg1' is one of the
+ * keyspace hash tables which were substituted with fresh ones in the
+ * main thread when the database was logically deleted. 'arg2' is the
+ * expires dictionary: when the keyspace is sharded it is only attached
+ * to the job freeing the first shard, and is NULL otherwise. */
+void lazyfreeFreeDatabaseFromBioThread(void *arg1, void *arg2, void *arg3) {
+    dict *ht1 = arg1, *ht2 = arg2;
+    UNUSED(arg3);
     size_t numkeys = dictSize(ht1);
     dictRelease(ht1);
-    dictRelease(ht2);
+    if (ht2) dictRelease(ht2);
     atomicDecr(lazyfree_objects,numkeys);
 }
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
+/* Release the radix tree mapping Redis Cluster keys to slots in the
  * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
+void lazyfreeFreeSlotsMapFromBioThread(void *arg1, void *arg2, void *arg3) {
+    rax *rt = arg1;
+    UNUSED(arg2);
+    UNUSED(arg3);
     size_t len = rt->numele;
     raxFree(rt);
     atomicDecr(lazyfree_objects,len);
 }
+
+/* Release one bucket range of a huge dictionary split by
+ * lazyfreeShardedDictFree(). The worker processing the last range also
+ * frees the dictionary remains and the owning object. */
+void lazyfreeFreeDictShardFromBioThread(void *arg1, void *arg2, void *arg3) {
+    struct lazyfreeDictShard *shard = arg1;
+    lazyfreeShardedDict *ctx = shard->owner;
+    UNUSED(arg2);
+    UNUSED(arg3);
+    int oldpending;
+
+    dictFreeBucketRange(ctx->d,shard->start,shard->end);
+    zfree(shard);
+    atomicGetIncr(ctx->pending,oldpending,-1);
+    if (oldpending == 1) {
+        /* All the entries are gone: release the bucket arrays and the
+         * object envelope directly. Going through decrRefCount() would
+         * walk the (now dangling) entries again. */
+        dictReleaseTables(ctx->d);
+        zfree(ctx->o);
+        atomicDecr(lazyfree_objects,ctx->numele);
+        pthread_mutex_destroy(&ctx->pending_mutex);
+        zfree(ctx);
+    }
+}
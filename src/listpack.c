@@ -217,6 +217,18 @@ void lpFree(unsigned char *lp) {
     lp_free(lp);
 }
 
+/* Grow the allocation of 'lp' (not its content) to at least 'capacity'
+ * bytes: following inserts are then served from the allocation slack
+ * instead of growing the listpack one reallocation at a time. Useful when
+ * the final size of the listpack is known in advance, as for the stream
+ * macro nodes that fill up to a configured size. */
+unsigned char *lpPrealloc(unsigned char *lp, size_t capacity) {
+    if (capacity > UINT32_MAX) capacity = UINT32_MAX;
+    if (lp_malloc_size(lp) >= capacity) return lp;
+    unsigned char *newlp = lp_realloc(lp,capacity);
+    return newlp ? newlp : lp;
+}
+
 /* Given an element 'ele' of size 'size', determine if the element can be
  * represented inside the listpack encoded as integer, and returns
  * LP_ENCODING_INT if so. Otherwise returns LP_ENCODING_STR if no integer
@@ -655,8 +667,12 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
 
     unsigned char *dst = lp + poff; /* May be updated after reallocation. */
 
-    /* Realloc before: we need more room. */
-    if (new_listpack_bytes > old_listpack_bytes) {
+    /* Realloc before: we need more room. Note that the allocation may
+     * already be larger than the listpack content when lpPrealloc() was
+     * used: in that case the insert is served from the existing slack. */
+    if (new_listpack_bytes > old_listpack_bytes &&
+        new_listpack_bytes > lp_malloc_size(lp))
+    {
         if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
         dst = lp + poff;
     }
@@ -739,6 +755,17 @@ unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
     return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
 }
 
+/* Delete a range of entries from the listpack start at the element pointed
+ * by 'index' (negative indexes are supported as in lpSeek()), deleting at
+ * most 'num' entries. Returns the resulting listpack. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *p = lpSeek(lp,index);
+
+    while (num-- && p != NULL)
+        lp = lpInsert(lp,NULL,0,p,LP_REPLACE,&p);
+    return lp;
+}
+
 /* Remove the element pointed by 'p', and return the resulting listpack.
  * If 'newp' is not NULL, the next element pointer (to the right of the
  * deleted one) is returned by reference. If the deleted element was the
@@ -752,6 +779,60 @@ uint32_t lpBytes(unsigned char *lp) {
     return lpGetTotalBytes(lp);
 }
 
+/* Validate the integrity of a serialized listpack of 'size' bytes, so that
+ * it can be adopted as is from an untrusted source (a RESTORE payload).
+ * When 'deep' is zero only the header and the terminator are checked, in
+ * constant time. When non zero every element is scanned, verifying that
+ * all the encodings are known, that every length stays inside the buffer
+ * and that the backlen of each element agrees with its encoded length, so
+ * that after this both forward and backward traversals are safe.
+ * Returns 1 if the listpack is valid, 0 otherwise. */
+int lpValidateIntegrity(unsigned char *lp, size_t size, int deep) {
+    /* Must be long enough to hold the header and the terminator. */
+    if (size < LP_HDR_SIZE + 1) return 0;
+
+    /* The encoded size must match the buffer, and the terminator must
+     * be there. */
+    if (lpGetTotalBytes(lp) != size) return 0;
+    if (lp[size-1] != LP_EOF) return 0;
+
+    if (!deep) return 1;
+
+    uint32_t count = 0;
+    unsigned char *p = lp + LP_HDR_SIZE;
+    unsigned char *end = lp + size - 1; /* At the LP_EOF byte. */
+
+    while (p < end) {
+        /* Make sure the bytes encoding the element length are inside the
+         * buffer before lpCurrentEncodedSize() dereferences them: the
+         * longest encoding header is five bytes. */
+        uint32_t hdrlen = 1;
+        if (LP_ENCODING_IS_12BIT_STR(p[0])) hdrlen = 2;
+        else if (LP_ENCODING_IS_32BIT_STR(p[0])) hdrlen = 5;
+        if ((size_t)(end - p) < hdrlen) return 0;
+
+        uint64_t entrylen = lpCurrentEncodedSize(p);
+        if (entrylen == 0) return 0; /* Unknown encoding. */
+        uint64_t backlen = lpEncodeBacklen(NULL,entrylen);
+        if ((size_t)(end - p) < entrylen + backlen) return 0;
+
+        /* The backlen must agree with the element length, it is what
+         * makes backward traversal possible. */
+        if (lpDecodeBacklen(p + entrylen + backlen - 1) != entrylen)
+            return 0;
+
+        p += entrylen + backlen;
+        count++;
+    }
+    if (p != end) return 0;
+
+    /* When the elements count header is not saturated it must match the
+     * number of elements we walked. */
+    if (lpGetNumElements(lp) != LP_HDR_NUMELE_UNKNOWN &&
+        count != lpGetNumElements(lp)) return 0;
+    return 1;
+}
+
 /* Seek the specified element and returns the pointer to the seeked element.
  * Positive indexes specify the zero-based element to seek from the head to
  * the tail, negative indexes specify elements starting from the tail, where
@@ -801,3 +882,132 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+
+/* This is just a wrapper to lpGet() that is able to get an entry as a
+ * string: when the entry is integer encoded it is converted by reference
+ * in 'lval', otherwise the string pointer inside the listpack is returned
+ * and 'slen' is set to its length. Mirrors the ziplistGet() calling
+ * convention of returning either a string or a long long, which makes
+ * porting ziplist users simpler. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    unsigned char *vstr;
+    int64_t ele_len;
+
+    vstr = lpGet(p, &ele_len, NULL);
+    if (vstr) {
+        *slen = ele_len;
+    } else {
+        *lval = ele_len;
+    }
+    return vstr;
+}
+
+/* Compare entry pointed to by 'p' with string 's' of length 'slen'.
+ * Return 1 if equal. */
+unsigned int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *value;
+    int64_t sz;
+    if (p[0] == LP_EOF) return 0;
+
+    value = lpGet(p, &sz, NULL);
+    if (value) {
+        return (slen == sz) && memcmp(value,s,slen) == 0;
+    } else {
+        /* We use lpStringToInt64() to get an integer representation of the
+         * string 's' and compare it to the entry value, it's much faster
+         * than converting the integer to string and comparing. */
+        int64_t sval;
+        if (lpStringToInt64((const char*)s, slen, &sval))
+            return sz == sval;
+    }
+    return 0;
+}
+
+/* Find pointer to the entry equal to the specified entry. Skip 'skip' entries
+ * between every comparison. Returns NULL when the field could not be found.
+ * 'p' is the entry the search starts from, usually obtained with lpFirst()
+ * or lpSeek(). */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
+                      uint32_t slen, unsigned int skip)
+{
+    int skipcnt = 0;
+    unsigned char vencoding = 0;
+    int64_t vll = 0;
+    (void)lp; /* Taken for API symmetry with the other iteration calls. */
+
+    while (p) {
+        if (skipcnt == 0) {
+            int64_t ele_len;
+            unsigned char *value = lpGet(p, &ele_len, NULL);
+            if (value) {
+                if (slen == ele_len && memcmp(value, s, slen) == 0) {
+                    return p;
+                }
+            } else {
+                /* Find out if the searched field can be encoded. Note that
+                 * we do it only the first time, once done vencoding is set
+                 * to non-zero and vll is set to the integer value. */
+                if (vencoding == 0) {
+                    if (!lpStringToInt64((const char*)s, slen, &vll)) {
+                        /* If the entry can't be encoded we set it to
+                         * UCHAR_MAX so that we don't retry again the next
+                         * time. */
+                        vencoding = UCHAR_MAX;
+                    } else {
+                        vencoding = 1;
+                    }
+                }
+
+                /* Compare current entry with specified entry, do it only
+                 * if vencoding != UCHAR_MAX because if there is no encoding
+                 * possible for the field it can't be a valid integer. */
+                if (vencoding != UCHAR_MAX && ele_len == vll) {
+                    return p;
+                }
+            }
+
+            /* Reset skip count */
+            skipcnt = skip;
+        } else {
+            /* Skip entry */
+            skipcnt--;
+        }
+        p = lpSkip(p);
+        if (p[0] == LP_EOF) break;
+    }
+
+    return NULL;
+}
+
+/* Replace the element pointed by 'p' with the 'ele' of length 'len', updating
+ * '*p' to point to the new element inside the reallocated listpack. It is
+ * implemented in terms of lpInsert(). */
+unsigned char *lpReplace(unsigned char *lp, unsigned char **p, unsigned char *ele, uint32_t size) {
+    return lpInsert(lp, ele, size, *p, LP_REPLACE, p);
+}
+
+/* Print info of listpack which is used in debugCommand. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p;
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %u}\n", lpBytes(lp), lpLength(lp));
+
+    p = lpFirst(lp);
+    while(p) {
+        int64_t count;
+        unsigned char *vstr = lpGet(p,&count,NULL);
+
+        printf("{index %d} {bytes %u} [%s]  ", index,
+               lpCurrentEncodedSize(p), vstr ? "str" : "int");
+        if (vstr) {
+            fwrite(vstr,count,1,stdout);
+        } else {
+            printf("%lld", (long long)count);
+        }
+        printf("\n");
+        p = lpNext(lp,p);
+        index++;
+    }
+    printf("{end}\n");
+}
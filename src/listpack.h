@@ -46,9 +46,11 @@
 
 unsigned char *lpNew(void);
 void lpFree(unsigned char *lp);
+unsigned char *lpPrealloc(unsigned char *lp, size_t capacity);
 unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, unsigned char *p, int where, unsigned char **newp);
 unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size);
 unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp);
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num);
 uint32_t lpLength(unsigned char *lp);
 unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf);
 unsigned char *lpFirst(unsigned char *lp);
@@ -56,6 +58,12 @@ unsigned char *lpLast(unsigned char *lp);
 unsigned char *lpNext(unsigned char *lp, unsigned char *p);
 unsigned char *lpPrev(unsigned char *lp, unsigned char *p);
 uint32_t lpBytes(unsigned char *lp);
+int lpValidateIntegrity(unsigned char *lp, size_t size, int deep);
 unsigned char *lpSeek(unsigned char *lp, long index);
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval);
+unsigned int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen);
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip);
+unsigned char *lpReplace(unsigned char *lp, unsigned char **p, unsigned char *ele, uint32_t size);
+void lpRepr(unsigned char *lp);
 
 #endif
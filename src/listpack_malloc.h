@@ -39,7 +39,8 @@
 #ifndef LISTPACK_ALLOC_H
 #define LISTPACK_ALLOC_H
 #include "zmalloc.h"
-#define lp_malloc zmalloc
-#define lp_realloc zrealloc
+#define lp_malloc(sz) zmalloc_typed(ZMALLOC_TYPE_VALUE,sz)
+#define lp_realloc(ptr,sz) zrealloc_typed(ZMALLOC_TYPE_VALUE,ptr,sz)
 #define lp_free zfree
+#define lp_malloc_size zmalloc_size
 #endif
@@ -251,6 +251,9 @@ typedef struct RedisModuleBlockedClient {
     int dbid;           /* Database number selected by the original client. */
     int blocked_on_keys;    /* If blocked via RM_BlockClientOnKeys(). */
     int unblocked;          /* Already on the moduleUnblocked list. */
+    int retry_command;      /* Re-dispatch the blocked command on unblock
+                               instead of using the module reply. See
+                               RM_RetryCommand(). */
 } RedisModuleBlockedClient;
 
 static pthread_mutex_t moduleUnblockedClientsMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -260,6 +263,18 @@ static list *moduleUnblockedClients;
  * allow thread safe contexts to execute commands at a safe moment. */
 static pthread_mutex_t moduleGIL = PTHREAD_MUTEX_INITIALIZER;
 
+/* State of the slot scoped variant of the GIL: module threads working on
+ * keys of a single keyspace shard can take just the mutex of that shard,
+ * so threads touching disjoint shards run in parallel, while the main
+ * thread (and every cross-slot user of the plain GIL) still excludes all
+ * of them. See moduleAcquireSlotGIL() for the locking protocol. */
+static pthread_mutex_t moduleSlotGILMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t moduleSlotGILCond = PTHREAD_COND_INITIALIZER;
+static int moduleSlotGILActive = 0; /* Threads holding some slot lock. */
+static pthread_mutex_t *moduleSlotGIL = NULL; /* One mutex per keyspace
+                                                 shard, allocated once the
+                                                 configuration is known. */
+
 
 /* Function pointer type for keyspace event notification subscriptions from modules. */
 typedef int (*RedisModuleNotificationFunc) (RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key);
@@ -281,6 +296,22 @@ typedef struct RedisModuleKeyspaceSubscriber {
 /* The module keyspace notification subscribers list */
 static list *moduleKeyspaceSubscribers;
 
+/* Function pointer type for the read-through key miss interceptors. The
+ * callback returns non zero when it took ownership of the client (it
+ * blocked it, or replied itself), zero to let the command proceed. */
+typedef int (*RedisModuleKeyMissFunc) (RedisModuleCtx *ctx, RedisModuleString *key);
+
+/* Key miss interceptor registration.
+ * See RM_InterceptKeyMisses() for more information. */
+typedef struct RedisModuleKeyMissInterceptor {
+    RedisModule *module;                /* The registering module. */
+    RedisModuleKeyMissFunc callback;    /* Interceptor in the module. */
+    int active;                         /* Reentrancy guard. */
+} RedisModuleKeyMissInterceptor;
+
+/* The module key miss interceptors list */
+static list *moduleKeyMissInterceptors;
+
 /* Static client recycled for when we need to provide a context with a client
  * in a situation where there is no client to provide. This avoidsallocating
  * a new client per round. For instance this is used in the keyspace
@@ -493,7 +524,7 @@ int moduleCreateEmptyKey(RedisModuleKey *key, int type) {
                             server.list_compress_depth);
         break;
     case REDISMODULE_KEYTYPE_ZSET:
-        obj = createZsetZiplistObject();
+        obj = createZsetListpackObject();
         break;
     case REDISMODULE_KEYTYPE_HASH:
         obj = createHashObject();
@@ -817,8 +848,11 @@ int RM_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc c
     cp->rediscmd->keystep = keystep;
     cp->rediscmd->microseconds = 0;
     cp->rediscmd->calls = 0;
+    cp->rediscmd->latency_histogram =
+        zcalloc(sizeof(uint64_t)*LATENCY_HIST_BUCKETS);
     dictAdd(server.commands,sdsdup(cmdname),cp->rediscmd);
     dictAdd(server.orig_commands,sdsdup(cmdname),cp->rediscmd);
+    rebuildCommandLookupFastTable();
     cp->rediscmd->id = ACLGetCommandID(cmdname); /* ID used for ACL. */
     return REDISMODULE_OK;
 }
@@ -1942,6 +1976,27 @@ void *RM_OpenKey(RedisModuleCtx *ctx, robj *keyname, int mode) {
     return (void*)kp;
 }
 
+/* Open 'count' keys at once: keys[i] is populated with the handle for
+ * keynames[i], exactly as if RedisModule_OpenKey() was called with the
+ * same mode (so keys[i] may be NULL for non existing keys opened just
+ * for READ, and each non NULL handle must be closed with
+ * RedisModule_CloseKey()).
+ *
+ * The only difference with a loop of RedisModule_OpenKey() calls is
+ * performance: the keyspace hash table buckets of all the keys are
+ * prefetched before the lookups start, hiding part of the memory latency
+ * that sequential lookups would pay one after the other. */
+void RM_OpenKeys(RedisModuleCtx *ctx, RedisModuleString **keynames, int count, int mode, RedisModuleKey **keys) {
+    int j;
+
+    for (j = 0; j < count; j++) {
+        dict *d = dbGetDict(ctx->client->db,keynames[j]->ptr);
+        dictPrefetch(d,keynames[j]->ptr);
+    }
+    for (j = 0; j < count; j++)
+        keys[j] = RM_OpenKey(ctx,keynames[j],mode);
+}
+
 /* Destroy a RedisModuleKey struct (freeing is the responsibility of the caller). */
 static void moduleCloseKey(RedisModuleKey *key) {
     int signal = SHOULD_SIGNAL_MODIFIED_KEYS(key->ctx);
@@ -2066,7 +2121,7 @@ void RM_ResetDataset(int restart_aof, int async) {
 
 /* Returns the number of keys in the current db. */
 unsigned long long RM_DbSize(RedisModuleCtx *ctx) {
-    return dictSize(ctx->client->db->dict);
+    return dbSize(ctx->client->db);
 }
 
 /* Returns a name of a random key, or NULL if current db is empty. */
@@ -2411,7 +2466,7 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     zrs->minex = minex;
     zrs->maxex = maxex;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInRange(key->value->ptr,zrs) :
                                 zzlLastInRange(key->value->ptr,zrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2475,7 +2530,7 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
      * otherwise we don't want the zlexrangespec to be freed. */
     key->ztype = REDISMODULE_ZSET_RANGE_LEX;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInLexRange(key->value->ptr,zlrs) :
                                 zzlLastInLexRange(key->value->ptr,zlrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2520,12 +2575,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
     RedisModuleString *str;
 
     if (key->zcurrent == NULL) return NULL;
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr, *sptr;
         eptr = key->zcurrent;
-        sds ele = ziplistGetObject(eptr);
+        sds ele = lpGetObject(eptr);
         if (score) {
-            sptr = ziplistNext(key->value->ptr,eptr);
+            sptr = lpNext(key->value->ptr,eptr);
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
@@ -2546,12 +2601,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
 int RM_ZsetRangeNext(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *next;
-        next = ziplistNext(zl,eptr); /* Skip element. */
-        if (next) next = ziplistNext(zl,next); /* Skip score. */
+        next = lpNext(zl,eptr); /* Skip element. */
+        if (next) next = lpNext(zl,next); /* Skip score. */
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -2561,7 +2616,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 /* Fetch the next element score for the
                  * range check. */
                 unsigned char *saved_next = next;
-                next = ziplistNext(zl,next); /* Skip next element. */
+                next = lpNext(zl,next); /* Skip next element. */
                 double score = zzlGetScore(next); /* Obtain the next score. */
                 if (!zslValueLteMax(score,&key->zrs)) {
                     key->zer = 1;
@@ -2609,12 +2664,12 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
 int RM_ZsetRangePrev(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *prev;
-        prev = ziplistPrev(zl,eptr); /* Go back to previous score. */
-        if (prev) prev = ziplistPrev(zl,prev); /* Back to previous ele. */
+        prev = lpPrev(zl,eptr); /* Go back to previous score. */
+        if (prev) prev = lpPrev(zl,prev); /* Back to previous ele. */
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -2624,7 +2679,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 /* Fetch the previous element score for the
                  * range check. */
                 unsigned char *saved_prev = prev;
-                prev = ziplistNext(zl,prev); /* Skip element to get the score.*/
+                prev = lpNext(zl,prev); /* Skip element to get the score.*/
                 double score = zzlGetScore(prev); /* Obtain the prev score. */
                 if (!zslValueGteMin(score,&key->zrs)) {
                     key->zer = 1;
@@ -2873,6 +2928,41 @@ int RM_HashGet(RedisModuleKey *key, int flags, ...) {
     return REDISMODULE_OK;
 }
 
+/* Like RedisModule_HashGet() but fetches 'count' fields at once: the
+ * value of fields[i] is returned into values[i], set to NULL if the
+ * field does not exist. The underlying hash is scanned a single time
+ * whatever the number of requested fields, so for module commands
+ * aggregating many fields of the same key this is much cheaper than a
+ * loop of RedisModule_HashGet() calls.
+ *
+ * Only REDISMODULE_HASH_NONE is supported as 'flags' for now: fields are
+ * RedisModuleString pointers and values are returned as strings.
+ *
+ * The function returns REDISMODULE_OK on success and REDISMODULE_ERR if
+ * the key is not an hash value or the flags are not valid. The returned
+ * strings should be released with RedisModule_FreeString(), or by
+ * enabling automatic memory management. */
+int RM_HashGetMulti(RedisModuleKey *key, int flags, RedisModuleString **fields, RedisModuleString **values, int count) {
+    if (key->value && key->value->type != OBJ_HASH) return REDISMODULE_ERR;
+    if (flags != REDISMODULE_HASH_NONE) return REDISMODULE_ERR;
+
+    sds *fieldsds = zmalloc(sizeof(sds)*count);
+    for (int j = 0; j < count; j++) fieldsds[j] = fields[j]->ptr;
+    hashTypeGetMulti(key->value,fieldsds,(robj**)values,count);
+    zfree(fieldsds);
+
+    for (int j = 0; j < count; j++) {
+        if (values[j] == NULL) continue;
+        /* The value may be returned as a shared integer object: modules
+         * expect strings they can own. */
+        robj *decoded = getDecodedObject(values[j]);
+        decrRefCount(values[j]);
+        values[j] = decoded;
+        autoMemoryAdd(key->ctx,REDISMODULE_AM_STRING,values[j]);
+    }
+    return REDISMODULE_OK;
+}
+
 /* --------------------------------------------------------------------------
  * Redis <-> Modules generic Call() API
  * -------------------------------------------------------------------------- */
@@ -3276,6 +3366,114 @@ cleanup:
     return reply;
 }
 
+/* Execute 'count' commands reusing a single fake client, which is by far
+ * the most expensive part of the RedisModule_Call() setup. Command 'j'
+ * is described by the argument vector cmdargv[j] of cmdargc[j]
+ * RedisModuleString pointers, the command name included as first
+ * element. The reply of each command is returned into replies[j], set to
+ * NULL (with errno set as in RedisModule_Call()) for the commands that
+ * could not be executed; the other commands of the batch are dispatched
+ * anyway.
+ *
+ * The 'fmt' string can only contain the RedisModule_Call() modifiers
+ * valid for all the commands of the batch: "!" to replicate them, plus
+ * "A" and "R" to suppress AOF or replicas propagation.
+ *
+ * The function returns the number of commands that produced a reply, or
+ * REDISMODULE_ERR if 'fmt' is not valid. */
+int RM_CallBatch(RedisModuleCtx *ctx, const char *fmt, RedisModuleString ***cmdargv, const int *cmdargc, int count, RedisModuleCallReply **replies) {
+    client *c;
+    int flags = 0, replicate, done = 0;
+
+    for (const char *p = fmt; *p; p++) {
+        if (*p == '!') flags |= REDISMODULE_ARGV_REPLICATE;
+        else if (*p == 'A') flags |= REDISMODULE_ARGV_NO_AOF;
+        else if (*p == 'R') flags |= REDISMODULE_ARGV_NO_REPLICAS;
+        else { errno = EINVAL; return REDISMODULE_ERR; }
+    }
+    replicate = flags & REDISMODULE_ARGV_REPLICATE;
+
+    /* The fake client is created and released once for the whole batch. */
+    c = createClient(NULL);
+    c->user = NULL; /* Root user. */
+    c->flags |= CLIENT_MODULE;
+    c->db = ctx->client->db;
+    if (ctx->module) ctx->module->in_call++;
+
+    for (int j = 0; j < count; j++) {
+        struct redisCommand *cmd;
+
+        replies[j] = NULL;
+        c->argv = zmalloc(sizeof(robj*)*cmdargc[j]);
+        c->argc = cmdargc[j];
+        for (int i = 0; i < cmdargc[j]; i++) {
+            c->argv[i] = cmdargv[j][i];
+            incrRefCount(c->argv[i]);
+        }
+
+        /* The checks below mirror RM_Call(), just applied per command. */
+        moduleCallCommandFilters(c);
+        cmd = lookupCommand(c->argv[0]->ptr);
+        if (!cmd) {
+            errno = ENOENT;
+            goto next;
+        }
+        c->cmd = c->lastcmd = cmd;
+        if ((cmd->arity > 0 && cmd->arity != c->argc) ||
+            (c->argc < -cmd->arity))
+        {
+            errno = EINVAL;
+            goto next;
+        }
+        if (server.cluster_enabled && !(ctx->client->flags & CLIENT_MASTER)) {
+            c->flags &= ~(CLIENT_READONLY|CLIENT_ASKING);
+            c->flags |= ctx->client->flags & (CLIENT_READONLY|CLIENT_ASKING);
+            if (getNodeByQuery(c,c->cmd,c->argv,c->argc,NULL,NULL) !=
+                               server.cluster->myself)
+            {
+                errno = EPERM;
+                goto next;
+            }
+        }
+        if (replicate) moduleReplicateMultiIfNeeded(ctx);
+
+        int call_flags = CMD_CALL_SLOWLOG | CMD_CALL_STATS;
+        if (replicate) {
+            if (!(flags & REDISMODULE_ARGV_NO_AOF))
+                call_flags |= CMD_CALL_PROPAGATE_AOF;
+            if (!(flags & REDISMODULE_ARGV_NO_REPLICAS))
+                call_flags |= CMD_CALL_PROPAGATE_REPL;
+        }
+        call(c,call_flags);
+
+        sds proto = sdsnewlen(c->buf,c->bufpos);
+        c->bufpos = 0;
+        while(listLength(c->reply)) {
+            clientReplyBlock *o = listNodeValue(listFirst(c->reply));
+
+            proto = sdscatlen(proto,o->buf,o->used);
+            listDelNode(c->reply,listFirst(c->reply));
+        }
+        replies[j] = moduleCreateCallReplyFromProto(ctx,proto);
+        autoMemoryAdd(ctx,REDISMODULE_AM_REPLY,replies[j]);
+        done++;
+
+next:
+        /* Release the argument vector (the command may have rewritten it
+         * for propagation purposes) and make the client ready for the
+         * next command of the batch. */
+        for (int i = 0; i < c->argc; i++) decrRefCount(c->argv[i]);
+        zfree(c->argv);
+        c->argv = NULL;
+        c->argc = 0;
+        c->cmd = NULL;
+    }
+
+    if (ctx->module) ctx->module->in_call--;
+    freeClient(c);
+    return done;
+}
+
 /* Return a pointer, and a length, to the protocol returned by the command
  * that returned the reply object. */
 const char *RM_CallReplyProto(RedisModuleCallReply *reply, size_t *len) {
@@ -3469,6 +3667,10 @@ void moduleTypeNameByID(char *name, uint64_t moduleid) {
  * * **aof_rewrite**: A callback function pointer that rewrites data as commands.
  * * **digest**: A callback function pointer that is used for `DEBUG DIGEST`.
  * * **free**: A callback function pointer that can free a type value.
+ * * **defrag**: A callback function pointer that is used for active defrag
+ *   of the type value, see RM_DefragAlloc(). It should return 0 when the
+ *   value was fully defragmented, or 1 to be called again with cursor
+ *   support for values too big to process in one call.
  *
  * The **digest* and **mem_usage** methods should currently be omitted since
  * they are not yet implemented inside the Redis modules core.
@@ -3512,6 +3714,9 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
             moduleTypeAuxSaveFunc aux_save;
             int aux_save_triggers;
         } v2;
+        struct {
+            moduleTypeDefragFunc defrag;
+        } v3;
     } *tms = (struct typemethods*) typemethods_ptr;
 
     moduleType *mt = zcalloc(sizeof(*mt));
@@ -3528,6 +3733,9 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
         mt->aux_save = tms->v2.aux_save;
         mt->aux_save_triggers = tms->v2.aux_save_triggers;
     }
+    if (tms->version >= 3) {
+        mt->defrag = tms->v3.defrag;
+    }
     memcpy(mt->name,name,sizeof(mt->name));
     listAddNodeTail(ctx->module->types,mt);
     return mt;
@@ -4258,6 +4466,7 @@ RedisModuleBlockedClient *moduleBlockClient(RedisModuleCtx *ctx, RedisModuleCmdF
     bc->dbid = c->db->id;
     bc->blocked_on_keys = keys != NULL;
     bc->unblocked = 0;
+    bc->retry_command = 0;
     c->bpop.timeout = timeout;
 
     if (islua || ismulti) {
@@ -4442,6 +4651,22 @@ int RM_UnblockClient(RedisModuleBlockedClient *bc, void *privdata) {
     return REDISMODULE_OK;
 }
 
+/* Ask Redis to re-dispatch the command the client was blocked on instead
+ * of having the module reply: may only be called from a blocked client
+ * reply callback, before returning from it, and the callback must not
+ * have produced any reply. Once the client is unblocked the original
+ * command is executed again against the current dataset, as if it was
+ * just received. This is the completion half of the read-through cache
+ * protocol of RM_InterceptKeyMisses(): after the module populated the
+ * missing key, retrying serves the client the actual value with the
+ * command's native reply format. Returns REDISMODULE_ERR when called
+ * outside of a reply callback. */
+int RM_RetryCommand(RedisModuleCtx *ctx) {
+    if (ctx->blocked_client == NULL) return REDISMODULE_ERR;
+    ctx->blocked_client->retry_command = 1;
+    return REDISMODULE_OK;
+}
+
 /* Abort a blocked client blocking operation: the client will be unblocked
  * without firing any callback. */
 int RM_AbortBlock(RedisModuleBlockedClient *bc) {
@@ -4537,8 +4762,41 @@ void moduleHandleBlockedClients(void) {
             /* Before unblocking the client, set the disconnect callback
              * to NULL, because if we reached this point, the client was
              * properly unblocked by the module. */
+            /* The reply callback may have asked to re-dispatch the
+             * original command instead of replying itself (see
+             * RM_RetryCommand()): typically after a read-through module
+             * populated the missing key the client was blocked on.
+             * unblockClientFromModule() resets the client, so the
+             * argument vector is retained across the unblocking. */
+            int retry = bc->retry_command && c->cmd != NULL;
+            robj **retry_argv = NULL;
+            int retry_argc = 0;
+            struct redisCommand *retry_cmd = NULL;
+            if (retry) {
+                retry_argv = c->argv;
+                retry_argc = c->argc;
+                retry_cmd = c->cmd;
+                c->argv = NULL; /* Keep resetClient() from freeing it. */
+                c->argc = 0;
+            }
+
             bc->disconnect_callback = NULL;
             unblockClient(c);
+
+            if (retry) {
+                c->argv = retry_argv;
+                c->argc = retry_argc;
+                c->cmd = c->lastcmd = retry_cmd;
+                client *old_client = server.current_client;
+                server.current_client = c;
+                call(c,CMD_CALL_FULL);
+                c->woff = server.master_repl_offset;
+                if (listLength(server.ready_keys))
+                    handleClientsBlockedOnKeys();
+                server.current_client = old_client;
+                resetClient(c);
+            }
+
             /* Put the client in the list of clients that need to write
              * if there are pending replies here. This is needed since
              * during a non blocking command the client may receive output. */
@@ -4683,14 +4941,95 @@ void RM_ThreadSafeContextUnlock(RedisModuleCtx *ctx) {
     moduleReleaseGIL();
 }
 
+/* Return the keyspace shard ("slot") the specified key name hashes to,
+ * always 0 when the keyspace is not sharded (db-dict-shards = 1). This is
+ * the slot to pass to RedisModule_ThreadSafeContextLockSlot() in order to
+ * access the key from a background thread. The mapping of a key never
+ * changes at runtime. */
+int RM_GetKeySlot(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    UNUSED(ctx);
+    if (server.db_dict_shards == 1) return 0;
+    unsigned int slot = keyHashSlot(keyname->ptr,sdslen(keyname->ptr));
+    return slot & (server.db_dict_shards-1);
+}
+
+/* Return the total number of keyspace shards, that is the number of
+ * distinct slots RedisModule_GetKeySlot() can return. */
+int RM_GetKeySlotCount(RedisModuleCtx *ctx) {
+    UNUSED(ctx);
+    return server.db_dict_shards;
+}
+
+/* Like RedisModule_ThreadSafeContextLock(), but only locks the specified
+ * keyspace slot instead of the whole server: module threads locking
+ * different slots run in parallel, while both the main thread and the
+ * holders of the plain (global) lock are excluded as usual.
+ *
+ * While the lock is held the thread may only access keys whose
+ * RedisModule_GetKeySlot() is exactly 'slot': touching any other key, or
+ * any server wide state, is a programming error. Operations spanning
+ * several slots must keep using RedisModule_ThreadSafeContextLock().
+ *
+ * Slot locks cannot be nested, nor held while acquiring the global lock,
+ * otherwise the two protocols may deadlock.
+ *
+ * The function returns REDISMODULE_OK, or REDISMODULE_ERR if 'slot' is
+ * out of range. */
+int RM_ThreadSafeContextLockSlot(RedisModuleCtx *ctx, int slot) {
+    UNUSED(ctx);
+    if (slot < 0 || slot >= server.db_dict_shards) return REDISMODULE_ERR;
+    moduleAcquireSlotGIL(slot);
+    return REDISMODULE_OK;
+}
+
+/* Release the slot lock acquired with
+ * RedisModule_ThreadSafeContextLockSlot(). The 'slot' argument must be
+ * the one passed at lock time. */
+int RM_ThreadSafeContextUnlockSlot(RedisModuleCtx *ctx, int slot) {
+    UNUSED(ctx);
+    if (slot < 0 || slot >= server.db_dict_shards) return REDISMODULE_ERR;
+    moduleReleaseSlotGIL(slot);
+    return REDISMODULE_OK;
+}
+
 void moduleAcquireGIL(void) {
     pthread_mutex_lock(&moduleGIL);
+    /* Wait for the threads holding just a slot scoped lock to drain: no
+     * new one can enter since they need the global mutex, held by us, in
+     * order to register. */
+    pthread_mutex_lock(&moduleSlotGILMutex);
+    while (moduleSlotGILActive > 0)
+        pthread_cond_wait(&moduleSlotGILCond,&moduleSlotGILMutex);
+    pthread_mutex_unlock(&moduleSlotGILMutex);
 }
 
 void moduleReleaseGIL(void) {
     pthread_mutex_unlock(&moduleGIL);
 }
 
+/* Acquire the right to access the keys of a single keyspace shard from a
+ * module thread. The global mutex is taken only for the time needed to
+ * register as an active slot locker, so that we are mutually exclusive
+ * with the main thread and with the global lock holders, but not with
+ * the other slot lockers (except those contending the same slot). */
+void moduleAcquireSlotGIL(int slot) {
+    pthread_mutex_lock(&moduleGIL);
+    pthread_mutex_lock(&moduleSlotGILMutex);
+    moduleSlotGILActive++;
+    pthread_mutex_unlock(&moduleSlotGILMutex);
+    pthread_mutex_unlock(&moduleGIL);
+    pthread_mutex_lock(&moduleSlotGIL[slot]);
+}
+
+void moduleReleaseSlotGIL(int slot) {
+    pthread_mutex_unlock(&moduleSlotGIL[slot]);
+    pthread_mutex_lock(&moduleSlotGILMutex);
+    moduleSlotGILActive--;
+    if (moduleSlotGILActive == 0)
+        pthread_cond_signal(&moduleSlotGILCond);
+    pthread_mutex_unlock(&moduleSlotGILMutex);
+}
+
 
 /* --------------------------------------------------------------------------
  * Module Keyspace Notifications API
@@ -4819,6 +5158,109 @@ void moduleUnsubscribeNotifications(RedisModule *module) {
     }
 }
 
+/* Register the calling module as a read-through key miss interceptor, or
+ * unregister it when 'callback' is NULL. While at least one interceptor
+ * is registered, every read command whose first key is missing invokes
+ * the callbacks before the command runs, from the context of the real
+ * client, with the missing key name as argument:
+ *
+ *   int (*RedisModuleKeyMissFunc) (RedisModuleCtx *ctx,
+ *                                  RedisModuleString *key);
+ *
+ * A callback returning zero lets the command proceed normally (and reply
+ * with its usual miss semantics). Returning non zero means the module
+ * took ownership of the client: typically it called
+ * RedisModule_BlockClient() on the context, handed the fetch from the
+ * backing store to its own threads, populated the key from a thread safe
+ * context and finally called RedisModule_UnblockClient(). From the reply
+ * callback the module can either reply itself or call
+ * RedisModule_RetryCommand() to have the original command re-dispatched
+ * against the now populated keyspace, implementing server side
+ * read-through caching with no extra client round trips.
+ *
+ * The interception only triggers for commands flagged readonly, with a
+ * static first key, dispatched directly by a client: commands executed
+ * from Lua, MULTI or the replication link never see the interceptor.
+ * The re-dispatched command does not trigger the interceptor again while
+ * the key is still missing, since it is executed directly instead of
+ * going through the command dispatch path. */
+int RM_InterceptKeyMisses(RedisModuleCtx *ctx, RedisModuleKeyMissFunc callback) {
+    listIter li;
+    listNode *ln;
+
+    /* Replace or drop a previous registration of the same module. */
+    listRewind(moduleKeyMissInterceptors,&li);
+    while((ln = listNext(&li))) {
+        RedisModuleKeyMissInterceptor *in = ln->value;
+        if (in->module == ctx->module) {
+            if (callback)
+                in->callback = callback;
+            else {
+                listDelNode(moduleKeyMissInterceptors, ln);
+                zfree(in);
+            }
+            return REDISMODULE_OK;
+        }
+    }
+    if (callback == NULL) return REDISMODULE_OK;
+
+    RedisModuleKeyMissInterceptor *in = zmalloc(sizeof(*in));
+    in->module = ctx->module;
+    in->callback = callback;
+    in->active = 0;
+    listAddNodeTail(moduleKeyMissInterceptors, in);
+    return REDISMODULE_OK;
+}
+
+/* Called by processCommand() before executing a read command: gives the
+ * registered key miss interceptors a chance to take over the client when
+ * the command's first key does not exist. Returns 1 when some module took
+ * ownership of the client and the command must not be executed, 0 to
+ * proceed as usual. Cheap while no interceptor is registered. */
+int moduleKeyMissInterceptCommand(client *c) {
+    if (listLength(moduleKeyMissInterceptors) == 0) return 0;
+    if (!(c->cmd->flags & CMD_READONLY) || c->cmd->firstkey == 0) return 0;
+    if (c->flags & (CLIENT_LUA|CLIENT_MASTER|CLIENT_MULTI)) return 0;
+
+    /* Raw existence check: lookupKeyRead() would count the miss and fire
+     * the keymiss event a first time here and a second time when the
+     * command runs after the interceptors declined. */
+    robj *key = c->argv[c->cmd->firstkey];
+    expireIfNeeded(c->db,key);
+    if (dictFind(dbGetDict(c->db,key->ptr),key->ptr) != NULL) return 0;
+
+    listIter li;
+    listNode *ln;
+    listRewind(moduleKeyMissInterceptors,&li);
+    while((ln = listNext(&li))) {
+        RedisModuleKeyMissInterceptor *in = ln->value;
+        if (in->active) continue;
+        RedisModuleCtx ctx = REDISMODULE_CTX_INIT;
+        ctx.module = in->module;
+        ctx.client = c;
+        in->active = 1;
+        int handled = in->callback(&ctx, key);
+        in->active = 0;
+        moduleFreeContext(&ctx);
+        if (handled) return 1;
+    }
+    return 0;
+}
+
+/* Drop the key miss interceptor this module registered, upon unloading. */
+void moduleUnregisterKeyMissInterceptors(RedisModule *module) {
+    listIter li;
+    listNode *ln;
+    listRewind(moduleKeyMissInterceptors,&li);
+    while((ln = listNext(&li))) {
+        RedisModuleKeyMissInterceptor *in = ln->value;
+        if (in->module == module) {
+            listDelNode(moduleKeyMissInterceptors, ln);
+            zfree(in);
+        }
+    }
+}
+
 /* --------------------------------------------------------------------------
  * Modules Cluster API
  * -------------------------------------------------------------------------- */
@@ -6054,6 +6496,9 @@ void moduleCallCommandFilters(client *c) {
 
     c->argv = filter.argv;
     c->argc = filter.argc;
+    /* The filter may have swapped in a reallocated vector: don't let the
+     * parser assume the old capacity. */
+    c->argv_len = filter.argc;
 }
 
 /* Return the number of arguments a filtered command has.  The number of
@@ -6240,7 +6685,7 @@ int RM_Scan(RedisModuleCtx *ctx, RedisModuleScanCursor *cursor, RedisModuleScanC
     }
     int ret = 1;
     ScanCBData data = { ctx, privdata, fn };
-    cursor->cursor = dictScan(ctx->client->db->dict, cursor->cursor, moduleScanCallback, NULL, &data);
+    cursor->cursor = dbScan(ctx->client->db, cursor->cursor, moduleScanCallback, NULL, &data);
     if (cursor->cursor == 0) {
         cursor->done = 1;
         ret = 0;
@@ -6357,22 +6802,22 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
         cursor->done = 1;
         ret = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpFirst(o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *field = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createStringObjectFromLongLong(vll);
-            p = ziplistNext(o->ptr,p);
-            ziplistGet(p,&vstr,&vlen,&vll);
+            p = lpNext(o->ptr,p);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *value = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createStringObjectFromLongLong(vll);
             fn(key, field, value, privdata);
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
             decrRefCount(field);
             decrRefCount(value);
         }
@@ -6838,6 +7283,150 @@ void processModuleLoadingProgressEvent(int is_aof) {
     }
 }
 
+/* --------------------------------------------------------------------------
+ * Defrag API
+ * -------------------------------------------------------------------------- */
+
+/* The defrag context, passed to the data type defrag callback registered
+ * with the 'defrag' method of RedisModuleTypeMethods. */
+typedef struct RedisModuleDefragCtx {
+    long long endtime;      /* Deadline in microseconds, 0 = no deadline. */
+    unsigned long *cursor;  /* Cursor to resume an interrupted defrag, only
+                             * set when defragging a key scheduled for the
+                             * "late defrag" stage, otherwise NULL. */
+    long defragged;         /* Allocations moved during this callback. */
+} RedisModuleDefragCtx;
+
+/* Defrag a memory allocation previously allocated by RM_Alloc, RM_Realloc,
+ * etc. The defragmentation process involves allocating a new memory block
+ * and copying the contents to it, like realloc().
+ *
+ * If the defragmentation was not necessary or not possible, NULL is
+ * returned and the operation has no other effect, so the caller can keep
+ * using the original pointer. If a non-NULL value is returned, the caller
+ * MUST replace the old pointer with the new returned pointer, and the old
+ * pointer must no longer be used. */
+void *RM_DefragAlloc(RedisModuleDefragCtx *ctx, void *ptr) {
+#ifdef HAVE_DEFRAG
+    void *newptr = activeDefragAlloc(ptr);
+    if (newptr) ctx->defragged++;
+    return newptr;
+#else
+    UNUSED(ctx);
+    UNUSED(ptr);
+    return NULL;
+#endif
+}
+
+/* Defrag a RedisModuleString previously allocated by RM_Alloc,
+ * RM_CreateString, etc. See RM_DefragAlloc() for more information on how
+ * the defragmentation process works.
+ *
+ * NOTE: strings held by the module with a refcount bigger than one are
+ * not defragmented, since they may be shared: in that case NULL is
+ * returned and the string is left in place. */
+RedisModuleString *RM_DefragRedisModuleString(RedisModuleDefragCtx *ctx, RedisModuleString *str) {
+#ifdef HAVE_DEFRAG
+    return activeDefragStringOb(str, &ctx->defragged);
+#else
+    UNUSED(ctx);
+    UNUSED(str);
+    return NULL;
+#endif
+}
+
+/* Returns true if a defrag callback needs to stop processing and return:
+ * the callback should then save its position with RM_DefragCursorSet(),
+ * return 1, and expect to be called again later with the saved cursor to
+ * continue where it left. */
+int RM_DefragShouldStop(RedisModuleDefragCtx *ctx) {
+    return (ctx->endtime != 0 && ctx->endtime < ustime());
+}
+
+/* Store an arbitrary cursor value for future re-use.
+ *
+ * This should only be called if RM_DefragShouldStop() has returned a
+ * non-zero value and the defrag callback is about to exit without fully
+ * iterating its data type.
+ *
+ * Cursors are only supported for keys that were scheduled for a second,
+ * time limited defrag stage because of their size: in that case the
+ * callback is invoked with a valid cursor until it reports completion.
+ * On the first, synchronous attempt cursors are not available, and this
+ * function returns REDISMODULE_ERR: the callback may then simply return
+ * 1 to ask to be called again with cursor support. */
+int RM_DefragCursorSet(RedisModuleDefragCtx *ctx, unsigned long cursor) {
+    if (!ctx->cursor) return REDISMODULE_ERR;
+    *ctx->cursor = cursor;
+    return REDISMODULE_OK;
+}
+
+/* Fetch a cursor value that has been previously stored using
+ * RM_DefragCursorSet().
+ *
+ * If not called for a second defrag stage (see RM_DefragCursorSet()),
+ * REDISMODULE_ERR is returned and the cursor should be ignored. */
+int RM_DefragCursorGet(RedisModuleDefragCtx *ctx, unsigned long *cursor) {
+    if (!ctx->cursor) return REDISMODULE_ERR;
+    *cursor = *ctx->cursor;
+    return REDISMODULE_OK;
+}
+
+/* Defrag callback for the module values scanned by the main defrag loop in
+ * defrag.c. Defrags the moduleValue wrapper itself, then gives the module
+ * a chance to defrag its own data through the 'defrag' type method.
+ *
+ * Returns 1 if the value was fully processed, or 0 if the module asked for
+ * more work: in that case the caller should schedule the key for the time
+ * limited late defrag stage (see moduleLateDefrag()). */
+int moduleDefragValue(robj *key, robj *obj, long *defragged) {
+    moduleValue *mv = obj->ptr, *newmv;
+    moduleType *mt = mv->type;
+
+#ifdef HAVE_DEFRAG
+    if ((newmv = activeDefragAlloc(mv))) {
+        (*defragged)++;
+        obj->ptr = mv = newmv;
+    }
+#else
+    UNUSED(newmv);
+#endif
+
+    if (!mt->defrag) return 1;
+
+    RedisModuleDefragCtx ctx = { 0, NULL, 0 };
+    int more = mt->defrag(&ctx,key,&mv->value);
+    *defragged += ctx.defragged;
+    return more ? 0 : 1;
+}
+
+/* Incremental defrag of a module value scheduled for late defrag: invoked
+ * repeatedly by defragLaterStep() with the deadline and a persistent cursor
+ * until the callback reports completion.
+ *
+ * Returns 1 if the time is up and more work is needed, 0 when done. */
+int moduleLateDefrag(robj *key, robj *obj, unsigned long *cursor, long long endtime, long long *defragged) {
+    /* The value may have been replaced since the key was scheduled. */
+    if (obj->type != OBJ_MODULE) {
+        *cursor = 0;
+        return 0;
+    }
+
+    moduleValue *mv = obj->ptr;
+    moduleType *mt = mv->type;
+
+    if (!mt->defrag) {
+        *cursor = 0;
+        return 0;
+    }
+
+    RedisModuleDefragCtx ctx = { endtime, cursor, 0 };
+    int more = mt->defrag(&ctx,key,&mv->value);
+    *defragged += ctx.defragged;
+    if (!more) *cursor = 0;
+    return more;
+}
+
 /* --------------------------------------------------------------------------
  * Modules API internals
  * -------------------------------------------------------------------------- */
@@ -6880,6 +7469,7 @@ void moduleInitModulesSystem(void) {
 
     /* Set up the keyspace notification susbscriber list and static client */
     moduleKeyspaceSubscribers = listCreate();
+    moduleKeyMissInterceptors = listCreate();
     moduleFreeContextReusedClient = createClient(NULL);
     moduleFreeContextReusedClient->flags |= CLIENT_MODULE;
     moduleFreeContextReusedClient->user = NULL; /* root user. */
@@ -6923,6 +7513,13 @@ void moduleLoadFromQueue(void) {
     listIter li;
     listNode *ln;
 
+    /* The slot scoped GIL mutexes can only be created here, and not in
+     * moduleInitModulesSystem(), because the number of keyspace shards is
+     * not yet known when the modules system is initialized. */
+    moduleSlotGIL = zmalloc(sizeof(pthread_mutex_t)*server.db_dict_shards);
+    for (int j = 0; j < server.db_dict_shards; j++)
+        pthread_mutex_init(&moduleSlotGIL[j],NULL);
+
     listRewind(server.loadmodule_queue,&li);
     while((ln = listNext(&li))) {
         struct moduleLoadQueueEntry *loadmod = ln->value;
@@ -6960,12 +7557,17 @@ void moduleUnregisterCommands(struct RedisModule *module) {
                 dictDelete(server.commands,cmdname);
                 dictDelete(server.orig_commands,cmdname);
                 sdsfree(cmdname);
+                zfree(cp->rediscmd->latency_histogram);
                 zfree(cp->rediscmd);
                 zfree(cp);
             }
         }
     }
     dictReleaseIterator(di);
+    rebuildCommandLookupFastTable();
+    /* The scripting engine may hold a direct pointer to one of the
+     * commands we just freed. */
+    scriptingClearCommandCache();
 }
 
 /* Load a module and initialize it. On success C_OK is returned, otherwise
@@ -7063,6 +7665,7 @@ int moduleUnload(sds name) {
 
     /* Remove any notification subscribers this module might have */
     moduleUnsubscribeNotifications(module);
+    moduleUnregisterKeyMissInterceptors(module);
     moduleUnsubscribeAllServerEvents(module);
 
     /* Unload the dynamic library. */
@@ -7339,6 +7942,7 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(GetSelectedDb);
     REGISTER_API(SelectDb);
     REGISTER_API(OpenKey);
+    REGISTER_API(OpenKeys);
     REGISTER_API(CloseKey);
     REGISTER_API(KeyType);
     REGISTER_API(ValueLength);
@@ -7348,6 +7952,7 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(StringToDouble);
     REGISTER_API(StringToLongDouble);
     REGISTER_API(Call);
+    REGISTER_API(CallBatch);
     REGISTER_API(CallReplyProto);
     REGISTER_API(FreeCallReply);
     REGISTER_API(CallReplyInteger);
@@ -7391,6 +7996,7 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(ZsetRangeEndReached);
     REGISTER_API(HashSet);
     REGISTER_API(HashGet);
+    REGISTER_API(HashGetMulti);
     REGISTER_API(IsKeysPositionRequest);
     REGISTER_API(KeyAtPos);
     REGISTER_API(GetClientId);
@@ -7442,12 +8048,18 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(FreeThreadSafeContext);
     REGISTER_API(ThreadSafeContextLock);
     REGISTER_API(ThreadSafeContextUnlock);
+    REGISTER_API(ThreadSafeContextLockSlot);
+    REGISTER_API(ThreadSafeContextUnlockSlot);
+    REGISTER_API(GetKeySlot);
+    REGISTER_API(GetKeySlotCount);
     REGISTER_API(DigestAddStringBuffer);
     REGISTER_API(DigestAddLongLong);
     REGISTER_API(DigestEndSequence);
     REGISTER_API(NotifyKeyspaceEvent);
     REGISTER_API(GetNotifyKeyspaceEvents);
     REGISTER_API(SubscribeToKeyspaceEvents);
+    REGISTER_API(InterceptKeyMisses);
+    REGISTER_API(RetryCommand);
     REGISTER_API(RegisterClusterMessageReceiver);
     REGISTER_API(SendClusterMessage);
     REGISTER_API(GetClusterNodeInfo);
@@ -7531,4 +8143,9 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(ScanCursorRestart);
     REGISTER_API(Scan);
     REGISTER_API(ScanKey);
+    REGISTER_API(DefragAlloc);
+    REGISTER_API(DefragRedisModuleString);
+    REGISTER_API(DefragShouldStop);
+    REGISTER_API(DefragCursorSet);
+    REGISTER_API(DefragCursorGet);
 }
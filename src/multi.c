@@ -31,11 +31,46 @@
 
 /* ================================ MULTI/EXEC ============================== */
 
+/* The argument vectors of the queued commands are carved out of a
+ * per-client arena of robj pointer slots, released in a single pass when
+ * the transaction ends (EXEC, DISCARD, disconnection), instead of with
+ * one heap allocation per queued command. Blocks are chained and never
+ * reallocated, so the vectors stay stable while the queue grows. */
+#define MULTI_ARENA_MIN_SLOTS 128
+typedef struct multiArgvBlock {
+    struct multiArgvBlock *next;    /* Older, exhausted blocks. */
+    int used;                       /* Slots used in this block. */
+    int size;                       /* Total slots in this block. */
+    robj *slots[];
+} multiArgvBlock;
+
+/* Carve an argument vector of 'count' slots out of the arena. */
+static robj **multiArenaAlloc(multiState *ms, int count) {
+    multiArgvBlock *b = ms->arena;
+
+    if (b == NULL || b->size - b->used < count) {
+        int size = b ? b->size*2 : MULTI_ARENA_MIN_SLOTS;
+        if (size < count) size = count;
+        b = zmalloc(sizeof(*b)+sizeof(robj*)*size);
+        b->next = ms->arena;
+        b->used = 0;
+        b->size = size;
+        ms->arena = b;
+    }
+    robj **argv = b->slots+b->used;
+    b->used += count;
+    return argv;
+}
+
 /* Client state initialization for MULTI/EXEC */
 void initClientMultiState(client *c) {
     c->mstate.commands = NULL;
     c->mstate.count = 0;
+    c->mstate.size = 0;
     c->mstate.cmd_flags = 0;
+    c->mstate.arena = NULL;
+    c->mstate.acl_user = NULL;
+    c->mstate.acl_generation = 0;
 }
 
 /* Release all the resources associated with MULTI/EXEC state */
@@ -48,9 +83,16 @@ void freeClientMultiState(client *c) {
 
         for (i = 0; i < mc->argc; i++)
             decrRefCount(mc->argv[i]);
-        zfree(mc->argv);
+        /* Vectors living in the arena are released with it below. */
+        if (mc->argv_heap) zfree(mc->argv);
     }
     zfree(c->mstate.commands);
+    multiArgvBlock *b = c->mstate.arena;
+    while (b) {
+        multiArgvBlock *next = b->next;
+        zfree(b);
+        b = next;
+    }
 }
 
 /* Add a new command into the MULTI commands queue */
@@ -58,12 +100,18 @@ void queueMultiCommand(client *c) {
     multiCmd *mc;
     int j;
 
-    c->mstate.commands = zrealloc(c->mstate.commands,
-            sizeof(multiCmd)*(c->mstate.count+1));
+    /* Grow the queue geometrically: reallocating for every queued command
+     * turns long transactions into quadratic work. */
+    if (c->mstate.count == c->mstate.size) {
+        c->mstate.size = c->mstate.size ? c->mstate.size*2 : 8;
+        c->mstate.commands = zrealloc(c->mstate.commands,
+                sizeof(multiCmd)*c->mstate.size);
+    }
     mc = c->mstate.commands+c->mstate.count;
     mc->cmd = c->cmd;
     mc->argc = c->argc;
-    mc->argv = zmalloc(sizeof(robj*)*c->argc);
+    mc->argv = multiArenaAlloc(&c->mstate,c->argc);
+    mc->argv_heap = 0;
     memcpy(mc->argv,c->argv,sizeof(robj*)*c->argc);
     for (j = 0; j < c->argc; j++)
         incrRefCount(mc->argv[j]);
@@ -91,6 +139,10 @@ void multiCommand(client *c) {
         return;
     }
     c->flags |= CLIENT_MULTI;
+    /* Remember the context the queued commands will be validated in, so
+     * that EXEC can tell whether their ACL checks are still valid. */
+    c->mstate.acl_user = c->user;
+    c->mstate.acl_generation = server.acl_generation;
     addReply(c,shared.ok);
 }
 
@@ -116,7 +168,7 @@ void execCommandPropagateMulti(client *c) {
 void execCommand(client *c) {
     int j;
     robj **orig_argv;
-    int orig_argc;
+    int orig_argc, orig_argv_len;
     struct redisCommand *orig_cmd;
     int must_propagate = 0; /* Need to propagate MULTI/EXEC to AOF / slaves? */
     int was_master = server.masterhost == NULL;
@@ -157,13 +209,25 @@ void execCommand(client *c) {
     /* Exec all the queued commands */
     unwatchAllKeys(c); /* Unwatch ASAP otherwise we'll waste CPU cycles */
     orig_argv = c->argv;
+    orig_argv_len = c->argv_len;
     orig_argc = c->argc;
     orig_cmd = c->cmd;
+
+    /* The ACL check of every queued command already ran when it was
+     * queued: repeat it at EXEC time only if the permissions may have
+     * changed in between, that is, if the client switched user or the
+     * ACL rules were modified. */
+    int acl_recheck = c->user != c->mstate.acl_user ||
+                      c->mstate.acl_generation != server.acl_generation;
+
     addReplyArrayLen(c,c->mstate.count);
     for (j = 0; j < c->mstate.count; j++) {
-        c->argc = c->mstate.commands[j].argc;
-        c->argv = c->mstate.commands[j].argv;
-        c->cmd = c->mstate.commands[j].cmd;
+        multiCmd *mc = c->mstate.commands+j;
+
+        c->argc = mc->argc;
+        c->argv = mc->argv;
+        c->cmd = mc->cmd;
+        if (!mc->argv_heap) c->flags |= CLIENT_ARGV_BORROWED;
 
         /* Propagate a MULTI request once we encounter the first command which
          * is not readonly nor an administrative one.
@@ -173,9 +237,13 @@ void execCommand(client *c) {
         if (!must_propagate && !(c->cmd->flags & (CMD_READONLY|CMD_ADMIN))) {
             execCommandPropagateMulti(c);
             must_propagate = 1;
+            /* From here on the effects stream is buffered so that
+             * multiple writes to the same key can be merged before it
+             * is flushed. */
+            propagateCoalesceStart();
         }
 
-        int acl_retval = ACLCheckCommandPerm(c);
+        int acl_retval = acl_recheck ? ACLCheckCommandPerm(c) : ACL_OK;
         if (acl_retval != ACL_OK) {
             addReplyErrorFormat(c,
                 "-NOPERM ACLs rules changed between the moment the "
@@ -190,11 +258,19 @@ void execCommand(client *c) {
         }
 
         /* Commands may alter argc/argv, restore mstate. */
-        c->mstate.commands[j].argc = c->argc;
-        c->mstate.commands[j].argv = c->argv;
-        c->mstate.commands[j].cmd = c->cmd;
+        c->flags &= ~CLIENT_ARGV_BORROWED;
+        mc->argc = c->argc;
+        if (c->argv != mc->argv) {
+            /* The command replaced its vector with a fresh heap
+             * allocation: the old arena slice is dead, and the new
+             * vector must be freed with the transaction. */
+            mc->argv = c->argv;
+            mc->argv_heap = 1;
+        }
+        mc->cmd = c->cmd;
     }
     c->argv = orig_argv;
+    c->argv_len = orig_argv_len;
     c->argc = orig_argc;
     c->cmd = orig_cmd;
     discardTransaction(c);
@@ -203,6 +279,7 @@ void execCommand(client *c) {
      * was already propagated. */
     if (must_propagate) {
         int is_master = server.masterhost == NULL;
+        propagateCoalesceEnd();
         server.dirty++;
         /* If inside the MULTI/EXEC block this instance was suddenly
          * switched from master to slave (using the SLAVEOF command), the
@@ -211,7 +288,7 @@ void execCommand(client *c) {
          * backlog with the final EXEC. */
         if (server.repl_backlog && was_master && !is_master) {
             char *execcmd = "*1\r\n$4\r\nEXEC\r\n";
-            feedReplicationBacklog(execcmd,strlen(execcmd));
+            feedReplicationBuffer(execcmd,strlen(execcmd));
         }
     }
 
@@ -221,8 +298,8 @@ handle_monitor:
      * MUTLI, EXEC, ... commands inside transaction ...
      * Instead EXEC is flagged as CMD_SKIP_MONITOR in the command
      * table, and we do it here with correct ordering. */
-    if (listLength(server.monitors) && !server.loading)
-        replicationFeedMonitors(c,server.monitors,c->db->id,c->argv,c->argc);
+    if (auditEnabled() && !server.loading)
+        auditFeedCommand(c,c->db->id,c->argv,c->argc);
 }
 
 /* ===================== WATCH (CAS alike for MULTI/EXEC) ===================
@@ -341,7 +418,7 @@ void touchWatchedKeysOnFlush(int dbid) {
              * key exists, mark the client as dirty, as the key will be
              * removed. */
             if (dbid == -1 || wk->db->id == dbid) {
-                if (dictFind(wk->db->dict, wk->key->ptr) != NULL)
+                if (dictFind(dbGetDict(wk->db,wk->key->ptr), wk->key->ptr) != NULL)
                     c->flags |= CLIENT_DIRTY_CAS;
             }
         }
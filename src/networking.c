@@ -33,9 +33,18 @@
 #include <sys/uio.h>
 #include <math.h>
 #include <ctype.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_PROTO_AVX2 1
+#include <immintrin.h>
+#endif
 
 static void setProtocolError(const char *errstr, client *c);
+static void clientCheckObufBackpressureRelease(client *c);
 int postponeClientRead(client *c);
+extern _Thread_local int io_threads_executing_command;
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -56,22 +65,219 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* Size of the per-client reply arena: enough for a few pipelined replies
+ * spilling past the client static buffer. Anything that does not fit is
+ * allocated with zmalloc() as before. */
+#define PROTO_REPLY_ARENA_BYTES (PROTO_REPLY_CHUNK_BYTES*4)
+
+/* Allocate a clientReplyBlock able to hold at least 'payload' bytes in
+ * buf[]. The block is carved from the client reply arena when there is
+ * room, creating the arena on first use, and falls back to the heap
+ * otherwise. On return 'size' is set to the usable payload capacity and
+ * 'arena' tells freeClientReplyValue() how to release the block; the
+ * caller fills the remaining fields. */
+static clientReplyBlock *replyBlockAlloc(client *c, size_t payload) {
+    clientReplyBlock *block;
+    /* Keep the blocks aligned as malloc would. */
+    size_t need = sizeof(clientReplyBlock) + payload;
+    need = (need + (sizeof(long)-1)) & ~(sizeof(long)-1);
+
+    replyArena *arena = c->reply_arena;
+    if (arena == NULL && need <= PROTO_REPLY_ARENA_BYTES) {
+        arena = zmalloc_typed(ZMALLOC_TYPE_TRANSIENT,
+                              sizeof(replyArena) + PROTO_REPLY_ARENA_BYTES);
+        arena->size = PROTO_REPLY_ARENA_BYTES;
+        arena->used = 0;
+        arena->live = 0;
+        c->reply_arena = arena;
+    }
+    if (arena && arena->size - arena->used >= need) {
+        block = (clientReplyBlock*)(arena->buf + arena->used);
+        arena->used += need;
+        arena->live++;
+        block->size = need - sizeof(clientReplyBlock);
+        block->arena = arena;
+        return block;
+    }
+    block = zmalloc_typed(ZMALLOC_TYPE_TRANSIENT,
+                          sizeof(clientReplyBlock) + payload);
+    /* Take over the allocation's internal fragmentation. */
+    block->size = zmalloc_usable(block) - sizeof(clientReplyBlock);
+    block->arena = NULL;
+    return block;
+}
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
+    clientReplyBlock *buf;
+
+    /* The copy always lives on the heap: the duplicated list is attached
+     * to a different client than the one owning the arena. */
+    if (old->blob) {
+        /* Blocks referencing a string object have no embedded payload:
+         * just duplicate the header and share another reference. */
+        buf = zmalloc(sizeof(clientReplyBlock));
+        *buf = *old;
+        buf->arena = NULL;
+        incrRefCount(buf->blob);
+        return buf;
+    }
+    buf = zmalloc(sizeof(clientReplyBlock) + old->size);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    buf->arena = NULL;
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
-    zfree(o);
+    clientReplyBlock *block = o;
+    if (block == NULL) return;
+    if (block->blob) decrRefCount(block->blob);
+    if (block->arena) {
+        /* Arena blocks are not returned one by one: once the last one is
+         * gone (the reply list was fully flushed) rewind the arena so the
+         * space is reused for the next replies. */
+        replyArena *arena = block->arena;
+        serverAssert(arena->live > 0);
+        if (--arena->live == 0) arena->used = 0;
+    } else {
+        zfree(o);
+    }
 }
 
 int listMatchObjects(void *a, void *b) {
     return equalStringObjects(a,b);
 }
 
+/* Add the client to one of the secondary indexes (peer address or name)
+ * mapping an sds key to the list of matching clients. */
+static void clientIndexAdd(dict *index, sds key, client *c) {
+    dictEntry *de = dictFind(index,key);
+    list *l;
+
+    if (de == NULL) {
+        l = listCreate();
+        dictAdd(index,sdsdup(key),l);
+    } else {
+        l = dictGetVal(de);
+    }
+    listAddNodeTail(l,c);
+}
+
+/* Remove the client from a secondary index, dropping the whole bucket
+ * when it becomes empty. */
+static void clientIndexRemove(dict *index, sds key, client *c) {
+    dictEntry *de = dictFind(index,key);
+
+    if (de == NULL) return;
+    list *l = dictGetVal(de);
+    listNode *ln = listSearchKey(l,c);
+    if (ln) listDelNode(l,ln);
+    if (listLength(l) == 0) dictDelete(index,key);
+}
+
+/* ----------------------------- Query buffer pool -------------------------
+ * Under connection churn workloads the allocation and release of query
+ * buffers is a visible fraction of the allocator traffic: every new
+ * connection grows a fresh buffer to at least PROTO_IOBUF_LEN on its first
+ * read, just to throw it away when the connection closes. We recycle the
+ * buffers instead, in a small per-thread pool (each I/O thread parses its
+ * own clients, so thread local storage makes the pool lock free).
+ *
+ * The pool holds buffers in power-of-four capacity classes. Releasing a
+ * buffer files it under the class of its *lower* bound, so any buffer
+ * popped from class N is guaranteed to hold at least the class N lower
+ * bound without reallocating. */
+#define QUERYBUF_POOL_CLASSES 4
+#define QUERYBUF_POOL_MIN_SIZE (1024*16) /* Class 0 lower bound. */
+static const int querybuf_pool_limit[QUERYBUF_POOL_CLASSES] = {16, 8, 4, 2};
+static __thread sds querybuf_pool[QUERYBUF_POOL_CLASSES][16];
+static __thread int querybuf_pool_count[QUERYBUF_POOL_CLASSES];
+
+/* Return the pool class for a buffer of 'size' usable bytes: 0 for
+ * [16KB,64KB), 1 for [64KB,256KB) and so forth, or -1 when the size is
+ * below the smallest class. Sizes past the top class cap at the last one
+ * for lookup purposes (callers check the actual capacity). */
+static int queryBufferPoolClass(size_t size) {
+    if (size < QUERYBUF_POOL_MIN_SIZE) return -1;
+    int class = 0;
+    size_t bound = QUERYBUF_POOL_MIN_SIZE;
+    while (class < QUERYBUF_POOL_CLASSES-1 && size >= bound*4) {
+        bound *= 4;
+        class++;
+    }
+    return class;
+}
+
+/* Return an empty query buffer able to hold at least 'wanted' bytes,
+ * reusing a pooled buffer when one is available. With 'wanted' zero any
+ * pooled buffer (or a fresh empty sds) is returned. */
+static sds queryBufferGet(size_t wanted) {
+    int class = wanted ? queryBufferPoolClass(wanted) : 0;
+    if (class != -1) {
+        /* A buffer filed under 'class' is only guaranteed to hold the
+         * class lower bound: when 'wanted' exceeds it look one class up. */
+        size_t bound = QUERYBUF_POOL_MIN_SIZE << (2*class);
+        if (wanted > bound) class++;
+        for (int j = class; j < QUERYBUF_POOL_CLASSES; j++) {
+            if (querybuf_pool_count[j] == 0) continue;
+            sds buf = querybuf_pool[j][--querybuf_pool_count[j]];
+            serverAssert(sdsalloc(buf) >= wanted);
+            return buf;
+        }
+    }
+    if (wanted == 0) return sdsempty();
+    sds buf = sdsnewlen(SDS_NOINIT,wanted);
+    sdsclear(buf);
+    return buf;
+}
+
+/* Return a query buffer to the pool of the calling thread, or free it when
+ * it is too small to be worth recycling or its class is full. */
+static void queryBufferRelease(sds buf) {
+    if (buf == NULL) return;
+    int class = queryBufferPoolClass(sdsalloc(buf));
+    if (class == -1 || querybuf_pool_count[class] >= querybuf_pool_limit[class]) {
+        sdsfree(buf);
+        return;
+    }
+    sdsclear(buf);
+    querybuf_pool[class][querybuf_pool_count[class]++] = buf;
+}
+
+/* ---------------------------- Client recycling ---------------------------
+ * The client structure is large and drags half a dozen container
+ * allocations with it (reply list, blocking and pubsub dicts, watched keys
+ * list), so connection churn pays a visible malloc/init tax on every
+ * accept. Instead of tearing a disconnected client fully down we park the
+ * struct, with its containers emptied but still allocated and the argv
+ * vector capacity preserved, in a small per-thread free list that
+ * createClient() pops from. As with the query buffer pool above, thread
+ * local storage keeps this lock free: each thread recycles only clients it
+ * freed itself. */
+#define CLIENT_POOL_MAX 64
+static __thread client *client_pool[CLIENT_POOL_MAX];
+static __thread int client_pool_count = 0;
+
+/* Return a parked client struct, or NULL when the pool is empty and the
+ * caller should allocate and fully initialize a fresh one. */
+static client *clientPoolGet(void) {
+    if (client_pool_count == 0) return NULL;
+    return client_pool[--client_pool_count];
+}
+
+/* Return non zero when the calling thread has room to park one more
+ * client: freeClient() uses this to decide between recycling the client
+ * containers and releasing them for good. */
+static int clientPoolCanPark(void) {
+    return client_pool_count < CLIENT_POOL_MAX;
+}
+
+static void clientPoolPark(client *c) {
+    serverAssert(client_pool_count < CLIENT_POOL_MAX);
+    client_pool[client_pool_count++] = c;
+}
+
 /* This function links the client to the global linked list of clients.
  * unlinkClient() does the opposite, among other things. */
 void linkClient(client *c) {
@@ -82,10 +288,15 @@ void linkClient(client *c) {
     c->client_list_node = listLast(server.clients);
     uint64_t id = htonu64(c->id);
     raxInsert(server.clients_index,(unsigned char*)&id,sizeof(id),c,NULL);
+    clientIndexAdd(server.clients_by_addr,getClientPeerId(c),c);
 }
 
 client *createClient(connection *conn) {
-    client *c = zmalloc(sizeof(client));
+    client *c = clientPoolGet();
+    /* A recycled client keeps its (empty) containers and the argv vector
+     * capacity: only allocate them for a brand new struct. */
+    int recycled = (c != NULL);
+    if (!recycled) c = zmalloc(sizeof(client));
 
     /* passing NULL as conn it is possible to create a non connected client.
      * This is useful since all the commands needs to be executed
@@ -108,19 +319,33 @@ client *createClient(connection *conn) {
     c->name = NULL;
     c->bufpos = 0;
     c->qb_pos = 0;
-    c->querybuf = sdsempty();
+    c->querybuf = queryBufferGet(0);
     c->pending_querybuf = sdsempty();
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
-    c->argv = NULL;
+    if (!recycled) {
+        c->argv = NULL;
+        c->argv_len = 0;
+        c->argv_pool_count = 0;
+    }
     c->cmd = c->lastcmd = NULL;
     c->user = DefaultUser;
+    c->acl_cmd_generation = 0;
+    c->acl_cmd_user = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
     c->sentlen = 0;
     c->flags = 0;
     c->ctime = c->lastinteraction = server.unixtime;
+    c->timeout_deadline = 0;
+    c->command_time_limit = 0;
+    /* Connected clients are subject to the idle timeout: give them their
+     * entry in the timeout table. Deadlines are refreshed lazily when they
+     * fire, see blocked.c. */
+    if (conn && server.maxidletime)
+        addClientToTimeoutTable(c,
+            ((mstime_t)c->lastinteraction+server.maxidletime)*1000);
     /* If the default user does not require authentication, the user is
      * directly authenticated. */
     c->authenticated = (c->user->flags & USER_FLAG_NOPASS) != 0;
@@ -133,14 +358,26 @@ client *createClient(connection *conn) {
     c->slave_listening_port = 0;
     c->slave_ip[0] = '\0';
     c->slave_capa = SLAVE_CAPA_NONE;
-    c->reply = listCreate();
+    c->rdb_pipe_chunk = NULL;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
+    c->repl_codec = NULL;
+    c->repl_frame_buf = NULL;
+    c->repl_frame_sent = 0;
+    if (!recycled) {
+        c->reply = listCreate();
+        listSetFreeMethod(c->reply,freeClientReplyValue);
+        listSetDupMethod(c->reply,dupClientReplyValue);
+    }
+    c->reply_arena = NULL;
     c->reply_bytes = 0;
+    c->deferred_reply_nodes = 0;
     c->obuf_soft_limit_reached_time = 0;
-    listSetFreeMethod(c->reply,freeClientReplyValue);
-    listSetDupMethod(c->reply,dupClientReplyValue);
     c->btype = BLOCKED_NONE;
+    c->cold_faults = 0;
     c->bpop.timeout = 0;
-    c->bpop.keys = dictCreate(&objectKeyHeapPointerValueDictType,NULL);
+    if (!recycled)
+        c->bpop.keys = dictCreate(&objectKeyHeapPointerValueDictType,NULL);
     c->bpop.target = NULL;
     c->bpop.xread_group = NULL;
     c->bpop.xread_consumer = NULL;
@@ -148,14 +385,19 @@ client *createClient(connection *conn) {
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
     c->woff = 0;
-    c->watched_keys = listCreate();
-    c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
-    c->pubsub_patterns = listCreate();
+    if (!recycled) {
+        c->watched_keys = listCreate();
+        c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
+        c->pubsub_patterns = listCreate();
+        listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
+        listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
+        c->pubsub_conflated = NULL;
+    }
     c->peerid = NULL;
     c->client_list_node = NULL;
     c->client_tracking_redirection = 0;
-    listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
-    listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
+    c->tracking_pending = NULL;
+    c->tracking_epoch = 0;
     if (conn) linkClient(c);
     initClientMultiState(c);
     return c;
@@ -222,11 +464,22 @@ int prepareClientToWrite(client *c) {
     if ((c->flags & CLIENT_MASTER) &&
         !(c->flags & CLIENT_MASTER_FORCE_REPLY)) return C_ERR;
 
+    /* Replicas stream directly from the shared replication buffer, their
+     * private output buffers are never used (monitors are an exception,
+     * they are fed with addReply() as normal clients). */
+    if ((c->flags & CLIENT_SLAVE) && !(c->flags & CLIENT_MONITOR))
+        return C_ERR;
+
     if (!c->conn) return C_ERR; /* Fake client for AOF loading. */
 
     /* Schedule the client to write the output buffers to the socket, unless
-     * it should already be setup to do so (it has already pending data). */
-    if (!clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+     * it should already be setup to do so (it has already pending data).
+     *
+     * If CLIENT_PENDING_READ is set, we're in an IO thread and should
+     * not install a write handler. Instead, it will be done by
+     * handleClientsWithPendingReadsUsingThreads() upon return. */
+    if (!clientHasPendingReplies(c) && !(c->flags & CLIENT_PENDING_READ))
+        clientInstallWriteHandler(c);
 
     /* Authorize the caller to queue in the output buffer of this client. */
     return C_OK;
@@ -263,7 +516,9 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
      * addDeferredMultiBulkLength() is used, it sets a dummy node to NULL just
      * fo fill it later, when the size of the bulk length is set. */
 
-    /* Append to tail string when possible. */
+    /* Append to tail string when possible. Blocks referencing a string
+     * object have no embedded buffer to append to. */
+    if (tail && tail->blob) tail = NULL;
     if (tail) {
         /* Copy the part we can fit into the tail, and leave the rest for a
          * new node */
@@ -278,10 +533,9 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         /* Create a new node, make sure it is allocated to at
          * least PROTO_REPLY_CHUNK_BYTES */
         size_t size = len < PROTO_REPLY_CHUNK_BYTES? PROTO_REPLY_CHUNK_BYTES: len;
-        tail = zmalloc(size + sizeof(clientReplyBlock));
-        /* take over the allocation's internal fragmentation */
-        tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
+        tail = replyBlockAlloc(c,size);
         tail->used = len;
+        tail->blob = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -289,6 +543,25 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Append a block referencing a range of the payload of the string object
+ * 'o' to the reply list, without copying it: the block holds a reference
+ * to the object and the payload is read directly at socket write time.
+ * Only called for large sds encoded payloads, where saving the copy is
+ * worth the extra list node and iovec entry. */
+void _addReplyBlobRangeToList(client *c, robj *o, size_t start, size_t len) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    clientReplyBlock *tail = replyBlockAlloc(c,0);
+    tail->used = len;
+    tail->size = getStringObjectSdsUsedMemory(o);
+    tail->blob = o;
+    tail->blob_off = start;
+    incrRefCount(o);
+    listAddNodeTail(c->reply, tail);
+    c->reply_bytes += tail->size;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -299,7 +572,15 @@ void addReply(client *c, robj *obj) {
     if (prepareClientToWrite(c) != C_OK) return;
 
     if (sdsEncodedObject(obj)) {
-        if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
+        /* Large payloads are referenced in the reply list instead of
+         * copied, and sent with a gathered write. Fake clients (Lua,
+         * modules) read the protocol back from the embedded buffers, so
+         * they always get a copy. */
+        if (c->conn && obj->encoding == OBJ_ENCODING_RAW &&
+            sdslen(obj->ptr) >= PROTO_REPLY_ZEROCOPY_MIN_SIZE)
+        {
+            _addReplyBlobRangeToList(c,obj,0,sdslen(obj->ptr));
+        } else if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
             _addReplyProtoToList(c,obj->ptr,sdslen(obj->ptr));
     } else if (obj->encoding == OBJ_ENCODING_INT) {
         /* For integer encoded strings we just convert it into a string
@@ -423,6 +704,7 @@ void *addReplyDeferredLen(client *c) {
      * event loop setDeferredAggregateLen() will be called. */
     if (prepareClientToWrite(c) != C_OK) return NULL;
     listAddNodeTail(c->reply,NULL); /* NULL is our placeholder. */
+    c->deferred_reply_nodes++;
     return listLast(c->reply);
 }
 
@@ -437,6 +719,7 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
      * we return NULL in addReplyDeferredLen() */
     if (node == NULL) return;
     serverAssert(!listNodeValue(ln));
+    c->deferred_reply_nodes--;
 
     /* Normally we fill this dummy NULL node, added by addReplyDeferredLen(),
      * with a new buffer structure containing the protocol needed to specify
@@ -449,6 +732,7 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
      * - It has enough room already allocated
      * - And not too large (avoid large memmove) */
     if (ln->next != NULL && (next = listNodeValue(ln->next)) &&
+        next->blob == NULL &&
         next->size - next->used >= lenstr_len &&
         next->used < PROTO_REPLY_CHUNK_BYTES * 4) {
         memmove(next->buf + lenstr_len, next->buf, next->used);
@@ -457,10 +741,9 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
         listDelNode(c->reply,ln);
     } else {
         /* Create a new node */
-        clientReplyBlock *buf = zmalloc(lenstr_len + sizeof(clientReplyBlock));
-        /* Take over the allocation's internal fragmentation */
-        buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
+        clientReplyBlock *buf = replyBlockAlloc(c,lenstr_len);
         buf->used = lenstr_len;
+        buf->blob = NULL;
         memcpy(buf->buf, lenstr, lenstr_len);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -483,6 +766,66 @@ void setDeferredSetLen(client *c, void *node, long length) {
     setDeferredAggregateLen(c,node,length,prefix);
 }
 
+/* Try to flush what is already accumulated in the output buffers of 'c'
+ * to the socket, in the middle of the execution of a command emitting a
+ * very long multi bulk reply (HGETALL against a huge hash and friends).
+ * This keeps the peak reply memory of a client that reads fast bounded by
+ * reply-stream-bytes instead of the fully materialized reply. When the
+ * socket would block, the data is left in the buffers and delivered later
+ * by the normal write path, and the usual output buffer limits apply.
+ *
+ * The flush is skipped for clients without a real connection (Lua, module
+ * and AOF loading fake clients), for replicas and monitors that receive
+ * the replication stream, while a command executes on an I/O thread, and
+ * while a deferred length placeholder is pending, since writeToClient()
+ * can't skip the NULL node. */
+void replyStreamFlushIfNeeded(client *c) {
+    if (server.reply_stream_bytes == 0) return;
+    if ((size_t)c->bufpos + c->reply_bytes < server.reply_stream_bytes)
+        return;
+    if (!c->conn || c->deferred_reply_nodes ||
+        io_threads_executing_command ||
+        c->flags & (CLIENT_SLAVE|CLIENT_MONITOR|CLIENT_LUA|CLIENT_MODULE|
+                    CLIENT_CLOSE_ASAP))
+        return;
+    writeToClient(c,0);
+}
+
+/* Take a snapshot of the current reply position of the client. Paired
+ * with replyCheckpointRewind() by long iterating commands that may need
+ * to abort with an error after part of the reply was already emitted,
+ * typically when commandDeadlineReached() fires. */
+void replyCheckpointSet(client *c, replyCheckpoint *cp) {
+    cp->bufpos = c->bufpos;
+    cp->tail = listLast(c->reply);
+    cp->tailused = (cp->tail && listNodeValue(cp->tail)) ?
+        ((clientReplyBlock*)listNodeValue(cp->tail))->used : 0;
+    cp->reply_bytes = c->reply_bytes;
+    cp->net_output_bytes = server.stat_net_output_bytes;
+}
+
+/* Discard everything the client reply accumulated since the checkpoint
+ * was taken. Returns C_ERR without touching anything when part of that
+ * output already reached the socket (replyStreamFlushIfNeeded() flushed
+ * it), since emitted protocol can't be taken back: in that case the
+ * caller must complete the reply normally. Deferred length placeholders
+ * added after the checkpoint are dropped too, and must not be filled by
+ * the caller afterwards. */
+int replyCheckpointRewind(client *c, replyCheckpoint *cp) {
+    listNode *ln;
+
+    if (cp->net_output_bytes != server.stat_net_output_bytes) return C_ERR;
+    while ((ln = listLast(c->reply)) != NULL && ln != cp->tail) {
+        if (listNodeValue(ln) == NULL) c->deferred_reply_nodes--;
+        listDelNode(c->reply,ln);
+    }
+    if (cp->tail && listNodeValue(cp->tail))
+        ((clientReplyBlock*)listNodeValue(cp->tail))->used = cp->tailused;
+    c->bufpos = cp->bufpos;
+    c->reply_bytes = cp->reply_bytes;
+    return C_OK;
+}
+
 void setDeferredAttributeLen(client *c, void *node, long length) {
     int prefix = c->resp == 2 ? '*' : '|';
     if (c->resp == 2) length *= 2;
@@ -506,16 +849,29 @@ void addReplyDouble(client *c, double d) {
                               d > 0 ? 6 : 7);
         }
     } else {
-        char dbuf[MAX_LONG_DOUBLE_CHARS+3],
-             sbuf[MAX_LONG_DOUBLE_CHARS+32];
-        int dlen, slen;
+        /* Format the double at a fixed offset inside the buffer, leaving
+         * enough room before it for the "$<len>\r\n" header, so the whole
+         * reply is emitted with a single call. d2string() uses the fast
+         * shortest-representation conversion of util.c instead of the
+         * much slower snprintf("%.17g") this function used to call. */
+        char dbuf[DOUBLE_STR_SIZE+16];
+        int dlen, start;
         if (c->resp == 2) {
-            dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
-            slen = snprintf(sbuf,sizeof(sbuf),"$%d\r\n%s\r\n",dlen,dbuf);
-            addReplyProto(c,sbuf,slen);
+            dlen = d2string(dbuf+7,DOUBLE_STR_SIZE,d);
+            start = 7-digits10(dlen)-3;
+            dbuf[start] = '$';
+            ll2string(dbuf+start+1,sizeof(dbuf)-start-1,dlen);
+            dbuf[5] = '\r';
+            dbuf[6] = '\n';
+            dbuf[dlen+7] = '\r';
+            dbuf[dlen+8] = '\n';
+            addReplyProto(c,dbuf+start,dlen+9-start);
         } else {
-            dlen = snprintf(dbuf,sizeof(dbuf),",%.17g\r\n",d);
-            addReplyProto(c,dbuf,dlen);
+            dbuf[0] = ',';
+            dlen = d2string(dbuf+1,DOUBLE_STR_SIZE,d);
+            dbuf[dlen+1] = '\r';
+            dbuf[dlen+2] = '\n';
+            addReplyProto(c,dbuf,dlen+3);
         }
     }
 }
@@ -537,6 +893,33 @@ void addReplyHumanLongDouble(client *c, long double d) {
     }
 }
 
+/* Precomputed "$<len>\r\n" and "*<len>\r\n" headers for every length up
+ * to REPLY_CACHED_HDR_LEN. The shared.bulkhdr objects cover only the
+ * first OBJ_SHARED_BULKHDR_LEN lengths, while almost every bulk emitted
+ * by real workloads is shorter than 1024 bytes: a flat table turns the
+ * header emission into a single memcpy without the robj indirection nor
+ * a ll2string() call. */
+#define REPLY_CACHED_HDR_LEN 1024
+static char cached_bulkhdr[REPLY_CACHED_HDR_LEN][8];
+static char cached_mbulkhdr[REPLY_CACHED_HDR_LEN][8];
+static uint8_t cached_bulkhdr_len[REPLY_CACHED_HDR_LEN];
+
+/* Fill the cached header tables above. Called once at startup by
+ * createSharedObjects(). */
+void createCachedReplyHeaders(void) {
+    for (int j = 0; j < REPLY_CACHED_HDR_LEN; j++) {
+        char numbuf[8];
+        int len = ll2string(numbuf,sizeof(numbuf),j);
+        cached_bulkhdr[j][0] = '$';
+        cached_mbulkhdr[j][0] = '*';
+        memcpy(cached_bulkhdr[j]+1,numbuf,len);
+        memcpy(cached_mbulkhdr[j]+1,numbuf,len);
+        memcpy(cached_bulkhdr[j]+1+len,"\r\n",2);
+        memcpy(cached_mbulkhdr[j]+1+len,"\r\n",2);
+        cached_bulkhdr_len[j] = len+3;
+    }
+}
+
 /* Add a long long as integer reply or bulk len / multi bulk count.
  * Basically this is used to output <prefix><long long><crlf>. */
 void addReplyLongLongWithPrefix(client *c, long long ll, char prefix) {
@@ -544,14 +927,15 @@ void addReplyLongLongWithPrefix(client *c, long long ll, char prefix) {
     int len;
 
     /* Things like $3\r\n or *2\r\n are emitted very often by the protocol
-     * so we have a few shared objects to use if the integer is small
-     * like it is most of the times. */
-    if (prefix == '*' && ll < OBJ_SHARED_BULKHDR_LEN && ll >= 0) {
-        addReply(c,shared.mbulkhdr[ll]);
-        return;
-    } else if (prefix == '$' && ll < OBJ_SHARED_BULKHDR_LEN && ll >= 0) {
-        addReply(c,shared.bulkhdr[ll]);
-        return;
+     * so the headers for every small length are precomputed. */
+    if (ll >= 0 && ll < REPLY_CACHED_HDR_LEN) {
+        if (prefix == '$') {
+            addReplyProto(c,cached_bulkhdr[ll],cached_bulkhdr_len[ll]);
+            return;
+        } else if (prefix == '*') {
+            addReplyProto(c,cached_mbulkhdr[ll],cached_bulkhdr_len[ll]);
+            return;
+        }
     }
 
     buf[0] = prefix;
@@ -571,10 +955,7 @@ void addReplyLongLong(client *c, long long ll) {
 }
 
 void addReplyAggregateLen(client *c, long length, int prefix) {
-    if (prefix == '*' && length < OBJ_SHARED_BULKHDR_LEN)
-        addReply(c,shared.mbulkhdr[length]);
-    else
-        addReplyLongLongWithPrefix(c,length,prefix);
+    addReplyLongLongWithPrefix(c,length,prefix);
 }
 
 void addReplyArrayLen(client *c, long length) {
@@ -633,12 +1014,7 @@ void addReplyNullArray(client *c) {
 
 /* Create the length prefix of a bulk reply, example: $2234 */
 void addReplyBulkLen(client *c, robj *obj) {
-    size_t len = stringObjectLen(obj);
-
-    if (len < OBJ_SHARED_BULKHDR_LEN)
-        addReply(c,shared.bulkhdr[len]);
-    else
-        addReplyLongLongWithPrefix(c,len,'$');
+    addReplyLongLongWithPrefix(c,stringObjectLen(obj),'$');
 }
 
 /* Add a Redis Object as a bulk reply */
@@ -648,6 +1024,24 @@ void addReplyBulk(client *c, robj *obj) {
     addReply(c,shared.crlf);
 }
 
+/* Add a range of the payload of the string object 'obj' as a bulk reply.
+ * Large ranges of raw strings are referenced in the reply list instead of
+ * copied, like addReply() does with whole payloads: the object is pinned
+ * until the reply is flushed, so huge GETRANGE replies don't duplicate
+ * the range bytes. */
+void addReplyBulkRange(client *c, robj *obj, size_t start, size_t len) {
+    addReplyLongLongWithPrefix(c,len,'$');
+    if (c->conn && obj->encoding == OBJ_ENCODING_RAW &&
+        len >= PROTO_REPLY_ZEROCOPY_MIN_SIZE)
+    {
+        if (prepareClientToWrite(c) == C_OK)
+            _addReplyBlobRangeToList(c,obj,start,len);
+    } else {
+        addReplyProto(c,(char*)obj->ptr+start,len);
+    }
+    addReply(c,shared.crlf);
+}
+
 /* Add a C buffer as bulk reply */
 void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
     addReplyLongLongWithPrefix(c,len,'$');
@@ -754,21 +1148,21 @@ void AddReplyFromClient(client *dst, client *src) {
     src->bufpos = 0;
 }
 
-/* Copy 'src' client output buffers into 'dst' client output buffers.
- * The function takes care of freeing the old output buffers of the
- * destination client. */
-void copyClientOutputBuffer(client *dst, client *src) {
-    listRelease(dst->reply);
-    dst->sentlen = 0;
-    dst->reply = listDup(src->reply);
-    memcpy(dst->buf,src->buf,src->bufpos);
-    dst->bufpos = src->bufpos;
-    dst->reply_bytes = src->reply_bytes;
-}
-
 /* Return true if the specified client has pending reply buffers to write to
  * the socket. */
 int clientHasPendingReplies(client *c) {
+    if ((c->flags & CLIENT_SLAVE) && !(c->flags & CLIENT_MONITOR)) {
+        /* Replicas use the shared replication buffer instead of their own
+         * output buffers: they have pending data when their reference is
+         * not at the very end of the stream, or when part of a compressed
+         * frame still has to be transmitted. */
+        if (c->repl_frame_buf &&
+            sdslen(c->repl_frame_buf) > c->repl_frame_sent) return 1;
+        if (c->ref_repl_buf_node == NULL) return 0;
+        replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+        return c->ref_block_pos < o->used ||
+               listNextNode(c->ref_repl_buf_node) != NULL;
+    }
     return c->bufpos || listLength(c->reply);
 }
 
@@ -833,7 +1227,7 @@ void clientAcceptHandler(connection *conn) {
 }
 
 #define MAX_ACCEPTS_PER_CALL 1000
-static void acceptCommonHandler(connection *conn, int flags, char *ip) {
+static void acceptCommonHandler(connection *conn, uint64_t flags, char *ip) {
     client *c;
     UNUSED(ip);
 
@@ -908,6 +1302,26 @@ void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+void acceptAdminHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int cport, cfd, max = MAX_ACCEPTS_PER_CALL;
+    char cip[NET_IP_STR_LEN];
+    UNUSED(el);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    while(max--) {
+        cfd = anetTcpAccept(server.neterr, fd, cip, sizeof(cip), &cport);
+        if (cfd == ANET_ERR) {
+            if (errno != EWOULDBLOCK)
+                serverLog(LL_WARNING,
+                    "Accepting client connection: %s", server.neterr);
+            return;
+        }
+        serverLog(LL_VERBOSE,"Accepted %s:%d (admin port)", cip, cport);
+        acceptCommonHandler(connCreateAcceptedSocket(cfd),CLIENT_ADMIN_PORT,cip);
+    }
+}
+
 void acceptTLSHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     int cport, cfd, max = MAX_ACCEPTS_PER_CALL;
     char cip[NET_IP_STR_LEN];
@@ -928,6 +1342,109 @@ void acceptTLSHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+/* ==================== Sharded accept threads (SO_REUSEPORT) ==============
+ *
+ * When tcp-reuseport is enabled, the TCP listeners are SO_REUSEPORT shards
+ * (see listenToPortReusePort()) each owned by a dedicated thread blocking
+ * in accept(2). The threads queue the connected sockets and wake up the
+ * event loop with a pipe, so that during a reconnect storm the main thread
+ * only pays for the client creation, in bounded batches, while the accept
+ * system calls and the kernel side handshakes happen off-main. */
+
+typedef struct acceptedConn {
+    int fd;
+    int port;
+    char ip[NET_IP_STR_LEN];
+} acceptedConn;
+
+static list *accepted_conns;
+static pthread_mutex_t accepted_conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int accept_notify_pipe[2] = {-1,-1};
+
+static void *acceptThreadMain(void *arg) {
+    int lfd = (int)(long)arg;
+    char err[ANET_ERR_LEN];
+
+    while(1) {
+        acceptedConn conn;
+        conn.fd = anetTcpAccept(err,lfd,conn.ip,sizeof(conn.ip),&conn.port);
+        if (conn.fd == ANET_ERR) {
+            /* The listener is closed on shutdown. */
+            if (errno == EBADF || errno == EINVAL) break;
+            /* Transient failure (likely out of file descriptors): don't
+             * turn the blocking accept loop into a busy loop. */
+            usleep(1000);
+            continue;
+        }
+        acceptedConn *ac = zmalloc(sizeof(*ac));
+        *ac = conn;
+        pthread_mutex_lock(&accepted_conns_mutex);
+        listAddNodeTail(accepted_conns,ac);
+        pthread_mutex_unlock(&accepted_conns_mutex);
+        /* A full pipe just means the main thread was already notified. */
+        if (write(accept_notify_pipe[1]," ",1) == -1 && errno != EAGAIN) {
+            /* Nothing to do: the queue is drained in the pipe handler. */
+        }
+    }
+    return NULL;
+}
+
+/* Called from the event loop when an accept thread signals the notify
+ * pipe: create the clients for the queued sockets. The batch is bounded
+ * like the classic accept handler, re-arming the event when more work is
+ * left, so a storm of incoming connections can't starve served clients. */
+static void acceptShardedConnsHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[1024];
+    int max = MAX_ACCEPTS_PER_CALL;
+    UNUSED(el);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    while (read(fd,buf,sizeof(buf)) == sizeof(buf));
+    while(max--) {
+        pthread_mutex_lock(&accepted_conns_mutex);
+        listNode *ln = listFirst(accepted_conns);
+        acceptedConn *ac = ln ? listNodeValue(ln) : NULL;
+        if (ln) listDelNode(accepted_conns,ln);
+        pthread_mutex_unlock(&accepted_conns_mutex);
+        if (!ac) return;
+
+        serverLog(LL_VERBOSE,"Accepted %s:%d", ac->ip, ac->port);
+        acceptCommonHandler(connCreateAcceptedSocket(ac->fd),0,ac->ip);
+        zfree(ac);
+    }
+    /* Batch limit reached with the queue still populated: make sure the
+     * event fires again on the next iteration. */
+    if (write(accept_notify_pipe[1]," ",1) == -1 && errno != EAGAIN) {
+        /* As above, a full pipe is already a pending notification. */
+    }
+}
+
+void initAcceptThreads(void) {
+    accepted_conns = listCreate();
+    if (pipe(accept_notify_pipe) == -1)
+        serverPanic("Unable to create the accept notification pipe.");
+    anetNonBlock(NULL,accept_notify_pipe[0]);
+    anetNonBlock(NULL,accept_notify_pipe[1]);
+    if (aeCreateFileEvent(server.el,accept_notify_pipe[0],AE_READABLE,
+        acceptShardedConnsHandler,NULL) == AE_ERR)
+    {
+        serverPanic(
+            "Unrecoverable error creating the accept queue pipe event.");
+    }
+    for (int j = 0; j < server.reuseport_fd_count; j++) {
+        pthread_t tid;
+        if (pthread_create(&tid,NULL,acceptThreadMain,
+            (void*)(long)server.reuseport_fd[j]) != 0)
+        {
+            serverPanic("Fatal: Can't initialize the accept threads.");
+        }
+        pthread_detach(tid);
+    }
+    serverLog(LL_NOTICE,"Accepting connections on %d SO_REUSEPORT listeners.",
+        server.reuseport_fd_count);
+}
+
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     int cfd, max = MAX_ACCEPTS_PER_CALL;
     UNUSED(el);
@@ -949,8 +1466,24 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
 static void freeClientArgv(client *c) {
     int j;
-    for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+    for (j = 0; j < c->argc; j++) {
+        robj *o = c->argv[j];
+
+        /* String objects nobody retained a reference to are recycled into
+         * the client argv pool, so the parser can serve the next command
+         * without allocating: see createArgvStringObject(). Anything the
+         * executed command kept (refcount > 1), re-encoded, or backed by
+         * an oversized buffer is released normally. */
+        if (o->refcount == 1 && o->type == OBJ_STRING &&
+            o->encoding == OBJ_ENCODING_RAW &&
+            c->argv_pool_count < PROTO_ARGV_POOL_SIZE &&
+            sdsalloc(o->ptr) <= PROTO_ARGV_POOL_MAX_BUF)
+        {
+            c->argv_pool[c->argv_pool_count++] = o;
+        } else {
+            decrRefCount(o);
+        }
+    }
     c->argc = 0;
     c->cmd = NULL;
 }
@@ -982,6 +1515,9 @@ void unlinkClient(client *c) {
         if (c->client_list_node) {
             uint64_t id = htonu64(c->id);
             raxRemove(server.clients_index,(unsigned char*)&id,sizeof(id),NULL);
+            clientIndexRemove(server.clients_by_addr,getClientPeerId(c),c);
+            if (c->name)
+                clientIndexRemove(server.clients_by_name,c->name->ptr,c);
             listDelNode(server.clients,c->client_list_node);
             c->client_list_node = NULL;
         }
@@ -995,8 +1531,10 @@ void unlinkClient(client *c) {
             int i;
             for (i=0; i < server.rdb_pipe_numconns; i++) {
                 if (server.rdb_pipe_conns[i] == c->conn) {
-                    rdbPipeWriteHandlerConnRemoved(c->conn);
+                    /* Clear the slot first: releasing the last referenced
+                     * chunk may complete the transfer and free the array. */
                     server.rdb_pipe_conns[i] = NULL;
+                    rdbPipeWriteHandlerConnRemoved(c->conn);
                     break;
                 }
             }
@@ -1030,6 +1568,15 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_UNBLOCKED;
     }
 
+    /* Remove the client from the deferred execution queue if it has a
+     * parked command that will never run. */
+    if (c->flags & CLIENT_DEFERRED_EXEC) {
+        ln = listSearchKey(server.deferred_exec_clients,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.deferred_exec_clients,ln);
+        c->flags &= ~CLIENT_DEFERRED_EXEC;
+    }
+
     /* Clear the tracking status. */
     if (c->flags & CLIENT_TRACKING) disableTracking(c);
 }
@@ -1073,27 +1620,58 @@ void freeClient(client *c) {
             replicationGetSlaveName(c));
     }
 
+    /* When the thread local pool has room the client struct is parked for
+     * reuse instead of being torn down: its containers are emptied but not
+     * released, so the next createClient() is allocation-free. */
+    int park = clientPoolCanPark();
+
     /* Free the query buffer */
-    sdsfree(c->querybuf);
+    queryBufferRelease(c->querybuf);
     sdsfree(c->pending_querybuf);
     c->querybuf = NULL;
+    sdsfree(c->repl_frame_buf);
+    c->repl_frame_buf = NULL;
 
-    /* Deallocate structures used to block on blocking ops. */
+    /* Deallocate structures used to block on blocking ops. Note that
+     * unblocking may retarget the timeout table entry, so the entry is
+     * dropped afterwards. */
     if (c->flags & CLIENT_BLOCKED) unblockClient(c);
-    dictRelease(c->bpop.keys);
+    removeClientFromTimeoutTable(c);
+    if (park)
+        dictEmpty(c->bpop.keys,NULL);
+    else
+        dictRelease(c->bpop.keys);
 
     /* UNWATCH all the keys */
     unwatchAllKeys(c);
-    listRelease(c->watched_keys);
+    if (!park) listRelease(c->watched_keys);
+
+    /* Release the stateful scan sessions of the client. */
+    scanSessionFreeClient(c);
 
     /* Unsubscribe from all the pubsub channels */
     pubsubUnsubscribeAllChannels(c,0);
     pubsubUnsubscribeAllPatterns(c,0);
-    dictRelease(c->pubsub_channels);
-    listRelease(c->pubsub_patterns);
+    pubsubFreeConflatedMessages(c);
+    if (!park) {
+        dictRelease(c->pubsub_channels);
+        listRelease(c->pubsub_patterns);
+        if (c->pubsub_conflated) dictRelease(c->pubsub_conflated);
+    }
+
+    /* Keep the backpressure clients gauge in sync. */
+    if (c->flags & CLIENT_OBUF_BACKPRESSURE) {
+        c->flags &= ~CLIENT_OBUF_BACKPRESSURE;
+        server.obuf_backpressure_clients--;
+    }
 
-    /* Free data structures. */
-    listRelease(c->reply);
+    /* Free data structures. Note that the arena must go after the reply
+     * list, whose free method releases the blocks carved from it. */
+    if (park)
+        listEmpty(c->reply);
+    else
+        listRelease(c->reply);
+    zfree(c->reply_arena);
     freeClientArgv(c);
 
     /* Unlink the client: this will close the socket, remove the I/O
@@ -1112,6 +1690,11 @@ void freeClient(client *c) {
         ln = listSearchKey(l,c);
         serverAssert(ln != NULL);
         listDelNode(l,ln);
+        /* Drop the reference this replica holds into the shared
+         * replication buffer (no-op for monitors, that never get one). */
+        replicaReleaseReplicationBuffer(c);
+        /* Monitors instead hold a cursor into the audit ring. */
+        if (c->flags & CLIENT_MONITOR) auditMonitorRelease(c);
         /* We need to remember the time when we started to have zero
          * attached slaves, as after some time we'll free the replication
          * backlog. */
@@ -1138,12 +1721,19 @@ void freeClient(client *c) {
     }
 
     /* Release other dynamically allocated client structure fields,
-     * and finally release the client structure itself. */
+     * and finally release or park the client structure itself. Note that
+     * the argv vector is kept (with its capacity) by parked clients. */
     if (c->name) decrRefCount(c->name);
-    zfree(c->argv);
     freeClientMultiState(c);
     sdsfree(c->peerid);
-    zfree(c);
+    if (park) {
+        clientPoolPark(c);
+    } else {
+        while (c->argv_pool_count > 0)
+            decrRefCount(c->argv_pool[--c->argv_pool_count]);
+        zfree(c->argv);
+        zfree(c);
+    }
 }
 
 /* Schedule a client to free it at a safe time in the serverCron() function.
@@ -1184,6 +1774,149 @@ client *lookupClientByID(uint64_t id) {
     return (c == raxNotFound) ? NULL : c;
 }
 
+/* Return non zero if the replica still has raw stream bytes to consume
+ * from the shared replication buffer blocks. */
+static int replicaStreamPending(client *c) {
+    if (c->ref_repl_buf_node == NULL) return 0;
+    replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+    return c->ref_block_pos < o->used ||
+           listNextNode(c->ref_repl_buf_node) != NULL;
+}
+
+/* Consume up to REPL_STREAM_COMPRESS_BLOCK raw stream bytes from the
+ * shared buffer blocks referenced by the replica and stage them in
+ * c->repl_frame_buf as a single compressed frame: the raw and stored
+ * lengths as two little endian 32 bit words, followed by the payload.
+ * The payload is stored verbatim when the codec cannot make it smaller,
+ * in which case the two lengths are equal.
+ *
+ * Uses static scratch buffers: like writeToReplica() this only runs in
+ * the main thread. */
+static void replicaBuildFrame(client *c) {
+    static char raw[REPL_STREAM_COMPRESS_BLOCK];
+    static char comp[REPL_STREAM_COMPRESS_BLOCK];
+    uint32_t rawlen = 0, storedlen;
+    char *payload;
+
+    while (rawlen < REPL_STREAM_COMPRESS_BLOCK && replicaStreamPending(c)) {
+        replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+        size_t avail = o->used - c->ref_block_pos;
+        size_t take = REPL_STREAM_COMPRESS_BLOCK - rawlen;
+
+        if (take > avail) take = avail;
+        memcpy(raw+rawlen,o->buf+c->ref_block_pos,take);
+        rawlen += take;
+        c->ref_block_pos += take;
+
+        /* Advance the block reference like writeToReplica() does once a
+         * block is fully consumed. */
+        listNode *next = listNextNode(c->ref_repl_buf_node);
+        if (next && c->ref_block_pos == o->used) {
+            o->refcount--;
+            ((replBufBlock*)listNodeValue(next))->refcount++;
+            c->ref_repl_buf_node = next;
+            c->ref_block_pos = 0;
+            freeReplicationBufferHead();
+        } else if (next == NULL) {
+            break;
+        }
+    }
+    if (rawlen == 0) return;
+
+    storedlen = c->repl_codec->compress(raw,rawlen,comp,rawlen-1);
+    payload = storedlen ? comp : raw;
+    if (storedlen == 0) storedlen = rawlen;
+
+    uint32_t hdr[2] = {rawlen, storedlen};
+    memrev32ifbe(&hdr[0]);
+    memrev32ifbe(&hdr[1]);
+    c->repl_frame_buf = sdscatlen(c->repl_frame_buf,hdr,sizeof(hdr));
+    c->repl_frame_buf = sdscatlen(c->repl_frame_buf,payload,storedlen);
+}
+
+/* Send the pending part of the replication stream to a replica client:
+ * replicas reference the shared replication buffer directly, so we write
+ * straight from the buffer blocks, advancing the replica reference as
+ * blocks are fully transferred and releasing the buffer head when this
+ * replica was the last reader of a block. When the replica negotiated a
+ * compressed stream (REPLCONF compress) the raw bytes are consumed into
+ * length-prefixed compressed frames first, one frame staged at a time so
+ * that a slow link never piles up compressed copies.
+ *
+ * Since it manipulates the block reference counts and the blocks list,
+ * this function is only safe to call from the main thread: the threaded
+ * write path takes care of serving replicas synchronously. */
+static int writeToReplica(client *c, int handler_installed) {
+    ssize_t nwritten = 0, totwritten = 0;
+
+    if (c->repl_codec) {
+        while(1) {
+            /* Transmit the staged frame first, then consume more of the
+             * stream into the next frame. */
+            size_t framelen = sdslen(c->repl_frame_buf);
+            if (framelen > c->repl_frame_sent) {
+                nwritten = connWrite(c->conn,
+                                     c->repl_frame_buf+c->repl_frame_sent,
+                                     framelen-c->repl_frame_sent);
+                if (nwritten <= 0) break;
+                c->repl_frame_sent += nwritten;
+                totwritten += nwritten;
+                if (c->repl_frame_sent < framelen) continue;
+            }
+            sdsclear(c->repl_frame_buf);
+            c->repl_frame_sent = 0;
+            if (!replicaStreamPending(c)) break;
+            replicaBuildFrame(c);
+            if (sdslen(c->repl_frame_buf) == 0) break;
+        }
+    } else while (clientHasPendingReplies(c)) {
+        replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+        serverAssert(o->used >= c->ref_block_pos);
+
+        if (o->used > c->ref_block_pos) {
+            nwritten = connWrite(c->conn,o->buf+c->ref_block_pos,
+                                 o->used-c->ref_block_pos);
+            if (nwritten <= 0) break;
+            c->ref_block_pos += nwritten;
+            totwritten += nwritten;
+        }
+
+        /* If the block is fully sent, move the reference to the next one,
+         * releasing the head of the buffer if we were its last reader.
+         * Note that we don't limit the amount of data sent in a single
+         * call: on high-speed traffic capping writes to replicas would
+         * just make the replication buffer grow (see writeToClient()). */
+        listNode *next = listNextNode(c->ref_repl_buf_node);
+        if (next && c->ref_block_pos == o->used) {
+            o->refcount--;
+            ((replBufBlock*)listNodeValue(next))->refcount++;
+            c->ref_repl_buf_node = next;
+            c->ref_block_pos = 0;
+            freeReplicationBufferHead();
+        }
+    }
+    server.stat_net_output_bytes += totwritten;
+    if (nwritten == -1) {
+        if (connGetState(c->conn) == CONN_STATE_CONNECTED) {
+            nwritten = 0;
+        } else {
+            serverLog(LL_VERBOSE,
+                "Error writing to client: %s", connGetLastError(c->conn));
+            freeClientAsync(c);
+            return C_ERR;
+        }
+    }
+    if (totwritten > 0) c->lastinteraction = server.unixtime;
+    if (!clientHasPendingReplies(c)) {
+        if (handler_installed) connSetWriteHandler(c->conn, NULL);
+        if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+            freeClientAsync(c);
+            return C_ERR;
+        }
+    }
+    return C_OK;
+}
+
 /* Write data in output buffers to client. Return C_OK if the client
  * is still valid after the call, C_ERR if it was freed because of some
  * error.  If handler_installed is set, it will attempt to clear the
@@ -1194,46 +1927,91 @@ client *lookupClientByID(uint64_t id) {
  * thread safe. */
 int writeToClient(client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
     clientReplyBlock *o;
+    listNode *ln;
+
+    /* Replicas are served from the shared replication buffer. */
+    if ((c->flags & CLIENT_SLAVE) && !(c->flags & CLIENT_MONITOR))
+        return writeToReplica(c,handler_installed);
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
-            nwritten = connWrite(c->conn,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+        struct iovec iov[PROTO_WRITEV_MAX];
+        int iovcnt = 0;
+        size_t iovlen = 0, offset;
+        listIter li;
 
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
+        /* Remove empty blocks from the head of the reply list. */
+        while (c->bufpos == 0 && (ln = listFirst(c->reply)) != NULL &&
+               (o = listNodeValue(ln))->used == 0)
+        {
+            c->reply_bytes -= o->size;
+            listDelNode(c->reply,ln);
+        }
+        if (!clientHasPendingReplies(c)) break;
+
+        /* Gather the static buffer and the reply list blocks into a
+         * vector, so that the whole chain is flushed with a single
+         * writev(2), without copying referenced payloads around.
+         * c->sentlen is the amount already sent of the head of the
+         * chain: the static buffer when bufpos is non zero, the first
+         * reply block otherwise. */
+        if (c->bufpos > 0) {
+            iov[iovcnt].iov_base = c->buf+c->sentlen;
+            iov[iovcnt].iov_len = c->bufpos-c->sentlen;
+            iovlen += iov[iovcnt++].iov_len;
+            offset = 0;
         } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = o->used;
-
-            if (objlen == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
+            offset = c->sentlen;
+        }
+        listRewind(c->reply,&li);
+        while (iovcnt < PROTO_WRITEV_MAX &&
+               iovlen < NET_MAX_WRITES_PER_EVENT &&
+               (ln = listNext(&li)) != NULL)
+        {
+            o = listNodeValue(ln);
+            if (o->used > offset) {
+                iov[iovcnt].iov_base =
+                    (o->blob ? (char*)o->blob->ptr + o->blob_off : o->buf) +
+                    offset;
+                iov[iovcnt].iov_len = o->used - offset;
+                iovlen += iov[iovcnt++].iov_len;
             }
+            offset = 0;
+        }
 
-            nwritten = connWrite(c->conn, o->buf + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+        nwritten = connWritev(c->conn,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
 
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
+        /* Consume what was sent from the head of the chain. */
+        ssize_t remaining = nwritten;
+        if (c->bufpos > 0) {
+            ssize_t avail = c->bufpos - c->sentlen;
+            if (remaining >= avail) {
+                remaining -= avail;
+                c->bufpos = 0;
+                c->sentlen = 0;
+            } else {
+                c->sentlen += remaining;
+                remaining = 0;
+            }
+        }
+        while (remaining > 0) {
+            ln = listFirst(c->reply);
+            o = listNodeValue(ln);
+            ssize_t avail = o->used - c->sentlen;
+            if (remaining >= avail) {
+                remaining -= avail;
                 c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
+                listDelNode(c->reply,ln);
                 c->sentlen = 0;
                 /* If there are no longer objects in the list, we expect
                  * the count of reply bytes to be exactly zero. */
                 if (listLength(c->reply) == 0)
                     serverAssert(c->reply_bytes == 0);
+            } else {
+                c->sentlen += remaining;
+                remaining = 0;
             }
         }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
@@ -1291,7 +2069,8 @@ int writeToClient(client *c, int handler_installed) {
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(connection *conn) {
     client *c = connGetPrivateData(conn);
-    writeToClient(c,1);
+    if (writeToClient(c,1) == C_OK)
+        clientCheckObufBackpressureRelease(c);
 }
 
 /* This function is called just before entering the event loop, in the hope
@@ -1315,6 +2094,7 @@ int handleClientsWithPendingWrites(void) {
 
         /* Try to write buffers to the client socket. */
         if (writeToClient(c,0) == C_ERR) continue;
+        clientCheckObufBackpressureRelease(c);
 
         /* If after the synchronous writes above we still have data to
          * output to the client, we need to install the writable handler. */
@@ -1343,7 +2123,17 @@ void resetClient(client *c) {
     redisCommandProc *prevcmd = c->cmd ? c->cmd->proc : NULL;
 
     freeClientArgv(c);
-    c->reqtype = 0;
+    /* Connections locked to the multibulk protocol don't go back through
+     * inline detection: the next iteration of the parser loop jumps
+     * straight into the multibulk state machine. Replication links are
+     * excluded because they exchange bare newlines as liveness pings. */
+    if ((c->flags & CLIENT_PROTO_RESP) &&
+        !(c->flags & (CLIENT_SLAVE|CLIENT_MASTER)))
+    {
+        c->reqtype = PROTO_REQ_MULTIBULK;
+    } else {
+        c->reqtype = 0;
+    }
     c->multibulklen = 0;
     c->bulklen = -1;
 
@@ -1390,6 +2180,72 @@ void unprotectClient(client *c) {
     }
 }
 
+#ifdef HAVE_PROTO_AVX2
+/* Cached CPU feature check for the vectorized protocol scanner. */
+static int protoAvx2Supported(void) {
+    static int supported = -1;
+    if (supported == -1) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2");
+    }
+    return supported;
+}
+
+__attribute__((target("avx2")))
+static char *protoFindByteAvx2(char *s, size_t len, char b) {
+    const __m256i needle = _mm256_set1_epi8(b);
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)s);
+        int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v,needle));
+        if (mask) return s + __builtin_ctz(mask);
+        s += 32;
+        len -= 32;
+    }
+    return memchr(s,b,len);
+}
+#endif
+
+/* Find the first occurrence of byte 'b' in the 'len' bytes at 's', or
+ * NULL. Used by the request parsers to locate the CRLF terminating
+ * protocol lines with 32 byte probes. Unlike the strchr() calls it
+ * replaces, the scan is bounded by 'len' rather than by the sds
+ * terminator, so unparsed bulk payloads containing zero bytes don't cut
+ * the search short. */
+static char *protoFindByte(char *s, size_t len, char b) {
+#ifdef HAVE_PROTO_AVX2
+    if (len >= 32 && protoAvx2Supported()) return protoFindByteAvx2(s,len,b);
+#endif
+    return memchr(s,b,len);
+}
+
+/* Fast path to parse the non-negative integer of a RESP length header
+ * ('len' bytes at 'p', already excluding the type byte and the CRLF).
+ * Returns 1 and sets 'value' on success, 0 if the string is not a plain
+ * sequence of digits (signs, empty or oversized input): the caller then
+ * falls back to string2ll(), which also serves negative lengths like the
+ * RESP2 null array. */
+static inline int protoParseLen(const char *p, size_t len, long long *value) {
+    long long v = 0;
+    if (len == 0 || len > 17) return 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned digit = (unsigned char)p[i] - '0';
+        if (digit > 9) return 0;
+        v = v*10 + digit;
+    }
+    *value = v;
+    return 1;
+}
+
+/* Make sure c->argv can hold 'argc' pointers, reusing the array allocated
+ * for previous commands when large enough: in pipelined workloads this
+ * saves an allocator round trip per command. */
+static void ensureArgvCapacity(client *c, int argc) {
+    if (c->argv && argc <= c->argv_len) return;
+    zfree(c->argv);
+    c->argv = zmalloc(sizeof(robj*)*argc);
+    c->argv_len = argc;
+}
+
 /* Like processMultibulkBuffer(), but for the inline protocol instead of RESP,
  * this function consumes the client query buffer and creates a command ready
  * to be executed inside the client structure. Returns C_OK if the command
@@ -1404,7 +2260,8 @@ int processInlineBuffer(client *c) {
     size_t querylen;
 
     /* Search for end of line */
-    newline = strchr(c->querybuf+c->qb_pos,'\n');
+    newline = protoFindByte(c->querybuf+c->qb_pos,
+                            sdslen(c->querybuf)-c->qb_pos,'\n');
 
     /* Nothing to do without a \r\n */
     if (newline == NULL) {
@@ -1440,10 +2297,7 @@ int processInlineBuffer(client *c) {
     c->qb_pos += querylen+linefeed_chars;
 
     /* Setup argv array on client structure */
-    if (argc) {
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*argc);
-    }
+    if (argc) ensureArgvCapacity(c,argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -1488,6 +2342,40 @@ static void setProtocolError(const char *errstr, client *c) {
     c->flags |= CLIENT_CLOSE_AFTER_REPLY;
 }
 
+/* Create the string object for a command argument of 'len' bytes at 'buf',
+ * reusing a recycled object from the client argv pool when possible.
+ *
+ * freeClientArgv() parks the string objects that survived command execution
+ * unreferenced, so in the common parse-dispatch-free cycle of small pipelined
+ * commands this function just refills the pooled sds in place and no
+ * allocation happens at all. When the pool is empty, arguments small enough
+ * to be pooled later are created with the RAW encoding on purpose: embedded
+ * string objects cannot have their buffer replaced, so they would never
+ * re-enter the pool. */
+static robj *createArgvStringObject(client *c, const char *buf, size_t len) {
+    robj *o;
+    sds s;
+
+    if (c->argv_pool_count == 0) {
+        if (len <= PROTO_ARGV_POOL_MAX_BUF)
+            return createRawStringObject(buf,len);
+        return createStringObject(buf,len);
+    }
+    o = c->argv_pool[--c->argv_pool_count];
+    s = o->ptr;
+    if (sdsalloc(s) < len) {
+        sdsfree(s);
+        s = sdsnewlen(SDS_NOINIT,len);
+        o->ptr = s;
+    } else {
+        sdssetlen(s,len);
+    }
+    memcpy(s,buf,len);
+    s[len] = '\0';
+    initObjectLRUOrLFU(o);
+    return o;
+}
+
 /* Process the query buffer for client 'c', setting up the client argument
  * vector for command execution. Returns C_OK if after running the function
  * the client has a well-formed ready to be processed command, otherwise
@@ -1509,7 +2397,8 @@ int processMultibulkBuffer(client *c) {
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
+        newline = protoFindByte(c->querybuf+c->qb_pos,
+                                sdslen(c->querybuf)-c->qb_pos,'\r');
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
@@ -1522,10 +2411,30 @@ int processMultibulkBuffer(client *c) {
         if (newline-(c->querybuf+c->qb_pos) > (ssize_t)(sdslen(c->querybuf)-c->qb_pos-2))
             return C_ERR;
 
+        /* Tolerate empty lines: clients and proxies may send a bare
+         * "\r\n" as a keepalive even on connections locked to the
+         * multibulk protocol. */
+        if (newline == c->querybuf+c->qb_pos) {
+            c->qb_pos += 2;
+            return C_OK;
+        }
+
         /* We know for sure there is a whole line since newline != NULL,
-         * so go ahead and find out the multi bulk length. */
-        serverAssertWithInfo(c,NULL,c->querybuf[c->qb_pos] == '*');
-        ok = string2ll(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
+         * so go ahead and find out the multi bulk length. Connections
+         * locked to the multibulk protocol skip the type detection in
+         * processInputBuffer(), so a stray inline command reaches this
+         * point and must be refused as a protocol error. */
+        if (c->querybuf[c->qb_pos] != '*') {
+            addReplyError(c,
+                "Protocol error: expected '*', got an inline command on "
+                "a RESP connection");
+            setProtocolError("expected multibulk",c);
+            return C_ERR;
+        }
+        ok = protoParseLen(c->querybuf+1+c->qb_pos,
+                           newline-(c->querybuf+1+c->qb_pos),&ll) ||
+             string2ll(c->querybuf+1+c->qb_pos,
+                       newline-(c->querybuf+1+c->qb_pos),&ll);
         if (!ok || ll > 1024*1024) {
             addReplyError(c,"Protocol error: invalid multibulk length");
             setProtocolError("invalid mbulk count",c);
@@ -1539,15 +2448,15 @@ int processMultibulkBuffer(client *c) {
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*c->multibulklen);
+        ensureArgvCapacity(c,c->multibulklen);
     }
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            newline = protoFindByte(c->querybuf+c->qb_pos,
+                                    sdslen(c->querybuf)-c->qb_pos,'\r');
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
@@ -1570,7 +2479,10 @@ int processMultibulkBuffer(client *c) {
                 return C_ERR;
             }
 
-            ok = string2ll(c->querybuf+c->qb_pos+1,newline-(c->querybuf+c->qb_pos+1),&ll);
+            ok = protoParseLen(c->querybuf+c->qb_pos+1,
+                               newline-(c->querybuf+c->qb_pos+1),&ll) ||
+                 string2ll(c->querybuf+c->qb_pos+1,
+                           newline-(c->querybuf+c->qb_pos+1),&ll);
             if (!ok || ll < 0 || ll > server.proto_max_bulk_len) {
                 addReplyError(c,"Protocol error: invalid bulk length");
                 setProtocolError("invalid bulk length",c);
@@ -1591,9 +2503,10 @@ int processMultibulkBuffer(client *c) {
                 if (sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2) {
                     sdsrange(c->querybuf,c->qb_pos,-1);
                     c->qb_pos = 0;
-                    /* Hint the sds library about the amount of bytes this string is
-                     * going to contain. */
-                    c->querybuf = sdsMakeRoomFor(c->querybuf,ll+2);
+                    /* The exact amount of bytes this string is going to
+                     * contain is known: size for that, no preallocation. */
+                    c->querybuf = sdsMakeRoomForHint(c->querybuf,ll+2,
+                                                     sdslen(c->querybuf)+ll+2);
                 }
             }
             c->bulklen = ll;
@@ -1615,11 +2528,10 @@ int processMultibulkBuffer(client *c) {
                 sdsIncrLen(c->querybuf,-2); /* remove CRLF */
                 /* Assume that if we saw a fat argument we'll see another one
                  * likely... */
-                c->querybuf = sdsnewlen(SDS_NOINIT,c->bulklen+2);
-                sdsclear(c->querybuf);
+                c->querybuf = queryBufferGet(c->bulklen+2);
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+c->qb_pos,c->bulklen);
+                    createArgvStringObject(c,c->querybuf+c->qb_pos,c->bulklen);
                 c->qb_pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1655,9 +2567,12 @@ int processCommandAndResetClient(client *c) {
         /* Don't reset the client structure for clients blocked in a
          * module blocking command, so that the reply callback will
          * still be able to access the client argv and argc field.
-         * The client will be reset in unblockClientFromModule(). */
+         * The client will be reset in unblockClientFromModule().
+         * The same holds for clients parked on a cold tier fault:
+         * coldTierHandleCompletions() re-executes their command from
+         * argv once the values are resident again. */
         if (!(c->flags & CLIENT_BLOCKED) ||
-            c->btype != BLOCKED_MODULE)
+            (c->btype != BLOCKED_MODULE && c->btype != BLOCKED_COLD))
         {
             resetClient(c);
         }
@@ -1670,11 +2585,238 @@ int processCommandAndResetClient(client *c) {
     return deadclient ? C_ERR : C_OK;
 }
 
+/* Return non-zero if the command just parsed into c->argv must be parked
+ * instead of executed right away, queueing the client to the deferred
+ * exec list drained by processDeferredExecClients().
+ *
+ * Only heavy commands (the ones without the "fast" flag) from clients
+ * flagged with CLIENT SETPRI BATCH are deferred: this way a long
+ * SMEMBERS issued by an analytics connection does not hold back the
+ * sub-millisecond traffic parsed later in the same event loop
+ * iteration. */
+static int deferBatchPriorityCommand(client *c) {
+    if (!(c->flags & CLIENT_BATCH_PRIORITY)) return 0;
+    if (server.batch_priority_budget_usec == 0) return 0;
+    /* Masters, replicas and Lua never defer: reordering the replication
+     * stream or a script step is not an option. */
+    if (c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_LUA)) return 0;
+
+    struct redisCommand *cmd = lookupCommand(c->argv[0]->ptr);
+    if (cmd == NULL || cmd->flags & CMD_FAST) return 0;
+
+    c->flags |= CLIENT_DEFERRED_EXEC;
+    listAddNodeTail(server.deferred_exec_clients,c);
+    return 1;
+}
+
+/* Execute the commands parked by deferBatchPriorityCommand(), within the
+ * batch-priority-budget-usec time budget for this iteration. Called by
+ * beforeSleep(), once the fast-class traffic already drained: what does
+ * not fit in the budget stays queued for the next iteration, and we
+ * prevent the event loop from actually sleeping until the queue is
+ * empty. */
+void processDeferredExecClients(void) {
+    if (listLength(server.deferred_exec_clients) == 0) return;
+
+    long long start = ustime();
+    long long budget = server.batch_priority_budget_usec;
+
+    while (listLength(server.deferred_exec_clients)) {
+        listNode *ln = listFirst(server.deferred_exec_clients);
+        client *c = ln->value;
+
+        listDelNode(server.deferred_exec_clients,ln);
+        c->flags &= ~CLIENT_DEFERRED_EXEC;
+        if (processCommandAndResetClient(c) == C_OK) {
+            /* Keep consuming the input buffer: further heavy commands
+             * will be parked again, at the tail of the queue. */
+            processInputBuffer(c);
+        }
+        if (ustime()-start >= budget) break;
+    }
+    if (listLength(server.deferred_exec_clients))
+        aeSetDontWait(server.el,1);
+}
+
+/* ----------------------- Replication apply batching ----------------------
+ *
+ * Commands arriving on the link with our master are not executed as soon
+ * as each one is parsed. Up to REPL_APPLY_BATCH of them are collected
+ * first, the hash table buckets of their keys are prefetched, and only
+ * then the whole group is dispatched in parsing order: by the time a
+ * command runs, the memory its key lookup will walk is already on its way
+ * to the CPU caches, so a write burst from the master is applied without
+ * paying a full DRAM miss per command. The batch never outlives the
+ * processInputBuffer() call that created it, so no latency is added. */
+
+#define REPL_APPLY_BATCH 16
+
+typedef struct replApplyBatch {
+    struct {
+        robj **argv;
+        int argc;
+    } cmd[REPL_APPLY_BATCH];
+    int count;
+} replApplyBatch;
+
+/* Return non-zero if the command just parsed into c->argv may leave the
+ * client blocked once executed. Such commands are never batched: they run
+ * inline so that, if they do block, the parsing loop stops exactly like
+ * it would without batching, with the unapplied part of the stream still
+ * inside the query buffer. Module commands are excluded as a class since
+ * we can't tell which of them call RM_BlockClient(). */
+static int replApplyCommandMayBlock(client *c) {
+    struct redisCommand *cmd = lookupCommand(c->argv[0]->ptr);
+    if (!cmd) return 1; /* Unknown: let processCommand() handle the error. */
+    return commandMayBlockClient(cmd);
+}
+
+/* Take ownership of the command just parsed into c->argv and append it to
+ * 'batch', prefetching the bucket of its key. The client parsing state is
+ * reset, as resetClient() would, so that the caller can keep parsing the
+ * next command from the query buffer. */
+static void replApplyBatchAppend(replApplyBatch *batch, client *c) {
+    serverAssert(batch->count < REPL_APPLY_BATCH);
+    batch->cmd[batch->count].argv = c->argv;
+    batch->cmd[batch->count].argc = c->argc;
+    batch->count++;
+
+    /* Almost every command in the replication stream (SET, DEL, HSET,
+     * EXPIRE, ...) has its key as the first argument: a wrong guess for
+     * the few that don't just wastes a prefetch. */
+    if (c->argc >= 2 && sdsEncodedObject(c->argv[1])) {
+        sds key = c->argv[1]->ptr;
+        dictPrefetch(dbGetDict(c->db,key),key);
+    }
+
+    c->argv = NULL;
+    c->argv_len = 0;
+    c->argc = 0;
+    c->reqtype = 0;
+    c->multibulklen = 0;
+    c->bulklen = -1;
+}
+
+/* Apply the batched commands in parsing order. The replication offset is
+ * accounted a batch at a time rather than a command at a time, which is
+ * equivalent by the time the caller returns. Returns C_ERR if the client
+ * was freed while executing one of the commands, in which case the ones
+ * not yet applied are discarded: the link with the master is gone, and
+ * they will be retransmitted as part of the stream after the resync. */
+static int replApplyBatchFlush(replApplyBatch *batch, client *c) {
+    int j;
+
+    /* The parser may be holding a partially read command in the client
+     * (the parsing loop stops in the middle of an incomplete multibulk):
+     * save that state and give it back once the batch is applied. */
+    robj **pargv = c->argv;
+    int pargv_len = c->argv_len, pargc = c->argc, preqtype = c->reqtype;
+    long pmultibulklen = c->multibulklen;
+    long long pbulklen = c->bulklen;
+
+    for (j = 0; j < batch->count; j++) {
+        c->argv = batch->cmd[j].argv;
+        c->argv_len = batch->cmd[j].argc;
+        c->argc = batch->cmd[j].argc;
+        if (processCommandAndResetClient(c) == C_ERR) {
+            for (int i = j+1; i < batch->count; i++) {
+                for (int k = 0; k < batch->cmd[i].argc; k++)
+                    decrRefCount(batch->cmd[i].argv[k]);
+                zfree(batch->cmd[i].argv);
+            }
+            batch->count = 0;
+            return C_ERR;
+        }
+        /* resetClient() released the argument objects but keeps the
+         * vector around for reuse, and the command may even have swapped
+         * it (rewriteClientCommandVector): just free whatever the client
+         * ended up holding before installing the next command. */
+        zfree(c->argv);
+        c->argv = NULL;
+    }
+    batch->count = 0;
+
+    c->argv = pargv;
+    c->argv_len = pargv_len;
+    c->argc = pargc;
+    c->reqtype = preqtype;
+    c->multibulklen = pmultibulklen;
+    c->bulklen = pbulklen;
+    return C_OK;
+}
+
+/* ---------------------- Pipelined lookahead prefetch ---------------------
+ * When a client pipelines commands, the keys of the commands still sitting
+ * in the query buffer are already known while the first one executes. The
+ * functions below scan the RESP framing of the next few commands in place,
+ * without allocating anything, and prefetch the keyspace bucket of their
+ * likely key (the first argument, like the replication apply batch above):
+ * by the time each command runs, the memory its lookup will walk is on its
+ * way to the CPU caches. A position watermark avoids rescanning the same
+ * commands while the pipeline drains. */
+
+#define PIPELINE_PREFETCH_MAX 8 /* Commands scanned ahead of the current. */
+
+/* Parse "<prefix><number>\r\n" at 'p'. Returns the pointer right past the
+ * newline and stores the number in 'val', or NULL if the buffer ends first
+ * or the framing does not match. */
+static char *prefetchParseNumber(char *p, char *end, char prefix, long *val) {
+    long v = 0;
+
+    if (p >= end || *p != prefix) return NULL;
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v*10 + (*p - '0');
+        /* Give up on implausibly long frames (huge bulk values): scanning
+         * past them buys nothing and the parser will handle them anyway. */
+        if (v > 1024*1024) return NULL;
+        p++;
+    }
+    if (end-p < 2 || p[0] != '\r' || p[1] != '\n') return NULL;
+    *val = v;
+    return p+2;
+}
+
+/* Scan complete commands between the parsing position and the end of the
+ * query buffer, prefetching the bucket of each one's first argument.
+ * '*pf_pos' is the watermark: scanning resumes from it and it is advanced
+ * past every fully scanned command. */
+static void prefetchPipelinedKeys(client *c, size_t *pf_pos) {
+    char *end = c->querybuf + sdslen(c->querybuf);
+    size_t start = *pf_pos > c->qb_pos ? *pf_pos : c->qb_pos;
+    char *p = c->querybuf + start;
+    int scanned = 0;
+
+    while (scanned < PIPELINE_PREFETCH_MAX) {
+        long argc, len, j;
+
+        if ((p = prefetchParseNumber(p,end,'*',&argc)) == NULL) break;
+        for (j = 0; j < argc; j++) {
+            if ((p = prefetchParseNumber(p,end,'$',&len)) == NULL) break;
+            if (end-p < len+2 || p[len] != '\r' || p[len+1] != '\n') {
+                p = NULL;
+                break;
+            }
+            if (j == 1) {
+                dict *d = dbGetDictKeylen(c->db,p,len);
+                dictPrefetchByHash(d,dictGenHashFunction(p,len));
+            }
+            p += len+2;
+        }
+        if (p == NULL) break;
+        *pf_pos = p - c->querybuf;
+        scanned++;
+    }
+}
+
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
  * pending query buffer, already representing a full command, to process. */
 void processInputBuffer(client *c) {
+    replApplyBatch rbatch = {.count = 0};
+    size_t pf_pos = 0; /* Lookahead prefetch watermark. */
+
     /* Keep processing while there is something in the input buffer */
     while(c->qb_pos < sdslen(c->querybuf)) {
         /* Return if clients are paused. */
@@ -1685,7 +2827,7 @@ void processInputBuffer(client *c) {
 
         /* Don't process more buffers from clients that have already pending
          * commands to execute in c->argv. */
-        if (c->flags & CLIENT_PENDING_COMMAND) break;
+        if (c->flags & (CLIENT_PENDING_COMMAND|CLIENT_DEFERRED_EXEC)) break;
 
         /* Don't process input from the master while there is a busy script
          * condition on the slave. We want just to accumulate the replication
@@ -1704,6 +2846,23 @@ void processInputBuffer(client *c) {
         if (!c->reqtype) {
             if (c->querybuf[c->qb_pos] == '*') {
                 c->reqtype = PROTO_REQ_MULTIBULK;
+                /* When resp-protocol-lock is enabled, a client speaking
+                 * RESP never switches to the inline protocol: lock the
+                 * request type so resetClient() keeps it for the rest of
+                 * the connection. */
+                if (server.resp_protocol_lock &&
+                    !(c->flags & (CLIENT_SLAVE|CLIENT_MASTER)))
+                    c->flags |= CLIENT_PROTO_RESP;
+            } else if (!server.inline_commands && !server.gopher_enabled &&
+                       !(c->flags & (CLIENT_ADMIN_PORT|CLIENT_UNIX_SOCKET|
+                                     CLIENT_SLAVE|CLIENT_MASTER)))
+            {
+                /* Inline commands exist only for manual debugging: when
+                 * disabled they remain available on the admin port and
+                 * the Unix socket for operators. */
+                addReplyError(c,"inline commands are not accepted on this port");
+                setProtocolError("inline commands disabled",c);
+                break;
             } else {
                 c->reqtype = PROTO_REQ_INLINE;
             }
@@ -1740,6 +2899,27 @@ void processInputBuffer(client *c) {
                 break;
             }
 
+            /* Heavy commands from batch priority clients wait for the
+             * budgeted part of the event loop iteration. */
+            if (deferBatchPriorityCommand(c)) break;
+
+            /* Commands from the master link are grouped and applied with
+             * their key buckets prefetched, see the apply batching
+             * section above. */
+            if (c->flags & CLIENT_MASTER && !replApplyCommandMayBlock(c)) {
+                replApplyBatchAppend(&rbatch,c);
+                if (rbatch.count == REPL_APPLY_BATCH &&
+                    replApplyBatchFlush(&rbatch,c) == C_ERR)
+                    return;
+                continue;
+            }
+            if (rbatch.count && replApplyBatchFlush(&rbatch,c) == C_ERR)
+                return;
+
+            /* Warm the buckets of the keys pipelined behind this command,
+             * so their lookups run behind this execution, not after it. */
+            prefetchPipelinedKeys(c,&pf_pos);
+
             /* We are finally ready to execute the command. */
             if (processCommandAndResetClient(c) == C_ERR) {
                 /* If the client is no longer valid, we avoid exiting this
@@ -1749,6 +2929,7 @@ void processInputBuffer(client *c) {
             }
         }
     }
+    if (rbatch.count && replApplyBatchFlush(&rbatch,c) == C_ERR) return;
 
     /* Trim to pos */
     if (c->qb_pos) {
@@ -1775,13 +2956,112 @@ void processInputBufferAndReplicate(client *c) {
         processInputBuffer(c);
         size_t applied = c->reploff - prev_offset;
         if (applied) {
-            replicationFeedSlavesFromMasterStream(server.slaves,
-                    c->pending_querybuf, applied);
-            sdsrange(c->pending_querybuf,applied,-1);
+            if (server.repl_stream_staged) {
+                /* The applied bytes were staged into the shared
+                 * replication buffer at read time: just account for them
+                 * becoming part of the visible stream. */
+                applyStagedReplicationStream(applied);
+            } else {
+                replicationFeedSlavesFromMasterStream(server.slaves,
+                        c->pending_querybuf, applied);
+                sdsrange(c->pending_querybuf,applied,-1);
+            }
         }
     }
 }
 
+/* Read handler path used for the master link when a compressed stream was
+ * negotiated (REPLCONF compress): the socket carries frames made of the
+ * raw and stored lengths as two little endian 32 bit words followed by
+ * the payload, built by replicaBuildFrame() on the master. Every complete
+ * frame is decoded into the query buffer, with the decompressed bytes
+ * then accounted exactly like readQueryFromClient() accounts the plain
+ * stream: replication offsets always advance by raw stream bytes. */
+static void readCompressedReplStream(client *c) {
+    int nread;
+    size_t buflen, consumed = 0;
+
+    c->repl_frame_buf = sdsMakeRoomFor(c->repl_frame_buf,PROTO_IOBUF_LEN);
+    nread = connRead(c->conn,c->repl_frame_buf+sdslen(c->repl_frame_buf),
+                     PROTO_IOBUF_LEN);
+    if (nread == -1) {
+        if (connGetState(c->conn) == CONN_STATE_CONNECTED) {
+            return;
+        } else {
+            serverLog(LL_VERBOSE,
+                "Reading from master: %s",connGetLastError(c->conn));
+            freeClientAsync(c);
+            return;
+        }
+    } else if (nread == 0) {
+        serverLog(LL_VERBOSE, "Master closed connection");
+        freeClientAsync(c);
+        return;
+    }
+    sdsIncrLen(c->repl_frame_buf,nread);
+    c->lastinteraction = server.unixtime;
+    server.stat_net_input_bytes += nread;
+
+    /* Decode every complete frame. */
+    buflen = sdslen(c->repl_frame_buf);
+    while (buflen-consumed >= 8) {
+        unsigned char *frame = (unsigned char*)c->repl_frame_buf+consumed;
+        uint32_t rawlen, storedlen;
+
+        memcpy(&rawlen,frame,4);
+        memcpy(&storedlen,frame+4,4);
+        memrev32ifbe(&rawlen);
+        memrev32ifbe(&storedlen);
+        if (rawlen == 0 || rawlen > REPL_STREAM_COMPRESS_BLOCK ||
+            storedlen == 0 || storedlen > rawlen)
+        {
+            serverLog(LL_WARNING,
+                "Corrupted compressed replication stream frame header");
+            freeClientAsync(c);
+            return;
+        }
+        if (buflen-consumed-8 < storedlen) break; /* Incomplete frame. */
+
+        size_t qblen = sdslen(c->querybuf);
+        c->querybuf = sdsMakeRoomFor(c->querybuf,rawlen);
+        if (storedlen == rawlen) {
+            /* Incompressible block, stored verbatim. */
+            memcpy(c->querybuf+qblen,frame+8,rawlen);
+        } else if (c->repl_codec->decompress(frame+8,storedlen,
+                                             c->querybuf+qblen,rawlen) == 0)
+        {
+            serverLog(LL_WARNING,
+                "Corrupted compressed replication stream payload");
+            freeClientAsync(c);
+            return;
+        }
+        consumed += 8+storedlen;
+
+        /* Account the raw bytes like readQueryFromClient() does. */
+        if (server.repl_backlog && sdslen(c->pending_querybuf) == 0) {
+            stageReplicationStream(c->querybuf+qblen,rawlen);
+        } else {
+            c->pending_querybuf = sdscatlen(c->pending_querybuf,
+                                            c->querybuf+qblen,rawlen);
+        }
+        sdsIncrLen(c->querybuf,rawlen);
+        c->read_reploff += rawlen;
+    }
+    if (consumed) sdsrange(c->repl_frame_buf,consumed,-1);
+
+    if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
+        sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
+
+        bytes = sdscatrepr(bytes,c->querybuf,64);
+        serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
+        sdsfree(ci);
+        sdsfree(bytes);
+        freeClientAsync(c);
+        return;
+    }
+    processInputBufferAndReplicate(c);
+}
+
 void readQueryFromClient(connection *conn) {
     client *c = connGetPrivateData(conn);
     int nread, readlen;
@@ -1791,6 +3071,13 @@ void readQueryFromClient(connection *conn) {
      * the event loop. This is the case if threaded I/O is enabled. */
     if (postponeClientRead(c)) return;
 
+    /* The stream from a master that accepted REPLCONF compress arrives
+     * as compressed frames and is decoded by a dedicated path. */
+    if ((c->flags & CLIENT_MASTER) && c->repl_codec) {
+        readCompressedReplStream(c);
+        return;
+    }
+
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1798,6 +3085,7 @@ void readQueryFromClient(connection *conn) {
      * at the risk of requiring more read(2) calls. This way the function
      * processMultiBulkBuffer() can avoid copying buffers to create the
      * Redis Object representing the argument. */
+    size_t growhint = 0;
     if (c->reqtype == PROTO_REQ_MULTIBULK && c->multibulklen && c->bulklen != -1
         && c->bulklen >= PROTO_MBULK_BIG_ARG)
     {
@@ -1806,11 +3094,15 @@ void readQueryFromClient(connection *conn) {
         /* Note that the 'remaining' variable may be zero in some edge case,
          * for example once we resume a blocked client after CLIENT PAUSE. */
         if (remaining > 0 && remaining < readlen) readlen = remaining;
+
+        /* The buffer will contain exactly the bulk: size for that instead
+         * of preallocating free space that will never be used. */
+        growhint = c->bulklen+2;
     }
 
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
-    c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+    c->querybuf = sdsMakeRoomForHint(c->querybuf, readlen, growhint);
     nread = connRead(c->conn, c->querybuf+qblen, readlen);
     if (nread == -1) {
         if (connGetState(conn) == CONN_STATE_CONNECTED) {
@@ -1825,11 +3117,22 @@ void readQueryFromClient(connection *conn) {
         freeClientAsync(c);
         return;
     } else if (c->flags & CLIENT_MASTER) {
-        /* Append the query buffer to the pending (not applied) buffer
-         * of the master. We'll use this buffer later in order to have a
-         * copy of the string applied by the last command executed. */
-        c->pending_querybuf = sdscatlen(c->pending_querybuf,
-                                        c->querybuf+qblen,nread);
+        if (server.repl_backlog && sdslen(c->pending_querybuf) == 0) {
+            /* We have sub-replicas (or at least a backlog) to relay the
+             * stream to: since the relayed stream is byte-identical to
+             * what we just read, stage the bytes directly at the tail of
+             * the shared replication buffer. Once the commands they
+             * encode are applied, making them visible is just offset
+             * accounting, and the IO threads deliver them to the
+             * sub-replicas from there without further copies. */
+            stageReplicationStream(c->querybuf+qblen,nread);
+        } else {
+            /* Append the query buffer to the pending (not applied) buffer
+             * of the master. We'll use this buffer later in order to have a
+             * copy of the string applied by the last command executed. */
+            c->pending_querybuf = sdscatlen(c->pending_querybuf,
+                                            c->querybuf+qblen,nread);
+        }
     }
 
     sdsIncrLen(c->querybuf,nread);
@@ -1852,24 +3155,6 @@ void readQueryFromClient(connection *conn) {
      processInputBufferAndReplicate(c);
 }
 
-void getClientsMaxBuffers(unsigned long *longest_output_list,
-                          unsigned long *biggest_input_buffer) {
-    client *c;
-    listNode *ln;
-    listIter li;
-    unsigned long lol = 0, bib = 0;
-
-    listRewind(server.clients,&li);
-    while ((ln = listNext(&li)) != NULL) {
-        c = listNodeValue(ln);
-
-        if (listLength(c->reply) > lol) lol = listLength(c->reply);
-        if (sdslen(c->querybuf) > bib) bib = sdslen(c->querybuf);
-    }
-    *longest_output_list = lol;
-    *biggest_input_buffer = bib;
-}
-
 /* A Redis "Peer ID" is a colon separated ip:port pair.
  * For IPv4 it's in the form x.y.z.k:port, example: "127.0.0.1:1234".
  * For IPv6 addresses we use [] around the IP part, like in "[::1]:1234".
@@ -1930,6 +3215,8 @@ sds catClientInfoString(sds s, client *client) {
     if (client->flags & CLIENT_CLOSE_ASAP) *p++ = 'A';
     if (client->flags & CLIENT_UNIX_SOCKET) *p++ = 'U';
     if (client->flags & CLIENT_READONLY) *p++ = 'r';
+    if (client->flags & CLIENT_BATCH_PRIORITY) *p++ = 'B';
+    if (client->flags & CLIENT_NO_TOUCH) *p++ = 'T';
     if (p == flags) *p++ = 'N';
     *p++ = '\0';
 
@@ -1994,7 +3281,11 @@ int clientSetNameOrReply(client *c, robj *name) {
     /* Setting the client name to an empty string actually removes
      * the current name. */
     if (len == 0) {
-        if (c->name) decrRefCount(c->name);
+        if (c->name) {
+            if (c->conn)
+                clientIndexRemove(server.clients_by_name,c->name->ptr,c);
+            decrRefCount(c->name);
+        }
         c->name = NULL;
         addReply(c,shared.ok);
         return C_OK;
@@ -2011,9 +3302,17 @@ int clientSetNameOrReply(client *c, robj *name) {
             return C_ERR;
         }
     }
-    if (c->name) decrRefCount(c->name);
+    if (c->name) {
+        if (c->conn)
+            clientIndexRemove(server.clients_by_name,c->name->ptr,c);
+        decrRefCount(c->name);
+    }
     c->name = name;
     incrRefCount(name);
+    /* Fake clients (Lua, AOF loading) are not in the indexes since they
+     * are never linked nor unlinked. */
+    if (c->conn)
+        clientIndexAdd(server.clients_by_name,name->ptr,c);
     return C_OK;
 }
 
@@ -2029,13 +3328,19 @@ void clientCommand(client *c) {
 "KILL <ip:port>         -- Kill connection made from <ip:port>.",
 "KILL <option> <value> [option value ...] -- Kill connections. Options are:",
 "     ADDR <ip:port>                      -- Kill connection made from <ip:port>",
+"     ID <client-id>                      -- Kill connection by client id.",
+"     NAME <name>                         -- Kill connections with the given name.",
 "     TYPE (normal|master|replica|pubsub) -- Kill connections by type.",
 "     SKIPME (yes|no)   -- Skip killing current connection (default: yes).",
 "LIST [options ...]     -- Return information about client connections. Options:",
 "     TYPE (normal|master|replica|pubsub) -- Return clients of specified type.",
+"     CURSOR <cursor> [COUNT <count>]     -- Return a single page of at most <count> clients (default 100) starting after client id <cursor>, as a [next-cursor, page] array. A zero next-cursor means the end was reached.",
+"NO-TOUCH (on|off)      -- Control whether lookups from this connection alter the LRU/LFU state of the keys.",
 "PAUSE <timeout>        -- Suspend all Redis clients for <timout> milliseconds.",
 "REPLY (on|off|skip)    -- Control the replies sent to the current connection.",
 "SETNAME <name>         -- Assign the name <name> to the current connection.",
+"SETPRI (normal|batch)  -- Set the scheduling priority of the current connection. Heavy commands from batch priority connections are deferred after the fast traffic of each event loop iteration.",
+"TIMELIMIT <ms>         -- Set the execution deadline of long iterating commands from this connection, overriding the command-time-limit config. 0 restores the server wide value.",
 "UNBLOCK <clientid> [TIMEOUT|ERROR] -- Unblock the specified blocked client.",
 "TRACKING (on|off) [REDIRECT <id>] -- Enable client keys tracking for client side caching.",
 "GETREDIR               -- Return the client ID we are redirecting to when tracking is enabled.",
@@ -2046,22 +3351,109 @@ NULL
         /* CLIENT ID */
         addReplyLongLong(c,c->id);
     } else if (!strcasecmp(c->argv[1]->ptr,"list")) {
-        /* CLIENT LIST */
-        int type = -1;
-        if (c->argc == 4 && !strcasecmp(c->argv[2]->ptr,"type")) {
-            type = getClientTypeByName(c->argv[3]->ptr);
-            if (type == -1) {
-                addReplyErrorFormat(c,"Unknown client type '%s'",
-                    (char*) c->argv[3]->ptr);
+        /* CLIENT LIST [TYPE <type>] [CURSOR <cursor> [COUNT <count>]] */
+        int type = -1, paginated = 0;
+        long long cursor = 0, count = 100;
+        int i = 2;
+        while (i < c->argc) {
+            int moreargs = c->argc > i+1;
+            if (!strcasecmp(c->argv[i]->ptr,"type") && moreargs) {
+                type = getClientTypeByName(c->argv[i+1]->ptr);
+                if (type == -1) {
+                    addReplyErrorFormat(c,"Unknown client type '%s'",
+                        (char*) c->argv[i+1]->ptr);
+                    return;
+                }
+            } else if (!strcasecmp(c->argv[i]->ptr,"cursor") && moreargs) {
+                if (getLongLongFromObjectOrReply(c,c->argv[i+1],&cursor,NULL)
+                    != C_OK) return;
+                paginated = 1;
+            } else if (!strcasecmp(c->argv[i]->ptr,"count") && moreargs) {
+                if (getLongLongFromObjectOrReply(c,c->argv[i+1],&count,NULL)
+                    != C_OK) return;
+                if (count <= 0) {
+                    addReplyError(c,"COUNT must be positive");
+                    return;
+                }
+            } else {
+                addReply(c,shared.syntaxerr);
                 return;
-             }
-        } else if (c->argc != 2) {
+            }
+            i += 2;
+        }
+        if (paginated) {
+            /* Walk a single page of the clients index, which is ordered by
+             * client ID, and reply with [next-cursor, page]: this bounds
+             * the work of a single call on hosts with tens of thousands of
+             * connections. A zero next-cursor means the walk is done. */
+            raxIterator ri;
+            uint64_t seek = htonu64((uint64_t)cursor);
+            uint64_t lastid = 0;
+            long long returned = 0;
+            int more = 0;
+            sds o = sdsempty();
+
+            raxStart(&ri,server.clients_index);
+            if (cursor == 0)
+                raxSeek(&ri,"^",NULL,0);
+            else
+                raxSeek(&ri,">",(unsigned char*)&seek,sizeof(seek));
+            while (raxNext(&ri)) {
+                struct client *cl = ri.data;
+                if (type != -1 && getClientType(cl) != type) continue;
+                if (returned >= count) {
+                    more = 1;
+                    break;
+                }
+                o = catClientInfoString(o,cl);
+                o = sdscatlen(o,"\n",1);
+                lastid = cl->id;
+                returned++;
+            }
+            raxStop(&ri);
+            addReplyArrayLen(c,2);
+            addReplyLongLong(c,more ? (long long)lastid : 0);
+            addReplyVerbatim(c,o,sdslen(o),"txt");
+            sdsfree(o);
+        } else {
+            sds o = getAllClientsInfoString(type);
+            addReplyVerbatim(c,o,sdslen(o),"txt");
+            sdsfree(o);
+        }
+    } else if (!strcasecmp(c->argv[1]->ptr,"setpri") && c->argc == 3) {
+        /* CLIENT SETPRI NORMAL|BATCH */
+        if (!strcasecmp(c->argv[2]->ptr,"normal")) {
+            c->flags &= ~CLIENT_BATCH_PRIORITY;
+            addReply(c,shared.ok);
+        } else if (!strcasecmp(c->argv[2]->ptr,"batch")) {
+            c->flags |= CLIENT_BATCH_PRIORITY;
+            addReply(c,shared.ok);
+        } else {
             addReply(c,shared.syntaxerr);
+        }
+    } else if (!strcasecmp(c->argv[1]->ptr,"timelimit") && c->argc == 3) {
+        /* CLIENT TIMELIMIT <milliseconds> */
+        long long ms;
+
+        if (getLongLongFromObjectOrReply(c,c->argv[2],&ms,NULL) != C_OK)
+            return;
+        if (ms < 0) {
+            addReplyError(c,"timelimit can't be negative");
             return;
         }
-        sds o = getAllClientsInfoString(type);
-        addReplyVerbatim(c,o,sdslen(o),"txt");
-        sdsfree(o);
+        c->command_time_limit = ms;
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"no-touch") && c->argc == 3) {
+        /* CLIENT NO-TOUCH ON|OFF */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            c->flags |= CLIENT_NO_TOUCH;
+            addReply(c,shared.ok);
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            c->flags &= ~CLIENT_NO_TOUCH;
+            addReply(c,shared.ok);
+        } else {
+            addReply(c,shared.syntaxerr);
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"reply") && c->argc == 3) {
         /* CLIENT REPLY ON|OFF|SKIP */
         if (!strcasecmp(c->argv[2]->ptr,"on")) {
@@ -2080,6 +3472,7 @@ NULL
         /* CLIENT KILL <ip:port>
          * CLIENT KILL <option> [value] ... <option> [value] */
         char *addr = NULL;
+        char *name = NULL;
         int type = -1;
         uint64_t id = 0;
         int skipme = 1;
@@ -2111,6 +3504,8 @@ NULL
                     }
                 } else if (!strcasecmp(c->argv[i]->ptr,"addr") && moreargs) {
                     addr = c->argv[i+1]->ptr;
+                } else if (!strcasecmp(c->argv[i]->ptr,"name") && moreargs) {
+                    name = c->argv[i+1]->ptr;
                 } else if (!strcasecmp(c->argv[i]->ptr,"skipme") && moreargs) {
                     if (!strcasecmp(c->argv[i+1]->ptr,"yes")) {
                         skipme = 1;
@@ -2131,11 +3526,36 @@ NULL
             return;
         }
 
-        /* Iterate clients killing all the matching clients. */
-        listRewind(server.clients,&li);
+        /* Collect the candidates: when an ID, ADDR or NAME filter is given
+         * the secondary indexes are used instead of scanning the whole
+         * clients list. A private list is built since killing a client
+         * removes it from the index bucket being walked. */
+        list *candidates = listCreate();
+        if (id != 0) {
+            struct client *cl = lookupClientByID(id);
+            if (cl) listAddNodeTail(candidates,cl);
+        } else if (addr || name) {
+            dictEntry *de = addr ?
+                dictFind(server.clients_by_addr,addr) :
+                dictFind(server.clients_by_name,name);
+            if (de) {
+                listRewind(dictGetVal(de),&li);
+                while ((ln = listNext(&li)) != NULL)
+                    listAddNodeTail(candidates,listNodeValue(ln));
+            }
+        } else {
+            listRewind(server.clients,&li);
+            while ((ln = listNext(&li)) != NULL)
+                listAddNodeTail(candidates,listNodeValue(ln));
+        }
+
+        /* Iterate the candidates killing all the matching clients. */
+        listRewind(candidates,&li);
         while ((ln = listNext(&li)) != NULL) {
             client = listNodeValue(ln);
             if (addr && strcmp(getClientPeerId(client),addr) != 0) continue;
+            if (name && (!client->name ||
+                         strcmp(client->name->ptr,name) != 0)) continue;
             if (type != -1 && getClientType(client) != type) continue;
             if (id != 0 && client->id != id) continue;
             if (c == client && skipme) continue;
@@ -2148,6 +3568,7 @@ NULL
             }
             killed++;
         }
+        listRelease(candidates);
 
         /* Reply according to old/new format. */
         if (c->argc == 3) {
@@ -2366,10 +3787,13 @@ void rewriteClientCommandVector(client *c, int argc, ...) {
      * sure that if the same objects are reused in the new vector the
      * refcount gets incremented before it gets decremented. */
     for (j = 0; j < c->argc; j++) decrRefCount(c->argv[j]);
-    zfree(c->argv);
+    if (c->flags & CLIENT_ARGV_BORROWED)
+        c->flags &= ~CLIENT_ARGV_BORROWED;
+    else
+        zfree(c->argv);
     /* Replace argv and argc with our new versions. */
     c->argv = argv;
-    c->argc = argc;
+    c->argc = c->argv_len = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     serverAssertWithInfo(c,NULL,c->cmd != NULL);
     va_end(ap);
@@ -2378,9 +3802,12 @@ void rewriteClientCommandVector(client *c, int argc, ...) {
 /* Completely replace the client command vector with the provided one. */
 void replaceClientCommandVector(client *c, int argc, robj **argv) {
     freeClientArgv(c);
-    zfree(c->argv);
+    if (c->flags & CLIENT_ARGV_BORROWED)
+        c->flags &= ~CLIENT_ARGV_BORROWED;
+    else
+        zfree(c->argv);
     c->argv = argv;
-    c->argc = argc;
+    c->argc = c->argv_len = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     serverAssertWithInfo(c,NULL,c->cmd != NULL);
 }
@@ -2400,8 +3827,15 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
     robj *oldval;
 
     if (i >= c->argc) {
-        c->argv = zrealloc(c->argv,sizeof(robj*)*(i+1));
-        c->argc = i+1;
+        if (c->flags & CLIENT_ARGV_BORROWED) {
+            robj **argv = zmalloc(sizeof(robj*)*(i+1));
+            memcpy(argv,c->argv,sizeof(robj*)*c->argc);
+            c->argv = argv;
+            c->flags &= ~CLIENT_ARGV_BORROWED;
+        } else {
+            c->argv = zrealloc(c->argv,sizeof(robj*)*(i+1));
+        }
+        c->argc = c->argv_len = i+1;
         c->argv[i] = NULL;
     }
     oldval = c->argv[i];
@@ -2423,8 +3857,19 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(client *c) {
+    if ((c->flags & CLIENT_SLAVE) && !(c->flags & CLIENT_MONITOR)) {
+        /* Replicas reference the shared replication buffer, so their
+         * "output buffer" is the amount of stream not yet delivered:
+         * the distance between their reference and the global offset. */
+        if (c->ref_repl_buf_node == NULL) return 0;
+        replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+        return server.master_repl_offset -
+               (o->repl_offset - 1 + (long long)c->ref_block_pos);
+    }
     unsigned long list_item_size = sizeof(listNode) + sizeof(clientReplyBlock);
-    return c->reply_bytes + (list_item_size*listLength(c->reply));
+    unsigned long arena_size = c->reply_arena ?
+        sizeof(replyArena) + c->reply_arena->size : 0;
+    return c->reply_bytes + arena_size + (list_item_size*listLength(c->reply));
 }
 
 /* Get the class of a client, used in order to enforce limits to different
@@ -2507,6 +3952,51 @@ int checkClientOutputBufferLimits(client *c) {
     return soft || hard;
 }
 
+/* Return non-zero if the client output buffer reached the hard limit for
+ * its class. Used to tell the hard and the soft limit apart when the
+ * backpressure mode is enabled. */
+static int clientReachedObufHardLimit(client *c) {
+    int class = getClientType(c);
+    if (class == CLIENT_TYPE_MASTER) class = CLIENT_TYPE_NORMAL;
+    return server.client_obuf_limits[class].hard_limit_bytes &&
+           getClientOutputBufferMemoryUsage(c) >=
+           server.client_obuf_limits[class].hard_limit_bytes;
+}
+
+/* Put the client under output buffer backpressure: stop reading from its
+ * socket so that it can't pile up more commands (and, for pub/sub clients,
+ * so that the kernel receive buffer of the peer eventually fills and the
+ * publishers block at their end too). The client is resumed by
+ * clientCheckObufBackpressureRelease() once the buffer drains. */
+static void clientApplyObufBackpressure(client *c) {
+    if (c->flags & CLIENT_OBUF_BACKPRESSURE) return;
+    c->flags |= CLIENT_OBUF_BACKPRESSURE;
+    connSetReadHandler(c->conn,NULL);
+    server.obuf_backpressure_clients++;
+    serverLog(LL_VERBOSE,
+        "Client id=%llu suspended for overcoming of output buffer soft limit.",
+        (unsigned long long) c->id);
+}
+
+/* Resume a client under output buffer backpressure once its buffer fully
+ * drained. Waiting for a complete drain (instead of just getting back below
+ * the soft limit) avoids flapping between the two states. Called from the
+ * main thread after the write paths flushed the client buffer. */
+static void clientCheckObufBackpressureRelease(client *c) {
+    if (!(c->flags & CLIENT_OBUF_BACKPRESSURE)) return;
+    if (c->flags & (CLIENT_CLOSE_ASAP|CLIENT_CLOSE_AFTER_REPLY|CLIENT_PROTECTED))
+        return;
+    if (clientHasPendingReplies(c)) return;
+
+    c->flags &= ~CLIENT_OBUF_BACKPRESSURE;
+    c->obuf_soft_limit_reached_time = 0;
+    server.obuf_backpressure_clients--;
+    /* Deliver the messages conflated while the client was suspended, then
+     * start reading from the socket again. */
+    pubsubFlushConflatedMessages(c);
+    connSetReadHandler(c->conn,readQueryFromClient);
+}
+
 /* Asynchronously close a client if soft or hard limit is reached on the
  * output buffer size. The caller can check if the client will be closed
  * checking if the client CLIENT_CLOSE_ASAP flag is set.
@@ -2517,8 +4007,27 @@ int checkClientOutputBufferLimits(client *c) {
 void asyncCloseClientOnOutputBufferLimitReached(client *c) {
     if (!c->conn) return; /* It is unsafe to free fake clients. */
     serverAssert(c->reply_bytes < SIZE_MAX-(1024*64));
-    if (c->reply_bytes == 0 || c->flags & CLIENT_CLOSE_ASAP) return;
+    /* Note that c->reply_bytes is always zero for replicas, that are
+     * accounted by the amount of replication stream they still have to
+     * consume instead. */
+    if ((c->flags & CLIENT_SLAVE) && !(c->flags & CLIENT_MONITOR)) {
+        if (getClientOutputBufferMemoryUsage(c) == 0) return;
+    } else if (c->reply_bytes == 0) {
+        return;
+    }
+    if (c->flags & CLIENT_CLOSE_ASAP) return;
     if (checkClientOutputBufferLimits(c)) {
+        /* In backpressure mode normal and pubsub clients crossing the soft
+         * limit are suspended instead of closed: reconnect storms of slow
+         * consumers are usually worse than the pressure itself. The hard
+         * limit still disconnects as the last resort. */
+        if (server.obuf_backpressure &&
+            !(c->flags & (CLIENT_SLAVE|CLIENT_MASTER)) &&
+            !clientReachedObufHardLimit(c))
+        {
+            clientApplyObufBackpressure(c);
+            return;
+        }
         sds client = catClientInfoString(sdsempty(),c);
 
         freeClientAsync(c);
@@ -2649,62 +4158,417 @@ int tio_debug = 0;
 #define IO_THREADS_MAX_NUM 128
 #define IO_THREADS_OP_READ 0
 #define IO_THREADS_OP_WRITE 1
+#define IO_THREADS_OP_LOOKUP 2
 
 pthread_t io_threads[IO_THREADS_MAX_NUM];
-pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
 _Atomic unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
-int io_threads_active;  /* Are the threads currently spinning waiting I/O? */
+int io_threads_active;  /* Is the main thread dispatching I/O to threads? */
 int io_threads_op;      /* IO_THREADS_OP_WRITE or IO_THREADS_OP_READ. */
-list *io_threads_list[IO_THREADS_MAX_NUM];
+
+/* The main thread hands clients to the I/O threads via per-thread SPSC
+ * (single producer, single consumer) lock-free rings: the main thread is
+ * the only producer and each I/O thread the only consumer of its ring, so
+ * a slot is published just by storing the client pointer and advancing
+ * 'tail', and consumed by advancing 'head' -- no mutex and no CAS on the
+ * fast path. The counters are C11 atomics (sequentially consistent, like
+ * io_threads_pending above) so the pointer store is visible before the
+ * 'tail' increment that publishes it.
+ *
+ * An idle I/O thread does not spin: once its ring is empty it blocks
+ * reading a per-thread eventfd (a pipe on systems without eventfd), and
+ * the main thread wakes it with a single 8 byte write after filling the
+ * ring. */
+#define IO_THREADS_RING_SIZE 4096 /* Must be a power of two. */
+typedef struct ioThreadRing {
+    client *items[IO_THREADS_RING_SIZE];
+    _Atomic unsigned long head; /* Next slot to consume (I/O thread). */
+    char pad[64];               /* Keep producer/consumer counters on
+                                 * different cache lines. */
+    _Atomic unsigned long tail; /* Next slot to fill (main thread). */
+    int wakeup_rfd;             /* I/O thread blocks reading this fd. */
+    int wakeup_wfd;             /* Main thread writes here to wake it up.
+                                 * Same as wakeup_rfd with eventfd. */
+    _Atomic int shutdown;       /* Thread exits once the ring is drained:
+                                 * set when "io-threads" is lowered at
+                                 * runtime to retire this worker. */
+    long id;                    /* Thread number owning this ring. */
+} ioThreadRing;
+ioThreadRing *io_threads_ring[IO_THREADS_MAX_NUM];
+
+/* Number of threads actually spawned: 0 in single threaded mode, kept in
+ * sync with server.io_threads_num by resizeIOThreads() otherwise. */
+static int io_threads_spawned = 0;
+
+/* Wake up the I/O thread blocked on the ring wakeup fd, if any. With
+ * eventfd the counter just accumulates, with a pipe we can safely ignore
+ * a full buffer: either way pending wakeups collapse into one. */
+static void ioThreadRingWakeup(ioThreadRing *ring) {
+    uint64_t one = 1;
+    while (write(ring->wakeup_wfd,&one,sizeof(one)) == -1 && errno == EINTR);
+}
+
+/* Queue a client for the given I/O thread. Called only by the main
+ * thread. If the ring is full (the consumer is more than a full ring
+ * behind) we make sure the thread is awake and wait for a free slot. */
+static void ioThreadRingPush(ioThreadRing *ring, client *c) {
+    unsigned long tail = ring->tail;
+    if (tail - ring->head >= IO_THREADS_RING_SIZE) {
+        ioThreadRingWakeup(ring);
+        while (tail - ring->head >= IO_THREADS_RING_SIZE);
+    }
+    ring->items[tail & (IO_THREADS_RING_SIZE-1)] = c;
+    ring->tail = tail+1;
+}
+
+/* Dequeue the next client, or NULL if the ring is empty. Called only by
+ * the owning I/O thread. */
+static client *ioThreadRingPop(ioThreadRing *ring) {
+    unsigned long head = ring->head;
+    if (head == ring->tail) return NULL;
+    client *c = ring->items[head & (IO_THREADS_RING_SIZE-1)];
+    ring->head = head+1;
+    return c;
+}
+
+_Thread_local int io_threads_executing_command = 0;
+
+/* Try to execute the command an I/O thread just finished parsing for 'c',
+ * directly in the thread context. This is only attempted when the user
+ * enabled io-threads-do-execute, and is restricted to a few non-blocking
+ * O(1)/O(N keys) read-only commands executed on behalf of clients with no
+ * special state: everything else is deferred to the main thread as usual,
+ * and writes remain serialized there.
+ *
+ * It is safe to touch the keyspace here because during the threaded read
+ * phase the main thread is parked waiting for the I/O threads, and the
+ * lookup functions take a strictly read-only path when
+ * io_threads_executing_command is set (see lookupKeyReadWithFlags()).
+ *
+ * Returns 1 if the command was executed and the client reset, so the
+ * caller must clear the CLIENT_PENDING_COMMAND flag. Returns 0 if the
+ * command must be processed by the main thread as usual. */
+int tryExecuteCommandFromIOThread(client *c) {
+    struct redisCommand *cmd;
+    dictEntry *de;
+
+    if (!server.io_threads_do_execute) return 0;
+
+    /* While values lazily loaded from a memory mapped RDB file are still
+     * around, lookups may materialize them modifying the keyspace, so the
+     * read-only fast path is not safe. */
+    if (rdbLazyValuesPresent()) return 0;
+
+    /* The restricted execution path can't handle cluster redirections,
+     * command monitors, keyspace miss events or client side caching. */
+    if (server.cluster_enabled ||
+        listLength(server.monitors) ||
+        (server.notify_keyspace_events & NOTIFY_KEY_MISS)) return 0;
+    if (c->flags & (CLIENT_MULTI|CLIENT_TRACKING|CLIENT_CLOSE_ASAP|
+                    CLIENT_CLOSE_AFTER_REPLY|CLIENT_LUA)) return 0;
+
+    /* Plain point reads only. Note that the command dict may be in the
+     * middle of a rehashing if a module registered commands at runtime,
+     * so the lookup must not perform rehash steps. */
+    if ((de = dictFindNoRehash(server.commands,c->argv[0]->ptr)) == NULL)
+        return 0;
+    cmd = dictGetVal(de);
+    if (cmd->proc != getCommand &&
+        cmd->proc != mgetCommand &&
+        cmd->proc != hgetCommand) return 0;
+    if ((cmd->arity > 0 && cmd->arity != c->argc) ||
+        (c->argc < -cmd->arity)) return 0;
+
+    /* Authentication and ACLs are still enforced: on failure we just
+     * defer to the main thread, that will emit the proper error. */
+    int auth_required = (!(DefaultUser->flags & USER_FLAG_NOPASS) ||
+                          DefaultUser->flags & USER_FLAG_DISABLED) &&
+                        !c->authenticated;
+    if (auth_required) return 0;
+    /* ACLCheckCommandPerm() lazily rebuilds the user's compiled key
+     * patterns when they are out of date, a write to the shared user
+     * structure that must only happen on the main thread: defer there
+     * whenever a rebuild could trigger. */
+    if (!(c->user->flags & USER_FLAG_ALLKEYS) &&
+        c->user->compiled_generation != server.acl_generation) return 0;
+    c->cmd = c->lastcmd = cmd;
+    if (ACLCheckCommandPerm(c) != ACL_OK) return 0;
+
+    io_threads_executing_command = 1;
+    cmd->proc(c);
+    io_threads_executing_command = 0;
+    atomicIncr(server.stat_numcommands,1);
+    atomicIncr(server.stat_io_commands_processed,1);
+    resetClient(c);
+    return 1;
+}
+
+/* A slice of a multi-key read lookup batch, handed to an I/O thread via
+ * its ring (the item pointer is cast, its meaning is given by the
+ * IO_THREADS_OP_LOOKUP batch operation). The job covers the 'count'
+ * consecutive entries of keys[]/vals[] starting at 'start', so the
+ * values land directly in argument order and no gather pass is needed. */
+typedef struct ioThreadLookupJob {
+    redisDb *db;
+    robj **keys;  /* The keys to look up (shared, read only). */
+    robj **vals;  /* Output: value object or NULL, per key. */
+    int start;    /* First index of keys[]/vals[] this job covers. */
+    int count;    /* Number of consecutive entries covered. */
+} ioThreadLookupJob;
+
+/* Don't bother waking a thread up for fewer keys than this. */
+#define IO_THREADS_LOOKUP_MIN_SLICE 8
+
+/* Resolve the slice of lookups of 'job'. Runs on an I/O thread, or on
+ * the main thread for its own slice: either way the thread local
+ * io_threads_executing_command flag routes lookupKeyReadWithFlags()
+ * through its strictly read only path, so concurrent slices never step
+ * on each other even when their keys hash to the same dict shard. */
+static void ioThreadLookupJobRun(ioThreadLookupJob *job) {
+    io_threads_executing_command = 1;
+    for (int j = 0; j < job->count; j++) {
+        job->vals[job->start+j] =
+            lookupKeyReadWithFlags(job->db,job->keys[job->start+j],
+                                   LOOKUP_NONE);
+    }
+    io_threads_executing_command = 0;
+}
+
+/* Fan the 'count' read lookups of keys[] out across the I/O threads on
+ * behalf of client 'c', filling vals[] (value object, or NULL for a
+ * missing or logically expired key) in the same order. The batch is
+ * split in even contiguous slices, one per I/O thread plus one that the
+ * main thread resolves itself while it waits for the others.
+ *
+ * This is only called between I/O batches, when every ring is empty and
+ * the workers are parked, so the rings and the pending counters can be
+ * reused for the lookup jobs with the same protocol the read and write
+ * batches use.
+ *
+ * Returns 1 if the lookups were performed, 0 if the caller must fall
+ * back to the serial path: the batch is too small to amortize the
+ * wakeups, or the threaded lookup path would skip observable side
+ * effects (keymiss notifications, client side caching bookkeeping,
+ * lazy loaded values). */
+int ioThreadsLookupKeys(client *c, robj **keys, int count, robj **vals) {
+    ioThreadLookupJob jobs[IO_THREADS_MAX_NUM+1];
+
+    if (!server.io_threads_do_lookups || io_threads_spawned == 0) return 0;
+    /* MGET itself may be running on an I/O thread (see
+     * tryExecuteCommandFromIOThread()): never nest. */
+    if (io_threads_executing_command) return 0;
+    int slices = io_threads_spawned+1; /* The main thread takes one too. */
+    if (count < slices*IO_THREADS_LOOKUP_MIN_SLICE) return 0;
+    if (rdbLazyValuesPresent()) return 0;
+    if (server.notify_keyspace_events & NOTIFY_KEY_MISS) return 0;
+    if (c->flags & CLIENT_TRACKING) return 0;
+
+    /* Same ordering as the read/write batches: the op is set before the
+     * first push, the pending counter is incremented before the push. */
+    io_threads_op = IO_THREADS_OP_LOOKUP;
+    int per = count/slices, extra = count%slices, start = 0;
+    for (int id = 0; id < slices; id++) {
+        jobs[id].db = c->db;
+        jobs[id].keys = keys;
+        jobs[id].vals = vals;
+        jobs[id].start = start;
+        jobs[id].count = per + (id < extra);
+        start += jobs[id].count;
+        if (id == slices-1) break; /* The last slice stays with us. */
+        io_threads_pending[id]++;
+        ioThreadRingPush(io_threads_ring[id],(client*)&jobs[id]);
+        ioThreadRingWakeup(io_threads_ring[id]);
+    }
+
+    /* Resolve our own slice while the threads work on theirs, then wait
+     * for everybody: the jobs live on our stack. */
+    ioThreadLookupJobRun(&jobs[slices-1]);
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 0; j < io_threads_spawned; j++)
+            pending += io_threads_pending[j];
+        if (pending == 0) break;
+    }
+    return 1;
+}
+
+/* Drain the worker ring, processing every queued item. Note that
+ * 'io_threads_op' is set by the main thread before the first item of a
+ * batch is queued, and the main thread waits for our pending count to
+ * drop to 0 before starting a batch with a different operation. */
+static void ioThreadRingDrain(ioThreadRing *ring) {
+    client *c;
+
+    while ((c = ioThreadRingPop(ring)) != NULL) {
+        if (io_threads_op == IO_THREADS_OP_WRITE) {
+            writeToClient(c,0);
+        } else if (io_threads_op == IO_THREADS_OP_READ) {
+            readQueryFromClient(c->conn);
+            /* If we parsed a complete command and it is one of the
+             * few read-only ones we can run without touching shared
+             * state, serve it right away from this thread. */
+            if ((c->flags & CLIENT_PENDING_COMMAND) &&
+                tryExecuteCommandFromIOThread(c))
+            {
+                c->flags &= ~CLIENT_PENDING_COMMAND;
+            }
+        } else if (io_threads_op == IO_THREADS_OP_LOOKUP) {
+            ioThreadLookupJobRun((ioThreadLookupJob*)c);
+        } else {
+            serverPanic("io_threads_op value is unknown");
+        }
+        io_threads_pending[ring->id]--;
+
+        if (tio_debug && io_threads_pending[ring->id] == 0)
+            printf("[%ld] Done\n", ring->id);
+    }
+}
+
+/* File event installed on the ring wakeup fd of every worker event loop:
+ * fired when the main thread queues work (or retires the worker). */
+static void ioThreadRingReadable(aeEventLoop *el, int fd, void *privdata,
+                                 int mask)
+{
+    ioThreadRing *ring = privdata;
+    uint64_t buf[8];
+    (void)mask;
+
+    /* Reset the eventfd counter (or drain the pipe) before consuming the
+     * ring: a wakeup sent while we are still draining then just fires
+     * one extra empty drain, never a lost one. */
+    while (read(fd,buf,sizeof(buf)) == -1 && errno == EINTR);
+    ioThreadRingDrain(ring);
+
+    /* Retiring? Exit the event loop once the ring is fully drained: the
+     * main thread joins us and reclaims the ring. */
+    if (ring->shutdown && ring->head == ring->tail) aeStop(el);
+}
 
 void *IOThreadMain(void *myid) {
     /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
      * used by the thread to just manipulate a single sub-array of clients. */
     long id = (unsigned long)myid;
 
-    while(1) {
-        /* Wait for start */
-        for (int j = 0; j < 1000000; j++) {
-            if (io_threads_pending[id] != 0) break;
-        }
+    redisSetCpuAffinity(server.server_cpulist);
+
+    ioThreadRing *ring = io_threads_ring[id];
+
+    /* Every worker runs its own complete, private ae event loop, just
+     * like the main thread runs server.el. Today the only registered
+     * event is the ring wakeup fd -- the SPSC rings remain the only
+     * channel between the threads -- but any per-thread file or time
+     * event can now be added without reworking how the workers park:
+     * an idle worker simply sleeps in its poll(2) equivalent and burns
+     * no CPU. */
+    aeEventLoop *el = aeCreateEventLoop(64);
+    if (el == NULL ||
+        aeCreateFileEvent(el,ring->wakeup_rfd,AE_READABLE,
+                          ioThreadRingReadable,ring) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating I/O thread event loop.");
+    }
+    aeMain(el);
 
-        /* Give the main thread a chance to stop this thread. */
-        if (io_threads_pending[id] == 0) {
-            pthread_mutex_lock(&io_threads_mutex[id]);
-            pthread_mutex_unlock(&io_threads_mutex[id]);
-            continue;
-        }
+    /* aeStop() was called by the wakeup handler: we are retiring and the
+     * ring is empty. */
+    aeDeleteEventLoop(el);
+    return NULL;
+}
 
-        serverAssert(io_threads_pending[id] != 0);
+/* Create the ring and spawn the I/O thread with the given id. Returns
+ * C_OK on success, C_ERR (after logging the reason) otherwise. */
+static int spawnIOThread(int id) {
+    pthread_t tid;
+    ioThreadRing *ring = zcalloc(sizeof(ioThreadRing));
+#ifdef __linux__
+    ring->wakeup_rfd = ring->wakeup_wfd = eventfd(0,0);
+    if (ring->wakeup_rfd == -1) {
+        serverLog(LL_WARNING,
+            "Can't create eventfd for IO thread: %s",
+            strerror(errno));
+        zfree(ring);
+        return C_ERR;
+    }
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create pipe for IO thread: %s",
+            strerror(errno));
+        zfree(ring);
+        return C_ERR;
+    }
+    ring->wakeup_rfd = fds[0];
+    ring->wakeup_wfd = fds[1];
+    anetNonBlock(NULL,ring->wakeup_wfd);
+#endif
+    ring->id = id;
+    io_threads_ring[id] = ring;
+    io_threads_pending[id] = 0;
+    if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)id) != 0) {
+        serverLog(LL_WARNING,"Can't initialize IO thread.");
+        close(ring->wakeup_rfd);
+        if (ring->wakeup_wfd != ring->wakeup_rfd) close(ring->wakeup_wfd);
+        io_threads_ring[id] = NULL;
+        zfree(ring);
+        return C_ERR;
+    }
+    io_threads[id] = tid;
+    return C_OK;
+}
 
-        if (tio_debug) printf("[%ld] %d to handle\n", id, (int)listLength(io_threads_list[id]));
+/* Signal the I/O thread with the given id to exit and reclaim its ring.
+ * Must be called from the main thread with no batch in flight, so that
+ * the ring is empty and the thread is parked (or about to park) on its
+ * wakeup fd. */
+static void retireIOThread(int id) {
+    ioThreadRing *ring = io_threads_ring[id];
+
+    ring->shutdown = 1;
+    ioThreadRingWakeup(ring);
+    pthread_join(io_threads[id],NULL);
+    close(ring->wakeup_rfd);
+    if (ring->wakeup_wfd != ring->wakeup_rfd) close(ring->wakeup_wfd);
+    io_threads_ring[id] = NULL;
+    zfree(ring);
+}
 
-        /* Process: note that the main thread will never touch our list
-         * before we drop the pending count to 0. */
-        listIter li;
-        listNode *ln;
-        listRewind(io_threads_list[id],&li);
-        while((ln = listNext(&li))) {
-            client *c = listNodeValue(ln);
-            if (io_threads_op == IO_THREADS_OP_WRITE) {
-                writeToClient(c,0);
-            } else if (io_threads_op == IO_THREADS_OP_READ) {
-                readQueryFromClient(c->conn);
-            } else {
-                serverPanic("io_threads_op value is unknown");
-            }
+void stopThreadedIO(void);
+
+/* Hot-apply a new "io-threads" value: spawn the missing workers or
+ * retire the extra ones. This runs on the main thread between I/O
+ * batches, when every ring is empty and the pending counters are zero,
+ * so workers can be added and removed without synchronizing with a
+ * batch in flight. Returns C_OK, or C_ERR if a thread could not be
+ * spawned: in that case the already spawned workers are left in place
+ * and the caller is expected to retry or roll back the config. */
+int resizeIOThreads(int newnum) {
+    /* In single threaded mode no worker exists at all: the main thread
+     * performs the I/O directly. */
+    int target = (newnum == 1) ? 0 : newnum;
+
+    if (target < io_threads_spawned) {
+        /* Threads may be actively serving: drain the pending reads and
+         * deactivate the dispatch before retiring anybody. */
+        if (io_threads_active) stopThreadedIO();
+        while (io_threads_spawned > target)
+            retireIOThread(--io_threads_spawned);
+    } else {
+        while (io_threads_spawned < target) {
+            if (spawnIOThread(io_threads_spawned) == C_ERR) return C_ERR;
+            io_threads_spawned++;
         }
-        listEmpty(io_threads_list[id]);
-        io_threads_pending[id] = 0;
-
-        if (tio_debug) printf("[%ld] Done\n", id);
     }
+    return C_OK;
 }
 
 /* Initialize the data structures needed for threaded I/O. */
 void initThreadedIO(void) {
     io_threads_active = 0; /* We start with threads not active. */
 
+    /* Executing commands from the I/O threads only makes sense if the
+     * threads also read and parse the queries. */
+    if (server.io_threads_do_execute) server.io_threads_do_reads = 1;
+
     /* Don't spawn any thread if the user selected a single thread:
      * we'll handle I/O directly from the main thread. */
     if (server.io_threads_num == 1) return;
@@ -2716,26 +4580,20 @@ void initThreadedIO(void) {
     }
 
     /* Spawn the I/O threads. */
-    for (int i = 0; i < server.io_threads_num; i++) {
-        pthread_t tid;
-        pthread_mutex_init(&io_threads_mutex[i],NULL);
-        io_threads_pending[i] = 0;
-        io_threads_list[i] = listCreate();
-        pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
-        if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize IO thread.");
-            exit(1);
-        }
-        io_threads[i] = tid;
+    if (resizeIOThreads(server.io_threads_num) == C_ERR) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize IO threads.");
+        exit(1);
     }
 }
 
+/* With the threads parked on their wakeup fd when idle, starting and
+ * stopping the threaded I/O is just a matter of flipping the flag that
+ * makes the main thread dispatch clients to the rings: an inactive
+ * thread consumes no CPU, so there is nothing else to do. */
 void startThreadedIO(void) {
     if (tio_debug) { printf("S"); fflush(stdout); }
     if (tio_debug) printf("--- STARTING THREADED IO ---\n");
     serverAssert(io_threads_active == 0);
-    for (int j = 0; j < server.io_threads_num; j++)
-        pthread_mutex_unlock(&io_threads_mutex[j]);
     io_threads_active = 1;
 }
 
@@ -2748,8 +4606,6 @@ void stopThreadedIO(void) {
         (int) listLength(server.clients_pending_read),
         (int) listLength(server.clients_pending_write));
     serverAssert(io_threads_active == 1);
-    for (int j = 0; j < server.io_threads_num; j++)
-        pthread_mutex_lock(&io_threads_mutex[j]);
     io_threads_active = 0;
 }
 
@@ -2791,7 +4647,12 @@ int handleClientsWithPendingWritesUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL WRITE pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across the per-thread rings. The operation
+     * is set before queueing the first client: a thread still awake from
+     * the previous batch may legally start consuming right away. The
+     * pending counter is incremented before the push so the wait loop
+     * below can never observe an in-flight client as done. */
+    io_threads_op = IO_THREADS_OP_WRITE;
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_write,&li);
@@ -2799,17 +4660,24 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_WRITE;
+
+        /* Replicas are written synchronously by the main thread: their
+         * write path mutates the shared replication buffer reference
+         * counts, that the I/O threads can't touch safely. */
+        if ((c->flags & CLIENT_SLAVE) && !(c->flags & CLIENT_MONITOR)) {
+            writeToClient(c,0);
+            continue;
+        }
         int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
+        io_threads_pending[target_id]++;
+        ioThreadRingPush(io_threads_ring[target_id],c);
         item_id++;
     }
 
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_WRITE;
+    /* Wake up the threads that got clients queued. */
     for (int j = 0; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
+        if (io_threads_pending[j] != 0)
+            ioThreadRingWakeup(io_threads_ring[j]);
     }
 
     /* Wait for all threads to end their work. */
@@ -2826,6 +4694,15 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     listRewind(server.clients_pending_write,&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
+        /* Consume the node right away: releasing a client from output
+         * buffer backpressure below may queue it again into the pending
+         * write list, and such new nodes must survive this loop. */
+        listDelNode(server.clients_pending_write,ln);
+
+        /* The I/O threads can't touch the client state, so the release
+         * from output buffer backpressure happens here, from the main
+         * thread, once the buffer was flushed. */
+        clientCheckObufBackpressureRelease(c);
 
         /* Install the write handler if there are pending writes in some
          * of the clients. */
@@ -2835,7 +4712,6 @@ int handleClientsWithPendingWritesUsingThreads(void) {
             freeClientAsync(c);
         }
     }
-    listEmpty(server.clients_pending_write);
     return processed;
 }
 
@@ -2869,7 +4745,9 @@ int handleClientsWithPendingReadsUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL READ pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across the per-thread rings. See the
+     * write path above for the ordering requirements. */
+    io_threads_op = IO_THREADS_OP_READ;
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_read,&li);
@@ -2877,16 +4755,15 @@ int handleClientsWithPendingReadsUsingThreads(void) {
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
+        io_threads_pending[target_id]++;
+        ioThreadRingPush(io_threads_ring[target_id],c);
         item_id++;
     }
 
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_READ;
+    /* Wake up the threads that got clients queued. */
     for (int j = 0; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
+        if (io_threads_pending[j] != 0)
+            ioThreadRingWakeup(io_threads_ring[j]);
     }
 
     /* Wait for all threads to end their work. */
@@ -2905,9 +4782,20 @@ int handleClientsWithPendingReadsUsingThreads(void) {
         c->flags &= ~CLIENT_PENDING_READ;
         if (c->flags & CLIENT_PENDING_COMMAND) {
             c->flags &= ~ CLIENT_PENDING_COMMAND;
-            processCommandAndResetClient(c);
+            if (processCommandAndResetClient(c) == C_ERR) {
+                /* If the client is no longer valid, we avoid
+                 * processing the client later. So we just go
+                 * to the next. */
+                continue;
+            }
         }
         processInputBufferAndReplicate(c);
+
+        /* We may have pending replies if a command was executed directly
+         * from the I/O thread: the write handler is never installed from
+         * threads, so take care of it here. */
+        if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c))
+            clientInstallWriteHandler(c);
     }
     listEmpty(server.clients_pending_read);
     return processed;
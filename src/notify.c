@@ -56,6 +56,7 @@ int keyspaceEventsStringToFlags(char *classes) {
         case 'E': flags |= NOTIFY_KEYEVENT; break;
         case 't': flags |= NOTIFY_STREAM; break;
         case 'm': flags |= NOTIFY_KEY_MISS; break;
+        case 'n': flags |= NOTIFY_HOTKEY; break;
         default: return -1;
         }
     }
@@ -83,12 +84,97 @@ sds keyspaceEventsFlagsToString(int flags) {
         if (flags & NOTIFY_EVICTED) res = sdscatlen(res,"e",1);
         if (flags & NOTIFY_STREAM) res = sdscatlen(res,"t",1);
         if (flags & NOTIFY_KEY_MISS) res = sdscatlen(res,"m",1);
+        if (flags & NOTIFY_HOTKEY) res = sdscatlen(res,"n",1);
     }
     if (flags & NOTIFY_KEYSPACE) res = sdscatlen(res,"K",1);
     if (flags & NOTIFY_KEYEVENT) res = sdscatlen(res,"E",1);
     return res;
 }
 
+/* Event names ("set", "expired", ...) and the __keyevent@<db>__ channel
+ * names derived from them are drawn from a small fixed set: instead of
+ * creating and destroying a string object for them at every notification,
+ * they are interned in the caches below the first time they are seen and
+ * shared (the cached objects are never released). The __keyspace@<db>__
+ * channel name depends on the key and is still built per event. */
+static rax *notify_event_cache = NULL;      /* event name -> shared robj. */
+static rax *notify_keyevent_cache = NULL;   /* dbid+event -> channel robj. */
+
+/* Return the shared object for the given event name. */
+static robj *notifyGetSharedEvent(char *event, size_t len) {
+    if (notify_event_cache == NULL) notify_event_cache = raxNew();
+    robj *o = raxFind(notify_event_cache,(unsigned char*)event,len);
+    if (o == raxNotFound) {
+        o = createStringObject(event,len);
+        raxInsert(notify_event_cache,(unsigned char*)event,len,o,NULL);
+    }
+    return o;
+}
+
+/* Build the "__keyevent@<dbid>__:<event>" channel name as a string
+ * object. */
+static robj *notifyCreateKeyeventChannel(int dbid, char *event, size_t len) {
+    char buf[24];
+    sds chan = sdsnewlen("__keyevent@",11);
+    chan = sdscatlen(chan,buf,ll2string(buf,sizeof(buf),dbid));
+    chan = sdscatlen(chan,"__:",3);
+    chan = sdscatlen(chan,event,len);
+    return createObject(OBJ_STRING,chan);
+}
+
+/* Return the shared "__keyevent@<dbid>__:<event>" channel object. The
+ * caller must make sure the event name fits the cache key buffer (core
+ * event names always do, module provided ones may not). */
+static robj *notifyGetKeyeventChannel(int dbid, char *event, size_t len) {
+    unsigned char cachekey[4+64];
+
+    if (notify_keyevent_cache == NULL) notify_keyevent_cache = raxNew();
+    cachekey[0] = (dbid >> 24) & 0xff;
+    cachekey[1] = (dbid >> 16) & 0xff;
+    cachekey[2] = (dbid >> 8) & 0xff;
+    cachekey[3] = dbid & 0xff;
+    memcpy(cachekey+4,event,len);
+
+    robj *o = raxFind(notify_keyevent_cache,cachekey,4+len);
+    if (o == raxNotFound) {
+        o = notifyCreateKeyeventChannel(dbid,event,len);
+        raxInsert(notify_keyevent_cache,cachekey,4+len,o,NULL);
+    }
+    return o;
+}
+
+/* When notify-keyspace-batch is enabled, the pattern subscribers fan-out of
+ * every notification is queued here and flushed with a single scan of the
+ * pattern list at the end of the event loop iteration. The queue holds
+ * channel and message objects alternated, with a reference taken on each. */
+static robj **notify_batch = NULL;
+static size_t notify_batch_pairs = 0;
+static size_t notify_batch_size = 0;        /* Allocated pairs. */
+
+static void notifyBatchAdd(robj *channel, robj *message) {
+    if (notify_batch_pairs == notify_batch_size) {
+        notify_batch_size = notify_batch_size ? notify_batch_size*2 : 64;
+        notify_batch = zrealloc(notify_batch,
+                                sizeof(robj*)*notify_batch_size*2);
+    }
+    incrRefCount(channel);
+    incrRefCount(message);
+    notify_batch[notify_batch_pairs*2] = channel;
+    notify_batch[notify_batch_pairs*2+1] = message;
+    notify_batch_pairs++;
+}
+
+/* Deliver the queued notifications to the pattern subscribers. Called from
+ * beforeSleep(): this way N notifications produced inside the same event
+ * loop iteration cost one scan of the pattern list instead of N. */
+void notifyKeyspaceEventFlushBatch(void) {
+    if (notify_batch_pairs == 0) return;
+    pubsubPublishPatternsBatch(notify_batch,notify_batch_pairs);
+    for (size_t j = 0; j < notify_batch_pairs*2; j++)
+        decrRefCount(notify_batch[j]);
+    notify_batch_pairs = 0;
+}
+
 /* The API provided to the rest of the Redis core is a simple function:
  *
  * notifyKeyspaceEvent(char *event, robj *key, int dbid);
@@ -98,8 +184,7 @@ sds keyspaceEventsFlagsToString(int flags) {
  * 'dbid' is the database ID where the key lives.  */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
     sds chan;
-    robj *chanobj, *eventobj;
-    int len = -1;
+    robj *kschan = NULL, *kechan = NULL, *eventobj;
     char buf[24];
 
     /* If any modules are interested in events, notify the module system now.
@@ -111,30 +196,40 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
     /* If notifications for this class of events are off, return ASAP. */
     if (!(server.notify_keyspace_events & type)) return;
 
-    eventobj = createStringObject(event,strlen(event));
+    /* Events longer than the cache key buffer (only possible via the module
+     * API) are not interned. */
+    size_t eventlen = strlen(event);
+    int interned = eventlen <= 64;
+    eventobj = interned ? notifyGetSharedEvent(event,eventlen) :
+                          createStringObject(event,eventlen);
 
     /* __keyspace@<db>__:<key> <event> notifications. */
     if (server.notify_keyspace_events & NOTIFY_KEYSPACE) {
         chan = sdsnewlen("__keyspace@",11);
-        len = ll2string(buf,sizeof(buf),dbid);
-        chan = sdscatlen(chan, buf, len);
+        chan = sdscatlen(chan, buf, ll2string(buf,sizeof(buf),dbid));
         chan = sdscatlen(chan, "__:", 3);
         chan = sdscatsds(chan, key->ptr);
-        chanobj = createObject(OBJ_STRING, chan);
-        pubsubPublishMessage(chanobj, eventobj);
-        decrRefCount(chanobj);
+        kschan = createObject(OBJ_STRING, chan);
     }
 
     /* __keyevent@<db>__:<event> <key> notifications. */
     if (server.notify_keyspace_events & NOTIFY_KEYEVENT) {
-        chan = sdsnewlen("__keyevent@",11);
-        if (len == -1) len = ll2string(buf,sizeof(buf),dbid);
-        chan = sdscatlen(chan, buf, len);
-        chan = sdscatlen(chan, "__:", 3);
-        chan = sdscatsds(chan, eventobj->ptr);
-        chanobj = createObject(OBJ_STRING, chan);
-        pubsubPublishMessage(chanobj, key);
-        decrRefCount(chanobj);
+        kechan = interned ? notifyGetKeyeventChannel(dbid,event,eventlen) :
+                            notifyCreateKeyeventChannel(dbid,event,eventlen);
+    }
+
+    /* Fan-out to the subscribers of both channels with a single pass over
+     * the pattern list. With batching enabled the pattern subscribers are
+     * instead served once per event loop iteration. */
+    int batch = server.notify_keyspace_batch;
+    pubsubPublishMessagePair(kschan,eventobj,kechan,key,batch);
+    if (batch) {
+        if (kschan) notifyBatchAdd(kschan,eventobj);
+        if (kechan) notifyBatchAdd(kechan,key);
+    }
+    if (kschan) decrRefCount(kschan);
+    if (!interned) {
+        if (kechan) decrRefCount(kechan);
+        decrRefCount(eventobj);
     }
-    decrRefCount(eventobj);
 }
@@ -29,6 +29,8 @@
  */
 
 #include "server.h"
+#include "bio.h"
+#include "atomicvar.h"
 #include <math.h>
 #include <ctype.h>
 
@@ -38,20 +40,24 @@
 
 /* ===================== Creation and parsing of objects ==================== */
 
-robj *createObject(int type, void *ptr) {
-    robj *o = zmalloc(sizeof(*o));
-    o->type = type;
-    o->encoding = OBJ_ENCODING_RAW;
-    o->ptr = ptr;
-    o->refcount = 1;
-
-    /* Set the LRU to the current lruclock (minutes resolution), or
-     * alternatively the LFU counter. */
+/* Set the LRU to the current lruclock (minutes resolution), or
+ * alternatively the LFU counter. Called on creation, and again when an
+ * object is recycled instead of allocated (see freeClientArgv()). */
+void initObjectLRUOrLFU(robj *o) {
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
     } else {
         o->lru = LRU_CLOCK();
     }
+}
+
+robj *createObject(int type, void *ptr) {
+    robj *o = zmalloc_typed(ZMALLOC_TYPE_METADATA,sizeof(*o));
+    o->type = type;
+    o->encoding = OBJ_ENCODING_RAW;
+    o->ptr = ptr;
+    o->refcount = 1;
+    initObjectLRUOrLFU(o);
     return o;
 }
 
@@ -82,18 +88,15 @@ robj *createRawStringObject(const char *ptr, size_t len) {
  * an object where the sds string is actually an unmodifiable string
  * allocated in the same chunk as the object itself. */
 robj *createEmbeddedStringObject(const char *ptr, size_t len) {
-    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
+    robj *o = zmalloc_typed(ZMALLOC_TYPE_METADATA,
+                            sizeof(robj)+sizeof(struct sdshdr8)+len+1);
     struct sdshdr8 *sh = (void*)(o+1);
 
     o->type = OBJ_STRING;
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
     o->refcount = 1;
-    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-        o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
-    } else {
-        o->lru = LRU_CLOCK();
-    }
+    initObjectLRUOrLFU(o);
 
     sh->len = len;
     sh->alloc = len;
@@ -240,9 +243,9 @@ robj *createIntsetObject(void) {
 }
 
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -257,10 +260,10 @@ robj *createZsetObject(void) {
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+robj *createZsetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_ZSET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -295,6 +298,7 @@ void freeListObject(robj *o) {
 void freeSetObject(robj *o) {
     switch (o->encoding) {
     case OBJ_ENCODING_HT:
+        setSamplerRelease((dict*) o->ptr);
         dictRelease((dict*) o->ptr);
         break;
     case OBJ_ENCODING_INTSET:
@@ -314,7 +318,7 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
         zfree(o->ptr);
         break;
     default:
@@ -327,7 +331,8 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
+        hashTypeIndexInvalidate(o);
         zfree(o->ptr);
         break;
     default:
@@ -346,12 +351,237 @@ void freeStreamObject(robj *o) {
     freeStream(o->ptr);
 }
 
+/* ----------------------- Async encoding conversion ----------------------- */
+
+/* Converting a compact encoding into a hash table (listpack -> dict for
+ * hashes, intset -> dict for sets) used to happen synchronously on the
+ * write that crossed the size threshold, adding the full cost of the
+ * rebuild to the latency of that one command. When enabled (see
+ * objConvertSetAsync()) the write only *schedules* the conversion: in
+ * beforeSleep() we snapshot the compact representation, hand it to the
+ * BIO_OBJ_CONVERT background thread which builds the dict from the
+ * private snapshot, and keep serving the object in its old encoding in
+ * the meantime. Once the dict is ready the main thread swaps it in, again
+ * from beforeSleep(), mirroring how lazyfree defers destruction and how
+ * quicklist defers node compression.
+ *
+ * Correctness hinges on the snapshot matching the live object at swap
+ * time: every mutation of a compact-encoded hash or set cancels the
+ * pending job (see objConvertCancel()), and the threshold check of the
+ * mutating write schedules a fresh one. A job holds a reference on the
+ * object, so deletion of the key cannot free it under the background
+ * thread and the active defrag will not move it (it skips shared
+ * objects). The job list itself is touched by the main thread only; the
+ * mutex just covers the state/result handoff with the bio thread. */
+
+#define OBJ_CONVERT_SCHEDULED 0  /* Waiting for the beforeSleep() snapshot. */
+#define OBJ_CONVERT_RUNNING   1  /* Snapshot handed to the bio thread. */
+#define OBJ_CONVERT_DONE      2  /* Result ready to be swapped in. */
+
+typedef struct objConvertJob {
+    robj *obj;            /* Target object, NULL once the job is canceled. */
+    int type;             /* OBJ_HASH or OBJ_SET. */
+    int state;            /* OBJ_CONVERT_* (guarded by the mutex). */
+    unsigned char *blob;  /* Private snapshot of the listpack / intset. */
+    dict *result;         /* Hash table built by the bio thread. */
+    struct objConvertJob *next;
+} objConvertJob;
+
+static pthread_mutex_t obj_convert_mutex = PTHREAD_MUTEX_INITIALIZER;
+static objConvertJob *obj_convert_jobs = NULL;
+static int obj_convert_enabled = 0;
+static pid_t obj_convert_pid = 0;
+
+/* Enable or disable background encoding conversions. Must be called after
+ * bioInit(). Disabling only affects new jobs: already scheduled ones are
+ * still completed (or discarded) by objConvertHandleCompleted(). */
+void objConvertSetAsync(int enable) {
+    obj_convert_enabled = enable;
+    obj_convert_pid = getpid();
+}
+
+/* Forked children inherit the job list but own none of the jobs, so they
+ * must stick to the synchronous conversion paths. */
+#define objConvertActive() \
+    (obj_convert_enabled && obj_convert_pid == getpid())
+
+/* Schedule a background conversion of 'o' (a listpack encoded hash or an
+ * intset encoded set) to the hash table encoding. Returns 1 if the object
+ * is now scheduled (possibly by an earlier call) and the caller should
+ * skip the synchronous conversion, 0 if background conversion is not
+ * available and the caller must convert in place. */
+int objConvertSchedule(robj *o) {
+    if (!objConvertActive()) return 0;
+    for (objConvertJob *job = obj_convert_jobs; job; job = job->next)
+        if (job->obj == o) return 1;
+
+    objConvertJob *job = zmalloc(sizeof(*job));
+    job->obj = o;
+    job->type = o->type;
+    job->state = OBJ_CONVERT_SCHEDULED;
+    job->blob = NULL;
+    job->result = NULL;
+    job->next = obj_convert_jobs;
+    obj_convert_jobs = job;
+    incrRefCount(o);
+    return 1;
+}
+
+/* Drop the scheduled or queued conversion job of 'o', if any. Must be
+ * called before the compact representation of a hash or set with a
+ * pending job is modified, otherwise the completion handler would swap in
+ * a hash table missing the modification. Cheap when no job exists. */
+void objConvertCancel(robj *o) {
+    if (obj_convert_jobs == NULL || obj_convert_pid != getpid()) return;
+    for (objConvertJob *job = obj_convert_jobs; job; job = job->next) {
+        if (job->obj == o) {
+            /* The mutating caller necessarily owns a reference on top of
+             * the one held by the job, so this cannot free the object. */
+            job->obj = NULL;
+            decrRefCount(o);
+            break;
+        }
+    }
+}
+
+/* Called by the bio thread to build the hash table from the snapshot of a
+ * queued job. Only job->blob is read and job->result / job->state are
+ * written: the blob is owned by the job and the mutex publishing the
+ * state change also publishes the dict to the main thread. */
+void objConvertFromBioThread(void *jobref) {
+    objConvertJob *job = jobref;
+    dict *d;
+
+    if (job->type == OBJ_HASH) {
+        unsigned char *zl = job->blob;
+        unsigned char *fptr = lpFirst(zl);
+
+        d = dictCreate(&hashDictType, NULL);
+        dictExpand(d, lpLength(zl)/2);
+        while (fptr != NULL) {
+            unsigned char *str;
+            unsigned int len;
+            long long v;
+            sds field, value;
+
+            str = lpGetValue(fptr, &len, &v);
+            field = str ? sdsnewlen(str, len) : sdsfromlonglong(v);
+            fptr = lpNext(zl, fptr);
+            serverAssert(fptr != NULL);
+            str = lpGetValue(fptr, &len, &v);
+            value = str ? sdsnewlen(str, len) : sdsfromlonglong(v);
+            serverAssert(dictAdd(d, field, value) == DICT_OK);
+            fptr = lpNext(zl, fptr);
+        }
+    } else if (job->type == OBJ_SET) {
+        intset *is = (intset*)job->blob;
+        uint32_t len = intsetLen(is);
+
+        d = dictCreate(&setDictType, NULL);
+        dictExpand(d, len);
+        for (uint32_t i = 0; i < len; i++) {
+            int64_t v;
+
+            serverAssert(intsetGet(is, i, &v));
+            serverAssert(dictAdd(d, sdsfromlonglong(v), NULL) == DICT_OK);
+        }
+    } else {
+        serverPanic("Unknown object type in conversion job");
+    }
+    pthread_mutex_lock(&obj_convert_mutex);
+    job->result = d;
+    job->state = OBJ_CONVERT_DONE;
+    pthread_mutex_unlock(&obj_convert_mutex);
+}
+
+/* Snapshot the objects scheduled for conversion and install the results
+ * of finished jobs. Called from the main thread (beforeSleep()) while no
+ * other thread may touch the dataset, so swapping the object
+ * representation is safe. Canceled jobs are discarded with their result. */
+void objConvertHandleCompleted(void) {
+    if (obj_convert_jobs == NULL || obj_convert_pid != getpid()) return;
+    objConvertJob **ref = &obj_convert_jobs, *job;
+    while ((job = *ref) != NULL) {
+        pthread_mutex_lock(&obj_convert_mutex);
+        int state = job->state;
+        pthread_mutex_unlock(&obj_convert_mutex);
+
+        if (state == OBJ_CONVERT_RUNNING) {
+            ref = &job->next;
+            continue;
+        }
+        if (state == OBJ_CONVERT_SCHEDULED && job->obj != NULL) {
+            /* Snapshot the compact representation and queue the job. A
+             * mutation since the schedule would have canceled the job, so
+             * the encoding is necessarily still the compact one. */
+            robj *o = job->obj;
+            size_t sz;
+
+            if (job->type == OBJ_HASH) {
+                serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
+                sz = lpBytes(o->ptr);
+            } else {
+                serverAssert(o->encoding == OBJ_ENCODING_INTSET);
+                sz = intsetBlobLen(o->ptr);
+            }
+            job->blob = zmalloc(sz);
+            memcpy(job->blob, o->ptr, sz);
+            job->state = OBJ_CONVERT_RUNNING;
+            bioCreateBackgroundJob(BIO_OBJ_CONVERT, job, NULL, NULL);
+            ref = &job->next;
+            continue;
+        }
+
+        /* DONE, or SCHEDULED but canceled: unlink and dispose. */
+        if (job->obj != NULL && state == OBJ_CONVERT_DONE) {
+            robj *o = job->obj;
+
+            if (job->type == OBJ_HASH) hashTypeIndexInvalidate(o);
+            zfree(o->ptr);
+            o->ptr = job->result;
+            o->encoding = OBJ_ENCODING_HT;
+            job->result = NULL;
+        }
+        *ref = job->next;
+        if (job->obj) decrRefCount(job->obj);
+        if (job->result) dictRelease(job->result); /* Canceled after build. */
+        zfree(job->blob);
+        zfree(job);
+    }
+}
+
+/* Reference counts are updated atomically: reply blocks hold references
+ * to value objects that writeToClient() releases from the I/O threads,
+ * and read-only commands executed directly on the I/O threads take new
+ * ones, so two threads of the same batch can update the counter of a
+ * shared value concurrently. Everything else (creation, the refcount == 1
+ * unsharing checks, and so forth) stays plain: the main thread only runs
+ * commands while the I/O threads are parked between batches. */
 void incrRefCount(robj *o) {
-    if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount++;
+    if (o->refcount != OBJ_SHARED_REFCOUNT) atomicIncr(o->refcount,1);
 }
 
 void decrRefCount(robj *o) {
-    if (o->refcount == 1) {
+    int refcount;
+
+    if (o->refcount == OBJ_SHARED_REFCOUNT) return;
+    atomicGetIncr(o->refcount,refcount,-1);
+    if (refcount == 1) {
+        if (o->encoding == OBJ_ENCODING_LAZY) {
+            /* A value never materialized from a memory mapped RDB file:
+             * it only holds a reference into the mapping, whatever its
+             * logical type is. */
+            rdbLazyValueFree(o);
+            zfree(o);
+            return;
+        }
+        if (o->encoding == OBJ_ENCODING_COLD) {
+            /* A stub for a value demoted to the cold tier: only the
+             * on-disk location is attached, whatever the logical type. */
+            coldValueFree(o);
+            zfree(o);
+            return;
+        }
         switch(o->type) {
         case OBJ_STRING: freeStringObject(o); break;
         case OBJ_LIST: freeListObject(o); break;
@@ -363,9 +593,8 @@ void decrRefCount(robj *o) {
         default: serverPanic("Unknown object type"); break;
         }
         zfree(o);
-    } else {
-        if (o->refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
-        if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount--;
+    } else if (refcount <= 0) {
+        serverPanic("decrRefCount against refcount <= 0");
     }
 }
 
@@ -428,6 +657,101 @@ void trimStringObjectIfNeeded(robj *o) {
 }
 
 /* Try to encode a string object in order to save space */
+/* ----------------------------------------------------------------------------
+ * Shared object cache: interning of repeated small values.
+ *
+ * Datasets often store the same small value under a huge number of keys
+ * ("true", country codes, status enums, hot counters past the
+ * shared.integers range). When shared-object-cache-size is non zero we
+ * keep a fixed table of recently encoded values, keyed by content hash:
+ * a value that matches a cached one is dropped in favor of an extra
+ * reference to the shared object, so hot repeated values cost one robj
+ * fleet-wide instead of one per key. Slots are direct mapped and simply
+ * overwritten on collision, so the cache adapts to whatever values are
+ * hot with no maintenance cost. The usual restriction on shared objects
+ * applies: like shared.integers, the cache is bypassed under the
+ * maxmemory policies that need a private LRU/LFU field per value.
+ * -------------------------------------------------------------------- */
+
+static robj **shared_object_cache = NULL;
+static unsigned long shared_object_cache_slots = 0; /* Power of two. */
+
+/* Create, resize or release (size 0) the shared object cache. The size is
+ * rounded up to a power of two. Cached values are only dropped here, or
+ * when evicted by a colliding value. */
+void sharedObjectCacheResize(long long size) {
+    unsigned long slots = 1;
+    if (size <= 0) slots = 0;
+    else while (slots < (unsigned long long)size) slots *= 2;
+
+    for (unsigned long j = 0; j < shared_object_cache_slots; j++)
+        if (shared_object_cache[j]) decrRefCount(shared_object_cache[j]);
+    zfree(shared_object_cache);
+    shared_object_cache = slots ? zcalloc(slots*sizeof(robj*)) : NULL;
+    shared_object_cache_slots = slots;
+}
+
+/* Number of values currently interned, for MEMORY STATS. */
+size_t sharedObjectCacheEntries(void) {
+    size_t entries = 0;
+    for (unsigned long j = 0; j < shared_object_cache_slots; j++)
+        if (shared_object_cache[j]) entries++;
+    return entries;
+}
+
+/* Try to replace the just encoded value 'o' with an identical shared
+ * object from the cache, or intern 'o' for the next time the same value
+ * shows up. Called by tryObjectEncoding() on its INT/EMBSTR results, so
+ * 'o' is never a candidate for in-place modification: writers already
+ * unshare values with refcount > 1 (see dbUnshareStringValue()). */
+static robj *tryObjectSharing(robj *o) {
+    char numbuf[32];
+    char *key;
+    size_t len;
+
+    if (shared_object_cache_slots == 0 || o->refcount != 1) return o;
+    if (server.maxmemory > 0 &&
+        (server.maxmemory_policy & MAXMEMORY_FLAG_NO_SHARED_INTEGERS))
+        return o;
+
+    if (o->encoding == OBJ_ENCODING_INT) {
+        len = ll2string(numbuf,sizeof(numbuf),(long)o->ptr);
+        key = numbuf;
+    } else if (sdsEncodedObject(o)) {
+        key = o->ptr;
+        len = sdslen(key);
+        if (len > OBJ_ENCODING_EMBSTR_SIZE_LIMIT) return o;
+    } else {
+        return o;
+    }
+
+    uint64_t hash = dictGenHashFunction(key,len);
+    robj **slot = &shared_object_cache[hash & (shared_object_cache_slots-1)];
+    robj *cached = *slot;
+    if (cached) {
+        int equal;
+        if (cached->encoding == OBJ_ENCODING_INT)
+            equal = o->encoding == OBJ_ENCODING_INT && cached->ptr == o->ptr;
+        else
+            equal = o->encoding != OBJ_ENCODING_INT &&
+                    sdslen(cached->ptr) == len &&
+                    memcmp(cached->ptr,key,len) == 0;
+        if (equal) {
+            server.stat_shared_object_cache_hits++;
+            server.stat_shared_object_cache_saved += zmalloc_size(o);
+            decrRefCount(o);
+            incrRefCount(cached);
+            return cached;
+        }
+        /* Collision with a different value: adopt the newcomer, a hotter
+         * value will win the slot back on its next appearance. */
+        decrRefCount(cached);
+    }
+    *slot = o;
+    incrRefCount(o);
+    return o;
+}
+
 robj *tryObjectEncoding(robj *o) {
     long value;
     sds s = o->ptr;
@@ -471,10 +795,11 @@ robj *tryObjectEncoding(robj *o) {
                 sdsfree(o->ptr);
                 o->encoding = OBJ_ENCODING_INT;
                 o->ptr = (void*) value;
-                return o;
+                return tryObjectSharing(o);
             } else if (o->encoding == OBJ_ENCODING_EMBSTR) {
                 decrRefCount(o);
-                return createStringObjectFromLongLongForValue(value);
+                return tryObjectSharing(
+                    createStringObjectFromLongLongForValue(value));
             }
         }
     }
@@ -486,10 +811,10 @@ robj *tryObjectEncoding(robj *o) {
     if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT) {
         robj *emb;
 
-        if (o->encoding == OBJ_ENCODING_EMBSTR) return o;
+        if (o->encoding == OBJ_ENCODING_EMBSTR) return tryObjectSharing(o);
         emb = createEmbeddedStringObject(s,sdslen(s));
         decrRefCount(o);
-        return emb;
+        return tryObjectSharing(emb);
     }
 
     /* We can't encode the object...
@@ -736,9 +1061,12 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_HT: return "hashtable";
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+    case OBJ_ENCODING_LAZY: return "lazy";
+    case OBJ_ENCODING_COLD: return "cold";
     default: return "unknown";
     }
 }
@@ -781,6 +1109,15 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
     struct dictEntry *de;
     size_t asize = 0, elesize = 0, samples = 0;
 
+    /* A value not yet materialized from a memory mapped RDB file only
+     * consumes its bookkeeping structure: the payload is in the mapping. */
+    if (o->encoding == OBJ_ENCODING_LAZY)
+        return sizeof(*o)+rdbLazyValueMemUsage(o);
+
+    /* Same for a value demoted to the cold tier: the payload is on disk. */
+    if (o->encoding == OBJ_ENCODING_COLD)
+        return sizeof(*o)+coldValueMemUsage(o);
+
     if (o->type == OBJ_STRING) {
         if(o->encoding == OBJ_ENCODING_INT) {
             asize = sizeof(*o);
@@ -813,7 +1150,10 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sizeof(*o)+sizeof(dict)+(sizeof(struct dictEntry*)*dictSlots(d));
             while((de = dictNext(di)) != NULL && samples < sample_size) {
                 ele = dictGetKey(de);
-                elesize += sizeof(struct dictEntry) + sdsAllocSize(ele);
+                /* Entries use the extended layout; sdsAllocSize() is right
+                 * for both inline and heap allocated elements, since an
+                 * inline element consumes exactly its placement size. */
+                elesize += sizeof(dictEntryEx) + sdsAllocSize(ele);
                 samples++;
             }
             dictReleaseIterator(di);
@@ -825,28 +1165,25 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
-            zskiplistNode *znode = zsl->header->level[0].forward;
+            /* The nodes and their inline elements live in the skiplist
+             * arena, and the hash table keys and values point into the
+             * nodes, so the arena size plus the dict entries gives an
+             * exact figure with no need to sample. */
             asize = sizeof(*o)+sizeof(zset)+sizeof(zskiplist)+sizeof(dict)+
                     (sizeof(struct dictEntry*)*dictSlots(d))+
-                    zmalloc_size(zsl->header);
-            while(znode != NULL && samples < sample_size) {
-                elesize += sdsAllocSize(znode->ele);
-                elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
-                samples++;
-                znode = znode->level[0].forward;
-            }
-            if (samples) asize += (double)elesize/samples*dictSize(d);
+                    (sizeof(struct dictEntry)*dictSize(d))+
+                    zslAllocatedBytes(zsl);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -855,7 +1192,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 ele = dictGetKey(de);
                 ele2 = dictGetVal(de);
                 elesize += sdsAllocSize(ele) + sdsAllocSize(ele2);
-                elesize += sizeof(struct dictEntry);
+                elesize += sizeof(dictEntryEx); /* Fields may be inline. */
                 samples++;
             }
             dictReleaseIterator(di);
@@ -905,7 +1242,12 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 streamCG *cg = ri.data;
                 asize += sizeof(*cg);
                 asize += streamRadixTreeMemoryUsage(cg->pel);
-                asize += sizeof(streamNACK)*raxSize(cg->pel);
+                /* The NACKs are carved from the group arena blocks. */
+                for (streamNACKBlock *block = cg->nack_blocks; block;
+                     block = block->next)
+                {
+                    asize += sizeof(*block);
+                }
 
                 /* For each consumer we also need to add the basic data
                  * structures and the PEL memory usage. */
@@ -977,8 +1319,12 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem_total += server.initial_memory_usage;
 
     mem = 0;
-    if (server.repl_backlog)
+    if (server.repl_backlog) {
+        /* The shared replication buffer blocks hold the backlog history:
+         * we report them here, while the slaves just hold references. */
         mem += zmalloc_size(server.repl_backlog);
+        mem += server.repl_buffer_mem;
+    }
     mh->repl_backlog = mem;
     mem_total += mem;
 
@@ -990,7 +1336,6 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         listRewind(server.slaves,&li);
         while((ln = listNext(&li))) {
             client *c = listNodeValue(ln);
-            mem += getClientOutputBufferMemoryUsage(c);
             mem += sdsAllocSize(c->querybuf);
             mem += sizeof(client);
         }
@@ -1038,16 +1383,19 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
-        long long keyscount = dictSize(db->dict);
+        long long keyscount = dbSize(db);
         if (keyscount==0) continue;
 
         mh->total_keys += keyscount;
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = dictSize(db->dict) * sizeof(dictEntry) +
-              dictSlots(db->dict) * sizeof(dictEntry*) +
-              dictSize(db->dict) * sizeof(robj);
+        unsigned long main_slots = 0;
+        for (int i = 0; i < server.db_dict_shards; i++)
+            main_slots += dictSlots(db->dict[i]);
+        mem = keyscount * sizeof(dictEntryEx) +
+              main_slots * sizeof(dictEntry*) +
+              keyscount * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
@@ -1094,6 +1442,7 @@ sds getMemoryDoctorReport(void) {
     int big_slave_buf = 0;  /* Slave buffers are too big. */
     int big_client_buf = 0; /* Client buffers are too big. */
     int many_scripts = 0;   /* Script cache has too many scripts. */
+    int frag_growing = 0;   /* Fragmentation trending towards defrag. */
     int num_reports = 0;
     struct redisMemOverhead *mh = getMemoryOverheadData();
 
@@ -1150,6 +1499,16 @@ sds getMemoryDoctorReport(void) {
             many_scripts = 1;
             num_reports++;
         }
+
+        /* Fragmentation predicted to cross the defrag threshold soon? */
+        float frag_slope, frag_predicted;
+        if (defragForecast(&frag_slope, &frag_predicted) &&
+            frag_slope > 0 &&
+            frag_predicted > server.active_defrag_threshold_lower)
+        {
+            frag_growing = 1;
+            num_reports++;
+        }
     }
 
     sds s;
@@ -1190,6 +1549,9 @@ sds getMemoryDoctorReport(void) {
         if (many_scripts) {
             s = sdscat(s," * Many scripts: There seem to be many cached scripts in this instance (more than 1000). This may be because scripts are generated and `EVAL`ed, instead of being parameterized (with KEYS and ARGV), `SCRIPT LOAD`ed and `EVALSHA`ed. Unless `SCRIPT FLUSH` is called periodically, the scripts' caches may end up consuming most of your memory.\n\n");
         }
+        if (frag_growing) {
+            s = sdscat(s," * Growing fragmentation: The allocator fragmentation is trending upwards and is predicted to cross the active defrag lower threshold within a few minutes. With 'activedefrag' and 'active-defrag-forecast' enabled the defragmenter will start working proactively during the next quiet traffic window, otherwise expect either a fragmentation buildup or a defrag burst once the threshold is crossed.\n\n");
+        }
         s = sdscat(s,"I'm here to keep you safe, Sam. I want to help you.\n");
     }
     freeMemoryOverheadData(mh);
@@ -1212,9 +1574,9 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
     } else if (lru_idle >= 0) {
         /* Provided LRU idle time is in seconds. Scale
          * according to the LRU clock resolution this Redis
-         * instance was compiled with (normally 1000 ms, so the
+         * instance is running with (normally 1000 ms, so the
          * below statement will expand to lru_idle*1000/1000. */
-        lru_idle = lru_idle*lru_multiplier/LRU_CLOCK_RESOLUTION;
+        lru_idle = lru_idle*lru_multiplier/server.lru_clock_resolution;
         long lru_abs = lru_clock - lru_idle; /* Absolute access time. */
         /* If the LRU field underflows (since LRU it is a wrapping
          * clock), the best we can do is to provide a large enough LRU
@@ -1236,7 +1598,7 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 robj *objectCommandLookup(client *c, robj *key) {
     dictEntry *de;
 
-    if ((de = dictFind(c->db->dict,key->ptr)) == NULL) return NULL;
+    if ((de = dictFind(dbGetDict(c->db,key->ptr),key->ptr)) == NULL) return NULL;
     return (robj*) dictGetVal(de);
 }
 
@@ -1257,6 +1619,7 @@ void objectCommand(client *c) {
 "ENCODING <key> -- Return the kind of internal representation used in order to store the value associated with a key.",
 "FREQ <key> -- Return the access frequency index of the key. The returned integer is proportional to the logarithm of the recent access frequency of the key.",
 "IDLETIME <key> -- Return the idle time of the key, that is the approximated number of seconds elapsed since the last access to the key.",
+"INSPECT <key> [<key> ...] -- Return encoding, serialized length and the eviction metadata of every specified key in a single reply, without touching the LRU / LFU information.",
 "REFCOUNT <key> -- Return the number of references of the value associated with the specified key.",
 NULL
         };
@@ -1289,15 +1652,395 @@ NULL
          * because we update the access time only
          * when the key is read or overwritten. */
         addReplyLongLong(c,LFUDecrAndReturn(o));
+    } else if (!strcasecmp(c->argv[1]->ptr,"inspect") && c->argc >= 3) {
+        /* Batch introspection: one reply element per key, each being a map
+         * with the fields that FREQ / IDLETIME / ENCODING return one key at
+         * a time, plus the serialized length. Like the other subcommands
+         * the lookup does not update the LRU clock nor the LFU counter, so
+         * sampling many keys does not skew what is being measured. The
+         * field that the current maxmemory policy does not track is
+         * reported as -1. */
+        int lfu = server.maxmemory_policy & MAXMEMORY_FLAG_LFU;
+
+        addReplyArrayLen(c,c->argc-2);
+        for (int j = 2; j < c->argc; j++) {
+            robj *o = objectCommandLookup(c,c->argv[j]);
+
+            if (o == NULL) {
+                addReplyNull(c);
+                continue;
+            }
+            addReplyMapLen(c,4);
+            addReplyBulkCString(c,"encoding");
+            addReplyBulkCString(c,strEncoding(o->encoding));
+            addReplyBulkCString(c,"serializedlength");
+            addReplyLongLong(c,rdbSavedObjectLen(o));
+            addReplyBulkCString(c,"idletime");
+            if (lfu)
+                addReplyLongLong(c,-1);
+            else
+                addReplyLongLong(c,estimateObjectIdleTime(o)/1000);
+            addReplyBulkCString(c,"freq");
+            if (lfu)
+                addReplyLongLong(c,LFUDecrAndReturn(o));
+            else
+                addReplyLongLong(c,-1);
+        }
     } else {
         addReplySubcommandSyntaxError(c);
     }
 }
 
+/* ----------------------- Per type memory statistics ---------------------- */
+
+/* Number of random keys inspected by MEMORY STATS to estimate the memory
+ * usage and the value size distribution of each object type. */
+#define MEMORY_STATS_TYPE_SAMPLES 256
+#define MEMORY_STATS_SIZE_BUCKETS 48 /* Power of two size buckets. */
+
+struct typeMemoryStats {
+    long long count;            /* Live number of keys of this type. */
+    long long samples;          /* Keys of this type that were sampled. */
+    unsigned long long bytes;   /* Total bytes across the sampled values. */
+    long long hist[MEMORY_STATS_SIZE_BUCKETS]; /* Samples per log2 bucket. */
+};
+
+/* Object type names indexed by type, for the MEMORY STATS fields. Unlike
+ * getObjectTypeName() this does not need a value at hand, so module typed
+ * keys are reported under the generic "module" name. */
+static char *typeMemoryStatsName[OBJ_TYPE_MAX] = {
+    "string","list","set","zset","hash","module","stream"
+};
+
+/* Fill 'stats', an array of OBJ_TYPE_MAX entries, with the per type key
+ * counts and an estimate of the per type memory usage and value size
+ * distribution.
+ *
+ * The counts are taken from the live db->type_count[] counters and are
+ * exact. The sizes instead cannot be tracked incrementally, because values
+ * grow, shrink and change encoding in place after being added to the
+ * keyspace: they are estimated here by calling objectComputeSize() on a
+ * bounded number of random keys, so the cost of the call does not depend
+ * on the keyspace size. */
+void computeTypeMemoryStats(struct typeMemoryStats *stats) {
+    long long total_keys = 0;
+
+    memset(stats,0,sizeof(*stats)*OBJ_TYPE_MAX);
+    for (int j = 0; j < server.dbnum; j++) {
+        for (int t = 0; t < OBJ_TYPE_MAX; t++)
+            stats[t].count += server.db[j].type_count[t];
+        total_keys += dbSize(&server.db[j]);
+    }
+    if (total_keys == 0) return;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        long long dbkeys = dbSize(db);
+        if (dbkeys == 0) continue;
+
+        /* Spread the sampling effort across the databases proportionally
+         * to their share of the total keyspace. */
+        long long samples = (long long)MEMORY_STATS_TYPE_SAMPLES *
+                            dbkeys / total_keys;
+        if (samples < 1) samples = 1;
+        while (samples--) {
+            dict *d = dbRandomShard(db);
+            if (d == NULL) break;
+            dictEntry *de = dictGetFairRandomKey(d);
+            if (de == NULL) continue;
+
+            robj *val = dictGetVal(de);
+            size_t bytes = objectComputeSize(val,
+                                             OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+            struct typeMemoryStats *ts = stats+val->type;
+            int msb = 0;
+            while (bytes >> (msb+1)) msb++;
+            if (msb >= MEMORY_STATS_SIZE_BUCKETS)
+                msb = MEMORY_STATS_SIZE_BUCKETS-1;
+            ts->samples++;
+            ts->bytes += bytes;
+            ts->hist[msb]++;
+        }
+    }
+}
+
+/* Emit the per type MEMORY STATS fields, one map entry per object type.
+ * Each entry holds the exact key count, the estimated total memory and a
+ * histogram of the estimated number of keys per power of two value size. */
+void addReplyTypeMemoryStats(client *c, struct typeMemoryStats *stats) {
+    for (int t = 0; t < OBJ_TYPE_MAX; t++) {
+        struct typeMemoryStats *ts = stats+t;
+        char field[64];
+
+        snprintf(field,sizeof(field),"type.%s",typeMemoryStatsName[t]);
+        addReplyBulkCString(c,field);
+        addReplyMapLen(c,3);
+
+        addReplyBulkCString(c,"count");
+        addReplyLongLong(c,ts->count);
+
+        addReplyBulkCString(c,"bytes.estimate");
+        addReplyLongLong(c, ts->samples ?
+            (long long)((double)ts->bytes/ts->samples*ts->count) : 0);
+
+        addReplyBulkCString(c,"size.histogram");
+        int buckets = 0;
+        for (int b = 0; b < MEMORY_STATS_SIZE_BUCKETS; b++)
+            if (ts->hist[b]) buckets++;
+        addReplyMapLen(c,buckets);
+        for (int b = 0; b < MEMORY_STATS_SIZE_BUCKETS; b++) {
+            if (ts->hist[b] == 0) continue;
+            snprintf(field,sizeof(field),">=%llu",1ULL<<b);
+            addReplyBulkCString(c,field);
+            addReplyLongLong(c,
+                (long long)((double)ts->hist[b]/ts->samples*ts->count+0.5));
+        }
+    }
+}
+
 /* The memory command will eventually be a complete interface for the
  * memory introspection capabilities of Redis.
  *
  * Usage: MEMORY usage <key> */
+/* ----------------------------------------------------------------------------
+ * Forked heap census: MEMORY CENSUS
+ * ----------------------------------------------------------------------------
+ *
+ * Attributing memory to applications ("bytes by key pattern") with
+ * MEMORY USAGE over a SCAN loop takes hours on a big keyspace and loads
+ * the server the whole time. A fork() gives us the same cheap
+ * copy-on-write snapshot rdbSaveBackground() relies on: the child walks
+ * its frozen view of the keyspace at leisure, aggregates the per-key
+ * memory usage into the buckets described by the supplied glob patterns,
+ * and streams the totals back over a pipe, with zero impact on the
+ * parent besides the fork itself.
+ *
+ * The client issuing MEMORY CENSUS is blocked until the report arrives,
+ * exactly like DEBUG DIGEST ASYNC (see debug.c), which this borrows its
+ * structure from. Every key is accounted to the first pattern it
+ * matches, and keys matching no pattern land in the trailing "other"
+ * bucket. */
+
+#define MEMORY_CENSUS_MAX_PATTERNS 64
+
+typedef struct censusBucket {
+    uint64_t keys;          /* Number of keys accounted to the bucket. */
+    uint64_t bytes;         /* Estimated bytes used by those keys. */
+} censusBucket;
+
+typedef struct memoryCensusJob {
+    client *c;              /* Blocked owner, NULL if it went away. */
+    int pipe_rd;            /* Read end of the report pipe. */
+    int numpatterns;        /* Patterns requested (report has one more
+                               bucket: the trailing "other" one). */
+    censusBucket *buckets;  /* Report bytes received so far. */
+    size_t nread;
+} memoryCensusJob;
+
+static memoryCensusJob *memory_census_job = NULL;
+
+/* Release the current job, closing the pipe. If 'kill_child' is true and
+ * the census child is still running it is signaled to terminate. */
+static void memoryCensusJobFree(int kill_child) {
+    memoryCensusJob *job = memory_census_job;
+    if (job == NULL) return;
+    aeDeleteFileEvent(server.el,job->pipe_rd,AE_READABLE);
+    close(job->pipe_rd);
+    if (kill_child && server.census_child_pid != -1)
+        kill(server.census_child_pid,SIGUSR1);
+    zfree(job->buckets);
+    zfree(job);
+    memory_census_job = NULL;
+}
+
+/* Walk the whole keyspace of the forked child, attributing every key to
+ * the first matching pattern, and write the aggregated buckets to 'fd'.
+ * Returns C_OK if the full report was written. */
+static int memoryCensusChild(int fd, robj **patterns, int numpatterns) {
+    censusBucket *buckets = zcalloc(sizeof(censusBucket)*(numpatterns+1));
+
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dictEntry *de;
+        if (dbSize(db) == 0) continue;
+        dbIterator *dbit = dbGetSafeIterator(db);
+        while ((de = dbIteratorNext(dbit)) != NULL) {
+            sds key = dictGetKey(de);
+            int slot = numpatterns; /* The trailing "other" bucket. */
+
+            for (int i = 0; i < numpatterns; i++) {
+                if (stringmatchlen(patterns[i]->ptr,sdslen(patterns[i]->ptr),
+                                   key,sdslen(key),0))
+                {
+                    slot = i;
+                    break;
+                }
+            }
+
+            /* Same per-key accounting as MEMORY USAGE. */
+            size_t bytes = objectComputeSize(dictGetVal(de),
+                                             OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+            dict *d = dbGetDict(db,key);
+            if (!dictKeyIsInline(d,de)) bytes += sdsAllocSize(key);
+            bytes += zmalloc_size((void*)de);
+            buckets[slot].keys++;
+            buckets[slot].bytes += bytes;
+        }
+        dbReleaseIterator(dbit);
+    }
+
+    size_t towrite = sizeof(censusBucket)*(numpatterns+1), written = 0;
+    while (written < towrite) {
+        ssize_t n = write(fd,(char*)buckets+written,towrite-written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            zfree(buckets);
+            return C_ERR;
+        }
+        written += n;
+    }
+    zfree(buckets);
+    return C_OK;
+}
+
+/* Read handler of the census pipe: accumulate the report and deliver
+ * the reply to the blocked client once all of it arrived. */
+static void memoryCensusReadHandler(aeEventLoop *el, int fd, void *privdata,
+                                    int mask)
+{
+    memoryCensusJob *job = privdata;
+    size_t report_len = sizeof(censusBucket)*(job->numpatterns+1);
+    UNUSED(el);
+    UNUSED(mask);
+
+    ssize_t nread = read(fd,(char*)job->buckets+job->nread,
+                         report_len-job->nread);
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        nread = 0; /* Treat errors as an EOF: the child is gone. */
+    }
+    job->nread += nread;
+    if (nread > 0 && job->nread < report_len) return;
+
+    client *c = job->c;
+    if (c) {
+        if (job->nread == report_len) {
+            /* The blocked client still holds the command arguments the
+             * job was started with: the patterns are c->argv[2..]. */
+            addReplyMapLen(c,job->numpatterns+1);
+            for (int i = 0; i <= job->numpatterns; i++) {
+                if (i < job->numpatterns)
+                    addReplyBulk(c,c->argv[i+2]);
+                else
+                    addReplyBulkCString(c,"other");
+                addReplyMapLen(c,2);
+                addReplyBulkCString(c,"keys");
+                addReplyLongLong(c,job->buckets[i].keys);
+                addReplyBulkCString(c,"bytes");
+                addReplyLongLong(c,job->buckets[i].bytes);
+            }
+        } else {
+            addReplyError(c,"Census child terminated without producing "
+                            "a report");
+        }
+    }
+    /* Free the job before unblocking, so that the unblock hook finds
+     * nothing left to clean up. */
+    memoryCensusJobFree(0);
+    if (c) unblockClient(c);
+}
+
+/* Called by unblockClient() when a client blocked on a census goes away
+ * before the report is delivered: discard the whole job. */
+void memoryCensusUnblockClient(client *c) {
+    if (memory_census_job && memory_census_job->c == c)
+        memoryCensusJobFree(1);
+}
+
+/* Called by checkChildrenDone() when the census child is collected. On
+ * a clean exit the report is sitting in the pipe buffer and the read
+ * handler will deliver it; otherwise fail the pending job right away. */
+void memoryCensusDoneHandler(int exitcode, int bysignal) {
+    server.census_child_pid = -1;
+    if (!bysignal && exitcode == 0) return;
+    serverLog(LL_WARNING,"Memory census child terminated with an error "
+        "condition (exit code %d, signal %d)", exitcode, bysignal);
+    memoryCensusJob *job = memory_census_job;
+    if (job) {
+        client *c = job->c;
+        if (c) addReplyError(c,"Census child terminated abnormally");
+        memoryCensusJobFree(0);
+        if (c) unblockClient(c);
+    }
+}
+
+/* MEMORY CENSUS <pattern> [<pattern> ...]: fork a child aggregating the
+ * memory usage of the whole keyspace by key pattern and block the
+ * client until the report arrives over the pipe. */
+static void memoryCensusStart(client *c) {
+    int numpatterns = c->argc-2;
+    int pipefds[2];
+    pid_t childpid;
+
+    if (numpatterns > MEMORY_CENSUS_MAX_PATTERNS) {
+        addReplyErrorFormat(c,"Too many census patterns (max %d)",
+                            MEMORY_CENSUS_MAX_PATTERNS);
+        return;
+    }
+    if (hasActiveChildProcess()) {
+        addReplyError(c,"Another child process is active (AOF, RDB, module "
+                        "or snapshot): can't take a census now");
+        return;
+    }
+    if (pipe(pipefds) == -1) {
+        addReplyErrorFormat(c,"Can't create the census pipe: %s",
+                            strerror(errno));
+        return;
+    }
+
+    if ((childpid = redisFork()) == 0) {
+        /* Child: the keyspace is frozen by copy-on-write, aggregate it
+         * and stream the report back. */
+        close(pipefds[0]);
+        redisSetProcTitle("redis-memory-census");
+        int ret = memoryCensusChild(pipefds[1],c->argv+2,numpatterns);
+        close(pipefds[1]);
+        exitFromChild(ret == C_OK ? 0 : 1);
+    } else if (childpid == -1) {
+        close(pipefds[0]);
+        close(pipefds[1]);
+        addReplyErrorFormat(c,"Can't fork the census child: %s",
+                            strerror(errno));
+    } else {
+        /* Parent. */
+        close(pipefds[1]);
+        anetNonBlock(NULL,pipefds[0]);
+        serverLog(LL_NOTICE,
+            "Memory census started by pid %ld (%d patterns)",
+            (long)childpid, numpatterns);
+
+        memoryCensusJob *job = zmalloc(sizeof(*job));
+        job->c = c;
+        job->pipe_rd = pipefds[0];
+        job->numpatterns = numpatterns;
+        job->buckets = zmalloc(sizeof(censusBucket)*(numpatterns+1));
+        job->nread = 0;
+        memory_census_job = job;
+        server.census_child_pid = childpid;
+
+        if (aeCreateFileEvent(server.el,pipefds[0],AE_READABLE,
+                              memoryCensusReadHandler,job) == AE_ERR)
+        {
+            addReplyError(c,"Can't register the census pipe in the "
+                            "event loop");
+            memoryCensusJobFree(1);
+            return;
+        }
+        c->bpop.timeout = 0; /* No timeout: the job always completes. */
+        blockClient(c,BLOCKED_CENSUS);
+    }
+}
+
 void memoryCommand(client *c) {
     if (!strcasecmp(c->argv[1]->ptr,"help") && c->argc == 2) {
         const char *help[] = {
@@ -1306,9 +2049,12 @@ void memoryCommand(client *c) {
 "PURGE -- Attempt to purge dirty pages for reclamation by the allocator.",
 "STATS -- Return information about the memory usage of the server.",
 "USAGE <key> [SAMPLES <count>] -- Return memory in bytes used by <key> and its value. Nested values are sampled up to <count> times (default: 5).",
+"CENSUS <pattern> [<pattern> ...] -- Aggregate the memory used by the whole keyspace by key pattern, walking a forked copy-on-write snapshot.",
 NULL
         };
         addReplyHelp(c, help);
+    } else if (!strcasecmp(c->argv[1]->ptr,"census") && c->argc >= 3) {
+        memoryCensusStart(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"usage") && c->argc >= 3) {
         dictEntry *de;
         long long samples = OBJ_COMPUTE_SIZE_DEF_SAMPLES;
@@ -1329,18 +2075,24 @@ NULL
                 return;
             }
         }
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        dict *d = dbGetDict(c->db,c->argv[2]->ptr);
+        if ((de = dictFind(d,c->argv[2]->ptr)) == NULL) {
             addReplyNull(c);
             return;
         }
         size_t usage = objectComputeSize(dictGetVal(de),samples);
-        usage += sdsAllocSize(dictGetKey(de));
-        usage += sizeof(dictEntry);
+        /* Inline keys live inside the entry allocation itself, which is
+         * accounted below. */
+        if (!dictKeyIsInline(d,de))
+            usage += sdsAllocSize(dictGetKey(de));
+        usage += zmalloc_size((void*)de);
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
+        struct typeMemoryStats tstats[OBJ_TYPE_MAX];
+        computeTypeMemoryStats(tstats);
 
-        addReplyMapLen(c,25+mh->num_dbs);
+        addReplyMapLen(c,28+3*ZMALLOC_TYPE_COUNT+OBJ_TYPE_MAX+mh->num_dbs);
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1366,6 +2118,15 @@ NULL
         addReplyBulkCString(c,"lua.caches");
         addReplyLongLong(c,mh->lua_caches);
 
+        addReplyBulkCString(c,"object-cache.entries");
+        addReplyLongLong(c,sharedObjectCacheEntries());
+
+        addReplyBulkCString(c,"object-cache.hits");
+        addReplyLongLong(c,server.stat_shared_object_cache_hits);
+
+        addReplyBulkCString(c,"object-cache.bytes-saved");
+        addReplyLongLong(c,server.stat_shared_object_cache_saved);
+
         for (size_t j = 0; j < mh->num_dbs; j++) {
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
@@ -1388,6 +2149,8 @@ NULL
         addReplyBulkCString(c,"keys.bytes-per-key");
         addReplyLongLong(c,mh->bytes_per_key);
 
+        addReplyTypeMemoryStats(c,tstats);
+
         addReplyBulkCString(c,"dataset.bytes");
         addReplyLongLong(c,mh->dataset);
 
@@ -1406,6 +2169,31 @@ NULL
         addReplyBulkCString(c,"allocator.resident");
         addReplyLongLong(c,server.cron_malloc_stats.allocator_resident);
 
+        /* Per allocation class arena statistics: all zeros when the typed
+         * arenas are not in use (non-jemalloc builds). */
+        {
+            char *arena_names[ZMALLOC_TYPE_COUNT] =
+                {"metadata","value","transient"};
+            for (int j = 0; j < ZMALLOC_TYPE_COUNT; j++) {
+                size_t aalloc, aactive, aresident;
+                char field[64];
+
+                zmalloc_typed_arena_stats(j,&aalloc,&aactive,&aresident);
+                snprintf(field,sizeof(field),
+                         "allocator-arena-%s.allocated",arena_names[j]);
+                addReplyBulkCString(c,field);
+                addReplyLongLong(c,aalloc);
+                snprintf(field,sizeof(field),
+                         "allocator-arena-%s.active",arena_names[j]);
+                addReplyBulkCString(c,field);
+                addReplyLongLong(c,aactive);
+                snprintf(field,sizeof(field),
+                         "allocator-arena-%s.resident",arena_names[j]);
+                addReplyBulkCString(c,field);
+                addReplyLongLong(c,aresident);
+            }
+        }
+
         addReplyBulkCString(c,"allocator-fragmentation.ratio");
         addReplyDouble(c,mh->allocator_frag);
 
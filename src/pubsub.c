@@ -116,22 +116,150 @@ void addReplyPubsubPatUnsubscribed(client *c, robj *pattern) {
     addReplyLongLong(c,clientSubscriptionsCount(c));
 }
 
+/*-----------------------------------------------------------------------------
+ * Slow consumers conflation
+ *----------------------------------------------------------------------------*/
+
+/* Number of receivers of the last publish operation that were under output
+ * buffer backpressure (see clientApplyObufBackpressure()): the PUBLISH
+ * command uses it to signal slow consumers back to the publisher. */
+static int pubsub_slow_receivers = 0;
+
+/* Return non-zero if 'channel' is subject to message conflation: for such
+ * channels only the latest message is retained for clients under output
+ * buffer backpressure, since intermediate values are obsolete anyway
+ * (think of a price or metric feed). Controlled by the
+ * pubsub-conflation-channels glob pattern. */
+static int pubsubChannelIsConflated(robj *channel) {
+    int conflated;
+
+    if (server.pubsub_conflation_channels == NULL) return 0;
+    channel = getDecodedObject(channel);
+    conflated = stringmatchlen(server.pubsub_conflation_channels,
+                               strlen(server.pubsub_conflation_channels),
+                               channel->ptr,sdslen(channel->ptr),0);
+    decrRefCount(channel);
+    return conflated;
+}
+
+/* Park 'message' as the latest value of 'channel' for the suspended client
+ * 'c', replacing any value parked before: it is delivered (or dropped, if
+ * the client unsubscribed meanwhile) by pubsubFlushConflatedMessages() when
+ * the client output buffer drains. */
+static void pubsubConflateMessage(client *c, robj *channel, robj *message) {
+    if (c->pubsub_conflated == NULL)
+        c->pubsub_conflated = dictCreate(&objectKeyPointerValueDictType,NULL);
+
+    dictEntry *de = dictFind(c->pubsub_conflated,channel);
+    if (de) {
+        decrRefCount(dictGetVal(de));
+        incrRefCount(message);
+        dictSetVal(c->pubsub_conflated,de,message);
+    } else {
+        incrRefCount(channel);
+        incrRefCount(message);
+        dictAdd(c->pubsub_conflated,channel,message);
+    }
+}
+
+/* Deliver the messages conflated while the client was under backpressure.
+ * Channels the client unsubscribed from in the meantime are dropped. */
+void pubsubFlushConflatedMessages(client *c) {
+    if (c->pubsub_conflated == NULL || dictSize(c->pubsub_conflated) == 0)
+        return;
+
+    dictIterator *di = dictGetIterator(c->pubsub_conflated);
+    dictEntry *de;
+    while((de = dictNext(di)) != NULL) {
+        robj *channel = dictGetKey(de);
+        robj *message = dictGetVal(de);
+
+        if (dictFind(c->pubsub_channels,channel) != NULL)
+            addReplyPubsubMessage(c,channel,message);
+        decrRefCount(channel);
+        decrRefCount(message);
+    }
+    dictReleaseIterator(di);
+    dictEmpty(c->pubsub_conflated,NULL);
+}
+
+/* Discard the conflated messages of the client, if any. Called when the
+ * client is freed (or parked for reuse). */
+void pubsubFreeConflatedMessages(client *c) {
+    if (c->pubsub_conflated == NULL || dictSize(c->pubsub_conflated) == 0)
+        return;
+
+    dictIterator *di = dictGetIterator(c->pubsub_conflated);
+    dictEntry *de;
+    while((de = dictNext(di)) != NULL) {
+        decrRefCount(dictGetKey(de));
+        decrRefCount(dictGetVal(de));
+    }
+    dictReleaseIterator(di);
+    dictEmpty(c->pubsub_conflated,NULL);
+}
+
 /*-----------------------------------------------------------------------------
  * Pubsub low level API
  *----------------------------------------------------------------------------*/
 
-void freePubsubPattern(void *p) {
-    pubsubPattern *pat = p;
+/* Return the length of the literal prefix of a glob pattern, that is the
+ * number of leading bytes before the first special character. The pattern
+ * object must be sds encoded. */
+static size_t pubsubPatternPrefixLen(robj *pattern) {
+    char *p = pattern->ptr;
+    size_t len = sdslen(pattern->ptr), j;
 
-    decrRefCount(pat->pattern);
-    zfree(pat);
+    for (j = 0; j < len; j++) {
+        if (p[j] == '*' || p[j] == '?' || p[j] == '[' || p[j] == '\\')
+            break;
+    }
+    return j;
 }
 
-int listMatchPubsubPattern(void *a, void *b) {
-    pubsubPattern *pa = a, *pb = b;
+/* Add a unique pattern entry to the prefix index: entries without a
+ * literal prefix go to a plain list, the other ones are bucketed by
+ * prefix in a radix tree. */
+static void pubsubPatternIndexAdd(pubsubPattern *pat) {
+    if (pat->prefix_len == 0) {
+        listAddNodeTail(server.pubsub_patterns_nopfx,pat);
+        pat->index_node = listLast(server.pubsub_patterns_nopfx);
+    } else {
+        list *bucket = raxFind(server.pubsub_patterns_index,
+                               (unsigned char*)pat->pattern->ptr,
+                               pat->prefix_len);
+        if (bucket == raxNotFound) {
+            bucket = listCreate();
+            raxInsert(server.pubsub_patterns_index,
+                      (unsigned char*)pat->pattern->ptr,
+                      pat->prefix_len,bucket,NULL);
+        }
+        listAddNodeTail(bucket,pat);
+        pat->index_node = listLast(bucket);
+        if (pat->prefix_len > server.pubsub_patterns_maxprefix)
+            server.pubsub_patterns_maxprefix = pat->prefix_len;
+    }
+}
 
-    return (pa->client == pb->client) &&
-           (equalStringObjects(pa->pattern,pb->pattern));
+/* Remove a unique pattern entry from the prefix index, releasing its
+ * bucket if it was the last entry with that prefix. */
+static void pubsubPatternIndexRemove(pubsubPattern *pat) {
+    if (pat->prefix_len == 0) {
+        listDelNode(server.pubsub_patterns_nopfx,pat->index_node);
+    } else {
+        list *bucket = raxFind(server.pubsub_patterns_index,
+                               (unsigned char*)pat->pattern->ptr,
+                               pat->prefix_len);
+        serverAssert(bucket != raxNotFound);
+        listDelNode(bucket,pat->index_node);
+        if (listLength(bucket) == 0) {
+            raxRemove(server.pubsub_patterns_index,
+                      (unsigned char*)pat->pattern->ptr,
+                      pat->prefix_len,NULL);
+            listRelease(bucket);
+        }
+    }
+    pat->index_node = NULL;
 }
 
 /* Return the number of channels + patterns a client is subscribed to. */
@@ -205,14 +333,27 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
     int retval = 0;
 
     if (listSearchKey(c->pubsub_patterns,pattern) == NULL) {
-        retval = 1;
+        dictEntry *de;
         pubsubPattern *pat;
+
+        retval = 1;
         listAddNodeTail(c->pubsub_patterns,pattern);
         incrRefCount(pattern);
-        pat = zmalloc(sizeof(*pat));
-        pat->pattern = getDecodedObject(pattern);
-        pat->client = c;
-        listAddNodeTail(server.pubsub_patterns,pat);
+        /* Identical patterns subscribed by multiple clients share a single
+         * entry: look it up, creating it at the first subscription. */
+        de = dictFind(server.pubsub_patterns,pattern);
+        if (de == NULL) {
+            pat = zmalloc(sizeof(*pat));
+            pat->pattern = getDecodedObject(pattern);
+            pat->clients = listCreate();
+            pat->prefix_len = pubsubPatternPrefixLen(pat->pattern);
+            pubsubPatternIndexAdd(pat);
+            incrRefCount(pat->pattern); /* Reference held by the dict key. */
+            dictAdd(server.pubsub_patterns,pat->pattern,pat);
+        } else {
+            pat = dictGetVal(de);
+        }
+        listAddNodeTail(pat->clients,c);
     }
     /* Notify the client */
     addReplyPubsubPatSubscribed(c,pattern);
@@ -223,17 +364,29 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
  * 0 if the client was not subscribed to the specified channel. */
 int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
     listNode *ln;
-    pubsubPattern pat;
     int retval = 0;
 
     incrRefCount(pattern); /* Protect the object. May be the same we remove */
     if ((ln = listSearchKey(c->pubsub_patterns,pattern)) != NULL) {
+        dictEntry *de;
+        pubsubPattern *pat;
+
         retval = 1;
         listDelNode(c->pubsub_patterns,ln);
-        pat.client = c;
-        pat.pattern = pattern;
-        ln = listSearchKey(server.pubsub_patterns,&pat);
-        listDelNode(server.pubsub_patterns,ln);
+        de = dictFind(server.pubsub_patterns,pattern);
+        serverAssertWithInfo(c,NULL,de != NULL);
+        pat = dictGetVal(de);
+        ln = listSearchKey(pat->clients,c);
+        serverAssertWithInfo(c,NULL,ln != NULL);
+        listDelNode(pat->clients,ln);
+        if (listLength(pat->clients) == 0) {
+            /* This was the last subscriber: release the shared entry. */
+            pubsubPatternIndexRemove(pat);
+            listRelease(pat->clients);
+            dictDelete(server.pubsub_patterns,pattern);
+            decrRefCount(pat->pattern);
+            zfree(pat);
+        }
     }
     /* Notify the client */
     if (notify) addReplyPubsubPatUnsubscribed(c,pattern);
@@ -276,49 +429,147 @@ int pubsubUnsubscribeAllPatterns(client *c, int notify) {
     return count;
 }
 
-/* Publish a message */
-int pubsubPublishMessage(robj *channel, robj *message) {
+/* Send a message to the clients subscribed exactly to 'channel' (no pattern
+ * matching fan-out). Returns the number of receivers. */
+static int pubsubPublishChannel(robj *channel, robj *message) {
     int receivers = 0;
     dictEntry *de;
-    listNode *ln;
-    listIter li;
 
-    /* Send to clients listening for that channel */
     de = dictFind(server.pubsub_channels,channel);
     if (de) {
         list *list = dictGetVal(de);
         listNode *ln;
         listIter li;
+        int conflated = pubsubChannelIsConflated(channel);
 
         listRewind(list,&li);
         while ((ln = listNext(&li)) != NULL) {
             client *c = ln->value;
+            if (c->flags & CLIENT_OBUF_BACKPRESSURE) {
+                pubsub_slow_receivers++;
+                /* Slow consumers of a conflated channel only get the
+                 * latest message once they drain: don't make the buffer
+                 * problem worse with values that will be obsolete. */
+                if (conflated) {
+                    pubsubConflateMessage(c,channel,message);
+                    receivers++;
+                    continue;
+                }
+            }
             addReplyPubsubMessage(c,channel,message);
             receivers++;
         }
     }
-    /* Send to clients listening to matching channels */
-    if (listLength(server.pubsub_patterns)) {
-        listRewind(server.pubsub_patterns,&li);
-        channel = getDecodedObject(channel);
-        while ((ln = listNext(&li)) != NULL) {
-            pubsubPattern *pat = ln->value;
+    return receivers;
+}
 
-            if (stringmatchlen((char*)pat->pattern->ptr,
-                                sdslen(pat->pattern->ptr),
-                                (char*)channel->ptr,
-                                sdslen(channel->ptr),0))
-            {
-                addReplyPubsubPatMessage(pat->client,
-                    pat->pattern,channel,message);
-                receivers++;
-            }
+/* Deliver a message to the clients of a unique pattern entry if the
+ * pattern matches the channel. Returns the number of receivers. */
+static int pubsubPublishPatternEntry(pubsubPattern *pat, robj *channel, robj *message) {
+    int receivers = 0;
+    listNode *ln;
+    listIter li;
+
+    if (stringmatchlen((char*)pat->pattern->ptr,
+                        sdslen(pat->pattern->ptr),
+                        (char*)channel->ptr,
+                        sdslen(channel->ptr),0))
+    {
+        listRewind(pat->clients,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            client *c = ln->value;
+            if (c->flags & CLIENT_OBUF_BACKPRESSURE)
+                pubsub_slow_receivers++;
+            addReplyPubsubPatMessage(c,pat->pattern,channel,message);
+            receivers++;
         }
-        decrRefCount(channel);
     }
     return receivers;
 }
 
+/* Send a message to the clients subscribed to patterns matching the
+ * channel. Instead of matching the channel against every known pattern,
+ * only the index buckets whose literal prefix is a prefix of the channel
+ * are considered (plus the patterns with a leading special character,
+ * that can match anything and are kept in a separate list). The channel
+ * must be an sds encoded string object. Returns the number of
+ * receivers. */
+static int pubsubPublishPatterns(robj *channel, robj *message) {
+    int receivers = 0;
+    listNode *ln;
+    listIter li;
+
+    if (dictSize(server.pubsub_patterns) == 0) return 0;
+
+    /* Patterns without a literal prefix may match any channel. */
+    listRewind(server.pubsub_patterns_nopfx,&li);
+    while ((ln = listNext(&li)) != NULL)
+        receivers += pubsubPublishPatternEntry(ln->value,channel,message);
+
+    /* Look up the bucket of every literal prefix of the channel. */
+    size_t chanlen = sdslen(channel->ptr);
+    size_t maxprefix = server.pubsub_patterns_maxprefix;
+    if (maxprefix > chanlen) maxprefix = chanlen;
+    for (size_t j = 1; j <= maxprefix; j++) {
+        list *bucket = raxFind(server.pubsub_patterns_index,
+                               (unsigned char*)channel->ptr,j);
+        if (bucket == raxNotFound) continue;
+        listRewind(bucket,&li);
+        while ((ln = listNext(&li)) != NULL)
+            receivers += pubsubPublishPatternEntry(ln->value,channel,message);
+    }
+    return receivers;
+}
+
+/* Publish a message */
+int pubsubPublishMessage(robj *channel, robj *message) {
+    int receivers = 0;
+
+    /* Send to clients listening for that channel */
+    receivers += pubsubPublishChannel(channel,message);
+
+    /* Send to clients listening to matching channels */
+    channel = getDecodedObject(channel);
+    receivers += pubsubPublishPatterns(channel,message);
+    decrRefCount(channel);
+    return receivers;
+}
+
+/* Publish two channel/message pairs at once. This is used by keyspace
+ * notifications, where every event is published both to the
+ * __keyspace@<db>__ and __keyevent@<db>__ channels.
+ *
+ * Either pair may be NULL (the corresponding notification class may be
+ * disabled). If 'skip_patterns' is non-zero the pattern fan-out is not
+ * performed at all: the caller batches the pattern deliveries and flushes
+ * them at the end of the event loop iteration. Both channels must be sds
+ * encoded string objects. Returns the number of receivers. */
+int pubsubPublishMessagePair(robj *chan1, robj *msg1, robj *chan2, robj *msg2, int skip_patterns) {
+    int receivers = 0;
+
+    if (chan1) receivers += pubsubPublishChannel(chan1,msg1);
+    if (chan2) receivers += pubsubPublishChannel(chan2,msg2);
+
+    if (!skip_patterns) {
+        if (chan1) receivers += pubsubPublishPatterns(chan1,msg1);
+        if (chan2) receivers += pubsubPublishPatterns(chan2,msg2);
+    }
+    return receivers;
+}
+
+/* Deliver a batch of messages to the pattern subscribers only. 'pairs'
+ * contains 2*count objects, alternating channel and message: this is the
+ * layout used by the keyspace notifications queue (see
+ * notifyKeyspaceEventFlushBatch()). The channels must be sds encoded
+ * string objects. Returns the number of receivers. */
+int pubsubPublishPatternsBatch(robj **pairs, size_t count) {
+    int receivers = 0;
+
+    for (size_t j = 0; j < count; j++)
+        receivers += pubsubPublishPatterns(pairs[j*2],pairs[j*2+1]);
+    return receivers;
+}
+
 /*-----------------------------------------------------------------------------
  * Pubsub commands implementation
  *----------------------------------------------------------------------------*/
@@ -364,12 +615,22 @@ void punsubscribeCommand(client *c) {
 }
 
 void publishCommand(client *c) {
+    pubsub_slow_receivers = 0;
     int receivers = pubsubPublishMessage(c->argv[1],c->argv[2]);
     if (server.cluster_enabled)
         clusterPropagatePublish(c->argv[1],c->argv[2]);
     else
         forceCommandPropagation(c,PROPAGATE_REPL);
     addReplyLongLong(c,receivers);
+
+    /* Tell RESP3 publishers how many of the receivers are currently under
+     * output buffer backpressure, so that they can throttle. */
+    if (pubsub_slow_receivers && c->resp > 2) {
+        addReplyPushLen(c,3);
+        addReplyBulkCBuffer(c,"slowconsumer",12);
+        addReplyBulk(c,c->argv[1]);
+        addReplyLongLong(c,pubsub_slow_receivers);
+    }
 }
 
 /* PUBSUB command for Pub/Sub introspection. */
@@ -419,7 +680,7 @@ NULL
         }
     } else if (!strcasecmp(c->argv[1]->ptr,"numpat") && c->argc == 2) {
         /* PUBSUB NUMPAT */
-        addReplyLongLong(c,listLength(server.pubsub_patterns));
+        addReplyLongLong(c,dictSize(server.pubsub_patterns));
     } else {
         addReplySubcommandSyntaxError(c);
     }
@@ -29,11 +29,15 @@
  */
 
 #include <string.h> /* for memcpy */
+#include <pthread.h>
+#include <unistd.h> /* for getpid */
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "compress.h"
+#include "bio.h"
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -58,6 +62,26 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
  * resulted in a larger size than the original data. */
 #define MIN_COMPRESS_IMPROVE 8
 
+/* Codec used to compress quicklist nodes. This is process wide: the codec
+ * is selected once at startup via quicklistSetCompressionCodec(), so every
+ * compressed node in every quicklist uses the same codec and no per node
+ * codec identifier is needed. Defaults to LZF. */
+static compressCodec *ql_codec = NULL;
+
+static inline compressCodec *quicklistCodec(void) {
+    if (ql_codec == NULL) ql_codec = compressCodecById(COMPRESS_CODEC_LZF);
+    return ql_codec;
+}
+
+/* Select the codec used to compress quicklist nodes. Must be called before
+ * any node is compressed: changing codec with live compressed nodes would
+ * make them undecodable. The caller is expected to pass the identifier of
+ * a compiled in codec. */
+void quicklistSetCompressionCodec(int id) {
+    compressCodec *codec = compressCodecById(id);
+    if (codec) ql_codec = codec;
+}
+
 /* If not verbose testing, remove all debug printing. */
 #ifndef REDIS_TEST_VERBOSE
 #define D(...)
@@ -100,6 +124,7 @@ quicklist *quicklistCreate(void) {
     quicklist->count = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    quicklist->skipidx = NULL;
     return quicklist;
 }
 
@@ -145,9 +170,94 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
     node->recompress = 0;
+    node->compress_pending = 0;
     return node;
 }
 
+/* Sparse seek index ("skip index").
+ *
+ * quicklistIndex() walks node headers linearly from the closer end, which
+ * on multi million entry lists makes LINSERT, LPOS and mid-list LRANGE
+ * O(number of nodes) before a single entry is even looked at. The skip
+ * index is an array of checkpoints, one every QUICKLIST_SKIPIDX_STRIDE
+ * nodes, each storing a node pointer and the number of entries preceding
+ * that node, so a seek can binary search the checkpoints and walk at most
+ * a stride worth of nodes.
+ *
+ * The index is built lazily by the first long seek on a list with enough
+ * nodes, since push/pop-at-the-ends workloads should not pay for it.
+ * Pushes and pops at the head shift every "entries before" count by the
+ * same amount, and are tracked with the single 'adjust' counter; tail
+ * operations only touch entries past the last checkpoint and need no
+ * bookkeeping at all. Any mutation in the middle of the list just drops
+ * the index, to be rebuilt by the next long seek. */
+
+#define QUICKLIST_SKIPIDX_STRIDE 16    /* One checkpoint every this many nodes. */
+#define QUICKLIST_SKIPIDX_MIN_NODES 64 /* Don't index shorter lists. */
+
+struct quicklistSkipIndex {
+    unsigned long len; /* Number of checkpoints. */
+    long long adjust;  /* Correction applied to every 'cum' value, tracking
+                          entries pushed/popped at the head since build. */
+    struct {
+        quicklistNode *node;    /* Node the checkpoint is anchored to. */
+        unsigned long long cum; /* Entries before 'node' at build time. */
+    } cp[];
+};
+
+/* Drop the skip index of the quicklist, if any. Called whenever a mutation
+ * would leave the cumulative counts (or an anchor node pointer) stale.
+ * Exported since the active defrag relocates node structs too. */
+void quicklistSkipIndexInvalidate(quicklist *quicklist) {
+    if (quicklist->skipidx) {
+        zfree(quicklist->skipidx);
+        quicklist->skipidx = NULL;
+    }
+}
+
+/* Account for 'delta' entries (+1 push, -1 pop) added to or removed from
+ * the head node 'node' of the quicklist. The counts of all checkpoints
+ * move uniformly, except when the head itself reached the first
+ * checkpoint: entries inside a checkpointed node are not "before" it, so
+ * the correction would no longer be uniform and the index is dropped. */
+REDIS_STATIC void quicklistSkipIndexHeadChange(quicklist *quicklist,
+                                               quicklistNode *node,
+                                               int delta) {
+    struct quicklistSkipIndex *si = quicklist->skipidx;
+
+    if (!si) return;
+    if (node == si->cp[0].node)
+        quicklistSkipIndexInvalidate(quicklist);
+    else
+        si->adjust += delta;
+}
+
+/* Build the skip index with a full walk of the node headers: O(number of
+ * nodes), the same cost as the long seek that triggers the build. */
+REDIS_STATIC void quicklistSkipIndexBuild(quicklist *quicklist) {
+    unsigned long ncp = (quicklist->len - 1) / QUICKLIST_SKIPIDX_STRIDE;
+    struct quicklistSkipIndex *si;
+    quicklistNode *n = quicklist->head;
+    unsigned long long cum = 0;
+    unsigned long i = 0, nodeidx = 0;
+
+    if (ncp == 0) return;
+    si = zmalloc(sizeof(*si) + ncp * sizeof(si->cp[0]));
+    si->adjust = 0;
+    while (n && i < ncp) {
+        if (nodeidx && nodeidx % QUICKLIST_SKIPIDX_STRIDE == 0) {
+            si->cp[i].node = n;
+            si->cp[i].cum = cum;
+            i++;
+        }
+        cum += n->count;
+        n = n->next;
+        nodeidx++;
+    }
+    si->len = i;
+    quicklist->skipidx = si;
+}
+
 /* Return cached quicklist count */
 unsigned long quicklistCount(const quicklist *ql) { return ql->count; }
 
@@ -161,6 +271,8 @@ void quicklistRelease(quicklist *quicklist) {
     while (len--) {
         next = current->next;
 
+        if (current->compress_pending)
+            quicklistNodeAsyncCompressCancel(current);
         zfree(current->zl);
         quicklist->count -= current->count;
 
@@ -169,9 +281,163 @@ void quicklistRelease(quicklist *quicklist) {
         quicklist->len--;
         current = next;
     }
+    quicklistSkipIndexInvalidate(quicklist);
     zfree(quicklist);
 }
 
+/* Asynchronous node compression.
+ *
+ * Compressing a node that just left the compress depth window runs the
+ * codec over up to 8k of ziplist data in the middle of a list write. When
+ * enabled (see quicklistSetAsyncCompression()) we instead snapshot the
+ * ziplist, hand the snapshot to the BIO_LIST_COMPRESS background thread,
+ * and keep serving the raw node in the meantime. The main thread installs
+ * the compressed blob later, from quicklistAsyncCompressHandleCompleted(),
+ * and only if the node was not modified, deleted or moved since the job
+ * was queued: every such event cancels the job by NULLing its node
+ * reference, so a completed job for a stale node is simply discarded.
+ *
+ * The job list is shared with the bio thread and with the lazy free
+ * thread (quicklistRelease() may run there), so every access goes through
+ * ql_async_mutex. Forked children inherit pending bits but never touch
+ * the job list: the pid check makes them fall back to the synchronous
+ * code paths, which also sidesteps a mutex possibly held at fork time. */
+typedef struct quicklistAsyncCompress {
+    quicklistNode *node;  /* Target node, NULL once the job is canceled. */
+    unsigned char *zl;    /* Private snapshot of the node ziplist. */
+    unsigned int sz;      /* Length of 'zl' in bytes. */
+    quicklistLZF *lzf;    /* Result, NULL if compression did not pay off. */
+    int done;             /* Non zero once the bio thread is finished. */
+    struct quicklistAsyncCompress *next;
+} quicklistAsyncCompress;
+
+static pthread_mutex_t ql_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static quicklistAsyncCompress *ql_async_jobs = NULL;
+static int ql_async_enabled = 0;
+static pid_t ql_async_pid = 0;
+
+/* Enable or disable background compression of quicklist nodes. Must be
+ * called after bioInit(): once enabled, nodes leaving the compress depth
+ * window are queued to the BIO_LIST_COMPRESS thread instead of being
+ * compressed in place. Disabling only affects new jobs, already queued
+ * ones are still applied (or discarded) by the completion handler. */
+void quicklistSetAsyncCompression(int enable) {
+    if (enable) quicklistCodec(); /* Settle the codec before threads race. */
+    ql_async_enabled = enable;
+    ql_async_pid = getpid();
+}
+
+/* Return true if this process may queue or cancel background compression
+ * jobs: forked children see the parent's pending bits but own none of the
+ * jobs, so they must stick to the synchronous paths. */
+#define quicklistAsyncCompressActive()                                         \
+    (ql_async_enabled && ql_async_pid == getpid())
+
+/* Drop the queued compression job of 'node', if any. Must be called
+ * before the ziplist of a RAW node with the compress_pending bit set is
+ * modified, freed, or before the node itself is freed or moved: otherwise
+ * the completion handler would install a stale blob (or follow a dangling
+ * node pointer). Safe to call from the lazy free thread. */
+void quicklistNodeAsyncCompressCancel(quicklistNode *node) {
+    if (!node->compress_pending) return;
+    node->compress_pending = 0;
+    if (ql_async_pid != getpid()) return; /* Forked child: no jobs owned. */
+    pthread_mutex_lock(&ql_async_mutex);
+    for (quicklistAsyncCompress *job = ql_async_jobs; job; job = job->next) {
+        if (job->node == node) {
+            job->node = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ql_async_mutex);
+}
+
+/* Cancel helper for the hot paths: pay only a bit test when no job is
+ * queued for the node. */
+#define quicklistNodeCancelAsyncCompress(_node)                                \
+    do {                                                                       \
+        if (unlikely((_node)->compress_pending))                               \
+            quicklistNodeAsyncCompressCancel((_node));                         \
+    } while (0)
+
+/* Snapshot the ziplist of 'node' and queue it for background
+ * compression. The node stays RAW (and fully readable) until the
+ * completion handler installs the result. Always returns 0 since the
+ * node is not compressed yet. */
+REDIS_STATIC int quicklistAsyncCompressEnqueue(quicklistNode *node) {
+    quicklistAsyncCompress *job = zmalloc(sizeof(*job));
+
+    job->node = node;
+    job->sz = node->sz;
+    job->zl = zmalloc(node->sz);
+    memcpy(job->zl, node->zl, node->sz);
+    job->lzf = NULL;
+    job->done = 0;
+    node->compress_pending = 1;
+    pthread_mutex_lock(&ql_async_mutex);
+    job->next = ql_async_jobs;
+    ql_async_jobs = job;
+    pthread_mutex_unlock(&ql_async_mutex);
+    bioCreateBackgroundJob(BIO_LIST_COMPRESS,job,NULL,NULL);
+    return 0;
+}
+
+/* Called by the bio thread to run the codec over the snapshot of a queued
+ * job. Only job->zl is touched outside the lock: it is owned by the job
+ * and never freed before 'done' is set. */
+void quicklistCompressFromBioThread(void *jobref) {
+    quicklistAsyncCompress *job = jobref;
+    quicklistLZF *lzf = zmalloc(sizeof(*lzf) + job->sz);
+
+    if (((lzf->sz = quicklistCodec()->compress(job->zl, job->sz,
+                                               lzf->compressed,
+                                               job->sz)) == 0) ||
+        lzf->sz + MIN_COMPRESS_IMPROVE >= job->sz) {
+        /* The codec aborts/rejects compression if value not compressable. */
+        zfree(lzf);
+        lzf = NULL;
+    } else {
+        lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
+    }
+    pthread_mutex_lock(&ql_async_mutex);
+    job->lzf = lzf;
+    job->done = 1;
+    pthread_mutex_unlock(&ql_async_mutex);
+}
+
+/* Install the results of finished background compression jobs. Called
+ * from the main thread (beforeSleep()) while no other thread may touch
+ * the dataset, so swapping the node ziplist with the compressed blob is
+ * safe. Canceled jobs are discarded together with their result. */
+void quicklistAsyncCompressHandleCompleted(void) {
+    if (ql_async_jobs == NULL) return; /* Unlocked peek: stale reads only
+                                        * delay the cleanup by one cycle. */
+    pthread_mutex_lock(&ql_async_mutex);
+    quicklistAsyncCompress **ref = &ql_async_jobs, *job;
+    while ((job = *ref) != NULL) {
+        if (!job->done) {
+            ref = &job->next;
+            continue;
+        }
+        quicklistNode *node = job->node;
+        if (node) {
+            node->compress_pending = 0;
+            if (job->lzf) {
+                zfree(node->zl);
+                node->zl = (unsigned char *)job->lzf;
+                node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+                node->recompress = 0;
+                job->lzf = NULL;
+            }
+        }
+        *ref = job->next;
+        zfree(job->zl);
+        zfree(job->lzf); /* Result of a job canceled after compression. */
+        zfree(job);
+    }
+    pthread_mutex_unlock(&ql_async_mutex);
+}
+
 /* Compress the ziplist in 'node' and update encoding details.
  * Returns 1 if ziplist compressed successfully.
  * Returns 0 if compression failed or if ziplist too small to compress. */
@@ -184,13 +450,21 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
 
+    /* Offload to the background thread when enabled: the node stays RAW
+     * for now, a job already being queued means we have nothing to do. */
+    if (quicklistAsyncCompressActive()) {
+        if (node->compress_pending) return 0;
+        return quicklistAsyncCompressEnqueue(node);
+    }
+
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = quicklistCodec()->compress(node->zl, node->sz,
+                                               lzf->compressed,
+                                               node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+        /* The codec aborts/rejects compression if value not compressable. */
         zfree(lzf);
         return 0;
     }
@@ -219,7 +493,8 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 
     void *decompressed = zmalloc(node->sz);
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (quicklistCodec()->decompress(lzf->compressed, lzf->sz, decompressed,
+                                     node->sz) == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
@@ -230,11 +505,15 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
     return 1;
 }
 
-/* Decompress only compressed nodes. */
+/* Decompress only compressed nodes. A RAW node with a queued background
+ * compression job is about to be read or modified, so the job must be
+ * dropped before its stale result can be installed. */
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
         if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
             __quicklistDecompressNode((_node));                                \
+        } else if ((_node)) {                                                  \
+            quicklistNodeCancelAsyncCompress((_node));                         \
         }                                                                      \
     } while (0)
 
@@ -244,6 +523,9 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
         if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
             __quicklistDecompressNode((_node));                                \
             (_node)->recompress = 1;                                           \
+        } else if ((_node) && (_node)->compress_pending) {                     \
+            quicklistNodeAsyncCompressCancel((_node));                         \
+            (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
@@ -352,6 +634,15 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
                                         quicklistNode *old_node,
                                         quicklistNode *new_node, int after) {
+    /* A node inserted in the middle shifts the entry counts of every
+     * checkpoint after it: drop the skip index. End insertions are fine:
+     * the head adjustment tracks entries, not nodes, and nodes appended
+     * at the tail are simply past the last checkpoint. */
+    if (quicklist->skipidx &&
+        !(after && old_node == quicklist->tail) &&
+        !(!after && old_node == quicklist->head))
+        quicklistSkipIndexInvalidate(quicklist);
+
     if (after) {
         new_node->prev = old_node;
         if (old_node) {
@@ -481,6 +772,7 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_head = quicklist->head;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
+        quicklistNodeCancelAsyncCompress(quicklist->head);
         quicklist->head->zl =
             ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
         quicklistNodeUpdateSz(quicklist->head);
@@ -493,6 +785,7 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     }
     quicklist->count++;
     quicklist->head->count++;
+    quicklistSkipIndexHeadChange(quicklist, quicklist->head, 1);
     return (orig_head != quicklist->head);
 }
 
@@ -504,6 +797,7 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_tail = quicklist->tail;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
+        quicklistNodeCancelAsyncCompress(quicklist->tail);
         quicklist->tail->zl =
             ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
         quicklistNodeUpdateSz(quicklist->tail);
@@ -578,6 +872,22 @@ quicklist *quicklistCreateFromZiplist(int fill, int compress,
 
 REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
                                      quicklistNode *node) {
+    /* Keep the skip index coherent. Since checkpoints are ordered by
+     * position, the head can only collide with the first one and the tail
+     * with the last one: in both cases the anchor would dangle, so drop
+     * the index. Deleting a non-checkpointed head just folds its entries
+     * into the adjustment, deleting the tail is transparent, and any
+     * middle deletion shifts the downstream counts, dropping the index. */
+    if (quicklist->skipidx) {
+        struct quicklistSkipIndex *si = quicklist->skipidx;
+        if (si->cp[0].node == node || si->cp[si->len-1].node == node)
+            quicklistSkipIndexInvalidate(quicklist);
+        else if (node == quicklist->head)
+            si->adjust -= node->count;
+        else if (node != quicklist->tail)
+            quicklistSkipIndexInvalidate(quicklist);
+    }
+
     if (node->next)
         node->next->prev = node->prev;
     if (node->prev)
@@ -597,6 +907,7 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
 
     quicklist->count -= node->count;
 
+    quicklistNodeCancelAsyncCompress(node);
     zfree(node->zl);
     zfree(node);
     quicklist->len--;
@@ -614,8 +925,19 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
                                    unsigned char **p) {
     int gone = 0;
 
+    quicklistNodeCancelAsyncCompress(node);
     node->zl = ziplistDelete(node->zl, p);
     node->count--;
+    /* Entry deletions at the head are folded into the skip index
+     * adjustment, at the tail they are past the last checkpoint, anywhere
+     * else they shift the downstream counts and drop the index. If the
+     * node gets emptied, __quicklistDelNode() accounts for the rest. */
+    if (quicklist->skipidx) {
+        if (node == quicklist->head)
+            quicklistSkipIndexHeadChange(quicklist, node, -1);
+        else if (node != quicklist->tail)
+            quicklistSkipIndexInvalidate(quicklist);
+    }
     if (node->count == 0) {
         gone = 1;
         __quicklistDelNode(quicklist, node);
@@ -836,6 +1158,11 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     quicklistNode *node = entry->node;
     quicklistNode *new_node = NULL;
 
+    /* Mid-list inserts (and their possible node splits and merges) shift
+     * the checkpoint counts in ways not worth tracking: drop the skip
+     * index, the next long seek rebuilds it. */
+    quicklistSkipIndexInvalidate(quicklist);
+
     if (!node) {
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
@@ -978,6 +1305,11 @@ int quicklistDelRange(quicklist *quicklist, const long start,
       count, extent);
     quicklistNode *node = entry.node;
 
+    /* The range may hit arbitrary middle nodes without going through
+     * quicklistDelIndex(): drop the skip index (the seek above already
+     * profited from it). */
+    quicklistSkipIndexInvalidate(quicklist);
+
     /* iterate over next nodes until everything is deleted. */
     while (extent) {
         quicklistNode *next = node->next;
@@ -1243,6 +1575,43 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     if (index >= quicklist->count)
         return 0;
 
+    /* Long seeks on node-rich lists build and then use the skip index:
+     * binary search the closest checkpoint at or before the target and
+     * walk from there, instead of walking node by node from the closer
+     * end. The checkpoint is only adopted when it actually skips more
+     * entries than the plain walk would. */
+    if (quicklist->skipidx == NULL &&
+        quicklist->len >= QUICKLIST_SKIPIDX_MIN_NODES)
+        quicklistSkipIndexBuild((struct quicklist *)quicklist);
+    if (quicklist->skipidx) {
+        struct quicklistSkipIndex *si = quicklist->skipidx;
+        unsigned long long fwd = forward ? index : quicklist->count - 1 - index;
+        long lo = 0, hi = si->len - 1, best = -1;
+
+        while (lo <= hi) {
+            long mid = (lo + hi) / 2;
+            if ((long long)si->cp[mid].cum + si->adjust <= (long long)fwd) {
+                best = mid;
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        if (best != -1) {
+            unsigned long long cum =
+                (long long)si->cp[best].cum + si->adjust;
+            if (fwd - cum < index) {
+                /* Continue as a forward seek from the checkpoint. */
+                D("Skip index: fwd %llu from checkpoint %ld at cum %llu",
+                  fwd, best, cum);
+                forward = 1;
+                index = fwd;
+                n = si->cp[best].node;
+                accum = cum;
+            }
+        }
+    }
+
     while (likely(n)) {
         if ((accum + n->count) > index) {
             break;
@@ -2276,6 +2645,58 @@ int quicklistTest(int argc, char *argv[]) {
             OK;
         }
 
+        TEST("skip index seeks stay exact across mutations") {
+            quicklist *ql = quicklistNew(-2, options[_i]);
+            quicklistSetFill(ql, 4);
+            char num[32];
+            unsigned char *data;
+            unsigned int dsz;
+            long long lv;
+            quicklistEntry entry;
+            for (int i = 0; i < 2000; i++) {
+                int sz = ll2string(num, sizeof(num), i);
+                quicklistPushTail(ql, num, sz);
+            }
+            /* A long seek on a node-rich list must build the index. */
+            quicklistIndex(ql, 1500, &entry);
+            if (entry.longval != 1500)
+                ERR("Expected 1500, got %lld", entry.longval);
+            if (!ql->skipidx)
+                ERR("No skip index after a long seek on %lu nodes", ql->len);
+            /* Head pushes and pops shift every index by the same amount
+             * and must be absorbed by the adjustment, not break seeks. */
+            for (int i = 1; i <= 100; i++) {
+                int sz = ll2string(num, sizeof(num), -i);
+                quicklistPushHead(ql, num, sz);
+            }
+            for (int i = 0; i < 50; i++) {
+                quicklistPop(ql, QUICKLIST_HEAD, &data, &dsz, &lv);
+                zfree(data);
+            }
+            quicklistIndex(ql, 1550, &entry);
+            if (entry.longval != 1500)
+                ERR("After head churn expected 1500, got %lld", entry.longval);
+            quicklistIndex(ql, -300, &entry);
+            if (entry.longval != 1700)
+                ERR("Reverse seek expected 1700, got %lld", entry.longval);
+            /* A middle insert drops the index; the next long seek
+             * rebuilds it and must still be exact. */
+            quicklistIndex(ql, 1000, &entry);
+            quicklistInsertAfter(ql, &entry, "mid", 3);
+            if (ql->skipidx)
+                ERR("Skip index survived a middle insert (%lu nodes)",
+                    ql->len);
+            quicklistIndex(ql, 1001, &entry);
+            if (strncmp((char *)entry.value, "mid", 3))
+                ERR("Expected mid, got %.*s", entry.sz, entry.value);
+            quicklistIndex(ql, 1551, &entry);
+            if (entry.longval != 1500)
+                ERR("After middle insert expected 1500, got %lld",
+                    entry.longval);
+            quicklistRelease(ql);
+            OK;
+        }
+
         for (int f = optimize_start; f < 16; f++) {
             TEST_DESC("lrem test at fill %d at compress %d", f, options[_i]) {
                 quicklist *ql = quicklistNew(f, options[_i]);
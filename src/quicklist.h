@@ -40,7 +40,9 @@
  * container: 2 bits, NONE=1, ZIPLIST=2.
  * recompress: 1 bit, bool, true if node is temporarry decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
- * extra: 10 bits, free for future use; pads out the remainder of 32 bits */
+ * compress_pending: 1 bit, bool, true if a background compression job for
+ *                   this node is queued but not yet applied.
+ * extra: 9 bits, free for future use; pads out the remainder of 32 bits */
 typedef struct quicklistNode {
     struct quicklistNode *prev;
     struct quicklistNode *next;
@@ -51,7 +53,8 @@ typedef struct quicklistNode {
     unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
     unsigned int recompress : 1; /* was this node previous compressed? */
     unsigned int attempted_compress : 1; /* node can't compress; too small */
-    unsigned int extra : 10; /* more bits to steal for future usage */
+    unsigned int compress_pending : 1; /* async compression job queued */
+    unsigned int extra : 9; /* more bits to steal for future usage */
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
@@ -77,6 +80,8 @@ typedef struct quicklist {
     unsigned long len;          /* number of quicklistNodes */
     int fill : 16;              /* fill factor for individual nodes */
     unsigned int compress : 16; /* depth of end nodes not to compress;0=off */
+    struct quicklistSkipIndex *skipidx; /* Sparse seek index, NULL until a
+                                           long seek builds it lazily. */
 } quicklist;
 
 typedef struct quicklistIter {
@@ -118,6 +123,7 @@ typedef struct quicklistEntry {
 quicklist *quicklistCreate(void);
 quicklist *quicklistNew(int fill, int compress);
 void quicklistSetCompressDepth(quicklist *quicklist, int depth);
+void quicklistSetCompressionCodec(int id);
 void quicklistSetFill(quicklist *quicklist, int fill);
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth);
 void quicklistRelease(quicklist *quicklist);
@@ -155,8 +161,13 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
 int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
                  unsigned int *sz, long long *slong);
 unsigned long quicklistCount(const quicklist *ql);
+void quicklistSkipIndexInvalidate(quicklist *quicklist);
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
 size_t quicklistGetLzf(const quicklistNode *node, void **data);
+void quicklistSetAsyncCompression(int enable);
+void quicklistNodeAsyncCompressCancel(quicklistNode *node);
+void quicklistCompressFromBioThread(void *jobref);
+void quicklistAsyncCompressHandleCompleted(void);
 
 #ifdef REDIS_TEST
 int quicklistTest(int argc, char *argv[]);
@@ -203,6 +203,7 @@ rax *raxNew(void) {
     if (rax == NULL) return NULL;
     rax->numele = 0;
     rax->numnodes = 1;
+    rax->version = 0;
     rax->head = raxNewNode(0,0);
     if (rax->head == NULL) {
         rax_free(rax);
@@ -513,6 +514,7 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
     raxNode *h, **parentlink;
 
     debugf("### Insert %.*s with value %p\n", (int)len, s, data);
+    rax->version++; /* Invalidate iterator checkpoints. */
     i = raxLowWalk(rax,s,len,&h,&parentlink,&j,NULL);
 
     /* If i == len we walked following the whole string. If we are not
@@ -910,6 +912,304 @@ int raxTryInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old)
     return raxGenericInsert(rax,s,len,data,old,0);
 }
 
+/* ------------------------------ Bulk loading -----------------------------
+ *
+ * When a large tree is populated from keys already in sorted order (as it
+ * happens when a rax serialized by iteration order is loaded back), going
+ * through raxInsert() is wasteful: every insert descends from the root and
+ * almost every insert reallocates the parent node to link one more child.
+ *
+ * The bulk builder below constructs the tree bottom-up instead. It keeps a
+ * "spine" of open frames describing the path of the last appended key;
+ * appending the next key closes (finalizes into immutable rax nodes) every
+ * frame below the point where the two keys diverge, since sorted input
+ * guarantees nothing will be added under them anymore, and opens a single
+ * new frame for the new key's unique suffix. Every node is thus allocated
+ * exactly once, already with its final size and compressed runs.
+ *
+ * A frame describes a future node chain: a compressed run of bytes leading
+ * to a core node at depth 'depth' holding the children finalized so far
+ * (in ascending edge byte order, again guaranteed by sorted input) and,
+ * possibly, a key. */
+struct raxBulkFrame {
+    unsigned char edgebyte; /* Byte linking this frame from the parent core
+                               (unused for the root frame). */
+    unsigned char *run;     /* Compressed run bytes, owned. */
+    size_t runlen;
+    size_t depth;           /* Depth of the core node: a key ending in this
+                               frame has exactly this length. */
+    unsigned char *edges;   /* Edge bytes of the finalized children. */
+    raxNode **children;     /* The finalized children themselves. */
+    size_t numchildren, maxchildren;
+    int iskey;              /* True if a key ends at the core node. */
+    void *data;
+};
+
+/* Turn the frame into the actual rax nodes: the core node with its
+ * children and key data, wrapped by the compressed run (split into chains
+ * if it exceeds the maximum node size). The frame owned buffers are
+ * released. Returns the topmost node, or NULL on out of memory. */
+static raxNode *raxBulkFinalizeFrame(raxBulk *b, struct raxBulkFrame *f) {
+    raxNode *core = raxNewNode(f->numchildren, f->iskey && f->data != NULL);
+    if (core == NULL) return NULL;
+    if (f->numchildren) {
+        memcpy(core->data,f->edges,f->numchildren);
+        raxNode **cp = raxNodeFirstChildPtr(core);
+        for (size_t i = 0; i < f->numchildren; i++)
+            memcpy(cp+i,&f->children[i],sizeof(raxNode*));
+    }
+    if (f->iskey) raxSetData(core,f->data);
+    b->numnodes++;
+
+    raxNode *n = core;
+    size_t left = f->runlen;
+    while (left) {
+        size_t chunk = left > RAX_NODE_MAX_SIZE ? RAX_NODE_MAX_SIZE : left;
+        size_t nodesize = sizeof(raxNode)+chunk+raxPadding(chunk)+
+                          sizeof(raxNode*);
+        raxNode *wrap = rax_malloc(nodesize);
+        if (wrap == NULL) {
+            while (n != core) {
+                raxNode *child;
+                memcpy(&child,raxNodeLastChildPtr(n),sizeof(child));
+                rax_free(n);
+                n = child;
+            }
+            rax_free(core);
+            return NULL;
+        }
+        wrap->iskey = 0;
+        wrap->isnull = 0;
+        wrap->iscompr = 1;
+        wrap->size = chunk;
+        memcpy(wrap->data,f->run+left-chunk,chunk);
+        memcpy(raxNodeLastChildPtr(wrap),&n,sizeof(n));
+        n = wrap;
+        b->numnodes++;
+        left -= chunk;
+    }
+    rax_free(f->run);
+    rax_free(f->edges);
+    rax_free(f->children);
+    f->run = NULL;
+    f->edges = NULL;
+    f->children = NULL;
+    return n;
+}
+
+/* Link the finalized node 'child' to frame 'f' with edge byte 'c'.
+ * Returns 0 on out of memory. */
+static int raxBulkFrameAddChild(struct raxBulkFrame *f, unsigned char c,
+                                raxNode *child)
+{
+    if (f->numchildren == f->maxchildren) {
+        size_t newmax = f->maxchildren ? f->maxchildren*2 : 4;
+        unsigned char *edges = rax_realloc(f->edges,newmax);
+        if (edges == NULL) return 0;
+        f->edges = edges;
+        raxNode **children = rax_realloc(f->children,
+                                         newmax*sizeof(raxNode*));
+        if (children == NULL) return 0;
+        f->children = children;
+        f->maxchildren = newmax;
+    }
+    f->edges[f->numchildren] = c;
+    f->children[f->numchildren++] = child;
+    return 1;
+}
+
+/* Finalize the deepest open frame and attach it to its parent (or record
+ * it as the tree root if it is the last one). Returns 0 on OOM. */
+static int raxBulkPop(raxBulk *b) {
+    struct raxBulkFrame *f = &b->frames[b->numframes-1];
+    raxNode *n = raxBulkFinalizeFrame(b,f);
+    if (n == NULL) return 0;
+    b->numframes--;
+    if (b->numframes == 0) {
+        b->root = n;
+        return 1;
+    }
+    return raxBulkFrameAddChild(&b->frames[b->numframes-1],f->edgebyte,n);
+}
+
+/* Open a new frame for the key suffix s[start..len), terminating a key
+ * with the given data. Returns 0 on OOM. */
+static int raxBulkPush(raxBulk *b, unsigned char edgebyte, unsigned char *s,
+                       size_t start, size_t len, void *data)
+{
+    if (b->numframes == b->maxframes) {
+        size_t newmax = b->maxframes ? b->maxframes*2 : 16;
+        struct raxBulkFrame *frames = rax_realloc(b->frames,
+            newmax*sizeof(struct raxBulkFrame));
+        if (frames == NULL) return 0;
+        b->frames = frames;
+        b->maxframes = newmax;
+    }
+    struct raxBulkFrame *f = &b->frames[b->numframes];
+    f->edgebyte = edgebyte;
+    f->runlen = len-start;
+    f->run = NULL;
+    if (f->runlen) {
+        f->run = rax_malloc(f->runlen);
+        if (f->run == NULL) return 0;
+        memcpy(f->run,s+start,f->runlen);
+    }
+    f->depth = len;
+    f->edges = NULL;
+    f->children = NULL;
+    f->numchildren = 0;
+    f->maxchildren = 0;
+    f->iskey = 1;
+    f->data = data;
+    b->numframes++;
+    return 1;
+}
+
+/* Split the frame's compressed run at depth 'lcp': everything below the
+ * cut (the run tail, the children and the key collected so far) is
+ * finalized into a node attached back to the frame, which becomes a pure
+ * branching point at depth 'lcp'. Returns 0 on OOM. */
+static int raxBulkSplit(raxBulk *b, struct raxBulkFrame *f, size_t lcp) {
+    size_t start = f->depth - f->runlen;
+    size_t cut = lcp - start;
+    struct raxBulkFrame deep = *f;
+
+    deep.edgebyte = f->run[cut];
+    deep.runlen = f->runlen - cut - 1;
+    deep.run = NULL;
+    if (deep.runlen) {
+        deep.run = rax_malloc(deep.runlen);
+        if (deep.run == NULL) return 0;
+        memcpy(deep.run,f->run+cut+1,deep.runlen);
+    }
+
+    /* The children, key and run tail now belong to 'deep'. */
+    f->runlen = cut;
+    f->depth = lcp;
+    f->iskey = 0;
+    f->data = NULL;
+    f->edges = NULL;
+    f->children = NULL;
+    f->numchildren = 0;
+    f->maxchildren = 0;
+
+    raxNode *n = raxBulkFinalizeFrame(b,&deep);
+    if (n == NULL) return 0;
+    return raxBulkFrameAddChild(f,deep.edgebyte,n);
+}
+
+/* Close every open frame and install the resulting tree as the rax head,
+ * replacing the empty one. No-op if nothing was built. */
+static void raxBulkCommit(raxBulk *b) {
+    if (b->numframes == 0) return;
+    while (b->numframes)
+        if (!raxBulkPop(b)) return; /* OOM: never happens with zmalloc. */
+    rax_free(b->rt->head);
+    b->rt->head = b->root;
+    b->rt->numele += b->numele;
+    b->rt->numnodes = b->numnodes;
+    b->rt->version++;
+    b->root = NULL;
+    b->numele = 0;
+}
+
+/* Initialize a bulk loading session for 'rt'. The builder path requires
+ * the tree to be empty and the keys to arrive in strictly ascending
+ * order; violating either just degrades, transparently, to raxInsert().
+ * The session must be closed with raxBulkStop(). */
+void raxBulkStart(raxBulk *b, rax *rt) {
+    b->rt = rt;
+    b->frames = NULL;
+    b->numframes = 0;
+    b->maxframes = 0;
+    b->root = NULL;
+    b->prev = NULL;
+    b->prevlen = 0;
+    b->prevalloc = 0;
+    b->numele = 0;
+    b->numnodes = 0;
+    b->degraded = rt->numele != 0;
+}
+
+/* Append a key to the bulk loading session. Same contract as
+ * raxInsert(): returns 1 if inserted, 0 with errno set to 0 if the key
+ * was already present (its value is updated, the old one returned via
+ * 'old' if not NULL), 0 with errno set to ENOMEM on OOM. */
+int raxBulkInsert(raxBulk *b, unsigned char *s, size_t len, void *data,
+                  void **old)
+{
+    if (b->degraded) return raxInsert(b->rt,s,len,data,old);
+
+    /* Compute the longest common prefix with the previous key, also
+     * checking the ordering contract. */
+    size_t minlen = len < b->prevlen ? len : b->prevlen;
+    size_t lcp = 0;
+    while (lcp < minlen && b->prev[lcp] == s[lcp]) lcp++;
+    if (b->numele) {
+        if (lcp == len && lcp == b->prevlen) {
+            /* Same key again: update the still-open deepest frame. */
+            struct raxBulkFrame *f = &b->frames[b->numframes-1];
+            if (old) *old = f->data;
+            f->data = data;
+            errno = 0;
+            return 0;
+        }
+        if (lcp == len || (lcp < minlen && b->prev[lcp] > s[lcp])) {
+            /* Out of order: commit what was built and fall back. */
+            raxBulkCommit(b);
+            b->degraded = 1;
+            return raxInsert(b->rt,s,len,data,old);
+        }
+    }
+
+    if (b->numframes == 0) {
+        /* First key: open the root frame covering the whole key. */
+        if (!raxBulkPush(b,0,s,0,len,data)) goto oom;
+    } else {
+        /* Close the spine below the first diverging byte: those nodes
+         * will never receive further keys. */
+        for (;;) {
+            struct raxBulkFrame *f = &b->frames[b->numframes-1];
+            if (f->depth == lcp) break;
+            if (f->depth - f->runlen > lcp) {
+                if (!raxBulkPop(b)) goto oom;
+                continue;
+            }
+            /* The divergence point falls inside this frame's run. */
+            if (!raxBulkSplit(b,f,lcp)) goto oom;
+            break;
+        }
+        /* Open the frame for the new key's unique suffix. */
+        if (!raxBulkPush(b,s[lcp],s,lcp+1,len,data)) goto oom;
+    }
+
+    /* Remember the key for the next lcp computation. */
+    if (len > b->prevalloc) {
+        size_t newalloc = len < 64 ? 64 : len;
+        unsigned char *prev = rax_realloc(b->prev,newalloc);
+        if (prev == NULL) goto oom;
+        b->prev = prev;
+        b->prevalloc = newalloc;
+    }
+    memcpy(b->prev,s,len);
+    b->prevlen = len;
+    b->numele++;
+    return 1;
+
+oom:
+    errno = ENOMEM;
+    return 0;
+}
+
+/* Close a bulk loading session, committing the tree built so far. */
+void raxBulkStop(raxBulk *b) {
+    raxBulkCommit(b);
+    rax_free(b->prev);
+    rax_free(b->frames);
+    b->prev = NULL;
+    b->frames = NULL;
+}
+
 /* Find a key in the rax, returns raxNotFound special void pointer value
  * if the item was not found, otherwise the value associated with the
  * item is returned. */
@@ -1032,6 +1332,7 @@ int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
     if (old) *old = raxGetData(h);
     h->iskey = 0;
     rax->numele--;
+    rax->version++; /* Invalidate iterator checkpoints. */
 
     /* If this node has no children, the deletion needs to reclaim the
      * no longer used nodes. This is an iterative process that needs to
@@ -1814,6 +2115,97 @@ int raxEOF(raxIterator *it) {
     return it->flags & RAX_ITER_EOF;
 }
 
+/* --------------------------- Iterator checkpoints ------------------------
+ *
+ * An iteration that is performed incrementally (a few elements per call,
+ * like cursor based range queries or background passes over a big tree)
+ * pays a full root-to-leaf seek at every resumption. A checkpoint saves
+ * the iterator position -- current key, current node and parents stack --
+ * so that a later iterator can restart exactly where the previous one
+ * stopped. The saved node pointers are reused verbatim only if the tree
+ * was not modified in between (checked against the rax version counter),
+ * otherwise the restore transparently performs a normal seek by key, so
+ * a checkpoint is never unsafe, just possibly slower to restore. */
+
+/* Initialize a checkpoint structure before its first use. */
+void raxCheckpointInit(raxCheckpoint *cp) {
+    cp->version = 0;
+    cp->flags = RAX_ITER_EOF;
+    cp->key = NULL;
+    cp->key_len = 0;
+    cp->stack = NULL;
+    cp->stackitems = 0;
+    cp->node = NULL;
+}
+
+/* Save the current position of 'it' into 'cp', releasing any position
+ * previously saved there. Returns 1 on success, 0 on out of memory. */
+int raxIteratorCheckpoint(raxIterator *it, raxCheckpoint *cp) {
+    raxCheckpointRelease(cp);
+    cp->version = it->rt->version;
+    cp->flags = it->flags;
+    cp->node = it->node;
+    cp->key_len = it->key_len;
+    if (it->key_len) {
+        cp->key = rax_malloc(it->key_len);
+        if (cp->key == NULL) return 0;
+        memcpy(cp->key,it->key,it->key_len);
+    }
+    cp->stackitems = it->stack.items;
+    if (cp->stackitems) {
+        cp->stack = rax_malloc(sizeof(void*)*cp->stackitems);
+        if (cp->stack == NULL) {
+            raxCheckpointRelease(cp);
+            return 0;
+        }
+        memcpy(cp->stack,it->stack.stack,sizeof(void*)*cp->stackitems);
+    }
+    return 1;
+}
+
+/* Restore into 'it' (already started with raxStart() against the same
+ * rax the checkpoint was taken from) the position saved in 'cp'. If the
+ * tree was modified since the checkpoint was taken the function falls
+ * back to seeking the saved key, which positions the iteration at the
+ * same logical point even if the saved element was removed meanwhile.
+ * Returns 1 on success, 0 on out of memory. */
+int raxIteratorRestore(raxIterator *it, raxCheckpoint *cp) {
+    if (cp->version != it->rt->version) {
+        if (cp->flags & RAX_ITER_EOF) {
+            it->flags |= RAX_ITER_EOF;
+            return 1;
+        }
+        /* If the element was not consumed yet it must be returned by the
+         * next call, otherwise iteration continues after it. */
+        return raxSeek(it,(cp->flags & RAX_ITER_JUST_SEEKED) ? ">=" : ">",
+                       cp->key,cp->key_len);
+    }
+    it->key_len = 0;
+    if (cp->key_len && !raxIteratorAddChars(it,cp->key,cp->key_len))
+        return 0;
+    it->stack.items = 0;
+    for (size_t i = 0; i < cp->stackitems; i++)
+        if (!raxStackPush(&it->stack,cp->stack[i])) return 0;
+    it->node = cp->node;
+    it->flags = cp->flags;
+    if (it->node && it->node->iskey && !it->node->isnull)
+        it->data = raxGetData(it->node);
+    return 1;
+}
+
+/* Release the buffers owned by a checkpoint. The structure can be
+ * reused for another raxIteratorCheckpoint() call afterward. */
+void raxCheckpointRelease(raxCheckpoint *cp) {
+    rax_free(cp->key);
+    rax_free(cp->stack);
+    cp->key = NULL;
+    cp->key_len = 0;
+    cp->stack = NULL;
+    cp->stackitems = 0;
+    cp->node = NULL;
+    cp->flags = RAX_ITER_EOF;
+}
+
 /* Return the number of elements inside the radix tree. */
 uint64_t raxSize(rax *rax) {
     return rax->numele;
@@ -134,6 +134,9 @@ typedef struct rax {
     raxNode *head;
     uint64_t numele;
     uint64_t numnodes;
+    uint64_t version;   /* Bumped at every modification of the tree: lets
+                           iterator checkpoints detect that their saved
+                           node pointers are no longer valid. */
 } rax;
 
 /* Stack data structure used by raxLowWalk() in order to, optionally, return
@@ -185,6 +188,39 @@ typedef struct raxIterator {
     raxNodeCallback node_cb; /* Optional node callback. Normally set to NULL. */
 } raxIterator;
 
+/* Checkpoint of an iterator position. Taking a checkpoint copies the
+ * iterator's current key and parents stack, so that a later iterator (on
+ * the same rax) can resume from the saved position without re-descending
+ * from the root. The saved node pointers are only reused when the tree was
+ * not modified in between (tracked via the rax 'version' counter),
+ * otherwise restoring transparently falls back to a normal seek by key. */
+typedef struct raxCheckpoint {
+    uint64_t version;       /* rax->version when the checkpoint was taken. */
+    int flags;              /* Iterator flags at checkpoint time. */
+    unsigned char *key;     /* Copy of the current key. */
+    size_t key_len;
+    void **stack;           /* Copy of the parents stack. */
+    size_t stackitems;
+    raxNode *node;          /* Current node. */
+} raxCheckpoint;
+
+/* Bulk loading state. When keys are appended in strictly ascending order
+ * the tree is built bottom-up, constructing every node exactly once with
+ * its final size, instead of paying the per-insert reallocations and root
+ * descents of raxInsert(). Out of order input transparently degrades to
+ * normal insertions. */
+typedef struct raxBulk {
+    rax *rt;
+    struct raxBulkFrame *frames; /* Spine of open nodes, root first. */
+    size_t numframes, maxframes;
+    raxNode *root;          /* Finalized root, set when the spine closes. */
+    unsigned char *prev;    /* Previously appended key. */
+    size_t prevlen, prevalloc;
+    uint64_t numele;        /* Keys appended to the builder. */
+    uint64_t numnodes;      /* Nodes created so far. */
+    int degraded;           /* True if we fell back to raxInsert(). */
+} raxBulk;
+
 /* A special pointer returned for not found items. */
 extern void *raxNotFound;
 
@@ -204,6 +240,13 @@ int raxRandomWalk(raxIterator *it, size_t steps);
 int raxCompare(raxIterator *iter, const char *op, unsigned char *key, size_t key_len);
 void raxStop(raxIterator *it);
 int raxEOF(raxIterator *it);
+void raxCheckpointInit(raxCheckpoint *cp);
+int raxIteratorCheckpoint(raxIterator *it, raxCheckpoint *cp);
+int raxIteratorRestore(raxIterator *it, raxCheckpoint *cp);
+void raxCheckpointRelease(raxCheckpoint *cp);
+void raxBulkStart(raxBulk *b, rax *rt);
+int raxBulkInsert(raxBulk *b, unsigned char *s, size_t len, void *data, void **old);
+void raxBulkStop(raxBulk *b);
 void raxShow(rax *rax);
 uint64_t raxSize(rax *rax);
 unsigned long raxTouch(raxNode *n);
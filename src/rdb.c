@@ -29,10 +29,13 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#include "compress.h"
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
 
+#include "atomicvar.h"
+
 #include <math.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -41,6 +44,8 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 /* This macro is called when the internal RDB stracture is corrupt */
 #define rdbExitReportCorruptRDB(...) rdbReportError(1, __LINE__,__VA_ARGS__)
@@ -343,34 +348,261 @@ writeerr:
     return -1;
 }
 
-ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+/* Like rdbSaveLzfBlob() but for blobs compressed with a non default codec.
+ * The codec identifier is saved before the compressed length, so that the
+ * loading side knows how to decompress the data. */
+ssize_t rdbSaveCodecBlob(rio *rdb, int codec_id, void *data,
+                         size_t compress_len, size_t original_len) {
+    unsigned char byte;
+    ssize_t n, nwritten = 0;
+
+    byte = (RDB_ENCVAL<<6)|RDB_ENC_CODEC;
+    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
+    nwritten += n;
+
+    if ((n = rdbSaveLen(rdb,codec_id)) == -1) goto writeerr;
+    nwritten += n;
+
+    if ((n = rdbSaveLen(rdb,compress_len)) == -1) goto writeerr;
+    nwritten += n;
+
+    if ((n = rdbSaveLen(rdb,original_len)) == -1) goto writeerr;
+    nwritten += n;
+
+    if ((n = rdbWriteRaw(rdb,data,compress_len)) == -1) goto writeerr;
+    nwritten += n;
+
+    return nwritten;
+
+writeerr:
+    return -1;
+}
+
+/* Compress 's' with the codec selected by rdb-compress-codec and save it.
+ * LZF output keeps the historical RDB_ENC_LZF encoding so that RDB files
+ * produced with the default configuration remain unchanged, other codecs
+ * are saved with the RDB_ENC_CODEC encoding. */
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
     void *out;
+    compressCodec *codec = compressCodecById(server.rdb_compress_codec);
 
     /* We require at least four bytes compression for this to be worth it */
     if (len <= 4) return 0;
     outlen = len-4;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(s, len, out, outlen);
+    comprlen = codec->compress(s, len, out, outlen);
     if (comprlen == 0) {
         zfree(out);
         return 0;
     }
-    ssize_t nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len);
+    ssize_t nwritten = (codec->id == COMPRESS_CODEC_LZF) ?
+        rdbSaveLzfBlob(rdb, out, comprlen, len) :
+        rdbSaveCodecBlob(rdb, codec->id, out, comprlen, len);
     zfree(out);
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
+/* ---------------------------- Parallel RDB load ---------------------------
+ *
+ * Parsing an RDB stream is inherently sequential, since the format is self
+ * describing, but decompressing the payload of string values is not: once
+ * the compressed bytes are read off the stream and the target buffer is
+ * allocated, the actual decompression can happen at any point before the
+ * value is first accessed, that at load time means before rdbLoadRio()
+ * returns. When rdb-load-threads is greater than one a small worker pool
+ * decompresses string values in the background while the main thread goes
+ * on parsing the stream. The same pool runs the deep integrity walks of
+ * untrusted encoding blobs, that are likewise independent per object once
+ * the bytes are off the stream: this is what makes a multi threaded
+ * redis-check-rdb run possible. rdbLoadPoolBarrier() waits for all the
+ * deferred jobs to complete, and is called before anything may free or
+ * read a deferred value. */
+
+typedef struct rdbLoadJob {
+    compressCodec *codec;   /* Decompress jobs: codec to use, otherwise NULL. */
+    int (*validate)(unsigned char *p, size_t size, int deep);
+                            /* Validate jobs: deep check to run on 'in'. */
+    unsigned char *in;      /* Input bytes: owned by the job for decompress
+                             * jobs, by the loaded object for validate jobs. */
+    size_t inlen;
+    void *out;              /* Target buffer, owned by the loaded object. */
+    size_t outlen;
+    struct rdbLoadJob *next;
+} rdbLoadJob;
+
+/* Max number of queued or in flight jobs before the producer blocks, to
+ * bound the amount of compressed payload copies retained in memory. */
+#define RDB_LOAD_POOL_MAX_PENDING 1024
+
+static struct {
+    pthread_t *threads;
+    int numthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;    /* Signaled when a job is queued. */
+    pthread_cond_t idle;        /* Signaled when a job completes. */
+    rdbLoadJob *head, *tail;
+    int pending;                /* Queued plus in flight jobs. */
+    const char *error;          /* Error message if a job failed, or NULL. */
+    int stop;
+} rdb_load_pool = {NULL,0,PTHREAD_MUTEX_INITIALIZER,PTHREAD_COND_INITIALIZER,
+                   PTHREAD_COND_INITIALIZER,NULL,NULL,0,NULL,0};
+
+/* Set to 1 by rdbLoadCompressedStringObject() when the last payload was
+ * deferred to the pool, so that callers know the bytes are not there yet. */
+static int rdb_load_last_deferred = 0;
+
+static void *rdbLoadPoolWorker(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&rdb_load_pool.lock);
+    while(1) {
+        while (rdb_load_pool.head == NULL && !rdb_load_pool.stop)
+            pthread_cond_wait(&rdb_load_pool.notempty,&rdb_load_pool.lock);
+        if (rdb_load_pool.head == NULL) break; /* Stopping. */
+        rdbLoadJob *job = rdb_load_pool.head;
+        rdb_load_pool.head = job->next;
+        if (rdb_load_pool.head == NULL) rdb_load_pool.tail = NULL;
+        pthread_mutex_unlock(&rdb_load_pool.lock);
+
+        const char *error = NULL;
+        if (job->codec) {
+            if (job->codec->decompress(job->in,job->inlen,
+                                       job->out,job->outlen) == 0)
+            {
+                error = "Invalid compressed string payload";
+            }
+            zfree(job->in);
+        } else {
+            if (!job->validate(job->in,job->inlen,1))
+                error = "Corrupt encoding blob in object serialization";
+        }
+        zfree(job);
+
+        pthread_mutex_lock(&rdb_load_pool.lock);
+        if (error) rdb_load_pool.error = error;
+        rdb_load_pool.pending--;
+        pthread_cond_broadcast(&rdb_load_pool.idle);
+    }
+    pthread_mutex_unlock(&rdb_load_pool.lock);
+    return NULL;
+}
+
+int rdbLoadPoolActive(void) {
+    return rdb_load_pool.numthreads > 0;
+}
+
+void rdbLoadPoolStart(void) {
+    if (rdbLoadPoolActive() || server.rdb_load_threads <= 1) return;
+    rdb_load_pool.numthreads = server.rdb_load_threads;
+    rdb_load_pool.threads =
+        zmalloc(sizeof(pthread_t)*rdb_load_pool.numthreads);
+    rdb_load_pool.stop = 0;
+    rdb_load_pool.error = NULL;
+    for (int j = 0; j < rdb_load_pool.numthreads; j++) {
+        if (pthread_create(&rdb_load_pool.threads[j],NULL,
+                           rdbLoadPoolWorker,NULL) != 0)
+        {
+            /* Run with the threads we managed to spawn, possibly none. */
+            rdb_load_pool.numthreads = j;
+            break;
+        }
+    }
+    if (rdb_load_pool.numthreads == 0) {
+        zfree(rdb_load_pool.threads);
+        rdb_load_pool.threads = NULL;
+    }
+}
+
+static void rdbLoadPoolEnqueue(rdbLoadJob *job) {
+    pthread_mutex_lock(&rdb_load_pool.lock);
+    while (rdb_load_pool.pending >= RDB_LOAD_POOL_MAX_PENDING)
+        pthread_cond_wait(&rdb_load_pool.idle,&rdb_load_pool.lock);
+    if (rdb_load_pool.tail) {
+        rdb_load_pool.tail->next = job;
+        rdb_load_pool.tail = job;
+    } else {
+        rdb_load_pool.head = rdb_load_pool.tail = job;
+    }
+    rdb_load_pool.pending++;
+    pthread_cond_signal(&rdb_load_pool.notempty);
+    pthread_mutex_unlock(&rdb_load_pool.lock);
+}
+
+/* Queue the decompression of 'inlen' bytes at 'in' into 'out'. Ownership
+ * of 'in' is transferred to the pool, 'out' stays with the caller. */
+static void rdbLoadPoolSubmit(compressCodec *codec, unsigned char *in,
+                              size_t inlen, void *out, size_t outlen)
+{
+    rdbLoadJob *job = zmalloc(sizeof(*job));
+    job->codec = codec;
+    job->validate = NULL;
+    job->in = in;
+    job->inlen = inlen;
+    job->out = out;
+    job->outlen = outlen;
+    job->next = NULL;
+    rdbLoadPoolEnqueue(job);
+}
+
+/* Queue the deep integrity walk of the 'len' bytes encoding blob at 'p',
+ * performed with the 'validate' callback. The blob stays owned by the
+ * caller, that must not free it before rdbLoadPoolBarrier() returns. */
+static void rdbLoadPoolSubmitValidate(int (*validate)(unsigned char *p,
+                                                      size_t size, int deep),
+                                      unsigned char *p, size_t len)
+{
+    rdbLoadJob *job = zmalloc(sizeof(*job));
+    job->codec = NULL;
+    job->validate = validate;
+    job->in = p;
+    job->inlen = len;
+    job->out = NULL;
+    job->outlen = 0;
+    job->next = NULL;
+    rdbLoadPoolEnqueue(job);
+}
+
+/* Wait until every deferred job has completed. Exits reporting a corrupt
+ * RDB if any of them failed. Must be called before deferred values are
+ * read, freed, or the load returns. */
+void rdbLoadPoolBarrier(void) {
+    if (!rdbLoadPoolActive()) return;
+    pthread_mutex_lock(&rdb_load_pool.lock);
+    while (rdb_load_pool.pending > 0)
+        pthread_cond_wait(&rdb_load_pool.idle,&rdb_load_pool.lock);
+    const char *error = rdb_load_pool.error;
+    pthread_mutex_unlock(&rdb_load_pool.lock);
+    if (error)
+        rdbExitReportCorruptRDB("%s",error);
+}
+
+void rdbLoadPoolStop(void) {
+    if (!rdbLoadPoolActive()) return;
+    rdbLoadPoolBarrier();
+    pthread_mutex_lock(&rdb_load_pool.lock);
+    rdb_load_pool.stop = 1;
+    pthread_cond_broadcast(&rdb_load_pool.notempty);
+    pthread_mutex_unlock(&rdb_load_pool.lock);
+    for (int j = 0; j < rdb_load_pool.numthreads; j++)
+        pthread_join(rdb_load_pool.threads[j],NULL);
+    zfree(rdb_load_pool.threads);
+    rdb_load_pool.threads = NULL;
+    rdb_load_pool.numthreads = 0;
+}
+
+/* Load a compressed string in RDB format, decompressing it with 'codec'.
+ * The returned value changes according to 'flags'. For more info check the
  * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+void *rdbLoadCompressedStringObject(rio *rdb, compressCodec *codec, int flags,
+                                    size_t *lenptr)
+{
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
     unsigned char *c = NULL;
     char *val = NULL;
 
+    rdb_load_last_deferred = 0;
     if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((c = zmalloc(clen)) == NULL) goto err;
@@ -383,12 +615,22 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
     }
     if (lenptr) *lenptr = len;
 
-    /* Load the compressed representation and uncompress it to target. */
+    /* Load the compressed representation and uncompress it to target.
+     * When the caller allows it and the load pool is active, defer the
+     * decompression to a worker thread: the compressed bytes are handed
+     * to the pool and 'val' will be filled in the background, before
+     * rdbLoadPoolBarrier() returns. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) {
-        rdbExitReportCorruptRDB("Invalid LZF compressed string");
+    if ((flags & RDB_LOAD_ASYNC) && !plain && rdbLoadPoolActive()) {
+        rdbLoadPoolSubmit(codec,c,clen,val,len);
+        rdb_load_last_deferred = 1;
+    } else {
+        if (codec->decompress(c,clen,val,len) == 0) {
+            rdbExitReportCorruptRDB("Invalid %s compressed string",
+                                    codec->name);
+        }
+        zfree(c);
     }
-    zfree(c);
 
     if (plain || sds) {
         return val;
@@ -419,10 +661,10 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -497,7 +739,21 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+            return rdbLoadCompressedStringObject(rdb,
+                compressCodecById(COMPRESS_CODEC_LZF),flags,lenptr);
+        case RDB_ENC_CODEC:
+        {
+            uint64_t codec_id;
+            compressCodec *codec;
+
+            if ((codec_id = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+            if ((codec = compressCodecById(codec_id)) == NULL) {
+                rdbExitReportCorruptRDB(
+                    "Unknown or not compiled in compression codec %d",
+                    (int)codec_id);
+            }
+            return rdbLoadCompressedStringObject(rdb,codec,flags,lenptr);
+        }
         default:
             rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",len);
             return NULL; /* Never reached. */
@@ -644,15 +900,15 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_SKIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -776,7 +1032,13 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 if (quicklistNodeIsCompressed(node)) {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
-                    if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
+                    /* Already compressed nodes are saved as they are. The
+                     * encoding depends on the codec the quicklist uses. */
+                    n = (server.list_compress_codec == COMPRESS_CODEC_LZF) ?
+                        rdbSaveLzfBlob(rdb,data,compress_len,node->sz) :
+                        rdbSaveCodecBlob(rdb,server.list_compress_codec,
+                                         data,compress_len,node->sz);
+                    if (n == -1) return -1;
                     nwritten += n;
                 } else {
                     if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
@@ -821,8 +1083,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -857,8 +1119,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -897,19 +1159,28 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             serverPanic("Unknown hash encoding");
         }
     } else if (o->type == OBJ_STREAM) {
-        /* Store how many listpacks we have inside the radix tree. */
+        /* Store how many listpacks we have inside the radix tree, not
+         * counting the head nodes below the trim watermark that still
+         * wait for incremental release. */
         stream *s = o->ptr;
         rax *rax = s->rax;
-        if ((n = rdbSaveLen(rdb,raxSize(rax))) == -1) return -1;
+        if ((n = rdbSaveLen(rdb,raxSize(rax)-s->trim_dead_nodes)) == -1)
+            return -1;
         nwritten += n;
 
         /* Serialize all the listpacks inside the radix tree as they are,
          * when loading back, we'll use the first entry of each listpack
          * to insert it back into the radix tree. */
         raxIterator ri;
+        uint64_t dead = s->trim_dead_nodes;
         raxStart(&ri,rax);
         raxSeek(&ri,"^",NULL,0);
         while (raxNext(&ri)) {
+            if (dead) {
+                /* Logically deleted node: don't persist it. */
+                dead--;
+                continue;
+            }
             unsigned char *lp = ri.data;
             size_t lp_bytes = lpBytes(lp);
             if ((n = rdbSaveRawString(rdb,ri.key,ri.key_len)) == -1) return -1;
@@ -1008,11 +1279,187 @@ size_t rdbSavedObjectLen(robj *o) {
     return len;
 }
 
+/* ---------------------------- Lazy RDB loading ----------------------------
+ *
+ * When 'rdb-mmap-format' is enabled, rdbSaveKeyValuePair() prefixes every
+ * key-value pair with RDB_OPCODE_MMAP_VALUE followed by a fixed-width header:
+ * an 8 byte little endian payload length and the one byte RDB type. The
+ * header makes the serialized value self delimiting, so the loading side can
+ * locate the payload bytes without parsing them.
+ *
+ * At startup, when the file is loaded from disk, we memory map it and for
+ * every such pair we create a placeholder object with OBJ_ENCODING_LAZY
+ * whose ptr references the payload inside the map. The real object is only
+ * built (materialized) the first time lookupKey() touches the key, so a
+ * restart becomes I/O bound on the keyspace metadata instead of CPU bound
+ * on deserializing every value.
+ *
+ * The map is reference counted: every outstanding lazy value holds a
+ * reference, plus one held by the loading code itself while the load is in
+ * progress. The last reference dropped unmaps the file. Since values may be
+ * freed from the lazyfree background thread, the counter is atomic. */
+
+/* A memory mapped RDB file backing lazy values. */
+typedef struct rdbMemoryMap {
+    unsigned char *data;    /* Start of the mapping. */
+    size_t size;            /* Size of the mapping in bytes. */
+    long long refs;         /* Atomic reference count. */
+} rdbMemoryMap;
+
+/* A not yet materialized value: robj->ptr of an OBJ_ENCODING_LAZY object. */
+typedef struct lazyValue {
+    rdbMemoryMap *map;      /* The map holding the serialized payload. */
+    uint64_t offset;        /* Payload offset inside the map. */
+    uint64_t len;           /* Payload length in bytes. */
+    int rdbtype;            /* RDB_TYPE_* of the serialized payload. */
+} lazyValue;
+
+/* The map being populated by the ongoing rdbLoad(), if any, and the global
+ * number of lazy values still alive across all the maps. */
+static rdbMemoryMap *rdb_mmap_current = NULL;
+static long long rdb_lazy_values = 0;
+
+/* Drop a reference on 'map', unmapping the file when it was the last one. */
+static void rdbMemoryMapRelease(rdbMemoryMap *map) {
+    long long oldrefs;
+    atomicGetIncr(map->refs,oldrefs,-1);
+    if (oldrefs == 1) {
+        munmap(map->data,map->size);
+        zfree(map);
+    }
+}
+
+/* Try to memory map the RDB file we are about to load from 'fp'. On success
+ * lazy values can be created by rdbLoadRio() via rdbCreateLazyValue(). On
+ * failure we just load eagerly as usual: mapping is an optimization. */
+static void rdbMmapLoadBegin(FILE *fp) {
+    struct stat sb;
+
+    if (!server.rdb_mmap_format) return;
+    if (fstat(fileno(fp),&sb) == -1 || sb.st_size == 0) return;
+    void *data = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fileno(fp),0);
+    if (data == MAP_FAILED) {
+        serverLog(LL_WARNING,
+            "Can't memory map the RDB file (%s), loading it eagerly.",
+            strerror(errno));
+        return;
+    }
+    rdbMemoryMap *map = zmalloc(sizeof(*map));
+    map->data = data;
+    map->size = sb.st_size;
+    map->refs = 1; /* The reference of the loading code itself. */
+    rdb_mmap_current = map;
+}
+
+/* Called when rdbLoad() is done with the file: drops the loader reference.
+ * If no lazy value was created the file is unmapped right away. */
+static void rdbMmapLoadEnd(void) {
+    if (rdb_mmap_current == NULL) return;
+    rdbMemoryMapRelease(rdb_mmap_current);
+    rdb_mmap_current = NULL;
+}
+
+/* Map an RDB_TYPE_* identifier to the OBJ_* logical type the payload will
+ * have once materialized, or -1 for types we can't defer (modules need
+ * their type callbacks at load time). */
+static int rdbTypeToObjectType(int rdbtype) {
+    switch(rdbtype) {
+    case RDB_TYPE_STRING: return OBJ_STRING;
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_LIST_QUICKLIST: return OBJ_LIST;
+    case RDB_TYPE_SET:
+    case RDB_TYPE_SET_INTSET: return OBJ_SET;
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK: return OBJ_ZSET;
+    case RDB_TYPE_HASH:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_HASH_LISTPACK: return OBJ_HASH;
+    case RDB_TYPE_STREAM_LISTPACKS: return OBJ_STREAM;
+    default: return -1;
+    }
+}
+
+/* Create a lazy placeholder for a payload of 'len' bytes at 'offset' inside
+ * the map currently being loaded. The object reports the logical type of
+ * the value so that type checks work before materialization. */
+static robj *rdbCreateLazyValue(int rdbtype, uint64_t offset, uint64_t len) {
+    lazyValue *lv = zmalloc(sizeof(*lv));
+    lv->map = rdb_mmap_current;
+    lv->offset = offset;
+    lv->len = len;
+    lv->rdbtype = rdbtype;
+
+    atomicIncr(lv->map->refs,1);
+    atomicIncr(rdb_lazy_values,1);
+
+    robj *o = createObject(rdbTypeToObjectType(rdbtype),lv);
+    o->encoding = OBJ_ENCODING_LAZY;
+    return o;
+}
+
+/* Deserialize the payload of the lazy value 'o' and return the resulting
+ * object. 'o' itself is left untouched. */
+robj *rdbLazyValueLoad(robj *key, robj *o) {
+    serverAssert(o->encoding == OBJ_ENCODING_LAZY);
+    lazyValue *lv = o->ptr;
+    rio payload;
+    sds buf = sdsnewlen(lv->map->data+lv->offset,lv->len);
+
+    rioInitWithBuffer(&payload,buf);
+    robj *val = rdbLoadObject(lv->rdbtype,&payload,key,0);
+    if (val == NULL)
+        rdbExitReportCorruptRDB("Error materializing lazy value");
+    sdsfree(buf);
+    return val;
+}
+
+/* Materialize the lazy value stored at the dict entry 'de' of 'db', replace
+ * it in place, and return the materialized object. Must be called from the
+ * main thread, since it modifies the keyspace. */
+robj *rdbLazyValueMaterialize(redisDb *db, robj *key, dictEntry *de) {
+    robj *o = dictGetVal(de);
+    robj *val = rdbLazyValueLoad(key,o);
+
+    val->lru = o->lru;
+    dictSetVal(dbGetDict(db,key->ptr),de,val);
+    decrRefCount(o);
+    return val;
+}
+
+/* Free a lazy value object: called by decrRefCount() in place of the
+ * per-type free functions. May run in the lazyfree background thread. */
+void rdbLazyValueFree(robj *o) {
+    lazyValue *lv = o->ptr;
+    rdbMemoryMapRelease(lv->map);
+    zfree(lv);
+    atomicDecr(rdb_lazy_values,1);
+}
+
+/* Return true if there is at least one lazy value alive. While this is the
+ * case, command execution from I/O threads is disabled since materialization
+ * modifies the keyspace. */
+int rdbLazyValuesPresent(void) {
+    long long count;
+    atomicGet(rdb_lazy_values,count);
+    return count != 0;
+}
+
+/* Memory reported for a lazy value by OBJECT/MEMORY introspection: just the
+ * bookkeeping structure, since the payload lives in the file mapping. */
+size_t rdbLazyValueMemUsage(robj *o) {
+    UNUSED(o);
+    return sizeof(lazyValue);
+}
+
 /* Save a key-value pair, with expire time, type, key, value.
  * On error -1 is returned.
  * On success if the key was actually saved 1 is returned, otherwise 0
  * is returned (the key was already expired). */
-int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
+int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime, int rdbflags) {
     int savelru = server.maxmemory_policy & MAXMEMORY_FLAG_LRU;
     int savelfu = server.maxmemory_policy & MAXMEMORY_FLAG_LFU;
 
@@ -1042,10 +1489,81 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
         if (rdbWriteRaw(rdb,buf,1) == -1) return -1;
     }
 
-    /* Save type, key, value */
-    if (rdbSaveObjectType(rdb,val) == -1) return -1;
-    if (rdbSaveStringObject(rdb,key) == -1) return -1;
-    if (rdbSaveObject(rdb,val,key) == -1) return -1;
+    /* The memory mappable format is only used for RDB files loaded back by
+     * ourselves: the AOF preamble and the replication stream must remain
+     * readable by standard parsers. */
+    int mmapfmt = server.rdb_mmap_format &&
+                  !(rdbflags & (RDBFLAGS_AOF_PREAMBLE|RDBFLAGS_REPLICATION));
+
+    if (val->encoding == OBJ_ENCODING_LAZY) {
+        /* A value that was never materialized: its serialized payload is
+         * already available in the file mapping, copy it verbatim. The
+         * payload layout is the same in both formats. */
+        lazyValue *lv = val->ptr;
+        unsigned char type = lv->rdbtype;
+        if (mmapfmt) {
+            uint64_t len64 = lv->len;
+            memrev64ifbe(&len64);
+            if (rdbSaveType(rdb,RDB_OPCODE_MMAP_VALUE) == -1) return -1;
+            if (rdbWriteRaw(rdb,&len64,8) == -1) return -1;
+        }
+        if (rdbWriteRaw(rdb,&type,1) == -1) return -1;
+        if (rdbSaveStringObject(rdb,key) == -1) return -1;
+        if (rdbWriteRaw(rdb,lv->map->data+lv->offset,lv->len) == -1) return -1;
+    } else if (val->encoding == OBJ_ENCODING_COLD) {
+        /* A value demoted to the cold tier: copy its serialized payload
+         * from the cold tier log (or the pending write buffer) without
+         * materializing it. Safe in the saving child too, as the log is
+         * append only and this entry was durable before the fork. */
+        sds payload = coldValueGetPayload(val);
+        unsigned char type = coldValueRdbType(val);
+        if (payload == NULL) return -1;
+        if (mmapfmt) {
+            uint64_t len64 = sdslen(payload);
+            memrev64ifbe(&len64);
+            if (rdbSaveType(rdb,RDB_OPCODE_MMAP_VALUE) == -1 ||
+                rdbWriteRaw(rdb,&len64,8) == -1)
+            {
+                sdsfree(payload);
+                return -1;
+            }
+        }
+        if (rdbWriteRaw(rdb,&type,1) == -1 ||
+            rdbSaveStringObject(rdb,key) == -1 ||
+            rdbWriteRaw(rdb,payload,sdslen(payload)) == -1)
+        {
+            sdsfree(payload);
+            return -1;
+        }
+        sdsfree(payload);
+    } else if (mmapfmt) {
+        /* Serialize the value in a buffer first, since the fixed-width
+         * header needs the payload length up front. */
+        rio payload;
+        rioInitWithBuffer(&payload,sdsempty());
+        if (rdbSaveObject(&payload,val,key) == -1) {
+            sdsfree(payload.io.buffer.ptr);
+            return -1;
+        }
+        uint64_t len64 = sdslen(payload.io.buffer.ptr);
+        memrev64ifbe(&len64);
+        if (rdbSaveType(rdb,RDB_OPCODE_MMAP_VALUE) == -1 ||
+            rdbWriteRaw(rdb,&len64,8) == -1 ||
+            rdbSaveObjectType(rdb,val) == -1 ||
+            rdbSaveStringObject(rdb,key) == -1 ||
+            rdbWriteRaw(rdb,payload.io.buffer.ptr,
+                        sdslen(payload.io.buffer.ptr)) == -1)
+        {
+            sdsfree(payload.io.buffer.ptr);
+            return -1;
+        }
+        sdsfree(payload.io.buffer.ptr);
+    } else {
+        /* Save type, key, value */
+        if (rdbSaveObjectType(rdb,val) == -1) return -1;
+        if (rdbSaveStringObject(rdb,key) == -1) return -1;
+        if (rdbSaveObject(rdb,val,key) == -1) return -1;
+    }
 
     /* Delay return if required (for testing) */
     if (server.rdb_key_save_delay)
@@ -1090,6 +1608,14 @@ int rdbSaveInfoAuxFields(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     if (rdbSaveAuxFieldStrInt(rdb,"ctime",time(NULL)) == -1) return -1;
     if (rdbSaveAuxFieldStrInt(rdb,"used-mem",zmalloc_used_memory()) == -1) return -1;
 
+    /* Total number of keys in the dataset: lets a warmup-enabled server
+     * size its hash tables once at load time instead of rehashing. */
+    long long keyspace_size = 0;
+    for (int j = 0; j < server.dbnum; j++)
+        keyspace_size += dbSize(server.db+j);
+    if (rdbSaveAuxFieldStrInt(rdb,"keyspace-size",keyspace_size) == -1)
+        return -1;
+
     /* Handle saving options that generate aux fields. */
     if (rsi) {
         if (rdbSaveAuxFieldStrInt(rdb,"repl-stream-db",rsi->repl_stream_db)
@@ -1100,6 +1626,14 @@ int rdbSaveInfoAuxFields(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             == -1) return -1;
     }
     if (rdbSaveAuxFieldStrInt(rdb,"aof-preamble",aof_preamble) == -1) return -1;
+
+    /* Full saves to disk carry the ID delta RDB files will chain to. */
+    if (server.rdb_incremental && server.rdb_base_id[0] != '\0' &&
+        !(rdbflags & (RDBFLAGS_AOF_PREAMBLE|RDBFLAGS_REPLICATION)))
+    {
+        if (rdbSaveAuxFieldStrStr(rdb,"snapshot-id",server.rdb_base_id) == -1)
+            return -1;
+    }
     return 1;
 }
 
@@ -1142,6 +1676,118 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
     return io.bytes;
 }
 
+/* ---------------------------- Parallel RDB save -------------------------- */
+
+/* State of a worker thread serializing one keyspace shard into a private
+ * memory buffer. */
+typedef struct rdbSaveShardJob {
+    pthread_t tid;
+    redisDb *db;        /* Database the shard belongs to. */
+    dict *d;            /* Shard to serialize. */
+    sds buf;            /* Serialized output, owned by the caller on join. */
+    int rdbflags;       /* RDBFLAGS_* of the save in progress. */
+    int spawned;        /* True if a thread was actually created. */
+    int error;          /* True if serialization failed. */
+} rdbSaveShardJob;
+
+static void *rdbSaveShardThread(void *arg) {
+    rdbSaveShardJob *job = arg;
+    rio r;
+    dictIterator *di;
+    dictEntry *de;
+
+    rioInitWithBuffer(&r,sdsempty());
+    di = dictGetIterator(job->d);
+    while((de = dictNext(di)) != NULL) {
+        sds keystr = dictGetKey(de);
+        robj key, *o = dictGetVal(de);
+        long long expire = -1;
+
+        initStaticStringObject(key,keystr);
+        /* Like getExpire(), but without the incremental rehash step:
+         * the expires dictionary is shared by all the worker threads. */
+        if (dictSize(job->db->expires)) {
+            dictEntry *ede = dictFindNoRehash(job->db->expires,keystr);
+            if (ede) expire = dictGetSignedIntegerVal(ede);
+        }
+        if (rdbSaveKeyValuePair(&r,&key,o,expire,job->rdbflags) == -1) {
+            job->error = 1;
+            break;
+        }
+    }
+    dictReleaseIterator(di);
+    job->buf = r.io.buffer.ptr;
+    return NULL;
+}
+
+/* Save every key of 'db' writing through 'rdb' using worker threads.
+ *
+ * The shards of the database are processed in waves of at most
+ * rdb-save-threads shards: each worker serializes (and compresses) one
+ * shard into a private memory buffer, then the main thread writes the
+ * buffers back in shard order through 'rdb'. Serialization, that is by
+ * far the expensive part, runs in parallel, while the ordered write
+ * through 'rdb' keeps the output deterministic and lets the rio layer
+ * compute the CRC64 checksum sequentially as usual. The wave size bounds
+ * the amount of memory retained in worker buffers at any time.
+ *
+ * On success C_OK is returned, otherwise C_ERR. */
+static int rdbSaveDbParallel(rio *rdb, redisDb *db, int rdbflags,
+                             size_t *processed)
+{
+    int shards = server.db_dict_shards;
+    int nthreads = server.rdb_save_threads;
+    if (nthreads > shards) nthreads = shards;
+    rdbSaveShardJob *jobs = zcalloc(sizeof(*jobs)*nthreads);
+    int start, j, ret = C_OK;
+
+    for (start = 0; start < shards && ret == C_OK; start += nthreads) {
+        int n = shards - start < nthreads ? shards - start : nthreads;
+
+        for (j = 0; j < n; j++) {
+            jobs[j].db = db;
+            jobs[j].d = db->dict[start+j];
+            jobs[j].buf = NULL;
+            jobs[j].rdbflags = rdbflags;
+            jobs[j].spawned = 0;
+            jobs[j].error = 0;
+            if (dictSize(jobs[j].d) == 0) continue;
+            if (pthread_create(&jobs[j].tid,NULL,rdbSaveShardThread,
+                               &jobs[j]) == 0)
+            {
+                jobs[j].spawned = 1;
+            } else {
+                /* Out of threads: serialize the shard in this thread. */
+                rdbSaveShardThread(&jobs[j]);
+            }
+        }
+        for (j = 0; j < n; j++)
+            if (jobs[j].spawned) pthread_join(jobs[j].tid,NULL);
+
+        /* Ordered merge stage: write the buffers through the main rio. */
+        for (j = 0; j < n; j++) {
+            if (ret == C_OK && jobs[j].error) ret = C_ERR;
+            if (ret == C_OK && jobs[j].buf && sdslen(jobs[j].buf) &&
+                rdbWriteRaw(rdb,jobs[j].buf,sdslen(jobs[j].buf)) == -1)
+            {
+                ret = C_ERR;
+            }
+            if (jobs[j].buf) sdsfree(jobs[j].buf);
+        }
+
+        /* See the serial loop in rdbSaveRio() about moving the accumulated
+         * diff from the parent while an AOF rewrite is in progress. */
+        if (ret == C_OK && (rdbflags & RDBFLAGS_AOF_PREAMBLE) &&
+            rdb->processed_bytes > *processed+AOF_READ_DIFF_INTERVAL_BYTES)
+        {
+            *processed = rdb->processed_bytes;
+            aofReadDiffFromParent();
+        }
+    }
+    zfree(jobs);
+    return ret;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1152,6 +1798,7 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
  * error. */
 int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     dictIterator *di = NULL;
+    dbIterator *dbit = NULL;
     dictEntry *de;
     char magic[10];
     int j;
@@ -1167,9 +1814,7 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
+        if (dbSize(db) == 0) continue;
 
         /* Write the SELECT DB opcode */
         if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
@@ -1180,21 +1825,30 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
          * However this does not limit the actual size of the DB to load since
          * these sizes are just hints to resize the hash tables. */
         uint64_t db_size, expires_size;
-        db_size = dictSize(db->dict);
+        db_size = dbSize(db);
         expires_size = dictSize(db->expires);
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
 
-        /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
+        /* When the keyspace is sharded and more than one save thread is
+         * configured, serialize the shards in parallel, otherwise iterate
+         * this DB writing every entry from this thread. */
+        if (server.rdb_save_threads > 1 && server.db_dict_shards > 1) {
+            if (rdbSaveDbParallel(rdb,db,rdbflags,&processed) == C_ERR)
+                goto werr;
+            continue;
+        }
+
+        dbit = dbGetSafeIterator(db);
+        while((de = dbIteratorNext(dbit)) != NULL) {
             sds keystr = dictGetKey(de);
             robj key, *o = dictGetVal(de);
             long long expire;
 
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
+            if (rdbSaveKeyValuePair(rdb,&key,o,expire,rdbflags) == -1) goto werr;
 
             /* When this RDB is produced as part of an AOF rewrite, move
              * accumulated diff from parent to child while rewriting in
@@ -1205,9 +1859,16 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
                 processed = rdb->processed_bytes;
                 aofReadDiffFromParent();
             }
+
+            /* Periodically report to the parent the copy on write consumed
+             * so far, it is exported in the INFO persistence section. */
+            if (server.in_fork_child)
+                sendChildCOWInfoIfNeeded(rdbflags & RDBFLAGS_AOF_PREAMBLE ?
+                                         CHILD_INFO_TYPE_AOF :
+                                         CHILD_INFO_TYPE_RDB);
         }
-        dictReleaseIterator(di);
-        di = NULL; /* So that we don't release it again on error. */
+        dbReleaseIterator(dbit);
+        dbit = NULL; /* So that we don't release it again on error. */
     }
 
     /* If we are storing the replication information on disk, persist
@@ -1240,6 +1901,7 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
 werr:
     if (error) *error = errno;
     if (di) dictReleaseIterator(di);
+    if (dbit) dbReleaseIterator(dbit);
     return C_ERR;
 }
 
@@ -1260,7 +1922,7 @@ int rdbSaveRioWithEOFMark(rio *rdb, int *error, rdbSaveInfo *rsi) {
     if (rioWrite(rdb,"$EOF:",5) == 0) goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     if (rioWrite(rdb,"\r\n",2) == 0) goto werr;
-    if (rdbSaveRio(rdb,error,RDBFLAGS_NONE,rsi) == C_ERR) goto werr;
+    if (rdbSaveRio(rdb,error,RDBFLAGS_REPLICATION,rsi) == C_ERR) goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     stopSaving(1);
     return C_OK;
@@ -1280,6 +1942,11 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     rio rdb;
     int error = 0;
 
+    /* A synchronous save starts a new delta chain base: reset the key
+     * tracking right before the snapshot is taken. In the BGSAVE case the
+     * same is done by the parent before forking. */
+    if (!server.in_fork_child) rdbDeltaBaseStarted();
+
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
     fp = fopen(tmpfile,"w");
     if (!fp) {
@@ -1329,6 +1996,7 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     server.dirty = 0;
     server.lastsave = time(NULL);
     server.lastbgsave_status = C_OK;
+    if (!server.in_fork_child) rdbDeltaBaseSaved();
     stopSaving(1);
     return C_OK;
 
@@ -1349,11 +2017,17 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     server.lastbgsave_try = time(NULL);
     openChildInfoPipe();
 
+    /* The child serializes the dataset as it is at fork time: start the
+     * new delta chain base now, so that the parent tracks exactly the
+     * keys modified after this point. */
+    rdbDeltaBaseStarted();
+
     if ((childpid = redisFork()) == 0) {
         int retval;
 
         /* Child */
         redisSetProcTitle("redis-rdb-bgsave");
+        redisSetCpuAffinity(server.bgsave_cpulist);
         retval = rdbSave(filename,rsi);
         if (retval == C_OK) {
             sendChildCOWInfo(CHILD_INFO_TYPE_RDB, "RDB");
@@ -1377,6 +2051,230 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     return C_OK; /* unreached */
 }
 
+/* --------------------------- Incremental RDB -----------------------------
+ *
+ * When rdb-incremental is enabled every modified key is recorded into a
+ * per DB set (server.rdb_delta_keys). SAVE DELTA serializes only those
+ * keys into a small delta RDB file that chains to the last full snapshot
+ * (the "base"): the file carries the base snapshot ID and a sequence
+ * number in AUX fields, stores deleted keys with the special
+ * RDB_OPCODE_DELTA_DEL opcode, and is applied on top of the base (and of
+ * the previous deltas) at startup by rdbLoadDeltaChain(). This gives
+ * frequent, cheap persistence points without forking or rewriting the
+ * whole dataset. */
+
+/* Sequence number the delta file being loaded is expected to carry, used
+ * by rdbLoadRio() to validate the "delta-seq" AUX field. Zero when no
+ * delta file is being loaded. */
+static int rdb_delta_expect_seq = 0;
+
+/* Return the name of the delta file with the given sequence number. The
+ * caller is responsible for releasing the returned sds string. */
+static sds rdbDeltaFileName(int seq) {
+    return sdscatprintf(sdsempty(),"%s.delta.%d",server.rdb_filename,seq);
+}
+
+/* Record that 'key' of 'db' changed (or was deleted) since the last
+ * snapshot, so that the next SAVE DELTA includes it. Called by
+ * signalModifiedKey() and by the expiration and eviction delete paths. */
+void rdbDeltaTrackKey(redisDb *db, robj *key) {
+    if (!server.rdb_incremental || server.loading) return;
+    dict *d = server.rdb_delta_keys[db->id];
+    if (dictFind(d,key->ptr) != NULL) return;
+    dictAdd(d,sdsdup(key->ptr),NULL);
+}
+
+/* Invalidate the delta chain: called when the dataset changes in a way a
+ * delta file cannot express (FLUSHDB / FLUSHALL / SWAPDB), and when the
+ * rdb-incremental option is changed at runtime. Delta saves will fail
+ * until a new base snapshot is taken. */
+void rdbDeltaInvalidate(void) {
+    server.rdb_base_valid = 0;
+    server.rdb_base_id[0] = '\0';
+    server.rdb_delta_seq = 0;
+    if (server.rdb_delta_keys) {
+        for (int j = 0; j < server.dbnum; j++)
+            dictEmpty(server.rdb_delta_keys[j],NULL);
+    }
+}
+
+/* Called (in the parent process) when a full save starts: a new base ID
+ * is generated, to be written in the "snapshot-id" AUX field, and the
+ * tracked key sets are reset, so that they accumulate exactly the changes
+ * applied after the snapshot was taken. The new base becomes usable for
+ * delta saves only once rdbDeltaBaseSaved() confirms it reached disk. */
+void rdbDeltaBaseStarted(void) {
+    if (!server.rdb_incremental) return;
+    getRandomHexChars(server.rdb_base_id,CONFIG_RUN_ID_SIZE);
+    server.rdb_base_id[CONFIG_RUN_ID_SIZE] = '\0';
+    server.rdb_base_valid = 0;
+    for (int j = 0; j < server.dbnum; j++)
+        dictEmpty(server.rdb_delta_keys[j],NULL);
+}
+
+/* Called when the full save started by rdbDeltaBaseStarted() completed
+ * successfully: the base becomes the head of a new (empty) delta chain,
+ * and the delta files of the previous chain are removed. */
+void rdbDeltaBaseSaved(void) {
+    int oldseq = server.rdb_delta_seq;
+
+    if (!server.rdb_incremental || server.rdb_base_id[0] == '\0') return;
+    server.rdb_base_valid = 1;
+    server.rdb_delta_seq = 0;
+    for (int i = 1;; i++) {
+        sds fname = rdbDeltaFileName(i);
+        int retval = unlink(fname);
+        sdsfree(fname);
+        if (retval == -1 && i >= oldseq) break;
+    }
+}
+
+/* Save a delta RDB file with the keys modified since the last snapshot.
+ * On success the tracked key sets are reset, so that the next delta only
+ * carries the changes applied from this point on.
+ *
+ * The caller must make sure that rdb-incremental is enabled and that a
+ * valid base snapshot exists. Returns C_OK on success, C_ERR on error. */
+int rdbSaveDelta(void) {
+    char tmpfile[256];
+    char magic[10];
+    long long keys = 0;
+    FILE *fp;
+    rio rdb;
+    int j;
+
+    snprintf(tmpfile,256,"temp-delta-%d.rdb", (int) getpid());
+    fp = fopen(tmpfile,"w");
+    if (!fp) {
+        serverLog(LL_WARNING,
+            "Failed opening the temporary delta RDB file %s for saving: %s",
+            tmpfile, strerror(errno));
+        return C_ERR;
+    }
+
+    rioInitWithFile(&rdb,fp);
+    if (server.rdb_save_incremental_fsync)
+        rioSetAutoSync(&rdb,REDIS_AUTOSYNC_BYTES);
+
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    if (rdbWriteRaw(&rdb,magic,9) == -1) goto werr;
+    if (rdbSaveAuxFieldStrStr(&rdb,"delta-of",server.rdb_base_id) == -1)
+        goto werr;
+    if (rdbSaveAuxFieldStrInt(&rdb,"delta-seq",server.rdb_delta_seq+1) == -1)
+        goto werr;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dict *tracked = server.rdb_delta_keys[j];
+        dictIterator *di;
+        dictEntry *de;
+
+        if (dictSize(tracked) == 0) continue;
+        if (rdbSaveType(&rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
+        if (rdbSaveLen(&rdb,j) == -1) goto werr;
+
+        di = dictGetIterator(tracked);
+        while((de = dictNext(di)) != NULL) {
+            sds keystr = dictGetKey(de);
+            robj key;
+            dictEntry *kde;
+
+            initStaticStringObject(key,keystr);
+            kde = dictFind(dbGetDict(db,keystr),keystr);
+            if (kde) {
+                if (rdbSaveKeyValuePair(&rdb,&key,dictGetVal(kde),
+                                        getExpire(db,&key),
+                                        RDBFLAGS_NONE) == -1)
+                {
+                    dictReleaseIterator(di);
+                    goto werr;
+                }
+            } else {
+                /* The key does not exist anymore: record the deletion. */
+                if (rdbSaveType(&rdb,RDB_OPCODE_DELTA_DEL) == -1 ||
+                    rdbSaveRawString(&rdb,(unsigned char*)keystr,
+                                     sdslen(keystr)) == -1)
+                {
+                    dictReleaseIterator(di);
+                    goto werr;
+                }
+            }
+            keys++;
+        }
+        dictReleaseIterator(di);
+    }
+
+    if (rdbSaveType(&rdb,RDB_OPCODE_EOF) == -1) goto werr;
+    uint64_t cksum = rdb.cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(&rdb,&cksum,8) == 0) goto werr;
+
+    /* Make sure data will not remain on the OS's output buffers */
+    if (fflush(fp) == EOF) goto werr;
+    if (fsync(fileno(fp)) == -1) goto werr;
+    if (fclose(fp) == EOF) goto werr;
+
+    sds fname = rdbDeltaFileName(server.rdb_delta_seq+1);
+    if (rename(tmpfile,fname) == -1) {
+        serverLog(LL_WARNING,
+            "Error moving temp delta RDB file %s on the final "
+            "destination %s: %s", tmpfile, fname, strerror(errno));
+        sdsfree(fname);
+        unlink(tmpfile);
+        return C_ERR;
+    }
+    server.rdb_delta_seq++;
+    for (j = 0; j < server.dbnum; j++)
+        dictEmpty(server.rdb_delta_keys[j],NULL);
+    serverLog(LL_NOTICE,"Delta RDB %s saved on disk (%lld keys)",
+        fname, keys);
+    sdsfree(fname);
+    return C_OK;
+
+werr:
+    serverLog(LL_WARNING,"Write error saving delta RDB on disk: %s",
+        strerror(errno));
+    fclose(fp);
+    unlink(tmpfile);
+    return C_ERR;
+}
+
+/* Called at startup after the base RDB file was loaded: apply, in order,
+ * the delta files chained to it. The chain stops at the first missing
+ * sequence number, or at the first file that does not reference the
+ * loaded base (a leftover of an older chain). On a clean stop the delta
+ * chain can keep growing from the last applied sequence number. */
+void rdbLoadDeltaChain(void) {
+    int seq = 1;
+
+    if (!server.rdb_incremental || !server.rdb_base_valid) return;
+    while(1) {
+        sds fname = rdbDeltaFileName(seq);
+        struct stat sb;
+        long long start;
+
+        if (stat(fname,&sb) == -1) {
+            sdsfree(fname);
+            break;
+        }
+        start = ustime();
+        rdb_delta_expect_seq = seq;
+        if (rdbLoad(fname,NULL,RDBFLAGS_DELTA) != C_OK) {
+            serverLog(LL_WARNING,
+                "Not applying delta RDB %s (nor the rest of the chain)",
+                fname);
+            sdsfree(fname);
+            break;
+        }
+        serverLog(LL_NOTICE,"Delta RDB %s applied: %.3f seconds",
+            fname,(float)(ustime()-start)/1000000);
+        server.rdb_delta_seq = seq;
+        sdsfree(fname);
+        seq++;
+    }
+    rdb_delta_expect_seq = 0;
+}
+
 void rdbRemoveTempFile(pid_t childpid) {
     char tmpfile[256];
 
@@ -1423,17 +2321,54 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Convert a ziplist blob loaded from an old RDB file into a listpack
+ * holding the same sequence of entries. Hashes and sorted sets are stored
+ * as listpacks since their small encodings moved off the ziplist, but we
+ * keep loading the retired on-disk formats forever. The ziplist is freed
+ * and the new listpack returned. */
+static unsigned char *rdbZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+
+    while (p != NULL) {
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+
+        serverAssert(ziplistGet(p,&vstr,&vlen,&vll));
+        if (vstr) {
+            lp = lpAppend(lp,vstr,vlen);
+        } else {
+            char buf[32];
+            int len = ll2string(buf,sizeof(buf),vll);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
- * On success a newly allocated object is returned, otherwise NULL. */
-robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
+ * On success a newly allocated object is returned, otherwise NULL.
+ *
+ * When 'validate' is non zero the payload comes from an untrusted source
+ * (a RESTORE command instead of an RDB file we generated ourselves), so
+ * the compact-encoding blobs that are adopted verbatim as the object
+ * backing store get a deep structural check before being trusted;
+ * otherwise only cheap constant time checks are performed. */
+robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key, int validate) {
     robj *o = NULL, *ele, *dec;
     uint64_t len;
     unsigned int i;
 
     if (rdbtype == RDB_TYPE_STRING) {
-        /* Read string value */
-        if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
-        o = tryObjectEncoding(o);
+        /* Read string value. The payload of a compressed string value may
+         * be decompressed in the background: in that case the bytes are
+         * not there yet, so the object can't be re-encoded. */
+        if ((o = rdbGenericLoadStringObject(rdb,RDB_LOAD_ENC|RDB_LOAD_ASYNC,
+                                            NULL)) == NULL) return NULL;
+        if (!rdb_load_last_deferred) o = tryObjectEncoding(o);
     } else if (rdbtype == RDB_TYPE_LIST) {
         /* Read list value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
@@ -1524,13 +2459,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
             znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            dictAdd(zs->dict,znode->ele,&znode->score);
+            sdsfree(sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1545,8 +2481,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1554,11 +2490,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value ||
@@ -1601,22 +2535,98 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                             server.list_compress_depth);
 
         while (len--) {
+            size_t zl_len;
             unsigned char *zl =
-                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&zl_len);
             if (zl == NULL) return NULL;
+            /* Every node blob is adopted as is by the quicklist: check
+             * its integrity first, deeply for untrusted payloads. The deep
+             * walk of each node is independent from the rest of the load,
+             * so with the worker pool running it happens in the background
+             * while the main thread goes on parsing the stream. */
+            int valid = ziplistValidateIntegrity(zl,zl_len,0);
+            if (valid && validate) {
+                uint16_t zllen;
+                memcpy(&zllen,zl+8,2);
+                memrev16ifbe(&zllen);
+                if (rdbLoadPoolActive() && zllen != UINT16_MAX) {
+                    /* quicklistAppendZiplist() only reads the header of
+                     * nodes with a non saturated count, so the blob can
+                     * be adopted before the walk completes: the barrier
+                     * reports the corruption before the value is used. */
+                    rdbLoadPoolSubmitValidate(ziplistValidateIntegrity,
+                                              zl,zl_len);
+                } else {
+                    valid = ziplistValidateIntegrity(zl,zl_len,1);
+                }
+            }
+            if (!valid) {
+                serverLog(LL_WARNING,
+                    "Invalid ziplist node in quicklist serialization");
+                zfree(zl);
+                decrRefCount(o);
+                return NULL;
+            }
             quicklistAppendZiplist(o->ptr, zl);
         }
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
+        size_t encoded_len;
         unsigned char *encoded =
-            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
         if (encoded == NULL) return NULL;
         o = createObject(OBJ_STRING,encoded); /* Obj type fixed below. */
 
+        /* Since the blob is adopted as is as the object backing store,
+         * check its structural integrity first: deeply when it comes from
+         * an untrusted source, otherwise just the cheap header checks. */
+        int valid = 1;
+        switch(rdbtype) {
+            case RDB_TYPE_HASH_ZIPMAP:
+                valid = zipmapValidateIntegrity(encoded,encoded_len,validate);
+                break;
+            case RDB_TYPE_LIST_ZIPLIST:
+            case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_HASH_ZIPLIST:
+                valid = ziplistValidateIntegrity(encoded,encoded_len,validate);
+                break;
+            case RDB_TYPE_SET_INTSET:
+                valid = intsetValidateIntegrity(encoded,encoded_len,validate);
+                break;
+            case RDB_TYPE_ZSET_LISTPACK:
+            case RDB_TYPE_HASH_LISTPACK:
+                valid = lpValidateIntegrity(encoded,encoded_len,validate);
+                break;
+        }
+        if (valid && validate) {
+            /* Hash and sorted set blobs must hold field-value or
+             * member-score pairs: an odd number of entries would break
+             * the pair-wise iterators. */
+            switch(rdbtype) {
+                case RDB_TYPE_ZSET_ZIPLIST:
+                case RDB_TYPE_HASH_ZIPLIST:
+                    valid = ziplistLen(encoded) % 2 == 0;
+                    break;
+                case RDB_TYPE_ZSET_LISTPACK:
+                case RDB_TYPE_HASH_LISTPACK:
+                    valid = lpLength(encoded) % 2 == 0;
+                    break;
+            }
+        }
+        if (!valid) {
+            serverLog(LL_WARNING,
+                "Invalid encoding blob of RDB type %d in object serialization",
+                rdbtype);
+            decrRefCount(o);
+            return NULL;
+        }
+
         /* Fix the object encoding, and make sure to convert the encoded
          * data type into the base type if accordingly to the current
          * configuration there are too many elements in the encoded data
@@ -1625,10 +2635,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1637,14 +2647,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
@@ -1665,14 +2675,30 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
+                /* Convert the blob from the retired ziplist format to a
+                 * listpack: the encoded pairs are identical. */
+                o->ptr = rdbZiplistToListpack(o->ptr);
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (zsetLength(o) > server.zset_max_ziplist_entries)
+                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                break;
+            case RDB_TYPE_ZSET_LISTPACK:
+                o->type = OBJ_ZSET;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+                o->ptr = rdbZiplistToListpack(o->ptr);
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+                    hashTypeConvert(o, OBJ_ENCODING_HT);
+                break;
+            case RDB_TYPE_HASH_LISTPACK:
+                o->type = OBJ_HASH;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
@@ -1691,6 +2717,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             return NULL;
         }
 
+        /* The master IDs were saved iterating the radix tree, so they are
+         * read back in ascending order: build the tree bottom-up instead
+         * of paying a root descent and node reallocations per insert. */
+        raxBulk lpbulk;
+        raxBulkStart(&lpbulk,s->rax);
         while(listpacks--) {
             /* Get the master ID, the one we'll use as key of the radix tree
              * node: the entries inside the listpack itself are delta-encoded
@@ -1698,6 +2729,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             sds nodekey = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL);
             if (nodekey == NULL) {
                 rdbReportReadError("Stream master ID loading failed: invalid encoding or I/O error.");
+                raxBulkStop(&lpbulk);
                 decrRefCount(o);
                 return NULL;
             }
@@ -1707,11 +2739,22 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             }
 
             /* Load the listpack. */
+            size_t lp_len;
             unsigned char *lp =
-                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&lp_len);
             if (lp == NULL) {
                 rdbReportReadError("Stream listpacks loading failed.");
                 sdsfree(nodekey);
+                raxBulkStop(&lpbulk);
+                decrRefCount(o);
+                return NULL;
+            }
+            if (!lpValidateIntegrity(lp,lp_len,validate)) {
+                serverLog(LL_WARNING,
+                    "Invalid listpack inside stream serialization");
+                zfree(lp);
+                sdsfree(nodekey);
+                raxBulkStop(&lpbulk);
                 decrRefCount(o);
                 return NULL;
             }
@@ -1724,12 +2767,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             }
 
             /* Insert the key in the radix tree. */
-            int retval = raxInsert(s->rax,
+            int retval = raxBulkInsert(&lpbulk,
                 (unsigned char*)nodekey,sizeof(streamID),lp,NULL);
             sdsfree(nodekey);
             if (!retval)
                 rdbExitReportCorruptRDB("Listpack re-added with existing key");
         }
+        raxBulkStop(&lpbulk);
         /* Load total number of items inside the stream. */
         s->length = rdbLoadLen(rdb,NULL);
 
@@ -1789,26 +2833,32 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 decrRefCount(o);
                 return NULL;
             }
+            /* Like the listpacks master IDs above, PEL IDs were saved in
+             * radix tree iteration order, so the tree can be bulk built. */
+            raxBulk pelbulk;
+            raxBulkStart(&pelbulk,cgroup->pel);
             while(pel_size--) {
                 unsigned char rawid[sizeof(streamID)];
                 if (rioRead(rdb,rawid,sizeof(rawid)) == 0) {
                     rdbReportReadError("Stream PEL ID loading failed.");
+                    raxBulkStop(&pelbulk);
                     decrRefCount(o);
                     return NULL;
                 }
-                streamNACK *nack = streamCreateNACK(NULL);
+                streamNACK *nack = streamCreateNACK(cgroup,NULL);
                 nack->delivery_time = rdbLoadMillisecondTime(rdb,RDB_VERSION);
                 nack->delivery_count = rdbLoadLen(rdb,NULL);
                 if (rioGetReadError(rdb)) {
                     rdbReportReadError("Stream PEL NACK loading failed.");
+                    raxBulkStop(&pelbulk);
                     decrRefCount(o);
-                    streamFreeNACK(nack);
                     return NULL;
                 }
-                if (!raxInsert(cgroup->pel,rawid,sizeof(rawid),nack,NULL))
+                if (!raxBulkInsert(&pelbulk,rawid,sizeof(rawid),nack,NULL))
                     rdbExitReportCorruptRDB("Duplicated gobal PEL entry "
                                             "loading stream consumer group");
             }
+            raxBulkStop(&pelbulk);
 
             /* Now that we loaded our global PEL, we need to load the
              * consumers and their local PELs. */
@@ -1845,11 +2895,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     decrRefCount(o);
                     return NULL;
                 }
+                raxBulk cpelbulk;
+                raxBulkStart(&cpelbulk,consumer->pel);
                 while(pel_size--) {
                     unsigned char rawid[sizeof(streamID)];
                     if (rioRead(rdb,rawid,sizeof(rawid)) == 0) {
                         rdbReportReadError(
                             "Stream short read reading PEL streamID.");
+                        raxBulkStop(&cpelbulk);
                         decrRefCount(o);
                         return NULL;
                     }
@@ -1862,11 +2915,12 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                      * loading the global PEL. Then set the same shared
                      * NACK structure also in the consumer-specific PEL. */
                     nack->consumer = consumer;
-                    if (!raxInsert(consumer->pel,rawid,sizeof(rawid),nack,NULL))
+                    if (!raxBulkInsert(&cpelbulk,rawid,sizeof(rawid),nack,NULL))
                         rdbExitReportCorruptRDB("Duplicated consumer PEL entry "
                                                 " loading a stream consumer "
                                                 "group");
                 }
+                raxBulkStop(&cpelbulk);
             }
         }
     } else if (rdbtype == RDB_TYPE_MODULE || rdbtype == RDB_TYPE_MODULE_2) {
@@ -2043,6 +3097,8 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
     long long lru_clock = LRU_CLOCK();
 
+    rdbLoadPoolStart();
+
     while(1) {
         robj *key, *val;
 
@@ -2099,7 +3155,8 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                 goto eoferr;
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
-            dictExpand(db->dict,db_size);
+            for (int i = 0; i < server.db_dict_shards; i++)
+                dictExpand(db->dict[i],db_size/server.db_dict_shards);
             dictExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
@@ -2150,8 +3207,56 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             } else if (!strcasecmp(auxkey->ptr,"aof-preamble")) {
                 long long haspreamble = strtoll(auxval->ptr,NULL,10);
                 if (haspreamble) serverLog(LL_NOTICE,"RDB has an AOF tail");
+            } else if (!strcasecmp(auxkey->ptr,"keyspace-size")) {
+                /* Number of keys in the whole dataset when the file was
+                 * written. With startup-warmup enabled we expand the hash
+                 * tables up front: unlike the per-db RESIZEDB hints this
+                 * is written before the key space and also covers delta
+                 * files, which only list the changed keys. */
+                long long keys = strtoll(auxval->ptr,NULL,10);
+                if (server.startup_warmup && keys > 0) {
+                    for (int i = 0; i < server.db_dict_shards; i++)
+                        dictExpand(db->dict[i],keys/server.db_dict_shards);
+                }
             } else if (!strcasecmp(auxkey->ptr,"redis-bits")) {
                 /* Just ignored. */
+            } else if (!strcasecmp(auxkey->ptr,"snapshot-id")) {
+                /* ID of a full save acting as the base of a delta RDB
+                 * chain. Only meaningful when loading the on disk dataset
+                 * at startup. */
+                if (!(rdbflags & (RDBFLAGS_REPLICATION|
+                                  RDBFLAGS_AOF_PREAMBLE|
+                                  RDBFLAGS_DELTA)) &&
+                    sdslen(auxval->ptr) == CONFIG_RUN_ID_SIZE)
+                {
+                    memcpy(server.rdb_base_id,auxval->ptr,
+                           CONFIG_RUN_ID_SIZE+1);
+                    if (server.rdb_incremental) server.rdb_base_valid = 1;
+                }
+            } else if (!strcasecmp(auxkey->ptr,"delta-of")) {
+                /* Base snapshot a delta RDB file chains to: written before
+                 * any key, so a mismatch can stop the load before the
+                 * dataset is touched. */
+                if ((rdbflags & RDBFLAGS_DELTA) &&
+                    strcmp(auxval->ptr,server.rdb_base_id))
+                {
+                    serverLog(LL_WARNING,
+                        "Delta RDB file references a different base "
+                        "snapshot");
+                    decrRefCount(auxkey);
+                    decrRefCount(auxval);
+                    goto deltaerr;
+                }
+            } else if (!strcasecmp(auxkey->ptr,"delta-seq")) {
+                if ((rdbflags & RDBFLAGS_DELTA) && rdb_delta_expect_seq &&
+                    atoi(auxval->ptr) != rdb_delta_expect_seq)
+                {
+                    serverLog(LL_WARNING,
+                        "Delta RDB file is out of sequence");
+                    decrRefCount(auxkey);
+                    decrRefCount(auxval);
+                    goto deltaerr;
+                }
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -2213,26 +3318,88 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                 decrRefCount(aux);
                 continue; /* Read next opcode. */
             }
+        } else if (type == RDB_OPCODE_DELTA_DEL) {
+            /* A key deleted since the base snapshot: only found in delta
+             * RDB files, where it removes the version of the key loaded
+             * from the base (or from a previous delta). */
+            if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+            dbDelete(db,key);
+            decrRefCount(key);
+            continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_MMAP_VALUE) {
+            /* A key-value pair with a fixed-width header, written when
+             * rdb-mmap-format is enabled: 8 bytes of little endian payload
+             * length, the RDB type byte, the key, the payload. When the
+             * file is memory mapped we keep a reference to the payload and
+             * defer the deserialization to the first access of the key. */
+            uint64_t plen;
+            unsigned char ptypebyte;
+            int ptype;
+
+            if (rioRead(rdb,&plen,8) == 0) goto eoferr;
+            memrev64ifbe(&plen);
+            if (rioRead(rdb,&ptypebyte,1) == 0) goto eoferr;
+            ptype = ptypebyte;
+            if (!rdbIsObjectType(ptype))
+                rdbExitReportCorruptRDB("Invalid object type in mmap value");
+            if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+
+            off_t payload_off = rioTell(rdb);
+            if (rdb_mmap_current && rdbTypeToObjectType(ptype) != -1 &&
+                (uint64_t)payload_off+plen <= rdb_mmap_current->size)
+            {
+                val = rdbCreateLazyValue(ptype,payload_off,plen);
+                /* Skip the payload bytes reading through the rio anyway, so
+                 * that the checksum and the loading progress keep working. */
+                char discard[4096];
+                uint64_t left = plen;
+                while (left > 0) {
+                    size_t chunk = left > sizeof(discard) ?
+                                   sizeof(discard) : left;
+                    if (rioRead(rdb,discard,chunk) == 0) {
+                        decrRefCount(key);
+                        decrRefCount(val);
+                        goto eoferr;
+                    }
+                    left -= chunk;
+                }
+            } else {
+                /* The file could not be mapped, or the payload is of a type
+                 * we can't defer: load the value eagerly as usual. */
+                if ((val = rdbLoadObject(ptype,rdb,key,0)) == NULL) {
+                    decrRefCount(key);
+                    goto eoferr;
+                }
+            }
+            goto keyloaded;
         }
 
         /* Read key */
         if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
         /* Read value */
-        if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
+        if ((val = rdbLoadObject(type,rdb,key,0)) == NULL) {
             decrRefCount(key);
             goto eoferr;
         }
 
+keyloaded:
         /* Check if the key already expired. This function is used when loading
          * an RDB file from disk, either at startup, or when an RDB was
          * received from the master. In the latter case, the master is
          * responsible for key expiry. If we would expire keys here, the
          * snapshot taken by the master may not be reflected on the slave. */
         if (server.masterhost == NULL && !(rdbflags&RDBFLAGS_AOF_PREAMBLE) && expiretime != -1 && expiretime < now) {
+            /* The value payload may still be decompressing in the
+             * background: wait for it before freeing the object. */
+            rdbLoadPoolBarrier();
+            if (rdbflags & RDBFLAGS_DELTA) dbDelete(db,key);
             decrRefCount(key);
             decrRefCount(val);
         } else {
-            /* Add the new object in the hash table */
+            /* Add the new object in the hash table. In a delta file the
+             * key may exist already, loaded from the base snapshot or
+             * from a previous delta: this version replaces it. */
+            if (rdbflags & RDBFLAGS_DELTA) dbDelete(db,key);
             dbAdd(db,key,val);
 
             /* Set the expire time if needed */
@@ -2254,6 +3421,10 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         lfu_freq = -1;
         lru_idle = -1;
     }
+    /* Wait for (and check) the payloads deferred to the load pool before
+     * the loaded dataset is considered ready. */
+    rdbLoadPoolStop();
+
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
         uint64_t cksum, expected = rdb->cksum;
@@ -2269,6 +3440,16 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             }
         }
     }
+
+    /* With startup-warmup enabled, touch every page of the file mapping
+     * backing lazy values, so that first-access materializations don't
+     * stall on disk reads once traffic is back. */
+    if (server.startup_warmup && rdb_mmap_current) {
+        volatile unsigned char sink = 0;
+        for (size_t off = 0; off < rdb_mmap_current->size; off += 4096)
+            sink += rdb_mmap_current->data[off];
+        UNUSED(sink);
+    }
     return C_OK;
 
     /* Unexpected end of file is handled here calling rdbReportReadError():
@@ -2276,10 +3457,19 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
      * the RDB file from a socket during initial SYNC (diskless replica mode),
      * we'll report the error to the caller, so that we can retry. */
 eoferr:
+    rdbLoadPoolStop();
     serverLog(LL_WARNING,
         "Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbReportReadError("Unexpected EOF reading RDB file");
     return C_ERR;
+
+deltaerr:
+    /* A delta RDB file that does not belong to the loaded chain: stop
+     * before applying any of its keys. The AUX fields checked above are
+     * written before the key space, so the dataset is still consistent. */
+    rdbLoadPoolStop();
+    errno = EINVAL;
+    return C_ERR;
 }
 
 /* Like rdbLoadRio() but takes a filename instead of a rio stream. The
@@ -2297,7 +3487,9 @@ int rdbLoad(char *filename, rdbSaveInfo *rsi, int rdbflags) {
     if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
     startLoadingFile(fp, filename,rdbflags);
     rioInitWithFile(&rdb,fp);
+    rdbMmapLoadBegin(fp);
     retval = rdbLoadRio(&rdb,rdbflags,rsi);
+    rdbMmapLoadEnd();
     fclose(fp);
     stopLoading(retval==C_OK);
     return retval;
@@ -2312,6 +3504,7 @@ void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
         server.dirty = server.dirty - server.dirty_before_bgsave;
         server.lastsave = time(NULL);
         server.lastbgsave_status = C_OK;
+        rdbDeltaBaseSaved();
     } else if (!bysignal && exitcode != 0) {
         serverLog(LL_WARNING, "Background saving error");
         server.lastbgsave_status = C_ERR;
@@ -2410,7 +3603,6 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
      * the RDB to, which are i WAIT_BGSAVE_START state. */
     server.rdb_pipe_conns = zmalloc(sizeof(connection *)*listLength(server.slaves));
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
     listRewind(server.slaves,&li);
     while((ln = listNext(&li))) {
         client *slave = ln->value;
@@ -2430,6 +3622,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
         rioInitWithFd(&rdb,server.rdb_pipe_write);
 
         redisSetProcTitle("redis-rdb-to-slaves");
+        redisSetCpuAffinity(server.bgsave_cpulist);
 
         retval = rdbSaveRioWithEOFMark(&rdb,NULL,rsi);
         if (retval == C_OK && rioFlush(&rdb) == 0)
@@ -2463,7 +3656,6 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             zfree(server.rdb_pipe_conns);
             server.rdb_pipe_conns = NULL;
             server.rdb_pipe_numconns = 0;
-            server.rdb_pipe_numconns_writing = 0;
             closeChildInfoPipe();
         } else {
             serverLog(LL_NOTICE,"Background RDB transfer started by pid %d",
@@ -2481,11 +3673,42 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     return C_OK; /* Unreached. */
 }
 
+/* SAVE [DELTA] */
 void saveCommand(client *c) {
+    int delta = 0;
+
+    /* The DELTA option saves only the keys changed since the last
+     * snapshot into a delta RDB file, instead of rewriting the whole
+     * dataset. It requires rdb-incremental to be enabled. */
+    if (c->argc > 1) {
+        if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"delta")) {
+            delta = 1;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
     if (server.rdb_child_pid != -1) {
         addReplyError(c,"Background save already in progress");
         return;
     }
+
+    if (delta) {
+        if (!server.rdb_incremental) {
+            addReplyError(c,"SAVE DELTA requires the rdb-incremental "
+                            "option to be enabled");
+        } else if (!server.rdb_base_valid) {
+            addReplyError(c,"No base snapshot to chain the delta to. "
+                            "Take a full snapshot first with SAVE or BGSAVE");
+        } else if (rdbSaveDelta() == C_OK) {
+            addReply(c,shared.ok);
+        } else {
+            addReply(c,shared.err);
+        }
+        return;
+    }
+
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
     if (rdbSave(server.rdb_filename,rsiptr) == C_OK) {
@@ -38,7 +38,7 @@
 
 /* The current RDB version. When the format changes in a way that is no longer
  * backward compatible this number gets incremented. */
-#define RDB_VERSION 9
+#define RDB_VERSION 10
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -68,6 +68,9 @@
 #define RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define RDB_ENC_CODEC 4       /* string compressed with an explicit codec:
+                                 the COMPRESS_CODEC_* identifier is stored
+                                 as a length before the compressed data. */
 
 /* Map object types to RDB object types. Macros starting with OBJ_ are for
  * memory storage and may change. Instead RDB types must be fixed because
@@ -91,12 +94,18 @@
 #define RDB_TYPE_HASH_ZIPLIST  13
 #define RDB_TYPE_LIST_QUICKLIST 14
 #define RDB_TYPE_STREAM_LISTPACKS 15
+#define RDB_TYPE_HASH_LISTPACK 16
+#define RDB_TYPE_ZSET_LISTPACK 17
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 17))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
+#define RDB_OPCODE_DELTA_DEL  245   /* Key deleted since the base snapshot,
+                                       only found in delta RDB files. */
+#define RDB_OPCODE_MMAP_VALUE 246   /* Value with a fixed-width header, for
+                                       memory mapped lazy loading. */
 #define RDB_OPCODE_MODULE_AUX 247   /* Module auxiliary data. */
 #define RDB_OPCODE_IDLE       248   /* LRU idle time. */
 #define RDB_OPCODE_FREQ       249   /* LFU frequency. */
@@ -120,11 +129,15 @@
 #define RDB_LOAD_ENC    (1<<0)
 #define RDB_LOAD_PLAIN  (1<<1)
 #define RDB_LOAD_SDS    (1<<2)
+#define RDB_LOAD_ASYNC  (1<<3)   /* Compressed payloads may be decompressed
+                                    in the background by the load pool. */
 
 /* flags on the purpose of rdb save or load */
 #define RDBFLAGS_NONE 0
 #define RDBFLAGS_AOF_PREAMBLE (1<<0)
 #define RDBFLAGS_REPLICATION (1<<1)
+#define RDBFLAGS_DELTA (1<<2)       /* Loading a delta RDB file: keys may
+                                       already exist and are overwritten. */
 
 int rdbSaveType(rio *rdb, unsigned char type);
 int rdbLoadType(rio *rdb);
@@ -144,9 +157,9 @@ void rdbRemoveTempFile(pid_t childpid);
 int rdbSave(char *filename, rdbSaveInfo *rsi);
 ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key);
 size_t rdbSavedObjectLen(robj *o);
-robj *rdbLoadObject(int type, rio *rdb, robj *key);
+robj *rdbLoadObject(int type, rio *rdb, robj *key, int validate);
 void backgroundSaveDoneHandler(int exitcode, int bysignal);
-int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime);
+int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime, int rdbflags);
 ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt);
 robj *rdbLoadStringObject(rio *rdb);
 ssize_t rdbSaveStringObject(rio *rdb, robj *obj);
@@ -159,5 +172,20 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val);
 int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi);
 int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi);
 rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi);
+robj *rdbLazyValueMaterialize(redisDb *db, robj *key, dictEntry *de);
+void rdbLoadPoolStart(void);
+void rdbLoadPoolStop(void);
+void rdbLoadPoolBarrier(void);
+int rdbLoadPoolActive(void);
+robj *rdbLazyValueLoad(robj *key, robj *o);
+void rdbLazyValueFree(robj *o);
+int rdbLazyValuesPresent(void);
+size_t rdbLazyValueMemUsage(robj *o);
+int rdbSaveDelta(void);
+void rdbLoadDeltaChain(void);
+void rdbDeltaTrackKey(redisDb *db, robj *key);
+void rdbDeltaBaseStarted(void);
+void rdbDeltaBaseSaved(void);
+void rdbDeltaInvalidate(void);
 
 #endif
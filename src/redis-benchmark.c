@@ -57,6 +57,14 @@
 #define MAX_THREADS 500
 #define CLUSTER_SLOTS 16384
 
+/* Key access distributions for the __rand_int__ substitution. */
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+#define DIST_HOTSPOT 2
+#define ZIPF_DEFAULT_THETA 0.99
+#define HOTSPOT_DEFAULT_KEYS 0.1
+#define HOTSPOT_DEFAULT_OPS 0.9
+
 #define CLIENT_GET_EVENTLOOP(c) \
     (c->thread_id >= 0 ? config.threads[c->thread_id]->el : config.el)
 
@@ -64,6 +72,37 @@ struct benchmarkThread;
 struct clusterNode;
 struct redisConfig;
 
+/* Command mix. The --mix option runs a single benchmark interleaving
+ * commands from the table below with user supplied weights, attributing
+ * the latency of every reply to the command that produced it. */
+typedef struct mixCommandSpec {
+    const char *name;
+    int has_payload;    /* Non-zero if 'format' takes a %b value argument. */
+    const char *format;
+} mixCommandSpec;
+
+static const mixCommandSpec mix_commands[] = {
+    {"ping", 0, "PING"},
+    {"get", 0, "GET key:{tag}:__rand_int__"},
+    {"set", 1, "SET key:{tag}:__rand_int__ %b"},
+    {"del", 0, "DEL key:{tag}:__rand_int__"},
+    {"incr", 0, "INCR counter:{tag}:__rand_int__"},
+    {"lpush", 1, "LPUSH mylist:{tag} %b"},
+    {"rpush", 1, "RPUSH mylist:{tag} %b"},
+    {"lpop", 0, "LPOP mylist:{tag}"},
+    {"rpop", 0, "RPOP mylist:{tag}"},
+    {"sadd", 0, "SADD myset:{tag} element:__rand_int__"},
+    {"spop", 0, "SPOP myset:{tag}"},
+    {"hset", 1, "HSET myhash:{tag}:__rand_int__ element:__rand_int__ %b"},
+    {NULL, 0, NULL}
+};
+
+typedef struct mixEntry {
+    int cmd;            /* Index into mix_commands[]. */
+    double weight;
+    double cumulative;  /* Normalized upper bound used when sampling. */
+} mixEntry;
+
 static struct config {
     aeEventLoop *el;
     const char *hostip;
@@ -105,6 +144,24 @@ static struct config {
     int is_updating_slots;
     int slots_last_update;
     int enable_tracking;
+    int dist;                   /* Key distribution (DIST_* defines). */
+    double zipf_theta;
+    double zipf_zetan;          /* Precomputed zipfian sampling constants. */
+    double zipf_eta;
+    double zipf_alpha;
+    double zipf_halfpow;
+    double hotspot_keys;        /* Fraction of the keyspace that is hot. */
+    double hotspot_ops;         /* Fraction of requests hitting the hot set. */
+    mixEntry *mix;              /* Command mix, NULL to run regular tests. */
+    int mix_count;
+    const char *replay_file;    /* Trace to replay, NULL when not replaying. */
+    const char *replay_save;    /* Save the latency summary here. */
+    const char *replay_compare; /* Compare against this saved summary. */
+    double replay_threshold;    /* Tolerated percentile degradation (pct). */
+    double replay_speed;        /* Trace time scale, 0 to disable pacing. */
+    unsigned char *latency_tag; /* Mix entry of every sample in 'latency'. */
+    int datasize_min;           /* Value size range for mixed writes, */
+    int datasize_max;           /* zero when a fixed -d size is used.  */
     /* Thread mutexes to be used as fallbacks by atomicvar.h */
     pthread_mutex_t requests_issued_mutex;
     pthread_mutex_t requests_finished_mutex;
@@ -132,6 +189,8 @@ typedef struct _client {
                                such as auth and select are prefixed to the pipeline of
                                benchmark commands and discarded after the first send. */
     int prefixlen;          /* Size in bytes of the pending prefix commands */
+    unsigned char *cmdtags; /* Mix entry of every command in the pipeline
+                               (only used when a command mix is active). */
     int thread_id;
     struct clusterNode *cluster_node;
     int slots_last_update;
@@ -185,6 +244,7 @@ static redisConfig *getRedisConfig(const char *ip, int port,
 static void freeRedisConfig(redisConfig *cfg);
 static int fetchClusterSlotsConfiguration(client c);
 static void updateClusterSlotsConfiguration();
+static void mixResampleClient(client c);
 int showThroughput(struct aeEventLoop *eventLoop, long long id,
                    void *clientData);
 
@@ -324,6 +384,7 @@ static void freeClient(client c) {
     sdsfree(c->obuf);
     zfree(c->randptr);
     zfree(c->stagptr);
+    zfree(c->cmdtags);
     zfree(c);
     if (config.num_threads) pthread_mutex_lock(&(config.liveclients_mutex));
     config.liveclients--;
@@ -350,6 +411,65 @@ static void resetClient(client c) {
     aeCreateFileEvent(el,c->context->fd,AE_WRITABLE,writeHandler,c);
     c->written = 0;
     c->pending = config.pipeline;
+    /* With few pipeline slots per client a fixed buffer would freeze the
+     * commands sampled at creation time, skewing the requested mix, so a
+     * fresh pipeline is sampled for every batch. */
+    if (config.mix_count) mixResampleClient(c);
+}
+
+/* Precompute the constants needed to sample the selected key distribution.
+ * For the zipfian distribution we use the usual rejection-free method:
+ * the generalized harmonic number of the keyspace is computed once, then
+ * every sample costs a single pow() call. */
+static void initKeyDistribution(void) {
+    long long i, n = config.randomkeys_keyspacelen;
+
+    if (config.dist == DIST_UNIFORM) return;
+    if (n <= 0) {
+        fprintf(stderr,
+            "--dist requires a keyspace, use it together with -r\n");
+        exit(1);
+    }
+    if (config.dist == DIST_ZIPF) {
+        double theta = config.zipf_theta, zetan = 0;
+        for (i = 1; i <= n; i++) zetan += 1.0/pow((double)i,theta);
+        config.zipf_zetan = zetan;
+        config.zipf_halfpow = pow(0.5,theta);
+        config.zipf_alpha = 1.0/(1.0-theta);
+        config.zipf_eta = (1.0-pow(2.0/(double)n,1.0-theta)) /
+                          (1.0-(1.0+config.zipf_halfpow)/zetan);
+    }
+}
+
+/* Return a key index in [0,keyspacelen) according to the configured
+ * distribution. With the zipfian distribution index 0 is the most popular
+ * key; with the hotspot distribution the hot subset is the first
+ * 'hotspot_keys' fraction of the keyspace. */
+static size_t distKeySample(void) {
+    size_t n = config.randomkeys_keyspacelen;
+
+    switch (config.dist) {
+    case DIST_ZIPF: {
+        double u = (double)random()/((double)RAND_MAX+1);
+        double uz = u*config.zipf_zetan;
+        size_t r;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0+config.zipf_halfpow) return 1;
+        r = (size_t)((double)n *
+            pow(config.zipf_eta*u - config.zipf_eta + 1.0, config.zipf_alpha));
+        return r >= n ? n-1 : r;
+    }
+    case DIST_HOTSPOT: {
+        size_t hot = (size_t)((double)n*config.hotspot_keys);
+        if (hot < 1) hot = 1;
+        if (hot >= n) return random() % n;
+        if ((double)random()/((double)RAND_MAX+1) < config.hotspot_ops)
+            return random() % hot;
+        return hot + random() % (n-hot);
+    }
+    default:
+        return random() % n;
+    }
 }
 
 static void randomizeClientKey(client c) {
@@ -359,7 +479,7 @@ static void randomizeClientKey(client c) {
         char *p = c->randptr[i]+11;
         size_t r = 0;
         if (config.randomkeys_keyspacelen != 0)
-            r = random() % config.randomkeys_keyspacelen;
+            r = distKeySample();
         size_t j;
 
         for (j = 0; j < 12; j++) {
@@ -396,6 +516,164 @@ static void setClusterKeyHashTag(client c) {
     }
 }
 
+/* Shared value payload for mixed writes. Sized for the largest possible
+ * value so that commands of any sampled size can point into it. */
+static char *mix_payload = NULL;
+
+static int mixLookupCommand(const char *name) {
+    int j;
+    for (j = 0; mix_commands[j].name != NULL; j++)
+        if (!strcasecmp(name,mix_commands[j].name)) return j;
+    return -1;
+}
+
+/* Parse a command mix specification in the form "get:0.7,set:0.25,del:0.05".
+ * Weights are relative and do not need to sum to one; a missing weight
+ * defaults to 1. Exits with an error message on a malformed spec. */
+static void parseMixSpec(const char *spec) {
+    int count = 0, j;
+    double total = 0, running = 0;
+    sds *parts = sdssplitlen(spec,strlen(spec),",",1,&count);
+
+    if (parts == NULL || count == 0) {
+        fprintf(stderr, "Invalid --mix specification '%s'\n", spec);
+        exit(1);
+    }
+    config.mix = zmalloc(sizeof(mixEntry)*count);
+    config.mix_count = count;
+    for (j = 0; j < count; j++) {
+        char *sep = strchr(parts[j],':');
+        double weight = 1;
+        if (sep) {
+            *sep = '\0';
+            weight = atof(sep+1);
+        }
+        config.mix[j].cmd = mixLookupCommand(parts[j]);
+        if (config.mix[j].cmd < 0 || weight <= 0) {
+            fprintf(stderr, "Invalid --mix entry '%s'%s\n", parts[j],
+                config.mix[j].cmd < 0 ? " (unknown command)" : "");
+            exit(1);
+        }
+        config.mix[j].weight = weight;
+        total += weight;
+    }
+    for (j = 0; j < count; j++) {
+        running += config.mix[j].weight;
+        config.mix[j].cumulative = running/total;
+    }
+    sdsfreesplitres(parts,count);
+}
+
+/* Parse the --dist argument: "uniform", "zipf[:<theta>]" or
+ * "hotspot[:<keys>:<ops>]". Returns non-zero on a malformed spec. */
+static int parseDistSpec(const char *spec) {
+    if (!strcmp(spec,"uniform")) {
+        config.dist = DIST_UNIFORM;
+    } else if (!strncmp(spec,"zipf",4)) {
+        config.dist = DIST_ZIPF;
+        config.zipf_theta = ZIPF_DEFAULT_THETA;
+        if (spec[4] == ':') config.zipf_theta = atof(spec+5);
+        else if (spec[4] != '\0') return 1;
+        if (config.zipf_theta <= 0 || config.zipf_theta >= 1) return 1;
+    } else if (!strncmp(spec,"hotspot",7)) {
+        config.dist = DIST_HOTSPOT;
+        config.hotspot_keys = HOTSPOT_DEFAULT_KEYS;
+        config.hotspot_ops = HOTSPOT_DEFAULT_OPS;
+        if (spec[7] == ':') {
+            if (sscanf(spec+8,"%lf:%lf",
+                &config.hotspot_keys,&config.hotspot_ops) != 2) return 1;
+        } else if (spec[7] != '\0') return 1;
+        if (config.hotspot_keys <= 0 || config.hotspot_keys >= 1 ||
+            config.hotspot_ops <= 0 || config.hotspot_ops > 1) return 1;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+static int mixSampleEntry(void) {
+    double u = (double)random()/((double)RAND_MAX+1);
+    int j;
+    for (j = 0; j < config.mix_count-1; j++)
+        if (u < config.mix[j].cumulative) break;
+    return j;
+}
+
+static int sampleDataSize(void) {
+    if (config.datasize_max > 0)
+        return config.datasize_min +
+               random() % (config.datasize_max-config.datasize_min+1);
+    return config.datasize;
+}
+
+static int mixFormatCommand(int entry, char **cmd) {
+    const mixCommandSpec *spec = &mix_commands[config.mix[entry].cmd];
+    if (spec->has_payload)
+        return redisFormatCommand(cmd, spec->format, mix_payload,
+                                  (size_t)sampleDataSize());
+    return redisFormatCommand(cmd, spec->format);
+}
+
+/* Locate the __rand_int__ placeholders in the client output buffer,
+ * replacing any previously collected pointers. */
+static void scanClientRandPtrs(client c) {
+    char *p = c->obuf;
+
+    zfree(c->randptr);
+    c->randlen = 0;
+    c->randfree = RANDPTR_INITIAL_SIZE;
+    c->randptr = zmalloc(sizeof(char*)*c->randfree);
+    while ((p = strstr(p,"__rand_int__")) != NULL) {
+        if (c->randfree == 0) {
+            c->randptr = zrealloc(c->randptr,sizeof(char*)*c->randlen*2);
+            c->randfree += c->randlen;
+        }
+        c->randptr[c->randlen++] = p;
+        c->randfree--;
+        p += 12; /* 12 is strlen("__rand_int__). */
+    }
+}
+
+/* Same as the above for the {tag} slot hashtags (cluster mode only). */
+static void scanClientStagPtrs(client c) {
+    char *p = c->obuf;
+
+    zfree(c->stagptr);
+    c->staglen = 0;
+    c->stagfree = RANDPTR_INITIAL_SIZE;
+    c->stagptr = zmalloc(sizeof(char*)*c->stagfree);
+    while ((p = strstr(p,"{tag}")) != NULL) {
+        if (c->stagfree == 0) {
+            c->stagptr = zrealloc(c->stagptr,
+                                  sizeof(char*) * c->staglen*2);
+            c->stagfree += c->staglen;
+        }
+        c->stagptr[c->staglen++] = p;
+        c->stagfree--;
+        p += 5; /* 5 is strlen("{tag}"). */
+    }
+}
+
+/* Fill the client pipeline with freshly sampled commands from the mix.
+ * Only called once the prefix commands have been discarded, so the whole
+ * buffer can be rewritten. Command lengths differ between samples, so the
+ * placeholder pointers are relocated by scanning the new buffer. */
+static void mixResampleClient(client c) {
+    int j;
+
+    sdsclear(c->obuf);
+    for (j = 0; j < config.pipeline; j++) {
+        char *mixcmd;
+        int entry = mixSampleEntry();
+        int mixlen = mixFormatCommand(entry,&mixcmd);
+        c->cmdtags[j] = entry;
+        c->obuf = sdscatlen(c->obuf,mixcmd,mixlen);
+        free(mixcmd);
+    }
+    if (config.randomkeys) scanClientRandPtrs(c);
+    if (config.cluster_mode) scanClientStagPtrs(c);
+}
+
 static void clientDone(client c) {
     int requests_finished = 0;
     atomicGet(config.requests_finished, requests_finished);
@@ -503,8 +781,18 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                 }
                 int requests_finished = 0;
                 atomicGetIncr(config.requests_finished, requests_finished, 1);
-                if (requests_finished < config.requests)
+                if (requests_finished < config.requests) {
                     config.latency[requests_finished] = c->latency;
+                    if (config.latency_tag && c->cmdtags) {
+                        /* By the time data replies are consumed the prefix
+                         * replies are gone, so 'pending' counts the pipeline
+                         * slots still to be read, current one included. */
+                        int slot = config.pipeline - c->pending;
+                        if (slot < 0) slot = 0;
+                        config.latency_tag[requests_finished] =
+                            c->cmdtags[slot];
+                    }
+                }
                 c->pending--;
                 if (c->pending == 0) {
                     clientDone(c);
@@ -652,8 +940,24 @@ static client createClient(char *cmd, size_t len, client from, int thread_id) {
         c->prefix_pending++;
     }
     c->prefixlen = sdslen(c->obuf);
+    c->cmdtags = NULL;
     /* Append the request itself. */
-    if (from) {
+    if (config.mix_count) {
+        /* When a command mix is active every client samples its own
+         * pipeline, so that the requested proportions hold across the whole
+         * workload instead of replicating a single template. Remember which
+         * mix entry filled every slot so that the reply latencies can be
+         * attributed to the right command. */
+        c->cmdtags = zmalloc(config.pipeline);
+        for (j = 0; j < config.pipeline; j++) {
+            char *mixcmd;
+            int entry = mixSampleEntry();
+            int mixlen = mixFormatCommand(entry,&mixcmd);
+            c->cmdtags[j] = entry;
+            c->obuf = sdscatlen(c->obuf,mixcmd,mixlen);
+            free(mixcmd);
+        }
+    } else if (from) {
         c->obuf = sdscatlen(c->obuf,
             from->obuf+from->prefixlen,
             sdslen(from->obuf)-from->prefixlen);
@@ -669,9 +973,11 @@ static client createClient(char *cmd, size_t len, client from, int thread_id) {
     c->stagptr = NULL;
     c->staglen = 0;
 
-    /* Find substrings in the output buffer that need to be randomized. */
+    /* Find substrings in the output buffer that need to be randomized.
+     * Mixed pipelines are sampled per client, so their placeholders are
+     * always located by scanning even when cloning another client. */
     if (config.randomkeys) {
-        if (from) {
+        if (from && !config.mix_count) {
             c->randlen = from->randlen;
             c->randfree = 0;
             c->randptr = zmalloc(sizeof(char*)*c->randlen);
@@ -682,25 +988,12 @@ static client createClient(char *cmd, size_t len, client from, int thread_id) {
                 c->randptr[j] += c->prefixlen - from->prefixlen;
             }
         } else {
-            char *p = c->obuf;
-
-            c->randlen = 0;
-            c->randfree = RANDPTR_INITIAL_SIZE;
-            c->randptr = zmalloc(sizeof(char*)*c->randfree);
-            while ((p = strstr(p,"__rand_int__")) != NULL) {
-                if (c->randfree == 0) {
-                    c->randptr = zrealloc(c->randptr,sizeof(char*)*c->randlen*2);
-                    c->randfree += c->randlen;
-                }
-                c->randptr[c->randlen++] = p;
-                c->randfree--;
-                p += 12; /* 12 is strlen("__rand_int__). */
-            }
+            scanClientRandPtrs(c);
         }
     }
     /* If cluster mode is enabled, set slot hashtags pointers. */
     if (config.cluster_mode) {
-        if (from) {
+        if (from && !config.mix_count) {
             c->staglen = from->staglen;
             c->stagfree = 0;
             c->stagptr = zmalloc(sizeof(char*)*c->staglen);
@@ -711,21 +1004,7 @@ static client createClient(char *cmd, size_t len, client from, int thread_id) {
                 c->stagptr[j] += c->prefixlen - from->prefixlen;
             }
         } else {
-            char *p = c->obuf;
-
-            c->staglen = 0;
-            c->stagfree = RANDPTR_INITIAL_SIZE;
-            c->stagptr = zmalloc(sizeof(char*)*c->stagfree);
-            while ((p = strstr(p,"{tag}")) != NULL) {
-                if (c->stagfree == 0) {
-                    c->stagptr = zrealloc(c->stagptr,
-                                          sizeof(char*) * c->staglen*2);
-                    c->stagfree += c->staglen;
-                }
-                c->stagptr[c->staglen++] = p;
-                c->stagfree--;
-                p += 5; /* 12 is strlen("{tag}"). */
-            }
+            scanClientStagPtrs(c);
         }
     }
     aeEventLoop *el = NULL;
@@ -772,6 +1051,53 @@ static int ipow(int base, int exp) {
     return result;
 }
 
+static long long latencyPercentile(long long *lat, int count, double p) {
+    int idx = (int)(p/100.0*count);
+    if (idx >= count) idx = count-1;
+    return lat[idx];
+}
+
+/* Print per-command latency percentiles when a command mix is being
+ * benchmarked. Must run before showLatencyReport() sorts the latency
+ * array, because the per-sample command tags are positional. */
+static void showMixLatencyReport(void) {
+    int i, e;
+    int samples = config.requests_finished < config.requests ?
+                  config.requests_finished : config.requests;
+    long long *lat;
+
+    if (!config.mix_count || !config.latency_tag || samples == 0) return;
+    lat = zmalloc(sizeof(long long)*samples);
+    for (e = 0; e < config.mix_count; e++) {
+        const char *name = mix_commands[config.mix[e].cmd].name;
+        int count = 0;
+        long long p50, p95, p99, p999, max;
+
+        for (i = 0; i < samples; i++)
+            if (config.latency_tag[i] == e) lat[count++] = config.latency[i];
+        if (count == 0) continue;
+        qsort(lat,count,sizeof(long long),compareLatency);
+        p50 = latencyPercentile(lat,count,50);
+        p95 = latencyPercentile(lat,count,95);
+        p99 = latencyPercentile(lat,count,99);
+        p999 = latencyPercentile(lat,count,99.9);
+        max = lat[count-1];
+        if (config.csv) {
+            printf("\"%s:%s\",\"%d\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\","
+                   "\"%.3f\"\n",
+                config.title, name, count, p50/1000.0, p95/1000.0,
+                p99/1000.0, p999/1000.0, max/1000.0);
+        } else {
+            printf("  %-8s %8d requests (%5.1f%%) p50=%.3f p95=%.3f "
+                   "p99=%.3f p99.9=%.3f max=%.3f msec\n",
+                name, count, count*100.0/samples, p50/1000.0, p95/1000.0,
+                p99/1000.0, p999/1000.0, max/1000.0);
+        }
+    }
+    if (!config.csv) printf("\n");
+    zfree(lat);
+}
+
 static void showLatencyReport(void) {
     int i, curlat = 0;
     int usbetweenlat = ipow(10, MAX_LATENCY_PRECISION-config.precision);
@@ -812,6 +1138,7 @@ static void showLatencyReport(void) {
 
         printf("\n");
 
+        showMixLatencyReport();
         qsort(config.latency,config.requests,sizeof(long long),compareLatency);
         for (i = 0; i < config.requests; i++) {
             if (config.latency[i]/usbetweenlat != curlat ||
@@ -834,8 +1161,10 @@ static void showLatencyReport(void) {
         printf("%.2f requests per second\n\n", reqpersec);
     } else if (config.csv) {
         printf("\"%s\",\"%.2f\"\n", config.title, reqpersec);
+        showMixLatencyReport();
     } else {
         printf("%s: %.2f requests per second\n", config.title, reqpersec);
+        showMixLatencyReport();
     }
 }
 
@@ -1269,6 +1598,435 @@ static void updateClusterSlotsConfiguration() {
     pthread_mutex_unlock(&config.is_updating_slots_mutex);
 }
 
+/* Trace replay. The --replay mode replays a recorded command log against
+ * the server instead of running synthetic tests: every line of the trace
+ * carries a microsecond offset from the start of the recording and a client
+ * identifier, every distinct identifier gets its own connection, and
+ * commands are issued when the recorded offset comes due. Commands whose
+ * offsets land closer together than the server round trip time naturally
+ * pile up in the output buffer of their connection, so the concurrency and
+ * pipelining of the original traffic are preserved.
+ *
+ * Latencies are measured from the recorded due time rather than from the
+ * write() call: if the server falls behind, the queueing delay it causes
+ * is charged to the affected commands instead of being silently absorbed
+ * by the replay clock (the usual coordinated omission pitfall).
+ *
+ * The measured distribution can be saved with --replay-save and a later
+ * run against another build can load it with --replay-compare to get a
+ * PASS/FAIL regression verdict, suitable for release gating. */
+
+/* Percentile increases below this many microseconds never fail the
+ * comparison, whatever the relative threshold says: sub tenth of a
+ * millisecond differences are scheduling noise on most setups. */
+#define REPLAY_NOISE_FLOOR_US 50
+
+typedef struct replayOp {
+    long long ts;       /* Microsecond offset from the trace start. */
+    long long start;    /* Time the op came due while replaying. */
+    sds proto;          /* RESP serialized command. */
+} replayOp;
+
+typedef struct replayClient {
+    redisContext *context;
+    sds id;             /* Client identifier from the trace. */
+    replayOp *ops;
+    int numops;
+    int sent;           /* Next op to append to the output buffer. */
+    int acked;          /* Next op waiting for its reply. */
+    int prefix_pending; /* AUTH/SELECT replies still to discard. */
+    sds obuf;
+    size_t written;     /* Bytes of 'obuf' already written. */
+    int write_event;    /* Non-zero if AE_WRITABLE is installed. */
+} replayClient;
+
+static replayClient **replay_clients = NULL;
+static int replay_numclients = 0;
+static int replay_totalops = 0;
+static int replay_errors = 0;
+static long long replay_start = 0;
+static dict *replay_index = NULL; /* client id -> replayClient */
+
+/* Lookup or create the replay client for the given trace identifier.
+ * Takes ownership of 'id'. */
+static replayClient *replayGetClient(sds id) {
+    static dictType dtype = {
+        dictSdsHash,               /* hash function */
+        NULL,                      /* key dup */
+        NULL,                      /* val dup */
+        dictSdsKeyCompare,         /* key compare */
+        NULL,                      /* key destructor */
+        NULL                       /* val destructor */
+    };
+    if (replay_index == NULL) replay_index = dictCreate(&dtype, NULL);
+    dictEntry *entry = dictFind(replay_index, id);
+    if (entry) {
+        sdsfree(id);
+        return dictGetVal(entry);
+    }
+    replayClient *rc = zcalloc(sizeof(*rc));
+    rc->id = id;
+    rc->obuf = sdsempty();
+    assert(dictAdd(replay_index, id, rc) == DICT_OK);
+    replay_clients = zrealloc(replay_clients,
+        sizeof(replayClient*)*(replay_numclients+1));
+    replay_clients[replay_numclients++] = rc;
+    return rc;
+}
+
+/* Load the trace file. Each line is:
+ *
+ *   <usec-offset> <client-id> <command> [args...]
+ *
+ * Arguments are split like redis-cli does, so quoting is available for
+ * payloads containing spaces. Empty lines and lines starting with '#'
+ * are skipped. Exits with an error message on a malformed line. */
+static void replayLoadTrace(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    int linenum = 0;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open trace file '%s': %s\n",
+            path, strerror(errno));
+        exit(1);
+    }
+    while (getline(&line, &cap, fp) != -1) {
+        char *p = line, *end, *idstart;
+        long long ts;
+        sds id, *argv;
+        int j, argc, len;
+        char *cmd;
+
+        linenum++;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '\n' || *p == '#') continue;
+        ts = strtoll(p, &end, 10);
+        if (end == p || ts < 0 || (*end != ' ' && *end != '\t')) goto fmterr;
+        p = end;
+        while (*p == ' ' || *p == '\t') p++;
+        idstart = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n') p++;
+        if (p == idstart || *p == '\0' || *p == '\n') goto fmterr;
+        id = sdsnewlen(idstart, p-idstart);
+        argv = sdssplitargs(p, &argc);
+        if (argv == NULL || argc == 0) {
+            sdsfree(id);
+            if (argv) sdsfreesplitres(argv, argc);
+            goto fmterr;
+        }
+        const char **cargv = zmalloc(sizeof(char*)*argc);
+        size_t *cargvlen = zmalloc(sizeof(size_t)*argc);
+        for (j = 0; j < argc; j++) {
+            cargv[j] = argv[j];
+            cargvlen[j] = sdslen(argv[j]);
+        }
+        len = redisFormatCommandArgv(&cmd, argc, cargv, cargvlen);
+        zfree(cargv);
+        zfree(cargvlen);
+        sdsfreesplitres(argv, argc);
+
+        replayClient *rc = replayGetClient(id);
+        rc->ops = zrealloc(rc->ops, sizeof(replayOp)*(rc->numops+1));
+        rc->ops[rc->numops].ts = ts;
+        rc->ops[rc->numops].start = 0;
+        rc->ops[rc->numops].proto = sdsnewlen(cmd, len);
+        rc->numops++;
+        free(cmd);
+        replay_totalops++;
+    }
+    free(line);
+    fclose(fp);
+    if (replay_totalops == 0) {
+        fprintf(stderr, "Trace file '%s' contains no commands\n", path);
+        exit(1);
+    }
+    return;
+
+fmterr:
+    fprintf(stderr, "Invalid trace line %d in '%s', expecting "
+        "'<usec-offset> <client-id> <command> [args...]'\n", linenum, path);
+    exit(1);
+}
+
+static void replayWriteHandler(aeEventLoop *el, int fd, void *privdata,
+                               int mask)
+{
+    replayClient *rc = privdata;
+    UNUSED(fd);
+    UNUSED(mask);
+
+    if (sdslen(rc->obuf) > rc->written) {
+        void *ptr = rc->obuf+rc->written;
+        ssize_t nwritten = write(rc->context->fd, ptr,
+                                 sdslen(rc->obuf)-rc->written);
+        if (nwritten == -1) {
+            if (errno == EAGAIN) return;
+            fprintf(stderr, "Writing to socket: %s\n", strerror(errno));
+            exit(1);
+        }
+        rc->written += nwritten;
+    }
+    if (sdslen(rc->obuf) == rc->written) {
+        /* Fully flushed: recycle the buffer so it doesn't grow with the
+         * whole trace, and stop polling for writability until the pacing
+         * timer queues more commands. */
+        sdsclear(rc->obuf);
+        rc->written = 0;
+        aeDeleteFileEvent(el, rc->context->fd, AE_WRITABLE);
+        rc->write_event = 0;
+    }
+}
+
+static void replayReadHandler(aeEventLoop *el, int fd, void *privdata,
+                              int mask)
+{
+    replayClient *rc = privdata;
+    void *reply = NULL;
+    UNUSED(fd);
+    UNUSED(mask);
+
+    if (redisBufferRead(rc->context) != REDIS_OK) {
+        fprintf(stderr, "Error: %s\n", rc->context->errstr);
+        exit(1);
+    }
+    while (rc->acked < rc->sent || rc->prefix_pending) {
+        if (redisGetReply(rc->context, &reply) != REDIS_OK) {
+            fprintf(stderr, "Error: %s\n", rc->context->errstr);
+            exit(1);
+        }
+        if (reply == NULL) break;
+        if (rc->prefix_pending > 0) {
+            /* AUTH/SELECT prefix replies are discarded. */
+            rc->prefix_pending--;
+            freeReplyObject(reply);
+            continue;
+        }
+        redisReply *r = reply;
+        if (r->type == REDIS_REPLY_ERROR) {
+            replay_errors++;
+            if (config.showerrors)
+                printf("Error from server: %s\n", r->str);
+        }
+        long long lat = ustime() - rc->ops[rc->acked].start;
+        freeReplyObject(reply);
+        rc->acked++;
+        int requests_finished = 0;
+        atomicGetIncr(config.requests_finished, requests_finished, 1);
+        if (requests_finished < config.requests)
+            config.latency[requests_finished] = lat;
+        if (requests_finished+1 >= config.requests) {
+            aeStop(el);
+            return;
+        }
+    }
+}
+
+/* Pacing timer: appends every op whose recorded offset came due to the
+ * output buffer of its connection, and arms the write event. Runs every
+ * millisecond for the whole replay. */
+static int replayPump(aeEventLoop *el, long long id, void *clientData) {
+    long long elapsed = ustime()-replay_start;
+    int j;
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    for (j = 0; j < replay_numclients; j++) {
+        replayClient *rc = replay_clients[j];
+        while (rc->sent < rc->numops) {
+            replayOp *op = rc->ops+rc->sent;
+            long long due = config.replay_speed > 0 ?
+                (long long)(op->ts/config.replay_speed) : 0;
+            if (due > elapsed) break;
+            op->start = ustime();
+            rc->obuf = sdscatlen(rc->obuf, op->proto, sdslen(op->proto));
+            rc->sent++;
+        }
+        if (sdslen(rc->obuf) > rc->written && !rc->write_event) {
+            aeCreateFileEvent(config.el, rc->context->fd, AE_WRITABLE,
+                              replayWriteHandler, rc);
+            rc->write_event = 1;
+        }
+    }
+    return 1; /* Milliseconds to the next call. */
+}
+
+static void replayConnectClients(void) {
+    int j;
+
+    for (j = 0; j < replay_numclients; j++) {
+        replayClient *rc = replay_clients[j];
+        if (config.hostsocket == NULL)
+            rc->context = redisConnectNonBlock(config.hostip, config.hostport);
+        else
+            rc->context = redisConnectUnixNonBlock(config.hostsocket);
+        if (rc->context->err) {
+            fprintf(stderr, "Could not connect to Redis at ");
+            if (config.hostsocket == NULL)
+                fprintf(stderr, "%s:%d: %s\n", config.hostip, config.hostport,
+                    rc->context->errstr);
+            else
+                fprintf(stderr, "%s: %s\n", config.hostsocket,
+                    rc->context->errstr);
+            exit(1);
+        }
+        /* Suppress hiredis cleanup of unused buffers for max speed. */
+        rc->context->reader->maxbuf = 0;
+        if (config.auth) {
+            char *buf = NULL;
+            int len = redisFormatCommand(&buf, "AUTH %s", config.auth);
+            rc->obuf = sdscatlen(rc->obuf, buf, len);
+            free(buf);
+            rc->prefix_pending++;
+        }
+        if (config.dbnum != 0) {
+            rc->obuf = sdscatprintf(rc->obuf,
+                "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n",
+                (int)sdslen(config.dbnumstr), config.dbnumstr);
+            rc->prefix_pending++;
+        }
+        aeCreateFileEvent(config.el, rc->context->fd, AE_READABLE,
+                          replayReadHandler, rc);
+        if (sdslen(rc->obuf)) {
+            aeCreateFileEvent(config.el, rc->context->fd, AE_WRITABLE,
+                              replayWriteHandler, rc);
+            rc->write_event = 1;
+        }
+        atomicIncr(config.liveclients, 1);
+    }
+}
+
+static void replayFreeClients(void) {
+    int j, i;
+
+    for (j = 0; j < replay_numclients; j++) {
+        replayClient *rc = replay_clients[j];
+        redisFree(rc->context);
+        for (i = 0; i < rc->numops; i++) sdsfree(rc->ops[i].proto);
+        zfree(rc->ops);
+        sdsfree(rc->obuf);
+        sdsfree(rc->id);
+        zfree(rc);
+    }
+    zfree(replay_clients);
+    replay_clients = NULL;
+    replay_numclients = 0;
+    if (replay_index) dictRelease(replay_index);
+    replay_index = NULL;
+}
+
+static void replaySaveSummary(const char *path, int count) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not write summary file '%s': %s\n",
+            path, strerror(errno));
+        exit(1);
+    }
+    fprintf(fp, "count=%d\np50=%lld\np95=%lld\np99=%lld\np99.9=%lld\n"
+        "max=%lld\n",
+        count,
+        latencyPercentile(config.latency, count, 50),
+        latencyPercentile(config.latency, count, 95),
+        latencyPercentile(config.latency, count, 99),
+        latencyPercentile(config.latency, count, 99.9),
+        config.latency[count-1]);
+    fclose(fp);
+    printf("Latency summary saved to '%s'\n", path);
+}
+
+/* Compare the measured distribution against a saved baseline and print
+ * the verdict. Returns zero when the verdict is PASS. */
+static int replayCompareSummary(const char *path, int count) {
+    FILE *fp = fopen(path, "r");
+    int base_count, e, failed = 0;
+    long long base[4], cur[4];
+    static const char *names[4] = { "p50", "p95", "p99", "p99.9" };
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not read summary file '%s': %s\n",
+            path, strerror(errno));
+        exit(1);
+    }
+    if (fscanf(fp, "count=%d p50=%lld p95=%lld p99=%lld p99.9=%lld",
+        &base_count, &base[0], &base[1], &base[2], &base[3]) != 5)
+    {
+        fprintf(stderr, "Malformed summary file '%s'\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    cur[0] = latencyPercentile(config.latency, count, 50);
+    cur[1] = latencyPercentile(config.latency, count, 95);
+    cur[2] = latencyPercentile(config.latency, count, 99);
+    cur[3] = latencyPercentile(config.latency, count, 99.9);
+    printf("Comparing against baseline '%s' (%d samples, "
+        "threshold %.1f%%):\n", path, base_count, config.replay_threshold);
+    for (e = 0; e < 4; e++) {
+        double delta = base[e] ?
+            (cur[e]-base[e])*100.0/base[e] : 0;
+        int regressed = delta > config.replay_threshold &&
+                        cur[e]-base[e] > REPLAY_NOISE_FLOOR_US;
+        printf("  %-5s baseline %.3f msec, current %.3f msec (%+.1f%%)%s\n",
+            names[e], base[e]/1000.0, cur[e]/1000.0, delta,
+            regressed ? " REGRESSION" : "");
+        if (regressed) failed = 1;
+    }
+    printf("REPLAY VERDICT: %s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
+
+static void replayBenchmark(void) {
+    int count, verdict = 0;
+    float dt;
+
+    replayLoadTrace(config.replay_file);
+    config.requests = replay_totalops;
+    config.requests_finished = 0;
+    config.title = "REPLAY";
+    zfree(config.latency);
+    config.latency = zmalloc(sizeof(long long)*config.requests);
+
+    replayConnectClients();
+    aeCreateTimeEvent(config.el, 1, replayPump, NULL, NULL);
+    config.start = mstime();
+    replay_start = ustime();
+    aeMain(config.el);
+    config.totlatency = mstime()-config.start;
+
+    count = config.requests_finished < config.requests ?
+            config.requests_finished : config.requests;
+    qsort(config.latency, count, sizeof(long long), compareLatency);
+    dt = (float)config.totlatency/1000;
+    if (!config.csv) {
+        printf("====== REPLAY %s ======\n", config.replay_file);
+        printf("  %d commands from %d trace clients replayed in %.2f "
+            "seconds\n", count, replay_numclients, dt);
+        if (replay_errors)
+            printf("  %d error replies\n", replay_errors);
+        printf("  p50=%.3f p95=%.3f p99=%.3f p99.9=%.3f max=%.3f msec\n",
+            latencyPercentile(config.latency, count, 50)/1000.0,
+            latencyPercentile(config.latency, count, 95)/1000.0,
+            latencyPercentile(config.latency, count, 99)/1000.0,
+            latencyPercentile(config.latency, count, 99.9)/1000.0,
+            config.latency[count-1]/1000.0);
+        printf("  %.2f requests per second\n\n", count/dt);
+    } else {
+        printf("\"REPLAY\",\"%.2f\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\","
+            "\"%.3f\"\n", count/dt,
+            latencyPercentile(config.latency, count, 50)/1000.0,
+            latencyPercentile(config.latency, count, 95)/1000.0,
+            latencyPercentile(config.latency, count, 99)/1000.0,
+            latencyPercentile(config.latency, count, 99.9)/1000.0,
+            config.latency[count-1]/1000.0);
+    }
+    if (config.replay_save) replaySaveSummary(config.replay_save, count);
+    if (config.replay_compare)
+        verdict = replayCompareSummary(config.replay_compare, count);
+    replayFreeClients();
+    if (verdict) exit(1);
+}
+
 /* Returns number of consumed options. */
 int parseOptions(int argc, const char **argv) {
     int i;
@@ -1357,6 +2115,35 @@ int parseOptions(int argc, const char **argv) {
                        MAX_THREADS);
                 config.num_threads = MAX_THREADS;
              } else if (config.num_threads < 0) config.num_threads = 0;
+        } else if (!strcmp(argv[i],"--dist")) {
+            if (lastarg) goto invalid;
+            if (parseDistSpec(argv[++i])) goto invalid;
+        } else if (!strcmp(argv[i],"--mix")) {
+            if (lastarg) goto invalid;
+            parseMixSpec(argv[++i]);
+        } else if (!strcmp(argv[i],"--replay")) {
+            if (lastarg) goto invalid;
+            config.replay_file = strdup(argv[++i]);
+        } else if (!strcmp(argv[i],"--replay-save")) {
+            if (lastarg) goto invalid;
+            config.replay_save = strdup(argv[++i]);
+        } else if (!strcmp(argv[i],"--replay-compare")) {
+            if (lastarg) goto invalid;
+            config.replay_compare = strdup(argv[++i]);
+        } else if (!strcmp(argv[i],"--replay-threshold")) {
+            if (lastarg) goto invalid;
+            config.replay_threshold = atof(argv[++i]);
+            if (config.replay_threshold <= 0) goto invalid;
+        } else if (!strcmp(argv[i],"--replay-speed")) {
+            if (lastarg) goto invalid;
+            config.replay_speed = atof(argv[++i]);
+            if (config.replay_speed < 0) goto invalid;
+        } else if (!strcmp(argv[i],"--data-size-range")) {
+            if (lastarg) goto invalid;
+            if (sscanf(argv[++i],"%d:%d",
+                    &config.datasize_min,&config.datasize_max) != 2 ||
+                config.datasize_min < 1 ||
+                config.datasize_max < config.datasize_min) goto invalid;
         } else if (!strcmp(argv[i],"--cluster")) {
             config.cluster_mode = 1;
         } else if (!strcmp(argv[i],"--enable-tracking")) {
@@ -1399,6 +2186,41 @@ usage:
 "  from 0 to keyspacelen-1. The substitution changes every time a command\n"
 "  is executed. Default tests use this to hit random keys in the\n"
 "  specified range.\n"
+" --dist <spec>      Key distribution used for the __rand_int__ substitution:\n"
+"                    uniform (default), zipf[:<theta>] with theta in (0,1)\n"
+"                    (default 0.99), or hotspot[:<keys>:<ops>] where <keys>\n"
+"                    is the hot fraction of the keyspace and <ops> the\n"
+"                    fraction of requests it receives (default 0.1:0.9).\n"
+"                    Requires -r.\n"
+" --mix <spec>       Run a single benchmark interleaving commands with the\n"
+"                    given relative weights, e.g. \"get:0.7,set:0.25,del:0.05\".\n"
+"                    Latency percentiles are reported per command. Supported\n"
+"                    commands: ping, get, set, del, incr, lpush, rpush, lpop,\n"
+"                    rpop, sadd, spop, hset.\n"
+" --data-size-range <min>:<max>\n"
+"                    With --mix, use a uniformly random value size between\n"
+"                    min and max bytes for every write (overrides -d).\n"
+" --replay <file>    Replay a recorded command trace instead of running the\n"
+"                    synthetic tests. Every trace line is:\n"
+"                      <usec-offset> <client-id> <command> [args...]\n"
+"                    sorted by offset. Every distinct client id gets its own\n"
+"                    connection and commands are issued at their recorded\n"
+"                    offset, preserving the concurrency and pipelining of\n"
+"                    the original traffic. Arguments can be quoted like in\n"
+"                    redis-cli; lines starting with # are ignored.\n"
+" --replay-speed <x> Time scale for --replay: 2 replays twice as fast, 0\n"
+"                    disables pacing entirely (default 1).\n"
+" --replay-save <file>\n"
+"                    Save the replay latency distribution as a baseline.\n"
+" --replay-compare <file>\n"
+"                    Compare the replay latency distribution against a saved\n"
+"                    baseline and print a PASS/FAIL regression verdict. The\n"
+"                    exit status is non zero on FAIL.\n"
+" --replay-threshold <pct>\n"
+"                    Percentile degradation tolerated by --replay-compare\n"
+"                    before the verdict is FAIL (default 10).\n"
+    );
+    printf(
 " -P <numreq>        Pipeline <numreq> requests. Default 1 (no pipeline).\n"
 " -e                 If server replies with errors, show them on stdout.\n"
 "                    (no more than 1 error per second is displayed)\n"
@@ -1418,6 +2240,11 @@ usage:
 "   $ redis-benchmark -t set -n 1000000 -r 100000000\n\n"
 " Benchmark 127.0.0.1:6379 for a few commands producing CSV output:\n"
 "   $ redis-benchmark -t ping,set,get -n 100000 --csv\n\n"
+" Benchmark a mixed workload with a zipfian key distribution:\n"
+"   $ redis-benchmark -r 100000 --dist zipf --mix get:0.7,set:0.25,del:0.05\n\n"
+" Check a build for latency regressions against a recorded trace:\n"
+"   $ redis-benchmark -p 6379 --replay trace.log --replay-save baseline.txt\n"
+"   $ redis-benchmark -p 6380 --replay trace.log --replay-compare baseline.txt\n\n"
 " Benchmark a specific command line:\n"
 "   $ redis-benchmark -r 10000 -n 10000 eval 'return redis.call(\"ping\")' 0\n\n"
 " Fill a list with 10000 random elements:\n"
@@ -1517,12 +2344,26 @@ int main(int argc, const char **argv) {
     config.is_updating_slots = 0;
     config.slots_last_update = 0;
     config.enable_tracking = 0;
+    config.dist = DIST_UNIFORM;
+    config.mix = NULL;
+    config.mix_count = 0;
+    config.latency_tag = NULL;
+    config.datasize_min = 0;
+    config.datasize_max = 0;
+    config.replay_file = NULL;
+    config.replay_save = NULL;
+    config.replay_compare = NULL;
+    config.replay_threshold = 10;
+    config.replay_speed = 1;
 
     i = parseOptions(argc,argv);
     argc -= i;
     argv += i;
 
     config.latency = zmalloc(sizeof(long long)*config.requests);
+    if (config.mix_count)
+        config.latency_tag = zmalloc(sizeof(unsigned char)*config.requests);
+    initKeyDistribution();
 
     if (config.cluster_mode) {
         /* Fetch cluster configuration. */
@@ -1598,6 +2439,32 @@ int main(int argc, const char **argv) {
         /* and will wait for every */
     }
 
+    /* Replay a recorded trace. */
+    if (config.replay_file) {
+        if (config.cluster_mode || config.num_threads) {
+            fprintf(stderr,
+                "--replay is not supported with --cluster or --threads\n");
+            exit(1);
+        }
+        replayBenchmark();
+        if (config.redis_config != NULL) freeRedisConfig(config.redis_config);
+        return 0;
+    }
+
+    /* Run a single benchmark mixing the requested commands. */
+    if (config.mix_count) {
+        int maxsize = config.datasize_max > 0 ?
+                      config.datasize_max : config.datasize;
+        mix_payload = zmalloc(maxsize);
+        memset(mix_payload,'x',maxsize);
+        do {
+            benchmark("MIX",NULL,0);
+        } while(config.loop);
+
+        if (config.redis_config != NULL) freeRedisConfig(config.redis_config);
+        return 0;
+    }
+
     /* Run benchmark with command in the remainder of the arguments. */
     if (argc) {
         sds title = sdsnew(argv[0]);
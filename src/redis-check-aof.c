@@ -142,23 +142,31 @@ off_t process(FILE *fp) {
 }
 
 int redis_check_aof_main(int argc, char **argv) {
-    char *filename;
-    int fix = 0;
-
-    if (argc < 2) {
-        printf("Usage: %s [--fix] <file.aof>\n", argv[0]);
-        exit(1);
-    } else if (argc == 2) {
-        filename = argv[1];
-    } else if (argc == 3) {
-        if (strcmp(argv[1],"--fix") != 0) {
-            printf("Invalid argument: %s\n", argv[1]);
+    char *filename = NULL;
+    int fix = 0, j;
+
+    for (j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"--fix")) {
+            fix = 1;
+        } else if (!strcmp(argv[j],"--threads") && j+1 < argc) {
+            /* Threads used by the deep integrity checks of the RDB
+             * preamble, if the AOF has one. The AOF tail is a sequential
+             * protocol parse and is always checked by this thread. */
+            int threads = atoi(argv[++j]);
+            if (threads < 1 || threads > 128) {
+                printf("Invalid --threads count '%s'\n", argv[j]);
+                exit(1);
+            }
+            server.rdb_load_threads = threads;
+        } else if (filename == NULL) {
+            filename = argv[j];
+        } else {
+            printf("Invalid argument: %s\n", argv[j]);
             exit(1);
         }
-        filename = argv[2];
-        fix = 1;
-    } else {
-        printf("Invalid arguments\n");
+    }
+    if (filename == NULL) {
+        printf("Usage: %s [--fix] [--threads <count>] <file.aof>\n", argv[0]);
         exit(1);
     }
 
@@ -59,6 +59,10 @@ struct {
 #define RDB_CHECK_DOING_READ_LEN 6
 #define RDB_CHECK_DOING_READ_AUX 7
 
+/* Number of loaded values retained before draining the worker pool and
+ * freeing them, when deep checks run on the pool (see redis_check_rdb). */
+#define RDB_CHECK_VAL_BATCH 128
+
 char *rdb_check_doing_string[] = {
     "start",
     "read-type",
@@ -178,7 +182,8 @@ void rdbCheckSetupSignals(void) {
  * otherwise the already open file 'fp' is checked. */
 int redis_check_rdb(char *rdbfilename, FILE *fp) {
     uint64_t dbid;
-    int type, rdbver;
+    uint64_t mmap_payload_len = 0, payload_start = 0;
+    int type, rdbver, mmap_value = 0;
     char buf[1024];
     long long expiretime, now = mstime();
     static rio rdb; /* Pointed by global struct riostate. */
@@ -203,6 +208,16 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
 
     expiretime = -1;
     startLoadingFile(fp, rdbfilename, RDBFLAGS_NONE);
+
+    /* With rdb-load-threads > 1 the deep integrity walks of the loaded
+     * values run on the load worker pool while this thread goes on parsing
+     * the stream. Deferred jobs reference the payload of the values they
+     * check, so values are retained and freed in batches once the pool is
+     * drained, instead of right after loading them. */
+    rdbLoadPoolStart();
+    robj *pending_vals[RDB_CHECK_VAL_BATCH];
+    int pending = 0;
+
     while(1) {
         robj *key, *val;
 
@@ -272,6 +287,23 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             decrRefCount(auxkey);
             decrRefCount(auxval);
             continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_MMAP_VALUE) {
+            /* Fixed-width header written by rdb-mmap-format: the payload
+             * length and the real type of the value that follows. */
+            unsigned char ptypebyte;
+            int ptype;
+            rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
+            if (rioRead(&rdb,&mmap_payload_len,8) == 0) goto eoferr;
+            memrev64ifbe(&mmap_payload_len);
+            if (rioRead(&rdb,&ptypebyte,1) == 0) goto eoferr;
+            ptype = ptypebyte;
+            if (!rdbIsObjectType(ptype)) {
+                rdbCheckError("Invalid object type: %d", ptype);
+                goto err;
+            }
+            mmap_value = 1;
+            type = ptype;
+            rdbstate.key_type = type;
         } else {
             if (!rdbIsObjectType(type)) {
                 rdbCheckError("Invalid object type: %d", type);
@@ -287,17 +319,37 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         rdbstate.keys++;
         /* Read value */
         rdbstate.doing = RDB_CHECK_DOING_READ_OBJECT_VALUE;
-        if ((val = rdbLoadObject(type,&rdb,key)) == NULL) goto eoferr;
+        payload_start = rdb.processed_bytes;
+        if ((val = rdbLoadObject(type,&rdb,key,1)) == NULL) goto eoferr;
+        /* The fixed-width header must match the actual payload length:
+         * the server trusts it to locate the payload in the mapping. */
+        if (mmap_value &&
+            rdb.processed_bytes - payload_start != mmap_payload_len)
+        {
+            rdbCheckError("Wrong payload length in mmap value header");
+            goto err;
+        }
+        mmap_value = 0;
         /* Check if the key already expired. */
         if (expiretime != -1 && expiretime < now)
             rdbstate.already_expired++;
         if (expiretime != -1) rdbstate.expires++;
         rdbstate.key = NULL;
         decrRefCount(key);
-        decrRefCount(val);
+        if (rdbLoadPoolActive()) {
+            pending_vals[pending++] = val;
+            if (pending == RDB_CHECK_VAL_BATCH) {
+                rdbLoadPoolBarrier();
+                while (pending) decrRefCount(pending_vals[--pending]);
+            }
+        } else {
+            decrRefCount(val);
+        }
         rdbstate.key_type = -1;
         expiretime = -1;
     }
+    rdbLoadPoolStop(); /* Waits for and reports any pending deep check. */
+    while (pending) decrRefCount(pending_vals[--pending]);
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5 && server.rdb_checksum) {
         uint64_t cksum, expected = rdb.cksum;
@@ -344,8 +396,26 @@ err:
  * Otherwise if called with a non NULL fp, the function returns C_OK or
  * C_ERR depending on the success or failure. */
 int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
-    if (argc != 2 && fp == NULL) {
-        fprintf(stderr, "Usage: %s <rdb-file-name>\n", argv[0]);
+    char *filename = NULL;
+    int j;
+
+    for (j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"--threads") && j+1 < argc) {
+            /* Deep integrity checks run in parallel on this many threads,
+             * same limits as the rdb-load-threads config directive. */
+            int threads = atoi(argv[++j]);
+            if (threads < 1 || threads > 128) {
+                fprintf(stderr, "Invalid --threads count '%s'\n", argv[j]);
+                exit(1);
+            }
+            server.rdb_load_threads = threads;
+        } else if (filename == NULL) {
+            filename = argv[j];
+        }
+    }
+    if (filename == NULL && fp == NULL) {
+        fprintf(stderr, "Usage: %s [--threads <count>] <rdb-file-name>\n",
+            argv[0]);
         exit(1);
     }
     /* In order to call the loading functions we need to create the shared
@@ -355,9 +425,9 @@ int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
         createSharedObjects();
     server.loading_process_events_interval_bytes = 0;
     rdbCheckMode = 1;
-    rdbCheckInfo("Checking RDB file %s", argv[1]);
+    rdbCheckInfo("Checking RDB file %s", filename);
     rdbCheckSetupSignals();
-    int retval = redis_check_rdb(argv[1],fp);
+    int retval = redis_check_rdb(filename,fp);
     if (retval == 0) {
         rdbCheckInfo("\\o/ RDB looks OK! \\o/");
         rdbShowGenericInfo();
@@ -45,6 +45,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 
 #include <hiredis.h>
 #ifdef USE_OPENSSL
@@ -1729,6 +1730,9 @@ static void usage(void) {
 "  --replica          Simulate a replica showing commands received from the master.\n"
 "  --rdb <filename>   Transfer an RDB dump from remote server to local file.\n"
 "  --pipe             Transfer raw Redis protocol from stdin to server.\n"
+"                     Combined with -c, commands are routed by hash slot\n"
+"                     to the right cluster master, one pipelined\n"
+"                     connection per node.\n"
 "  --pipe-timeout <n> In --pipe mode, abort with error if after sending all data.\n"
 "                     no reply is received within <n> seconds.\n"
 "                     Default timeout: %d. Use 0 to wait forever.\n",
@@ -7056,6 +7060,322 @@ static void pipeMode(void) {
         exit(0);
 }
 
+/* Cluster pipe mode (--pipe combined with -c): like pipeMode(), but the
+ * commands read from stdin are parsed client side, routed by hash slot
+ * over the fetched cluster map, and streamed over one pipelined
+ * connection per master, each with its own backpressure. Bulk loads thus
+ * proceed at the aggregate speed of the cluster rather than being
+ * bottlenecked on a single node. */
+
+#define PIPE_CLUSTER_MAX_PENDING (1024*1024) /* Per node output high mark. */
+
+typedef struct pipeClusterTarget {
+    clusterManagerNode *node;
+    int fd;
+    redisReader *reader;
+    sds obuf;           /* Protocol bytes not yet written to the socket. */
+    size_t obuf_pos;    /* First unwritten byte of obuf. */
+    long long sent;     /* Commands routed to this node. */
+    long long replies;
+    long long errors;
+    long long bytes;    /* Bytes written to the socket. */
+    int done;           /* True once the final ECHO reply was matched. */
+} pipeClusterTarget;
+
+/* Parse one complete multibulk command at 'buf'. Returns the number of
+ * bytes the command spans (including any leading CRLFs, that the server
+ * ignores), 0 if the buffer does not yet hold a complete command, or -1
+ * on a protocol error. On success '*key' points inside 'buf' at the
+ * first argument after the command name, if any, and '*has_cmd' is set.
+ * Inline commands are rejected: there is no way to route them without
+ * guessing at quoting rules, and mass insertion input is generated
+ * protocol anyway. */
+static ssize_t pipeClusterParseCommand(char *buf, size_t len, char **key,
+                                       size_t *keylen, int *has_cmd)
+{
+    char *p = buf, *end = buf+len, *eol;
+    long long nargs, arglen, i;
+
+    *key = NULL;
+    *keylen = 0;
+    *has_cmd = 0;
+
+    while (p < end && (*p == '\r' || *p == '\n')) p++;
+    if (p == end) return 0;
+    if (*p != '*') return -1;
+    eol = memchr(p,'\r',end-p);
+    if (eol == NULL || eol+1 >= end) return 0;
+    nargs = strtoll(p+1,NULL,10);
+    if (nargs <= 0 || eol[1] != '\n') return -1;
+    p = eol+2;
+    for (i = 0; i < nargs; i++) {
+        if (p == end) return 0;
+        if (*p != '$') return -1;
+        eol = memchr(p,'\r',end-p);
+        if (eol == NULL || eol+1 >= end) return 0;
+        arglen = strtoll(p+1,NULL,10);
+        if (arglen < 0 || eol[1] != '\n') return -1;
+        p = eol+2;
+        if (end-p < arglen+2) return 0;
+        if (i == 1) {
+            *key = p;
+            *keylen = arglen;
+        }
+        p += arglen+2;
+    }
+    *has_cmd = 1;
+    return p-buf;
+}
+
+static void clusterPipeMode(void) {
+    pipeClusterTarget *targets;
+    pipeClusterTarget *slots_map[CLUSTER_MANAGER_SLOTS] = {NULL};
+    char aneterr[ANET_ERR_LEN];
+    char ibuf[1024*16];
+    char magic[20];
+    sds stdin_buf = sdsempty();
+    int i, numtargets = 0, done_targets = 0, eof = 0;
+    long long errors = 0, replies = 0;
+    long long start = mstime();
+    time_t last_read_time = time(NULL);
+    listIter li;
+    listNode *ln;
+
+    srand(time(NULL));
+    for (i = 0; i < 20; i++) magic[i] = rand() & 0xff;
+
+    /* Fetch the cluster map from the reference node given on the command
+     * line, and open one connection per slot-serving master. */
+    clusterManagerNode *refnode =
+        clusterManagerNewNode(config.hostip,config.hostport);
+    if (!clusterManagerLoadInfoFromNode(refnode,0)) exit(1);
+
+    listRewind(cluster_manager.nodes,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerNode *n = ln->value;
+        if (n->flags & CLUSTER_MANAGER_FLAG_SLAVE) continue;
+        if (n->slots_count == 0) continue;
+        numtargets++;
+    }
+    if (numtargets == 0) {
+        fprintf(stderr,"No master is serving slots: nothing to pipe to.\n");
+        exit(1);
+    }
+    targets = zcalloc(sizeof(*targets)*numtargets);
+    numtargets = 0;
+    listRewind(cluster_manager.nodes,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerNode *n = ln->value;
+        if (n->flags & CLUSTER_MANAGER_FLAG_SLAVE) continue;
+        if (n->slots_count == 0) continue;
+        if (!n->context && !clusterManagerNodeConnect(n)) exit(1);
+        pipeClusterTarget *t = targets+numtargets++;
+        t->node = n;
+        t->fd = n->context->fd;
+        t->reader = redisReaderCreate();
+        t->obuf = sdsempty();
+        if (anetNonBlock(aneterr,t->fd) == ANET_ERR) {
+            fprintf(stderr,
+                "Can't set the socket in non blocking mode: %s\n", aneterr);
+            exit(1);
+        }
+        for (i = 0; i < CLUSTER_MANAGER_SLOTS; i++)
+            if (n->slots[i]) slots_map[i] = t;
+    }
+    for (i = 0; i < CLUSTER_MANAGER_SLOTS; i++) {
+        if (slots_map[i] == NULL) {
+            fprintf(stderr,
+                "Slot %d is not served by any master: fix the cluster "
+                "before piping data into it.\n", i);
+            exit(1);
+        }
+    }
+
+    struct pollfd *pfds = zmalloc(sizeof(struct pollfd)*(numtargets+1));
+    while (done_targets < numtargets) {
+        int paused = 0;
+
+        for (i = 0; i < numtargets; i++) {
+            pipeClusterTarget *t = targets+i;
+            pfds[i].fd = t->fd;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+            size_t pending = sdslen(t->obuf)-t->obuf_pos;
+            if (pending) pfds[i].events |= POLLOUT;
+            /* Backpressure: stdin is a single ordered stream, so when any
+             * node lags too far behind we must stop consuming it; the
+             * other connections keep draining their queues meanwhile. */
+            if (pending > PIPE_CLUSTER_MAX_PENDING) paused = 1;
+        }
+        pfds[numtargets].fd = STDIN_FILENO;
+        pfds[numtargets].events = (!eof && !paused) ? POLLIN : 0;
+        pfds[numtargets].revents = 0;
+        if (poll(pfds,numtargets+1,1000) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr,"poll: %s\n",strerror(errno));
+            exit(1);
+        }
+
+        /* Consume stdin and route complete commands by hash slot. */
+        if (pfds[numtargets].revents & (POLLIN|POLLHUP)) {
+            ssize_t nread = read(STDIN_FILENO,ibuf,sizeof(ibuf));
+
+            if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr,"Error reading from stdin: %s\n",
+                    strerror(errno));
+                exit(1);
+            }
+            if (nread > 0) stdin_buf = sdscatlen(stdin_buf,ibuf,nread);
+            while (sdslen(stdin_buf)) {
+                char *key;
+                size_t keylen;
+                int has_cmd;
+                ssize_t consumed = pipeClusterParseCommand(stdin_buf,
+                    sdslen(stdin_buf),&key,&keylen,&has_cmd);
+
+                if (consumed == -1) {
+                    fprintf(stderr,"Protocol error reading commands from "
+                        "stdin: only multibulk commands can be routed in "
+                        "cluster pipe mode.\n");
+                    exit(1);
+                }
+                if (consumed == 0) break;
+                /* Commands without a key argument (SELECT, FLUSHALL, ...)
+                 * go to the first master. */
+                pipeClusterTarget *t = key ?
+                    slots_map[clusterManagerKeyHashSlot(key,keylen)] :
+                    targets;
+                t->obuf = sdscatlen(t->obuf,stdin_buf,consumed);
+                t->sent++;
+                sdsrange(stdin_buf,consumed,-1);
+            }
+            if (nread == 0) {
+                /* All input consumed: queue the final ECHO on every
+                 * connection so we can tell when each node is done. The
+                 * leading CRLF protects the ECHO from trailing garbage
+                 * and is ignored by the server. */
+                char echo[] =
+                "\r\n*2\r\n$4\r\nECHO\r\n$20\r\n01234567890123456789\r\n";
+
+                memcpy(echo+21,magic,20);
+                eof = 1;
+                for (i = 0; i < numtargets; i++)
+                    targets[i].obuf =
+                        sdscatlen(targets[i].obuf,echo,sizeof(echo)-1);
+                printf("All data transferred. Waiting for the last replies...\n");
+            }
+        }
+
+        for (i = 0; i < numtargets; i++) {
+            pipeClusterTarget *t = targets+i;
+
+            /* Read replies from this node. */
+            if (pfds[i].revents & (POLLIN|POLLERR|POLLHUP)) {
+                ssize_t nread;
+                int read_error = 0;
+                redisReply *reply;
+
+                do {
+                    nread = read(t->fd,ibuf,sizeof(ibuf));
+                    if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+                        fprintf(stderr,"Error reading from %s:%d: %s\n",
+                            t->node->ip,t->node->port,strerror(errno));
+                        read_error = 1;
+                        break;
+                    }
+                    if (nread > 0) {
+                        redisReaderFeed(t->reader,ibuf,nread);
+                        last_read_time = time(NULL);
+                    }
+                } while (nread > 0);
+
+                do {
+                    if (redisReaderGetReply(t->reader,(void**)&reply)
+                        == REDIS_ERR)
+                    {
+                        fprintf(stderr,"Error reading replies from %s:%d\n",
+                            t->node->ip,t->node->port);
+                        exit(1);
+                    }
+                    if (reply) {
+                        if (reply->type == REDIS_REPLY_ERROR) {
+                            fprintf(stderr,"%s:%d: %s\n",
+                                t->node->ip,t->node->port,reply->str);
+                            t->errors++;
+                            errors++;
+                        } else if (eof && !t->done &&
+                                   reply->type == REDIS_REPLY_STRING &&
+                                   reply->len == 20 &&
+                                   memcmp(reply->str,magic,20) == 0)
+                        {
+                            t->done = 1;
+                            done_targets++;
+                            replies--;
+                            t->replies--;
+                        }
+                        replies++;
+                        t->replies++;
+                        freeReplyObject(reply);
+                    }
+                } while (reply);
+                if (read_error) exit(1);
+            }
+
+            /* Flush pending protocol bytes to this node. */
+            if (pfds[i].revents & POLLOUT) {
+                size_t pending = sdslen(t->obuf)-t->obuf_pos;
+                ssize_t nwritten = write(t->fd,t->obuf+t->obuf_pos,pending);
+
+                if (nwritten == -1) {
+                    if (errno != EAGAIN && errno != EINTR) {
+                        fprintf(stderr,"Error writing to %s:%d: %s\n",
+                            t->node->ip,t->node->port,strerror(errno));
+                        exit(1);
+                    }
+                    nwritten = 0;
+                }
+                t->obuf_pos += nwritten;
+                t->bytes += nwritten;
+                if (t->obuf_pos == sdslen(t->obuf)) {
+                    sdsclear(t->obuf);
+                    t->obuf_pos = 0;
+                }
+            }
+        }
+
+        /* Timeout handling, as in single node pipe mode. */
+        if (eof && config.pipe_timeout > 0 &&
+            time(NULL)-last_read_time > config.pipe_timeout)
+        {
+            fprintf(stderr,"No replies for %d seconds: exiting.\n",
+                config.pipe_timeout);
+            errors++;
+            break;
+        }
+    }
+
+    /* Per node throughput report. */
+    double elapsed = (mstime()-start)/1000.0;
+    if (elapsed <= 0) elapsed = 0.001;
+    for (i = 0; i < numtargets; i++) {
+        pipeClusterTarget *t = targets+i;
+        printf("%s:%d -> replies: %lld (%.0f/s), errors: %lld, "
+               "%.2f MB sent\n",
+            t->node->ip,t->node->port,t->replies,t->replies/elapsed,
+            t->errors,(double)t->bytes/(1024*1024));
+        redisReaderFree(t->reader);
+        sdsfree(t->obuf);
+    }
+    printf("errors: %lld, replies: %lld\n", errors, replies);
+    zfree(pfds);
+    zfree(targets);
+    sdsfree(stdin_buf);
+    if (errors)
+        exit(1);
+    else
+        exit(0);
+}
+
 /*------------------------------------------------------------------------------
  * Find big keys
  *--------------------------------------------------------------------------- */
@@ -7960,8 +8280,13 @@ int main(int argc, char **argv) {
 
     /* Pipe mode */
     if (config.pipe_mode) {
-        if (cliConnect(0) == REDIS_ERR) exit(1);
-        pipeMode();
+        if (config.cluster_mode) {
+            /* Connects one socket per master on its own. */
+            clusterPipeMode();
+        } else {
+            if (cliConnect(0) == REDIS_ERR) exit(1);
+            pipeMode();
+        }
     }
 
     /* Find big keys */
@@ -44,6 +44,12 @@ void replicationSendAck(void);
 void putSlaveOnline(client *slave);
 int cancelReplicationHandshake(void);
 
+/* Return values of replHandshakeReadLine(). */
+#define READLINE_AGAIN 0
+#define READLINE_OK 1
+#define READLINE_ERR -1
+static int replHandshakeReadLine(connection *conn, sds *dst);
+
 /* --------------------------- Utility functions ---------------------------- */
 
 /* Return the pointer to a string representing the slave ip:listening_port
@@ -75,11 +81,22 @@ char *replicationGetSlaveName(client *c) {
 
 /* ---------------------------------- MASTER -------------------------------- */
 
+/* One every how many buffer blocks an entry is added to the backlog
+ * offset index: a PSYNC start point lookup seeks the index and then walks
+ * at most this number of blocks. */
+#define REPL_BACKLOG_INDEX_PER_BLOCKS 64
+
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
+    server.repl_backlog = zmalloc(sizeof(replBacklog));
+    server.repl_backlog->ref_node = NULL;
+    server.repl_backlog->blocks_index = raxNew();
+    server.repl_backlog->unindexed_blocks = 0;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
+    if (server.repl_buffer_blocks == NULL) {
+        server.repl_buffer_blocks = listCreate();
+        listSetFreeMethod(server.repl_buffer_blocks,zfree);
+    }
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
@@ -87,71 +104,426 @@ void createReplicationBacklog(void) {
     server.repl_backlog_off = server.master_repl_offset+1;
 }
 
+/* Free every buffer block from the head of the list that is not referenced
+ * anymore, either by the backlog or by a replica. Blocks are only released
+ * from the head: a block in the middle of the list is part of the stream
+ * some slower reader will still go through. */
+void freeReplicationBufferHead(void) {
+    listNode *ln;
+
+    while ((ln = listFirst(server.repl_buffer_blocks)) != NULL) {
+        replBufBlock *o = listNodeValue(ln);
+        if (o->refcount != 0) break;
+        /* Never release a block still holding staged master stream bytes:
+         * they are dropped or applied by the staging functions. */
+        if (o->staged != 0) break;
+        /* Drop the offset index entry of the block, if it has one. */
+        if (server.repl_backlog) {
+            uint64_t encoded = htonu64(o->repl_offset);
+            raxRemove(server.repl_backlog->blocks_index,
+                      (unsigned char*)&encoded,sizeof(encoded),NULL);
+        }
+        server.repl_buffer_mem -= sizeof(replBufBlock)+o->size;
+        listDelNode(server.repl_buffer_blocks,ln);
+    }
+}
+
+/* Move the backlog reference forward dropping whole blocks from its window,
+ * as long as the remaining history is still at least repl_backlog_size
+ * bytes. Blocks a slow replica still references are kept alive even when
+ * they fall out of the backlog: the replica output buffer limits take care
+ * of disconnecting replicas that lag too much. */
+static void trimReplicationBacklog(void) {
+    if (server.repl_backlog == NULL || server.repl_backlog->ref_node == NULL)
+        return;
+    listNode *next;
+    while ((next = listNextNode(server.repl_backlog->ref_node)) != NULL) {
+        replBufBlock *o = listNodeValue(server.repl_backlog->ref_node);
+        if (server.repl_backlog_histlen - (long long)o->used <
+            server.repl_backlog_size) break;
+        serverAssert(o->refcount > 0);
+        o->refcount--;
+        ((replBufBlock*)listNodeValue(next))->refcount++;
+        server.repl_backlog->ref_node = next;
+        server.repl_backlog_off =
+            ((replBufBlock*)listNodeValue(next))->repl_offset;
+        server.repl_backlog_histlen =
+            server.master_repl_offset - server.repl_backlog_off + 1;
+    }
+    freeReplicationBufferHead();
+}
+
 /* This function is called when the user modifies the replication backlog
- * size at runtime. It is up to the function to both update the
- * server.repl_backlog_size and to resize the buffer and setup it so that
- * it contains the same data as the previous one (possibly less data, but
- * the most recent bytes, or the same data and more free space in case the
- * buffer is enlarged). */
+ * size at runtime: since the backlog is just a reference counted window
+ * over the shared replication buffer there is no buffer to reallocate, the
+ * new size is simply enforced by trimming (shrinking) or by letting more
+ * blocks accumulate before they are trimmed (growing), so no history is
+ * lost on resize. */
 void resizeReplicationBacklog(long long newsize) {
     if (newsize < CONFIG_REPL_BACKLOG_MIN_SIZE)
         newsize = CONFIG_REPL_BACKLOG_MIN_SIZE;
     if (server.repl_backlog_size == newsize) return;
 
     server.repl_backlog_size = newsize;
-    if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
-    }
+    trimReplicationBacklog();
 }
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
+    if (server.repl_backlog == NULL) return;
+    if (server.repl_backlog->ref_node) {
+        replBufBlock *o = listNodeValue(server.repl_backlog->ref_node);
+        serverAssert(o->refcount > 0);
+        o->refcount--;
+    }
+    /* Without the backlog and without replicas nothing references the
+     * buffer blocks anymore: release them (and their index entries)
+     * before dropping the backlog structure itself. */
+    freeReplicationBufferHead();
+    raxFree(server.repl_backlog->blocks_index);
     zfree(server.repl_backlog);
     server.repl_backlog = NULL;
+    server.repl_backlog_histlen = 0;
 }
 
-/* Add data to the replication backlog.
- * This function also increments the global replication offset stored at
- * server.master_repl_offset, because there is no case where we want to feed
- * the backlog without incrementing the offset. */
-void feedReplicationBacklog(void *ptr, size_t len) {
-    unsigned char *p = ptr;
+/* ------------------------- Backlog persistence ---------------------------
+ *
+ * The backlog (and the replication IDs framing it) normally dies with the
+ * process, so even a planned restart forces every replica into a full
+ * resynchronization. When repl-backlog-file is configured, a clean
+ * shutdown dumps the backlog window to disk right after the final RDB
+ * snapshot, and the next startup restores it if (and only if) the RDB
+ * that was just loaded carries the very same replication ID and offset in
+ * its aux fields: that proves the dataset and the stream window belong
+ * together. A master restarting this way keeps serving PSYNC from where
+ * it left, and a restarting replica can offer the window to its own
+ * sub-replicas. The file is one-shot: it is removed as soon as it is
+ * found at startup, so a crash can never resurrect a stale window. */
+
+#define REPL_BACKLOG_FILE_MAGIC "REPLBACKLOG00001"
+
+typedef struct replBacklogFileHeader {
+    char magic[16];                 /* REPL_BACKLOG_FILE_MAGIC, no null. */
+    char replid[CONFIG_RUN_ID_SIZE];
+    char replid2[CONFIG_RUN_ID_SIZE];
+    uint64_t master_repl_offset;    /* Offset of the last byte we had. */
+    int64_t second_replid_offset;
+    uint64_t backlog_off;           /* Offset of the first stored byte. */
+    uint64_t histlen;               /* Stored bytes. */
+} replBacklogFileHeader;
+
+/* Dump the current backlog window to repl-backlog-file. Called on clean
+ * shutdown, after the final RDB snapshot was saved. Best effort: on any
+ * error the file is removed and the restart will just fall back to full
+ * resynchronizations. */
+void replicationPersistBacklog(void) {
+    replBacklogFileHeader hdr;
+    char tmpfile[256];
+    uint64_t crc;
+    FILE *fp;
+
+    if (server.repl_backlog_file == NULL) return;
+    if (server.repl_backlog == NULL || server.repl_backlog_histlen == 0)
+        return;
+
+    memcpy(hdr.magic,REPL_BACKLOG_FILE_MAGIC,sizeof(hdr.magic));
+    memcpy(hdr.replid,server.replid,CONFIG_RUN_ID_SIZE);
+    memcpy(hdr.replid2,server.replid2,CONFIG_RUN_ID_SIZE);
+    hdr.master_repl_offset = server.master_repl_offset;
+    hdr.second_replid_offset = server.second_replid_offset;
+    hdr.backlog_off = server.repl_backlog_off;
+    hdr.histlen = server.repl_backlog_histlen;
+    memrev64ifbe(&hdr.master_repl_offset);
+    memrev64ifbe(&hdr.second_replid_offset);
+    memrev64ifbe(&hdr.backlog_off);
+    memrev64ifbe(&hdr.histlen);
+
+    snprintf(tmpfile,sizeof(tmpfile),"temp-replbacklog-%d.bin",(int)getpid());
+    if ((fp = fopen(tmpfile,"w")) == NULL) {
+        serverLog(LL_WARNING,
+            "Can't persist the replication backlog to %s: %s",
+            tmpfile,strerror(errno));
+        return;
+    }
+    crc = crc64(0,(unsigned char*)&hdr,sizeof(hdr));
+    if (fwrite(&hdr,sizeof(hdr),1,fp) != 1) goto werr;
+
+    /* Walk the shared buffer blocks from the one the backlog references,
+     * skipping the bytes of the first block that already fell out of the
+     * window. Only 'used' bytes are part of the visible stream: staged
+     * master bytes were never acknowledged as applied. */
+    listNode *node = server.repl_backlog->ref_node;
+    long long written = 0;
+    while (node) {
+        replBufBlock *o = listNodeValue(node);
+        size_t skip = 0;
+        if (o->repl_offset < server.repl_backlog_off)
+            skip = server.repl_backlog_off - o->repl_offset;
+        if (skip < o->used) {
+            size_t len = o->used - skip;
+            if (fwrite(o->buf+skip,len,1,fp) != 1) goto werr;
+            crc = crc64(crc,(unsigned char*)o->buf+skip,len);
+            written += len;
+        }
+        node = listNextNode(node);
+    }
+    serverAssert(written == server.repl_backlog_histlen);
+
+    memrev64ifbe(&crc);
+    if (fwrite(&crc,sizeof(crc),1,fp) != 1) goto werr;
+    if (fflush(fp) == EOF) goto werr;
+    if (fsync(fileno(fp)) == -1) goto werr;
+    if (fclose(fp) == EOF) { fp = NULL; goto werr; }
+    if (rename(tmpfile,server.repl_backlog_file) == -1) {
+        fp = NULL;
+        goto werr;
+    }
+    serverLog(LL_NOTICE,
+        "Replication backlog saved to %s (%lld bytes, offsets %lld-%lld)",
+        server.repl_backlog_file,server.repl_backlog_histlen,
+        server.repl_backlog_off,server.master_repl_offset);
+    return;
+
+werr:
+    serverLog(LL_WARNING,"Error persisting the replication backlog: %s",
+        strerror(errno));
+    if (fp) fclose(fp);
+    unlink(tmpfile);
+}
+
+/* Restore the backlog window persisted by the previous clean shutdown, if
+ * any. Called at startup right after the RDB was loaded: 'rsi' carries the
+ * replication ID and offset found in the RDB aux fields, and the persisted
+ * window is only accepted when it ends exactly at that offset under the
+ * same ID. The file is always removed, accepted or not. */
+void replicationLoadBacklog(rdbSaveInfo *rsi) {
+    replBacklogFileHeader hdr;
+    uint64_t crc, expected_crc;
+    char *data = NULL;
+    FILE *fp;
+
+    if (server.repl_backlog_file == NULL) return;
+    if ((fp = fopen(server.repl_backlog_file,"r")) == NULL) return;
+    unlink(server.repl_backlog_file); /* One-shot, stale windows are
+                                       * worse than full syncs. */
+
+    if (fread(&hdr,sizeof(hdr),1,fp) != 1 ||
+        memcmp(hdr.magic,REPL_BACKLOG_FILE_MAGIC,sizeof(hdr.magic)) != 0)
+    {
+        serverLog(LL_WARNING,
+            "Malformed replication backlog file: ignoring it.");
+        goto cleanup;
+    }
+    crc = crc64(0,(unsigned char*)&hdr,sizeof(hdr));
+    memrev64ifbe(&hdr.master_repl_offset);
+    memrev64ifbe(&hdr.second_replid_offset);
+    memrev64ifbe(&hdr.backlog_off);
+    memrev64ifbe(&hdr.histlen);
+
+    if (!rsi->repl_id_is_set ||
+        rsi->repl_offset != (long long)hdr.master_repl_offset ||
+        memcmp(hdr.replid,rsi->repl_id,CONFIG_RUN_ID_SIZE) != 0)
+    {
+        serverLog(LL_WARNING,"Replication backlog file does not match the "
+            "replication ID / offset of the loaded RDB file: ignoring it.");
+        goto cleanup;
+    }
+    if (hdr.histlen == 0 ||
+        hdr.backlog_off + hdr.histlen != hdr.master_repl_offset+1)
+    {
+        serverLog(LL_WARNING,
+            "Inconsistent replication backlog file: ignoring it.");
+        goto cleanup;
+    }
+
+    data = zmalloc(hdr.histlen);
+    if (fread(data,hdr.histlen,1,fp) != 1 ||
+        fread(&expected_crc,sizeof(expected_crc),1,fp) != 1)
+    {
+        serverLog(LL_WARNING,
+            "Truncated replication backlog file: ignoring it.");
+        goto cleanup;
+    }
+    memrev64ifbe(&expected_crc);
+    crc = crc64(crc,(unsigned char*)data,hdr.histlen);
+    if (crc != expected_crc) {
+        serverLog(LL_WARNING,
+            "Corrupted replication backlog file (bad CRC): ignoring it.");
+        goto cleanup;
+    }
+
+    /* Restore the replication IDs framing the window. A replica already
+     * got them from the RDB aux fields in loadDataFromDisk(), for a
+     * master this is what lets it answer PSYNC under its old ID. */
+    memcpy(server.replid,hdr.replid,CONFIG_RUN_ID_SIZE);
+    server.replid[CONFIG_RUN_ID_SIZE] = '\0';
+    memcpy(server.replid2,hdr.replid2,CONFIG_RUN_ID_SIZE);
+    server.replid2[CONFIG_RUN_ID_SIZE] = '\0';
+    server.second_replid_offset = hdr.second_replid_offset;
+
+    /* Rebuild the backlog by replaying the window through the regular
+     * feed path, so blocks, refcounts and the offset index come out
+     * exactly as if the bytes had just flowed: rewind the global offset
+     * to right before the window and let the feed advance it back. */
+    server.master_repl_offset = hdr.backlog_off-1;
+    if (server.repl_backlog == NULL) createReplicationBacklog();
+    feedReplicationBuffer(data,hdr.histlen);
+    serverAssert(server.master_repl_offset ==
+                 (long long)hdr.master_repl_offset);
+
+    serverLog(LL_NOTICE,
+        "Replication backlog restored (%llu bytes, offsets %llu-%llu): "
+        "partial resynchronizations with the pre-restart stream possible.",
+        (unsigned long long)hdr.histlen,
+        (unsigned long long)hdr.backlog_off,
+        (unsigned long long)hdr.master_repl_offset);
+
+cleanup:
+    if (data) zfree(data);
+    fclose(fp);
+}
+
+/* Common bookkeeping performed when 'len' new bytes of replication stream
+ * became visible at the tail of the shared buffer, either because they were
+ * just copied there by feedReplicationBuffer() or because staged master
+ * stream bytes were applied by applyStagedReplicationStream().
+ *
+ * 'start_node' and 'start_pos' locate the first new byte, and are used to
+ * attach replicas (and the backlog) that were not referencing the stream
+ * yet. 'prev_end_node' and 'prev_end_pos' locate the end of the visible
+ * stream before the new data: a replica referencing exactly that point was
+ * fully in sync and needs to be scheduled for write again. */
+static void replicationStreamAdvanced(listNode *start_node, size_t start_pos,
+                                      listNode *prev_end_node,
+                                      size_t prev_end_pos, size_t len)
+{
+    listNode *ln;
+    listIter li;
 
     server.master_repl_offset += len;
+    server.repl_backlog_histlen += len;
+
+    /* A backlog that was just created (or that never received data yet)
+     * starts referencing the stream from the first byte just written. */
+    if (server.repl_backlog && server.repl_backlog->ref_node == NULL) {
+        server.repl_backlog->ref_node = start_node;
+        ((replBufBlock*)listNodeValue(start_node))->refcount++;
+        server.repl_backlog_off = server.master_repl_offset - len + 1;
+        server.repl_backlog_histlen = len;
+    }
+
+    /* Attach the replicas that were waiting for their first byte since
+     * the full sync started, and schedule for write the ones that had
+     * nothing pending before this feed. */
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
 
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
-        if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
-        len -= thislen;
+        /* Don't feed slaves that are still waiting for BGSAVE to start. */
+        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
+
+        int was_synced = 0;
+        if (slave->ref_repl_buf_node == NULL) {
+            slave->ref_repl_buf_node = start_node;
+            slave->ref_block_pos = start_pos;
+            ((replBufBlock*)listNodeValue(start_node))->refcount++;
+            was_synced = 1;
+        } else if (slave->ref_repl_buf_node == prev_end_node &&
+                   slave->ref_block_pos == prev_end_pos)
+        {
+            was_synced = 1;
+        }
+        /* A replica that was fully in sync before this feed is put in the
+         * pending write queue like prepareClientToWrite() would do. If
+         * CLIENT_PENDING_READ is set an IO thread owns the client and
+         * handleClientsWithPendingReadsUsingThreads() will schedule it. */
+        if (was_synced && !(slave->flags & CLIENT_PENDING_READ))
+            clientInstallWriteHandler(slave);
+        asyncCloseClientOnOutputBufferLimitReached(slave);
+    }
+    trimReplicationBacklog();
+}
+
+/* Append data to the shared replication buffer, referenced by the backlog
+ * and by every attached replica: this is the only copy of the stream that
+ * is ever made on the feed path. The function also increments the global
+ * replication offset stored at server.master_repl_offset, because there is
+ * no case where we want to feed the stream without incrementing the
+ * offset. */
+void feedReplicationBuffer(char *buf, size_t len) {
+    const char *p = buf;
+    size_t remaining = len;
+    listNode *start_node = NULL;
+    size_t start_pos = 0;
+    listNode *prev_tail_node;
+    size_t prev_tail_used;
+
+    if (server.repl_buffer_blocks == NULL) return;
+
+    /* Remember where the stream ended before this feed: a replica whose
+     * reference is here was fully in sync and needs to be scheduled for
+     * write again. */
+    prev_tail_node = listLast(server.repl_buffer_blocks);
+    prev_tail_used = prev_tail_node ?
+        ((replBufBlock*)listNodeValue(prev_tail_node))->used : 0;
+
+    while (remaining) {
+        listNode *tail_node = listLast(server.repl_buffer_blocks);
+        replBufBlock *tail = tail_node ? listNodeValue(tail_node) : NULL;
+        size_t avail = tail ? tail->size - tail->used : 0;
+        size_t thislen;
+
+        if (avail == 0) {
+            /* Allocate a new block: at least the usual chunk size, or
+             * more to fit a big payload in a single block. */
+            size_t size = (remaining < PROTO_REPLY_CHUNK_BYTES) ?
+                          PROTO_REPLY_CHUNK_BYTES : remaining;
+            tail = zmalloc(sizeof(replBufBlock)+size);
+            /* Take over the allocator internal fragmentation, so the
+             * block is accounted for exactly and the slack holds data. */
+            size = zmalloc_usable(tail) - sizeof(replBufBlock);
+            tail->refcount = 0;
+            tail->size = size;
+            tail->used = 0;
+            tail->staged = 0;
+            tail->repl_offset = server.master_repl_offset +
+                                (long long)(len - remaining) + 1;
+            listAddNodeTail(server.repl_buffer_blocks,tail);
+            server.repl_buffer_mem += sizeof(replBufBlock)+size;
+            tail_node = listLast(server.repl_buffer_blocks);
+            avail = size;
+
+            /* Periodically index the new block by its replication offset,
+             * so PSYNC can find its start point without walking the whole
+             * blocks list. */
+            if (server.repl_backlog &&
+                ++server.repl_backlog->unindexed_blocks >=
+                REPL_BACKLOG_INDEX_PER_BLOCKS)
+            {
+                uint64_t encoded = htonu64(tail->repl_offset);
+                raxInsert(server.repl_backlog->blocks_index,
+                          (unsigned char*)&encoded,sizeof(encoded),
+                          tail_node,NULL);
+                server.repl_backlog->unindexed_blocks = 0;
+            }
+        }
+        if (start_node == NULL) {
+            start_node = tail_node;
+            start_pos = tail->used;
+        }
+        thislen = (avail < remaining) ? avail : remaining;
+        memcpy(tail->buf+tail->used,p,thislen);
+        tail->used += thislen;
         p += thislen;
-        server.repl_backlog_histlen += thislen;
+        remaining -= thislen;
     }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    server.repl_backlog_off = server.master_repl_offset -
-                              server.repl_backlog_histlen + 1;
+    replicationStreamAdvanced(start_node,start_pos,
+                              prev_tail_node,prev_tail_used,len);
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Wrapper for feedReplicationBuffer() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationBufferWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -163,7 +535,147 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen(o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
+    feedReplicationBuffer(p,len);
+}
+
+/* Stage verbatim master stream bytes at the tail of the shared replication
+ * buffer, after the visible stream. This is called at read time on a
+ * chained replica serving sub-replicas: the stream we relay to them is
+ * byte-identical to what we receive, so the bytes can be placed in their
+ * final location right away, before the commands they encode are applied.
+ * Staged bytes are not part of the replication history yet: they don't
+ * move the global offset and no reader can reach them until
+ * applyStagedReplicationStream() makes them visible. */
+void stageReplicationStream(char *buf, size_t len) {
+    const char *p = buf;
+    size_t remaining = len;
+
+    serverAssert(server.repl_buffer_blocks != NULL);
+    while (remaining) {
+        listNode *tail_node = listLast(server.repl_buffer_blocks);
+        replBufBlock *tail = tail_node ? listNodeValue(tail_node) : NULL;
+        size_t avail = tail ? tail->size - tail->used - tail->staged : 0;
+        size_t thislen;
+
+        if (avail == 0) {
+            size_t size = (remaining < PROTO_REPLY_CHUNK_BYTES) ?
+                          PROTO_REPLY_CHUNK_BYTES : remaining;
+            tail = zmalloc(sizeof(replBufBlock)+size);
+            size = zmalloc_usable(tail) - sizeof(replBufBlock);
+            tail->refcount = 0;
+            tail->size = size;
+            tail->used = 0;
+            tail->staged = 0;
+            tail->repl_offset = server.master_repl_offset +
+                (long long)(server.repl_stream_staged+(len-remaining)) + 1;
+            listAddNodeTail(server.repl_buffer_blocks,tail);
+            server.repl_buffer_mem += sizeof(replBufBlock)+size;
+            tail_node = listLast(server.repl_buffer_blocks);
+            avail = size;
+            /* Blocks born from staging are indexed by offset only once
+             * they enter the visible stream. */
+        }
+        if (server.repl_stream_staged_node == NULL)
+            server.repl_stream_staged_node = tail_node;
+        thislen = (avail < remaining) ? avail : remaining;
+        memcpy(tail->buf+tail->used+tail->staged,p,thislen);
+        tail->staged += thislen;
+        p += thislen;
+        remaining -= thislen;
+    }
+    server.repl_stream_staged += len;
+}
+
+/* Turn 'applied' staged bytes into visible replication stream, in reply to
+ * the main thread having applied that many bytes of master stream. The
+ * bytes are already in place, so this is pure offset accounting: per block
+ * the 'used' watermark advances over the staged region, then the usual
+ * post-feed bookkeeping attaches and schedules the sub-replicas. */
+void applyStagedReplicationStream(size_t applied) {
+    serverAssert(applied <= server.repl_stream_staged);
+    listNode *start_node = server.repl_stream_staged_node;
+    replBufBlock *start = listNodeValue(start_node);
+    size_t start_pos = start->used;
+
+    /* The visible stream ended where the staged region begins, except when
+     * the first staged block was created by staging alone: then it ended
+     * at the tail of the previous block. */
+    listNode *prev_end_node = start_node;
+    size_t prev_end_pos = start_pos;
+    if (start_pos == 0 && listPrevNode(start_node)) {
+        prev_end_node = listPrevNode(start_node);
+        prev_end_pos = ((replBufBlock*)listNodeValue(prev_end_node))->used;
+    }
+
+    listNode *ln = start_node;
+    size_t remaining = applied;
+    while (1) {
+        replBufBlock *o = listNodeValue(ln);
+        size_t thislen = (o->staged < remaining) ? o->staged : remaining;
+        o->used += thislen;
+        o->staged -= thislen;
+        remaining -= thislen;
+        /* Index blocks entering the visible stream by their offset, with
+         * the same density used by feedReplicationBuffer(). */
+        if (o->used == thislen && server.repl_backlog &&
+            ++server.repl_backlog->unindexed_blocks >=
+            REPL_BACKLOG_INDEX_PER_BLOCKS)
+        {
+            uint64_t encoded = htonu64(o->repl_offset);
+            raxInsert(server.repl_backlog->blocks_index,
+                      (unsigned char*)&encoded,sizeof(encoded),ln,NULL);
+            server.repl_backlog->unindexed_blocks = 0;
+        }
+        if (remaining == 0) break;
+        ln = listNextNode(ln);
+    }
+    server.repl_stream_staged -= applied;
+    if (server.repl_stream_staged == 0) {
+        server.repl_stream_staged_node = NULL;
+    } else {
+        server.repl_stream_staged_node =
+            ((replBufBlock*)listNodeValue(ln))->staged ? ln :
+            listNextNode(ln);
+    }
+    replicationStreamAdvanced(start_node,start_pos,
+                              prev_end_node,prev_end_pos,applied);
+}
+
+/* Drop every staged byte, releasing the buffer blocks that held nothing
+ * else. Called when the link with the master is lost: the non applied part
+ * of the stream will be received again after the PSYNC continuation, since
+ * we resume from the applied offset. */
+void discardStagedReplicationStream(void) {
+    listNode *ln = server.repl_stream_staged_node;
+
+    if (server.repl_stream_staged == 0) return;
+    while (ln) {
+        listNode *next = listNextNode(ln);
+        replBufBlock *o = listNodeValue(ln);
+        o->staged = 0;
+        if (o->used == 0) {
+            serverAssert(o->refcount == 0);
+            server.repl_buffer_mem -= sizeof(replBufBlock)+o->size;
+            listDelNode(server.repl_buffer_blocks,ln);
+        }
+        ln = next;
+    }
+    server.repl_stream_staged = 0;
+    server.repl_stream_staged_node = NULL;
+}
+
+/* Drop the reference a replica holds into the shared replication buffer,
+ * releasing the head blocks nobody references anymore. Called when a
+ * replica is freed. */
+void replicaReleaseReplicationBuffer(client *c) {
+    if (c->ref_repl_buf_node) {
+        replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+        serverAssert(o->refcount > 0);
+        o->refcount--;
+        freeReplicationBufferHead();
+    }
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
 }
 
 /* Propagate write commands to slaves, and populate the replication backlog
@@ -172,8 +684,6 @@ void feedReplicationBacklogWithObject(robj *o) {
  * stream. Instead if the instance is a slave and has sub-slaves attached,
  * we use replicationFeedSlavesFromMaster() */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
     int j, len;
     char llstr[LONG_STR_SIZE];
 
@@ -208,24 +718,19 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = ln->value;
-            if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-            addReply(slave,selectcmd);
-        }
+        /* Add the SELECT command into the shared replication buffer: the
+         * slaves reference the buffer so there is no per-slave copy to
+         * perform. */
+        feedReplicationBufferWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
+    /* Write the command to the shared replication buffer once: both the
+     * backlog and every attached slave reference the very same bytes. */
+    {
         char aux[LONG_STR_SIZE+3];
 
         /* Add the multi bulk reply length. */
@@ -233,7 +738,7 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
         len = ll2string(aux+1,sizeof(aux)-1,argc);
         aux[len+1] = '\r';
         aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
+        feedReplicationBuffer(aux,len+3);
 
         for (j = 0; j < argc; j++) {
             long objlen = stringObjectLen(argv[j]);
@@ -245,41 +750,17 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
             len = ll2string(aux+1,sizeof(aux)-1,objlen);
             aux[len+1] = '\r';
             aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
+            feedReplicationBuffer(aux,len+3);
+            feedReplicationBufferWithObject(argv[j]);
+            feedReplicationBuffer(aux+len+1,2);
         }
     }
-
-    /* Write the command to every slave. */
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        /* Don't feed slaves that are still waiting for BGSAVE to start. */
-        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
-
-        /* Add the multi bulk length. */
-        addReplyArrayLen(slave,argc);
-
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
-    }
 }
 
 /* This function is used in order to proxy what we receive from our master
  * to our sub-slaves. */
 #include <ctype.h>
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen) {
-    listNode *ln;
-    listIter li;
-
     /* Debugging: this is handy to see the stream sent from master
      * to slaves. Disabled with if(0). */
     if (0) {
@@ -290,60 +771,19 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        /* Don't feed slaves that are still waiting for BGSAVE to start. */
-        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-        addReplyProto(slave,buf,buflen);
-    }
-}
-
-void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
-    int j;
-    sds cmdrepr = sdsnew("+");
-    robj *cmdobj;
-    struct timeval tv;
-
-    gettimeofday(&tv,NULL);
-    cmdrepr = sdscatprintf(cmdrepr,"%ld.%06ld ",(long)tv.tv_sec,(long)tv.tv_usec);
-    if (c->flags & CLIENT_LUA) {
-        cmdrepr = sdscatprintf(cmdrepr,"[%d lua] ",dictid);
-    } else if (c->flags & CLIENT_UNIX_SOCKET) {
-        cmdrepr = sdscatprintf(cmdrepr,"[%d unix:%s] ",dictid,server.unixsocket);
-    } else {
-        cmdrepr = sdscatprintf(cmdrepr,"[%d %s] ",dictid,getClientPeerId(c));
-    }
-
-    for (j = 0; j < argc; j++) {
-        if (argv[j]->encoding == OBJ_ENCODING_INT) {
-            cmdrepr = sdscatprintf(cmdrepr, "\"%ld\"", (long)argv[j]->ptr);
-        } else {
-            cmdrepr = sdscatrepr(cmdrepr,(char*)argv[j]->ptr,
-                        sdslen(argv[j]->ptr));
-        }
-        if (j != argc-1)
-            cmdrepr = sdscatlen(cmdrepr," ",1);
-    }
-    cmdrepr = sdscatlen(cmdrepr,"\r\n",2);
-    cmdobj = createObject(OBJ_STRING,cmdrepr);
-
-    listRewind(monitors,&li);
-    while((ln = listNext(&li))) {
-        client *monitor = ln->value;
-        addReply(monitor,cmdobj);
-    }
-    decrRefCount(cmdobj);
+    /* The sub-slaves reference the shared replication buffer, so feeding
+     * it once feeds the backlog and all of them. */
+    UNUSED(slaves);
+    if (server.repl_backlog) feedReplicationBuffer(buf,buflen);
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
+ * specified 'offset' up to the end of the backlog: since the backlog is
+ * a window over the shared replication buffer, this just makes the slave
+ * reference the block containing 'offset', no data is copied at all. */
 long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
+    long long skip;
+    listNode *node;
 
     serverLog(LL_DEBUG, "[PSYNC] Replica request offset: %lld", offset);
 
@@ -358,37 +798,44 @@ long long addReplyReplicationBacklog(client *c, long long offset) {
              server.repl_backlog_off);
     serverLog(LL_DEBUG, "[PSYNC] History len: %lld",
              server.repl_backlog_histlen);
-    serverLog(LL_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
 
     /* Compute the amount of bytes we need to discard. */
     skip = offset - server.repl_backlog_off;
     serverLog(LL_DEBUG, "[PSYNC] Skipping: %lld", skip);
 
-    /* Point j to the oldest byte, that is actually our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    serverLog(LL_DEBUG, "[PSYNC] Index of first byte: %lld", j);
-
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
-
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
-
-        serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
+    /* Search the block containing the requested offset. The offset index
+     * has an entry every REPL_BACKLOG_INDEX_PER_BLOCKS blocks: seek the
+     * closest indexed block at or before the offset and walk forward from
+     * there, so the lookup cost is bounded whatever the backlog size.
+     * With an empty index (small backlog) we just walk from the oldest
+     * block referenced by the backlog. */
+    raxIterator ri;
+    uint64_t encoded = htonu64(offset);
+    raxStart(&ri,server.repl_backlog->blocks_index);
+    raxSeek(&ri,"<=",(unsigned char*)&encoded,sizeof(encoded));
+    node = raxNext(&ri) ? ri.data : server.repl_backlog->ref_node;
+    raxStop(&ri);
+    serverAssert(node != NULL);
+    while (node) {
+        replBufBlock *o = listNodeValue(node);
+        if (offset < o->repl_offset + (long long)o->used) break;
+        node = listNextNode(node);
+    }
+    if (node == NULL) {
+        /* The requested offset is exactly past the last byte we have:
+         * reference the end of the tail block, the slave is in sync. */
+        node = listLast(server.repl_buffer_blocks);
+        c->ref_repl_buf_node = node;
+        c->ref_block_pos = ((replBufBlock*)listNodeValue(node))->used;
+    } else {
+        replBufBlock *o = listNodeValue(node);
+        c->ref_repl_buf_node = node;
+        c->ref_block_pos = offset - o->repl_offset;
     }
+    ((replBufBlock*)listNodeValue(node))->refcount++;
+
+    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld",
+             server.repl_backlog_histlen - skip);
     return server.repl_backlog_histlen - skip;
 }
 
@@ -524,6 +971,7 @@ int masterTryPartialResynchronization(client *c) {
         return C_OK;
     }
     psync_len = addReplyReplicationBacklog(c,psync_offset);
+    if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
     serverLog(LL_NOTICE,
         "Partial resynchronization request from %s accepted. Sending %lld bytes of backlog starting from offset %lld.",
             replicationGetSlaveName(c),
@@ -726,8 +1174,15 @@ void syncCommand(client *c) {
          * capabilities of the slave that triggered the current BGSAVE. */
         if (ln && ((c->slave_capa & slave->slave_capa) == slave->slave_capa)) {
             /* Perfect, the server is already registering differences for
-             * another slave. Set the right state, and copy the buffer. */
-            copyClientOutputBuffer(c,slave);
+             * another slave: share its reference into the replication
+             * buffer, so both replicas stream from the same bytes. Note
+             * that a WAIT_BGSAVE_END slave never advances its reference,
+             * so it still points where the differences started. */
+            if (slave->ref_repl_buf_node) {
+                c->ref_repl_buf_node = slave->ref_repl_buf_node;
+                c->ref_block_pos = slave->ref_block_pos;
+                ((replBufBlock*)listNodeValue(c->ref_repl_buf_node))->refcount++;
+            }
             replicationSetupSlaveForFullResync(c,slave->psync_initial_offset);
             serverLog(LL_NOTICE,"Waiting for end of BGSAVE for SYNC");
         } else {
@@ -815,6 +1270,19 @@ void replconfCommand(client *c) {
                 c->slave_capa |= SLAVE_CAPA_EOF;
             else if (!strcasecmp(c->argv[j+1]->ptr,"psync2"))
                 c->slave_capa |= SLAVE_CAPA_PSYNC2;
+        } else if (!strcasecmp(c->argv[j]->ptr,"compress")) {
+            /* REPLCONF compress <codec>: the replica asks to receive the
+             * replication stream as compressed frames. We reply with an
+             * error if the codec is unknown or was not compiled in, so
+             * that the replica can fall back to the plain stream. */
+            compressCodec *codec = compressCodecByName(c->argv[j+1]->ptr);
+            if (codec == NULL) {
+                addReplyErrorFormat(c,"Unsupported compression codec: %s",
+                    (char*)c->argv[j+1]->ptr);
+                return;
+            }
+            c->repl_codec = codec;
+            if (c->repl_frame_buf == NULL) c->repl_frame_buf = sdsempty();
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -909,16 +1377,25 @@ void sendBulkToSlave(connection *conn) {
         }
     }
 
-    /* If the preamble was already transferred, send the RDB bulk data. */
-    lseek(slave->repldbfd,slave->repldboff,SEEK_SET);
-    buflen = read(slave->repldbfd,buf,PROTO_IOBUF_LEN);
-    if (buflen <= 0) {
-        serverLog(LL_WARNING,"Read error sending DB to replica: %s",
-            (buflen == 0) ? "premature EOF" : strerror(errno));
-        freeClient(slave);
-        return;
+    /* If the preamble was already transferred, send the RDB bulk data.
+     * Try the zero copy path first: on plain TCP connections sendfile(2)
+     * moves the file pages straight to the socket, without bouncing every
+     * chunk through this userspace buffer. TLS connections must encrypt
+     * the stream and take the buffered fallback below. */
+    nwritten = connSendFile(conn,slave->repldbfd,slave->repldboff,
+                            slave->repldbsize-slave->repldboff);
+    if (nwritten == -1 && errno == ENOTSUP) {
+        lseek(slave->repldbfd,slave->repldboff,SEEK_SET);
+        buflen = read(slave->repldbfd,buf,PROTO_IOBUF_LEN);
+        if (buflen <= 0) {
+            serverLog(LL_WARNING,"Read error sending DB to replica: %s",
+                (buflen == 0) ? "premature EOF" : strerror(errno));
+            freeClient(slave);
+            return;
+        }
+        nwritten = connWrite(conn,buf,buflen);
     }
-    if ((nwritten = connWrite(conn,buf,buflen)) == -1) {
+    if (nwritten == -1) {
         if (connGetState(conn) != CONN_STATE_CONNECTED) {
             serverLog(LL_WARNING,"Write error sending DB to replica: %s",
                 connGetLastError(conn));
@@ -936,43 +1413,106 @@ void sendBulkToSlave(connection *conn) {
     }
 }
 
-/* Remove one write handler from the list of connections waiting to be writable
- * during rdb pipe transfer. */
-void rdbPipeWriteHandlerConnRemoved(struct connection *conn) {
-    if (!connHasWriteHandler(conn))
-        return;
-    connSetWriteHandler(conn, NULL);
-    server.rdb_pipe_numconns_writing--;
-    /* if there are no more writes for now for this conn, or write error: */
-    if (server.rdb_pipe_numconns_writing == 0) {
-        if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
+void rdbPipeWriteHandler(struct connection *conn);
+void RdbPipeCleanup(void);
+
+/* Release one reference of 'chunk' on behalf of a replica that is done
+ * with it (either it was sent, or the replica dropped). Chunks are freed
+ * from the head of the list as the slowest replica moves past them, and
+ * reading from the child pipe is resumed once the buffered memory is
+ * back below repl-diskless-sync-buffer. */
+static void rdbPipeReleaseChunk(rdbPipeChunk *chunk) {
+    serverAssert(chunk->refcount > 0);
+    chunk->refcount--;
+    while (server.rdb_pipe_head && server.rdb_pipe_head->refcount == 0) {
+        rdbPipeChunk *head = server.rdb_pipe_head;
+        server.rdb_pipe_head = head->next;
+        if (server.rdb_pipe_head == NULL) server.rdb_pipe_tail = NULL;
+        server.rdb_pipe_mem -= head->used;
+        zfree(head);
+    }
+    if (!server.rdb_pipe_eof &&
+        server.rdb_pipe_mem <= server.repl_diskless_sync_buffer)
+    {
+        if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE,
+                              rdbPipeReadHandler,NULL) == AE_ERR)
+        {
             serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
         }
     }
 }
 
+/* If the child closed its end of the pipe and every buffered chunk was
+ * delivered, the transfer is complete: clean up after it. Returns 1 if
+ * the cleanup was performed. */
+static int rdbPipeCheckDone(void) {
+    if (!server.rdb_pipe_eof || server.rdb_pipe_head != NULL) return 0;
+    int stillUp = 0;
+    for (int i = 0; i < server.rdb_pipe_numconns; i++)
+        if (server.rdb_pipe_conns[i]) stillUp++;
+    serverLog(LL_WARNING,"Diskless rdb transfer, done reading from pipe, %d replicas still up.", stillUp);
+    RdbPipeCleanup();
+    return 1;
+}
+
+/* Send to 'slave' as much as possible of the chunks it still references.
+ * Installs or removes the connection write handler as needed. Returns
+ * C_ERR if the client was freed because of a write error. */
+static int rdbPipeFlushSlave(client *slave) {
+    connection *conn = slave->conn;
+
+    while (slave->rdb_pipe_chunk) {
+        rdbPipeChunk *chunk = slave->rdb_pipe_chunk;
+        int nwritten = connWrite(conn, chunk->buf + slave->repldboff,
+                                 chunk->used - slave->repldboff);
+        if (nwritten == -1) {
+            if (connGetState(conn) == CONN_STATE_CONNECTED)
+                break; /* Equivalent to EAGAIN. */
+            serverLog(LL_WARNING,"Diskless rdb transfer, write error sending DB to replica: %s",
+                connGetLastError(conn));
+            freeClient(slave);
+            return C_ERR;
+        }
+        slave->repldboff += nwritten;
+        server.stat_net_output_bytes += nwritten;
+        if (slave->repldboff < (off_t)chunk->used)
+            break; /* Socket buffer is full. */
+        slave->rdb_pipe_chunk = chunk->next;
+        slave->repldboff = 0;
+        rdbPipeReleaseChunk(chunk);
+    }
+    if (slave->rdb_pipe_chunk) {
+        connSetWriteHandler(conn, rdbPipeWriteHandler);
+    } else {
+        connSetWriteHandler(conn, NULL);
+        rdbPipeCheckDone();
+    }
+    return C_OK;
+}
+
+/* Called from freeClient() when a replica that is the target of a diskless
+ * rdb transfer is removed: release every chunk it still referenced. */
+void rdbPipeWriteHandlerConnRemoved(struct connection *conn) {
+    client *slave = connGetPrivateData(conn);
+    rdbPipeChunk *chunk = slave->rdb_pipe_chunk;
+
+    if (connHasWriteHandler(conn))
+        connSetWriteHandler(conn, NULL);
+    slave->rdb_pipe_chunk = NULL;
+    slave->repldboff = 0;
+    while (chunk) {
+        rdbPipeChunk *next = chunk->next;
+        rdbPipeReleaseChunk(chunk);
+        chunk = next;
+    }
+    rdbPipeCheckDone();
+}
+
 /* Called in diskless master during transfer of data from the rdb pipe, when
  * the replica becomes writable again. */
 void rdbPipeWriteHandler(struct connection *conn) {
-    serverAssert(server.rdb_pipe_bufflen>0);
     client *slave = connGetPrivateData(conn);
-    int nwritten;
-    if ((nwritten = connWrite(conn, server.rdb_pipe_buff + slave->repldboff,
-                              server.rdb_pipe_bufflen - slave->repldboff)) == -1)
-    {
-        if (connGetState(conn) == CONN_STATE_CONNECTED)
-            return; /* equivalent to EAGAIN */
-        serverLog(LL_WARNING,"Write error sending DB to replica: %s",
-            connGetLastError(conn));
-        freeClient(slave);
-        return;
-    } else {
-        slave->repldboff += nwritten;
-        server.stat_net_output_bytes += nwritten;
-        if (slave->repldboff < server.rdb_pipe_bufflen)
-            return; /* more data to write.. */
-    }
-    rdbPipeWriteHandlerConnRemoved(conn);
+    rdbPipeFlushSlave(slave);
 }
 
 /* When the the pipe serving diskless rdb transfer is drained (write end was
@@ -983,10 +1523,14 @@ void RdbPipeCleanup() {
     zfree(server.rdb_pipe_conns);
     server.rdb_pipe_conns = NULL;
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
-    zfree(server.rdb_pipe_buff);
-    server.rdb_pipe_buff = NULL;
-    server.rdb_pipe_bufflen = 0;
+    while (server.rdb_pipe_head) {
+        rdbPipeChunk *head = server.rdb_pipe_head;
+        server.rdb_pipe_head = head->next;
+        zfree(head);
+    }
+    server.rdb_pipe_tail = NULL;
+    server.rdb_pipe_mem = 0;
+    server.rdb_pipe_eof = 0;
 
     /* Since we're avoiding to detect the child exited as long as the pipe is
      * not drained, so now is the time to check. */
@@ -999,13 +1543,12 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
     UNUSED(clientData);
     UNUSED(eventLoop);
     int i;
-    if (!server.rdb_pipe_buff)
-        server.rdb_pipe_buff = zmalloc(PROTO_IOBUF_LEN);
-    serverAssert(server.rdb_pipe_numconns_writing==0);
 
     while (1) {
-        server.rdb_pipe_bufflen = read(fd, server.rdb_pipe_buff, PROTO_IOBUF_LEN);
-        if (server.rdb_pipe_bufflen < 0) {
+        rdbPipeChunk *chunk = zmalloc(sizeof(rdbPipeChunk)+PROTO_IOBUF_LEN);
+        ssize_t nread = read(fd, chunk->buf, PROTO_IOBUF_LEN);
+        if (nread < 0) {
+            zfree(chunk);
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 return;
             serverLog(LL_WARNING,"Diskless rdb transfer, read error sending DB to replicas: %s", strerror(errno));
@@ -1021,51 +1564,46 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
             return;
         }
 
-        if (server.rdb_pipe_bufflen == 0) {
-            /* EOF - write end was closed. */
-            int stillUp = 0;
+        if (nread == 0) {
+            /* EOF - write end was closed. Replicas that are behind keep
+             * draining the buffered chunks at their own pace, and the
+             * cleanup happens when the last one is done. */
+            zfree(chunk);
+            server.rdb_pipe_eof = 1;
             aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
-            for (i=0; i < server.rdb_pipe_numconns; i++)
-            {
-                connection *conn = server.rdb_pipe_conns[i];
-                if (!conn)
-                    continue;
-                stillUp++;
-            }
-            serverLog(LL_WARNING,"Diskless rdb transfer, done reading from pipe, %d replicas still up.", stillUp);
-            RdbPipeCleanup();
+            rdbPipeCheckDone();
             return;
         }
 
+        /* Append the chunk to the broadcast list and reference it on
+         * behalf of every live replica: ones that were fully caught up
+         * start from it, the lagging ones will get to it via the list. */
+        chunk->next = NULL;
+        chunk->used = nread;
+        chunk->refcount = 0;
+        if (server.rdb_pipe_tail)
+            server.rdb_pipe_tail->next = chunk;
+        else
+            server.rdb_pipe_head = chunk;
+        server.rdb_pipe_tail = chunk;
+        server.rdb_pipe_mem += chunk->used;
+
         int stillAlive = 0;
         for (i=0; i < server.rdb_pipe_numconns; i++)
         {
-            int nwritten;
             connection *conn = server.rdb_pipe_conns[i];
             if (!conn)
                 continue;
-
             client *slave = connGetPrivateData(conn);
-            if ((nwritten = connWrite(conn, server.rdb_pipe_buff, server.rdb_pipe_bufflen)) == -1) {
-                if (connGetState(conn) != CONN_STATE_CONNECTED) {
-                    serverLog(LL_WARNING,"Diskless rdb transfer, write error sending DB to replica: %s",
-                        connGetLastError(conn));
-                    freeClient(slave);
-                    server.rdb_pipe_conns[i] = NULL;
-                    continue;
-                }
-                /* An error and still in connected state, is equivalent to EAGAIN */
+            chunk->refcount++;
+            if (slave->rdb_pipe_chunk == NULL) {
+                /* The replica was fully caught up (or is starting the
+                 * transfer): point it at the new chunk. */
+                slave->rdb_pipe_chunk = chunk;
                 slave->repldboff = 0;
-            } else {
-                slave->repldboff = nwritten;
-                server.stat_net_output_bytes += nwritten;
-            }
-            /* If we were unable to write all the data to one of the replicas,
-             * setup write handler (and disable pipe read handler, below) */
-            if (nwritten != server.rdb_pipe_bufflen) {
-                server.rdb_pipe_numconns_writing++;
-                connSetWriteHandler(conn, rdbPipeWriteHandler);
             }
+            if (rdbPipeFlushSlave(slave) == C_ERR)
+                continue; /* Write error: the client is gone. */
             stillAlive++;
         }
 
@@ -1073,11 +1611,15 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
             serverLog(LL_WARNING,"Diskless rdb transfer, last replica dropped, killing fork child.");
             killRDBChild();
             RdbPipeCleanup();
+            aeDeleteFileEvent(server.el, fd, AE_READABLE);
+            return;
         }
-        /*  Remove the pipe read handler if at least one write handler was set. */
-        if (server.rdb_pipe_numconns_writing || stillAlive == 0) {
+
+        /* Stop reading from the child when too much memory is buffered:
+         * reading resumes as the lagging replicas release chunks. */
+        if (server.rdb_pipe_mem > server.repl_diskless_sync_buffer) {
             aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
-            break;
+            return;
         }
     }
 }
@@ -1268,6 +1810,12 @@ void replicationCreateMasterClient(connection *conn, int dbid) {
     if (server.master->reploff == -1)
         server.master->flags |= CLIENT_PRE_PSYNC;
     if (dbid != -1) selectDb(server.master,dbid);
+    /* If the master accepted REPLCONF compress during the handshake the
+     * stream arrives as compressed frames: see readCompressedReplStream(). */
+    if (conn && server.repl_stream_codec) {
+        server.master->repl_codec = server.repl_stream_codec;
+        server.master->repl_frame_buf = sdsempty();
+    }
 }
 
 /* This function will try to re-enable the AOF file after the
@@ -1311,8 +1859,13 @@ redisDb *disklessLoadMakeBackups(void) {
     redisDb *backups = zmalloc(sizeof(redisDb)*server.dbnum);
     for (int i=0; i<server.dbnum; i++) {
         backups[i] = server.db[i];
-        server.db[i].dict = dictCreate(&dbDictType,NULL);
+        server.db[i].dict = zmalloc(sizeof(dict*)*server.db_dict_shards);
+        for (int j = 0; j < server.db_dict_shards; j++)
+            server.db[i].dict[j] = dictCreate(&dbDictType,NULL);
         server.db[i].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[i].expires_index = raxNew();
+        server.db[i].hexpires = dictCreate(&hashExpiresDictType,NULL);
+        server.db[i].hexpires_index = raxNew();
     }
     return backups;
 }
@@ -1333,16 +1886,26 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
         /* Restore. */
         emptyDbGeneric(server.db,-1,empty_db_flags,replicationEmptyDbCallback);
         for (int i=0; i<server.dbnum; i++) {
-            dictRelease(server.db[i].dict);
+            for (int j = 0; j < server.db_dict_shards; j++)
+                dictRelease(server.db[i].dict[j]);
+            zfree(server.db[i].dict);
             dictRelease(server.db[i].expires);
+            raxFree(server.db[i].expires_index);
+            dictRelease(server.db[i].hexpires);
+            raxFree(server.db[i].hexpires_index);
             server.db[i] = backup[i];
         }
     } else {
         /* Delete. */
         emptyDbGeneric(backup,-1,empty_db_flags,replicationEmptyDbCallback);
         for (int i=0; i<server.dbnum; i++) {
-            dictRelease(backup[i].dict);
+            for (int j = 0; j < server.db_dict_shards; j++)
+                dictRelease(backup[i].dict[j]);
+            zfree(backup[i].dict);
             dictRelease(backup[i].expires);
+            raxFree(backup[i].expires_index);
+            dictRelease(backup[i].hexpires);
+            raxFree(backup[i].hexpires_index);
         }
     }
     zfree(backup);
@@ -1366,14 +1929,25 @@ void readSyncBulkPayload(connection *conn) {
     static int usemark = 0;
 
     /* If repl_transfer_size == -1 we still have to read the bulk length
-     * from the master reply. */
+     * from the master reply. The read is non blocking: on a partial line
+     * we just return into the event loop and resume at the next readable
+     * event. */
     if (server.repl_transfer_size == -1) {
-        if (connSyncReadLine(conn,buf,1024,server.repl_syncio_timeout*1000) == -1) {
+        sds line;
+        int res = replHandshakeReadLine(conn,&line);
+
+        if (res == READLINE_AGAIN) return;
+        if (res == READLINE_ERR) {
             serverLog(LL_WARNING,
                 "I/O error reading bulk count from MASTER: %s",
-                strerror(errno));
+                connGetLastError(conn));
             goto error;
         }
+        size_t linelen = sdslen(line);
+        if (linelen > sizeof(buf)-1) linelen = sizeof(buf)-1;
+        memcpy(buf,line,linelen);
+        buf[linelen] = '\0';
+        sdsfree(line);
 
         if (buf[0] == '-') {
             serverLog(LL_WARNING,
@@ -1676,12 +2250,65 @@ error:
     return;
 }
 
+/* The replication handshake is driven by readable events on a non
+ * blocking socket, but a reply line can arrive in multiple pieces if the
+ * master is slow or paging: partial lines are accumulated here between
+ * successive invocations of the handler, so that the event loop is never
+ * stalled waiting for the missing bytes. */
+static sds repl_handshake_line = NULL;
+
+static void replHandshakeLineReset(void) {
+    sdsfree(repl_handshake_line);
+    repl_handshake_line = NULL;
+}
+
+/* Try to complete the reading of a protocol line from 'conn' without
+ * ever blocking. Returns:
+ *
+ * READLINE_OK:    a full line arrived, returned in '*dst' as an sds with
+ *                 the final newline (and preceding \r, if any) stripped.
+ * READLINE_AGAIN: the line is not complete yet: the caller must return
+ *                 into the event loop and call again on the next
+ *                 readable event.
+ * READLINE_ERR:   I/O error or connection closed, see
+ *                 connGetLastError(). */
+static int replHandshakeReadLine(connection *conn, sds *dst) {
+    if (repl_handshake_line == NULL) repl_handshake_line = sdsempty();
+    while(1) {
+        char ch;
+        /* Read one byte at a time: overshooting past the newline would
+         * swallow bytes belonging to what follows the line, like the
+         * first bytes of the RDB payload after the bulk count. */
+        int nread = connRead(conn,&ch,1);
+        if (nread == -1) {
+            if (connGetState(conn) == CONN_STATE_CONNECTED)
+                return READLINE_AGAIN;
+            return READLINE_ERR;
+        } else if (nread == 0) {
+            return READLINE_ERR;
+        }
+        if (ch == '\n') {
+            sds line = repl_handshake_line;
+            repl_handshake_line = NULL;
+            if (sdslen(line) && line[sdslen(line)-1] == '\r')
+                sdsrange(line,0,-2);
+            server.repl_transfer_lastio = server.unixtime;
+            *dst = line;
+            return READLINE_OK;
+        }
+        repl_handshake_line = sdscatlen(repl_handshake_line,&ch,1);
+        if (sdslen(repl_handshake_line) > 1024) return READLINE_ERR;
+    }
+}
+
 /* Send a synchronous command to the master. Used to send AUTH and
  * REPLCONF commands before starting the replication with SYNC.
  *
  * The command returns an sds string representing the result of the
- * operation. On error the first byte is a "-".
- */
+ * operation. On error the first byte is a "-". With SYNC_CMD_READ the
+ * function can also return NULL, meaning the reply did not arrive in
+ * full yet: the caller must return into the event loop and retry on the
+ * next readable event, as the read never blocks. */
 #define SYNC_CMD_READ (1<<0)
 #define SYNC_CMD_WRITE (1<<1)
 #define SYNC_CMD_FULL (SYNC_CMD_READ|SYNC_CMD_WRITE)
@@ -1723,18 +2350,19 @@ char *sendSynchronousCommand(int flags, connection *conn, ...) {
         sdsfree(cmd);
     }
 
-    /* Read the reply from the server. */
+    /* Read the reply from the server, without ever blocking: a partial
+     * line makes the function return NULL, and the caller retries on the
+     * next readable event. */
     if (flags & SYNC_CMD_READ) {
-        char buf[256];
+        sds line;
+        int res = replHandshakeReadLine(conn,&line);
 
-        if (connSyncReadLine(conn,buf,sizeof(buf),server.repl_syncio_timeout*1000)
-            == -1)
-        {
+        if (res == READLINE_AGAIN) return NULL;
+        if (res == READLINE_ERR) {
             return sdscatprintf(sdsempty(),"-Reading from master: %s",
-                    strerror(errno));
+                    connGetLastError(conn));
         }
-        server.repl_transfer_lastio = server.unixtime;
-        return sdsnew(buf);
+        return line;
     }
     return NULL;
 }
@@ -1830,6 +2458,7 @@ int slaveTryPartialResynchronization(connection *conn, int read_reply) {
 
     /* Reading half */
     reply = sendSynchronousCommand(SYNC_CMD_READ,conn,NULL);
+    if (reply == NULL) return PSYNC_WAIT_REPLY; /* Partial reply. */
     if (sdslen(reply) == 0) {
         /* The master may send empty newlines after it receives PSYNC
          * and before to reply, just to keep the connection alive. */
@@ -1991,6 +2620,7 @@ void syncWithMaster(connection *conn) {
     /* Receive the PONG command. */
     if (server.repl_state == REPL_STATE_RECEIVE_PONG) {
         err = sendSynchronousCommand(SYNC_CMD_READ,conn,NULL);
+        if (err == NULL) return; /* Wait for a complete reply. */
 
         /* We accept only two replies as valid, a positive +PONG reply
          * (we just check for "+") or an authentication error.
@@ -2033,6 +2663,7 @@ void syncWithMaster(connection *conn) {
     /* Receive AUTH reply. */
     if (server.repl_state == REPL_STATE_RECEIVE_AUTH) {
         err = sendSynchronousCommand(SYNC_CMD_READ,conn,NULL);
+        if (err == NULL) return; /* Wait for a complete reply. */
         if (err[0] == '-') {
             serverLog(LL_WARNING,"Unable to AUTH to MASTER: %s",err);
             sdsfree(err);
@@ -2062,6 +2693,7 @@ void syncWithMaster(connection *conn) {
     /* Receive REPLCONF listening-port reply. */
     if (server.repl_state == REPL_STATE_RECEIVE_PORT) {
         err = sendSynchronousCommand(SYNC_CMD_READ,conn,NULL);
+        if (err == NULL) return; /* Wait for a complete reply. */
         /* Ignore the error if any, not all the Redis versions support
          * REPLCONF listening-port. */
         if (err[0] == '-') {
@@ -2093,6 +2725,7 @@ void syncWithMaster(connection *conn) {
     /* Receive REPLCONF ip-address reply. */
     if (server.repl_state == REPL_STATE_RECEIVE_IP) {
         err = sendSynchronousCommand(SYNC_CMD_READ,conn,NULL);
+        if (err == NULL) return; /* Wait for a complete reply. */
         /* Ignore the error if any, not all the Redis versions support
          * REPLCONF listening-port. */
         if (err[0] == '-') {
@@ -2121,6 +2754,7 @@ void syncWithMaster(connection *conn) {
     /* Receive CAPA reply. */
     if (server.repl_state == REPL_STATE_RECEIVE_CAPA) {
         err = sendSynchronousCommand(SYNC_CMD_READ,conn,NULL);
+        if (err == NULL) return; /* Wait for a complete reply. */
         /* Ignore the error if any, not all the Redis versions support
          * REPLCONF capa. */
         if (err[0] == '-') {
@@ -2128,6 +2762,43 @@ void syncWithMaster(connection *conn) {
                                   "REPLCONF capa: %s", err);
         }
         sdsfree(err);
+        server.repl_state = REPL_STATE_SEND_COMPRESS;
+    }
+
+    /* Skip REPLCONF compress if stream compression is not configured. */
+    if (server.repl_state == REPL_STATE_SEND_COMPRESS &&
+        server.repl_stream_compression == -1)
+    {
+        server.repl_stream_codec = NULL;
+        server.repl_state = REPL_STATE_SEND_PSYNC;
+    }
+
+    /* Ask the master to compress the replication stream. */
+    if (server.repl_state == REPL_STATE_SEND_COMPRESS) {
+        compressCodec *codec =
+            compressCodecById(server.repl_stream_compression);
+        err = sendSynchronousCommand(SYNC_CMD_WRITE,conn,"REPLCONF",
+                "compress",codec->name,NULL);
+        if (err) goto write_error;
+        sdsfree(err);
+        server.repl_state = REPL_STATE_RECEIVE_COMPRESS;
+        return;
+    }
+
+    /* Receive REPLCONF compress reply: an error means the master does not
+     * know the option or the codec, and the plain stream is used. */
+    if (server.repl_state == REPL_STATE_RECEIVE_COMPRESS) {
+        err = sendSynchronousCommand(SYNC_CMD_READ,conn,NULL);
+        if (err == NULL) return; /* Wait for a complete reply. */
+        if (err[0] == '-') {
+            serverLog(LL_NOTICE,"(Non critical) Master does not support "
+                                "the compressed replication stream: %s", err);
+            server.repl_stream_codec = NULL;
+        } else {
+            server.repl_stream_codec =
+                compressCodecById(server.repl_stream_compression);
+        }
+        sdsfree(err);
         server.repl_state = REPL_STATE_SEND_PSYNC;
     }
 
@@ -2228,6 +2899,7 @@ error:
     if (dfd != -1) close(dfd);
     connClose(conn);
     server.repl_transfer_s = NULL;
+    replHandshakeLineReset();
     if (server.repl_transfer_fd != -1)
         close(server.repl_transfer_fd);
     if (server.repl_transfer_tmpfile)
@@ -2267,6 +2939,7 @@ int connectWithMaster(void) {
 void undoConnectWithMaster(void) {
     connClose(server.repl_transfer_s);
     server.repl_transfer_s = NULL;
+    replHandshakeLineReset();
 }
 
 /* Abort the async download of the bulk dataset while SYNC-ing with master.
@@ -2398,6 +3071,10 @@ void replicationHandleMasterDisconnection(void) {
                               REDISMODULE_SUBEVENT_MASTER_LINK_DOWN,
                               NULL);
 
+    /* Bytes of master stream staged but never applied will be received
+     * again after the PSYNC continuation: drop them. */
+    discardStagedReplicationStream();
+
     server.master = NULL;
     server.repl_state = REPL_STATE_CONNECT;
     server.repl_down_since = server.unixtime;
@@ -2646,6 +3323,15 @@ void replicationResurrectCachedMaster(connection *conn) {
     server.repl_state = REPL_STATE_CONNECTED;
     server.repl_down_since = 0;
 
+    /* The stream compression negotiated during the new handshake replaces
+     * whatever the previous connection used. A partially read frame, if
+     * any, belonged to the old connection: the master retransmits those
+     * stream bytes in fresh frames, so it is just discarded. */
+    server.master->repl_codec = server.repl_stream_codec;
+    if (server.master->repl_frame_buf) sdsclear(server.master->repl_frame_buf);
+    if (server.master->repl_codec && server.master->repl_frame_buf == NULL)
+        server.master->repl_frame_buf = sdsempty();
+
     /* Re-add to the list of clients. */
     linkClient(server.master);
     if (connSetReadHandler(server.master->conn, readQueryFromClient)) {
@@ -2847,12 +3533,21 @@ void waitCommand(client *c) {
         return;
     }
 
-    /* Otherwise block the client and put it into our list of clients
-     * waiting for ack from slaves. */
+    /* Otherwise block the client and index it by the offset it is
+     * waiting for, so that the ack processing can unblock exactly the
+     * clients whose offset was reached. */
     c->bpop.timeout = timeout;
     c->bpop.reploffset = offset;
     c->bpop.numreplicas = numreplicas;
-    listAddNodeTail(server.clients_waiting_acks,c);
+    uint64_t key = htonu64(offset);
+    list *bucket = raxFind(server.clients_waiting_acks,
+                           (unsigned char*)&key,sizeof(key));
+    if (bucket == raxNotFound) {
+        bucket = listCreate();
+        raxInsert(server.clients_waiting_acks,
+                  (unsigned char*)&key,sizeof(key),bucket,NULL);
+    }
+    listAddNodeTail(bucket,c);
     blockClient(c,BLOCKED_WAIT);
 
     /* Make sure that the server will send an ACK request to all the slaves
@@ -2861,48 +3556,105 @@ void waitCommand(client *c) {
 }
 
 /* This is called by unblockClient() to perform the blocking op type
- * specific cleanup. We just remove the client from the list of clients
- * waiting for replica acks. Never call it directly, call unblockClient()
- * instead. */
+ * specific cleanup. We just remove the client from the bucket of clients
+ * waiting for its replica ack offset. Never call it directly, call
+ * unblockClient() instead. */
 void unblockClientWaitingReplicas(client *c) {
-    listNode *ln = listSearchKey(server.clients_waiting_acks,c);
+    uint64_t key = htonu64(c->bpop.reploffset);
+    list *bucket = raxFind(server.clients_waiting_acks,
+                           (unsigned char*)&key,sizeof(key));
+    serverAssert(bucket != raxNotFound);
+    listNode *ln = listSearchKey(bucket,c);
     serverAssert(ln != NULL);
-    listDelNode(server.clients_waiting_acks,ln);
+    listDelNode(bucket,ln);
+    if (listLength(bucket) == 0) {
+        raxRemove(server.clients_waiting_acks,
+                  (unsigned char*)&key,sizeof(key),NULL);
+        listRelease(bucket);
+    }
 }
 
 /* Check if there are clients blocked in WAIT that can be unblocked since
- * we received enough ACKs from slaves. */
+ * we received enough ACKs from slaves.
+ *
+ * Instead of counting the acks for the offset of every waiting client,
+ * we sort the replica ack offsets once: a client waiting for N replicas
+ * is satisfied exactly when the Nth best ack offset reached its target
+ * offset. Since the waiting clients are indexed by target offset, we
+ * visit them in ascending order and stop at the first offset no replica
+ * acknowledged yet, so a pass costs the number of clients actually
+ * unblocked, not the number of clients waiting. */
 void processClientsWaitingReplicas(void) {
-    long long last_offset = 0;
-    int last_numreplicas = 0;
-
     listIter li;
     listNode *ln;
 
-    listRewind(server.clients_waiting_acks,&li);
+    if (raxSize(server.clients_waiting_acks) == 0) return;
+    int numslaves = listLength(server.slaves);
+    if (numslaves == 0) return;
+
+    /* Collect the ack offsets of the online replicas, best first. */
+    long long *acks = zmalloc(sizeof(long long)*numslaves);
+    int numacks = 0;
+    listRewind(server.slaves,&li);
     while((ln = listNext(&li))) {
-        client *c = ln->value;
-
-        /* Every time we find a client that is satisfied for a given
-         * offset and number of replicas, we remember it so the next client
-         * may be unblocked without calling replicationCountAcksByOffset()
-         * if the requested offset / replicas were equal or less. */
-        if (last_offset && last_offset > c->bpop.reploffset &&
-                           last_numreplicas > c->bpop.numreplicas)
-        {
-            unblockClient(c);
-            addReplyLongLong(c,last_numreplicas);
-        } else {
-            int numreplicas = replicationCountAcksByOffset(c->bpop.reploffset);
+        client *slave = ln->value;
+
+        if (slave->replstate != SLAVE_STATE_ONLINE) continue;
+        int i = numacks++;
+        while (i > 0 && acks[i-1] < slave->repl_ack_off) {
+            acks[i] = acks[i-1];
+            i--;
+        }
+        acks[i] = slave->repl_ack_off;
+    }
+    if (numacks == 0) {
+        zfree(acks);
+        return;
+    }
+
+    /* Collect the satisfied clients: we can't unblock them while
+     * iterating the index, since unblocking removes them from it. */
+    list *satisfied = NULL;
+    raxIterator ri;
+    raxStart(&ri,server.clients_waiting_acks);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri)) {
+        uint64_t key;
+        memcpy(&key,ri.key,sizeof(key));
+        long long offset = ntohu64(key);
+
+        if (offset > acks[0]) break; /* Nobody acked this offset yet. */
+
+        /* Number of replicas that acknowledged this offset. */
+        int count = 0;
+        while (count < numacks && acks[count] >= offset) count++;
 
-            if (numreplicas >= c->bpop.numreplicas) {
-                last_offset = c->bpop.reploffset;
-                last_numreplicas = numreplicas;
-                unblockClient(c);
-                addReplyLongLong(c,numreplicas);
+        list *bucket = ri.data;
+        listRewind(bucket,&li);
+        while((ln = listNext(&li))) {
+            client *c = ln->value;
+
+            if (c->bpop.numreplicas <= count) {
+                if (satisfied == NULL) satisfied = listCreate();
+                listAddNodeTail(satisfied,c);
             }
         }
     }
+    raxStop(&ri);
+
+    if (satisfied) {
+        listRewind(satisfied,&li);
+        while((ln = listNext(&li))) {
+            client *c = ln->value;
+            int count = 0;
+            while (count < numacks && acks[count] >= c->bpop.reploffset)
+                count++;
+            unblockClient(c);
+            addReplyLongLong(c,count);
+        }
+        listRelease(satisfied);
+    }
+    zfree(acks);
 }
 
 /* Return the slave replication offset for this instance, that is
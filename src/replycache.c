@@ -0,0 +1,534 @@
+/* replycache.c -- Serialized reply cache for hot immutable reads.
+ *
+ * In read-heavy workloads a handful of keys often serves a large share
+ * of all the GETs while changing only rarely. Replying to those GETs
+ * still re-runs the bulk reply encoding on every call: the length is
+ * converted to digits, the "$<len>\r\n" header, the payload and the
+ * trailing CRLF are appended as separate pieces. This file caches the
+ * fully encoded RESP bulk reply of such keys, so that subsequent GETs
+ * emit one prebuilt contiguous buffer: a single memcpy for small
+ * payloads, or a zero-copy reference flushed by the writev() chain for
+ * large ones (see _addReplyBlobRangeToList()).
+ *
+ * The cache is invalidated through the same hooks that keep WATCH and
+ * client side caching coherent: signalModifiedKey() drops the entry of a
+ * written key, signalFlushedDb() drops a whole database, and the
+ * dbSyncDelete()/dbAsyncDelete() chokepoints cover deletions performed
+ * without a modification signal (expiration, eviction). A bulk reply is
+ * encoded identically in RESP2 and RESP3, so entries are shared by
+ * clients of both protocols.
+ *
+ * The number of cached replies is bounded by the reply-cache-size
+ * option (0, the default, disables the feature): above the limit a
+ * random entry is evicted, which over time keeps the frequently read
+ * keys resident since they are re-inserted on their next GET.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* Payloads larger than this are not cached: the cache stores a private
+ * copy of the value, and for big strings addReply() already avoids the
+ * copy by referencing the value object directly. */
+#define REPLY_CACHE_MAX_VALUE (64*1024)
+
+/* One dict per database, created lazily, mapping the key name (an owned
+ * sds copy) to a string object holding the complete "$<len>\r\n...\r\n"
+ * reply. The robj is refcounted, so a cached reply still referenced by
+ * the output chain of some client survives its own invalidation. */
+static dict **reply_cache = NULL;
+static unsigned long reply_cache_entries = 0;
+
+static void replyCacheValDestructor(void *privdata, void *val) {
+    DICT_NOTUSED(privdata);
+    decrRefCount(val);
+}
+
+static dictType replyCacheDictType = {
+    dictSdsHash,               /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictSdsKeyCompare,         /* key compare */
+    dictSdsDestructor,         /* key destructor */
+    replyCacheValDestructor,   /* val destructor */
+    NULL,                      /* key inline size */
+    NULL                       /* key inline copy */
+};
+
+static void cmdCacheInit(void);
+
+void replyCacheInit(void) {
+    reply_cache = zcalloc(sizeof(dict*)*server.dbnum);
+    cmdCacheInit();
+}
+
+/* Emit the cached (or freshly cached) bulk reply for the GET of 'key',
+ * whose current value is 'o'. Returns 1 if the reply was emitted, 0 if
+ * the feature is disabled or the value is not eligible and the caller
+ * must produce the reply itself. */
+int replyCacheAddReply(client *c, redisDb *db, sds key, robj *o) {
+    if (server.reply_cache_size == 0 || reply_cache == NULL) return 0;
+    if (o->encoding != OBJ_ENCODING_RAW && o->encoding != OBJ_ENCODING_EMBSTR)
+        return 0;
+    if (sdslen(o->ptr) > REPLY_CACHE_MAX_VALUE) return 0;
+
+    dict *d = reply_cache[db->id];
+    dictEntry *de = d ? dictFind(d,key) : NULL;
+    if (de) {
+        server.stat_reply_cache_hits++;
+        addReply(c,dictGetVal(de));
+        return 1;
+    }
+
+    /* First GET of an eligible key: encode the reply once and remember
+     * it. The header is built exactly like addReplyBulkLen() would. */
+    if (d == NULL)
+        d = reply_cache[db->id] = dictCreate(&replyCacheDictType,NULL);
+    if (dictSize(d) >= (unsigned long)server.reply_cache_size) {
+        dictEntry *victim = dictGetRandomKey(d);
+        if (victim) {
+            dictDelete(d,dictGetKey(victim));
+            reply_cache_entries--;
+        }
+    }
+
+    char hdr[32];
+    size_t hdrlen = 0, len = sdslen(o->ptr);
+    hdr[hdrlen++] = '$';
+    hdrlen += ll2string(hdr+hdrlen,sizeof(hdr)-hdrlen,len);
+    hdr[hdrlen++] = '\r';
+    hdr[hdrlen++] = '\n';
+
+    sds proto = sdsnewlen(SDS_NOINIT,hdrlen+len+2);
+    memcpy(proto,hdr,hdrlen);
+    memcpy(proto+hdrlen,o->ptr,len);
+    memcpy(proto+hdrlen+len,"\r\n",2);
+    robj *reply = createObject(OBJ_STRING,proto);
+
+    serverAssert(dictAdd(d,sdsdup(key),reply) == DICT_OK);
+    reply_cache_entries++;
+    addReply(c,reply);
+    return 1;
+}
+
+/* Drop the cached reply of 'key', if any. Called on every key
+ * modification and deletion, so the empty-cache case must stay cheap. */
+static void cmdCacheInvalidate(redisDb *db, robj *key);
+static void cmdCacheFlush(int dbid);
+
+void replyCacheInvalidate(redisDb *db, robj *key) {
+    cmdCacheInvalidate(db,key);
+    if (reply_cache_entries == 0) return;
+    dict *d = reply_cache[db->id];
+    if (d && dictDelete(d,key->ptr) == DICT_OK) reply_cache_entries--;
+}
+
+/* Drop every cached reply of database 'dbid', or of all the databases if
+ * 'dbid' is -1. Used on FLUSHDB/FLUSHALL/SWAPDB and when the feature is
+ * reconfigured at runtime. */
+void replyCacheFlush(int dbid) {
+    cmdCacheFlush(dbid);
+    if (reply_cache == NULL || reply_cache_entries == 0) return;
+    for (int j = 0; j < server.dbnum; j++) {
+        if (dbid != -1 && dbid != j) continue;
+        if (reply_cache[j] == NULL) continue;
+        reply_cache_entries -= dictSize(reply_cache[j]);
+        dictRelease(reply_cache[j]);
+        reply_cache[j] = NULL;
+    }
+}
+
+/* Number of currently cached replies, for introspection (INFO). */
+unsigned long replyCacheNumEntries(void) {
+    return reply_cache_entries;
+}
+
+/* ------------------------- Command result cache ---------------------------
+ *
+ * The per-key cache above only understands GET. Replicas serving
+ * dashboards see a different pattern: the same heavy deterministic read
+ * (a ZREVRANGE of a leaderboard, an LRANGE of a feed) repeated thousands
+ * of times between two writes of the replication stream. The second
+ * layer below caches the complete encoded reply of such commands, keyed
+ * by the full argument vector (plus database and protocol version), so
+ * repeats cost a dict probe and one buffer append instead of walking the
+ * data structure again.
+ *
+ * Eligible commands are the read-only ones not flagged random (which
+ * excludes TTL, OBJECT, SCAN and friends whose output does not only
+ * depend on the keyspace) that access at least one key: the accessed
+ * keys, obtained from the command table, index the entries so that the
+ * signalModifiedKey() hook drops every result computed from a written
+ * key. Keys with a TTL are never cached: on a replica a logically
+ * expired value must stop being served before the DEL of the master
+ * arrives. Results are captured right out of the client output buffer
+ * bracketing the call(), so any reply shape is supported without
+ * cooperation from the command implementations.
+ *
+ * Entries form an LRU list and total memory is bounded by the
+ * reply-cache-command-bytes option (0, the default, disables the
+ * layer). */
+
+typedef struct cmdCacheEntry {
+    sds cmdkey;             /* Lookup key: dbid, RESP version and argv. */
+    sds reply;              /* Complete encoded reply. */
+    listNode *lru;          /* Position in cmd_cache_lru. */
+    int dbid;
+    int numkeys;            /* Keys the command read... */
+    sds *keys;              /* ...their names, */
+    listNode **key_nodes;   /* ...and our nodes in their index lists. */
+} cmdCacheEntry;
+
+static dict *cmd_cache = NULL;       /* cmdkey -> cmdCacheEntry */
+static dict **cmd_cache_keys = NULL; /* Per db: key name -> list of entries */
+static list *cmd_cache_lru = NULL;   /* Head: most recently served. */
+static size_t cmd_cache_bytes = 0;
+
+/* Capture state, armed by replyCacheServeCommand() on a miss and
+ * consumed by replyCacheCaptureResult() right after the command ran.
+ * Commands execute one at a time on the main thread, so a single slot
+ * suffices. */
+static client *cmd_cache_cap_client = NULL;
+static sds cmd_cache_cap_cmdkey = NULL;
+static int cmd_cache_cap_bufpos = 0;
+static listNode *cmd_cache_cap_tail = NULL;
+static size_t cmd_cache_cap_tailused = 0;
+
+static void cmdCacheKeyListDestructor(void *privdata, void *val) {
+    DICT_NOTUSED(privdata);
+    listRelease(val);
+}
+
+static dictType cmdCacheKeysDictType = {
+    dictSdsHash,               /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictSdsKeyCompare,         /* key compare */
+    dictSdsDestructor,         /* key destructor */
+    cmdCacheKeyListDestructor, /* val destructor */
+    NULL,                      /* key inline size */
+    NULL                       /* key inline copy */
+};
+
+/* The main index does not own keys nor values: both belong to the entry,
+ * released by cmdCacheRemoveEntry(). */
+static dictType cmdCacheDictType = {
+    dictSdsHash,               /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictSdsKeyCompare,         /* key compare */
+    NULL,                      /* key destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* key inline size */
+    NULL                       /* key inline copy */
+};
+
+static void cmdCacheInit(void) {
+    cmd_cache = dictCreate(&cmdCacheDictType,NULL);
+    cmd_cache_keys = zcalloc(sizeof(dict*)*server.dbnum);
+    cmd_cache_lru = listCreate();
+}
+
+/* Approximation of the memory footprint of an entry, for the
+ * reply-cache-command-bytes accounting. */
+static size_t cmdCacheEntryBytes(cmdCacheEntry *e) {
+    size_t bytes = sizeof(*e) + sdsAllocSize(e->cmdkey) +
+                   sdsAllocSize(e->reply);
+    for (int j = 0; j < e->numkeys; j++) {
+        bytes += sdsAllocSize(e->keys[j]) + sizeof(listNode) +
+                 sizeof(sds) + sizeof(listNode*);
+    }
+    return bytes;
+}
+
+/* Unlink 'e' from every index and release it. */
+static void cmdCacheRemoveEntry(cmdCacheEntry *e) {
+    dict *kd = cmd_cache_keys[e->dbid];
+
+    cmd_cache_bytes -= cmdCacheEntryBytes(e);
+    for (int j = 0; j < e->numkeys; j++) {
+        dictEntry *de = dictFind(kd,e->keys[j]);
+        serverAssert(de != NULL);
+        list *l = dictGetVal(de);
+        listDelNode(l,e->key_nodes[j]);
+        if (listLength(l) == 0) dictDelete(kd,e->keys[j]);
+        sdsfree(e->keys[j]);
+    }
+    listDelNode(cmd_cache_lru,e->lru);
+    dictDelete(cmd_cache,e->cmdkey);
+    sdsfree(e->cmdkey);
+    sdsfree(e->reply);
+    zfree(e->keys);
+    zfree(e->key_nodes);
+    zfree(e);
+}
+
+/* Build the lookup key identifying this exact request: same database,
+ * same protocol version (aggregate replies are encoded differently in
+ * RESP2 and RESP3), same arguments. */
+static sds cmdCacheBuildKey(client *c) {
+    sds ck = sdsempty();
+
+    ck = sdscatprintf(ck,"%d:%d",c->db->id,c->resp);
+    for (int j = 0; j < c->argc; j++) {
+        robj *a = c->argv[j];
+        char llbuf[LONG_STR_SIZE];
+        char *p;
+        size_t len;
+
+        if (sdsEncodedObject(a)) {
+            p = a->ptr;
+            len = sdslen(a->ptr);
+        } else {
+            len = ll2string(llbuf,sizeof(llbuf),(long)a->ptr);
+            p = llbuf;
+        }
+        ck = sdscatprintf(ck,"/%zu:",len);
+        ck = sdscatlen(ck,p,len);
+    }
+    return ck;
+}
+
+/* Return non-zero if the command the client is about to run may be
+ * served from (and stored into) the result cache. */
+static int cmdCacheableCommand(client *c) {
+    struct redisCommand *cmd = c->cmd;
+
+    /* Masters feeding us, monitors and Lua do not go through the normal
+     * reply path; tracking clients must record the keys they read. */
+    if (c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_MONITOR|CLIENT_LUA|
+                    CLIENT_TRACKING)) return 0;
+    /* Fake clients (AOF loading, modules) discard their replies. */
+    if (c->conn == NULL) return 0;
+    /* Scripts may write, so they are normally never cacheable -- except
+     * when declared deterministic and idempotent with SCRIPT MEMO: by
+     * that declaration re-execution returns the same reply and re-applies
+     * the same final state, so serving the remembered reply (and skipping
+     * the Lua VM entirely) is equivalent until one of the declared keys
+     * is modified. The declared key list (argv[3..]) indexes the entry
+     * like any other command's keys would. */
+    if (cmd->proc == evalShaCommand)
+        return c->argc >= 3 && scriptIsMemoizable(c);
+    if (!(cmd->flags & CMD_READONLY)) return 0;
+    if (cmd->flags & (CMD_RANDOM|CMD_ADMIN|CMD_PUBSUB|CMD_NOSCRIPT|
+                      CMD_MODULE)) return 0;
+    /* No keys means no way to invalidate the result. */
+    if (cmd->firstkey == 0 && cmd->getkeys_proc == NULL) return 0;
+    /* GET is already covered by the per-key layer above. */
+    if (cmd->proc == getCommand) return 0;
+    /* The whole point of TOUCH is its side effect on the LRU data. */
+    if (cmd->proc == touchCommand) return 0;
+    return 1;
+}
+
+/* Serve the client from the result cache if possible. Returns 1 when the
+ * reply was emitted. On an eligible miss the capture state is armed, so
+ * that the reply produced by the upcoming call() is remembered by
+ * replyCacheCaptureResult(). */
+int replyCacheServeCommand(client *c) {
+    if (server.reply_cache_cmd_bytes == 0 || cmd_cache == NULL) return 0;
+    if (!cmdCacheableCommand(c)) return 0;
+
+    sds ck = cmdCacheBuildKey(c);
+    dictEntry *de = dictFind(cmd_cache,ck);
+    if (de) {
+        cmdCacheEntry *e = dictGetVal(de);
+
+        addReplyProto(c,e->reply,sdslen(e->reply));
+        /* Move to the head of the LRU list. */
+        listDelNode(cmd_cache_lru,e->lru);
+        listAddNodeHead(cmd_cache_lru,e);
+        e->lru = listFirst(cmd_cache_lru);
+        server.stat_reply_cache_cmd_hits++;
+        sdsfree(ck);
+        return 1;
+    }
+    server.stat_reply_cache_cmd_misses++;
+    cmd_cache_cap_client = c;
+    cmd_cache_cap_cmdkey = ck;
+    cmd_cache_cap_bufpos = c->bufpos;
+    cmd_cache_cap_tail = listLast(c->reply);
+    cmd_cache_cap_tailused = cmd_cache_cap_tail ?
+        ((clientReplyBlock*)listNodeValue(cmd_cache_cap_tail))->used : 0;
+    return 0;
+}
+
+/* Append to 'reply' the bytes of reply block 'b' starting at 'off'. */
+static sds cmdCacheCatBlock(sds reply, clientReplyBlock *b, size_t off) {
+    if (b->blob) {
+        return sdscatlen(reply,(char*)b->blob->ptr+b->blob_off+off,
+                         b->used-off);
+    }
+    return sdscatlen(reply,b->buf+off,b->used-off);
+}
+
+/* Consume the capture state armed by replyCacheServeCommand(): extract
+ * from the client output buffers the bytes the command just appended and
+ * store them in the cache. Must be called right after the command
+ * executed, before any buffer is flushed. */
+void replyCacheCaptureResult(client *c) {
+    sds ck = cmd_cache_cap_cmdkey;
+    int bufpos = cmd_cache_cap_bufpos;
+    listNode *tail = cmd_cache_cap_tail;
+    size_t tailused = cmd_cache_cap_tailused;
+
+    if (cmd_cache_cap_client != c) return;
+    cmd_cache_cap_client = NULL;
+    cmd_cache_cap_cmdkey = NULL;
+
+    /* A client going away, still blocked, or in reply-skip mode did not
+     * produce a complete reply worth remembering. */
+    if (c->flags & (CLIENT_CLOSE_ASAP|CLIENT_CLOSE_AFTER_REPLY|
+                    CLIENT_BLOCKED|CLIENT_REPLY_SKIP|CLIENT_REPLY_OFF))
+    {
+        sdsfree(ck);
+        return;
+    }
+
+    /* Keys with a TTL are not cacheable: a logically expired value must
+     * not outlive its deadline in the cache, and no write would come to
+     * invalidate it until the DEL of the master arrives. */
+    int numkeys = 0, *keyidx;
+    keyidx = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+    if (numkeys == 0) {
+        getKeysFreeResult(keyidx);
+        sdsfree(ck);
+        return;
+    }
+    for (int j = 0; j < numkeys; j++) {
+        if (getExpire(c->db,c->argv[keyidx[j]]) != -1) {
+            getKeysFreeResult(keyidx);
+            sdsfree(ck);
+            return;
+        }
+    }
+
+    /* Collect the emitted bytes: the static buffer slice first, then the
+     * blocks appended to the reply list (starting in the middle of the
+     * block that was the tail when the capture was armed). */
+    sds reply = sdsempty();
+    if (c->bufpos > bufpos)
+        reply = sdscatlen(reply,c->buf+bufpos,c->bufpos-bufpos);
+    listNode *ln = tail ? tail : listFirst(c->reply);
+    size_t off = tail ? tailused : 0;
+    while (ln) {
+        reply = cmdCacheCatBlock(reply,listNodeValue(ln),off);
+        off = 0;
+        ln = listNextNode(ln);
+    }
+
+    /* Oversized results would just evict everything else. */
+    if (sdsAllocSize(reply)+sdsAllocSize(ck) >
+        server.reply_cache_cmd_bytes/4)
+    {
+        getKeysFreeResult(keyidx);
+        sdsfree(ck);
+        sdsfree(reply);
+        return;
+    }
+
+    cmdCacheEntry *e = zmalloc(sizeof(*e));
+    e->cmdkey = ck;
+    e->reply = reply;
+    e->dbid = c->db->id;
+    e->numkeys = numkeys;
+    e->keys = zmalloc(sizeof(sds)*numkeys);
+    e->key_nodes = zmalloc(sizeof(listNode*)*numkeys);
+
+    dict *kd = cmd_cache_keys[e->dbid];
+    if (kd == NULL)
+        kd = cmd_cache_keys[e->dbid] = dictCreate(&cmdCacheKeysDictType,NULL);
+    for (int j = 0; j < numkeys; j++) {
+        robj *keyobj = c->argv[keyidx[j]];
+        sds key = sdsEncodedObject(keyobj) ? sdsdup(keyobj->ptr) :
+                  sdsfromlonglong((long)keyobj->ptr);
+        list *l;
+        dictEntry *de = dictFind(kd,key);
+
+        if (de) {
+            l = dictGetVal(de);
+        } else {
+            l = listCreate();
+            serverAssert(dictAdd(kd,sdsdup(key),l) == DICT_OK);
+        }
+        listAddNodeTail(l,e);
+        e->keys[j] = key;
+        e->key_nodes[j] = listLast(l);
+    }
+    getKeysFreeResult(keyidx);
+
+    listAddNodeHead(cmd_cache_lru,e);
+    e->lru = listFirst(cmd_cache_lru);
+    serverAssert(dictAdd(cmd_cache,e->cmdkey,e) == DICT_OK);
+    cmd_cache_bytes += cmdCacheEntryBytes(e);
+
+    /* Enforce the memory bound evicting the least recently served. */
+    while (cmd_cache_bytes > server.reply_cache_cmd_bytes &&
+           listLength(cmd_cache_lru) > 1)
+    {
+        cmdCacheRemoveEntry(listNodeValue(listLast(cmd_cache_lru)));
+    }
+}
+
+/* Drop every cached result computed from 'key'. Called by the
+ * signalModifiedKey() hook, so the empty-cache case must stay cheap. */
+static void cmdCacheInvalidate(redisDb *db, robj *key) {
+    if (cmd_cache == NULL || dictSize(cmd_cache) == 0) return;
+    dict *kd = cmd_cache_keys[db->id];
+    if (kd == NULL) return;
+    dictEntry *de = dictFind(kd,key->ptr);
+    if (de == NULL) return;
+    list *l = dictGetVal(de);
+    listNode *ln;
+    while ((ln = listFirst(l)) != NULL)
+        cmdCacheRemoveEntry(listNodeValue(ln));
+}
+
+/* Drop the cached results of database 'dbid' (-1 means all). */
+static void cmdCacheFlush(int dbid) {
+    if (cmd_cache == NULL || dictSize(cmd_cache) == 0) return;
+    listNode *ln = listFirst(cmd_cache_lru), *next;
+    while (ln) {
+        cmdCacheEntry *e = listNodeValue(ln);
+        next = listNextNode(ln);
+        if (dbid == -1 || e->dbid == dbid) cmdCacheRemoveEntry(e);
+        ln = next;
+    }
+}
+
+/* Introspection for INFO. */
+unsigned long replyCacheCmdNumEntries(void) {
+    return cmd_cache ? dictSize(cmd_cache) : 0;
+}
+
+size_t replyCacheCmdBytes(void) {
+    return cmd_cache_bytes;
+}
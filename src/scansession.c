@@ -0,0 +1,294 @@
+/* scansession.c -- Stateful scan sessions for HSCAN, SSCAN and ZSCAN.
+ *
+ * The regular scan family encodes all its state in the reversed-bits
+ * cursor: stateless for the server, but every call re-derives the
+ * position, and a rehash in progress can hand the same elements out
+ * twice, forcing clients exporting big containers to deduplicate.
+ *
+ * A stateful session, requested by passing the STATEFUL option to
+ * HSCAN/SSCAN/ZSCAN with cursor 0, keeps the iteration state on the
+ * server instead: a safe dict iterator pinned on the object's hash
+ * table (which also pauses its incremental rehash, like any safe
+ * iterator does). Batches then resume exactly where the previous one
+ * stopped, walk the buckets sequentially, and return every element
+ * exactly once, in storage order. The returned cursor is the session
+ * id, opaque like a normal cursor.
+ *
+ * A pinned iterator cannot survive the underlying dict changing or
+ * going away, so a session is dropped -- and the client told to restart
+ * with -NOSESSION -- when its key is written (through the same
+ * signalModifiedKey() hook that keeps WATCH coherent), deleted, expired
+ * or evicted (the dbSyncDelete()/dbAsyncDelete() chokepoints), when the
+ * database is flushed or swapped, and when the active defragmenter is
+ * about to relocate the object's entries. Sessions also die with their
+ * client, like the blocking state does, after sixty seconds of
+ * inactivity, and the total count is bounded by the scan-sessions-max
+ * option (0, the default, disables the feature).
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* Sessions not advanced for this long are reclaimed by the cron. */
+#define SCAN_SESSION_IDLE_MS 60000
+
+/* Per-batch time budget: a batch stops early once it spent this much,
+ * whatever COUNT says, so a huge COUNT cannot stall the event loop. */
+#define SCAN_SESSION_BATCH_USEC 2000
+
+typedef struct scanSession {
+    uint64_t id;        /* Returned to the client as the cursor. */
+    client *owner;      /* Only this client may resume the session. */
+    redisDb *db;
+    sds key;            /* Owned copy of the key name. */
+    robj *obj;          /* The container walked (borrowed pointer, only
+                         * compared, never dereferenced: any event that
+                         * could free it drops the session first). */
+    dictIterator *di;   /* Safe iterator pinned on the object's dict. */
+    mstime_t last_used;
+} scanSession;
+
+/* The handful of allowed sessions lives in a plain list: every lookup
+ * and invalidation is a linear walk bounded by scan-sessions-max. */
+static list *scan_sessions = NULL;
+static uint64_t scan_session_next_id = 1;
+
+static void scanSessionRelease(listNode *ln) {
+    scanSession *s = listNodeValue(ln);
+
+    dictReleaseIterator(s->di);
+    sdsfree(s->key);
+    zfree(s);
+    listDelNode(scan_sessions,ln);
+}
+
+static void addReplyNoSession(client *c) {
+    addReplySds(c,sdsnew("-NOSESSION No such stateful scan session: it "
+        "may have expired or been invalidated by a write to the key. "
+        "Restart the scan with cursor 0.\r\n"));
+}
+
+/* Serve one batch of the stateful scan of 'o' (a hash table encoded
+ * hash, set or sorted set whose dict is 'ht') for the client. Cursor 0
+ * opens a session, any other cursor resumes the session with that id.
+ * 'count' is the reply item budget of the batch, as already adjusted by
+ * scanGenericCommand() (doubled for the field-value types). */
+void scanSessionGenericCommand(client *c, robj *o, dict *ht,
+                               unsigned long cursor, long count)
+{
+    scanSession *s = NULL;
+    listNode *ln;
+
+    if (server.scan_sessions_max == 0) {
+        addReplyError(c,"stateful scan sessions are disabled, set "
+                        "scan-sessions-max to enable them");
+        return;
+    }
+
+    if (cursor == 0) {
+        if (scan_sessions == NULL) scan_sessions = listCreate();
+        if (listLength(scan_sessions) >=
+            (unsigned long)server.scan_sessions_max)
+        {
+            addReplyError(c,"too many active stateful scan sessions");
+            return;
+        }
+        s = zmalloc(sizeof(*s));
+        s->id = scan_session_next_id++;
+        s->owner = c;
+        s->db = c->db;
+        s->key = sdsEncodedObject(c->argv[1]) ? sdsdup(c->argv[1]->ptr) :
+                 sdsfromlonglong((long)c->argv[1]->ptr);
+        s->obj = o;
+        s->di = dictGetSafeIterator(ht);
+        listAddNodeTail(scan_sessions,s);
+        ln = listLast(scan_sessions);
+    } else {
+        listIter li;
+
+        if (scan_sessions == NULL) {
+            addReplyNoSession(c);
+            return;
+        }
+        listRewind(scan_sessions,&li);
+        while ((ln = listNext(&li))) {
+            s = listNodeValue(ln);
+            if (s->owner == c && s->id == cursor) break;
+        }
+        if (ln == NULL) {
+            addReplyNoSession(c);
+            return;
+        }
+        /* The hooks drop a session before anything can happen to its
+         * object, so a mismatch here means the cursor was replayed
+         * against a different key: refuse rather than guess. */
+        if (s->obj != o || s->db != c->db) {
+            addReplyNoSession(c);
+            return;
+        }
+    }
+    s->last_used = mstime();
+
+    /* Walk the next slice of the dict. The entries are only borrowed:
+     * nothing can touch the dict before the reply below is built. */
+    list *entries = listCreate();
+    long long timelimit = ustime()+SCAN_SESSION_BATCH_USEC;
+    long budget = count;
+    dictEntry *de = NULL;
+    int exhausted = 0;
+
+    while (budget > 0) {
+        if ((de = dictNext(s->di)) == NULL) {
+            exhausted = 1;
+            break;
+        }
+        listAddNodeTail(entries,de);
+        budget -= (o->type == OBJ_SET) ? 1 : 2;
+        if ((listLength(entries) & 63) == 0 && ustime() > timelimit) break;
+    }
+
+    addReplyArrayLen(c,2);
+    addReplyBulkLongLong(c,exhausted ? 0 : (long long)s->id);
+    addReplyArrayLen(c,listLength(entries) *
+                       ((o->type == OBJ_SET) ? 1 : 2));
+    listIter li;
+    listRewind(entries,&li);
+    while ((ln = listNext(&li))) {
+        de = listNodeValue(ln);
+        sds ele = dictGetKey(de);
+        addReplyBulkCBuffer(c,ele,sdslen(ele));
+        if (o->type == OBJ_HASH) {
+            sds val = dictGetVal(de);
+            addReplyBulkCBuffer(c,val,sdslen(val));
+        } else if (o->type == OBJ_ZSET) {
+            robj *score = createStringObjectFromLongDouble(
+                *(double*)dictGetVal(de),0);
+            addReplyBulk(c,score);
+            decrRefCount(score);
+        }
+    }
+    listRelease(entries);
+
+    if (exhausted) scanSessionRelease(listSearchKey(scan_sessions,s));
+}
+
+/* Drop every session walking 'key' of 'db'. Hooked into the key
+ * modification and deletion chokepoints, so the no-sessions case must
+ * stay cheap. */
+void scanSessionInvalidateKey(redisDb *db, robj *key) {
+    if (scan_sessions == NULL || listLength(scan_sessions) == 0) return;
+
+    char buf[LONG_STR_SIZE];
+    char *name;
+    size_t namelen;
+
+    if (sdsEncodedObject(key)) {
+        name = key->ptr;
+        namelen = sdslen(key->ptr);
+    } else {
+        namelen = ll2string(buf,sizeof(buf),(long)key->ptr);
+        name = buf;
+    }
+
+    listIter li;
+    listNode *ln;
+    listRewind(scan_sessions,&li);
+    while ((ln = listNext(&li))) {
+        scanSession *s = listNodeValue(ln);
+        if (s->db == db && sdslen(s->key) == namelen &&
+            memcmp(s->key,name,namelen) == 0)
+        {
+            scanSessionRelease(ln);
+        }
+    }
+}
+
+/* Drop every session of database 'dbid', or of all databases if -1.
+ * Called on FLUSHDB/FLUSHALL and on both sides of a SWAPDB. */
+void scanSessionInvalidateDb(int dbid) {
+    if (scan_sessions == NULL || listLength(scan_sessions) == 0) return;
+
+    listIter li;
+    listNode *ln;
+    listRewind(scan_sessions,&li);
+    while ((ln = listNext(&li))) {
+        scanSession *s = listNodeValue(ln);
+        if (dbid == -1 || s->db->id == dbid) scanSessionRelease(ln);
+    }
+}
+
+/* Drop every session walking the container 'o': called by the active
+ * defragmenter right before relocating its entries. */
+void scanSessionInvalidateObj(robj *o) {
+    if (scan_sessions == NULL || listLength(scan_sessions) == 0) return;
+
+    listIter li;
+    listNode *ln;
+    listRewind(scan_sessions,&li);
+    while ((ln = listNext(&li))) {
+        scanSession *s = listNodeValue(ln);
+        if (s->obj == o) scanSessionRelease(ln);
+    }
+}
+
+/* Drop the sessions of a disconnecting client. */
+void scanSessionFreeClient(client *c) {
+    if (scan_sessions == NULL || listLength(scan_sessions) == 0) return;
+
+    listIter li;
+    listNode *ln;
+    listRewind(scan_sessions,&li);
+    while ((ln = listNext(&li))) {
+        scanSession *s = listNodeValue(ln);
+        if (s->owner == c) scanSessionRelease(ln);
+    }
+}
+
+/* Reclaim the sessions of clients that opened one and then went silent:
+ * called by serverCron(). */
+void scanSessionCron(void) {
+    if (scan_sessions == NULL || listLength(scan_sessions) == 0) return;
+
+    mstime_t now = mstime();
+    listIter li;
+    listNode *ln;
+    listRewind(scan_sessions,&li);
+    while ((ln = listNext(&li))) {
+        scanSession *s = listNodeValue(ln);
+        if (now - s->last_used > SCAN_SESSION_IDLE_MS)
+            scanSessionRelease(ln);
+    }
+}
+
+/* Number of active sessions, for INFO. */
+unsigned long scanSessionCount(void) {
+    return scan_sessions ? listLength(scan_sessions) : 0;
+}
@@ -51,7 +51,9 @@ int redis_math_randomseed (lua_State *L);
 void ldbInit(void);
 void ldbDisable(client *c);
 void ldbEnable(client *c);
+void evalGenericCommand(client *c, int evalsha);
 void evalGenericCommandWithDebugging(client *c, int evalsha);
+static void luaRegisteredScriptsRecompile(void);
 void luaLdbLineHook(lua_State *lua, lua_Debug *ar);
 void ldbLog(sds entry);
 void ldbLogRedisReply(char *reply);
@@ -472,6 +474,22 @@ void luaReplyToRedisReply(client *c, lua_State *lua) {
 
 #define LUA_CMD_OBJCACHE_SIZE 32
 #define LUA_CMD_OBJCACHE_MAX_LEN 64
+
+/* One entry memoization of the last command resolved by redis.call():
+ * scripts overwhelmingly invoke the same command over and over, so on a
+ * name match we can skip the command table lookup entirely. */
+static struct redisCommand *lua_cached_cmd = NULL;
+static sds lua_cached_cmd_name = NULL;
+
+/* Drop the cached command resolution. Must be called every time entries
+ * may be removed from the command table (currently only when a module
+ * unregisters its commands), as the cached pointer would dangle. */
+void scriptingClearCommandCache(void) {
+    sdsfree(lua_cached_cmd_name);
+    lua_cached_cmd_name = NULL;
+    lua_cached_cmd = NULL;
+}
+
 int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     int j, argc = lua_gettop(lua);
     struct redisCommand *cmd;
@@ -592,8 +610,21 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         ldbLog(cmdlog);
     }
 
-    /* Command lookup */
-    cmd = lookupCommand(argv[0]->ptr);
+    /* Command lookup, going through the memoized resolution of the
+     * previous call when the name matches. */
+    if (lua_cached_cmd &&
+        sdslen(lua_cached_cmd_name) == sdslen(argv[0]->ptr) &&
+        !strcasecmp(lua_cached_cmd_name,argv[0]->ptr))
+    {
+        cmd = lua_cached_cmd;
+    } else {
+        cmd = lookupCommand(argv[0]->ptr);
+        if (cmd) {
+            sdsfree(lua_cached_cmd_name);
+            lua_cached_cmd_name = sdsdup(argv[0]->ptr);
+            lua_cached_cmd = cmd;
+        }
+    }
     if (!cmd || ((cmd->arity > 0 && cmd->arity != argc) ||
                    (argc < -cmd->arity)))
     {
@@ -703,6 +734,9 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     {
         execCommandPropagateMulti(server.lua_caller);
         server.lua_multi_emitted = 1;
+        /* From here on the effects stream is buffered so that multiple
+         * writes to the same key can be merged before it is flushed. */
+        propagateCoalesceStart();
     }
 
     /* Run the command */
@@ -1265,15 +1299,38 @@ void scriptingRelease(void) {
 
 void scriptingReset(void) {
     scriptingRelease();
+    scriptMemoFlush();
     scriptingInit(0);
+    luaRegisteredScriptsRecompile();
 }
 
 /* Set an array of Redis String Objects as a Lua array (table) stored into a
- * global variable. */
+ * global variable.
+ *
+ * When the global already holds a table from a previous call we clear and
+ * refill it in place instead of allocating a fresh one: EVAL workloads
+ * create two such tables per call, and recycling them removes the
+ * corresponding allocation and GC pressure from the hot path. */
 void luaSetGlobalArray(lua_State *lua, char *var, robj **elev, int elec) {
     int j;
 
-    lua_newtable(lua);
+    lua_getglobal(lua,var);
+    if (!lua_istable(lua,-1)) {
+        lua_pop(lua,1);
+        lua_newtable(lua);
+    } else {
+        /* Remove every field left over from the previous call: the script
+         * may have stored arbitrary keys into the table, so we enumerate
+         * instead of trusting the array length. Clearing the field just
+         * visited while traversing is explicitly allowed by lua_next(). */
+        lua_pushnil(lua);
+        while (lua_next(lua,-2) != 0) {
+            lua_pop(lua,1);         /* Discard the value, keep the key. */
+            lua_pushvalue(lua,-1);  /* Duplicate the key for the rawset. */
+            lua_pushnil(lua);
+            lua_rawset(lua,-4);
+        }
+    }
     for (j = 0; j < elec; j++) {
         lua_pushlstring(lua,(char*)elev[j]->ptr,sdslen(elev[j]->ptr));
         lua_rawseti(lua,-2,j+1);
@@ -1399,6 +1456,122 @@ sds luaCreateFunction(client *c, lua_State *lua, robj *body) {
     return sha;
 }
 
+/* ---------------------------------------------------------------------------
+ * Registered scripts library (SCRIPT REGISTER / EVALREF)
+ * ------------------------------------------------------------------------- */
+
+/* Scripts registered with SCRIPT REGISTER live in a small array indexed
+ * by the user supplied integer id. Each slot holds the original body
+ * (used to replicate calls as EVAL and to survive SCRIPT FLUSH), its
+ * SHA1 (the key inside server.lua_scripts) and a reference to the
+ * compiled function in the Lua registry: calling a registered script is
+ * a constant time lua_rawgeti() instead of the per-call name formatting
+ * and globals lookup that EVALSHA pays. */
+typedef struct luaRegisteredScript {
+    robj *body;     /* Script source, or NULL if the slot is empty. */
+    sds sha;        /* SHA1 hex digest of the body. */
+    int ref;        /* Lua registry reference to the compiled function. */
+} luaRegisteredScript;
+
+static luaRegisteredScript *lua_registered = NULL;
+static int lua_registered_size = 0;     /* Slots allocated so far. */
+#define LUA_REGISTERED_MAX_ID 1023
+
+/* Slot of the registered script being executed by EVALREF, set around
+ * the evalGenericCommand() call, otherwise NULL. */
+static luaRegisteredScript *lua_cur_registered = NULL;
+
+/* Compile slot->body into the current Lua state, taking a registry
+ * reference to the resulting function and filling slot->sha. On error
+ * C_ERR is returned and, if 'c' is not NULL, the client is informed by
+ * luaCreateFunction() itself. */
+static int luaRegisteredScriptCompile(client *c, luaRegisteredScript *slot) {
+    char funcname[43];
+    sds sha = luaCreateFunction(c,server.lua,slot->body);
+    if (sha == NULL) return C_ERR;
+
+    funcname[0] = 'f';
+    funcname[1] = '_';
+    memcpy(funcname+2,sha,40);
+    funcname[42] = '\0';
+    lua_getglobal(server.lua,funcname);
+    serverAssert(!lua_isnil(server.lua,-1));
+    slot->ref = luaL_ref(server.lua,LUA_REGISTRYINDEX);
+    slot->sha = sdsnewlen(sha,40);
+    return C_OK;
+}
+
+/* The Lua state was just recreated (SCRIPT FLUSH): the registry
+ * references are gone, so compile the registered scripts again into the
+ * new state. The bodies compiled before, so this can't fail. */
+static void luaRegisteredScriptsRecompile(void) {
+    for (int j = 0; j < lua_registered_size; j++) {
+        luaRegisteredScript *slot = &lua_registered[j];
+        if (slot->body == NULL) continue;
+        sdsfree(slot->sha);
+        slot->sha = NULL;
+        slot->ref = LUA_NOREF;
+        serverAssert(luaRegisteredScriptCompile(NULL,slot) == C_OK);
+    }
+}
+
+/* SCRIPT REGISTER <id> <body>: bind 'body' to the small integer 'id' so
+ * that EVALREF can call it. Registering over an occupied slot replaces
+ * the old script. Replies with the script SHA1, like SCRIPT LOAD. */
+static void scriptRegisterCommand(client *c) {
+    long long id;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&id,NULL) != C_OK) return;
+    if (id < 0 || id > LUA_REGISTERED_MAX_ID) {
+        addReplyErrorFormat(c,"Script id must be between 0 and %d",
+            LUA_REGISTERED_MAX_ID);
+        return;
+    }
+
+    /* Compile before touching the slot, so that a body that does not
+     * compile leaves the old registration in place. */
+    luaRegisteredScript newslot = {c->argv[3], NULL, LUA_NOREF};
+    if (luaRegisteredScriptCompile(c,&newslot) == C_ERR) return;
+    incrRefCount(newslot.body);
+
+    /* Grow the array up to the requested id. */
+    if (id >= lua_registered_size) {
+        lua_registered = zrealloc(lua_registered,
+            sizeof(luaRegisteredScript)*(id+1));
+        for (int j = lua_registered_size; j <= id; j++) {
+            lua_registered[j].body = NULL;
+            lua_registered[j].sha = NULL;
+            lua_registered[j].ref = LUA_NOREF;
+        }
+        lua_registered_size = id+1;
+    }
+
+    luaRegisteredScript *slot = &lua_registered[id];
+    if (slot->body != NULL) {
+        luaL_unref(server.lua,LUA_REGISTRYINDEX,slot->ref);
+        decrRefCount(slot->body);
+        sdsfree(slot->sha);
+    }
+    *slot = newslot;
+    addReplyBulkCBuffer(c,slot->sha,40);
+}
+
+void evalRefCommand(client *c) {
+    long long id;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[1],&id,NULL) != C_OK) return;
+    if (id < 0 || id >= lua_registered_size ||
+        lua_registered[id].body == NULL)
+    {
+        addReplyError(c,"No script registered with the specified id. "
+                        "Use SCRIPT REGISTER first.");
+        return;
+    }
+    lua_cur_registered = &lua_registered[id];
+    evalGenericCommand(c,0);
+    lua_cur_registered = NULL;
+}
+
 /* This is the Lua script "count" hook that we use to detect scripts timeout. */
 void luaMaskCountHook(lua_State *lua, lua_Debug *ar) {
     long long elapsed = mstime() - server.lua_time_start;
@@ -1469,7 +1642,13 @@ void evalGenericCommand(client *c, int evalsha) {
      * defined into the Lua state */
     funcname[0] = 'f';
     funcname[1] = '_';
-    if (!evalsha) {
+    if (lua_cur_registered) {
+        /* Registered script: the SHA1 was computed once at registration
+         * time, here it is only needed for error messages and for
+         * SCRIPT KILL reporting. */
+        memcpy(funcname+2,lua_cur_registered->sha,40);
+        funcname[42] = '\0';
+    } else if (!evalsha) {
         /* Hash the code if this is an EVAL call */
         sha1hex(funcname+2,c->argv[1]->ptr,sdslen(c->argv[1]->ptr));
     } else {
@@ -1489,27 +1668,34 @@ void evalGenericCommand(client *c, int evalsha) {
     /* Push the pcall error handler function on the stack. */
     lua_getglobal(lua, "__redis__err__handler");
 
-    /* Try to lookup the Lua function */
-    lua_getglobal(lua, funcname);
-    if (lua_isnil(lua,-1)) {
-        lua_pop(lua,1); /* remove the nil from the stack */
-        /* Function not defined... let's define it if we have the
-         * body of the function. If this is an EVALSHA call we can just
-         * return an error. */
-        if (evalsha) {
-            lua_pop(lua,1); /* remove the error handler from the stack. */
-            addReply(c, shared.noscripterr);
-            return;
-        }
-        if (luaCreateFunction(c,lua,c->argv[1]) == NULL) {
-            lua_pop(lua,1); /* remove the error handler from the stack. */
-            /* The error is sent to the client by luaCreateFunction()
-             * itself when it returns NULL. */
-            return;
-        }
-        /* Now the following is guaranteed to return non nil */
+    /* Registered scripts are compiled once and for all: fetching the
+     * function is a constant time access to the Lua registry, with no
+     * globals table lookup. */
+    if (lua_cur_registered) {
+        lua_rawgeti(lua,LUA_REGISTRYINDEX,lua_cur_registered->ref);
+    } else {
+        /* Try to lookup the Lua function */
         lua_getglobal(lua, funcname);
-        serverAssert(!lua_isnil(lua,-1));
+        if (lua_isnil(lua,-1)) {
+            lua_pop(lua,1); /* remove the nil from the stack */
+            /* Function not defined... let's define it if we have the
+             * body of the function. If this is an EVALSHA call we can just
+             * return an error. */
+            if (evalsha) {
+                lua_pop(lua,1); /* remove the error handler from the stack. */
+                addReply(c, shared.noscripterr);
+                return;
+            }
+            if (luaCreateFunction(c,lua,c->argv[1]) == NULL) {
+                lua_pop(lua,1); /* remove the error handler from the stack. */
+                /* The error is sent to the client by luaCreateFunction()
+                 * itself when it returns NULL. */
+                return;
+            }
+            /* Now the following is guaranteed to return non nil */
+            lua_getglobal(lua, funcname);
+            serverAssert(!lua_isnil(lua,-1));
+        }
     }
 
     /* Populate the argv and keys table accordingly to the arguments that
@@ -1592,6 +1778,7 @@ void evalGenericCommand(client *c, int evalsha) {
         preventCommandPropagation(c);
         if (server.lua_multi_emitted) {
             robj *propargv[1];
+            propagateCoalesceEnd();
             propargv[0] = createStringObject("EXEC",4);
             alsoPropagate(server.execCommand,c->db->id,propargv,1,
                 PROPAGATE_AOF|PROPAGATE_REPL);
@@ -1609,14 +1796,16 @@ void evalGenericCommand(client *c, int evalsha) {
      * For repliation, everytime a new slave attaches to the master, we need to
      * flush our cache of scripts that can be replicated as EVALSHA, while
      * for AOF we need to do so every time we rewrite the AOF file. */
-    if (evalsha && !server.lua_replicate_commands) {
-        if (!replicationScriptCacheExists(c->argv[1]->ptr)) {
+    if ((evalsha || lua_cur_registered) && !server.lua_replicate_commands) {
+        sds sha = lua_cur_registered ? lua_cur_registered->sha
+                                     : (sds)c->argv[1]->ptr;
+        if (!replicationScriptCacheExists(sha)) {
             /* This script is not in our script cache, replicate it as
              * EVAL, then add it into the script cache, as from now on
              * slaves and AOF know about it. */
-            robj *script = dictFetchValue(server.lua_scripts,c->argv[1]->ptr);
+            robj *script = dictFetchValue(server.lua_scripts,sha);
 
-            replicationScriptCacheAdd(c->argv[1]->ptr);
+            replicationScriptCacheAdd(sha);
             serverAssertWithInfo(c,NULL,script != NULL);
 
             /* If the script did not produce any changes in the dataset we want
@@ -1634,6 +1823,14 @@ void evalGenericCommand(client *c, int evalsha) {
                 rewriteClientCommandArgument(c,1,script);
             }
             forceCommandPropagation(c,PROPAGATE_REPL|PROPAGATE_AOF);
+        } else if (lua_cur_registered) {
+            /* Replicas and the AOF already know the script, but the
+             * registry ids are local to this instance: propagate the
+             * call as EVALSHA. */
+            rewriteClientCommandArgument(c,0,
+                resetRefCount(createStringObject("EVALSHA",7)));
+            rewriteClientCommandArgument(c,1,
+                resetRefCount(createStringObject(sha,40)));
         }
     }
 }
@@ -1662,6 +1859,46 @@ void evalShaCommand(client *c) {
     }
 }
 
+/* Shas of the scripts declared deterministic and idempotent with
+ * SCRIPT MEMO. The reply of an EVALSHA of such a script may be served
+ * from the command result cache (see replycache.c): the declaration is
+ * the user asserting that re-running the script with the same arguments
+ * returns the same reply and leaves the same final state, so replaying
+ * the remembered reply until one of the declared keys changes is
+ * equivalent to executing it again. The declaration is local state, not
+ * replicated: replicas memoize independently if told to. */
+static dict *lua_memo_scripts = NULL;
+
+static dictType luaMemoScriptsDictType = {
+    dictSdsCaseHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCaseCompare,      /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Return non-zero if the EVALSHA the client is running refers to a
+ * script declared with SCRIPT MEMO. Called by the result cache to
+ * decide eligibility, so the common no-declarations case must stay
+ * cheap. */
+int scriptIsMemoizable(client *c) {
+    if (lua_memo_scripts == NULL || dictSize(lua_memo_scripts) == 0)
+        return 0;
+    robj *sha = c->argv[1];
+    if (!sdsEncodedObject(sha) || sdslen(sha->ptr) != 40) return 0;
+    return dictFind(lua_memo_scripts,sha->ptr) != NULL;
+}
+
+/* Forget every SCRIPT MEMO declaration: called when the script cache is
+ * flushed, since the declarations refer to scripts by sha. */
+void scriptMemoFlush(void) {
+    if (lua_memo_scripts) {
+        dictRelease(lua_memo_scripts);
+        lua_memo_scripts = NULL;
+    }
+}
+
 void scriptCommand(client *c) {
     if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
         const char *help[] = {
@@ -1670,6 +1907,8 @@ void scriptCommand(client *c) {
 "FLUSH -- Flush the Lua scripts cache. Very dangerous on replicas.",
 "KILL -- Kill the currently executing Lua script.",
 "LOAD <script> -- Load a script into the scripts cache, without executing it.",
+"MEMO <sha1> (yes|no) -- Declare the script deterministic and idempotent, so identical EVALSHA calls may be served from the result cache.",
+"REGISTER <id> <script> -- Register a script under a small integer id, callable with EVALREF.",
 NULL
         };
         addReplyHelp(c, help);
@@ -1688,6 +1927,28 @@ NULL
             else
                 addReply(c,shared.czero);
         }
+    } else if (c->argc == 4 && !strcasecmp(c->argv[1]->ptr,"memo")) {
+        if (dictFind(server.lua_scripts,c->argv[2]->ptr) == NULL) {
+            addReply(c,shared.noscripterr);
+            return;
+        }
+        if (!strcasecmp(c->argv[3]->ptr,"yes")) {
+            if (lua_memo_scripts == NULL)
+                lua_memo_scripts =
+                    dictCreate(&luaMemoScriptsDictType,NULL);
+            sds sha = sdsdup(c->argv[2]->ptr);
+            if (dictAdd(lua_memo_scripts,sha,NULL) != DICT_OK)
+                sdsfree(sha); /* Already declared. */
+        } else if (!strcasecmp(c->argv[3]->ptr,"no")) {
+            if (lua_memo_scripts)
+                dictDelete(lua_memo_scripts,c->argv[2]->ptr);
+        } else {
+            addReplyError(c,"Use SCRIPT MEMO <sha1> yes/no");
+            return;
+        }
+        addReply(c,shared.ok);
+    } else if (c->argc == 4 && !strcasecmp(c->argv[1]->ptr,"register")) {
+        scriptRegisterCommand(c);
     } else if (c->argc == 3 && !strcasecmp(c->argv[1]->ptr,"load")) {
         sds sha = luaCreateFunction(c,server.lua,c->argv[2]);
         if (sha == NULL) return; /* The error was sent by luaCreateFunction(). */
@@ -73,6 +73,21 @@ static inline char sdsReqType(size_t string_size) {
 #endif
 }
 
+/* Max length the 'alloc' field of the given header type can represent. */
+static inline size_t sdsTypeMaxSize(char type) {
+    if (type == SDS_TYPE_5)
+        return (1<<5) - 1;
+    if (type == SDS_TYPE_8)
+        return (1<<8) - 1;
+    if (type == SDS_TYPE_16)
+        return (1<<16) - 1;
+#if (LONG_MAX == LLONG_MAX)
+    if (type == SDS_TYPE_32)
+        return (1ll<<32) - 1;
+#endif
+    return SIZE_MAX;
+}
+
 /* Create a new sds string with the content specified by the 'init' pointer
  * and 'initlen'.
  * If NULL is used for 'init' the string is initialized with zero bytes.
@@ -144,6 +159,65 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return s;
 }
 
+/* Return the number of bytes needed to place a string of 'initlen' bytes
+ * with sdsplacelen(). */
+size_t sdsplacesize(size_t initlen) {
+    return sdsHdrSize(sdsReqType(initlen))+initlen+1;
+}
+
+/* Like sdsnewlen(), but constructs the string inside the caller provided
+ * buffer 'buf', which must be at least sdsplacesize(initlen) bytes. The
+ * smallest possible header type is always used, including SDS_TYPE_5,
+ * since a placed string is never grown. The returned string must not be
+ * freed with sdsfree(): it is meant for containers that embed strings
+ * inside their own allocations to save the per-string allocation
+ * overhead. */
+sds sdsplacelen(void *buf, const void *init, size_t initlen) {
+    char type = sdsReqType(initlen);
+    int hdrlen = sdsHdrSize(type);
+    sds s = (char*)buf+hdrlen;
+    unsigned char *fp = ((unsigned char*)s)-1;
+
+    switch(type) {
+        case SDS_TYPE_5: {
+            *fp = type | (initlen << SDS_TYPE_BITS);
+            break;
+        }
+        case SDS_TYPE_8: {
+            SDS_HDR_VAR(8,s);
+            sh->len = initlen;
+            sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_16: {
+            SDS_HDR_VAR(16,s);
+            sh->len = initlen;
+            sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32,s);
+            sh->len = initlen;
+            sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64,s);
+            sh->len = initlen;
+            sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+    }
+    if (initlen && init)
+        memcpy(s, init, initlen);
+    s[initlen] = '\0';
+    return s;
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
@@ -199,12 +273,19 @@ void sdsclear(sds s) {
  * is sure that after calling this function can overwrite up to addlen
  * bytes after the end of the string, plus one more byte for nul term.
  *
+ * When 'hint' is non zero it is the caller's estimate of the *total* length
+ * the string is expected to reach: if it is at least len+addlen the buffer is
+ * sized to exactly 'hint' bytes instead of using the default preallocation
+ * policy. Callers that know the final size (a bulk argument of known length)
+ * avoid over-reserving, while callers that keep appending (APPEND) can pass
+ * a geometric estimate so that huge strings don't degrade to linear growth.
+ *
  * Note: this does not change the *length* of the sds string as returned
  * by sdslen(), but only the free buffer space we have. */
-sds sdsMakeRoomFor(sds s, size_t addlen) {
+sds sdsMakeRoomForHint(sds s, size_t addlen, size_t hint) {
     void *sh, *newsh;
     size_t avail = sdsavail(s);
-    size_t len, newlen;
+    size_t len, newlen, usable;
     char type, oldtype = s[-1] & SDS_TYPE_MASK;
     int hdrlen;
 
@@ -214,7 +295,9 @@ sds sdsMakeRoomFor(sds s, size_t addlen) {
     len = sdslen(s);
     sh = (char*)s-sdsHdrSize(oldtype);
     newlen = (len+addlen);
-    if (newlen < SDS_MAX_PREALLOC)
+    if (hint >= newlen)
+        newlen = hint;
+    else if (newlen < SDS_MAX_PREALLOC)
         newlen *= 2;
     else
         newlen += SDS_MAX_PREALLOC;
@@ -242,10 +325,22 @@ sds sdsMakeRoomFor(sds s, size_t addlen) {
         s[-1] = type;
         sdssetlen(s, len);
     }
-    sdssetalloc(s, newlen);
+    /* The allocator may have returned more memory than we asked for: claim
+     * the extra bytes as free space, they are already paid for. */
+    usable = s_malloc_usable(newsh) - hdrlen - 1;
+    if (usable > sdsTypeMaxSize(type))
+        usable = sdsTypeMaxSize(type);
+    sdssetalloc(s, usable);
     return s;
 }
 
+/* Like sdsMakeRoomForHint() but always uses the default growth policy:
+ * the new buffer doubles the space actually needed up to SDS_MAX_PREALLOC,
+ * and grows by SDS_MAX_PREALLOC bytes at a time after that. */
+sds sdsMakeRoomFor(sds s, size_t addlen) {
+    return sdsMakeRoomForHint(s, addlen, 0);
+}
+
 /* Reallocate the sds string so that it has no free space at the end. The
  * contained string remains not altered, but next concatenation operations
  * will require a reallocation.
@@ -483,6 +483,8 @@ void initSentinel(void) {
         int retval;
         struct redisCommand *cmd = sentinelcmds+j;
 
+        cmd->latency_histogram =
+            zcalloc(sizeof(uint64_t)*LATENCY_HIST_BUCKETS);
         retval = dictAdd(server.commands, sdsnew(cmd->name), cmd);
         serverAssert(retval == DICT_OK);
 
@@ -491,6 +493,7 @@ void initSentinel(void) {
         if (populateCommandTableParseFlags(cmd,cmd->sflags) == C_ERR)
             serverPanic("Unsupported command flag");
     }
+    rebuildCommandLookupFastTable();
 
     /* Initialize various data structures. */
     sentinel.current_epoch = 0;
@@ -2111,10 +2114,22 @@ int sentinelMasterLooksSane(sentinelRedisInstance *master) {
         (mstime() - master->info_refresh) < SENTINEL_INFO_PERIOD*2;
 }
 
+/* Bounded search inside a single line of the INFO output: return a pointer
+ * to the first byte after 'field' inside l[0..ll), or NULL if the field is
+ * not part of the line. */
+static const char *sentinelInfoFieldInLine(const char *l, size_t ll,
+                                           const char *field, size_t fl)
+{
+    while (ll >= fl) {
+        if (!memcmp(l,field,fl)) return l+fl;
+        l++; ll--;
+    }
+    return NULL;
+}
+
 /* Process the INFO output from masters. */
 void sentinelRefreshInstanceInfo(sentinelRedisInstance *ri, const char *info) {
-    sds *lines;
-    int numlines, j;
+    const char *p = info;
     int role = 0;
 
     /* cache full INFO output for instance */
@@ -2125,117 +2140,137 @@ void sentinelRefreshInstanceInfo(sentinelRedisInstance *ri, const char *info) {
      * are not found at all in the INFO output. */
     ri->master_link_down_time = 0;
 
-    /* Process line by line. */
-    lines = sdssplitlen(info,strlen(info),"\r\n",2,&numlines);
-    for (j = 0; j < numlines; j++) {
+    /* Process line by line, scanning the output in place: with hundreds of
+     * monitored instances, splitting every line of every INFO reply into a
+     * heap allocated string costs more than the parsing itself, while only
+     * a handful of fields is interesting. The first character is enough to
+     * discard most lines, and since the lines are not nul terminated every
+     * match is length checked; numerical fields can be converted directly
+     * because the conversion stops at the '\r' ending the line. */
+    while (*p) {
         sentinelRedisInstance *slave;
-        sds l = lines[j];
-
-        /* run_id:<40 hex chars>*/
-        if (sdslen(l) >= 47 && !memcmp(l,"run_id:",7)) {
-            if (ri->runid == NULL) {
-                ri->runid = sdsnewlen(l+7,40);
-            } else {
-                if (strncmp(ri->runid,l+7,40) != 0) {
-                    sentinelEvent(LL_NOTICE,"+reboot",ri,"%@");
-                    sdsfree(ri->runid);
+        const char *l = p;
+        const char *eol = strchr(p,'\r');
+        size_t ll = eol ? (size_t)(eol-p) : strlen(p);
+
+        p += ll;
+        if (p[0] == '\r') p++;
+        if (p[0] == '\n') p++;
+        if (ll == 0) continue;
+
+        switch(l[0]) {
+        case 'r':
+            /* run_id:<40 hex chars>*/
+            if (ll >= 47 && !memcmp(l,"run_id:",7)) {
+                if (ri->runid == NULL) {
                     ri->runid = sdsnewlen(l+7,40);
+                } else {
+                    if (strncmp(ri->runid,l+7,40) != 0) {
+                        sentinelEvent(LL_NOTICE,"+reboot",ri,"%@");
+                        sdsfree(ri->runid);
+                        ri->runid = sdsnewlen(l+7,40);
+                    }
                 }
             }
-        }
 
-        /* old versions: slave0:<ip>,<port>,<state>
-         * new versions: slave0:ip=127.0.0.1,port=9999,... */
-        if ((ri->flags & SRI_MASTER) &&
-            sdslen(l) >= 7 &&
-            !memcmp(l,"slave",5) && isdigit(l[5]))
-        {
-            char *ip, *port, *end;
-
-            if (strstr(l,"ip=") == NULL) {
-                /* Old format. */
-                ip = strchr(l,':'); if (!ip) continue;
-                ip++; /* Now ip points to start of ip address. */
-                port = strchr(ip,','); if (!port) continue;
-                *port = '\0'; /* nul term for easy access. */
-                port++; /* Now port points to start of port number. */
-                end = strchr(port,','); if (!end) continue;
-                *end = '\0'; /* nul term for easy access. */
-            } else {
-                /* New format. */
-                ip = strstr(l,"ip="); if (!ip) continue;
-                ip += 3; /* Now ip points to start of ip address. */
-                port = strstr(l,"port="); if (!port) continue;
-                port += 5; /* Now port points to start of port number. */
-                /* Nul term both fields for easy access. */
-                end = strchr(ip,','); if (end) *end = '\0';
-                end = strchr(port,','); if (end) *end = '\0';
-            }
-
-            /* Check if we already have this slave into our table,
-             * otherwise add it. */
-            if (sentinelRedisInstanceLookupSlave(ri,ip,atoi(port)) == NULL) {
-                if ((slave = createSentinelRedisInstance(NULL,SRI_SLAVE,ip,
-                            atoi(port), ri->quorum, ri)) != NULL)
-                {
-                    sentinelEvent(LL_NOTICE,"+slave",slave,"%@");
-                    sentinelFlushConfig();
+            /* role:<role> */
+            if (ll == 11 && !memcmp(l,"role:master",11)) role = SRI_MASTER;
+            else if (ll == 10 && !memcmp(l,"role:slave",10)) role = SRI_SLAVE;
+            break;
+        case 's':
+            /* old versions: slave0:<ip>,<port>,<state>
+             * new versions: slave0:ip=127.0.0.1,port=9999,... */
+            if ((ri->flags & SRI_MASTER) &&
+                ll >= 7 &&
+                !memcmp(l,"slave",5) && isdigit(l[5]))
+            {
+                char ip[NET_IP_STR_LEN];
+                const char *ipp, *portp, *end;
+                size_t iplen;
+
+                if ((ipp = sentinelInfoFieldInLine(l,ll,"ip=",3)) != NULL) {
+                    /* New format. */
+                    portp = sentinelInfoFieldInLine(l,ll,"port=",5);
+                    if (!portp) break;
+                } else {
+                    /* Old format. */
+                    ipp = memchr(l,':',ll); if (!ipp) break;
+                    ipp++; /* Now ipp points to start of ip address. */
+                    portp = memchr(ipp,',',l+ll-ipp); if (!portp) break;
+                    portp++; /* Now portp points to start of port number. */
+                }
+                end = memchr(ipp,',',l+ll-ipp);
+                iplen = end ? (size_t)(end-ipp) : (size_t)(l+ll-ipp);
+                if (iplen == 0 || iplen >= sizeof(ip)) break;
+                memcpy(ip,ipp,iplen);
+                ip[iplen] = '\0';
+
+                /* Check if we already have this slave into our table,
+                 * otherwise add it. */
+                if (sentinelRedisInstanceLookupSlave(ri,ip,atoi(portp)) == NULL) {
+                    if ((slave = createSentinelRedisInstance(NULL,SRI_SLAVE,ip,
+                                atoi(portp), ri->quorum, ri)) != NULL)
+                    {
+                        sentinelEvent(LL_NOTICE,"+slave",slave,"%@");
+                        sentinelFlushConfig();
+                    }
                 }
             }
-        }
 
-        /* master_link_down_since_seconds:<seconds> */
-        if (sdslen(l) >= 32 &&
-            !memcmp(l,"master_link_down_since_seconds",30))
-        {
-            ri->master_link_down_time = strtoll(l+31,NULL,10)*1000;
-        }
+            if (role == SRI_SLAVE) {
+                /* slave_priority:<priority> */
+                if (ll >= 15 && !memcmp(l,"slave_priority:",15))
+                    ri->slave_priority = atoi(l+15);
 
-        /* role:<role> */
-        if (!memcmp(l,"role:master",11)) role = SRI_MASTER;
-        else if (!memcmp(l,"role:slave",10)) role = SRI_SLAVE;
+                /* slave_repl_offset:<offset> */
+                if (ll >= 18 && !memcmp(l,"slave_repl_offset:",18))
+                    ri->slave_repl_offset = strtoull(l+18,NULL,10);
+            }
+            break;
+        case 'm':
+            /* master_link_down_since_seconds:<seconds> */
+            if (ll >= 32 &&
+                !memcmp(l,"master_link_down_since_seconds",30))
+            {
+                ri->master_link_down_time = strtoll(l+31,NULL,10)*1000;
+            }
 
-        if (role == SRI_SLAVE) {
-            /* master_host:<host> */
-            if (sdslen(l) >= 12 && !memcmp(l,"master_host:",12)) {
-                if (ri->slave_master_host == NULL ||
-                    strcasecmp(l+12,ri->slave_master_host))
-                {
-                    sdsfree(ri->slave_master_host);
-                    ri->slave_master_host = sdsnew(l+12);
-                    ri->slave_conf_change_time = mstime();
+            if (role == SRI_SLAVE) {
+                /* master_host:<host> */
+                if (ll >= 12 && !memcmp(l,"master_host:",12)) {
+                    size_t hl = ll-12;
+                    if (ri->slave_master_host == NULL ||
+                        sdslen(ri->slave_master_host) != hl ||
+                        strncasecmp(l+12,ri->slave_master_host,hl))
+                    {
+                        sdsfree(ri->slave_master_host);
+                        ri->slave_master_host = sdsnewlen(l+12,hl);
+                        ri->slave_conf_change_time = mstime();
+                    }
                 }
-            }
 
-            /* master_port:<port> */
-            if (sdslen(l) >= 12 && !memcmp(l,"master_port:",12)) {
-                int slave_master_port = atoi(l+12);
+                /* master_port:<port> */
+                if (ll >= 12 && !memcmp(l,"master_port:",12)) {
+                    int slave_master_port = atoi(l+12);
 
-                if (ri->slave_master_port != slave_master_port) {
-                    ri->slave_master_port = slave_master_port;
-                    ri->slave_conf_change_time = mstime();
+                    if (ri->slave_master_port != slave_master_port) {
+                        ri->slave_master_port = slave_master_port;
+                        ri->slave_conf_change_time = mstime();
+                    }
                 }
-            }
 
-            /* master_link_status:<status> */
-            if (sdslen(l) >= 19 && !memcmp(l,"master_link_status:",19)) {
-                ri->slave_master_link_status =
-                    (strcasecmp(l+19,"up") == 0) ?
-                    SENTINEL_MASTER_LINK_STATUS_UP :
-                    SENTINEL_MASTER_LINK_STATUS_DOWN;
+                /* master_link_status:<status> */
+                if (ll >= 19 && !memcmp(l,"master_link_status:",19)) {
+                    ri->slave_master_link_status =
+                        (ll == 21 && !strncasecmp(l+19,"up",2)) ?
+                        SENTINEL_MASTER_LINK_STATUS_UP :
+                        SENTINEL_MASTER_LINK_STATUS_DOWN;
+                }
             }
-
-            /* slave_priority:<priority> */
-            if (sdslen(l) >= 15 && !memcmp(l,"slave_priority:",15))
-                ri->slave_priority = atoi(l+15);
-
-            /* slave_repl_offset:<offset> */
-            if (sdslen(l) >= 18 && !memcmp(l,"slave_repl_offset:",18))
-                ri->slave_repl_offset = strtoull(l+18,NULL,10);
+            break;
         }
     }
     ri->info_refresh = mstime();
-    sdsfreesplitres(lines,numlines);
 
     /* ---------------------------- Acting half -----------------------------
      * Some things will not happen if sentinel.tilt is true, but some will
@@ -222,6 +222,10 @@ struct redisCommand redisCommandTable[] = {
      "write fast @keyspace",
      0,NULL,1,-1,1,0,0,0},
 
+    {"unlinkmatch",unlinkmatchCommand,-2,
+     "write @keyspace",
+     0,NULL,0,0,0,0,0,0},
+
     {"exists",existsCommand,-2,
      "read-only fast @keyspace",
      0,NULL,1,-1,1,0,0,0},
@@ -250,6 +254,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only @string",
      0,NULL,1,1,1,0,0,0},
 
+    {"strrange",strrangeCommand,-2,
+     "write use-memory @string",
+     0,NULL,1,1,1,0,0,0},
+
     {"incr",incrCommand,2,
      "write use-memory fast @string",
      0,NULL,1,1,1,0,0,0},
@@ -334,6 +342,10 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory fast @set",
      0,NULL,1,1,1,0,0,0},
 
+    {"saddsorted",saddsortedCommand,-3,
+     "write use-memory @set",
+     0,NULL,1,1,1,0,0,0},
+
     {"srem",sremCommand,-3,
      "write fast @set",
      0,NULL,1,1,1,0,0,0},
@@ -362,6 +374,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only to-sort @set",
      0,NULL,1,-1,1,0,0,0},
 
+    {"sintercard",sintercardCommand,-3,
+     "read-only @set",
+     0,sintercardGetKeys,0,0,0,0,0,0},
+
     {"sinterstore",sinterstoreCommand,-3,
      "write use-memory @set",
      0,NULL,1,-1,1,0,0,0},
@@ -394,6 +410,10 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory fast @sortedset",
      0,NULL,1,1,1,0,0,0},
 
+    {"zaddsorted",zaddsortedCommand,-4,
+     "write use-memory @sortedset",
+     0,NULL,1,1,1,0,0,0},
+
     {"zincrby",zincrbyCommand,4,
      "write use-memory fast @sortedset",
      0,NULL,1,1,1,0,0,0},
@@ -454,6 +474,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only @sortedset",
      0,NULL,1,1,1,0,0,0},
 
+    {"zrangestore",zrangestoreCommand,-5,
+     "write use-memory @sortedset",
+     0,NULL,1,2,1,0,0,0},
+
     {"zcard",zcardCommand,2,
      "read-only fast @sortedset",
      0,NULL,1,1,1,0,0,0},
@@ -531,15 +555,15 @@ struct redisCommand redisCommandTable[] = {
      0,NULL,1,1,1,0,0,0},
 
     {"hkeys",hkeysCommand,2,
-     "read-only to-sort @hash",
+     "read-only to-sort resumable @hash",
      0,NULL,1,1,1,0,0,0},
 
     {"hvals",hvalsCommand,2,
-     "read-only to-sort @hash",
+     "read-only to-sort resumable @hash",
      0,NULL,1,1,1,0,0,0},
 
     {"hgetall",hgetallCommand,2,
-     "read-only random @hash",
+     "read-only random resumable @hash",
      0,NULL,1,1,1,0,0,0},
 
     {"hexists",hexistsCommand,3,
@@ -550,6 +574,34 @@ struct redisCommand redisCommandTable[] = {
      "read-only random @hash",
      0,NULL,1,1,1,0,0,0},
 
+    {"hexpire",hexpireCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpire",hpexpireCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hexpireat",hexpireatCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpireat",hpexpireatCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"httl",httlCommand,-5,
+     "read-only fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpttl",hpttlCommand,-5,
+     "read-only fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpersist",hpersistCommand,-5,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
     {"incrby",incrbyCommand,3,
      "write use-memory fast @string",
      0,NULL,1,1,1,0,0,0},
@@ -566,6 +618,14 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory fast @string",
      0,NULL,1,1,1,0,0,0},
 
+    {"getdel",getdelCommand,2,
+     "write fast @string",
+     0,NULL,1,1,1,0,0,0},
+
+    {"getex",getexCommand,-2,
+     "write fast @string",
+     0,NULL,1,1,1,0,0,0},
+
     {"mset",msetCommand,-3,
      "write use-memory @string",
      0,NULL,1,-1,2,0,0,0},
@@ -620,6 +680,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only to-sort @keyspace @dangerous",
      0,NULL,0,0,0,0,0,0},
 
+    {"keysasync",keysasyncCommand,2,
+     "read-only no-script @keyspace @dangerous @blocking",
+     0,NULL,0,0,0,0,0,0},
+
     {"scan",scanCommand,-2,
      "read-only random @keyspace",
      0,NULL,0,0,0,0,0,0},
@@ -643,7 +707,7 @@ struct redisCommand redisCommandTable[] = {
      "read-only fast @connection",
      0,NULL,0,0,0,0,0,0},
 
-    {"save",saveCommand,1,
+    {"save",saveCommand,-1,
      "admin no-script",
      0,NULL,0,0,0,0,0,0},
 
@@ -667,6 +731,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only fast @keyspace",
      0,NULL,1,1,1,0,0,0},
 
+    {"keyinfo",keyinfoCommand,-2,
+     "read-only random fast @keyspace",
+     0,NULL,1,-1,1,0,0,0},
+
     {"multi",multiCommand,1,
      "no-script fast @transaction",
      0,NULL,0,0,0,0,0,0},
@@ -837,6 +905,10 @@ struct redisCommand redisCommandTable[] = {
      "no-script @scripting",
      0,evalGetKeys,0,0,0,0,0,0},
 
+    {"evalref",evalRefCommand,-3,
+     "no-script @scripting",
+     0,evalGetKeys,0,0,0,0,0,0},
+
     {"slowlog",slowlogCommand,-2,
      "admin random",
      0,NULL,0,0,0,0,0,0},
@@ -994,6 +1066,14 @@ struct redisCommand redisCommandTable[] = {
      "admin no-script ok-loading ok-stale",
      0,NULL,0,0,0,0,0,0},
 
+    {"hotkeys",hotkeysCommand,-1,
+     "admin no-script ok-loading ok-stale",
+     0,NULL,0,0,0,0,0,0},
+
+    {"eviction",evictionCommand,-2,
+     "admin no-script random",
+     0,NULL,0,0,0,0,0,0},
+
     {"lolwut",lolwutCommand,-1,
      "read-only fast",
      0,NULL,0,0,0,0,0,0},
@@ -1181,6 +1261,36 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+/* Keys up to key-inline-max-size bytes are stored inline inside the hash
+ * table entry itself as an sds string with the smallest header, saving the
+ * separate key allocation and one dependent cache miss per compared entry.
+ * The default limit of 15 keeps the common entry within a single cache
+ * line; instances whose keys are long because of a prefixed naming scheme
+ * can raise it so the whole key fits in the entry, trading larger entries
+ * for one less live allocation per key. */
+size_t dictSdsKeyInlineSize(const void *key) {
+    size_t len = sdslen((sds)key);
+
+    return (len <= (size_t)server.key_inline_max_size) ?
+           sdsplacesize(len) : 0;
+}
+
+/* Collection element dicts (sets, hash fields) use a larger inline limit:
+ * they are scanned less densely than the keyspace dict, and the point
+ * there is saving the per-allocation overhead, so everything short enough
+ * to be an embedded string robj is worth embedding in the entry too. */
+#define DICT_SDS_INLINE_ELE_MAX 44
+
+size_t dictSdsEleInlineSize(const void *key) {
+    size_t len = sdslen((sds)key);
+
+    return (len <= DICT_SDS_INLINE_ELE_MAX) ? sdsplacesize(len) : 0;
+}
+
+void *dictSdsKeyInlineCopy(void *buf, const void *key) {
+    return sdsplacelen(buf,key,sdslen((sds)key));
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -1264,14 +1374,18 @@ dictType objectKeyHeapPointerValueDictType = {
     dictVanillaFree            /* val destructor */
 };
 
-/* Set dictionary type. Keys are SDS strings, values are ot used. */
+/* Set dictionary type. Keys are SDS strings, values are ot used. Short
+ * elements are stored inline in the entries (see dictEntryEx in dict.h). */
 dictType setDictType = {
     dictSdsHash,               /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     dictSdsDestructor,         /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    dictSdsEleInlineSize,      /* inline key size */
+    dictSdsKeyInlineCopy,      /* inline key copy */
+    DICT_SPEC_SDS_KEY          /* shape hint */
 };
 
 /* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
@@ -1281,17 +1395,24 @@ dictType zsetDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     NULL,                      /* Note: SDS string shared & freed by skiplist */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* inline key size */
+    NULL,                      /* inline key copy */
+    DICT_SPEC_SDS_KEY          /* shape hint */
 };
 
-/* Db->dict, keys are sds strings, vals are Redis objects. */
+/* Db->dict, keys are sds strings, vals are Redis objects. Short keys are
+ * stored inline in the hash table entries (see dictEntryEx in dict.h). */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    dictObjectDestructor,       /* val destructor */
+    dictSdsKeyInlineSize,       /* inline key size */
+    dictSdsKeyInlineCopy,       /* inline key copy */
+    DICT_SPEC_SDS_KEY           /* shape hint */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -1314,6 +1435,22 @@ dictType keyptrDictType = {
     NULL                        /* val destructor */
 };
 
+static void dictListpackDestructor(void *privdata, void *val) {
+    DICT_NOTUSED(privdata);
+
+    if (val) lpFree(val);
+}
+
+/* Db->hexpires, key name (owned sds) -> listpack of field TTL pairs. */
+dictType hashExpiresDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictListpackDestructor      /* val destructor */
+};
+
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
     dictSdsCaseHash,            /* hash function */
@@ -1331,7 +1468,9 @@ dictType hashDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictSdsDestructor           /* val destructor */
+    dictSdsDestructor,          /* val destructor */
+    dictSdsEleInlineSize,       /* inline key size */
+    dictSdsKeyInlineCopy        /* inline key copy */
 };
 
 /* Keylist hash table type has unencoded redis objects as keys and
@@ -1346,6 +1485,28 @@ dictType keylistDictType = {
     dictListDestructor          /* val destructor */
 };
 
+/* Client secondary indexes: sds keys (a peer address or a client name)
+ * mapping to lists of clients. The lists are managed by networking.c. */
+dictType clientIndexDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictListDestructor          /* val destructor */
+};
+
+/* Unique pattern subscriptions dict, mapping pattern objects to their
+ * pubsubPattern entry. The entries are managed by pubsub.c. */
+dictType pubsubPatternDictType = {
+    dictObjHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictObjKeyCompare,          /* key compare */
+    dictObjectDestructor,       /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /* Cluster nodes hash table, mapping nodes addresses 1.2.3.4:6379 to
  * clusterNode structures. */
 dictType clusterNodesDictType = {
@@ -1391,6 +1552,18 @@ dictType migrateCacheDictType = {
     NULL                        /* val destructor */
 };
 
+/* Sets of key names changed since the last snapshot, used by the
+ * incremental RDB machinery (server.rdb_delta_keys). Keys are sds strings
+ * owned by the dictionary, values are not used. */
+dictType rdbDeltaKeysDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /* Replication cached script dict (server.repl_scriptcache_dict).
  * Keys are sds SHA1 strings, while values are not used at all in the current
  * implementation. */
@@ -1415,8 +1588,10 @@ int htNeedsResize(dict *dict) {
 /* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
  * we resize the hash table to save memory */
 void tryResizeHashTables(int dbid) {
-    if (htNeedsResize(server.db[dbid].dict))
-        dictResize(server.db[dbid].dict);
+    for (int i = 0; i < server.db_dict_shards; i++) {
+        if (htNeedsResize(server.db[dbid].dict[i]))
+            dictResize(server.db[dbid].dict[i]);
+    }
     if (htNeedsResize(server.db[dbid].expires))
         dictResize(server.db[dbid].expires);
 }
@@ -1428,11 +1603,117 @@ void tryResizeHashTables(int dbid) {
  *
  * The function returns 1 if some rehashing was performed, otherwise 0
  * is returned. */
+/* ----------------------------------------------------------------------------
+ * Background rehashing
+ *
+ * With background-rehashing enabled, the incremental rehash work for the
+ * database dicts is moved off the main thread: a dedicated worker runs
+ * dictRehash() in small bucket batches, but ONLY while the main thread is
+ * blocked in the multiplexing syscall, when it is guaranteed not to touch
+ * the keyspace. The handshake is driven from the event loop itself:
+ * beforeSleep() points the worker at a rehashing dict and lets it run,
+ * afterSleep() stops it and waits for the current batch (at most
+ * REHASH_BG_BATCH buckets) to complete before any event is served. The
+ * main thread therefore never pays for bucket migration, only for the
+ * brief handshake, and a huge table no longer steals a millisecond from
+ * every cron tick.
+ * -------------------------------------------------------------------- */
+
+#define REHASH_BG_BATCH 100 /* Buckets per batch, bounds the handshake wait. */
+
+static pthread_t rehash_bg_thread;
+static pthread_mutex_t rehash_bg_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rehash_bg_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rehash_bg_parked = PTHREAD_COND_INITIALIZER;
+static dict *rehash_bg_target = NULL;
+static int rehash_bg_run = 0;     /* Worker may process batches. */
+static int rehash_bg_busy = 0;    /* Worker is inside a batch. */
+static int rehash_bg_spawned = 0;
+static int rehash_bg_kicked = 0;  /* Main thread only: pause needed. */
+
+void *backgroundRehashMain(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&rehash_bg_mutex);
+    while(1) {
+        while (!rehash_bg_run) pthread_cond_wait(&rehash_bg_start,&rehash_bg_mutex);
+        dict *d = rehash_bg_target;
+        rehash_bg_busy = 1;
+        pthread_mutex_unlock(&rehash_bg_mutex);
+        int more = dictRehash(d,REHASH_BG_BATCH);
+        pthread_mutex_lock(&rehash_bg_mutex);
+        rehash_bg_busy = 0;
+        if (!more) {
+            /* Table fully migrated: nothing else can be safely picked up
+             * without the main thread, park until the next kick. */
+            rehash_bg_run = 0;
+            rehash_bg_target = NULL;
+        }
+        pthread_cond_signal(&rehash_bg_parked);
+    }
+}
+
+void backgroundRehashInit(void) {
+    if (pthread_create(&rehash_bg_thread,NULL,backgroundRehashMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize background rehashing thread.");
+        exit(1);
+    }
+    rehash_bg_spawned = 1;
+}
+
+/* Called at the very end of beforeSleep(): if some database dict is in
+ * the middle of a rehash, let the worker advance it while we sleep. */
+void backgroundRehashKick(void) {
+    static int kick_db = 0;
+    dict *d = NULL;
+
+    if (!rehash_bg_spawned || !server.background_rehashing ||
+        !server.activerehashing) return;
+    /* Module threads may acquire the GIL and touch the keyspace while the
+     * main thread sleeps: don't rehash under their feet. */
+    if (moduleCount()) return;
+
+    for (int j = 0; j < server.dbnum && d == NULL; j++) {
+        redisDb *db = server.db+(kick_db % server.dbnum);
+        for (int i = 0; i < server.db_dict_shards; i++) {
+            if (dictIsRehashing(db->dict[i])) {
+                d = db->dict[i];
+                break;
+            }
+        }
+        if (d == NULL && dictIsRehashing(db->expires)) d = db->expires;
+        if (d == NULL) kick_db++;
+    }
+    if (d == NULL) return;
+
+    pthread_mutex_lock(&rehash_bg_mutex);
+    rehash_bg_target = d;
+    rehash_bg_run = 1;
+    pthread_cond_signal(&rehash_bg_start);
+    pthread_mutex_unlock(&rehash_bg_mutex);
+    rehash_bg_kicked = 1;
+}
+
+/* Called first thing in afterSleep(): stop the worker and wait for the
+ * in-flight batch, so events are served with exclusive dict access. */
+void backgroundRehashPause(void) {
+    if (!rehash_bg_kicked) return;
+    rehash_bg_kicked = 0;
+    pthread_mutex_lock(&rehash_bg_mutex);
+    rehash_bg_run = 0;
+    rehash_bg_target = NULL;
+    while (rehash_bg_busy)
+        pthread_cond_wait(&rehash_bg_parked,&rehash_bg_mutex);
+    pthread_mutex_unlock(&rehash_bg_mutex);
+}
+
 int incrementallyRehash(int dbid) {
-    /* Keys dictionary */
-    if (dictIsRehashing(server.db[dbid].dict)) {
-        dictRehashMilliseconds(server.db[dbid].dict,1);
-        return 1; /* already used our millisecond for this loop... */
+    /* Keys dictionaries: with a sharded keyspace only one shard is
+     * rehashed for each call, to bound the latency of the step. */
+    for (int i = 0; i < server.db_dict_shards; i++) {
+        if (dictIsRehashing(server.db[dbid].dict[i])) {
+            dictRehashMilliseconds(server.db[dbid].dict[i],1);
+            return 1; /* already used our millisecond for this loop... */
+        }
     }
     /* Expires */
     if (dictIsRehashing(server.db[dbid].expires)) {
@@ -1458,7 +1739,9 @@ void updateDictResizePolicy(void) {
 int hasActiveChildProcess() {
     return server.rdb_child_pid != -1 ||
            server.aof_child_pid != -1 ||
-           server.module_child_pid != -1;
+           server.module_child_pid != -1 ||
+           server.snapshot_child_pid != -1 ||
+           server.census_child_pid != -1;
 }
 
 /* ======================= Cron: called every 100 ms ======================== */
@@ -1490,38 +1773,19 @@ long long getInstantaneousMetric(int metric) {
     return sum / STATS_METRIC_SAMPLES;
 }
 
-/* Check for timeouts. Returns non-zero if the client was terminated.
- * The function gets the current time in milliseconds as argument since
- * it gets called multiple times in a loop, so calling gettimeofday() for
- * each iteration would be costly without any actual gain. */
+/* Check for cluster redirections of blocked clients. Idle and blocking
+ * timeouts are not checked here anymore: they are enforced by the timeout
+ * table, that only visits the due clients (see blocked.c). Returns
+ * non-zero if the client was terminated, to mirror the other per client
+ * cron handlers. */
 int clientsCronHandleTimeout(client *c, mstime_t now_ms) {
-    time_t now = now_ms/1000;
-
-    if (server.maxidletime &&
-        !(c->flags & CLIENT_SLAVE) &&    /* no timeout for slaves */
-        !(c->flags & CLIENT_MASTER) &&   /* no timeout for masters */
-        !(c->flags & CLIENT_BLOCKED) &&  /* no timeout for BLPOP */
-        !(c->flags & CLIENT_PUBSUB) &&   /* no timeout for Pub/Sub clients */
-        (now - c->lastinteraction > server.maxidletime))
-    {
-        serverLog(LL_VERBOSE,"Closing idle client");
-        freeClient(c);
-        return 1;
-    } else if (c->flags & CLIENT_BLOCKED) {
-        /* Blocked OPS timeout is handled with milliseconds resolution.
-         * However note that the actual resolution is limited by
-         * server.hz. */
-
-        if (c->bpop.timeout != 0 && c->bpop.timeout < now_ms) {
-            /* Handle blocking operation specific timeout. */
-            replyToBlockedClientTimedOut(c);
+    UNUSED(now_ms);
+
+    if (server.cluster_enabled && c->flags & CLIENT_BLOCKED) {
+        /* Cluster: handle unblock & redirect of clients blocked
+         * into keys no longer served by this server. */
+        if (clusterRedirectBlockedClientIfNeeded(c))
             unblockClient(c);
-        } else if (server.cluster_enabled) {
-            /* Cluster: handle unblock & redirect of clients blocked
-             * into keys no longer served by this server. */
-            if (clusterRedirectBlockedClientIfNeeded(c))
-                unblockClient(c);
-        }
     }
     return 0;
 }
@@ -1641,7 +1905,7 @@ void getExpansiveClientsInfo(size_t *in_usage, size_t *out_usage) {
  * of clients per second, turning this function into a source of latency.
  */
 #define CLIENTS_CRON_MIN_ITERATIONS 5
-void clientsCron(void) {
+void clientsCron(long long budget_usec) {
     /* Try to process at least numclients/server.hz of clients
      * per call. Since normally (if there are no big latency events) this
      * function is called server.hz times per second, in the average case we
@@ -1649,6 +1913,8 @@ void clientsCron(void) {
     int numclients = listLength(server.clients);
     int iterations = numclients/server.hz;
     mstime_t now = mstime();
+    long long start = ustime();
+    int processed = 0;
 
     /* Process at least a few clients while we are at it, even if we need
      * to process less than CLIENTS_CRON_MIN_ITERATIONS to meet our contract
@@ -1661,6 +1927,12 @@ void clientsCron(void) {
         client *c;
         listNode *head;
 
+        /* Stop at the time budget: the list rotation below preserves the
+         * progress, the clients not visited are just processed by the next
+         * invocations of the task. The query buffer resize pass especially
+         * can touch many allocations in a row. */
+        if ((++processed & 15) == 0 && ustime()-start > budget_usec) break;
+
         /* Rotate the list, take the current head, process.
          * This way if the client must be removed from the list it's the
          * first element and we don't incur into O(N) computation. */
@@ -1678,8 +1950,15 @@ void clientsCron(void) {
 
 /* This function handles 'background' operations we are required to do
  * incrementally in Redis databases, such as active key expiring, resizing,
- * rehashing. */
-void databasesCron(void) {
+ * rehashing.
+ *
+ * The budget is enforced at phase granularity: the expire, defrag and
+ * rehash phases all have their own internal time limits, so a phase may
+ * overrun the budget, but the next phases are then skipped and picked up
+ * by the following invocation of the task. */
+void databasesCron(long long budget_usec) {
+    long long start = ustime();
+
     /* Expire keys by random sampling. Not required for slaves
      * as master will synthesize DELs for us. */
     if (server.active_expire_enabled) {
@@ -1687,11 +1966,15 @@ void databasesCron(void) {
             activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
         } else {
             expireSlaveKeys();
+            if (server.replica_free_expired_values)
+                replicaFreeExpiredValues();
         }
     }
+    if (ustime()-start > budget_usec) return;
 
     /* Defrag keys gradually. */
     activeDefragCycle();
+    if (ustime()-start > budget_usec) return;
 
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
@@ -1714,8 +1997,9 @@ void databasesCron(void) {
             resize_db++;
         }
 
-        /* Rehash */
-        if (server.activerehashing) {
+        /* Rehash. When background rehashing is enabled the migration work
+         * is done by the worker between event loop iterations instead. */
+        if (server.activerehashing && !server.background_rehashing) {
             for (j = 0; j < dbs_per_call; j++) {
                 int work_done = incrementallyRehash(rehash_db);
                 if (work_done) {
@@ -1804,6 +2088,10 @@ void checkChildrenDone(void) {
         } else if (pid == server.module_child_pid) {
             ModuleForkDoneHandler(exitcode,bysignal);
             if (!bysignal && exitcode == 0) receiveChildInfo();
+        } else if (pid == server.snapshot_child_pid) {
+            snapshotDigestDoneHandler(exitcode,bysignal);
+        } else if (pid == server.census_child_pid) {
+            memoryCensusDoneHandler(exitcode,bysignal);
         } else {
             if (!ldbRemoveChild(pid)) {
                 serverLog(LL_WARNING,
@@ -1813,7 +2101,250 @@ void checkChildrenDone(void) {
         }
         updateDictResizePolicy();
         closeChildInfoPipe();
+        cowLedgerChildDone();
+        server.stat_current_cow_bytes = 0;
+    }
+}
+
+/* ======================= Event loop CPU accounting ========================
+ *
+ * The slow log attributes time to individual commands, but nothing tells
+ * where the loop spends its time *between* commands: beforeSleep() alone
+ * flushes the AOF, serves pending writes, runs the fast expire cycle and
+ * flushes invalidation messages, all unattributed. Here we timestamp the
+ * loop phases with the cycle counter, aggregate the cycles per second per
+ * phase, and keep a minute of per-second history, so that a latency
+ * regression can be blamed on the responsible subsystem in production.
+ *
+ * The counters are exposed in the INFO "loopstats" section (last completed
+ * second) and via DEBUG LOOPSTATS (full history, LATENCY HISTORY style).
+ *
+ * Note that "dispatch" covers all the event callbacks fired by the loop,
+ * including the serverCron() time event, so the serverCron() part of the
+ * "cron" phase is a subset of it; the deadline scheduled cron tasks (see
+ * the scheduler below) run from beforeSleep() and are disjoint. */
+
+/* The loop phases we account for. */
+#define LOOP_PHASE_POLL 0       /* Multiplexing wait, busy polling included. */
+#define LOOP_PHASE_DISPATCH 1   /* Event callbacks: reads, commands, replies. */
+#define LOOP_PHASE_EXPIRE 2     /* Fast expire cycle of beforeSleep(). */
+#define LOOP_PHASE_EVICT 3      /* Pending eviction work. */
+#define LOOP_PHASE_UNBLOCK 4    /* WAIT acks, unblocked and deferred clients. */
+#define LOOP_PHASE_TRACKING 5   /* Invalidation and notification flushes. */
+#define LOOP_PHASE_AOF 6        /* flushAppendOnlyFile(). */
+#define LOOP_PHASE_WRITES 7     /* Pending writes, threaded or not. */
+#define LOOP_PHASE_READS 8      /* Threaded pending reads in afterSleep(). */
+#define LOOP_PHASE_CRON 9       /* serverCron() and the scheduled tasks. */
+#define LOOP_PHASE_COUNT 10
+
+#define LOOPSTATS_HISTORY 60    /* Seconds of per-phase history retained. */
+
+static const char *loopstats_phase_names[LOOP_PHASE_COUNT] = {
+    "poll", "dispatch", "expire", "evict", "unblock", "tracking", "aof",
+    "writes", "reads", "cron"
+};
+
+/* Current second accumulators and the history ring. */
+static uint64_t loopstats_cycles[LOOP_PHASE_COUNT];
+static uint64_t loopstats_calls[LOOP_PHASE_COUNT];
+static uint64_t loopstats_hist_cycles[LOOPSTATS_HISTORY][LOOP_PHASE_COUNT];
+static uint64_t loopstats_hist_calls[LOOPSTATS_HISTORY][LOOP_PHASE_COUNT];
+static time_t loopstats_hist_time[LOOPSTATS_HISTORY];
+static int loopstats_hist_idx = 0;
+static time_t loopstats_cursec = 0;
+
+/* Open phase markers, shared between beforeSleep() and afterSleep(). */
+static uint64_t loopstats_poll_start = 0;
+static uint64_t loopstats_dispatch_start = 0;
+
+/* Reference point to convert cycles into microseconds for reporting. */
+static uint64_t loopstats_ref_cycles = 0;
+static long long loopstats_ref_ustime = 0;
+
+/* Read the CPU cycle counter. Where no cheap counter is available the
+ * microsecond clock stands in: the reporting code only ever converts
+ * through the measured cycles/usec ratio, so the unit does not matter. */
+static inline uint64_t loopstatsCycles(void) {
+#if defined(__x86_64__)
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return (uint64_t)ustime();
+#endif
+}
+
+/* Cycles per microsecond measured from the reference point taken when the
+ * first sample was recorded. Returns zero if we can't tell yet. */
+static double loopstatsCyclesPerUsec(void) {
+    long long us = ustime() - loopstats_ref_ustime;
+    if (loopstats_ref_ustime == 0 || us <= 0) return 0;
+    return (double)(loopstatsCycles() - loopstats_ref_cycles) / us;
+}
+
+/* Push the accumulators of the completed second into the history ring. */
+static void loopstatsRotate(void) {
+    int j;
+
+    if (loopstats_cursec != 0) {
+        memcpy(loopstats_hist_cycles[loopstats_hist_idx],loopstats_cycles,
+               sizeof(loopstats_cycles));
+        memcpy(loopstats_hist_calls[loopstats_hist_idx],loopstats_calls,
+               sizeof(loopstats_calls));
+        loopstats_hist_time[loopstats_hist_idx] = loopstats_cursec;
+        loopstats_hist_idx = (loopstats_hist_idx+1) % LOOPSTATS_HISTORY;
+    }
+    for (j = 0; j < LOOP_PHASE_COUNT; j++)
+        loopstats_cycles[j] = loopstats_calls[j] = 0;
+    loopstats_cursec = server.unixtime;
+}
+
+/* Account the cycles elapsed since 'start' to 'phase' and return the
+ * current cycle counter, so that consecutive phases can be chained. */
+static uint64_t loopstatsSample(int phase, uint64_t start) {
+    uint64_t now = loopstatsCycles();
+
+    if (loopstats_ref_ustime == 0) {
+        loopstats_ref_cycles = now;
+        loopstats_ref_ustime = ustime();
+    }
+    if (server.unixtime != loopstats_cursec) loopstatsRotate();
+    loopstats_cycles[phase] += now - start;
+    loopstats_calls[phase]++;
+    return now;
+}
+
+/* Append the last completed second to the INFO "loopstats" section. */
+sds loopstatsCatInfoString(sds info) {
+    int last = (loopstats_hist_idx+LOOPSTATS_HISTORY-1) % LOOPSTATS_HISTORY;
+    uint64_t *cycles = loopstats_hist_cycles[last];
+    uint64_t *calls = loopstats_hist_calls[last];
+    double cpu = loopstatsCyclesPerUsec();
+    uint64_t total = 0;
+    int j;
+
+    if (loopstats_hist_time[last] == 0) return info;
+    for (j = 0; j < LOOP_PHASE_COUNT; j++)
+        if (j != LOOP_PHASE_CRON) total += cycles[j];
+    for (j = 0; j < LOOP_PHASE_COUNT; j++) {
+        info = sdscatprintf(info,
+            "loopstat_%s:cycles=%llu,calls=%llu,usec=%llu,pct=%.2f\r\n",
+            loopstats_phase_names[j],
+            (unsigned long long) cycles[j],
+            (unsigned long long) calls[j],
+            (unsigned long long) (cpu > 0 ? cycles[j]/cpu : 0),
+            total ? (double)cycles[j]*100/total : 0);
+    }
+    return info;
+}
+
+/* Reply with the per-phase history for DEBUG LOOPSTATS, in the same shape
+ * of LATENCY HISTORY: for every phase, an array of (timestamp, usec)
+ * pairs, oldest to newest. */
+void loopstatsReplyHistory(client *c) {
+    double cpu = loopstatsCyclesPerUsec();
+    int j, i, samples;
+
+    addReplyArrayLen(c,LOOP_PHASE_COUNT);
+    for (j = 0; j < LOOP_PHASE_COUNT; j++) {
+        samples = 0;
+        for (i = 0; i < LOOPSTATS_HISTORY; i++)
+            if (loopstats_hist_time[i] != 0) samples++;
+        addReplyArrayLen(c,2);
+        addReplyBulkCString(c,(char*)loopstats_phase_names[j]);
+        addReplyArrayLen(c,samples);
+        for (i = 0; i < LOOPSTATS_HISTORY; i++) {
+            int idx = (loopstats_hist_idx+i) % LOOPSTATS_HISTORY;
+            if (loopstats_hist_time[idx] == 0) continue;
+            addReplyArrayLen(c,2);
+            addReplyLongLong(c,loopstats_hist_time[idx]);
+            addReplyLongLong(c,
+                cpu > 0 ? (long long)(loopstats_hist_cycles[idx][j]/cpu) : 0);
+        }
+    }
+}
+
+/* =========================== Cron task scheduler ==========================
+ *
+ * serverCron() used to run every maintenance duty wholesale at each tick:
+ * with clientsCron() and databasesCron() inside, a single tick could absorb
+ * several milliseconds (the query buffer resize pass over many clients is
+ * a known offender), showing up in the p999 of unrelated commands.
+ *
+ * The divisible duties are registered here instead. Each task declares a
+ * period and a per-invocation time budget, and the scheduler, driven by
+ * beforeSleep(), runs at most one due task per event loop iteration: under
+ * load the tasks interleave with command processing in sub-millisecond
+ * slices, while an idle server still runs them at timer resolution like
+ * before. Per task time accounting is exposed at the end of the INFO
+ * loopstats section. */
+
+typedef struct cronTask {
+    const char *name;
+    void (*proc)(long long budget_usec);
+    long long period_ms;    /* Ms between invocations, 0 = track server.hz. */
+    long long budget_usec;  /* Per invocation time budget. */
+    mstime_t next;          /* Deadline of the next invocation. */
+    long long usec;         /* Total time spent into the task. */
+    long long calls;        /* Invocations so far. */
+    long long max_usec;     /* Worst single invocation. */
+} cronTask;
+
+#define CRON_TASK_MAX 8
+static cronTask cron_tasks[CRON_TASK_MAX];
+static int cron_task_count = 0;
+
+void cronTaskRegister(const char *name, void (*proc)(long long),
+                      long long period_ms, long long budget_usec)
+{
+    serverAssert(cron_task_count < CRON_TASK_MAX);
+    cronTask *t = &cron_tasks[cron_task_count++];
+    t->name = name;
+    t->proc = proc;
+    t->period_ms = period_ms;
+    t->budget_usec = budget_usec;
+    t->next = 0;
+    t->usec = t->calls = t->max_usec = 0;
+}
+
+/* Run the most overdue task among the ones whose deadline arrived, if any.
+ * One task per call: the caller invokes us once per event loop iteration
+ * and the spreading across iterations is the whole point. */
+void cronTasksRun(void) {
+    mstime_t now = server.mstime;
+    cronTask *due = NULL;
+    long long start, elapsed;
+    int j;
+
+    for (j = 0; j < cron_task_count; j++) {
+        cronTask *t = &cron_tasks[j];
+        if (t->next > now) continue;
+        if (!due || t->next < due->next) due = t;
     }
+    if (!due) return;
+
+    start = ustime();
+    due->proc(due->budget_usec);
+    elapsed = ustime()-start;
+    due->usec += elapsed;
+    due->calls++;
+    if (elapsed > due->max_usec) due->max_usec = elapsed;
+    due->next = now + (due->period_ms ? due->period_ms : 1000/server.hz);
+}
+
+/* Append the per task accounting to the INFO loopstats section. */
+sds cronTasksCatInfoString(sds info) {
+    int j;
+
+    for (j = 0; j < cron_task_count; j++) {
+        cronTask *t = &cron_tasks[j];
+        info = sdscatprintf(info,
+            "loopstat_task_%s:usec=%lld,calls=%lld,max_usec=%lld,"
+            "usec_per_call=%.2f\r\n",
+            t->name, t->usec, t->calls, t->max_usec,
+            t->calls ? (double)t->usec/t->calls : 0);
+    }
+    return info;
 }
 
 /* This is our timer interrupt, called server.hz times per second.
@@ -1837,6 +2368,7 @@ void checkChildrenDone(void) {
 
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     int j;
+    uint64_t ls = loopstatsCycles();
     UNUSED(eventLoop);
     UNUSED(id);
     UNUSED(clientData);
@@ -1871,6 +2403,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 server.stat_net_output_bytes);
     }
 
+    /* Start evicting ahead of the maxmemory limit once the configured
+     * watermark is crossed. */
+    run_with_period(100) evictionProactiveCron();
+
     /* We have just LRU_BITS bits per object for LRU information.
      * So we use an (eventually wrapping) LRU clock.
      *
@@ -1881,7 +2417,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * not likely.
      *
      * Note that you can change the resolution altering the
-     * LRU_CLOCK_RESOLUTION define. */
+     * lru-clock-resolution configuration directive. */
     server.lruclock = getLRUClock();
 
     /* Record the max memory used since the server was started. */
@@ -1929,8 +2465,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         for (j = 0; j < server.dbnum; j++) {
             long long size, used, vkeys;
 
-            size = dictSlots(server.db[j].dict);
-            used = dictSize(server.db[j].dict);
+            size = 0;
+            used = dbSize(&server.db[j]);
+            for (int i = 0; i < server.db_dict_shards; i++)
+                size += dictSlots(server.db[j].dict[i]);
             vkeys = dictSize(server.db[j].expires);
             if (used || vkeys) {
                 serverLog(LL_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
@@ -1950,23 +2488,27 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         }
     }
 
-    /* We need to do a few operations on clients asynchronously. */
-    clientsCron();
-
-    /* Handle background operations on Redis databases. */
-    databasesCron();
+    /* Client servicing and database background operations run as deadline
+     * scheduled tasks from beforeSleep(), see the cron task scheduler. */
 
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (!hasActiveChildProcess() &&
+        !aofNoForkRewriteInProgress() &&
         server.aof_rewrite_scheduled)
     {
         rewriteAppendOnlyFileBackground();
     }
 
+    /* Advance the forkless AOF rewrite, if one is in progress. */
+    if (aofNoForkRewriteInProgress()) aofNoForkRewriteCycle();
+
     /* Check if a background saving or AOF rewrite in progress terminated. */
     if (hasActiveChildProcess() || ldbPendingChildren())
     {
+        /* Drain the periodic copy-on-write updates the child may have sent,
+         * so that INFO reports the cost of the ongoing save. */
+        receiveChildInfo();
         checkChildrenDone();
     } else {
         /* If there is not a background saving/rewrite in progress check if
@@ -1996,6 +2538,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         /* Trigger an AOF rewrite if needed. */
         if (server.aof_state == AOF_ON &&
             !hasActiveChildProcess() &&
+            !aofNoForkRewriteInProgress() &&
             server.aof_rewrite_perc &&
             server.aof_current_size > server.aof_rewrite_min_size)
         {
@@ -2043,6 +2586,23 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         migrateCloseTimedoutSockets();
     }
 
+    /* Publish hot key notifications and decay the tracker counters. */
+    run_with_period(1000) {
+        hotkeysCron();
+    }
+
+    /* Reclaim the stateful scan sessions left idle by their clients. */
+    run_with_period(1000) scanSessionCron();
+
+    /* Release a few radix tree nodes of the streams trimmed recently. */
+    streamTrimCron();
+
+    /* Advance the pending background keyspace exports, if any. */
+    keysAsyncCron();
+
+    /* Advance the pending background pattern deletes, if any. */
+    unlinkMatchCron();
+
     /* Stop the I/O threads if we don't have enough pending work. */
     stopThreadedIOIfNeeded();
 
@@ -2071,6 +2631,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                           &ei);
 
     server.cronloops++;
+    loopstatsSample(LOOP_PHASE_CRON,ls);
     return 1000/server.hz;
 }
 
@@ -2078,8 +2639,16 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
  * main loop of the event driven library, that is, before to sleep
  * for ready file descriptors. */
 void beforeSleep(struct aeEventLoop *eventLoop) {
+    uint64_t ls;
     UNUSED(eventLoop);
 
+    /* Close the dispatch phase opened at the end of afterSleep(): it
+     * covers all the event callbacks fired since then. */
+    if (loopstats_dispatch_start) {
+        loopstatsSample(LOOP_PHASE_DISPATCH,loopstats_dispatch_start);
+        loopstats_dispatch_start = 0;
+    }
+
     /* Handle TLS pending data. (must be done before flushAppendOnlyFile) */
     tlsProcessPendingData();
     /* If tls still has pending unread data don't sleep at all. */
@@ -2093,8 +2662,33 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
-    if (server.active_expire_enabled && server.masterhost == NULL)
+    if (server.active_expire_enabled && server.masterhost == NULL) {
+        ls = loopstatsCycles();
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
+        loopstatsSample(LOOP_PHASE_EXPIRE,ls);
+    }
+
+    /* Reset the per-iteration eviction time budget, and resume an
+     * eviction cycle interrupted by it during the last iteration. */
+    ls = loopstatsCycles();
+    evictionProcessPendingWork();
+    ls = loopstatsSample(LOOP_PHASE_EVICT,ls);
+
+    /* Run at most one due maintenance task, see the cron task scheduler. */
+    cronTasksRun();
+
+    /* Run a time slice of the oldest pending resumable read job, and keep
+     * the event loop from blocking in the poll until all the jobs are
+     * done, since their slices run from here, one per iteration. */
+    if (hgetallAsyncJobsPending()) {
+        hgetallAsyncCron(1000);
+        if (hgetallAsyncJobsPending()) aeSetDontWait(server.el,1);
+    }
+    ls = loopstatsSample(LOOP_PHASE_CRON,ls);
+
+    /* Close idle clients and time out blocked ones whose deadline is due,
+     * visiting only the due entries of the timeout table. */
+    handleClientsTimeout();
 
     /* Send all the slaves an ACK request if at least one client blocked
      * during the previous event loop iteration. */
@@ -2113,39 +2707,89 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 
     /* Unblock all the clients blocked for synchronous replication
      * in WAIT. */
-    if (listLength(server.clients_waiting_acks))
+    if (raxSize(server.clients_waiting_acks))
         processClientsWaitingReplicas();
 
     /* Check if there are clients unblocked by modules that implement
      * blocking commands. */
     if (moduleCount()) moduleHandleBlockedClients();
 
+    /* Execute the commands of clients whose cold tier values completed
+     * faulting back, and retire finished demotion writes. */
+    coldTierHandleCompletions();
+
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
 
+    /* Execute the heavy commands deferred from batch priority clients,
+     * now that the fast traffic of this iteration already drained. */
+    processDeferredExecClients();
+    ls = loopstatsSample(LOOP_PHASE_UNBLOCK,ls);
+
+    /* Send the batched client side caching invalidation messages. */
+    if (server.tracking_clients) trackingFlushPendingMessages();
+
+    /* Deliver the keyspace notifications queued for the pattern
+     * subscribers, if batching is enabled. */
+    notifyKeyspaceEventFlushBatch();
+    ls = loopstatsSample(LOOP_PHASE_TRACKING,ls);
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
+    ls = loopstatsSample(LOOP_PHASE_AOF,ls);
+
+    /* Serve the MONITOR clients and the audit file writer from the
+     * command audit ring. */
+    auditFlush();
 
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWritesUsingThreads();
+    loopstatsSample(LOOP_PHASE_WRITES,ls);
 
     /* Close clients that need to be closed asynchronous */
     freeClientsInAsyncFreeQueue();
 
+    /* Install quicklist nodes compressed by the bio thread. Must be done
+     * while no module or io thread may access the dataset, that is before
+     * the GIL is released below. */
+    quicklistAsyncCompressHandleCompleted();
+
+    /* Queue scheduled encoding conversions to the bio thread and swap in
+     * the hash tables it finished building, under the same constraint. */
+    objConvertHandleCompleted();
+
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
      * time. */
     if (moduleCount()) moduleReleaseGIL();
+
+    /* Let the background rehashing worker migrate buckets while we are
+     * blocked in the multiplexing syscall. Must be the last thing done
+     * here: from now on the main thread does not touch the keyspace until
+     * afterSleep() stops the worker. */
+    backgroundRehashKick();
+
+    /* Open the poll phase: afterSleep() will close it once the
+     * multiplexing syscall (or the busy poll loop) returns. */
+    loopstats_poll_start = loopstatsCycles();
 }
 
 /* This function is called immadiately after the event loop multiplexing
  * API returned, and the control is going to soon return to Redis by invoking
  * the different events callbacks. */
 void afterSleep(struct aeEventLoop *eventLoop) {
+    uint64_t ls;
     UNUSED(eventLoop);
+    if (loopstats_poll_start) {
+        loopstatsSample(LOOP_PHASE_POLL,loopstats_poll_start);
+        loopstats_poll_start = 0;
+    }
+    backgroundRehashPause();
     if (moduleCount()) moduleAcquireGIL();
+    ls = loopstatsCycles();
     handleClientsWithPendingReadsUsingThreads();
+    loopstats_dispatch_start = loopstatsSample(LOOP_PHASE_READS,ls);
 }
 
 /* =========================== Server initialization ======================== */
@@ -2187,6 +2831,8 @@ void createSharedObjects(void) {
         "-READONLY You can't write against a read only replica.\r\n"));
     shared.noautherr = createObject(OBJ_STRING,sdsnew(
         "-NOAUTH Authentication required.\r\n"));
+    shared.timeouterr = createObject(OBJ_STRING,sdsnew(
+        "-TIMEOUT Command execution deadline exceeded.\r\n"));
     shared.oomerr = createObject(OBJ_STRING,sdsnew(
         "-OOM command not allowed when used memory > 'maxmemory'.\r\n"));
     shared.execaborterr = createObject(OBJ_STRING,sdsnew(
@@ -2238,12 +2884,15 @@ void createSharedObjects(void) {
     shared.punsubscribebulk = createStringObject("$12\r\npunsubscribe\r\n",19);
     shared.del = createStringObject("DEL",3);
     shared.unlink = createStringObject("UNLINK",6);
+    shared.hdel = createStringObject("HDEL",4);
     shared.rpop = createStringObject("RPOP",4);
     shared.lpop = createStringObject("LPOP",4);
     shared.lpush = createStringObject("LPUSH",5);
     shared.rpoplpush = createStringObject("RPOPLPUSH",9);
     shared.zpopmin = createStringObject("ZPOPMIN",7);
     shared.zpopmax = createStringObject("ZPOPMAX",7);
+    shared.pexpireat = createStringObject("PEXPIREAT",9);
+    shared.persist = createStringObject("PERSIST",7);
     for (j = 0; j < OBJ_SHARED_INTEGERS; j++) {
         shared.integers[j] =
             makeObjectShared(createObject(OBJ_STRING,(void*)(long)j));
@@ -2255,6 +2904,7 @@ void createSharedObjects(void) {
         shared.bulkhdr[j] = createObject(OBJ_STRING,
             sdscatprintf(sdsempty(),"$%d\r\n",j));
     }
+    createCachedReplyHeaders();
     /* The following two shared objects, minstring and maxstrings, are not
      * actually used for their value but as a special object meaning
      * respectively the minimum possible string and the maximum possible
@@ -2278,12 +2928,15 @@ void initServerConfig(void) {
     server.bindaddr_count = 0;
     server.unixsocketperm = CONFIG_DEFAULT_UNIX_SOCKET_PERM;
     server.ipfd_count = 0;
+    server.reuseport_fd_count = 0;
     server.tlsfd_count = 0;
+    server.adminfd_count = 0;
     server.sofd = -1;
     server.active_expire_enabled = 1;
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
+    server.command_deadline = 0;
     server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
     server.aof_state = AOF_OFF;
     server.aof_rewrite_base_size = 0;
@@ -2303,6 +2956,7 @@ void initServerConfig(void) {
     server.blocked_clients = 0;
     memset(server.blocked_clients_by_type,0,
            sizeof(server.blocked_clients_by_type));
+    server.obuf_backpressure_clients = 0;
     server.shutdown_asap = 0;
     server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     server.cluster_module_flags = CLUSTER_MODULE_FLAG_NONE;
@@ -2310,6 +2964,9 @@ void initServerConfig(void) {
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
     server.loading_process_events_interval_bytes = (1024*1024*2);
 
+    /* The config defaults are applied later by initConfigValues(), but
+     * getLRUClock() already divides by the clock resolution: seed it. */
+    server.lru_clock_resolution = LRU_CLOCK_DEFAULT_RESOLUTION;
     server.lruclock = getLRUClock();
     resetServerSaveParams();
 
@@ -2332,10 +2989,13 @@ void initServerConfig(void) {
     server.repl_down_since = 0; /* Never connected, repl is down since EVER. */
     server.master_repl_offset = 0;
 
-    /* Replication partial resync backlog */
+    /* Replication buffer and partial resync backlog */
+    server.repl_buffer_blocks = NULL;
+    server.repl_buffer_mem = 0;
+    server.repl_stream_staged = 0;
+    server.repl_stream_staged_node = NULL;
     server.repl_backlog = NULL;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
     server.repl_backlog_off = 0;
     server.repl_no_slaves_since = time(NULL);
 
@@ -2356,6 +3016,7 @@ void initServerConfig(void) {
     server.orig_commands = dictCreate(&commandTableDictType,NULL);
     populateCommandTable();
     server.delCommand = lookupCommandByCString("del");
+    server.hdelCommand = lookupCommandByCString("hdel");
     server.multiCommand = lookupCommandByCString("multi");
     server.lpushCommand = lookupCommandByCString("lpush");
     server.lpopCommand = lookupCommandByCString("lpop");
@@ -2551,6 +3212,25 @@ void checkTcpBacklogSettings(void) {
 #endif
 }
 
+/* Re-apply the configured TCP backlog to all the listening sockets.
+ * Calling listen() on an already listening socket just updates its
+ * backlog, so "CONFIG SET tcp-backlog" takes effect without restarting
+ * the server. Returns C_ERR if any of the sockets refused the update. */
+int applyTcpBacklog(void) {
+    int j;
+
+    for (j = 0; j < server.ipfd_count; j++) {
+        if (listen(server.ipfd[j],server.tcp_backlog) == -1) return C_ERR;
+    }
+    for (j = 0; j < server.tlsfd_count; j++) {
+        if (listen(server.tlsfd[j],server.tcp_backlog) == -1) return C_ERR;
+    }
+    if (server.sofd != -1 && listen(server.sofd,server.tcp_backlog) == -1)
+        return C_ERR;
+    checkTcpBacklogSettings();
+    return C_OK;
+}
+
 /* Initialize a set of file descriptors to listen to the specified 'port'
  * binding the addresses specified in the Redis server configuration.
  *
@@ -2569,7 +3249,7 @@ void checkTcpBacklogSettings(void) {
  * impossible to bind, or no bind addresses were specified in the server
  * configuration but the function is not able to bind * for at least
  * one of the IPv4 or IPv6 protocols. */
-int listenToPort(int port, int *fds, int *count) {
+static int listenToPortGeneric(int port, int *fds, int *count, int reuseport) {
     int j;
 
     /* Force binding of 0.0.0.0 if no bind address is specified, always
@@ -2580,10 +3260,13 @@ int listenToPort(int port, int *fds, int *count) {
             int unsupported = 0;
             /* Bind * for both IPv6 and IPv4, we enter here only if
              * server.bindaddr_count == 0. */
-            fds[*count] = anetTcp6Server(server.neterr,port,NULL,
-                server.tcp_backlog);
+            fds[*count] = reuseport ?
+                anetTcp6ReusePortServer(server.neterr,port,NULL,
+                    server.tcp_backlog) :
+                anetTcp6Server(server.neterr,port,NULL,
+                    server.tcp_backlog);
             if (fds[*count] != ANET_ERR) {
-                anetNonBlock(NULL,fds[*count]);
+                if (!reuseport) anetNonBlock(NULL,fds[*count]);
                 (*count)++;
             } else if (errno == EAFNOSUPPORT) {
                 unsupported++;
@@ -2592,10 +3275,13 @@ int listenToPort(int port, int *fds, int *count) {
 
             if (*count == 1 || unsupported) {
                 /* Bind the IPv4 address as well. */
-                fds[*count] = anetTcpServer(server.neterr,port,NULL,
-                    server.tcp_backlog);
+                fds[*count] = reuseport ?
+                    anetTcpReusePortServer(server.neterr,port,NULL,
+                        server.tcp_backlog) :
+                    anetTcpServer(server.neterr,port,NULL,
+                        server.tcp_backlog);
                 if (fds[*count] != ANET_ERR) {
-                    anetNonBlock(NULL,fds[*count]);
+                    if (!reuseport) anetNonBlock(NULL,fds[*count]);
                     (*count)++;
                 } else if (errno == EAFNOSUPPORT) {
                     unsupported++;
@@ -2608,12 +3294,18 @@ int listenToPort(int port, int *fds, int *count) {
             if (*count + unsupported == 2) break;
         } else if (strchr(server.bindaddr[j],':')) {
             /* Bind IPv6 address. */
-            fds[*count] = anetTcp6Server(server.neterr,port,server.bindaddr[j],
-                server.tcp_backlog);
+            fds[*count] = reuseport ?
+                anetTcp6ReusePortServer(server.neterr,port,server.bindaddr[j],
+                    server.tcp_backlog) :
+                anetTcp6Server(server.neterr,port,server.bindaddr[j],
+                    server.tcp_backlog);
         } else {
             /* Bind IPv4 address. */
-            fds[*count] = anetTcpServer(server.neterr,port,server.bindaddr[j],
-                server.tcp_backlog);
+            fds[*count] = reuseport ?
+                anetTcpReusePortServer(server.neterr,port,server.bindaddr[j],
+                    server.tcp_backlog) :
+                anetTcpServer(server.neterr,port,server.bindaddr[j],
+                    server.tcp_backlog);
         }
         if (fds[*count] == ANET_ERR) {
             serverLog(LL_WARNING,
@@ -2626,12 +3318,38 @@ int listenToPort(int port, int *fds, int *count) {
                     continue;
             return C_ERR;
         }
-        anetNonBlock(NULL,fds[*count]);
+        if (!reuseport) anetNonBlock(NULL,fds[*count]);
         (*count)++;
     }
     return C_OK;
 }
 
+int listenToPort(int port, int *fds, int *count) {
+    return listenToPortGeneric(port,fds,count,0);
+}
+
+/* Like listenToPort(), but binds multiple SO_REUSEPORT listeners on every
+ * configured address, one per io thread, so the kernel spreads incoming
+ * connections among them. The listeners are left blocking, since each one
+ * is owned by an accept thread blocking in accept(2) (see networking.c),
+ * not by the event loop. The number of shards is capped so that the fds
+ * fit into a CONFIG_BINDADDR_MAX sized array. */
+int listenToPortReusePort(int port, int *fds, int *count) {
+    int shards = server.io_threads_num;
+
+    /* Binding "*" may take two sockets per shard (IPv6 and IPv4). */
+    int per_shard = server.bindaddr_count ? server.bindaddr_count : 2;
+    if (shards > CONFIG_BINDADDR_MAX / per_shard)
+        shards = CONFIG_BINDADDR_MAX / per_shard;
+    if (shards < 1) shards = 1;
+
+    for (int s = 0; s < shards; s++) {
+        if (listenToPortGeneric(port,fds,count,1) == C_ERR)
+            return C_ERR;
+    }
+    return C_OK;
+}
+
 /* Resets the stats that we expose via INFO or other means that we want
  * to reset via CONFIG RESETSTAT. The function is also used in order to
  * initialize these fields in initServer() at server startup. */
@@ -2639,14 +3357,23 @@ void resetServerStats(void) {
     int j;
 
     server.stat_numcommands = 0;
+    server.stat_io_commands_processed = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_values_freed = 0;
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_expire_cycle_time_used = 0;
     server.stat_evictedkeys = 0;
+    server.stat_proactive_evictedkeys = 0;
+    server.stat_propagate_coalesced = 0;
+    server.stat_shared_object_cache_hits = 0;
+    server.stat_shared_object_cache_saved = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
+    server.stat_reply_cache_hits = 0;
+    server.stat_reply_cache_cmd_hits = 0;
+    server.stat_reply_cache_cmd_misses = 0;
     server.stat_active_defrag_hits = 0;
     server.stat_active_defrag_misses = 0;
     server.stat_active_defrag_key_hits = 0;
@@ -2684,12 +3411,21 @@ void initServer(void) {
 
     /* Initialization after setting defaults from the config system. */
     server.aof_state = server.aof_enabled ? AOF_ON : AOF_OFF;
+    quicklistSetCompressionCodec(server.list_compress_codec);
     server.hz = server.config_hz;
+    /* Recompute the cached LRU clock: the value set by initServerConfig()
+     * predates the lru-clock-resolution directive being applied, and the
+     * shared objects created below get stamped with it. */
+    server.lruclock = getLRUClock();
     server.pid = getpid();
+    server.in_fork_child = 0;
     server.current_client = NULL;
     server.fixed_time_expire = 0;
     server.clients = listCreate();
     server.clients_index = raxNew();
+    server.clients_timeout_table = raxNew();
+    server.clients_by_addr = dictCreate(&clientIndexDictType,NULL);
+    server.clients_by_name = dictCreate(&clientIndexDictType,NULL);
     server.clients_to_close = listCreate();
     server.slaves = listCreate();
     server.monitors = listCreate();
@@ -2697,8 +3433,9 @@ void initServer(void) {
     server.clients_pending_read = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
+    server.deferred_exec_clients = listCreate();
     server.ready_keys = listCreate();
-    server.clients_waiting_acks = listCreate();
+    server.clients_waiting_acks = raxNew();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
     server.system_memory_size = zmalloc_get_memory_size();
@@ -2709,6 +3446,7 @@ void initServer(void) {
     }
 
     createSharedObjects();
+    sharedObjectCacheResize(server.shared_object_cache_size);
     adjustOpenFilesLimit();
     server.el = aeCreateEventLoop(server.maxclients+CONFIG_FDSET_INCR);
     if (server.el == NULL) {
@@ -2717,15 +3455,34 @@ void initServer(void) {
             strerror(errno));
         exit(1);
     }
+    aeSetBusyPollDuration(server.el, server.busy_poll_max_usec);
     server.db = zmalloc(sizeof(redisDb)*server.dbnum);
+    replyCacheInit();
 
     /* Open the TCP listening socket for the user commands. */
-    if (server.port != 0 &&
+    if (server.port != 0 && server.tcp_reuseport &&
+        listenToPortReusePort(server.port,server.reuseport_fd,
+                              &server.reuseport_fd_count) == C_ERR)
+    {
+        /* Fall back to the classic, event loop driven accept path when
+         * SO_REUSEPORT is not available on this system. */
+        serverLog(LL_WARNING,
+            "Unable to create SO_REUSEPORT listeners, falling back to a "
+            "single accept path.");
+        for (j = 0; j < server.reuseport_fd_count; j++)
+            close(server.reuseport_fd[j]);
+        server.reuseport_fd_count = 0;
+        server.tcp_reuseport = 0;
+    }
+    if (server.port != 0 && !server.tcp_reuseport &&
         listenToPort(server.port,server.ipfd,&server.ipfd_count) == C_ERR)
         exit(1);
     if (server.tls_port != 0 &&
         listenToPort(server.tls_port,server.tlsfd,&server.tlsfd_count) == C_ERR)
         exit(1);
+    if (server.admin_port != 0 &&
+        listenToPort(server.admin_port,server.adminfd,&server.adminfd_count) == C_ERR)
+        exit(1);
 
     /* Open the listening Unix domain socket. */
     if (server.unixsocket != NULL) {
@@ -2740,39 +3497,69 @@ void initServer(void) {
     }
 
     /* Abort if there are no listening sockets at all. */
-    if (server.ipfd_count == 0 && server.tlsfd_count == 0 && server.sofd < 0) {
+    if (server.ipfd_count == 0 && server.reuseport_fd_count == 0 &&
+        server.tlsfd_count == 0 && server.adminfd_count == 0 &&
+        server.sofd < 0) {
         serverLog(LL_WARNING, "Configured to not listen anywhere, exiting.");
         exit(1);
     }
 
+    /* The number of keyspace shards must be a power of two, so that a
+     * slot can be mapped to a shard with a simple mask. */
+    if (server.db_dict_shards & (server.db_dict_shards-1)) {
+        int shards = 1;
+        while (shards < server.db_dict_shards) shards *= 2;
+        serverLog(LL_WARNING,
+            "db-dict-shards must be a power of two: rounding up %d to %d",
+            server.db_dict_shards, shards);
+        server.db_dict_shards = shards;
+    }
+
     /* Create the Redis databases, and initialize other internal state. */
+    server.rdb_delta_keys = zmalloc(sizeof(dict*)*server.dbnum);
+    server.rdb_base_id[0] = '\0';
+    server.rdb_base_valid = 0;
+    server.rdb_delta_seq = 0;
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
+        server.db[j].dict = zmalloc(sizeof(dict*)*server.db_dict_shards);
+        for (int i = 0; i < server.db_dict_shards; i++)
+            server.db[j].dict[i] = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
-        server.db[j].expires_cursor = 0;
+        server.db[j].expires_index = raxNew();
+        server.db[j].hexpires = dictCreate(&hashExpiresDictType,NULL);
+        server.db[j].hexpires_index = raxNew();
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
+        server.db[j].min_expire = LLONG_MAX;
+        server.db[j].min_expire_at = 0;
+        server.db[j].reclaimed_upto = 0;
+        memset(server.db[j].type_count,0,sizeof(server.db[j].type_count));
         server.db[j].defrag_later = listCreate();
         listSetFreeMethod(server.db[j].defrag_later,(void (*)(void*))sdsfree);
+        server.rdb_delta_keys[j] = dictCreate(&rdbDeltaKeysDictType,NULL);
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
-    server.pubsub_patterns = listCreate();
-    listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
-    listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
+    server.pubsub_patterns = dictCreate(&pubsubPatternDictType,NULL);
+    server.pubsub_patterns_index = raxNew();
+    server.pubsub_patterns_nopfx = listCreate();
+    server.pubsub_patterns_maxprefix = 0;
     server.cronloops = 0;
     server.rdb_child_pid = -1;
     server.aof_child_pid = -1;
     server.module_child_pid = -1;
+    server.snapshot_child_pid = -1;
+    server.census_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_pipe_conns = NULL;
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
-    server.rdb_pipe_buff = NULL;
-    server.rdb_pipe_bufflen = 0;
+    server.rdb_pipe_head = NULL;
+    server.rdb_pipe_tail = NULL;
+    server.rdb_pipe_mem = 0;
+    server.rdb_pipe_eof = 0;
     server.rdb_bgsave_scheduled = 0;
     server.child_info_pipe[0] = -1;
     server.child_info_pipe[1] = -1;
@@ -2791,6 +3578,7 @@ void initServer(void) {
     server.stat_rdb_cow_bytes = 0;
     server.stat_aof_cow_bytes = 0;
     server.stat_module_cow_bytes = 0;
+    server.stat_current_cow_bytes = 0;
     server.cron_malloc_stats.zmalloc_used = 0;
     server.cron_malloc_stats.process_rss = 0;
     server.cron_malloc_stats.allocator_allocated = 0;
@@ -2809,6 +3597,13 @@ void initServer(void) {
         exit(1);
     }
 
+    /* Register the deadline scheduled maintenance tasks, spread across
+     * event loop iterations by beforeSleep(). A zero period tracks
+     * server.hz, matching the rate serverCron() used to run them at. */
+    cronTaskRegister("clients",clientsCron,0,300);
+    cronTaskRegister("databases",databasesCron,0,5000);
+    cronTaskRegister("coldtier",coldTierCron,100,500);
+
     /* Create an event handler for accepting new connections in TCP and Unix
      * domain sockets. */
     for (j = 0; j < server.ipfd_count; j++) {
@@ -2827,6 +3622,14 @@ void initServer(void) {
                     "Unrecoverable error creating server.tlsfd file event.");
             }
     }
+    for (j = 0; j < server.adminfd_count; j++) {
+        if (aeCreateFileEvent(server.el, server.adminfd[j], AE_READABLE,
+            acceptAdminHandler,NULL) == AE_ERR)
+            {
+                serverPanic(
+                    "Unrecoverable error creating server.adminfd file event.");
+            }
+    }
     if (server.sofd > 0 && aeCreateFileEvent(server.el,server.sofd,AE_READABLE,
         acceptUnixHandler,NULL) == AE_ERR) serverPanic("Unrecoverable error creating server.sofd file event.");
 
@@ -2875,7 +3678,16 @@ void initServer(void) {
  * see: https://sourceware.org/bugzilla/show_bug.cgi?id=19329 */
 void InitServerLast() {
     bioInit();
+    /* Needs the BIO_COLD_* threads, so only after bioInit(). */
+    coldTierInit();
+    /* Needs the BIO_AUDIT_WRITE thread, so only after bioInit(). */
+    auditInit();
+    /* Needs the BIO_LIST_COMPRESS thread, so only after bioInit(). */
+    quicklistSetAsyncCompression(server.list_compress_async);
+    objConvertSetAsync(server.encoding_convert_async);
     initThreadedIO();
+    if (server.tcp_reuseport) initAcceptThreads();
+    backgroundRehashInit();
     set_jemalloc_bg_thread(server.jemalloc_bg_thread);
     server.initial_memory_usage = zmalloc_used_memory();
 }
@@ -2921,6 +3733,8 @@ int populateCommandTableParseFlags(struct redisCommand *c, char *strflags) {
             c->flags |= CMD_ASKING;
         } else if (!strcasecmp(flag,"fast")) {
             c->flags |= CMD_FAST | CMD_CATEGORY_FAST;
+        } else if (!strcasecmp(flag,"resumable")) {
+            c->flags |= CMD_RESUMABLE;
         } else {
             /* Parse ACL categories here if the flag name starts with @. */
             uint64_t catflag;
@@ -2957,12 +3771,15 @@ void populateCommandTable(void) {
             serverPanic("Unsupported command flag");
 
         c->id = ACLGetCommandID(c->name); /* Assign the ID used for ACL. */
+        c->latency_histogram =
+            zcalloc(sizeof(uint64_t)*LATENCY_HIST_BUCKETS);
         retval1 = dictAdd(server.commands, sdsnew(c->name), c);
         /* Populate an additional dictionary that will be unaffected
          * by rename-command statements in redis.conf. */
         retval2 = dictAdd(server.orig_commands, sdsnew(c->name), c);
         serverAssert(retval1 == DICT_OK && retval2 == DICT_OK);
     }
+    rebuildCommandLookupFastTable();
 }
 
 void resetCommandTableStats(void) {
@@ -2975,6 +3792,7 @@ void resetCommandTableStats(void) {
         c = (struct redisCommand *) dictGetVal(de);
         c->microseconds = 0;
         c->calls = 0;
+        memset(c->latency_histogram,0,sizeof(uint64_t)*LATENCY_HIST_BUCKETS);
     }
     dictReleaseIterator(di);
 
@@ -3019,14 +3837,103 @@ void redisOpArrayFree(redisOpArray *oa) {
 
 /* ====================== Commands lookup and execution ===================== */
 
+/* Fast command lookup table.
+ *
+ * Dispatching every request through server.commands means paying the
+ * case insensitive siphash of the command name plus a bucket chain walk.
+ * Since the set of command names only changes at startup (command table
+ * population, rename-command, sentinel mode) or at module load/unload
+ * time, we build a read-only open addressing table over the current
+ * names: a cheap FNV-1a hash selects a bucket of two slots, and the
+ * build retries random seeds (growing the table if needed) until every
+ * name fits, so a lookup is a single indexed probe with no allocations.
+ * The slots reference the server.commands keys, they don't own them:
+ * rebuildCommandLookupFastTable() must be called after every change to
+ * the commands dictionary. */
+static struct {
+    struct {
+        sds name;                 /* Lookup name (server.commands key). */
+        struct redisCommand *cmd;
+    } *slots;                     /* 2 * size entries, or NULL. */
+    unsigned long size;           /* Number of two-slot buckets (pow2). */
+    uint64_t seed;
+} commandFastTable;
+
+static uint64_t commandNameHash(uint64_t seed, const char *name, size_t len) {
+    uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+    while (len--) {
+        h ^= (unsigned char)tolower(*name++);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void rebuildCommandLookupFastTable(void) {
+    unsigned long numcommands = dictSize(server.commands);
+    unsigned long size = 16;
+    while (size < numcommands*8) size *= 2;
+
+    zfree(commandFastTable.slots);
+    commandFastTable.slots = NULL;
+    while(1) {
+        for (int attempt = 0; attempt < 20; attempt++) {
+            uint64_t seed;
+            getRandomBytes((unsigned char*)&seed,sizeof(seed));
+            void *slots = zcalloc(size*2*sizeof(commandFastTable.slots[0]));
+            commandFastTable.slots = slots;
+            commandFastTable.size = size;
+            commandFastTable.seed = seed;
+
+            dictIterator *di = dictGetIterator(server.commands);
+            dictEntry *de;
+            int collision = 0;
+            while((de = dictNext(di)) != NULL) {
+                sds name = dictGetKey(de);
+                uint64_t h = commandNameHash(seed,name,sdslen(name));
+                unsigned long b = (h & (size-1)) * 2;
+                if (commandFastTable.slots[b].name == NULL) {
+                    commandFastTable.slots[b].name = name;
+                    commandFastTable.slots[b].cmd = dictGetVal(de);
+                } else if (commandFastTable.slots[b+1].name == NULL) {
+                    commandFastTable.slots[b+1].name = name;
+                    commandFastTable.slots[b+1].cmd = dictGetVal(de);
+                } else {
+                    collision = 1;
+                    break;
+                }
+            }
+            dictReleaseIterator(di);
+            if (!collision) return;
+            zfree(commandFastTable.slots);
+            commandFastTable.slots = NULL;
+        }
+        size *= 2;
+    }
+}
+
+static struct redisCommand *commandFastLookup(const char *name, size_t len) {
+    uint64_t h = commandNameHash(commandFastTable.seed,name,len);
+    unsigned long b = (h & (commandFastTable.size-1)) * 2;
+    for (int i = 0; i < 2; i++) {
+        sds sname = commandFastTable.slots[b+i].name;
+        if (sname && sdslen(sname) == len && !strncasecmp(sname,name,len))
+            return commandFastTable.slots[b+i].cmd;
+    }
+    return NULL;
+}
+
 struct redisCommand *lookupCommand(sds name) {
+    if (commandFastTable.slots)
+        return commandFastLookup(name,sdslen(name));
     return dictFetchValue(server.commands, name);
 }
 
 struct redisCommand *lookupCommandByCString(char *s) {
     struct redisCommand *cmd;
-    sds name = sdsnew(s);
+    sds name;
 
+    if (commandFastTable.slots) return commandFastLookup(s,strlen(s));
+    name = sdsnew(s);
     cmd = dictFetchValue(server.commands, name);
     sdsfree(name);
     return cmd;
@@ -3040,12 +3947,416 @@ struct redisCommand *lookupCommandByCString(char *s) {
  * rewriteClientCommandVector() in order to set client->cmd pointer
  * correctly even if the command was renamed. */
 struct redisCommand *lookupCommandOrOriginal(sds name) {
-    struct redisCommand *cmd = dictFetchValue(server.commands, name);
+    struct redisCommand *cmd = lookupCommand(name);
 
     if (!cmd) cmd = dictFetchValue(server.orig_commands,name);
     return cmd;
 }
 
+/* Return non-zero if executing 'cmd' may leave the calling client
+ * blocked. Module commands are excluded as a class since we can't tell
+ * which of them call RM_BlockClient(). */
+int commandMayBlockClient(struct redisCommand *cmd) {
+    if (cmd->flags & (CMD_MODULE|CMD_RESUMABLE)) return 1;
+    return cmd->proc == blpopCommand || cmd->proc == brpopCommand ||
+           cmd->proc == brpoplpushCommand || cmd->proc == bzpopminCommand ||
+           cmd->proc == bzpopmaxCommand || cmd->proc == xreadCommand ||
+           cmd->proc == waitCommand || cmd->proc == keysasyncCommand ||
+           cmd->proc == debugCommand;
+}
+
+/* =========================== Effect coalescing ============================
+ *
+ * Scripts and MULTI blocks propagate their effects as a verbatim stream of
+ * write commands wrapped in MULTI/EXEC. A script that performs many writes
+ * to the same key (say, fifty HINCRBY calls against one hash) makes both
+ * the AOF and every replica pay for each individual write, even though
+ * only the final state of the key matters.
+ *
+ * While a MULTI/EXEC propagation block is open, propagate() accumulates
+ * the stream in a buffer instead of feeding it out. When the block is
+ * closed, multiple writes to the same key are merged into one command
+ * carrying the final state (an HSET of the resulting fields, a SET of the
+ * resulting string, and so forth), and the rewritten stream is flushed.
+ *
+ * The rewrite is conservative: a key is only coalesced when every
+ * propagated command touching it belongs to a small set whose combined
+ * effect is fully captured by the final value of the fields/members they
+ * name (so a DEL, an EXPIRE or a cross-key command in the stream excludes
+ * its keys), when all its writes share the same propagation target, and
+ * when the synthesized command is actually smaller than the commands it
+ * replaces. Everything else is propagated verbatim, in the original
+ * order. Since replication assumes replicas are exact copies, replacing
+ * a stream of relative writes with the absolute final state is always
+ * safe when those conditions hold. */
+
+#define COALESCE_NONE 0
+#define COALESCE_STRING 1
+#define COALESCE_HASH 2
+#define COALESCE_SET 3
+#define COALESCE_ZSET 4
+
+static redisOpArray CoalesceOps;
+static int CoalesceDepth = 0;
+
+static void propagateNow(struct redisCommand *cmd, int dbid, robj **argv,
+                         int argc, int flags);
+
+/* Per-key accumulator built while scanning the buffered stream. */
+typedef struct coalesceGroup {
+    sds key;            /* Key name (owned by the group). */
+    int dbid;
+    int class;          /* COALESCE_* type class of the writes. */
+    int eligible;       /* Zero if the key cannot be coalesced. */
+    int target;         /* Common PROPAGATE_* target of the writes. */
+    int numops;         /* Buffered ops writing this key. */
+    int lastidx;        /* Index of the last such op in the buffer. */
+    size_t bytes;       /* Total payload bytes of those ops. */
+    sds *fields;        /* Fields/members named by the writes (hash, set
+                           and zset classes), owned, possibly repeated. */
+    int numfields;
+} coalesceGroup;
+
+/* Classify a buffered operation: return the COALESCE_* class if its
+ * whole effect on its (single) key is captured by the final value of the
+ * fields/members it names, COALESCE_NONE otherwise. */
+static int coalesceOpClass(redisOp *op) {
+    redisCommandProc *proc = op->cmd->proc;
+
+    if (proc == incrCommand || proc == decrCommand ||
+        proc == incrbyCommand || proc == decrbyCommand ||
+        proc == appendCommand)
+    {
+        return COALESCE_STRING;
+    }
+    /* Only a plain SET: variants with expire flags alter the TTL, which
+     * a synthesized SET would not reproduce. Note that INCRBYFLOAT and
+     * HINCRBYFLOAT already reach us rewritten as SET / HSET. */
+    if ((proc == setCommand || proc == setnxCommand) && op->argc == 3)
+        return COALESCE_STRING;
+    if (proc == hsetCommand || proc == hsetnxCommand ||
+        proc == hincrbyCommand)
+    {
+        return COALESCE_HASH;
+    }
+    if (proc == saddCommand) return COALESCE_SET;
+    if (proc == zaddCommand || proc == zincrbyCommand) return COALESCE_ZSET;
+    return COALESCE_NONE;
+}
+
+/* Append to 'g' the fields/members that 'op' (already classified as
+ * 'class') writes. Returns C_ERR if they cannot be extracted, in which
+ * case the group must be marked not eligible. */
+static int coalesceOpFields(coalesceGroup *g, redisOp *op, int class) {
+    redisCommandProc *proc = op->cmd->proc;
+    int first, step, j;
+
+    if (class == COALESCE_STRING) return C_OK; /* Whole value rewritten. */
+    if (proc == hsetCommand) {
+        if (op->argc % 2 != 0) return C_ERR;
+        first = 2; step = 2;
+    } else if (proc == hsetnxCommand || proc == hincrbyCommand) {
+        first = 2; step = 1; /* Just argv[2]. */
+    } else if (proc == saddCommand) {
+        first = 2; step = 1;
+    } else if (proc == zincrbyCommand) {
+        first = 3; step = 1; /* Just argv[3]. */
+    } else {
+        /* ZADD: skip the option tokens, then take every member of the
+         * score/member pairs. Unknown tokens mean we are looking at a
+         * command shape this code does not understand: give up. */
+        j = 2;
+        while (j < op->argc) {
+            char *opt = op->argv[j]->ptr;
+            if (!sdsEncodedObject(op->argv[j])) break;
+            if (strcasecmp(opt,"nx") && strcasecmp(opt,"xx") &&
+                strcasecmp(opt,"ch") && strcasecmp(opt,"incr")) break;
+            j++;
+        }
+        if (j == op->argc || (op->argc-j) % 2 != 0) return C_ERR;
+        first = j+1; step = 2;
+    }
+    if (proc == hsetnxCommand || proc == hincrbyCommand ||
+        proc == saddCommand || proc == zincrbyCommand)
+    {
+        if (first >= op->argc) return C_ERR;
+        if (!sdsEncodedObject(op->argv[first])) return C_ERR;
+        g->fields = zrealloc(g->fields,sizeof(sds)*(g->numfields+1));
+        g->fields[g->numfields++] = sdsdup(op->argv[first]->ptr);
+        return C_OK;
+    }
+    for (j = first; j < op->argc; j += step) {
+        if (!sdsEncodedObject(op->argv[j])) return C_ERR;
+        g->fields = zrealloc(g->fields,sizeof(sds)*(g->numfields+1));
+        g->fields[g->numfields++] = sdsdup(op->argv[j]->ptr);
+    }
+    return C_OK;
+}
+
+/* Total payload bytes of an operation, used to make sure a synthesized
+ * command only replaces the originals when it is actually smaller. */
+static size_t coalesceOpBytes(redisOp *op) {
+    size_t bytes = 0;
+    for (int j = 0; j < op->argc; j++)
+        bytes += stringObjectLen(op->argv[j]);
+    return bytes;
+}
+
+/* Try to build the single command that reproduces the final state of the
+ * fields/members written by the ops of group 'g'. On success the new
+ * argument vector (with already incremented refcounts) is returned via
+ * 'argvp'/'argcp' together with its command, and C_OK is returned. */
+static int coalesceSynthesize(coalesceGroup *g, struct redisCommand **cmdp,
+                              robj ***argvp, int *argcp)
+{
+    redisDb *db = server.db+g->dbid;
+    robj *keyobj = createStringObject(g->key,sdslen(g->key));
+    robj *o = lookupKeyReadWithFlags(db,keyobj,LOOKUP_NOTOUCH);
+    robj **argv = NULL;
+    int argc = 0, j;
+    char *name;
+
+    if (o == NULL) goto err;
+    switch(g->class) {
+    case COALESCE_STRING:
+        /* A synthesized SET would clear any TTL the key has on the
+         * replica, while the relative commands it replaces preserve
+         * it: only coalesce keys with no expire. */
+        if (o->type != OBJ_STRING || getExpire(db,keyobj) != -1) goto err;
+        name = "set";
+        argv = zmalloc(sizeof(robj*)*3);
+        argv[0] = createStringObject("SET",3);
+        argv[1] = keyobj; incrRefCount(keyobj);
+        argv[2] = o; incrRefCount(o);
+        argc = 3;
+        break;
+    case COALESCE_HASH:
+    case COALESCE_SET:
+    case COALESCE_ZSET: {
+        int expected = g->class == COALESCE_HASH ? OBJ_HASH :
+                       g->class == COALESCE_SET ? OBJ_SET : OBJ_ZSET;
+        if (o->type != expected) goto err;
+        int perfield = g->class == COALESCE_SET ? 1 : 2;
+        argv = zmalloc(sizeof(robj*)*(2+g->numfields*perfield));
+        name = g->class == COALESCE_HASH ? "hset" :
+               g->class == COALESCE_SET ? "sadd" : "zadd";
+        argv[0] = createStringObject(name,4);
+        argv[1] = keyobj; incrRefCount(keyobj);
+        argc = 2;
+        for (j = 0; j < g->numfields; j++) {
+            sds field = g->fields[j];
+            int dup = 0, k;
+
+            /* The same field may be written multiple times: emit it
+             * once, its final value is the same anyway. */
+            for (k = 0; k < j && !dup; k++)
+                dup = sdscmp(field,g->fields[k]) == 0;
+            if (dup) continue;
+            if (g->class == COALESCE_HASH) {
+                robj *val = hashTypeGetValueObject(o,field);
+                if (val == NULL) goto err;
+                argv[argc++] = createStringObject(field,sdslen(field));
+                argv[argc++] = val;
+            } else if (g->class == COALESCE_SET) {
+                if (!setTypeIsMember(o,field)) goto err;
+                argv[argc++] = createStringObject(field,sdslen(field));
+            } else {
+                double score;
+                char buf[128];
+                if (zsetScore(o,field,&score) != C_OK) goto err;
+                argv[argc++] = createStringObject(buf,
+                    d2string(buf,sizeof(buf),score));
+                argv[argc++] = createStringObject(field,sdslen(field));
+            }
+        }
+        break;
+    }
+    default:
+        goto err;
+    }
+    decrRefCount(keyobj);
+    *cmdp = lookupCommandByCString(name);
+    *argvp = argv;
+    *argcp = argc;
+    return C_OK;
+
+err:
+    for (j = 0; j < argc; j++) decrRefCount(argv[j]);
+    zfree(argv);
+    decrRefCount(keyobj);
+    return C_ERR;
+}
+
+/* Rewrite the buffered propagation stream merging, where safe, multiple
+ * writes to the same key into one command carrying the final state, then
+ * flush it to the AOF and the replication stream. */
+static void propagateCoalesceFlush(void) {
+    int numops = CoalesceOps.numops, j, k;
+    coalesceGroup *groups = NULL;
+    int numgroups = 0;
+    unsigned char *dropped = NULL;
+    dict *bykey = NULL;
+    int abort = !server.propagate_coalescing || numops < 2;
+
+    if (!abort) {
+        bykey = dictCreate(&keyptrDictType,NULL);
+        dropped = zcalloc(numops);
+    }
+
+    /* Pass 1: group the buffered ops by (db,key), collecting the touched
+     * fields and disqualifying keys written by commands we cannot merge. */
+    for (j = 0; j < numops && !abort; j++) {
+        redisOp *op = &CoalesceOps.ops[j];
+        int class = coalesceOpClass(op);
+        int *keyindexes = NULL, numkeys = 0;
+
+        if (class == COALESCE_NONE) {
+            if (!(op->cmd->flags & CMD_WRITE)) continue;
+            keyindexes = getKeysFromCommand(op->cmd,op->argv,op->argc,
+                                            &numkeys);
+            if (numkeys == 0) {
+                /* A write with no extractable keys (FLUSHDB and the
+                 * like) may affect anything: propagate verbatim. */
+                getKeysFreeResult(keyindexes);
+                abort = 1;
+                break;
+            }
+        } else {
+            if (!sdsEncodedObject(op->argv[1])) class = COALESCE_NONE;
+            numkeys = 1;
+        }
+
+        for (k = 0; k < numkeys; k++) {
+            robj *keyarg = class == COALESCE_NONE && keyindexes ?
+                           op->argv[keyindexes[k]] : op->argv[1];
+            sds mapkey;
+            coalesceGroup *g;
+
+            if (!sdsEncodedObject(keyarg)) { abort = 1; break; }
+            mapkey = sdsnewlen(&op->dbid,sizeof(op->dbid));
+            mapkey = sdscatsds(mapkey,keyarg->ptr);
+            dictEntry *de = dictFind(bykey,mapkey);
+            if (de == NULL) {
+                groups = zrealloc(groups,
+                                  sizeof(coalesceGroup)*(numgroups+1));
+                g = &groups[numgroups];
+                g->key = sdsdup(keyarg->ptr);
+                g->dbid = op->dbid;
+                g->class = class;
+                g->eligible = class != COALESCE_NONE;
+                g->target = op->target;
+                g->numops = 0;
+                g->bytes = 0;
+                g->fields = NULL;
+                g->numfields = 0;
+                dictAdd(bykey,mapkey,(void*)(long)numgroups);
+                numgroups++;
+            } else {
+                g = &groups[(long)dictGetVal(de)];
+                sdsfree(mapkey);
+            }
+            g->numops++;
+            g->lastidx = j;
+            if (class == COALESCE_NONE || class != g->class ||
+                op->target != g->target)
+            {
+                g->eligible = 0;
+            }
+            if (g->eligible) {
+                g->bytes += coalesceOpBytes(op);
+                if (coalesceOpFields(g,op,class) != C_OK) g->eligible = 0;
+            }
+        }
+        getKeysFreeResult(keyindexes);
+    }
+
+    /* Pass 2: for every key with at least two merged writes, synthesize
+     * the final-state command and install it in place of the last write,
+     * dropping the previous ones. */
+    for (j = 0; j < numgroups && !abort; j++) {
+        coalesceGroup *g = &groups[j];
+        struct redisCommand *cmd;
+        robj **argv;
+        int argc;
+
+        if (!g->eligible || g->numops < 2) continue;
+        if (coalesceSynthesize(g,&cmd,&argv,&argc) != C_OK) continue;
+
+        size_t synth_bytes = 0;
+        for (k = 0; k < argc; k++) synth_bytes += stringObjectLen(argv[k]);
+        if (synth_bytes >= g->bytes) {
+            for (k = 0; k < argc; k++) decrRefCount(argv[k]);
+            zfree(argv);
+            continue;
+        }
+
+        /* Drop every op of the group, then replace the last one. */
+        for (k = 0; k < numops; k++) {
+            redisOp *op = &CoalesceOps.ops[k];
+            if (dropped[k] || op->dbid != g->dbid ||
+                coalesceOpClass(op) != g->class ||
+                !sdsEncodedObject(op->argv[1]) ||
+                sdscmp(op->argv[1]->ptr,g->key) != 0) continue;
+            if (k == g->lastidx) {
+                int i;
+                for (i = 0; i < op->argc; i++) decrRefCount(op->argv[i]);
+                zfree(op->argv);
+                op->cmd = cmd;
+                op->argv = argv;
+                op->argc = argc;
+            } else {
+                dropped[k] = 1;
+            }
+        }
+        server.stat_propagate_coalesced += g->numops-1;
+    }
+
+    /* Flush what is left of the stream, in the original order. */
+    for (j = 0; j < numops; j++) {
+        redisOp *op = &CoalesceOps.ops[j];
+        if (dropped && dropped[j]) continue;
+        propagateNow(op->cmd,op->dbid,op->argv,op->argc,op->target);
+    }
+
+    for (j = 0; j < numgroups; j++) {
+        for (k = 0; k < groups[j].numfields; k++)
+            sdsfree(groups[j].fields[k]);
+        zfree(groups[j].fields);
+        sdsfree(groups[j].key);
+    }
+    zfree(groups);
+    zfree(dropped);
+    if (bykey) {
+        dictIterator *di = dictGetIterator(bykey);
+        dictEntry *de;
+        while ((de = dictNext(di)) != NULL) sdsfree(dictGetKey(de));
+        dictReleaseIterator(di);
+        dictRelease(bykey);
+    }
+    redisOpArrayFree(&CoalesceOps);
+    redisOpArrayInit(&CoalesceOps);
+}
+
+/* Called right after the MULTI of a script / transaction propagation
+ * block is emitted: from here until propagateCoalesceEnd() the propagated
+ * stream is buffered so it can be rewritten as a whole. */
+void propagateCoalesceStart(void) {
+    if (CoalesceDepth == 0) {
+        if (!server.propagate_coalescing) return;
+        redisOpArrayInit(&CoalesceOps);
+    }
+    CoalesceDepth++;
+}
+
+/* Closes the block opened by propagateCoalesceStart(), rewriting and
+ * flushing the buffered stream. Must be called before the final EXEC is
+ * propagated. */
+void propagateCoalesceEnd(void) {
+    if (CoalesceDepth == 0) return; /* Coalescing disabled at start. */
+    if (--CoalesceDepth != 0) return;
+    propagateCoalesceFlush();
+}
+
 /* Propagate the specified command (in the context of the specified database id)
  * to AOF and Slaves.
  *
@@ -3059,6 +4370,23 @@ struct redisCommand *lookupCommandOrOriginal(sds name) {
  */
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc,
                int flags)
+{
+    /* Inside an open MULTI/EXEC propagation block the stream is buffered
+     * and rewritten when the block is closed. */
+    if (CoalesceDepth) {
+        robj **argvcopy = zmalloc(sizeof(robj*)*argc);
+        for (int j = 0; j < argc; j++) {
+            argvcopy[j] = argv[j];
+            incrRefCount(argv[j]);
+        }
+        redisOpArrayAppend(&CoalesceOps,cmd,dbid,argvcopy,argc,flags);
+        return;
+    }
+    propagateNow(cmd,dbid,argv,argc,flags);
+}
+
+static void propagateNow(struct redisCommand *cmd, int dbid, robj **argv,
+                         int argc, int flags)
 {
     if (server.aof_state != AOF_OFF && flags & PROPAGATE_AOF)
         feedAppendOnlyFile(cmd,dbid,argv,argc);
@@ -3119,6 +4447,17 @@ void preventCommandReplication(client *c) {
     c->flags |= CLIENT_PREVENT_REPL_PROP;
 }
 
+/* Return non zero if the command currently executing ran past the
+ * execution deadline armed by call() (command-time-limit config, or the
+ * CLIENT TIMELIMIT per client override). Long iterating read commands
+ * call this every few iterations, the same pattern activeDefragCycle()
+ * uses with its time limit, and abort with shared.timeouterr after
+ * rewinding any partial output with replyCheckpointRewind(). */
+int commandDeadlineReached(void) {
+    if (server.command_deadline == 0) return 0;
+    return mstime() >= server.command_deadline;
+}
+
 /* Call() is the core of Redis execution of a command.
  *
  * The following flags can be passed:
@@ -3164,13 +4503,13 @@ void call(client *c, int flags) {
 
     server.fixed_time_expire++;
 
-    /* Sent the command to clients in MONITOR mode, only if the commands are
-     * not generated from reading an AOF. */
-    if (listLength(server.monitors) &&
+    /* Sent the command to the audit ring (MONITOR clients and the audit
+     * log), only if the commands are not generated from reading an AOF. */
+    if (auditEnabled() &&
         !server.loading &&
         !(c->cmd->flags & (CMD_SKIP_MONITOR|CMD_ADMIN)))
     {
-        replicationFeedMonitors(c,server.monitors,c->db->id,c->argv,c->argc);
+        auditFeedCommand(c,c->db->id,c->argv,c->argc);
     }
 
     /* Initialization: clear the flags that must be set by the command on
@@ -3179,11 +4518,29 @@ void call(client *c, int flags) {
     redisOpArray prev_also_propagate = server.also_propagate;
     redisOpArrayInit(&server.also_propagate);
 
+    /* If a forkless AOF rewrite is in progress, the keys this command is
+     * about to modify must be serialized to the rewrite file before they
+     * change. */
+    if (aofNoForkRewriteInProgress() && (c->cmd->flags & CMD_WRITE))
+        aofNoForkRewriteBeforeCommand(c);
+
     /* Call the command. */
     dirty = server.dirty;
     updateCachedTime(0);
     start = server.ustime;
+
+    /* Arm the execution deadline checked by commandDeadlineReached():
+     * only regular clients can be timed out, and the per client limit
+     * set with CLIENT TIMELIMIT wins over the server wide config. */
+    mstime_t saved_deadline = server.command_deadline;
+    long long time_limit = c->command_time_limit ? c->command_time_limit :
+                           server.command_time_limit;
+    server.command_deadline =
+        (time_limit > 0 && c->conn &&
+         !(c->flags & (CLIENT_MASTER|CLIENT_LUA|CLIENT_MULTI))) ?
+        server.mstime + time_limit : 0;
     c->cmd->proc(c);
+    server.command_deadline = saved_deadline;
     duration = ustime()-start;
     dirty = server.dirty-dirty;
     if (dirty < 0) dirty = 0;
@@ -3218,6 +4575,7 @@ void call(client *c, int flags) {
          * EXPIRE, GEOADD, etc. */
         real_cmd->microseconds += duration;
         real_cmd->calls++;
+        latencyHistogramRecord(real_cmd,duration);
     }
 
     /* Propagate the command into the AOF and replication link */
@@ -3369,6 +4727,7 @@ int processCommand(client *c) {
      * However we don't perform the redirection if:
      * 1) The sender of this command is our master.
      * 2) The command has no key arguments. */
+    int cluster_slot = -1;
     if (server.cluster_enabled &&
         !(c->flags & CLIENT_MASTER) &&
         !(c->flags & CLIENT_LUA &&
@@ -3376,11 +4735,17 @@ int processCommand(client *c) {
         !(c->cmd->getkeys_proc == NULL && c->cmd->firstkey == 0 &&
           c->cmd->proc != execCommand))
     {
-        int hashslot;
+        int hashslot = -1;
         int error_code;
         clusterNode *n = getNodeByQuery(c,c->cmd,c->argv,c->argc,
                                         &hashslot,&error_code);
         if (n == NULL || n != server.cluster->myself) {
+            /* Keys of a migrating slot that already moved can be served
+             * by proxying the command to the import target instead of
+             * paying the -ASK redirect round trip on the client. */
+            if (error_code == CLUSTER_REDIR_ASK &&
+                clusterForwardCommand(c,n) == C_OK)
+                return C_OK;
             if (c->cmd->proc == execCommand) {
                 discardTransaction(c);
             } else {
@@ -3389,6 +4754,7 @@ int processCommand(client *c) {
             clusterRedirectClient(c,n,hashslot,error_code);
             return C_OK;
         }
+        cluster_slot = hashslot;
     }
 
     /* Handle the maxmemory directive.
@@ -3520,7 +4886,40 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
-        call(c,CMD_CALL_FULL);
+        /* If the command touches values demoted to the cold tier, park
+         * the client while bio threads read them back: the command runs
+         * from beforeSleep() once every value is resident again. */
+        if (coldTierBlockClientIfNeeded(c)) return C_OK;
+
+        /* Modules registered as read-through caches may intercept the
+         * miss of a read command's key: the module typically blocks the
+         * client, populates the key from the backing store on its own
+         * threads, and has the command re-dispatched. See
+         * RM_InterceptKeyMisses(). */
+        if (moduleKeyMissInterceptCommand(c)) return C_OK;
+
+        /* Identical deterministic reads may be served straight from the
+         * result cache; on an eligible miss the reply produced below is
+         * captured into it. */
+        if (replyCacheServeCommand(c)) {
+            c->cmd->calls++;
+            server.stat_numcommands++;
+            c->woff = server.master_repl_offset;
+            return C_OK;
+        }
+
+        /* Try the specialized fast path first: it fully executes the
+         * hottest commands when they need none of the general call()
+         * machinery, and reports 0 otherwise. */
+        unsigned long long slot_out_before = 0;
+        if (cluster_slot != -1)
+            slot_out_before = c->reply_bytes + c->bufpos;
+        if (!(server.fast_path_commands && handleFastPathCommand(c)))
+            call(c,CMD_CALL_FULL);
+        if (cluster_slot != -1)
+            clusterSlotStatsAddCommand(cluster_slot,c,
+                c->reply_bytes + c->bufpos - slot_out_before);
+        replyCacheCaptureResult(c);
         c->woff = server.master_repl_offset;
         if (listLength(server.ready_keys))
             handleClientsBlockedOnKeys();
@@ -3536,7 +4935,10 @@ void closeListeningSockets(int unlink_unix_socket) {
     int j;
 
     for (j = 0; j < server.ipfd_count; j++) close(server.ipfd[j]);
+    for (j = 0; j < server.reuseport_fd_count; j++)
+        close(server.reuseport_fd[j]);
     for (j = 0; j < server.tlsfd_count; j++) close(server.tlsfd[j]);
+    for (j = 0; j < server.adminfd_count; j++) close(server.adminfd[j]);
     if (server.sofd != -1) close(server.sofd);
     if (server.cluster_enabled)
         for (j = 0; j < server.cfd_count; j++) close(server.cfd[j]);
@@ -3583,6 +4985,13 @@ int prepareForShutdown(int flags) {
                 "There is a child rewriting the AOF. Killing it!");
             killAppendOnlyChild();
         }
+        if (aofNoForkRewriteInProgress()) {
+            if (server.aof_state == AOF_WAIT_REWRITE) {
+                serverLog(LL_WARNING, "Writing initial AOF, can't exit.");
+                return C_ERR;
+            }
+            aofNoForkRewriteAbort();
+        }
         /* Append only file: flush buffers and fsync() the AOF at exit */
         serverLog(LL_NOTICE,"Calling fsync() on the AOF file.");
         flushAppendOnlyFile(1);
@@ -3606,6 +5015,11 @@ int prepareForShutdown(int flags) {
         }
     }
 
+    /* Persist the replication backlog right after the final snapshot, so
+     * the restart can serve partial resynchronizations from where the
+     * stream stopped. */
+    replicationPersistBacklog();
+
     /* Fire the shutdown modules event. */
     moduleFireServerEvent(REDISMODULE_EVENT_SHUTDOWN,0,NULL);
 
@@ -3695,7 +5109,7 @@ void timeCommand(client *c) {
 }
 
 /* Helper function for addReplyCommand() to output flags. */
-int addReplyCommandFlag(client *c, struct redisCommand *cmd, int f, char *reply) {
+int addReplyCommandFlag(client *c, struct redisCommand *cmd, uint64_t f, char *reply) {
     if (cmd->flags & f) {
         addReplyStatus(c, reply);
         return 1;
@@ -3729,6 +5143,7 @@ void addReplyCommand(client *c, struct redisCommand *cmd) {
         flagcount += addReplyCommandFlag(c,cmd,CMD_SKIP_SLOWLOG, "skip_slowlog");
         flagcount += addReplyCommandFlag(c,cmd,CMD_ASKING, "asking");
         flagcount += addReplyCommandFlag(c,cmd,CMD_FAST, "fast");
+        flagcount += addReplyCommandFlag(c,cmd,CMD_RESUMABLE, "resumable");
         if ((cmd->getkeys_proc && !(cmd->flags & CMD_MODULE)) ||
             cmd->flags & CMD_MODULE_GETKEYS)
         {
@@ -3858,6 +5273,8 @@ sds genRedisInfoString(const char *section) {
     if (allsections || defsections || !strcasecmp(section,"server")) {
         static int call_uname = 1;
         static struct utsname name;
+        static sds cached = NULL;
+        static time_t cached_time = 0;
         char *mode;
 
         if (server.cluster_enabled) mode = "cluster";
@@ -3872,7 +5289,16 @@ sds genRedisInfoString(const char *section) {
             call_uname = 0;
         }
 
-        info = sdscatfmt(info,
+        /* Nothing in this section changes more often than once per second
+         * (uptime and the LRU clock have second resolution), so the
+         * formatted body can be reused when monitoring agents hammer INFO
+         * within the same second. */
+        if (cached && cached_time == server.unixtime) {
+            info = sdscatsds(info,cached);
+            goto server_section_done;
+        }
+        sdsfree(cached);
+        cached = sdscatfmt(sdsempty(),
             "# Server\r\n"
             "redis_version:%s\r\n"
             "redis_git_sha1:%s\r\n"
@@ -3918,6 +5344,9 @@ sds genRedisInfoString(const char *section) {
             server.lruclock,
             server.executable ? server.executable : "",
             server.configfile ? server.configfile : "");
+        cached_time = server.unixtime;
+        info = sdscatsds(info,cached);
+server_section_done: ;
     }
 
     /* Clients */
@@ -3931,11 +5360,15 @@ sds genRedisInfoString(const char *section) {
             "client_recent_max_input_buffer:%zu\r\n"
             "client_recent_max_output_buffer:%zu\r\n"
             "blocked_clients:%d\r\n"
-            "tracking_clients:%d\r\n",
+            "backpressure_clients:%u\r\n"
+            "tracking_clients:%d\r\n"
+            "scan_sessions:%lu\r\n",
             listLength(server.clients)-listLength(server.slaves),
             maxin, maxout,
             server.blocked_clients,
-            server.tracking_clients);
+            server.obuf_backpressure_clients,
+            server.tracking_clients,
+            scanSessionCount());
     }
 
     /* Memory */
@@ -3951,7 +5384,30 @@ sds genRedisInfoString(const char *section) {
         size_t total_system_mem = server.system_memory_size;
         const char *evict_policy = evictPolicyToString();
         long long memory_lua = (long long)lua_gc(server.lua,LUA_GCCOUNT,0)*1024;
-        struct redisMemOverhead *mh = getMemoryOverheadData();
+
+        /* Computing the memory overhead walks all the databases and the
+         * client lists, which is the expensive part of this section on
+         * hosts with many connections, while its output only moves slowly:
+         * sample it at most once per second. Plain counters like
+         * used_memory are still read live below. */
+        static struct redisMemOverhead *cached_mh = NULL;
+        static time_t cached_mh_time = 0;
+        if (cached_mh == NULL || cached_mh_time != server.unixtime) {
+            if (cached_mh) freeMemoryOverheadData(cached_mh);
+            cached_mh = getMemoryOverheadData();
+            cached_mh_time = server.unixtime;
+        }
+        struct redisMemOverhead *mh = cached_mh;
+
+        /* The replication buffer gauge must be read live: it can drop by
+         * tens of megabytes in an instant when a slow replica is
+         * disconnected and the blocks it referenced are released, and it
+         * is just a counter, not part of the expensive walk above. */
+        size_t mem_repl_backlog = 0;
+        if (server.repl_backlog) {
+            mem_repl_backlog = zmalloc_size(server.repl_backlog) +
+                               server.repl_buffer_mem;
+        }
 
         /* Peak memory is updated from time to time by serverCron() so it
          * may happen that the instantaneous value is slightly bigger than
@@ -4047,7 +5503,7 @@ sds genRedisInfoString(const char *section) {
                                      for backward compatibility. */
             mh->total_frag_bytes,
             freeMemoryGetNotCountedMemory(),
-            mh->repl_backlog,
+            mem_repl_backlog,
             mh->clients_slaves,
             mh->clients_normal,
             mh->aof_buffer,
@@ -4055,7 +5511,6 @@ sds genRedisInfoString(const char *section) {
             server.active_defrag_running,
             lazyfreeGetPendingObjectsCount()
         );
-        freeMemoryOverheadData(mh);
     }
 
     /* Persistence */
@@ -4071,6 +5526,7 @@ sds genRedisInfoString(const char *section) {
             "rdb_last_bgsave_time_sec:%jd\r\n"
             "rdb_current_bgsave_time_sec:%jd\r\n"
             "rdb_last_cow_size:%zu\r\n"
+            "current_cow_size:%zu\r\n"
             "aof_enabled:%d\r\n"
             "aof_rewrite_in_progress:%d\r\n"
             "aof_rewrite_scheduled:%d\r\n"
@@ -4090,11 +5546,13 @@ sds genRedisInfoString(const char *section) {
             (intmax_t)((server.rdb_child_pid == -1) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
+            server.stat_current_cow_bytes,
             server.aof_state != AOF_OFF,
-            server.aof_child_pid != -1,
+            server.aof_child_pid != -1 || aofNoForkRewriteInProgress(),
             server.aof_rewrite_scheduled,
             (intmax_t)server.aof_rewrite_time_last,
-            (intmax_t)((server.aof_child_pid == -1) ?
+            (intmax_t)((server.aof_child_pid == -1 &&
+                        !aofNoForkRewriteInProgress()) ?
                 -1 : time(NULL)-server.aof_rewrite_time_start),
             (server.aof_lastbgrewrite_status == C_OK) ? "ok" : "err",
             (server.aof_last_write_status == C_OK) ? "ok" : "err",
@@ -4102,6 +5560,27 @@ sds genRedisInfoString(const char *section) {
             server.module_child_pid != -1,
             server.stat_module_cow_bytes);
 
+        if (server.cow_ledger.state != COW_LEDGER_NONE) {
+            info = sdscatprintf(info,
+                "cow_ledger_state:%s\r\n"
+                "cow_ledger_dict_bytes:%zu\r\n"
+                "cow_ledger_backlog_bytes:%zu\r\n"
+                "cow_ledger_clientbufs_bytes:%zu\r\n"
+                "cow_ledger_sampled_keys:%d\r\n"
+                "cow_ledger_entries_dirty_pct:%.2f\r\n"
+                "cow_ledger_keys_dirty_pct:%.2f\r\n"
+                "cow_ledger_values_dirty_pct:%.2f\r\n",
+                (server.cow_ledger.state == COW_LEDGER_OK) ?
+                    "ok" : "unsupported",
+                server.cow_ledger.dict_bytes,
+                server.cow_ledger.backlog_bytes,
+                server.cow_ledger.clientbufs_bytes,
+                server.cow_ledger.sampled_keys,
+                server.cow_ledger.entries_dirty_pct,
+                server.cow_ledger.keys_dirty_pct,
+                server.cow_ledger.values_dirty_pct);
+        }
+
         if (server.aof_enabled) {
             info = sdscatprintf(info,
                 "aof_current_size:%lld\r\n"
@@ -4110,6 +5589,7 @@ sds genRedisInfoString(const char *section) {
                 "aof_buffer_length:%zu\r\n"
                 "aof_rewrite_buffer_length:%lu\r\n"
                 "aof_pending_bio_fsync:%llu\r\n"
+                "aof_pending_bio_write:%llu\r\n"
                 "aof_delayed_fsync:%lu\r\n",
                 (long long) server.aof_current_size,
                 (long long) server.aof_rewrite_base_size,
@@ -4117,6 +5597,7 @@ sds genRedisInfoString(const char *section) {
                 sdslen(server.aof_buf),
                 aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
+                bioPendingJobsOfType(BIO_AOF_WRITE),
                 server.aof_delayed_fsync);
         }
 
@@ -4159,6 +5640,7 @@ sds genRedisInfoString(const char *section) {
             "# Stats\r\n"
             "total_connections_received:%lld\r\n"
             "total_commands_processed:%lld\r\n"
+            "io_threaded_commands_processed:%lld\r\n"
             "instantaneous_ops_per_sec:%lld\r\n"
             "total_net_input_bytes:%lld\r\n"
             "total_net_output_bytes:%lld\r\n"
@@ -4169,10 +5651,13 @@ sds genRedisInfoString(const char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_values_freed:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "expire_cycle_cpu_milliseconds:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "evicted_keys_proactive:%lld\r\n"
+            "propagated_writes_coalesced:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
@@ -4184,9 +5669,16 @@ sds genRedisInfoString(const char *section) {
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
             "active_defrag_key_misses:%lld\r\n"
-            "tracking_used_slots:%lld\r\n",
+            "tracking_used_slots:%lld\r\n"
+            "reply_cache_hits:%lld\r\n"
+            "reply_cache_entries:%lu\r\n"
+            "reply_cache_cmd_hits:%lld\r\n"
+            "reply_cache_cmd_misses:%lld\r\n"
+            "reply_cache_cmd_entries:%lu\r\n"
+            "reply_cache_cmd_bytes:%zu\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
+            server.stat_io_commands_processed,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
             server.stat_net_input_bytes,
             server.stat_net_output_bytes,
@@ -4197,14 +5689,17 @@ sds genRedisInfoString(const char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            server.stat_expired_values_freed,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_expire_cycle_time_used/1000,
             server.stat_evictedkeys,
+            server.stat_proactive_evictedkeys,
+            server.stat_propagate_coalesced,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
-            listLength(server.pubsub_patterns),
+            dictSize(server.pubsub_patterns),
             server.stat_fork_time,
             dictSize(server.migrate_cached_sockets),
             getSlaveKeyWithExpireCount(),
@@ -4212,7 +5707,14 @@ sds genRedisInfoString(const char *section) {
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
             server.stat_active_defrag_key_misses,
-            trackingGetUsedSlots());
+            trackingGetUsedSlots(),
+            server.stat_reply_cache_hits,
+            replyCacheNumEntries(),
+            server.stat_reply_cache_cmd_hits,
+            server.stat_reply_cache_cmd_misses,
+            replyCacheCmdNumEntries(),
+            replyCacheCmdBytes());
+        if (coldTierEnabled()) info = coldTierAppendInfo(info);
     }
 
     /* Replication */
@@ -4385,6 +5887,21 @@ sds genRedisInfoString(const char *section) {
         dictReleaseIterator(di);
     }
 
+    /* Hot keys */
+    if (allsections || !strcasecmp(section,"hotkeys")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Hotkeys\r\n");
+        info = hotkeysCatInfoString(info);
+    }
+
+    /* Event loop phases */
+    if (allsections || !strcasecmp(section,"loopstats")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Loopstats\r\n");
+        info = loopstatsCatInfoString(info);
+        info = cronTasksCatInfoString(info);
+    }
+
     /* Cluster */
     if (allsections || defsections || !strcasecmp(section,"cluster")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -4398,15 +5915,18 @@ sds genRedisInfoString(const char *section) {
     if (allsections || defsections || !strcasecmp(section,"keyspace")) {
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info, "# Keyspace\r\n");
+        long long now = mstime();
         for (j = 0; j < server.dbnum; j++) {
             long long keys, vkeys;
 
-            keys = dictSize(server.db[j].dict);
+            keys = dbSize(&server.db[j]);
             vkeys = dictSize(server.db[j].expires);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
-                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
-                    j, keys, vkeys, server.db[j].avg_ttl);
+                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld,"
+                    "pending_expires=%lld\r\n",
+                    j, keys, vkeys, server.db[j].avg_ttl,
+                    dbPendingExpires(&server.db[j],now));
             }
         }
     }
@@ -4424,6 +5944,30 @@ sds genRedisInfoString(const char *section) {
     return info;
 }
 
+/* Reply with the INFO payload as a RESP3 map of section name -> section
+ * body, so that structured clients don't need to re-parse the flat text
+ * format. Sections start with a "# Name\r\n" header line and are separated
+ * by an empty line. */
+void addReplyInfoSectionsMap(client *c, sds info) {
+    void *replylen = addReplyDeferredLen(c);
+    long sections = 0;
+    char *p = info, *end = info + sdslen(info);
+
+    while (p < end && p[0] == '#' && p[1] == ' ') {
+        char *name = p+2;
+        char *eol = strstr(name,"\r\n");
+        if (!eol) break;
+        char *body = eol+2;
+        char *next = strstr(body,"\r\n# ");
+        size_t bodylen = next ? (size_t)(next-body) : (size_t)(end-body);
+        addReplyBulkCBuffer(c,name,eol-name);
+        addReplyVerbatim(c,body,bodylen,"txt");
+        sections++;
+        p = next ? next+2 : end;
+    }
+    setDeferredMapLen(c,replylen,sections);
+}
+
 void infoCommand(client *c) {
     char *section = c->argc == 2 ? c->argv[1]->ptr : "default";
 
@@ -4432,7 +5976,10 @@ void infoCommand(client *c) {
         return;
     }
     sds info = genRedisInfoString(section);
-    addReplyVerbatim(c,info,sdslen(info),"txt");
+    if (c->resp >= 3)
+        addReplyInfoSectionsMap(c,info);
+    else
+        addReplyVerbatim(c,info,sdslen(info),"txt");
     sdsfree(info);
 }
 
@@ -4442,6 +5989,7 @@ void monitorCommand(client *c) {
 
     c->flags |= (CLIENT_SLAVE|CLIENT_MONITOR);
     listAddNodeTail(server.monitors,c);
+    auditMonitorAttach(c);
     addReply(c,shared.ok);
 }
 
@@ -4647,6 +6195,7 @@ int redisFork() {
     long long start = ustime();
     if ((childpid = fork()) == 0) {
         /* Child */
+        server.in_fork_child = 1;
         closeListeningSockets(0);
         setupChildSignalHandlers();
     } else {
@@ -4658,6 +6207,7 @@ int redisFork() {
             return -1;
         }
         updateDictResizePolicy();
+        cowLedgerForkStarted();
     }
     return childpid;
 }
@@ -4672,6 +6222,7 @@ void sendChildCOWInfo(int ptype, char *pname) {
     }
 
     server.child_info_data.cow_size = private_dirty;
+    server.child_info_data.final = 1;
     sendChildInfo(ptype);
 }
 
@@ -4719,6 +6270,13 @@ void loadDataFromDisk(void) {
                 replicationCacheMasterUsingMyself();
                 selectDb(server.cached_master,rsi.repl_stream_db);
             }
+            /* Apply the delta RDB files chained to the base snapshot we
+             * just loaded, if any. */
+            rdbLoadDeltaChain();
+
+            /* Restore the replication backlog persisted by the previous
+             * clean shutdown, if it matches the RDB we just loaded. */
+            replicationLoadBacklog(&rsi);
         } else if (errno != ENOENT) {
             serverLog(LL_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
             exit(1);
@@ -4726,6 +6284,47 @@ void loadDataFromDisk(void) {
     }
 }
 
+/* startup-warmup: pre-fault the memory that the first wave of traffic
+ * after a restart would otherwise fault in on the hot path. We allocate a
+ * replication backlog worth of stream blocks plus a round of client query
+ * and reply buffers, touch every page, and free the lot: the allocator
+ * keeps the now-hot runs around and hands them back to the real
+ * allocations later. */
+static void warmupMemoryPools(void) {
+    long long start = ustime();
+    size_t blocksize = sizeof(replBufBlock)+PROTO_REPLY_CHUNK_BYTES;
+    size_t count = (server.repl_backlog_size+blocksize-1)/blocksize;
+    size_t j, touched = 0;
+
+    /* Cap the pass for pathologically large configured backlogs: warming
+     * a gigabyte is already enough to populate the allocator runs. */
+    if (count > (1024*1024*1024)/blocksize)
+        count = (1024*1024*1024)/blocksize;
+
+    /* Buffers for a round of 256 clients on top of the backlog blocks. */
+    size_t clients = 256;
+    void **blocks = zmalloc(sizeof(void*)*(count+clients*2));
+    for (j = 0; j < count; j++) {
+        blocks[j] = zmalloc(blocksize);
+        memset(blocks[j],0,blocksize);
+        touched += blocksize;
+    }
+    for (j = 0; j < clients; j++) {
+        size_t qbuf = PROTO_IOBUF_LEN;
+        size_t rbuf = sizeof(clientReplyBlock)+PROTO_REPLY_CHUNK_BYTES;
+        blocks[count+j*2] = zmalloc(qbuf);
+        memset(blocks[count+j*2],0,qbuf);
+        blocks[count+j*2+1] = zmalloc(rbuf);
+        memset(blocks[count+j*2+1],0,rbuf);
+        touched += qbuf+rbuf;
+    }
+    for (j = 0; j < count+clients*2; j++) zfree(blocks[j]);
+    zfree(blocks);
+    serverLog(LL_NOTICE,
+        "Warmed up %.1f Mb of buffer pools in %.3f seconds",
+        (double)touched/(1024*1024), (double)(ustime()-start)/1000000);
+}
+
 void redisOutOfMemoryHandler(size_t allocation_size) {
     serverLog(LL_WARNING,"Out Of Memory allocating %zu bytes!",
         allocation_size);
@@ -4881,6 +6480,7 @@ int main(int argc, char **argv) {
     setlocale(LC_COLLATE,"");
     tzset(); /* Populates 'timezone' global. */
     zmalloc_set_oom_handler(redisOutOfMemoryHandler);
+    zmalloc_typed_init();
     srand(time(NULL)^getpid());
     gettimeofday(&tv,NULL);
 
@@ -4916,6 +6516,8 @@ int main(int argc, char **argv) {
         redis_check_rdb_main(argc,argv,NULL);
     else if (strstr(argv[0],"redis-check-aof") != NULL)
         redis_check_aof_main(argc,argv);
+    else if (strstr(argv[0],"redis-microbench") != NULL)
+        redis_microbench_main(argc,argv);
 
     if (argc >= 2) {
         j = 1; /* First option to parse in argv[] */
@@ -5005,6 +6607,7 @@ int main(int argc, char **argv) {
     initServer();
     if (background || server.pidfile) createPidFile();
     redisSetProcTitle(argv[0]);
+    redisSetCpuAffinity(server.server_cpulist);
     redisAsciiArt();
     checkTcpBacklogSettings();
 
@@ -5018,6 +6621,7 @@ int main(int argc, char **argv) {
         ACLLoadUsersAtStartup();
         InitServerLast();
         loadDataFromDisk();
+        if (server.startup_warmup) warmupMemoryPools();
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
                 serverLog(LL_WARNING,
@@ -5026,7 +6630,8 @@ int main(int argc, char **argv) {
                 exit(1);
             }
         }
-        if (server.ipfd_count > 0 || server.tlsfd_count > 0)
+        if (server.ipfd_count > 0 || server.reuseport_fd_count > 0 ||
+            server.tlsfd_count > 0 || server.adminfd_count > 0)
             serverLog(LL_NOTICE,"Ready to accept connections");
         if (server.sofd > 0)
             serverLog(LL_NOTICE,"The server is now ready to accept connections at %s", server.unixsocket);
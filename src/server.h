@@ -60,6 +60,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list of strings data structure */
 #include "intset.h"  /* Compact integer set structure */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
@@ -69,6 +70,7 @@ typedef long long ustime_t; /* microsecond time type. */
                            N-elements flat arrays */
 #include "rax.h"     /* Radix tree */
 #include "connection.h" /* Connection abstraction */
+#include "compress.h" /* Pluggable compression codecs */
 
 #define REDISMODULE_CORE 1
 #include "redismodule.h"    /* Redis modules API defines. */
@@ -133,8 +135,15 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_ZEROCOPY_MIN_SIZE 4096 /* Min string payload size to be
+                                              referenced in the reply list
+                                              instead of copied. */
+#define PROTO_WRITEV_MAX 64 /* Max iovec entries gathered per writev call. */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_ARGV_POOL_SIZE    8    /* Recycled argument objects kept per
+                                        client, see freeClientArgv(). */
+#define PROTO_ARGV_POOL_MAX_BUF 1024 /* Don't pool bigger sds buffers. */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -194,6 +203,11 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CMD_CATEGORY_TRANSACTION (1ULL<<36)
 #define CMD_CATEGORY_SCRIPTING (1ULL<<37)
 
+#define CMD_RESUMABLE (1ULL<<38)       /* "resumable" flag: against big values
+                                          the command may block the client and
+                                          build its reply in bounded slices
+                                          across event loop iterations. */
+
 /* AOF states */
 #define AOF_OFF 0             /* AOF is off */
 #define AOF_ON 1              /* AOF is on */
@@ -239,9 +253,30 @@ typedef long long ustime_t; /* microsecond time type. */
                                           we return single threaded that the
                                           client has already pending commands
                                           to be executed. */
-#define CLIENT_TRACKING (1<<31) /* Client enabled keys tracking in order to
+#define CLIENT_TRACKING (1ULL<<31) /* Client enabled keys tracking in order to
                                    perform client side caching. */
 #define CLIENT_TRACKING_BROKEN_REDIR (1ULL<<32) /* Target client is invalid. */
+#define CLIENT_ARGV_BORROWED (1ULL<<33) /* c->argv is borrowed from the MULTI
+                                           queue arena: the command rewrite
+                                           functions must not free or
+                                           reallocate it. */
+#define CLIENT_BATCH_PRIORITY (1ULL<<34) /* Heavy commands from this client
+                                            are deferred to the budgeted part
+                                            of the event loop iteration. */
+#define CLIENT_DEFERRED_EXEC (1ULL<<35) /* The client has a parsed command
+                                           parked in the deferred exec list. */
+#define CLIENT_OBUF_BACKPRESSURE (1ULL<<36) /* Reads are suspended because the
+                                               output buffer crossed the soft
+                                               limit (backpressure mode). */
+#define CLIENT_NO_TOUCH (1ULL<<37) /* Lookups from this client don't alter the
+                                      LRU/LFU state of the keys (CLIENT
+                                      NO-TOUCH). */
+#define CLIENT_PROTO_RESP (1ULL<<38) /* The connection sent a RESP command:
+                                        it is locked to the multibulk protocol
+                                        and skips inline detection. */
+#define CLIENT_ADMIN_PORT (1ULL<<39) /* Accepted on the admin port: the inline
+                                        protocol stays available even when
+                                        inline-commands is disabled. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -251,7 +286,14 @@ typedef long long ustime_t; /* microsecond time type. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
-#define BLOCKED_NUM 6     /* Number of blocked states. */
+#define BLOCKED_KEYSEXPORT 6 /* KEYSASYNC background keyspace export. */
+#define BLOCKED_SNAPSHOT 7 /* Waiting for a forked snapshot child. */
+#define BLOCKED_RESUMABLE 8 /* Resumable read command slicing its reply. */
+#define BLOCKED_COLD 9    /* Waiting for cold tier values to fault back. */
+#define BLOCKED_CENSUS 10 /* Waiting for a forked heap census child. */
+#define BLOCKED_FORWARD 11 /* Waiting for a reply relayed by the cluster
+                              ASK redirect offload. */
+#define BLOCKED_NUM 12    /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -282,11 +324,13 @@ typedef long long ustime_t; /* microsecond time type. */
 #define REPL_STATE_RECEIVE_IP 9 /* Wait for REPLCONF reply */
 #define REPL_STATE_SEND_CAPA 10 /* Send REPLCONF capa */
 #define REPL_STATE_RECEIVE_CAPA 11 /* Wait for REPLCONF reply */
-#define REPL_STATE_SEND_PSYNC 12 /* Send PSYNC */
-#define REPL_STATE_RECEIVE_PSYNC 13 /* Wait for PSYNC reply */
+#define REPL_STATE_SEND_COMPRESS 12 /* Send REPLCONF compress */
+#define REPL_STATE_RECEIVE_COMPRESS 13 /* Wait for REPLCONF reply */
+#define REPL_STATE_SEND_PSYNC 14 /* Send PSYNC */
+#define REPL_STATE_RECEIVE_PSYNC 15 /* Wait for PSYNC reply */
 /* --- End of handshake states --- */
-#define REPL_STATE_TRANSFER 14 /* Receiving .rdb from master */
-#define REPL_STATE_CONNECTED 15 /* Connected to master */
+#define REPL_STATE_TRANSFER 16 /* Receiving .rdb from master */
+#define REPL_STATE_CONNECTED 17 /* Connected to master */
 
 /* State of slaves from the POV of the master. Used in client->replstate.
  * In SEND_BULK and ONLINE state the slave receives new updates
@@ -302,6 +346,10 @@ typedef long long ustime_t; /* microsecond time type. */
 #define SLAVE_CAPA_EOF (1<<0)    /* Can parse the RDB EOF streaming format. */
 #define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
 
+/* Size of the raw stream blocks compressed into a frame when a replica
+ * negotiated a compressed replication stream with REPLCONF compress. */
+#define REPL_STREAM_COMPRESS_BLOCK (64*1024)
+
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
 
@@ -409,7 +457,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define NOTIFY_EVICTED (1<<9)     /* e */
 #define NOTIFY_STREAM (1<<10)     /* t */
 #define NOTIFY_KEY_MISS (1<<11)   /* m */
-#define NOTIFY_ALL (NOTIFY_GENERIC | NOTIFY_STRING | NOTIFY_LIST | NOTIFY_SET | NOTIFY_HASH | NOTIFY_ZSET | NOTIFY_EXPIRED | NOTIFY_EVICTED | NOTIFY_STREAM | NOTIFY_KEY_MISS) /* A flag */
+#define NOTIFY_HOTKEY (1<<12)     /* n */
+#define NOTIFY_ALL (NOTIFY_GENERIC | NOTIFY_STRING | NOTIFY_LIST | NOTIFY_SET | NOTIFY_HASH | NOTIFY_ZSET | NOTIFY_EXPIRED | NOTIFY_EVICTED | NOTIFY_STREAM | NOTIFY_KEY_MISS | NOTIFY_HOTKEY) /* A flag */
 
 /* Get the first bind addr or NULL */
 #define NET_FIRST_BIND_ADDR (server.bindaddr_count ? server.bindaddr[0] : NULL)
@@ -450,6 +499,7 @@ typedef long long ustime_t; /* microsecond time type. */
  * encoding version. */
 #define OBJ_MODULE 5    /* Module object. */
 #define OBJ_STREAM 6    /* Stream object. */
+#define OBJ_TYPE_MAX 7  /* Total number of object types. */
 
 /* Extract encver / signature from a module type ID. */
 #define REDISMODULE_TYPE_ENCVER_BITS 10
@@ -465,6 +515,7 @@ struct RedisModule;
 struct RedisModuleIO;
 struct RedisModuleDigest;
 struct RedisModuleCtx;
+struct RedisModuleDefragCtx;
 struct redisObject;
 
 /* Each module type implementation should export a set of methods in order
@@ -479,6 +530,7 @@ typedef void (*moduleTypeRewriteFunc)(struct RedisModuleIO *io, struct redisObje
 typedef void (*moduleTypeDigestFunc)(struct RedisModuleDigest *digest, void *value);
 typedef size_t (*moduleTypeMemUsageFunc)(const void *value);
 typedef void (*moduleTypeFreeFunc)(void *value);
+typedef int (*moduleTypeDefragFunc)(struct RedisModuleDefragCtx *ctx, struct redisObject *key, void **value);
 
 /* The module type, which is referenced in each value of a given type, defines
  * the methods and links to the module exporting the type. */
@@ -494,6 +546,7 @@ typedef struct RedisModuleType {
     moduleTypeAuxLoadFunc aux_load;
     moduleTypeAuxSaveFunc aux_save;
     int aux_save_triggers;
+    moduleTypeDefragFunc defrag;
     char name[10]; /* 9 bytes name + null term. Charset: A-Z a-z 0-9 _- */
 } moduleType;
 
@@ -573,10 +626,17 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_LAZY 11 /* Not yet loaded: points into a memory mapped
+                                RDB file, materialized on first access. */
+#define OBJ_ENCODING_LISTPACK 12 /* Encoded as a listpack */
+#define OBJ_ENCODING_COLD 13 /* Demoted to the cold tier log on disk,
+                                faulted back on access. See coldtier.c. */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
-#define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
+#define LRU_CLOCK_DEFAULT_RESOLUTION 1000 /* Default LRU clock resolution
+                                             in ms, see the
+                                             lru-clock-resolution config. */
 
 #define OBJ_SHARED_REFCOUNT INT_MAX
 typedef struct redisObject {
@@ -608,30 +668,154 @@ char *getObjectTypeName(robj*);
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * Normally the block embeds a copy of the protocol bytes in buf[]. When
+ * 'blob' is not NULL the block instead references the sds payload of a
+ * string object, of which the block holds a reference: in that case 'used'
+ * is the payload length and 'size' only tracks the memory accounted in
+ * the client reply_bytes, while buf[] is empty. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *blob;
+    size_t blob_off;          /* First referenced byte of the blob payload:
+                               * non zero when only a range of the string is
+                               * part of the reply (GETRANGE). */
+    struct replyArena *arena; /* Arena the block was carved from, or NULL
+                               * if it was allocated with zmalloc(). */
     char buf[];
 } clientReplyBlock;
 
+/* Per-client bump allocator backing the clientReplyBlock allocations
+ * above. Blocks are carved sequentially from buf[] advancing 'used';
+ * individual blocks are not returned, instead 'live' counts the blocks
+ * handed out and still in the reply list, and when it drops back to zero
+ * (i.e. after writeToClient() flushed the last of them) the whole arena
+ * is reset with a single store. When the arena is full the allocation
+ * falls back to zmalloc(), so slow clients accumulating large outputs
+ * are served as before. */
+typedef struct replyArena {
+    size_t size;        /* Usable bytes in buf[]. */
+    size_t used;        /* Bump pointer: next free offset. */
+    size_t live;        /* Outstanding blocks not yet freed. */
+    char buf[];
+} replyArena;
+
+/* Snapshot of the reply position of a client, taken by a long iterating
+ * command before it starts emitting elements: if the command gives up
+ * midway (see commandDeadlineReached()) the partial output appended since
+ * the snapshot is discarded with replyCheckpointRewind(), so that a clean
+ * error can be emitted in its place. */
+typedef struct replyCheckpoint {
+    int bufpos;                 /* Static buffer position. */
+    listNode *tail;             /* Reply list tail, NULL if it was empty. */
+    size_t tailused;            /* Payload bytes used in that tail block. */
+    unsigned long long reply_bytes;
+    long long net_output_bytes; /* Detects flushes to the socket, after
+                                   which the output can't be taken back. */
+} replyCheckpoint;
+
+/* A refcounted chunk of the RDB stream produced by the diskless
+ * replication fork child. The chunks form a list that every target
+ * replica drains at its own pace: the refcount is the number of replicas
+ * that still have to send the chunk, and the chunk is freed when the
+ * slowest one is done with it. */
+typedef struct rdbPipeChunk {
+    struct rdbPipeChunk *next;
+    int refcount;
+    size_t used;
+    char buf[];
+} rdbPipeChunk;
+
+/* Block of the shared replication stream (see server.repl_buffer_blocks).
+ * The replication backlog and every attached replica reference the blocks
+ * directly instead of keeping private copies of the stream: a block is
+ * released when nobody references it anymore and every older block was
+ * released as well. */
+typedef struct replBufBlock {
+    int refcount;           /* Replicas referencing the block, plus one if
+                               it is the first block of the backlog. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    size_t size, used;
+    size_t staged;          /* Bytes after 'used' relayed verbatim from our
+                               master but not yet applied: they become part
+                               of the visible stream (moving into 'used')
+                               only once the main thread applied them. */
+    char buf[];
+} replBufBlock;
+
+/* Replication backlog: just a window over the shared replication buffer,
+ * referencing the oldest block that is still part of the history replicas
+ * may ask with PSYNC. */
+typedef struct replBacklog {
+    listNode *ref_node;     /* Oldest referenced buffer block node. */
+    rax *blocks_index;      /* Index of buffer block nodes by replication
+                               offset, holding one entry every
+                               REPL_BACKLOG_INDEX_PER_BLOCKS blocks, so a
+                               PSYNC start point is found in a bounded
+                               number of steps whatever the backlog size. */
+    long long unindexed_blocks; /* Blocks appended since the last entry. */
+} replBacklog;
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
-    dict *dict;                 /* The keyspace for this DB */
+    dict **dict;                /* The keyspace for this DB, split into
+                                   server.db_dict_shards hash tables routed
+                                   by key hash slot, so that every rehash
+                                   only touches a small table. */
     dict *expires;              /* Timeout of keys with a timeout set */
+    rax *expires_index;         /* Volatile keys ordered by expire time:
+                                   8 bytes big endian mstime followed by
+                                   the key name. Lets the expire cycle pop
+                                   exactly the keys that are already dead. */
+    dict *hexpires;             /* Field TTLs of hashes using them: key name
+                                   (owned sds) -> listpack of (field, expire
+                                   mstime) pairs. Only hashes touched by
+                                   HEXPIRE and friends have an entry here. */
+    rax *hexpires_index;        /* Hashes with field TTLs ordered by their
+                                   nearest field deadline, same entry layout
+                                   as expires_index. */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
-    unsigned long expires_cursor; /* Cursor of the active expire cycle. */
+    mstime_t min_expire;        /* Lower bound on the nearest expire time of
+                                   the DB, or LLONG_MAX if no volatile keys:
+                                   lets the lookup path skip the expire check
+                                   with a single comparison. Conservative:
+                                   removing an expire does not raise it. */
+    mstime_t min_expire_at;     /* Last time min_expire was recomputed from
+                                   the expires_index head, to rate limit the
+                                   refresh to once per millisecond. */
+    mstime_t reclaimed_upto;    /* Replicas only: expire times up to this
+                                   already had their value reclaimed by
+                                   replicaFreeExpiredValues(). */
+    long long type_count[OBJ_TYPE_MAX]; /* Number of keys per object type.
+                                   Exact: a value never changes type while
+                                   in the keyspace, so updating the add,
+                                   overwrite and delete paths is enough. */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
 } redisDb;
 
+/* Safe iterator over every key of a DB, crossing keyspace shard
+ * boundaries transparently. */
+typedef struct dbIterator {
+    redisDb *db;
+    int shard;              /* Shard currently being iterated. */
+    dictIterator *di;
+} dbIterator;
+
 /* Client MULTI/EXEC state */
+struct multiArgvBlock;
+
 typedef struct multiCmd {
     robj **argv;
+    int argv_heap;          /* True if argv is its own allocation and not a
+                               slice of the queue arena: the command vector
+                               was rewritten while executing. */
     int argc;
     struct redisCommand *cmd;
 } multiCmd;
@@ -639,9 +823,18 @@ typedef struct multiCmd {
 typedef struct multiState {
     multiCmd *commands;     /* Array of MULTI commands */
     int count;              /* Total number of MULTI commands */
+    int size;               /* Slots allocated in 'commands'. */
     int cmd_flags;          /* The accumulated command flags OR-ed together.
                                So if at least a command has a given flag, it
                                will be set in this field. */
+    struct multiArgvBlock *arena; /* Arena the queued argument vectors are
+                               carved from, released as a whole with the
+                               transaction. */
+    struct user *acl_user;  /* The user the queued commands were validated
+                               against. If it changed, EXEC re-checks the
+                               ACL of every command. */
+    unsigned long long acl_generation; /* server.acl_generation when the
+                               transaction started, same purpose. */
     int minreplicas;        /* MINREPLICAS for synchronous replication */
     time_t minreplicas_timeout; /* MINREPLICAS timeout as unixtime. */
 } multiState;
@@ -709,6 +902,10 @@ typedef struct readyList {
                                            no AUTH is needed, and every
                                            connection is immediately
                                            authenticated. */
+/* Not a flag but a mask: a user having both ALLKEYS and ALLCOMMANDS, like
+ * the default user in its default configuration, passes every ACL check,
+ * so commands can skip them with a single test. */
+#define USER_FLAG_FULLACCESS (USER_FLAG_ALLKEYS|USER_FLAG_ALLCOMMANDS)
 typedef struct user {
     sds name;       /* The username as an SDS string. */
     uint64_t flags; /* See USER_FLAG_* */
@@ -732,6 +929,17 @@ typedef struct user {
     list *patterns;  /* A list of allowed key patterns. If this field is NULL
                         the user cannot mention any key in a command, unless
                         the flag ALLKEYS is set in the user. */
+
+    /* Compiled form of 'patterns', rebuilt lazily when out of date with
+     * respect to server.acl_generation, and shared by all the clients
+     * authenticated with this user. See ACLCompileUserPatterns(). */
+    rax *key_prefixes; /* Pure prefix patterns like "tenant:*", keyed by
+                          their literal prefix. */
+    list *key_globs;   /* The remaining patterns, matched one by one with
+                          stringmatchlen(). The nodes just reference the
+                          sds strings owned by 'patterns'. */
+    unsigned long long compiled_generation; /* server.acl_generation value
+                          at compile time, or 0 if never compiled. */
 } user;
 
 /* With multiplexing we need to take per-client state.
@@ -756,19 +964,46 @@ typedef struct client {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
+    int argv_len;           /* Allocated robj* slots in argv: lets the
+                               parser reuse the array across pipelined
+                               commands instead of reallocating it. */
+    robj *argv_pool[PROTO_ARGV_POOL_SIZE]; /* String objects released by
+                               freeClientArgv() and reused by the parser,
+                               so that small pipelined commands don't
+                               allocate per argument. */
+    int argv_pool_count;    /* Used slots in argv_pool. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
     user *user;             /* User associated with this connection. If the
                                user is set to NULL the connection can do
                                anything (admin). */
+    /* Cache of the per-command ACL verdicts already computed for this
+     * client: if the bit of a command ID is set, the user could run the
+     * command regardless of its arguments when the cache was filled. Only
+     * trusted while 'acl_cmd_generation' matches server.acl_generation
+     * and 'acl_cmd_user' matches 'user'. */
+    uint64_t acl_cmd_allowed[USER_COMMAND_BITS_COUNT/64];
+    unsigned long long acl_cmd_generation; /* 0 = cache never filled. */
+    user *acl_cmd_user;
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
     long bulklen;           /* Length of bulk argument in multi bulk request. */
     list *reply;            /* List of reply objects to send to the client. */
+    replyArena *reply_arena; /* Bump arena backing the reply list blocks,
+                                created on first use. */
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
+    int deferred_reply_nodes; /* Pending addReplyDeferredLen() placeholders:
+                                 while non zero the reply list contains NULL
+                                 nodes and must not be flushed mid command. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
     time_t lastinteraction; /* Time of the last interaction, used for timeout */
+    mstime_t timeout_deadline; /* Deadline of this client's entry in
+                                  server.clients_timeout_table, zero if the
+                                  client has no entry. */
+    long long command_time_limit; /* CLIENT TIMELIMIT override of the
+                                     command-time-limit config, zero to use
+                                     the server wide value. */
     time_t obuf_soft_limit_reached_time;
     uint64_t flags;         /* Client flags: CLIENT_* macros. */
     int authenticated;      /* Needed when the default user requires auth. */
@@ -777,6 +1012,11 @@ typedef struct client {
     int repldbfd;           /* Replication DB file descriptor. */
     off_t repldboff;        /* Replication DB file offset. */
     off_t repldbsize;       /* Replication DB file size. */
+    rdbPipeChunk *rdb_pipe_chunk; /* Next chunk of the diskless RDB stream
+                                     this replica has to send. */
+    listNode *ref_repl_buf_node; /* Node of server.repl_buffer_blocks this
+                                    replica is currently sending from. */
+    size_t ref_block_pos;   /* Bytes of the referenced block already sent. */
     sds replpreamble;       /* Replication DB preamble. */
     long long read_reploff; /* Read replication offset if this is a master. */
     long long reploff;      /* Applied replication offset if this is a master. */
@@ -789,13 +1029,26 @@ typedef struct client {
     int slave_listening_port; /* As configured with: SLAVECONF listening-port */
     char slave_ip[NET_IP_STR_LEN]; /* Optionally given by REPLCONF ip-address */
     int slave_capa;         /* Slave capabilities: SLAVE_CAPA_* bitwise OR. */
+    struct compressCodec *repl_codec; /* Negotiated replication stream codec
+                               (REPLCONF compress), or NULL for the plain
+                               stream. Set on replicas of this master and on
+                               the master client of a replica. */
+    sds repl_frame_buf;     /* Compressed stream staging: on a replica of
+                               this master, the frame being transmitted; on
+                               the master client, the partially read frame.
+                               NULL when repl_codec is NULL. */
+    size_t repl_frame_sent; /* Bytes of repl_frame_buf already sent. */
     multiState mstate;      /* MULTI/EXEC state */
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
+    int cold_faults;        /* Outstanding cold tier reads if BLOCKED_COLD. */
     long long woff;         /* Last write global replication offset. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
+    dict *pubsub_conflated; /* Latest message per conflated channel, parked
+                               while the client is under output buffer
+                               backpressure. Lazily created. */
     sds peerid;             /* Cached peer ID. */
     listNode *client_list_node; /* list node in client list */
 
@@ -803,6 +1056,12 @@ typedef struct client {
      * invalidation messages for keys fetched by this client will be send to
      * the specified client ID. */
     uint64_t client_tracking_redirection;
+    list *tracking_pending; /* Caching slots invalidated in this event loop
+                             * iteration, pushed as a single message from
+                             * beforeSleep(). NULL if none is pending. */
+    uint64_t tracking_epoch; /* Epoch assigned when tracking was enabled:
+                              * fingerprint table entries tagged with an
+                              * older epoch are considered stale. */
 
     /* Response buffer */
     int bufpos;
@@ -826,9 +1085,11 @@ struct sharedObjectsStruct {
     *emptyarray, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
     *outofrangeerr, *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr,
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
+    *timeouterr,
     *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *unlink,
-    *rpop, *lpop, *lpush, *rpoplpush, *zpopmin, *zpopmax, *emptyscan,
+    *hdel, *rpop, *lpop, *lpush, *rpoplpush, *zpopmin, *zpopmax, *emptyscan,
+    *pexpireat, *persist,
     *select[PROTO_SHARED_SELECT_CMDS],
     *integers[OBJ_SHARED_INTEGERS],
     *mbulkhdr[OBJ_SHARED_BULKHDR_LEN], /* "*<value>\r\n" */
@@ -849,6 +1110,7 @@ typedef struct zskiplistNode {
 
 typedef struct zskiplist {
     struct zskiplistNode *header, *tail;
+    struct zslArena *arena; /* Node storage, see t_zset.c. */
     unsigned long length;
     int level;
 } zskiplist;
@@ -965,6 +1227,7 @@ typedef struct redisTLSContextConfig {
     char *ciphers;
     char *ciphersuites;
     int prefer_server_ciphers;
+    int ktls;
 } redisTLSContextConfig;
 
 /*-----------------------------------------------------------------------------
@@ -987,6 +1250,7 @@ struct clusterState;
 struct redisServer {
     /* General */
     pid_t pid;                  /* Main process pid. */
+    int in_fork_child;          /* True in a forked persistence child. */
     char *configfile;           /* Absolute config file path, or NULL */
     char *executable;           /* Absolute executable file path. */
     char **exec_argv;           /* Executable argv vector (copy). */
@@ -995,6 +1259,12 @@ struct redisServer {
                                    the actual 'hz' field value if dynamic-hz
                                    is enabled. */
     int hz;                     /* serverCron() calls frequency in hertz */
+    int busy_poll_max_usec;     /* Busy poll the event loop for up to this
+                                   many microseconds before blocking. */
+    int batch_priority_budget_usec; /* Per event loop iteration time budget
+                                       for commands deferred from batch
+                                       priority clients. 0 disables the
+                                       deferral entirely. */
     redisDb *db;
     dict *commands;             /* Command table */
     dict *orig_commands;        /* Command table before command renaming. */
@@ -1002,6 +1272,8 @@ struct redisServer {
     _Atomic unsigned int lruclock; /* Clock for LRU eviction */
     int shutdown_asap;          /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    int background_rehashing;   /* Run the incremental rehash on a worker
+                                   thread while the event loop sleeps. */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *pidfile;              /* PID file path */
     int arch_bits;              /* 32 or 64 depending on sizeof(long) */
@@ -1019,9 +1291,13 @@ struct redisServer {
                                    client blocked on a module command needs
                                    to be processed. */
     pid_t module_child_pid;     /* PID of module child */
+    pid_t snapshot_child_pid;   /* PID of the DEBUG DIGEST ASYNC child */
+    pid_t census_child_pid;     /* PID of the MEMORY CENSUS child */
     /* Networking */
     int port;                   /* TCP listening port */
     int tls_port;               /* TLS listening port */
+    int admin_port;             /* Admin TCP listening port, where the inline
+                                   protocol is always accepted. */
     int tcp_backlog;            /* TCP listen() backlog */
     char *bindaddr[CONFIG_BINDADDR_MAX]; /* Addresses we should bind to */
     int bindaddr_count;         /* Number of addresses in server.bindaddr[] */
@@ -1029,8 +1305,14 @@ struct redisServer {
     mode_t unixsocketperm;      /* UNIX socket permission */
     int ipfd[CONFIG_BINDADDR_MAX]; /* TCP socket file descriptors */
     int ipfd_count;             /* Used slots in ipfd[] */
+    int tcp_reuseport;          /* Accept clients on SO_REUSEPORT sharded
+                                   listeners owned by accept threads? */
+    int reuseport_fd[CONFIG_BINDADDR_MAX]; /* SO_REUSEPORT listener fds */
+    int reuseport_fd_count;     /* Used slots in reuseport_fd[] */
     int tlsfd[CONFIG_BINDADDR_MAX]; /* TLS socket file descriptors */
     int tlsfd_count;            /* Used slots in tlsfd[] */
+    int adminfd[CONFIG_BINDADDR_MAX]; /* Admin port socket file descriptors */
+    int adminfd_count;          /* Used slots in adminfd[] */
     int sofd;                   /* Unix socket file descriptor */
     int cfd[CONFIG_BINDADDR_MAX];/* Cluster bus listening socket */
     int cfd_count;              /* Used slots in cfd[] */
@@ -1042,6 +1324,10 @@ struct redisServer {
     client *current_client;     /* Current client executing the command. */
     long fixed_time_expire;     /* If > 0, expire keys against server.mstime. */
     rax *clients_index;         /* Active clients dictionary by client ID. */
+    rax *clients_timeout_table; /* Idle and blocking client deadlines sorted
+                                   by time, see blocked.c. */
+    dict *clients_by_addr;      /* Peer address -> list of clients. */
+    dict *clients_by_name;      /* Client name -> list of clients. */
     int clients_paused;         /* True if clients are currently paused */
     mstime_t clients_pause_end_time; /* Time when we undo clients_paused */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
@@ -1050,8 +1336,25 @@ struct redisServer {
     int protected_mode;         /* Don't accept external connections. */
     int gopher_enabled;         /* If true the server will reply to gopher
                                    queries. Will still serve RESP2 queries. */
+    int inline_commands;        /* Accept inline commands on the client ports?
+                                   The admin port always accepts them. */
+    int resp_protocol_lock;     /* Lock connections to the multibulk protocol
+                                   after their first RESP command? */
     int io_threads_num;         /* Number of IO threads to use. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_threads_do_execute;  /* Execute fast read-only commands directly
+                                   from IO threads? Implies do_reads. */
+    int io_threads_do_lookups;  /* Fan large multi-key read lookups out
+                                   across the IO threads? */
+    int fast_path_commands;     /* Execute GET/SET/EXISTS/INCR through the
+                                   specialized fast path in fastpath.c? */
+    char *server_cpulist;       /* CPU affinity list of the main and the IO
+                                   threads. */
+    char *bio_cpulist;          /* CPU affinity list of the bio threads. */
+    char *aof_rewrite_cpulist;  /* CPU affinity list of the AOF rewrite
+                                   child process. */
+    char *bgsave_cpulist;       /* CPU affinity list of the RDB saving
+                                   child process. */
 
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
@@ -1064,18 +1367,34 @@ struct redisServer {
                         *lpopCommand, *rpopCommand, *zpopminCommand,
                         *zpopmaxCommand, *sremCommand, *execCommand,
                         *expireCommand, *pexpireCommand, *xclaimCommand,
-                        *xgroupCommand;
+                        *xgroupCommand, *hdelCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
+    long long stat_io_commands_processed; /* Commands executed by IO threads */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expired_values_freed; /* Expired values reclaimed before
+                                            the master DEL (replicas only). */
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_proactive_evictedkeys; /* Keys evicted below the limit by
+                                       the watermark cron. */
+    long long stat_propagate_coalesced; /* Propagated writes merged away by
+                                       effect coalescing. */
+    long long stat_shared_object_cache_hits; /* Values deduplicated by the
+                                                shared object cache. */
+    long long stat_shared_object_cache_saved; /* Estimated bytes saved by
+                                                 the shared object cache. */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
+    long long stat_reply_cache_hits; /* GETs served from the reply cache. */
+    long long stat_reply_cache_cmd_hits;   /* Reads served from the command
+                                              result cache. */
+    long long stat_reply_cache_cmd_misses; /* Cacheable reads not found
+                                              there. */
     long long stat_active_defrag_hits;      /* number of allocations moved */
     long long stat_active_defrag_misses;    /* number of allocations scanned but not moved */
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
@@ -1098,6 +1417,8 @@ struct redisServer {
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
     size_t stat_module_cow_bytes;   /* Copy on write bytes during module fork. */
+    size_t stat_current_cow_bytes;  /* Copy on write bytes while a child is
+                                       active, last sample reported by it. */
     /* The following two are used to track instantaneous metrics, like
      * number of operations per second, network traffic. */
     struct {
@@ -1119,13 +1440,27 @@ struct redisServer {
     int active_defrag_threshold_upper; /* maximum percentage of fragmentation at which we use maximum effort */
     int active_defrag_cycle_min;       /* minimal effort for defrag in CPU percentage */
     int active_defrag_cycle_max;       /* maximal effort for defrag in CPU percentage */
+    int active_defrag_forecast;        /* start defrag early when the fragmentation trend predicts crossing the lower threshold */
+    int active_defrag_forecast_traffic_pct; /* max ops/sec, as a percentage of the observed peak, to call the instance quiet */
     unsigned long active_defrag_max_scan_fields; /* maximum number of fields of set/hash/zset/list to process from within the main dict scan */
     _Atomic size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
+    int db_dict_shards;             /* Number of hash tables every DB keyspace
+                                       is split into (power of two). */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
     int supervised_mode;            /* See SUPERVISED_* */
     int daemonize;                  /* True if running as a daemon */
     clientBufferLimitsConfig client_obuf_limits[CLIENT_TYPE_OBUF_COUNT];
+    int obuf_backpressure;          /* Suspend reading from normal and pubsub
+                                       clients crossing the output buffer soft
+                                       limit instead of closing them at the
+                                       hard limit. */
+    char *pubsub_conflation_channels; /* Glob pattern of channels whose
+                                         messages are conflated (only the
+                                         latest is kept) for clients under
+                                         backpressure. */
+    unsigned int obuf_backpressure_clients; /* # of clients with suspended
+                                               reads because of backpressure.*/
     /* AOF persistence */
     int aof_enabled;                /* AOF configuration */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
@@ -1156,6 +1491,9 @@ struct redisServer {
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
+    int aof_async_write;            /* Write + fsync the AOF from a bio thread. */
+    int aof_rewrite_no_fork;        /* Rewrite the AOF incrementally in the
+                                       main process instead of forking. */
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
     int aof_pipe_read_data_from_parent;
@@ -1174,6 +1512,11 @@ struct redisServer {
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compress_codec;         /* Codec used to compress RDB strings. */
+    int rdb_save_threads;           /* Threads serializing keyspace shards
+                                       while saving an RDB file. */
+    int rdb_load_threads;           /* Threads decompressing string payloads
+                                       while loading an RDB file. */
     int rdb_checksum;               /* Use RDB checksum? */
     time_t lastsave;                /* Unix time of last successful save */
     time_t lastbgsave_try;          /* Unix time of last attempted bgsave */
@@ -1187,22 +1530,63 @@ struct redisServer {
     int rdb_pipe_read;              /* data to the parent process in diskless repl. */
     connection **rdb_pipe_conns;    /* Connections which are currently the */
     int rdb_pipe_numconns;          /* target of diskless rdb fork child. */
-    int rdb_pipe_numconns_writing;  /* Number of rdb conns with pending writes. */
-    char *rdb_pipe_buff;            /* In diskless replication, this buffer holds data */
-    int rdb_pipe_bufflen;           /* that was read from the the rdb pipe. */
+    rdbPipeChunk *rdb_pipe_head;    /* Chunks of the RDB stream read from the
+                                       child pipe, drained by each replica
+                                       at its own pace. */
+    rdbPipeChunk *rdb_pipe_tail;    /* Tail of the chunk list. */
+    size_t rdb_pipe_mem;            /* Total payload bytes buffered in chunks. */
+    int rdb_pipe_eof;               /* True once the child closed the pipe. */
+    size_t repl_diskless_sync_buffer; /* Max memory buffered in chunks before
+                                         we stop reading from the child. */
     int rdb_key_save_delay;         /* Delay in microseconds between keys while
                                      * writing the RDB. (for testings) */
+    int rdb_mmap_format;            /* Write RDB files with fixed-width value
+                                     * headers so they can be memory mapped
+                                     * and loaded lazily at startup. */
+    int startup_warmup;             /* Pre-size the hash tables and pre-fault
+                                     * the buffer pools at startup. */
+    char *cold_tier_file;           /* Log file for values demoted to the cold
+                                     * tier, or NULL to disable tiering. */
+    int rdb_incremental;            /* Track changed keys so that SAVE DELTA
+                                     * can emit delta RDB files. */
+    dict **rdb_delta_keys;          /* One set of key names per DB: the keys
+                                     * changed since the last delta (or base)
+                                     * snapshot was taken. */
+    char rdb_base_id[CONFIG_RUN_ID_SIZE+1]; /* ID of the base snapshot the
+                                     * delta chain refers to. */
+    int rdb_base_valid;             /* True if a base snapshot exists on disk
+                                     * and delta files can chain to it. */
+    int rdb_delta_seq;              /* Sequence number of the last delta RDB
+                                     * file saved (or applied at startup). */
     int key_load_delay;             /* Delay in microseconds between keys while
                                      * loading aof or rdb. (for testings) */
     /* Pipe and data structures for child -> parent info sharing. */
     int child_info_pipe[2];         /* Pipe used to write the child_info_data. */
     struct {
         int process_type;           /* AOF or RDB child? */
+        int final;                  /* Last update of the child, sent when the
+                                       work is done, or periodic sample? */
         size_t cow_size;            /* Copy on write size. */
         unsigned long long magic;   /* Magic value to make sure data is valid. */
     } child_info_data;
+    /* Parent side dirty page ledger: what the parent wrote, by subsystem,
+     * while the last child was alive. See the soft dirty page tracking
+     * in childinfo.c. */
+    struct {
+        int state;                /* COW_LEDGER_* */
+        size_t dict_bytes;        /* Dirty keyspace bucket array pages. */
+        size_t backlog_bytes;     /* Dirty replication backlog pages. */
+        size_t clientbufs_bytes;  /* Dirty client struct / buffer pages. */
+        int sampled_keys;         /* Keys behind the percentages below. */
+        double entries_dirty_pct; /* Sampled dict entries on dirty pages. */
+        double keys_dirty_pct;    /* Sampled key sds strings, ditto. */
+        double values_dirty_pct;  /* Sampled value objects, ditto. */
+    } cow_ledger;
     /* Propagation of commands in AOF / replication */
     redisOpArray also_propagate;    /* Additional command to propagate. */
+    /* Command audit ring, see audit.c. */
+    char *audit_log;                /* Audit log file path, or NULL. */
+    size_t audit_buffer_limit;      /* Max memory of the audit ring. */
     /* Logging */
     char *logfile;                  /* Path of log file */
     int syslog_enabled;             /* Is syslog enabled? */
@@ -1215,15 +1599,23 @@ struct redisServer {
     long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
+    list *repl_buffer_blocks;       /* Replication stream as a list of
+                                       replBufBlock, shared by the backlog
+                                       and every attached replica. */
+    size_t repl_buffer_mem;         /* Total memory of the buffer blocks. */
+    size_t repl_stream_staged;      /* Master stream bytes staged into the
+                                       buffer blocks but not applied yet. */
+    listNode *repl_stream_staged_node; /* First block holding staged bytes. */
+    replBacklog *repl_backlog;      /* Replication backlog for partial syncs */
+    long long repl_backlog_size;    /* Max history the backlog retains */
     long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset,
-                                       that is the next byte will'll write to.*/
     long long repl_backlog_off;     /* Replication "master offset" of first
                                        byte in the replication backlog buffer.*/
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
+    char *repl_backlog_file;        /* Persist the backlog window here on
+                                       clean shutdown, restore at startup.
+                                       NULL disables persistence. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
                                        Only valid if server.slaves len is 0. */
     int repl_min_slaves_to_write;   /* Min number of slaves to write. */
@@ -1233,6 +1625,10 @@ struct redisServer {
     int repl_diskless_load;         /* Slave parse RDB directly from the socket.
                                      * see REPL_DISKLESS_LOAD_* enum */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_stream_compression;    /* Codec the replica asks the master to
+                                       compress the stream with, or -1. */
+    struct compressCodec *repl_stream_codec; /* Codec accepted by the master
+                                       during the current handshake. */
     /* Replication (slave) */
     char *masteruser;               /* AUTH with this user and masterauth with master */
     char *masterauth;               /* AUTH with this password with master */
@@ -1264,39 +1660,91 @@ struct redisServer {
     char master_replid[CONFIG_RUN_ID_SIZE+1];  /* Master PSYNC runid. */
     long long master_initial_offset;           /* Master PSYNC offset. */
     int repl_slave_lazy_flush;          /* Lazy FLUSHALL before loading DB? */
+    int replica_free_expired_values;    /* Reclaim the values of logically
+                                           expired keys before the master
+                                           DEL arrives? */
     /* Replication script cache. */
     dict *repl_scriptcache_dict;        /* SHA1 all slaves are aware of. */
     list *repl_scriptcache_fifo;        /* First in, first out LRU eviction. */
     unsigned int repl_scriptcache_size; /* Max number of elements. */
     /* Synchronous replication. */
-    list *clients_waiting_acks;         /* Clients waiting in WAIT command. */
+    rax *clients_waiting_acks;          /* Clients waiting in WAIT command,
+                                           indexed by the target replication
+                                           offset (big endian): each key holds
+                                           the list of clients waiting for
+                                           that offset to be acknowledged. */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int lru_clock_resolution;       /* LRU clock tick duration in ms. At the
+                                       default 1000ms keys touched within the
+                                       same second look equally idle to the
+                                       eviction pool: short-TTL cache tiers
+                                       can lower it to get sub-second
+                                       last-access ordering, trading clock
+                                       wrap time (24 bits of clock). */
+    int maxmemory_eviction_time_limit; /* Max milliseconds spent evicting
+                                       per event loop iteration. 0 =
+                                       unbounded. Work left over is
+                                       carried to the next iteration. */
+    int lru_ghost_second_chance;    /* Give evicted-then-recreated keys a
+                                       second chance under LRU policies. */
+    int maxmemory_eviction_watermark; /* Percentage of maxmemory at which
+                                       the cron starts evicting gently,
+                                       ahead of the hard limit. 0 = off. */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
+    size_t reply_stream_bytes;      /* Flush replies to the socket mid
+                                       command once this many bytes are
+                                       pending. 0 = only flush from the
+                                       event loop as usual. */
+    int shared_object_cache_size;   /* Slots of the interning cache for
+                                       repeated small values (0: disabled). */
+    int reply_cache_size;           /* Max cached serialized GET replies
+                                       (0: disabled). */
+    size_t reply_cache_cmd_bytes;   /* Memory bound of the command result
+                                       cache (0: disabled). */
+    int scan_sessions_max;          /* Max concurrent stateful scan
+                                       sessions (0: disabled). */
     /* Blocked clients */
     unsigned int blocked_clients;   /* # of clients executing a blocking cmd.*/
     unsigned int blocked_clients_by_type[BLOCKED_NUM];
     list *unblocked_clients; /* list of clients to unblock before next loop */
+    list *deferred_exec_clients; /* Batch priority clients with a parked
+                                    heavy command to execute. */
     list *ready_keys;        /* List of readyList structures for BLPOP & co */
     /* Client side caching. */
     unsigned int tracking_clients;  /* # of clients with tracking enabled.*/
     int tracking_table_max_fill;    /* Max fill percentage. */
+    long long tracking_fp_entries;  /* Bounded mode: size of the fingerprint
+                                       table, or 0 to use exact rax entries. */
     /* Sort parameters - qsort_r() is only available under BSD so we
      * have to take this state global, in order to pass it to sortCompare() */
     int sort_desc;
     int sort_alpha;
     int sort_bypattern;
     int sort_store;
+    int sort_threads;               /* Threads sorting big SORT vectors. */
     /* Zip structure config, see redis.conf for more information  */
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
     size_t set_max_intset_entries;
+    int set_dense_sampling;         /* Attach a dense element array to sets
+                                       served by SRANDMEMBER/SPOP <count>. */
+    int key_inline_max_size;        /* Store keys up to this length inline
+                                       in the keyspace dict entries. */
+    long long command_time_limit; /* Execution deadline for long iterating
+                                     commands in milliseconds, 0 = none. */
+    mstime_t command_deadline;  /* Deadline of the command currently
+                                   executing, zero when none is armed. */
+    size_t resumable_read_threshold; /* Serve flagged read commands against
+                                        values with at least this many
+                                        elements in background slices.
+                                        Zero disables the feature. */
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
     size_t hll_sparse_max_bytes;
@@ -1305,6 +1753,9 @@ struct redisServer {
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_compress_codec;    /* Codec used to compress quicklist nodes. */
+    int list_compress_async;    /* Compress quicklist nodes in a bio thread. */
+    int encoding_convert_async; /* Convert hash/set encodings in a bio thread. */
     /* time cache */
     _Atomic time_t unixtime;    /* Unix time sampled every cron cycle. */
     time_t timezone;            /* Cached timezone. As set by tzset(). */
@@ -1313,12 +1764,22 @@ struct redisServer {
     ustime_t ustime;            /* 'unixtime' in microseconds. */
     /* Pubsub */
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
-    list *pubsub_patterns;  /* A list of pubsub_patterns */
+    dict *pubsub_patterns;  /* Map unique patterns to pubsubPattern entries */
+    rax *pubsub_patterns_index; /* Literal pattern prefix -> bucket (list)
+                                   of pubsubPattern entries. */
+    list *pubsub_patterns_nopfx; /* Entries whose pattern starts with a glob
+                                   special character (no usable prefix). */
+    size_t pubsub_patterns_maxprefix; /* Longest indexed prefix length
+                                   (high watermark). */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
+    int notify_keyspace_batch;  /* Deliver keyspace notifications to pattern
+                                   subscribers once per event loop tick. */
     /* Cluster */
     int cluster_enabled;      /* Is cluster enabled? */
     mstime_t cluster_node_timeout; /* Cluster node timeout. */
+    int cluster_forward_asking; /* Proxy commands for migrating slots to the
+                                   import target instead of replying -ASK. */
     char *cluster_configfile; /* Cluster auto-generated config file name. */
     struct clusterState *cluster;  /* State of the cluster */
     int cluster_migration_barrier; /* Cluster replicas migration barrier. */
@@ -1348,6 +1809,8 @@ struct redisServer {
     int lua_random_dirty; /* True if a random command was called during the
                              execution of the current script. */
     int lua_replicate_commands; /* True if we are doing single commands repl. */
+    int propagate_coalescing;   /* Merge repeated same-key writes in the
+                                   propagated MULTI/EXEC effect streams. */
     int lua_multi_emitted;/* True if we already proagated MULTI. */
     int lua_repl;         /* Script replication flags for redis.set_repl(). */
     int lua_timedout;     /* True if we reached the time limit for script
@@ -1358,11 +1821,20 @@ struct redisServer {
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
+    int lazyfree_lazy_user_flush;
+    int lazyfree_threads;   /* Number of BIO_LAZY_FREE worker threads. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
+    /* Hot key tracking */
+    int hotkeys_sample_rate;    /* Sample 1 of N lookups. 0 = disabled. */
+    int hotkeys_report_period;  /* Seconds between "hotkey" notifications
+                                   and counter decay. 0 = never. */
     /* ACLs */
     char *acl_filename;     /* ACL Users file. NULL if not configured. */
+    unsigned long long acl_generation; /* Incremented on every change to the
+                               ACL rules: lets cached permission checks be
+                               revalidated only when needed. */
     /* Assert & bug reporting */
     const char *assert_failed;
     const char *assert_file;
@@ -1378,9 +1850,18 @@ struct redisServer {
     redisTLSContextConfig tls_ctx_config;
 };
 
+/* Pattern subscription: identical patterns subscribed by multiple clients
+ * are deduplicated into a single entry holding the subscribers list. The
+ * entries are indexed by their literal prefix (the bytes before the first
+ * glob special character) so that publishing does not need to scan every
+ * pattern: see pubsubPublishPatterns(). */
 typedef struct pubsubPattern {
-    client *client;
-    robj *pattern;
+    robj *pattern;      /* The pattern object, shared by the subscribers. */
+    list *clients;      /* The clients subscribed to this pattern. */
+    size_t prefix_len;  /* Length of the literal prefix of the pattern. */
+    struct listNode *index_node; /* Our node inside the prefix index bucket,
+                           or inside pubsub_patterns_nopfx when prefix_len
+                           is zero. */
 } pubsubPattern;
 
 typedef void redisCommandProc(client *c);
@@ -1404,6 +1885,10 @@ struct redisCommand {
                    ACLs. A connection is able to execute a given command if
                    the user associated to the connection has this command
                    bit set in the bitmap of allowed commands. */
+    uint64_t *latency_histogram; /* Log-linear histogram of the execution
+                   times of this command, in microseconds. Allocated when
+                   the command is registered, reset by CONFIG RESETSTAT
+                   and exposed by LATENCY HISTOGRAM. See latency.c. */
 };
 
 struct redisFunctionSym {
@@ -1482,7 +1967,10 @@ extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
+extern dictType rdbDeltaKeysDictType;
 extern dictType keyptrDictType;
+extern dictType hashExpiresDictType;
+extern dictType clientIndexDictType;
 extern dictType modulesDictType;
 
 /*-----------------------------------------------------------------------------
@@ -1504,8 +1992,13 @@ void moduleBlockedClientPipeReadable(aeEventLoop *el, int fd, void *privdata, in
 size_t moduleCount(void);
 void moduleAcquireGIL(void);
 void moduleReleaseGIL(void);
+void moduleAcquireSlotGIL(int slot);
+void moduleReleaseSlotGIL(int slot);
 void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
+int moduleKeyMissInterceptCommand(client *c);
 void moduleCallCommandFilters(client *c);
+int moduleDefragValue(robj *key, robj *obj, long *defragged);
+int moduleLateDefrag(robj *key, robj *obj, unsigned long *cursor, long long endtime, long long *defragged);
 void ModuleForkDoneHandler(int exitcode, int bysignal);
 int TerminateModuleForkChild(int child_pid, int wait);
 ssize_t rdbSaveModulesAux(rio *rdb, int when);
@@ -1526,6 +2019,7 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
 void redisSetProcTitle(char *title);
+void redisSetCpuAffinity(const char *cpulist);
 
 /* networking.c -- Networking and Client related operations */
 client *createClient(connection *conn);
@@ -1535,6 +2029,9 @@ void freeClientAsync(client *c);
 void resetClient(client *c);
 void sendReplyToClient(connection *conn);
 void *addReplyDeferredLen(client *c);
+void replyCheckpointSet(client *c, replyCheckpoint *cp);
+int replyCheckpointRewind(client *c, replyCheckpoint *cp);
+void replyStreamFlushIfNeeded(client *c);
 void setDeferredArrayLen(client *c, void *node, long length);
 void setDeferredMapLen(client *c, void *node, long length);
 void setDeferredSetLen(client *c, void *node, long length);
@@ -1542,10 +2039,13 @@ void setDeferredAttributeLen(client *c, void *node, long length);
 void setDeferredPushLen(client *c, void *node, long length);
 void processInputBuffer(client *c);
 void processInputBufferAndReplicate(client *c);
+int processCommandAndResetClient(client *c);
+void processDeferredExecClients(void);
 void processGopherRequest(client *c);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTLSHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void acceptAdminHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(connection *conn);
 void addReplyNull(client *c);
@@ -1557,6 +2057,7 @@ void AddReplyFromClient(client *c, client *src);
 void addReplyBulk(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
+void addReplyBulkRange(client *c, robj *obj, size_t start, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
 void addReply(client *c, robj *obj);
 void addReplySds(client *c, sds s);
@@ -1565,6 +2066,7 @@ void addReplyError(client *c, const char *err);
 void addReplyStatus(client *c, const char *status);
 void addReplyDouble(client *c, double d);
 void addReplyHumanLongDouble(client *c, long double d);
+void createCachedReplyHeaders(void);
 void addReplyLongLong(client *c, long long ll);
 void addReplyArrayLen(client *c, long length);
 void addReplyMapLen(client *c, long length);
@@ -1574,13 +2076,10 @@ void addReplyPushLen(client *c, long length);
 void addReplyHelp(client *c, const char **help);
 void addReplySubcommandSyntaxError(client *c);
 void addReplyLoadedModules(client *c);
-void copyClientOutputBuffer(client *dst, client *src);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
 void *dupClientReplyValue(void *o);
-void getClientsMaxBuffers(unsigned long *longest_output_list,
-                          unsigned long *biggest_input_buffer);
 char *getClientPeerId(client *client);
 sds catClientInfoString(sds s, client *client);
 sds getAllClientsInfoString(int type);
@@ -1596,20 +2095,30 @@ char *getClientTypeName(int class);
 void flushSlavesOutputBuffers(void);
 void disconnectSlaves(void);
 int listenToPort(int port, int *fds, int *count);
+int listenToPortReusePort(int port, int *fds, int *count);
 void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
 int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
+int tryExecuteCommandFromIOThread(client *c);
+int ioThreadsLookupKeys(client *c, robj **keys, int count, robj **vals);
+/* Non zero in the context of an I/O thread executing a read-only command:
+ * the keyspace lookup functions check it to take a path that never mutates
+ * shared state. */
+extern _Thread_local int io_threads_executing_command;
 int stopThreadedIOIfNeeded(void);
 int clientHasPendingReplies(client *c);
+void clientInstallWriteHandler(client *c);
 void unlinkClient(client *c);
 int writeToClient(client *c, int handler_installed);
 void linkClient(client *c);
 void protectClient(client *c);
 void unprotectClient(client *c);
 void initThreadedIO(void);
+int resizeIOThreads(int newnum);
+void initAcceptThreads(void);
 client *lookupClientByID(uint64_t id);
 
 #ifdef __GNUC__
@@ -1628,6 +2137,7 @@ void disableTracking(client *c);
 void trackingRememberKeys(client *c);
 void trackingInvalidateKey(robj *keyobj);
 void trackingInvalidateKeysOnFlush(int dbid);
+void trackingFlushPendingMessages(void);
 void trackingLimitUsedSlots(void);
 unsigned long long trackingGetUsedSlots(void);
 
@@ -1635,6 +2145,7 @@ unsigned long long trackingGetUsedSlots(void);
 void listTypeTryConversion(robj *subject, robj *value);
 void listTypePush(robj *subject, robj *value, int where);
 robj *listTypePop(robj *subject, int where);
+int listTypePopBatch(robj *subject, int where, robj **values, int count);
 unsigned long listTypeLength(const robj *subject);
 listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char direction);
 void listTypeReleaseIterator(listTypeIterator *li);
@@ -1659,6 +2170,11 @@ void flagTransaction(client *c);
 void execCommandPropagateMulti(client *c);
 
 /* Redis object implementation */
+void objConvertSetAsync(int enable);
+int objConvertSchedule(robj *o);
+void objConvertCancel(robj *o);
+void objConvertFromBioThread(void *jobref);
+void objConvertHandleCompleted(void);
 void decrRefCount(robj *o);
 void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
@@ -1670,6 +2186,7 @@ void freeSetObject(robj *o);
 void freeZsetObject(robj *o);
 void freeHashObject(robj *o);
 robj *createObject(int type, void *ptr);
+void initObjectLRUOrLFU(robj *o);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
@@ -1677,8 +2194,11 @@ robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
+void sharedObjectCacheResize(long long size);
+size_t sharedObjectCacheEntries(void);
 robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
+size_t objectComputeSize(robj *o, size_t sample_size);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongLongForValue(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
@@ -1688,7 +2208,7 @@ robj *createSetObject(void);
 robj *createIntsetObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1715,12 +2235,13 @@ ssize_t syncReadLine(int fd, char *ptr, ssize_t size, long long timeout);
 /* Replication */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc);
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen);
-void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc);
 void updateSlavesWaitingBgsave(int bgsaveerr, int type);
 void replicationCron(void);
 void replicationHandleMasterDisconnection(void);
 void replicationCacheMaster(client *c);
 void resizeReplicationBacklog(long long newsize);
+void replicationPersistBacklog(void);
+void replicationLoadBacklog(rdbSaveInfo *rsi);
 void replicationSetMaster(char *ip, int port);
 void replicationUnsetMaster(void);
 void refreshGoodSlavesCount(void);
@@ -1740,7 +2261,12 @@ void changeReplicationId(void);
 void clearReplicationId2(void);
 void chopReplicationBacklog(void);
 void replicationCacheMasterUsingMyself(void);
-void feedReplicationBacklog(void *ptr, size_t len);
+void feedReplicationBuffer(char *buf, size_t len);
+void replicaReleaseReplicationBuffer(client *c);
+void stageReplicationStream(char *buf, size_t len);
+void applyStagedReplicationStream(size_t applied);
+void discardStagedReplicationStream(void);
+void freeReplicationBufferHead(void);
 void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 void rdbPipeWriteHandlerConnRemoved(struct connection *conn);
 
@@ -1764,6 +2290,7 @@ void killRDBChild(void);
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
 int loadAppendOnlyFile(char *filename);
@@ -1775,13 +2302,29 @@ unsigned long aofRewriteBufferSize(void);
 ssize_t aofReadDiffFromParent(void);
 void killAppendOnlyChild(void);
 void restartAOFAfterSYNC();
+void aofWriteFromBioThread(int fd, sds buf, int dofsync);
+int aofCollectBackgroundWriteError(void);
+void aofDrainBackgroundWrites(void);
+int aofNoForkRewriteInProgress(void);
+int aofNoForkRewriteStart(void);
+void aofNoForkRewriteCycle(void);
+void aofNoForkRewriteBeforeCommand(client *c);
+void aofNoForkRewriteAbort(void);
 
 /* Child info */
 void openChildInfoPipe(void);
 void closeChildInfoPipe(void);
 void sendChildInfo(int process_type);
+void sendChildCOWInfoIfNeeded(int process_type);
 void receiveChildInfo(void);
 
+/* Parent side dirty page ledger (childinfo.c) */
+#define COW_LEDGER_NONE 0        /* No fork measured yet. */
+#define COW_LEDGER_OK 1          /* Fields hold the last fork's ledger. */
+#define COW_LEDGER_UNSUPPORTED 2 /* Kernel lacks soft dirty tracking. */
+void cowLedgerForkStarted(void);
+void cowLedgerChildDone(void);
+
 /* Fork helpers */
 int redisFork();
 int hasActiveChildProcess();
@@ -1800,6 +2343,7 @@ int ACLAuthenticateUser(client *c, robj *username, robj *password);
 unsigned long ACLGetCommandID(const char *cmdname);
 user *ACLGetUserByName(const char *name, size_t namelen);
 int ACLCheckCommandPerm(client *c);
+void ACLCompileUserPatterns(user *u);
 int ACLSetUser(user *u, const char *op, ssize_t oplen);
 sds ACLDefaultUserFirstPassword(void);
 uint64_t ACLGetCommandCategoryFlagByName(const char *name);
@@ -1817,6 +2361,8 @@ void addReplyCommandCategories(client *c, struct redisCommand *cmd);
 #define ZADD_INCR (1<<0)    /* Increment the score instead of setting it. */
 #define ZADD_NX (1<<1)      /* Don't touch elements not already existing. */
 #define ZADD_XX (1<<2)      /* Only touch elements already existing. */
+#define ZADD_GT (1<<7)      /* Only update existing when new scores are higher. */
+#define ZADD_LT (1<<8)      /* Only update existing when new scores are lower. */
 
 /* Output flags. */
 #define ZADD_NOP (1<<3)     /* Operation not performed because of conditionals.*/
@@ -1841,6 +2387,7 @@ typedef struct {
 
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
+size_t zslAllocatedBytes(zskiplist *zsl);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
 int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
@@ -1853,14 +2400,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1879,13 +2426,21 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
 size_t freeMemoryGetNotCountedMemory();
 int freeMemoryIfNeeded(void);
 int freeMemoryIfNeededAndSafe(void);
+void evictionProcessPendingWork(void);
+void evictionProactiveCron(void);
 int processCommand(client *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
 struct redisCommand *lookupCommandByCString(char *s);
 struct redisCommand *lookupCommandOrOriginal(sds name);
+int commandMayBlockClient(struct redisCommand *cmd);
+void rebuildCommandLookupFastTable(void);
 void call(client *c, int flags);
+int commandDeadlineReached(void);
+int handleFastPathCommand(client *c);
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int flags);
+void propagateCoalesceStart(void);
+void propagateCoalesceEnd(void);
 void alsoPropagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int target);
 void redisOpArrayInit(redisOpArray *oa);
 void redisOpArrayFree(redisOpArray *oa);
@@ -1905,13 +2460,23 @@ void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
+void backgroundRehashInit(void);
+void backgroundRehashKick(void);
+void backgroundRehashPause(void);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
 void adjustOpenFilesLimit(void);
+int applyTcpBacklog(void);
 void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime(int update_daylight_info);
 void resetServerStats(void);
+long long getInstantaneousMetric(int metric);
 void activeDefragCycle(void);
+int defragForecast(float *slope, float *predicted);
+#ifdef HAVE_DEFRAG
+void *activeDefragAlloc(void *ptr);
+robj *activeDefragStringOb(robj *ob, long *defragged);
+#endif
 unsigned int getLRUClock(void);
 unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
@@ -1935,6 +2500,7 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele);
 sds setTypeNextObject(setTypeIterator *si);
 int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele);
 unsigned long setTypeRandomElements(robj *set, unsigned long count, robj *aux_set);
+void setSamplerRelease(dict *d);
 unsigned long setTypeSize(const robj *subject);
 void setTypeConvert(robj *subject, int enc);
 
@@ -1945,36 +2511,82 @@ void setTypeConvert(robj *subject, int enc);
 
 void hashTypeConvert(robj *o, int enc);
 void hashTypeTryConversion(robj *subject, robj **argv, int start, int end);
+void hashTypeIndexInvalidate(robj *o);
 int hashTypeExists(robj *o, sds key);
 int hashTypeDelete(robj *o, sds key);
 unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
 sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
 robj *hashTypeGetValueObject(robj *o, sds field);
+void hashTypeGetMulti(robj *o, sds *fields, robj **vals, int count);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
+int hashTypeExpireFields(redisDb *db, robj *keyobj, mstime_t now);
+int hgetallAsyncJobsPending(void);
+void hgetallAsyncCron(long long budget_usec);
+void hgetallAsyncUnblockClient(client *c);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
 int pubsubUnsubscribeAllPatterns(client *c, int notify);
-void freePubsubPattern(void *p);
-int listMatchPubsubPattern(void *a, void *b);
 int pubsubPublishMessage(robj *channel, robj *message);
+int pubsubPublishMessagePair(robj *chan1, robj *msg1, robj *chan2, robj *msg2, int skip_patterns);
+int pubsubPublishPatternsBatch(robj **pairs, size_t count);
 void addReplyPubsubMessage(client *c, robj *channel, robj *msg);
+void pubsubFlushConflatedMessages(client *c);
+void pubsubFreeConflatedMessages(client *c);
 
 /* Keyspace events notification */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid);
+void notifyKeyspaceEventFlushBatch(void);
 int keyspaceEventsStringToFlags(char *classes);
 sds keyspaceEventsFlagsToString(int flags);
 
+/* Hot key tracking */
+void hotkeysSampleIfNeeded(redisDb *db, sds key);
+void hotkeysCron(void);
+void hotkeysReset(void);
+sds hotkeysCatInfoString(sds info);
+
+/* Event loop CPU accounting */
+sds loopstatsCatInfoString(sds info);
+void loopstatsReplyHistory(client *c);
+
+/* Cron task scheduler */
+void cronTaskRegister(const char *name, void (*proc)(long long),
+                      long long period_ms, long long budget_usec);
+void cronTasksRun(void);
+sds cronTasksCatInfoString(sds info);
+
+/* Serialized reply cache */
+void replyCacheInit(void);
+int replyCacheAddReply(client *c, redisDb *db, sds key, robj *o);
+void replyCacheInvalidate(redisDb *db, robj *key);
+void replyCacheFlush(int dbid);
+unsigned long replyCacheNumEntries(void);
+int replyCacheServeCommand(client *c);
+void replyCacheCaptureResult(client *c);
+unsigned long replyCacheCmdNumEntries(void);
+size_t replyCacheCmdBytes(void);
+
+/* scansession.c -- stateful scan sessions */
+void scanSessionGenericCommand(client *c, robj *o, dict *ht,
+                               unsigned long cursor, long count);
+void scanSessionInvalidateKey(redisDb *db, robj *key);
+void scanSessionInvalidateDb(int dbid);
+void scanSessionInvalidateObj(robj *o);
+void scanSessionFreeClient(client *c);
+void scanSessionCron(void);
+unsigned long scanSessionCount(void);
+
 /* Configuration */
 void loadServerConfig(char *filename, char *options);
 void appendServerSaveParams(time_t seconds, int changes);
@@ -1986,15 +2598,33 @@ void initConfigValues();
 
 /* db.c -- Keyspace access API */
 int removeExpire(redisDb *db, robj *key);
+int dbDeleteExpire(redisDb *db, sds key);
+long long dbPendingExpires(redisDb *db, long long now);
+void dbUpdateMinExpire(redisDb *db);
+unsigned char *hashExpiresLookup(redisDb *db, sds key);
+void hashExpiresSetField(redisDb *db, sds key, sds field, long long when);
+int hashExpiresRemoveField(redisDb *db, sds key, sds field);
+long long hashExpiresGetField(redisDb *db, sds key, sds field);
+void hashExpiresDelete(redisDb *db, sds key);
+void hashExpiresMove(redisDb *src, sds srckey, redisDb *dst, sds dstkey);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
+void updateLFU(robj *val);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
+dict *dbGetDict(redisDb *db, const void *key);
+dict *dbGetDictKeylen(redisDb *db, const char *key, size_t len);
+unsigned long dbSize(redisDb *db);
+dict *dbRandomShard(redisDb *db);
+unsigned long dbScan(redisDb *db, unsigned long cursor, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+dbIterator *dbGetSafeIterator(redisDb *db);
+dictEntry *dbIteratorNext(dbIterator *dbit);
+void dbReleaseIterator(dbIterator *dbit);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags);
 robj *objectCommandLookup(client *c, robj *key);
@@ -2004,6 +2634,7 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
 void dbAdd(redisDb *db, robj *key, robj *val);
+void dbAddBatch(redisDb *db, robj **keys, robj **vals, int count);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
 int dbExists(redisDb *db, robj *key);
@@ -2033,7 +2664,6 @@ void slotToKeyDel(robj *key);
 void slotToKeyFlush(void);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
-void slotToKeyFlushAsync(void);
 size_t lazyfreeGetPendingObjectsCount(void);
 void freeObjAsync(robj *o);
 
@@ -2041,6 +2671,7 @@ void freeObjAsync(robj *o);
 int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 void getKeysFreeResult(int *result);
 int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys);
+int *sintercardGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
@@ -2055,8 +2686,35 @@ void clusterCron(void);
 void clusterPropagatePublish(robj *channel, robj *message);
 void migrateCloseTimedoutSockets(void);
 void clusterBeforeSleep(void);
+void clusterForwardUnblockClient(client *c);
 int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uint8_t type, unsigned char *payload, uint32_t len);
 
+/* Cold value tier (coldtier.c) */
+void coldTierInit(void);
+int coldTierEnabled(void);
+void coldTierCron(long long budget_usec);
+void coldTierBioWrite(void *arg);
+void coldTierBioRead(void *arg);
+robj *coldValueMaterialize(redisDb *db, robj *key, dictEntry *de);
+robj *coldValueLoad(robj *key, robj *o);
+int coldTierBlockClientIfNeeded(client *c);
+void coldTierUnblockClient(client *c);
+void coldTierHandleCompletions(void);
+void coldValueFree(robj *o);
+size_t coldValueMemUsage(robj *o);
+int coldValueRdbType(robj *o);
+sds coldValueGetPayload(robj *o);
+sds coldTierAppendInfo(sds info);
+
+/* Command audit ring (audit.c) */
+void auditInit(void);
+int auditEnabled(void);
+void auditFeedCommand(client *c, int dictid, robj **argv, int argc);
+void auditMonitorAttach(client *c);
+void auditMonitorRelease(client *c);
+void auditFlush(void);
+void auditWriteFromBioThread(int fd, sds buf);
+
 /* Sentinel */
 void initSentinelConfig(void);
 void initSentinel(void);
@@ -2068,29 +2726,40 @@ void sentinelIsRunning(void);
 int redis_check_rdb(char *rdbfilename, FILE *fp);
 int redis_check_rdb_main(int argc, char **argv, FILE *fp);
 int redis_check_aof_main(int argc, char **argv);
+int redis_microbench_main(int argc, char **argv);
 
 /* Scripting */
 void scriptingInit(int setup);
+void scriptingClearCommandCache(void);
 int ldbRemoveChild(pid_t pid);
 void ldbKillForkedSessions(void);
 int ldbPendingChildren(void);
 sds luaCreateFunction(client *c, lua_State *lua, robj *body);
+int scriptIsMemoizable(client *c);
+void scriptMemoFlush(void);
 
 /* Blocked clients */
 void processUnblockedClients(void);
 void blockClient(client *c, int btype);
 void unblockClient(client *c);
+void addClientToTimeoutTable(client *c, mstime_t deadline);
+void removeClientFromTimeoutTable(client *c);
+void handleClientsTimeout(void);
 void queueClientForReprocessing(client *c);
 void replyToBlockedClientTimedOut(client *c);
 int getTimeoutFromObjectOrReply(client *c, robj *object, mstime_t *timeout, int unit);
 void disconnectAllBlockedClients(void);
 void handleClientsBlockedOnKeys(void);
+void keysAsyncCron(void);
+void unlinkMatchCron(void);
+void keysAsyncUnblockClient(client *c);
 void signalKeyAsReady(redisDb *db, robj *key);
 void blockForKeys(client *c, int btype, robj **keys, int numkeys, mstime_t timeout, robj *target, streamID *ids);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
 void expireSlaveKeys(void);
+void replicaFreeExpiredValues(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
 size_t getSlaveKeyWithExpireCount(void);
@@ -2104,8 +2773,13 @@ unsigned long LFUDecrAndReturn(robj *o);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
+uint64_t dictSdsCaseHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+int dictSdsKeyCaseCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
+size_t dictSdsKeyInlineSize(const void *key);
+size_t dictSdsEleInlineSize(const void *key);
+void *dictSdsKeyInlineCopy(void *buf, const void *key);
 
 /* Git SHA1 */
 char *redisGitSHA1(void);
@@ -2125,12 +2799,14 @@ void psetexCommand(client *c);
 void getCommand(client *c);
 void delCommand(client *c);
 void unlinkCommand(client *c);
+void unlinkmatchCommand(client *c);
 void existsCommand(client *c);
 void setbitCommand(client *c);
 void getbitCommand(client *c);
 void bitfieldCommand(client *c);
 void setrangeCommand(client *c);
 void getrangeCommand(client *c);
+void strrangeCommand(client *c);
 void incrCommand(client *c);
 void decrCommand(client *c);
 void incrbyCommand(client *c);
@@ -2140,6 +2816,7 @@ void selectCommand(client *c);
 void swapdbCommand(client *c);
 void randomkeyCommand(client *c);
 void keysCommand(client *c);
+void keysasyncCommand(client *c);
 void scanCommand(client *c);
 void dbsizeCommand(client *c);
 void lastsaveCommand(client *c);
@@ -2162,8 +2839,10 @@ void lindexCommand(client *c);
 void lrangeCommand(client *c);
 void ltrimCommand(client *c);
 void typeCommand(client *c);
+void keyinfoCommand(client *c);
 void lsetCommand(client *c);
 void saddCommand(client *c);
+void saddsortedCommand(client *c);
 void sremCommand(client *c);
 void smoveCommand(client *c);
 void sismemberCommand(client *c);
@@ -2171,6 +2850,7 @@ void scardCommand(client *c);
 void spopCommand(client *c);
 void srandmemberCommand(client *c);
 void sinterCommand(client *c);
+void sintercardCommand(client *c);
 void sinterstoreCommand(client *c);
 void sunionCommand(client *c);
 void sunionstoreCommand(client *c);
@@ -2191,6 +2871,8 @@ void expireatCommand(client *c);
 void pexpireCommand(client *c);
 void pexpireatCommand(client *c);
 void getsetCommand(client *c);
+void getdelCommand(client *c);
+void getexCommand(client *c);
 void ttlCommand(client *c);
 void touchCommand(client *c);
 void pttlCommand(client *c);
@@ -2201,6 +2883,7 @@ void debugCommand(client *c);
 void msetCommand(client *c);
 void msetnxCommand(client *c);
 void zaddCommand(client *c);
+void zaddsortedCommand(client *c);
 void zincrbyCommand(client *c);
 void zrangeCommand(client *c);
 void zrangebyscoreCommand(client *c);
@@ -2210,6 +2893,7 @@ void zrevrangebylexCommand(client *c);
 void zcountCommand(client *c);
 void zlexcountCommand(client *c);
 void zrevrangeCommand(client *c);
+void zrangestoreCommand(client *c);
 void zcardCommand(client *c);
 void zremCommand(client *c);
 void zscoreCommand(client *c);
@@ -2237,6 +2921,13 @@ void hmgetCommand(client *c);
 void hdelCommand(client *c);
 void hlenCommand(client *c);
 void hstrlenCommand(client *c);
+void hexpireCommand(client *c);
+void hpexpireCommand(client *c);
+void hexpireatCommand(client *c);
+void hpexpireatCommand(client *c);
+void httlCommand(client *c);
+void hpttlCommand(client *c);
+void hpersistCommand(client *c);
 void zremrangebyrankCommand(client *c);
 void zunionstoreCommand(client *c);
 void zinterstoreCommand(client *c);
@@ -2270,6 +2961,7 @@ void clientCommand(client *c);
 void helloCommand(client *c);
 void evalCommand(client *c);
 void evalShaCommand(client *c);
+void evalRefCommand(client *c);
 void scriptCommand(client *c);
 void timeCommand(client *c);
 void bitopCommand(client *c);
@@ -2293,6 +2985,8 @@ void pfcountCommand(client *c);
 void pfmergeCommand(client *c);
 void pfdebugCommand(client *c);
 void latencyCommand(client *c);
+void hotkeysCommand(client *c);
+void evictionCommand(client *c);
 void moduleCommand(client *c);
 void securityWarningCommand(client *c);
 void xaddCommand(client *c);
@@ -2334,6 +3028,10 @@ void serverLogHexDump(int level, char *descr, void *value, size_t len);
 int memtest_preserving_test(unsigned long *m, size_t bytes, int passes);
 void mixDigest(unsigned char *digest, void *ptr, size_t len);
 void xorDigest(unsigned char *digest, void *ptr, size_t len);
+void snapshotDigestUnblockClient(client *c);
+void snapshotDigestDoneHandler(int exitcode, int bysignal);
+void memoryCensusUnblockClient(client *c);
+void memoryCensusDoneHandler(int exitcode, int bysignal);
 int populateCommandTableParseFlags(struct redisCommand *c, char *strflags);
 
 /* TLS stuff */
@@ -0,0 +1,76 @@
+/* setcpuaffinity.c -- Bind threads and child processes to a CPU list.
+ *
+ * On NUMA machines the scheduler is free to migrate the server threads
+ * across nodes, while the memory they allocated stays where it was first
+ * touched: after enough migrations a large share of the accesses become
+ * remote. Pinning the main/IO threads, the bio threads and the persistence
+ * children to the CPUs of one node (see the *_cpulist options) keeps both
+ * the execution and, via the kernel first-touch policy, the memory local.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "server.h"
+
+/* Bind the calling thread, and the threads and child processes it will
+ * create from this point on, to the CPUs listed in 'cpulist'.
+ *
+ * The list uses the taskset(1) format: a comma separated list of CPU
+ * numbers or ranges, like "0-7,9,11". A NULL or empty list leaves the
+ * affinity untouched. On NUMA machines, listing only the CPUs of a single
+ * node also keeps the memory the bound threads allocate on that node,
+ * because of the kernel first-touch page placement policy.
+ *
+ * An invalid list, or a list with no usable CPU, is reported in the logs
+ * and otherwise ignored: CPU binding is an optimization and should never
+ * prevent the server from starting. */
+void redisSetCpuAffinity(const char *cpulist) {
+#ifdef __linux__
+    cpu_set_t cpuset;
+    const char *p = cpulist;
+
+    if (cpulist == NULL || cpulist[0] == '\0') return;
+
+    CPU_ZERO(&cpuset);
+    while (*p) {
+        char *end;
+        long from, to, step = 1;
+
+        from = to = strtol(p,&end,10);
+        if (end == p) goto err;
+        if (*end == '-') {
+            p = end+1;
+            to = strtol(p,&end,10);
+            if (end == p) goto err;
+        }
+        if (*end == ':') {
+            /* taskset(1) style stride: "0-7:2" means 0,2,4,6. */
+            p = end+1;
+            step = strtol(p,&end,10);
+            if (end == p || step < 1) goto err;
+        }
+        if (from < 0 || to < from || to >= CPU_SETSIZE) goto err;
+        for (long cpu = from; cpu <= to; cpu += step)
+            CPU_SET(cpu,&cpuset);
+        if (*end == '\0') break;
+        if (*end != ',') goto err;
+        p = end+1;
+    }
+    if (CPU_COUNT(&cpuset) == 0) goto err;
+
+    if (sched_setaffinity(0,sizeof(cpuset),&cpuset) == -1) {
+        serverLog(LL_WARNING,"Failed to set CPU affinity '%s': %s",
+            cpulist, strerror(errno));
+    }
+    return;
+
+err:
+    serverLog(LL_WARNING,"Invalid CPU affinity list '%s'", cpulist);
+#else
+    UNUSED(cpulist);
+#endif
+}
@@ -13,11 +13,32 @@ typedef struct streamID {
     uint64_t seq;       /* Sequence number. */
 } streamID;
 
+struct listNode;
+
 typedef struct stream {
     rax *rax;               /* The radix tree holding the stream. */
     uint64_t length;        /* Number of elements inside this stream. */
     streamID last_id;       /* Zero if there are yet no items. */
+    streamID trim_id;       /* Trim watermark: entries with an ID smaller
+                               than this one are logically deleted, even if
+                               the radix tree nodes containing them were not
+                               released yet. */
+    uint64_t trim_dead_nodes; /* Number of head radix tree nodes that are
+                               entirely below the trim watermark: trimming
+                               leaves them in place, and they are released
+                               incrementally by streamTrimCron(). */
+    struct listNode *trim_link; /* Our node inside the global list of streams
+                               with dead nodes still to release. NULL when
+                               not registered. */
     rax *cgroups;           /* Consumer groups dictionary: name -> streamCG */
+    unsigned char *tail_lp; /* Write cursor: cached listpack of the tail
+                               node, so that sustained appends don't need
+                               to seek the radix tree tail on every XADD.
+                               NULL when unknown; invalidated by any
+                               operation that touches the radix tree other
+                               than appending (trim, delete, defrag). */
+    uint64_t tail_key[2];   /* Radix tree key (big endian ID) of the node
+                               tail_lp belongs to. */
 } stream;
 
 /* We define an iterator to iterate stream items in an abstract way, without
@@ -47,6 +68,26 @@ typedef struct streamIterator {
     unsigned char value_buf[LP_INTBUF_SIZE];
 } streamIterator;
 
+/* Pending (yet not acknowledged) message in a consumer group. */
+typedef struct streamNACK {
+    mstime_t delivery_time;     /* Last time this message was delivered. */
+    uint64_t delivery_count;    /* Number of times this message was delivered.*/
+    struct streamConsumer *consumer; /* The consumer this message was delivered
+                                   to in the last delivery. */
+} streamNACK;
+
+/* NACK structures are allocated in blocks carved from a per consumer group
+ * arena: delivering a batch of N entries with XREADGROUP costs at most one
+ * allocation instead of N, and acknowledged NACKs are recycled through a
+ * free list instead of going back to the allocator. The whole arena is
+ * released at once when the group is destroyed. */
+#define STREAM_NACK_BLOCK_SIZE 128  /* NACKs carved from each arena block. */
+typedef struct streamNACKBlock {
+    struct streamNACKBlock *next;   /* Next (fully used) block. */
+    uint32_t used;                  /* NACKs carved from this block so far. */
+    streamNACK nacks[STREAM_NACK_BLOCK_SIZE];
+} streamNACKBlock;
+
 /* Consumer group. */
 typedef struct streamCG {
     streamID last_id;       /* Last delivered (not acknowledged) ID for this
@@ -61,6 +102,9 @@ typedef struct streamCG {
     rax *consumers;         /* A radix tree representing the consumers by name
                                and their associated representation in the form
                                of streamConsumer structures. */
+    streamNACKBlock *nack_blocks; /* Arena the PEL NACKs are carved from. */
+    streamNACK *nack_freelist;    /* Acknowledged NACKs ready for reuse,
+                                     chained through the consumer field. */
 } streamCG;
 
 /* A specific consumer in a consumer group.  */
@@ -78,14 +122,6 @@ typedef struct streamConsumer {
                                    itself, so the value is shared. */
 } streamConsumer;
 
-/* Pending (yet not acknowledged) message in a consumer group. */
-typedef struct streamNACK {
-    mstime_t delivery_time;     /* Last time this message was delivered. */
-    uint64_t delivery_count;    /* Number of times this message was delivered.*/
-    streamConsumer *consumer;   /* The consumer this message was delivered to
-                                   in the last delivery. */
-} streamNACK;
-
 /* Stream propagation informations, passed to functions in order to propagate
  * XCLAIM commands to AOF and slaves. */
 typedef struct streamPropInfo {
@@ -107,9 +143,11 @@ void streamIteratorStop(streamIterator *si);
 streamCG *streamLookupCG(stream *s, sds groupname);
 streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int create);
 streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id);
-streamNACK *streamCreateNACK(streamConsumer *consumer);
+streamNACK *streamCreateNACK(streamCG *cg, streamConsumer *consumer);
 void streamDecodeID(void *buf, streamID *id);
 int streamCompareID(streamID *a, streamID *b);
-void streamFreeNACK(streamNACK *na);
+void streamFreeNACK(streamCG *cg, streamNACK *na);
+void streamTrimCron(void);
+void streamTrimPendingUpdate(stream *s);
 
 #endif
@@ -35,12 +35,12 @@
  *----------------------------------------------------------------------------*/
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) return;
+    if (o->encoding != OBJ_ENCODING_LISTPACK) return;
 
     for (i = start; i <= end; i++) {
         if (sdsEncodedObject(argv[i]) &&
@@ -52,32 +52,147 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Sorted field index for listpack encoded hashes.
+ *
+ * A field lookup in a listpack is a linear scan that decodes every field
+ * entry until a match, which hurts on read-heavy hashes of a few dozen
+ * fields (the very workload the old zipmap encoding was designed for,
+ * before it was retired to an RDB loading shim). Instead of embedding an
+ * index inside the listpack itself -- the blob is saved verbatim to the
+ * RDB and walked blindly by SCAN, the iterators and the background
+ * conversion snapshot, so an in-band index entry would leak everywhere --
+ * we keep a single process-wide sidecar: the field entry offsets of the
+ * most recently read listpack hash, sorted by field, so that repeated
+ * lookups become a binary search. The index is rebuilt lazily on the
+ * first lookup (one walk, the same cost as the scan it replaces) and
+ * dropped by hashTypeIndexInvalidate() whenever the listpack is modified,
+ * moved or freed. One slot is enough: lookups against the same hot hash
+ * come in bursts (HGET pipelines, HMGET), and a miss just degrades to the
+ * plain scan. */
+#define HASH_FIELD_INDEX_MIN 8    /* Below this a linear scan is cheaper. */
+#define HASH_FIELD_INDEX_MAX 512  /* Above this conversion to HT is near. */
+
+static struct {
+    robj *obj;           /* Indexed hash object, NULL when empty. */
+    unsigned char *lp;   /* Its listpack at build time. */
+    int numfields;
+    uint32_t offsets[HASH_FIELD_INDEX_MAX]; /* Field entry offsets, sorted
+                                             * by field content. */
+} hash_field_index;
+
+/* Compare the field stored at offset 'off' inside the listpack 'zl'
+ * against the 'len' bytes at 's'. Returns a negative, zero or positive
+ * value in strcmp() style, ordering by content bytes and then length. */
+static int hashFieldIndexCmp(unsigned char *zl, uint32_t off,
+                             unsigned char *s, unsigned int len)
+{
+    unsigned char buf[LP_INTBUF_SIZE];
+    unsigned char *p;
+    int64_t plen;
+    int cmp;
+
+    p = lpGet(zl+off, &plen, buf);
+    cmp = memcmp(p, s, plen < (int64_t)len ? (size_t)plen : len);
+    if (cmp == 0) return (plen > (int64_t)len) - (plen < (int64_t)len);
+    return cmp;
+}
+
+/* Drop the sidecar field index if it covers 'o'. Must be called before
+ * the listpack of a hash is modified, reallocated or freed. */
+void hashTypeIndexInvalidate(robj *o) {
+    if (hash_field_index.obj == o) hash_field_index.obj = NULL;
+}
+
+/* Build the sidecar index for 'o', evicting whatever hash owned it.
+ * Returns 1 on success, 0 when the hash is out of the size range where
+ * the index pays off. */
+static int hashTypeIndexBuild(robj *o) {
+    unsigned char *zl = o->ptr;
+    unsigned long numfields = lpLength(zl)/2;
+    unsigned char *fptr;
+    int n = 0;
+
+    if (numfields < HASH_FIELD_INDEX_MIN ||
+        numfields > HASH_FIELD_INDEX_MAX) return 0;
+
+    fptr = lpFirst(zl);
+    while (fptr != NULL) {
+        unsigned char buf[LP_INTBUF_SIZE];
+        unsigned char *f;
+        int64_t flen;
+        int lo = 0, hi = n;
+
+        /* Binary search the insertion point: the walk is in hash order,
+         * the index must be in field order. */
+        f = lpGet(fptr, &flen, buf);
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (hashFieldIndexCmp(zl, hash_field_index.offsets[mid],
+                                  f, flen) < 0)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        memmove(hash_field_index.offsets+lo+1, hash_field_index.offsets+lo,
+                (n-lo)*sizeof(uint32_t));
+        hash_field_index.offsets[lo] = fptr - zl;
+        n++;
+
+        fptr = lpNext(zl, fptr);     /* Skip the value... */
+        serverAssert(fptr != NULL);
+        fptr = lpNext(zl, fptr);     /* ...and move to the next field. */
+    }
+    hash_field_index.obj = o;
+    hash_field_index.lp = zl;
+    hash_field_index.numfields = n;
+    return 1;
+}
+
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, sds field,
-                           unsigned char **vstr,
-                           unsigned int *vlen,
-                           long long *vll)
+int hashTypeGetFromListpack(robj *o, sds field,
+                            unsigned char **vstr,
+                            unsigned int *vlen,
+                            long long *vll)
 {
     unsigned char *zl, *fptr = NULL, *vptr = NULL;
-    int ret;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
     zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
-    if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
-        if (fptr != NULL) {
-            /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
-            serverAssert(vptr != NULL);
+    if ((hash_field_index.obj == o && hash_field_index.lp == zl) ||
+        hashTypeIndexBuild(o))
+    {
+        /* Binary search over the sidecar field index. */
+        int lo = 0, hi = hash_field_index.numfields-1;
+
+        while (lo <= hi) {
+            int mid = (lo+hi)/2;
+            int cmp = hashFieldIndexCmp(zl, hash_field_index.offsets[mid],
+                                        (unsigned char*)field,
+                                        sdslen(field));
+            if (cmp == 0) {
+                fptr = zl + hash_field_index.offsets[mid];
+                break;
+            } else if (cmp < 0) {
+                lo = mid+1;
+            } else {
+                hi = mid-1;
+            }
         }
+    } else {
+        fptr = lpFirst(zl);
+        if (fptr != NULL)
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
+    }
+    if (fptr != NULL) {
+        /* Grab pointer to the value (fptr points to the field) */
+        vptr = lpNext(zl, fptr);
+        serverAssert(vptr != NULL);
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(vptr, vlen, vll);
         return 0;
     }
 
@@ -92,7 +207,12 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
 
     serverAssert(o->encoding == OBJ_ENCODING_HT);
 
-    de = dictFind(o->ptr, field);
+    /* On the read-only I/O thread path the inner dict must not be
+     * touched: an incremental rehash step would race with the other
+     * threads of the batch (see lookupKeyReadWithFlags()). */
+    de = io_threads_executing_command ?
+         dictFindNoRehash(o->ptr, field) :
+         dictFind(o->ptr, field);
     if (de == NULL) return NULL;
     return dictGetVal(de);
 }
@@ -107,9 +227,9 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
@@ -138,17 +258,62 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
     else return createStringObjectFromLongLong(vll);
 }
 
+/* Fetch 'count' fields from 'o' at once: vals[i] is set to a newly
+ * allocated string object with the value of fields[i], or to NULL if the
+ * field is missing. 'o' may be NULL, meaning a non existing hash.
+ *
+ * Compared with a loop of hashTypeGetValueObject() calls, a listpack
+ * encoded hash is walked a single time whatever the number of requested
+ * fields, and with the hash table encoding the buckets of all the fields
+ * are prefetched before the lookups start. */
+void hashTypeGetMulti(robj *o, sds *fields, robj **vals, int count) {
+    int found = 0, i;
+
+    for (i = 0; i < count; i++) vals[i] = NULL;
+    if (o == NULL) return;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = o->ptr;
+        unsigned char *fptr = lpFirst(zl);
+
+        while (fptr != NULL && found < count) {
+            unsigned char *vptr = lpNext(zl, fptr);
+            serverAssert(vptr != NULL);
+            for (i = 0; i < count; i++) {
+                if (vals[i] != NULL) continue;
+                if (!lpCompare(fptr,(unsigned char*)fields[i],
+                               sdslen(fields[i]))) continue;
+                unsigned char *vstr;
+                unsigned int vlen;
+                long long vll;
+                vstr = lpGetValue(vptr, &vlen, &vll);
+                vals[i] = vstr ? createStringObject((char*)vstr,vlen) :
+                                 createStringObjectFromLongLong(vll);
+                found++;
+            }
+            fptr = lpNext(zl, vptr);
+        }
+    } else if (o->encoding == OBJ_ENCODING_HT) {
+        for (i = 0; i < count; i++) dictPrefetch(o->ptr, fields[i]);
+        for (i = 0; i < count; i++) {
+            sds value = hashTypeGetFromHashTable(o, fields[i]);
+            if (value) vals[i] = createStringObject(value, sdslen(value));
+        }
+    } else {
+        serverPanic("Unknown hash encoding");
+    }
+}
+
 /* Higher level function using hashTypeGet*() to return the length of the
  * object associated with the requested field, or 0 if the field does not
  * exist. */
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
@@ -164,12 +329,12 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
     } else {
@@ -202,40 +367,45 @@ int hashTypeExists(robj *o, sds field) {
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr, *vptr;
 
+        objConvertCancel(o); /* The snapshot is about to go stale. */
+        hashTypeIndexInvalidate(o); /* So is the field index. */
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(zl, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
+                /* Replace value */
+                zl = lpReplace(zl, &vptr, (unsigned char*)value,
                         sdslen(value));
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            zl = lpAppend(zl, (unsigned char*)field, sdslen(field));
+            zl = lpAppend(zl, (unsigned char*)value, sdslen(value));
         }
         o->ptr = zl;
 
-        /* Check if the ziplist needs to be converted to a hash table */
-        if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+        /* Check if the listpack needs to be converted to a hash table. The
+         * conversion is preferably performed in the background: only when
+         * that is not available, or the listpack grew well past the limit
+         * while a conversion was pending, we convert in place. */
+        unsigned long len = hashTypeLength(o);
+        if (len > (unsigned long)server.hash_max_ziplist_entries &&
+            (len > (unsigned long)server.hash_max_ziplist_entries*2 ||
+             !objConvertSchedule(o)))
+        {
             hashTypeConvert(o, OBJ_ENCODING_HT);
+        }
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictEntry *de = dictFind(o->ptr,field);
         if (de) {
@@ -279,16 +449,19 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr;
 
+        objConvertCancel(o); /* The snapshot is about to go stale. */
+        hashTypeIndexInvalidate(o); /* So is the field index. */
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
+                /* Delete both of the key and the value. */
+                zl = lpDelete(zl,fptr,&fptr);
+                zl = lpDelete(zl,fptr,&fptr);
                 o->ptr = zl;
                 deleted = 1;
             }
@@ -311,8 +484,8 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        length = lpLength(o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = dictSize((const dict*)o->ptr);
     } else {
@@ -326,7 +499,7 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
@@ -346,7 +519,7 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return C_OK when the next entry
  * could be found and C_ERR when the iterator reaches the end. */
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl;
         unsigned char *fptr, *vptr;
 
@@ -357,16 +530,16 @@ int hashTypeNext(hashTypeIterator *hi) {
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(zl);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(zl, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(zl, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -381,22 +554,18 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll)
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll)
 {
-    int ret;
-
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->fptr, vlen, vll);
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->vptr, vlen, vll);
     }
 }
 
@@ -424,9 +593,9 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
  * can always check the function return by checking the return value
  * type checking if vstr == NULL. */
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds ele = hashTypeCurrentFromHashTable(hi, what);
         *vstr = (unsigned char*) ele;
@@ -462,10 +631,12 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
+    objConvertCancel(o); /* Converting in place supersedes a pending job. */
+    hashTypeIndexInvalidate(o); /* The listpack is about to be freed. */
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
@@ -483,9 +654,9 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             ret = dictAdd(dict, key, value);
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
         hashTypeReleaseIterator(hi);
@@ -498,8 +669,8 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 }
 
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         serverPanic("Not implemented");
     } else {
@@ -513,6 +684,7 @@ void hashTypeConvert(robj *o, int enc) {
 
 void hsetnxCommand(client *c) {
     robj *o;
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
     hashTypeTryConversion(o,c->argv,2,3);
 
@@ -536,11 +708,15 @@ void hsetCommand(client *c) {
         return;
     }
 
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
     hashTypeTryConversion(o,c->argv,2,c->argc-1);
 
-    for (i = 2; i < c->argc; i += 2)
+    for (i = 2; i < c->argc; i += 2) {
         created += !hashTypeSet(o,c->argv[i]->ptr,c->argv[i+1]->ptr,HASH_SET_COPY);
+        /* Setting a field value discards its TTL, like SET does for keys. */
+        hashExpiresRemoveField(c->db,c->argv[1]->ptr,c->argv[i]->ptr);
+    }
 
     /* HMSET (deprecated) and HSET return value is different. */
     char *cmdname = c->argv[0]->ptr;
@@ -564,6 +740,7 @@ void hincrbyCommand(client *c) {
     unsigned int vlen;
 
     if (getLongLongFromObjectOrReply(c,c->argv[3],&incr,NULL) != C_OK) return;
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
     if (hashTypeGetValue(o,c->argv[2]->ptr,&vstr,&vlen,&value) == C_OK) {
         if (vstr) {
@@ -600,6 +777,7 @@ void hincrbyfloatCommand(client *c) {
     unsigned int vlen;
 
     if (getLongDoubleFromObjectOrReply(c,c->argv[3],&incr,NULL) != C_OK) return;
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
     if (hashTypeGetValue(o,c->argv[2]->ptr,&vstr,&vlen,&ll) == C_OK) {
         if (vstr) {
@@ -649,12 +827,12 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReplyNull(c);
         } else {
@@ -679,6 +857,7 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
 void hgetCommand(client *c) {
     robj *o;
 
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.null[c->resp])) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
@@ -691,6 +870,7 @@ void hmgetCommand(client *c) {
 
     /* Don't abort when the key cannot be found. Non-existing keys are empty
      * hashes, where HMGET should respond with a series of null bulks. */
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     o = lookupKeyRead(c->db, c->argv[1]);
     if (o != NULL && o->type != OBJ_HASH) {
         addReply(c, shared.wrongtypeerr);
@@ -707,11 +887,13 @@ void hdelCommand(client *c) {
     robj *o;
     int j, deleted = 0, keyremoved = 0;
 
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
     for (j = 2; j < c->argc; j++) {
         if (hashTypeDelete(o,c->argv[j]->ptr)) {
+            hashExpiresRemoveField(c->db,c->argv[1]->ptr,c->argv[j]->ptr);
             deleted++;
             if (hashTypeLength(o) == 0) {
                 dbDelete(c->db,c->argv[1]);
@@ -734,6 +916,7 @@ void hdelCommand(client *c) {
 void hlenCommand(client *c) {
     robj *o;
 
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
@@ -743,18 +926,19 @@ void hlenCommand(client *c) {
 void hstrlenCommand(client *c) {
     robj *o;
 
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
     addReplyLongLong(c,hashTypeGetValueLength(o,c->argv[2]->ptr));
 }
 
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             addReplyBulkCBuffer(c, vstr, vlen);
         else
@@ -767,14 +951,178 @@ static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int wh
     }
 }
 
+/* ----------------------------------------------------------------------------
+ * Resumable HGETALL / HKEYS / HVALS
+ * ----------------------------------------------------------------------------
+ *
+ * Against a hash with millions of fields these commands are an all or
+ * nothing chunk of main thread work: the event loop is stuck until the
+ * whole reply is built. When resumable-read-threshold is configured and a
+ * hash table encoded value crosses it, the client is blocked instead, the
+ * way KEYSASYNC blocks for a keyspace export, and the value is walked with
+ * dictScan() in bounded slices from the cron task scheduler while the rest
+ * of the traffic keeps being served.
+ *
+ * The value object is reference counted by the job, so deleting or
+ * replacing the key while a job runs is safe: the job keeps serving the
+ * object it started from. Fields written while the job is in progress
+ * follow the SCAN guarantees instead of the usual point in time snapshot,
+ * which is why the feature is opt in. */
+
+typedef struct hgetallAsyncJob {
+    client *c;              /* Owner: the blocked client. */
+    robj *o;                /* The hash value, reference held. */
+    int flags;              /* OBJ_HASH_KEY|OBJ_HASH_VALUE to emit. */
+    unsigned long cursor;   /* dictScan() cursor. */
+    unsigned long numele;   /* Fields collected so far. */
+    sds payload;            /* Reply body, already in protocol form. */
+} hgetallAsyncJob;
+
+static list *hgetall_async_jobs = NULL;     /* Active jobs, oldest first. */
+
+/* Return non-zero if there are jobs to serve: the caller then drives the
+ * slices and prevents the event loop from blocking, see beforeSleep(). */
+int hgetallAsyncJobsPending(void) {
+    return hgetall_async_jobs != NULL && listLength(hgetall_async_jobs) != 0;
+}
+
+static void hgetallAsyncJobFree(listNode *ln) {
+    hgetallAsyncJob *job = ln->value;
+    decrRefCount(job->o);
+    sdsfree(job->payload);
+    zfree(job);
+    listDelNode(hgetall_async_jobs,ln);
+}
+
+/* dictScan() callback: append field and/or value to the job payload. */
+static void hgetallAsyncScanCallback(void *privdata, const dictEntry *de) {
+    hgetallAsyncJob *job = privdata;
+    sds ele;
+
+    if (job->flags & OBJ_HASH_KEY) {
+        ele = dictGetKey(de);
+        job->payload = sdscatfmt(job->payload,"$%u\r\n",
+                                 (unsigned int)sdslen(ele));
+        job->payload = sdscatlen(job->payload,ele,sdslen(ele));
+        job->payload = sdscatlen(job->payload,"\r\n",2);
+    }
+    if (job->flags & OBJ_HASH_VALUE) {
+        ele = dictGetVal(de);
+        job->payload = sdscatfmt(job->payload,"$%u\r\n",
+                                 (unsigned int)sdslen(ele));
+        job->payload = sdscatlen(job->payload,ele,sdslen(ele));
+        job->payload = sdscatlen(job->payload,"\r\n",2);
+    }
+    job->numele++;
+}
+
+/* Perform a bounded amount of work for the oldest pending job. Called by
+ * beforeSleep() on every event loop iteration while jobs are pending, with
+ * a budget in microseconds capping how long the slice may take. */
+#define HGETALL_ASYNC_CHUNK_BUCKETS 128
+void hgetallAsyncCron(long long budget_usec) {
+    if (hgetall_async_jobs == NULL ||
+        listLength(hgetall_async_jobs) == 0) return;
+
+    listNode *ln = listFirst(hgetall_async_jobs);
+    hgetallAsyncJob *job = ln->value;
+    long long start = ustime();
+
+    while(1) {
+        /* Past SDS_MAX_PREALLOC sds grows linearly, which against a multi
+         * megabyte payload means a full copy every added megabyte. Keep
+         * doubling by hand so the growth stays amortized constant. */
+        if (sdsavail(job->payload) < 65536) {
+            size_t grow = sdslen(job->payload);
+            if (grow < (1<<20)) grow = 1<<20;
+            job->payload = sdsMakeRoomFor(job->payload,grow);
+        }
+        for (int i = 0; i < HGETALL_ASYNC_CHUNK_BUCKETS; i++) {
+            job->cursor = dictScan(job->o->ptr,job->cursor,
+                                   hgetallAsyncScanCallback,NULL,job);
+            if (job->cursor == 0) {
+                /* Iteration complete: deliver the reply and unblock the
+                 * owner. The payload is handed over as a single reply
+                 * node, so the delivery is O(1) too. */
+                client *c = job->c;
+                if (job->flags & OBJ_HASH_KEY && job->flags & OBJ_HASH_VALUE)
+                    addReplyMapLen(c,job->numele);
+                else
+                    addReplyArrayLen(c,job->numele);
+                if (sdslen(job->payload)) {
+                    addReplySds(c,job->payload);
+                    job->payload = NULL;
+                }
+                hgetallAsyncJobFree(ln);
+                unblockClient(c);
+                return;
+            }
+        }
+        if (ustime()-start > budget_usec) return;
+    }
+}
+
+/* Called by unblockClient() when a client blocked on a resumable read goes
+ * away before its job is done (it disconnected, or was force-unblocked):
+ * discard the pending job still attached to it, if any. */
+void hgetallAsyncUnblockClient(client *c) {
+    listIter li;
+    listNode *ln;
+
+    if (hgetall_async_jobs == NULL) return;
+    listRewind(hgetall_async_jobs,&li);
+    while((ln = listNext(&li))) {
+        hgetallAsyncJob *job = ln->value;
+        if (job->c == c) {
+            hgetallAsyncJobFree(ln);
+            return;
+        }
+    }
+}
+
+/* Block the client and queue a job serving its HGETALL / HKEYS / HVALS
+ * incrementally. The caller already checked the value is a hash table
+ * encoded hash big enough to be worth it. */
+static void hgetallAsyncStart(client *c, robj *o, int flags) {
+    hgetallAsyncJob *job = zmalloc(sizeof(*job));
+
+    job->c = c;
+    job->o = o;
+    incrRefCount(o);
+    job->flags = flags;
+    job->cursor = 0;
+    job->numele = 0;
+    job->payload = sdsempty();
+
+    if (hgetall_async_jobs == NULL) hgetall_async_jobs = listCreate();
+    listAddNodeTail(hgetall_async_jobs,job);
+
+    c->bpop.timeout = 0; /* No timeout: the job always completes. */
+    blockClient(c,BLOCKED_RESUMABLE);
+}
+
 void genericHgetallCommand(client *c, int flags) {
     robj *o;
     hashTypeIterator *hi;
     int length, count = 0;
 
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymap[c->resp]))
         == NULL || checkType(c,o,OBJ_HASH)) return;
 
+    /* Big hashes can be served incrementally while the client is blocked,
+     * see the resumable commands section above. Inside MULTI or Lua we
+     * can't block, and fake clients have no connection to block: those
+     * keep the synchronous behavior. */
+    if (server.resumable_read_threshold &&
+        o->encoding == OBJ_ENCODING_HT &&
+        hashTypeLength(o) >= server.resumable_read_threshold &&
+        c->conn && !(c->flags & (CLIENT_MULTI|CLIENT_LUA)))
+    {
+        hgetallAsyncStart(c,o,flags);
+        return;
+    }
+
     /* We return a map if the user requested keys and values, like in the
      * HGETALL case. Otherwise to use a flat array makes more sense. */
     length = hashTypeLength(o);
@@ -794,6 +1142,7 @@ void genericHgetallCommand(client *c, int flags) {
             addHashIteratorCursorToReply(c, hi, OBJ_HASH_VALUE);
             count++;
         }
+        replyStreamFlushIfNeeded(c);
     }
 
     hashTypeReleaseIterator(hi);
@@ -817,6 +1166,7 @@ void hgetallCommand(client *c) {
 
 void hexistsCommand(client *c) {
     robj *o;
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
@@ -828,7 +1178,294 @@ void hscanCommand(client *c) {
     unsigned long cursor;
 
     if (parseScanCursorOrReply(c,c->argv[2],&cursor) == C_ERR) return;
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptyscan)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/*-----------------------------------------------------------------------------
+ * Hash field expiration
+ *----------------------------------------------------------------------------*/
+
+/* Delete from the hash 'keyobj' every field whose TTL (see HEXPIRE) is
+ * already in the past at time 'now'. This gets called lazily at the start
+ * of the hash type commands, and by the active expire cycle walking
+ * db->hexpires_index, so commands never observe a logically dead field and
+ * memory is reclaimed timely even for hashes nobody touches again.
+ *
+ * On the master every deletion is propagated as an explicit HDEL, the way
+ * expired keys propagate a DEL, so replicas and the AOF stay consistent.
+ * Replicas reclaim their local copy without propagating, matching how this
+ * server reclaims expired key values ahead of the master DEL.
+ *
+ * Returns the number of fields that were deleted. */
+int hashTypeExpireFields(redisDb *db, robj *keyobj, mstime_t now) {
+    unsigned char *lp = hashExpiresLookup(db,keyobj->ptr);
+    int expired = 0, j;
+
+    if (lp == NULL) return 0;
+
+    /* Like key expires, field deadlines are only enforced while not
+     * loading: commands replayed from the AOF must observe the dataset
+     * as it was when they were logged. */
+    if (server.loading) return 0;
+
+    robj *o = lookupKeyWrite(db,keyobj);
+    if (o == NULL || o->type != OBJ_HASH) {
+        /* The value was replaced under the same name by a non hash (the
+         * key deletion paths drop the side data synchronously): the TTLs
+         * are stale, discard them. */
+        hashExpiresDelete(db,keyobj->ptr);
+        return 0;
+    }
+
+    /* Collect the dead fields first: removing their TTL entries mutates
+     * the listpack we are iterating. */
+    long count = lpLength(lp)/2;
+    sds *fields = zmalloc(sizeof(sds)*count);
+    unsigned char *p = lpFirst(lp);
+    while (p) {
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll, when;
+        unsigned char *q = lpNext(lp,p);
+
+        serverAssert(lpGetValue(q,NULL,&when) == NULL);
+        if (when <= now) {
+            vstr = lpGetValue(p,&vlen,&vll);
+            fields[expired++] = vstr ? sdsnewlen(vstr,vlen) :
+                                       sdsfromlonglong(vll);
+        }
+        p = lpNext(lp,q);
+    }
+    if (expired == 0) {
+        zfree(fields);
+        return 0;
+    }
+
+    for (j = 0; j < expired; j++) {
+        hashTypeDelete(o,fields[j]);
+        hashExpiresRemoveField(db,keyobj->ptr,fields[j]);
+    }
+
+    if (server.masterhost == NULL) {
+        robj **argv = zmalloc(sizeof(robj*)*(expired+2));
+        argv[0] = shared.hdel;
+        argv[1] = keyobj;
+        for (j = 0; j < expired; j++)
+            argv[2+j] = createStringObject(fields[j],sdslen(fields[j]));
+        propagate(server.hdelCommand,db->id,argv,expired+2,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+        for (j = 0; j < expired; j++) decrRefCount(argv[2+j]);
+        zfree(argv);
+    }
+    for (j = 0; j < expired; j++) sdsfree(fields[j]);
+    zfree(fields);
+
+    signalModifiedKey(db,keyobj);
+    notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",keyobj,db->id);
+    server.dirty += expired;
+    if (hashTypeLength(o) == 0) {
+        dbDelete(db,keyobj);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"del",keyobj,db->id);
+    }
+    return expired;
+}
+
+/* Parse the "FIELDS <numfields> field [field ...]" trailer the hash field
+ * expiration commands share, starting at argv[idx]. On success C_OK is
+ * returned and *numfields is set, otherwise an error was already sent. */
+static int hashExpireParseFields(client *c, int idx, long long *numfields) {
+    if (strcasecmp(c->argv[idx]->ptr,"fields")) {
+        addReplyError(c,"Mandatory keyword FIELDS is missing or not at the right position");
+        return C_ERR;
+    }
+    if (getLongLongFromObjectOrReply(c,c->argv[idx+1],numfields,NULL) != C_OK)
+        return C_ERR;
+    if (*numfields <= 0 || *numfields != c->argc-idx-2) {
+        addReplyError(c,"Parameter `numFields` should be greater than 0, and smaller or equal to the number of fields specified");
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* HEXPIRE <key> <ttl> FIELDS <numfields> <field> [<field> ...]
+ * and the HPEXPIRE / HEXPIREAT / HPEXPIREAT variants.
+ *
+ * The reply is an array with one integer per field: -2 if the key or the
+ * field does not exist, 2 if the field was deleted because the deadline
+ * was already in the past, 1 if the deadline was set. */
+void hexpireGenericCommand(client *c, long long basetime, int unit) {
+    long long ttl, numfields, when;
+    mstime_t now = mstime();
+    robj *o;
+    int j, changed = 0;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&ttl,NULL) != C_OK) return;
+    if (hashExpireParseFields(c,3,&numfields) != C_OK) return;
+
+    when = ttl;
+    if (unit == UNIT_SECONDS) {
+        if (when > LLONG_MAX/1000 || when < LLONG_MIN/1000) {
+            addReplyErrorFormat(c,"invalid expire time in %s",
+                                (char*)c->argv[0]->ptr);
+            return;
+        }
+        when *= 1000;
+    }
+    when += basetime;
+
+    hashTypeExpireFields(c->db,c->argv[1],now);
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o == NULL) {
+        addReplyArrayLen(c,numfields);
+        for (j = 0; j < numfields; j++) addReplyLongLong(c,-2);
+        return;
+    }
+    if (checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 0; j < numfields; j++) {
+        sds field = c->argv[5+j]->ptr;
+
+        if (!hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        /* A deadline in the past deletes the field right away, but like
+         * EXPIREAT never on replicas or while loading: there the past
+         * deadline is stored and the field reclaimed by the sweep. */
+        if (when <= now && !server.loading && !server.masterhost) {
+            hashTypeDelete(o,field);
+            hashExpiresRemoveField(c->db,c->argv[1]->ptr,field);
+            addReplyLongLong(c,2);
+        } else {
+            hashExpiresSetField(c->db,c->argv[1]->ptr,field,when);
+            addReplyLongLong(c,1);
+        }
+        changed++;
+    }
+
+    if (changed) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpire",c->argv[1],c->db->id);
+        server.dirty += changed;
+
+        /* Replicate/AOF this as an absolute milliseconds deadline. */
+        robj *cmdobj = createStringObject("HPEXPIREAT",10);
+        robj *aux = createStringObjectFromLongLong(when);
+        rewriteClientCommandArgument(c,0,cmdobj);
+        rewriteClientCommandArgument(c,2,aux);
+        decrRefCount(cmdobj);
+        decrRefCount(aux);
+    }
+    if (hashTypeLength(o) == 0) {
+        dbDelete(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"del",c->argv[1],c->db->id);
+    }
+}
+
+void hexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+void hpexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+void hexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+void hpexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/* HTTL <key> FIELDS <numfields> <field> [<field> ...]
+ * Replies one integer per field: -2 if the key or field does not exist,
+ * -1 if the field has no TTL, otherwise the remaining time to live. */
+void httlGenericCommand(client *c, int unit) {
+    long long numfields;
+    mstime_t now = mstime();
+    robj *o;
+    int j;
+
+    if (hashExpireParseFields(c,2,&numfields) != C_OK) return;
+
+    hashTypeExpireFields(c->db,c->argv[1],now);
+    o = lookupKeyRead(c->db,c->argv[1]);
+    if (o == NULL) {
+        addReplyArrayLen(c,numfields);
+        for (j = 0; j < numfields; j++) addReplyLongLong(c,-2);
+        return;
+    }
+    if (checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 0; j < numfields; j++) {
+        sds field = c->argv[4+j]->ptr;
+
+        if (!hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        long long when = hashExpiresGetField(c->db,c->argv[1]->ptr,field);
+        if (when == -1) {
+            addReplyLongLong(c,-1);
+        } else if (unit == UNIT_SECONDS) {
+            addReplyLongLong(c,(when-now+999)/1000);
+        } else {
+            addReplyLongLong(c,when-now);
+        }
+    }
+}
+
+void httlCommand(client *c) {
+    httlGenericCommand(c,UNIT_SECONDS);
+}
+
+void hpttlCommand(client *c) {
+    httlGenericCommand(c,UNIT_MILLISECONDS);
+}
+
+/* HPERSIST <key> FIELDS <numfields> <field> [<field> ...]
+ * Replies one integer per field: -2 if the key or field does not exist,
+ * -1 if the field had no TTL, 1 if the TTL was removed. */
+void hpersistCommand(client *c) {
+    long long numfields;
+    robj *o;
+    int j, persisted = 0;
+
+    if (hashExpireParseFields(c,2,&numfields) != C_OK) return;
+
+    hashTypeExpireFields(c->db,c->argv[1],mstime());
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o == NULL) {
+        addReplyArrayLen(c,numfields);
+        for (j = 0; j < numfields; j++) addReplyLongLong(c,-2);
+        return;
+    }
+    if (checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 0; j < numfields; j++) {
+        sds field = c->argv[4+j]->ptr;
+
+        if (!hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        if (hashExpiresRemoveField(c->db,c->argv[1]->ptr,field)) {
+            addReplyLongLong(c,1);
+            persisted++;
+        } else {
+            addReplyLongLong(c,-1);
+        }
+    }
+    if (persisted) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hpersist",c->argv[1],c->db->id);
+        server.dirty += persisted;
+    }
+}
@@ -71,6 +71,39 @@ robj *listTypePop(robj *subject, int where) {
     return value;
 }
 
+/* Pop up to 'count' elements from one end of the list, storing the popped
+ * values (as string objects with their refcount incremented) into the
+ * 'values' array. Returns the number of elements actually popped.
+ *
+ * This is equivalent to calling listTypePop() repeatedly, but the end of
+ * the quicklist is located (and its node decompressed, if needed) only
+ * once for the whole batch: it is used to serve many clients blocked on
+ * the same list with a single traversal. */
+int listTypePopBatch(robj *subject, int where, robj **values, int count) {
+    int popped = 0;
+
+    if (subject->encoding == OBJ_ENCODING_QUICKLIST) {
+        int dir = (where == LIST_HEAD) ? AL_START_HEAD : AL_START_TAIL;
+        long idx = (where == LIST_HEAD) ? 0 : -1;
+        quicklistIter *iter = quicklistGetIteratorAtIdx(subject->ptr,dir,idx);
+        quicklistEntry entry;
+
+        while (popped < count && quicklistNext(iter,&entry)) {
+            if (entry.value)
+                values[popped] = createStringObject((char*)entry.value,
+                                                    entry.sz);
+            else
+                values[popped] = createStringObjectFromLongLong(entry.longval);
+            popped++;
+            quicklistDelEntry(iter,&entry);
+        }
+        quicklistReleaseIterator(iter);
+    } else {
+        serverPanic("Unknown list encoding");
+    }
+    return popped;
+}
+
 unsigned long listTypeLength(const robj *subject) {
     if (subject->encoding == OBJ_ENCODING_QUICKLIST) {
         return quicklistCount(subject->ptr);
@@ -420,13 +453,24 @@ void lrangeCommand(client *c) {
     if (end >= llen) end = llen-1;
     rangelen = (end-start)+1;
 
-    /* Return the result in form of a multi-bulk reply */
+    /* Return the result in form of a multi-bulk reply. The traversal may
+     * be aborted by the execution deadline, unless part of the reply was
+     * already streamed to the socket. */
+    replyCheckpoint cp;
+    replyCheckpointSet(c,&cp);
     addReplyArrayLen(c,rangelen);
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
         listTypeIterator *iter = listTypeInitIterator(o, start, LIST_TAIL);
 
         while(rangelen--) {
             listTypeEntry entry;
+            if ((rangelen & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                listTypeReleaseIterator(iter);
+                addReply(c,shared.timeouterr);
+                return;
+            }
             listTypeNext(iter, &entry);
             quicklistEntry *qe = &entry.entry;
             if (qe->value) {
@@ -434,6 +478,7 @@ void lrangeCommand(client *c) {
             } else {
                 addReplyBulkLongLong(c,qe->longval);
             }
+            replyStreamFlushIfNeeded(c);
         }
         listTypeReleaseIterator(iter);
     } else {
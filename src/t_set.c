@@ -45,6 +45,104 @@ robj *setTypeCreate(sds value) {
     return createSetObject();
 }
 
+/*-----------------------------------------------------------------------------
+ * Dense sampling array
+ *
+ * Random member extraction on the hash table encoding probes random buckets
+ * (see dictGetFairRandomKey()), which is slow on sparse tables and biased
+ * toward the elements of short chains. Sets that actually get sampled can
+ * maintain a dense array with one pointer per element, making every
+ * extraction a single uniform array access. The array stores aliases of the
+ * dict entry keys, and every entry stores its own array slot in the entry
+ * value (unused by sets otherwise), so removals swap-fill the hole in
+ * constant time.
+ *
+ * The array hangs off the privdata pointer of the set dict, that sets never
+ * used, so the object representation does not change. It is built lazily by
+ * the first SRANDMEMBER/SPOP with a count served on a large enough hash
+ * table set, and released together with the set. Active defrag moves
+ * entries and keys around, so it simply drops the array: the next sampling
+ * command rebuilds it.
+ *----------------------------------------------------------------------------*/
+
+/* Don't bother attaching the array to sets smaller than this: probing
+ * random buckets of a small (hence dense) table works well enough. */
+#define SET_SAMPLER_MIN_SIZE 64
+
+typedef struct setSampler {
+    unsigned long size;     /* Elements in dense[] (== dictSize()). */
+    unsigned long capacity; /* Allocated slots. */
+    sds dense[];            /* Aliases of the dict entry keys. */
+} setSampler;
+
+/* Append a just added entry to the dense array, if the set has one. */
+static void setSamplerAdd(dict *d, dictEntry *de) {
+    setSampler *sp = d->privdata;
+
+    if (sp == NULL) return;
+    if (sp->size == sp->capacity) {
+        sp->capacity *= 2;
+        sp = zrealloc(sp,sizeof(*sp)+sizeof(sds)*sp->capacity);
+        d->privdata = sp;
+    }
+    sp->dense[sp->size] = dictGetKey(de);
+    dictSetUnsignedIntegerVal(de,sp->size);
+    sp->size++;
+}
+
+/* Remove an entry (already unlinked from the dict, but not yet freed) from
+ * the dense array, swapping the last element into its slot. */
+static void setSamplerDelete(dict *d, dictEntry *de) {
+    setSampler *sp = d->privdata;
+    unsigned long idx;
+
+    if (sp == NULL) return;
+    idx = dictGetUnsignedIntegerVal(de);
+    serverAssert(idx < sp->size);
+    if (idx != sp->size-1) {
+        sds moved = sp->dense[sp->size-1];
+        dictEntry *mde = dictFind(d,moved);
+        serverAssert(mde != NULL);
+        sp->dense[idx] = moved;
+        dictSetUnsignedIntegerVal(mde,idx);
+    }
+    sp->size--;
+}
+
+/* Release the dense array of a set dict, if any. Called when the set is
+ * freed, and by active defrag before moving entries or elements around:
+ * the array is rebuilt by the next sampling command. */
+void setSamplerRelease(dict *d) {
+    if (d->privdata) {
+        zfree(d->privdata);
+        d->privdata = NULL;
+    }
+}
+
+/* Attach the dense array to the set if it would pay off. */
+static void setSamplerMaybeAttach(robj *set) {
+    dict *d;
+    setSampler *sp;
+    dictIterator *di;
+    dictEntry *de;
+
+    if (set->encoding != OBJ_ENCODING_HT) return;
+    d = set->ptr;
+    if (d->privdata != NULL || !server.set_dense_sampling ||
+        dictSize(d) < SET_SAMPLER_MIN_SIZE) return;
+    sp = zmalloc(sizeof(*sp)+sizeof(sds)*dictSize(d));
+    sp->size = 0;
+    sp->capacity = dictSize(d);
+    di = dictGetIterator(d);
+    while((de = dictNext(di)) != NULL) {
+        sp->dense[sp->size] = dictGetKey(de);
+        dictSetUnsignedIntegerVal(de,sp->size);
+        sp->size++;
+    }
+    dictReleaseIterator(di);
+    d->privdata = sp;
+}
+
 /* Add the specified value into a set.
  *
  * If the value was already member of the set, nothing is done and 0 is
@@ -53,21 +151,34 @@ int setTypeAdd(robj *subject, sds value) {
     long long llval;
     if (subject->encoding == OBJ_ENCODING_HT) {
         dict *ht = subject->ptr;
-        dictEntry *de = dictAddRaw(ht,value,NULL);
+        /* The dict takes ownership of the copy: short elements are stored
+         * inline in the entry and the copy is released right away (see
+         * _dictAddEntry()), longer ones are referenced as the entry key. */
+        sds copy = sdsdup(value);
+        dictEntry *de = dictAddRaw(ht,copy,NULL);
         if (de) {
-            dictSetKey(ht,de,sdsdup(value));
             dictSetVal(ht,de,NULL);
+            setSamplerAdd(ht,de);
             return 1;
         }
+        sdsfree(copy); /* Was already a member. */
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             uint8_t success = 0;
             subject->ptr = intsetAdd(subject->ptr,llval,&success);
             if (success) {
-                /* Convert to regular set when the intset contains
-                 * too many entries. */
-                if (intsetLen(subject->ptr) > server.set_max_intset_entries)
+                objConvertCancel(subject); /* Snapshot went stale. */
+                /* Convert to regular set when the intset contains too many
+                 * entries, in the background when possible: only when that
+                 * is not available, or the intset grew well past the limit
+                 * while a conversion was pending, we convert in place. */
+                uint32_t len = intsetLen(subject->ptr);
+                if (len > (uint32_t)server.set_max_intset_entries &&
+                    (len > (uint32_t)server.set_max_intset_entries*2 ||
+                     !objConvertSchedule(subject)))
+                {
                     setTypeConvert(subject,OBJ_ENCODING_HT);
+                }
                 return 1;
             }
         } else {
@@ -88,15 +199,22 @@ int setTypeAdd(robj *subject, sds value) {
 int setTypeRemove(robj *setobj, sds value) {
     long long llval;
     if (setobj->encoding == OBJ_ENCODING_HT) {
-        if (dictDelete(setobj->ptr,value) == DICT_OK) {
-            if (htNeedsResize(setobj->ptr)) dictResize(setobj->ptr);
+        dict *ht = setobj->ptr;
+        dictEntry *de = dictUnlink(ht,value);
+        if (de != NULL) {
+            setSamplerDelete(ht,de);
+            dictFreeUnlinkedEntry(ht,de);
+            if (htNeedsResize(ht)) dictResize(ht);
             return 1;
         }
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             int success;
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
-            if (success) return 1;
+            if (success) {
+                objConvertCancel(setobj); /* Snapshot went stale. */
+                return 1;
+            }
         }
     } else {
         serverPanic("Unknown set encoding");
@@ -207,8 +325,14 @@ sds setTypeNextObject(setTypeIterator *si) {
  * used field with values which are easy to trap if misused. */
 int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     if (setobj->encoding == OBJ_ENCODING_HT) {
-        dictEntry *de = dictGetFairRandomKey(setobj->ptr);
-        *sdsele = dictGetKey(de);
+        setSampler *sp = ((dict*)setobj->ptr)->privdata;
+        if (sp) {
+            /* One array access: uniform by construction. */
+            *sdsele = sp->dense[random() % sp->size];
+        } else {
+            dictEntry *de = dictGetFairRandomKey(setobj->ptr);
+            *sdsele = dictGetKey(de);
+        }
         *llele = -123456789; /* Not needed. Defensive. */
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
@@ -236,6 +360,7 @@ void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
                              setobj->encoding == OBJ_ENCODING_INTSET);
+    objConvertCancel(setobj); /* Converting in place supersedes a pending job. */
 
     if (enc == OBJ_ENCODING_HT) {
         int64_t intele;
@@ -287,6 +412,52 @@ void saddCommand(client *c) {
     addReplyLongLong(c,added);
 }
 
+/* SADDSORTED key member [member ...]
+ *
+ * Bulk load variant of SADD for presorted payloads. Sorted input does
+ * not change how a hash table is built, but declaring the whole payload
+ * up front lets the command size the destination once: a payload that
+ * cannot stay an intset is converted and the table presized for all the
+ * members, instead of growing through every intermediate size with the
+ * rehashes that entails. Ascending integer members also append at the
+ * tail of an intset without shifting it. Behaves exactly like SADD
+ * otherwise, replying with the number of new members added. */
+void saddsortedCommand(client *c) {
+    robj *set;
+    int j, added = 0;
+
+    set = lookupKeyWrite(c->db,c->argv[1]);
+    if (set == NULL) {
+        set = setTypeCreate(c->argv[2]->ptr);
+        dbAdd(c->db,c->argv[1],set);
+    } else {
+        if (set->type != OBJ_SET) {
+            addReply(c,shared.wrongtypeerr);
+            return;
+        }
+    }
+
+    /* Presize for the whole payload. Members already inside the set (or
+     * repeated in the payload) just leave some spare room. */
+    if (set->encoding == OBJ_ENCODING_INTSET &&
+        (size_t)(c->argc-2) > server.set_max_intset_entries)
+    {
+        setTypeConvert(set,OBJ_ENCODING_HT);
+    }
+    if (set->encoding == OBJ_ENCODING_HT)
+        dictExpand(set->ptr,dictSize((dict*)set->ptr)+(c->argc-2));
+
+    for (j = 2; j < c->argc; j++) {
+        if (setTypeAdd(set,c->argv[j]->ptr)) added++;
+    }
+    if (added) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_SET,"sadd",c->argv[1],c->db->id);
+    }
+    server.dirty += added;
+    addReplyLongLong(c,added);
+}
+
 void sremCommand(client *c) {
     robj *set;
     int j, deleted = 0, keyremoved = 0;
@@ -449,6 +620,10 @@ void spopWithCountCommand(client *c) {
         return;
     }
 
+    /* This set is being sampled: give it the dense array so that the
+     * random extractions below (and future ones) are O(1) and uniform. */
+    setSamplerMaybeAttach(set);
+
     /* Case 2 and 3 require to replicate SPOP as a set of SREM commands.
      * Prepare our replication argument vector. Also send the array length
      * which is common to both the code paths. */
@@ -478,6 +653,7 @@ void spopWithCountCommand(client *c) {
             if (encoding == OBJ_ENCODING_INTSET) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
+                objConvertCancel(set); /* Snapshot goes stale. */
                 set->ptr = intsetRemove(set->ptr,llele,NULL);
             } else {
                 addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
@@ -575,6 +751,7 @@ void spopCommand(client *c) {
     /* Remove the element from the set */
     if (encoding == OBJ_ENCODING_INTSET) {
         ele = createStringObjectFromLongLong(llele);
+        objConvertCancel(set); /* Snapshot goes stale. */
         set->ptr = intsetRemove(set->ptr,llele,NULL);
     } else {
         ele = createStringObject(sdsele,sdslen(sdsele));
@@ -642,6 +819,10 @@ void srandmemberWithCountCommand(client *c) {
         return;
     }
 
+    /* This set is being sampled: give it the dense array so that the
+     * random extractions below (and future ones) are O(1) and uniform. */
+    setSamplerMaybeAttach(set);
+
     /* CASE 1: The count was negative, so the extraction method is just:
      * "return N random elements" sampling the whole set every time.
      * This case is trivial and can be served without auxiliary data
@@ -667,6 +848,36 @@ void srandmemberWithCountCommand(client *c) {
         return;
     }
 
+    /* Sets with the dense array can serve the "few elements of a big set"
+     * case without auxiliary objects: sample distinct slots directly,
+     * deduplicating them with a small scratch table of indexes. */
+    if (set->encoding == OBJ_ENCODING_HT &&
+        count*SRANDMEMBER_SUB_STRATEGY_MUL <= size &&
+        ((dict*)set->ptr)->privdata != NULL)
+    {
+        setSampler *sp = ((dict*)set->ptr)->privdata;
+        unsigned long added = 0, tsize = 4, tmask, *slots;
+
+        while (tsize < count*4) tsize *= 2; /* Low load factor. */
+        tmask = tsize-1;
+        slots = zmalloc(tsize*sizeof(unsigned long));
+        memset(slots,0xff,tsize*sizeof(unsigned long)); /* ULONG_MAX: free. */
+        addReplySetLen(c,count);
+        while(added < count) {
+            unsigned long idx = random() % sp->size;
+            unsigned long b = idx & tmask;
+            while (slots[b] != ULONG_MAX && slots[b] != idx)
+                b = (b+1) & tmask;
+            if (slots[b] == idx) continue; /* Already extracted. */
+            slots[b] = idx;
+            ele = sp->dense[idx];
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            added++;
+        }
+        zfree(slots);
+        return;
+    }
+
     /* For CASE 3 and CASE 4 we need an auxiliary dictionary. */
     d = dictCreate(&objectKeyPointerValueDictType,NULL);
 
@@ -789,8 +1000,15 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/* SINTER / SINTERSTORE / SINTERCARD common implementation.
+ *
+ * 'cardinality_only' is currently only used by SINTERCARD: only the number
+ * of common members is computed and no result set is ever materialized.
+ * In that mode a non zero 'limit' makes the scan stop as soon as 'limit'
+ * common members were seen, so huge intersections can be bounded. */
 void sinterGenericCommand(client *c, robj **setkeys,
-                          unsigned long setnum, robj *dstkey) {
+                          unsigned long setnum, robj *dstkey,
+                          int cardinality_only, unsigned long limit) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
     setTypeIterator *si;
     robj *dstset = NULL;
@@ -812,6 +1030,8 @@ void sinterGenericCommand(client *c, robj **setkeys,
                     server.dirty++;
                 }
                 addReply(c,shared.czero);
+            } else if (cardinality_only) {
+                addReply(c,shared.czero);
             } else {
                 addReply(c,shared.emptyset[c->resp]);
             }
@@ -827,13 +1047,64 @@ void sinterGenericCommand(client *c, robj **setkeys,
      * algorithm's performance */
     qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
 
+    /* When every operand is an intset the intersection can be computed as
+     * a galloping merge of sorted arrays, pairwise from the smallest set,
+     * instead of probing each element into every other set. */
+    int allintset = setnum >= 2;
+    for (j = 0; allintset && j < setnum; j++)
+        if (sets[j]->encoding != OBJ_ENCODING_INTSET) allintset = 0;
+
+    /* With a limited SINTERCARD the element by element scan below can
+     * stop early, so the full galloping merge is only a win when the
+     * whole intersection is needed anyway. */
+    if (allintset && !(cardinality_only && limit)) {
+        intset *res = intsetInter(sets[0]->ptr,sets[1]->ptr);
+        for (j = 2; j < setnum && intsetLen(res) != 0; j++) {
+            intset *next = intsetInter(res,sets[j]->ptr);
+            zfree(res);
+            res = next;
+        }
+        cardinality = intsetLen(res);
+        if (cardinality_only) {
+            addReplyLongLong(c,cardinality);
+            zfree(res);
+        } else if (!dstkey) {
+            /* The cardinality is known upfront, so the length can be
+             * emitted right away and the reply streamed in batches. */
+            int64_t intele;
+            uint32_t i = 0;
+            addReplySetLen(c,cardinality);
+            while (intsetGet(res,i++,&intele)) {
+                addReplyBulkLongLong(c,intele);
+                replyStreamFlushIfNeeded(c);
+            }
+            zfree(res);
+        } else {
+            /* The merged intset becomes the destination set itself. */
+            dstset = createIntsetObject();
+            zfree(dstset->ptr);
+            dstset->ptr = res;
+        }
+        goto cleanup;
+    }
+
     /* The first thing we should output is the total number of elements...
      * since this is a multi-bulk write, but at this stage we don't know
      * the intersection set size, so we use a trick, append an empty object
      * to the output list and save the pointer to later modify it with the
      * right length */
-    if (!dstkey) {
-        replylen = addReplyDeferredLen(c);
+    if (cardinality_only) {
+        /* Only the count is emitted, at the end of the scan: no deferred
+         * length node and no destination set are needed. */
+    } else if (!dstkey) {
+        /* With a single set (the SMEMBERS case) the result is the whole
+         * set, so the length is known upfront and we can emit it right
+         * away: this also allows the reply to be streamed to the socket
+         * in batches, since no deferred length node is pending. */
+        if (setnum == 1)
+            addReplySetLen(c,setTypeSize(sets[0]));
+        else
+            replylen = addReplyDeferredLen(c);
     } else {
         /* If we have a target key where to store the resulting set
          * create this key with an empty set inside */
@@ -873,12 +1144,17 @@ void sinterGenericCommand(client *c, robj **setkeys,
 
         /* Only take action when all sets contain the member */
         if (j == setnum) {
-            if (!dstkey) {
+            if (cardinality_only) {
+                cardinality++;
+                /* We stop the searching after the limit is reached. */
+                if (limit && cardinality >= limit) break;
+            } else if (!dstkey) {
                 if (encoding == OBJ_ENCODING_HT)
                     addReplyBulkCBuffer(c,elesds,sdslen(elesds));
                 else
                     addReplyBulkLongLong(c,intobj);
                 cardinality++;
+                replyStreamFlushIfNeeded(c);
             } else {
                 if (encoding == OBJ_ENCODING_INTSET) {
                     elesds = sdsfromlonglong(intobj);
@@ -892,6 +1168,9 @@ void sinterGenericCommand(client *c, robj **setkeys,
     }
     setTypeReleaseIterator(si);
 
+    if (cardinality_only) addReplyLongLong(c,cardinality);
+
+cleanup:
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
@@ -910,18 +1189,55 @@ void sinterGenericCommand(client *c, robj **setkeys,
         }
         signalModifiedKey(c->db,dstkey);
         server.dirty++;
-    } else {
+    } else if (replylen) {
         setDeferredSetLen(c,replylen,cardinality);
     }
     zfree(sets);
 }
 
 void sinterCommand(client *c) {
-    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,0,0);
+}
+
+/* SINTERCARD numkeys key [key ...] [LIMIT limit] */
+void sintercardCommand(client *c) {
+    long j;
+    long numkeys = 0;
+    long limit = 0;
+
+    if (getLongFromObjectOrReply(c,c->argv[1],&numkeys,NULL) != C_OK)
+        return;
+    if (numkeys < 1) {
+        addReplyError(c,"numkeys should be greater than 0");
+        return;
+    }
+    if (numkeys > (c->argc - 2)) {
+        addReplyError(c,"Number of keys can't be greater than number of args");
+        return;
+    }
+
+    j = numkeys + 2;
+    if (j < c->argc) {
+        if (j+2 == c->argc &&
+            !strcasecmp(c->argv[j]->ptr,"LIMIT"))
+        {
+            if (getLongFromObjectOrReply(c,c->argv[j+1],&limit,NULL) != C_OK)
+                return;
+            if (limit < 0) {
+                addReplyError(c,"LIMIT can't be negative");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    sinterGenericCommand(c,c->argv+2,numkeys,NULL,1,limit);
 }
 
 void sinterstoreCommand(client *c) {
-    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
+    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1],0,0);
 }
 
 #define SET_OP_UNION 0
@@ -39,9 +39,18 @@
 #define STREAM_ITEM_FLAG_NONE 0             /* No special flags. */
 #define STREAM_ITEM_FLAG_DELETED (1<<0)     /* Entry is deleted. Skip it. */
 #define STREAM_ITEM_FLAG_SAMEFIELDS (1<<1)  /* Same fields as master entry. */
+#define STREAM_ITEM_FLAG_INDEXED (1<<2)     /* Fields stored as indexes into
+                                               the master entry field table. */
+
+/* Maximum number of fields, both in the entry being added and in the master
+ * entry, for which we attempt the indexed fields encoding: it bounds the
+ * stack space used for the index table and the cost of matching every entry
+ * field against the master fields. */
+#define STREAM_ITEM_INDEXED_MAX_FIELDS 64
 
 void streamFreeCG(streamCG *cg);
-void streamFreeNACK(streamNACK *na);
+void streamFreeNACK(streamCG *cg, streamNACK *na);
+static void streamTrimUnregister(stream *s);
 size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer);
 
 /* -----------------------------------------------------------------------
@@ -55,18 +64,123 @@ stream *streamNew(void) {
     s->length = 0;
     s->last_id.ms = 0;
     s->last_id.seq = 0;
+    s->trim_id.ms = 0;
+    s->trim_id.seq = 0;
+    s->trim_dead_nodes = 0;
+    s->trim_link = NULL;
     s->cgroups = NULL; /* Created on demand to save memory when not used. */
+    s->tail_lp = NULL;
     return s;
 }
 
 /* Free a stream, including the listpacks stored inside the radix tree. */
 void freeStream(stream *s) {
+    streamTrimUnregister(s);
     raxFreeWithCallback(s->rax,(void(*)(void*))lpFree);
     if (s->cgroups)
         raxFreeWithCallback(s->cgroups,(void(*)(void*))streamFreeCG);
     zfree(s);
 }
 
+/* -----------------------------------------------------------------------
+ * Incremental release of trimmed radix tree nodes.
+ *
+ * Exact trimming (XTRIM / XADD with MAXLEN without '~') may have to get
+ * rid of a big number of radix tree nodes at once. Instead of paying for
+ * all the lpFree() and raxRemove() calls in the command itself, the trim
+ * just moves the stream trim watermark (trim_id) past the dead entries,
+ * fixes the logical length, and leaves the fully dead head nodes in the
+ * tree. Readers never see them because the stream iterator starts at the
+ * watermark, and the memory is reclaimed a few nodes at a time from
+ * serverCron(). A bio thread is not an option here since the radix tree
+ * is concurrently accessed by the main thread.
+ *
+ * The list of streams with nodes still to release is global: the mutex
+ * only serializes against freeStream(), that may run in a bio thread when
+ * keys are freed asynchronously.
+ * ----------------------------------------------------------------------- */
+
+#define STREAM_TRIM_NODES_PER_CYCLE 128 /* Max nodes released per cron call. */
+
+static pthread_mutex_t stream_trim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list *stream_trim_pending = NULL; /* Guarded by stream_trim_mutex. */
+
+/* Make sure 's' is inside the pending release list. Only called from the
+ * main thread, by the trimming functions. */
+static void streamTrimRegister(stream *s) {
+    pthread_mutex_lock(&stream_trim_mutex);
+    if (s->trim_link == NULL) {
+        if (stream_trim_pending == NULL)
+            stream_trim_pending = listCreate();
+        listAddNodeTail(stream_trim_pending,s);
+        s->trim_link = listLast(stream_trim_pending);
+    }
+    pthread_mutex_unlock(&stream_trim_mutex);
+}
+
+/* Remove 's' from the pending release list if it is there. Called when the
+ * stream is freed, possibly from a bio thread. */
+static void streamTrimUnregister(stream *s) {
+    if (stream_trim_pending == NULL) return;
+    pthread_mutex_lock(&stream_trim_mutex);
+    if (s->trim_link) {
+        listDelNode(stream_trim_pending,s->trim_link);
+        s->trim_link = NULL;
+    }
+    pthread_mutex_unlock(&stream_trim_mutex);
+}
+
+/* Active defrag may move the stream structure itself: update the pointer
+ * stored in the pending release list accordingly. */
+void streamTrimPendingUpdate(stream *s) {
+    if (s->trim_link == NULL) return;
+    pthread_mutex_lock(&stream_trim_mutex);
+    s->trim_link->value = s;
+    pthread_mutex_unlock(&stream_trim_mutex);
+}
+
+/* Physically release up to 'limit' radix tree nodes that are entirely below
+ * the trim watermark. Returns the number of nodes released. The caller is
+ * in charge of the pending list registration. */
+static size_t streamTrimReleaseNodes(stream *s, size_t limit) {
+    size_t released = 0;
+    while (s->trim_dead_nodes && released < limit) {
+        raxIterator ri;
+        raxStart(&ri,s->rax);
+        raxSeek(&ri,"^",NULL,0);
+        serverAssert(raxNext(&ri));
+        lpFree(ri.data);
+        raxRemove(s->rax,ri.key,ri.key_len,NULL);
+        raxStop(&ri);
+        s->trim_dead_nodes--;
+        released++;
+    }
+    /* Once a completely trimmed stream is drained nothing is left below
+     * the watermark: reset it, so that entries appended after XSETID moved
+     * the last ID backward are not hidden. */
+    if (s->trim_dead_nodes == 0 && s->length == 0) {
+        s->trim_id.ms = 0;
+        s->trim_id.seq = 0;
+    }
+    return released;
+}
+
+/* Called from serverCron(): release a bounded number of dead radix tree
+ * nodes from the streams trimmed since the last call. */
+void streamTrimCron(void) {
+    if (stream_trim_pending == NULL) return;
+    pthread_mutex_lock(&stream_trim_mutex);
+    size_t budget = STREAM_TRIM_NODES_PER_CYCLE;
+    while (budget && listLength(stream_trim_pending)) {
+        stream *s = listNodeValue(listFirst(stream_trim_pending));
+        budget -= streamTrimReleaseNodes(s,budget);
+        if (s->trim_dead_nodes) break; /* Budget exhausted on this stream. */
+        listDelNode(stream_trim_pending,s->trim_link);
+        s->trim_link = NULL;
+    }
+    pthread_mutex_unlock(&stream_trim_mutex);
+}
+
 /* Return the length of a stream. */
 unsigned long streamLength(const robj *subject) {
     stream *s = subject->ptr;
@@ -189,31 +303,53 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
 
     /* Check that the new ID is greater than the last entry ID
      * or return an error. Automatically generated IDs might
-     * overflow (and wrap-around) when incrementing the sequence 
+     * overflow (and wrap-around) when incrementing the sequence
        part. */
     if (streamCompareID(&id,&s->last_id) <= 0) return C_ERR;
 
-    /* Add the new entry. */
-    raxIterator ri;
-    raxStart(&ri,s->rax);
-    raxSeek(&ri,"$",NULL,0);
-
-    size_t lp_bytes = 0;        /* Total bytes in the tail listpack. */
-    unsigned char *lp = NULL;   /* Tail listpack pointer. */
-
-    /* Get a reference to the tail node listpack. */
-    if (raxNext(&ri)) {
-        lp = ri.data;
-        lp_bytes = lpBytes(lp);
+    /* If a previous trim logically emptied the stream, the radix tree may
+     * still contain dead nodes waiting for incremental release. Seeking
+     * the tail would land inside a dead node, below the trim watermark:
+     * release them now (this is the work the trim itself deferred). */
+    if (s->trim_dead_nodes && s->length == 0) {
+        streamTrimReleaseNodes(s,SIZE_MAX);
+        streamTrimUnregister(s);
     }
-    raxStop(&ri);
 
-    /* We have to add the key into the radix tree in lexicographic order,
+    /* Add the new entry.
+     *
+     * We have to add the key into the radix tree in lexicographic order,
      * to do so we consider the ID as a single 128 bit number written in
      * big endian, so that the most significant bytes are the first ones. */
     uint64_t rax_key[2];    /* Key in the radix tree containing the listpack.*/
     streamID master_id;     /* ID of the master entry in the listpack. */
 
+    size_t lp_bytes = 0;        /* Total bytes in the tail listpack. */
+    unsigned char *lp = NULL;   /* Tail listpack pointer. */
+    unsigned char *rax_lp = NULL; /* Pointer currently stored in the radix
+                                     tree for rax_key, to detect when a
+                                     reallocation makes an update needed. */
+
+    /* Get a reference to the tail node listpack: from the write cursor
+     * cached in the stream when possible, seeking the radix tree tail
+     * otherwise. */
+    if (s->tail_lp) {
+        lp = s->tail_lp;
+        lp_bytes = lpBytes(lp);
+        memcpy(rax_key,s->tail_key,sizeof(rax_key));
+    } else {
+        raxIterator ri;
+        raxStart(&ri,s->rax);
+        raxSeek(&ri,"$",NULL,0);
+        if (raxNext(&ri)) {
+            lp = ri.data;
+            lp_bytes = lpBytes(lp);
+            serverAssert(ri.key_len == sizeof(rax_key));
+            memcpy(rax_key,ri.key,sizeof(rax_key));
+        }
+        raxStop(&ri);
+    }
+
     /* Create a new listpack and radix tree node if needed. Note that when
      * a new listpack is created, we populate it with a "master entry". This
      * is just a set of fields that is taken as references in order to compress
@@ -261,11 +397,17 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     }
 
     int flags = STREAM_ITEM_FLAG_NONE;
+    int64_t field_index[STREAM_ITEM_INDEXED_MAX_FIELDS];
     if (lp == NULL || lp_bytes >= server.stream_node_max_bytes) {
         master_id = id;
         streamEncodeID(rax_key,&id);
-        /* Create the listpack having the master entry ID and fields. */
+        /* Create the listpack having the master entry ID and fields.
+         * Grow the allocation to the configured node size upfront: the
+         * node is going to fill up to it anyway, and this way the appends
+         * landing here don't reallocate at every entry. */
         lp = lpNew();
+        if (server.stream_node_max_bytes)
+            lp = lpPrealloc(lp,server.stream_node_max_bytes);
         lp = lpAppendInteger(lp,1); /* One item, the one we are adding. */
         lp = lpAppendInteger(lp,0); /* Zero deleted so far. */
         lp = lpAppendInteger(lp,numfields);
@@ -275,15 +417,14 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
         }
         lp = lpAppendInteger(lp,0); /* Master entry zero terminator. */
         raxInsert(s->rax,(unsigned char*)&rax_key,sizeof(rax_key),lp,NULL);
+        rax_lp = lp;
         /* The first entry we insert, has obviously the same fields of the
          * master entry. */
         flags |= STREAM_ITEM_FLAG_SAMEFIELDS;
     } else {
-        serverAssert(ri.key_len == sizeof(rax_key));
-        memcpy(rax_key,ri.key,sizeof(rax_key));
-
         /* Read the master ID from the radix tree key. */
         streamDecodeID(rax_key,&master_id);
+        rax_lp = lp;
         unsigned char *lp_ele = lpFirst(lp);
 
         /* Update count and skip the deleted fields. */
@@ -296,6 +437,7 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
          * as the master entry. */
         int64_t master_fields_count = lpGetInteger(lp_ele);
         lp_ele = lpNext(lp,lp_ele);
+        unsigned char *master_fields_start = lp_ele;
         if (numfields == master_fields_count) {
             int64_t i;
             for (i = 0; i < master_fields_count; i++) {
@@ -312,6 +454,37 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
              * setting a single bit in the flags. */
             if (i == master_fields_count) flags |= STREAM_ITEM_FLAG_SAMEFIELDS;
         }
+
+        /* Even when the fields are not exactly the master entry ones, they
+         * may still all exist in the master entry, just as a subset or in
+         * a different order: typical of metric samples where some column is
+         * occasionally omitted. In that case the master entry acts as the
+         * per-node field dictionary: we store, in place of each field name,
+         * its index inside the master entry field table, that is almost
+         * always a single byte once listpack-encoded. */
+        if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS) &&
+            numfields <= STREAM_ITEM_INDEXED_MAX_FIELDS &&
+            master_fields_count > 0 &&
+            master_fields_count <= STREAM_ITEM_INDEXED_MAX_FIELDS)
+        {
+            int64_t i;
+            for (i = 0; i < numfields; i++) {
+                sds field = argv[i*2]->ptr;
+                unsigned char *mf = master_fields_start;
+                int64_t j;
+                for (j = 0; j < master_fields_count; j++) {
+                    int64_t e_len;
+                    unsigned char buf[LP_INTBUF_SIZE];
+                    unsigned char *e = lpGet(mf,&e_len,buf);
+                    if (sdslen(field) == (size_t)e_len &&
+                        memcmp(e,field,e_len) == 0) break;
+                    mf = lpNext(lp,mf);
+                }
+                if (j == master_fields_count) break; /* Unknown field. */
+                field_index[i] = j;
+            }
+            if (i == numfields) flags |= STREAM_ITEM_FLAG_INDEXED;
+        }
     }
 
     /* Populate the listpack with the new entry. We use the following
@@ -328,6 +501,14 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
      * |flags|entry-id|value-1|...|value-N|lp-count|
      * +-----+--------+-------+-/-+-------+--------+
      *
+     * With the INDEXED flag set instead the structure is the same as the
+     * full one, but every field-K element is a small integer: the index of
+     * the field name inside the master entry field table. This compresses
+     * entries whose fields are a subset, or a reordering, of the master
+     * entry fields, and being element-for-element identical to the full
+     * layout it does not affect the reverse traversal nor the entry
+     * skipping arithmetic.
+     *
      * The entry-id field is actually two separated fields: the ms
      * and seq difference compared to the master entry.
      *
@@ -343,7 +524,9 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
         lp = lpAppendInteger(lp,numfields);
     for (int64_t i = 0; i < numfields; i++) {
         sds field = argv[i*2]->ptr, value = argv[i*2+1]->ptr;
-        if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
+        if (flags & STREAM_ITEM_FLAG_INDEXED)
+            lp = lpAppendInteger(lp,field_index[i]);
+        else if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
             lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
         lp = lpAppend(lp,(unsigned char*)value,sdslen(value));
     }
@@ -358,8 +541,11 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     lp = lpAppendInteger(lp,lp_count);
 
     /* Insert back into the tree in order to update the listpack pointer. */
-    if (ri.data != lp)
+    if (rax_lp != lp)
         raxInsert(s->rax,(unsigned char*)&rax_key,sizeof(rax_key),lp,NULL);
+    /* Remember the tail node as the write cursor for the next append. */
+    s->tail_lp = lp;
+    memcpy(s->tail_key,rax_key,sizeof(rax_key));
     s->length++;
     s->last_id = id;
     if (added_id) *added_id = id;
@@ -383,26 +569,51 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
 int64_t streamTrimByLength(stream *s, size_t maxlen, int approx) {
     if (s->length <= maxlen) return 0;
 
+    /* Trimming may remove or rewrite any node, including the tail:
+     * drop the append write cursor. */
+    s->tail_lp = NULL;
+
     raxIterator ri;
     raxStart(&ri,s->rax);
     raxSeek(&ri,"^",NULL,0);
 
     int64_t deleted = 0;
-    while(s->length > maxlen && raxNext(&ri)) {
+    uint64_t skip = s->trim_dead_nodes;
+    while(raxNext(&ri)) {
+        /* Head nodes already below the watermark because of a previous
+         * trim are waiting for incremental release: don't account for
+         * them twice. */
+        if (skip) {
+            skip--;
+            continue;
+        }
+
+        if (s->length <= maxlen) {
+            /* Enough entries deleted before reaching this node: it is the
+             * first surviving one, so the watermark moves here in order
+             * for readers to skip the dead nodes we left behind. */
+            streamDecodeID(ri.key,&s->trim_id);
+            break;
+        }
+
         unsigned char *lp = ri.data, *p = lpFirst(lp);
         int64_t entries = lpGetInteger(p);
 
         /* Check if we can remove the whole node, and still have at
-         * least maxlen elements. */
+         * least maxlen elements. Instead of freeing it right away, just
+         * fix the logical length and remember it is dead: the node is
+         * released incrementally by streamTrimCron(). */
         if (s->length - entries >= maxlen) {
-            lpFree(lp);
-            raxRemove(s->rax,ri.key,ri.key_len,NULL);
-            raxSeek(&ri,">=",ri.key,ri.key_len);
             s->length -= entries;
             deleted += entries;
+            s->trim_dead_nodes++;
             continue;
         }
 
+        /* This node survives (at least in part): it is the new trim
+         * watermark. */
+        streamDecodeID(ri.key,&s->trim_id);
+
         /* If we cannot remove a whole element, and approx is true,
          * stop here. */
         if (approx) break;
@@ -470,6 +681,16 @@ int64_t streamTrimByLength(stream *s, size_t maxlen, int approx) {
     }
 
     raxStop(&ri);
+
+    /* If we ran out of nodes, the trim deleted every entry: place the
+     * watermark right after the last generated ID. */
+    if (s->length == 0 && s->trim_dead_nodes) {
+        s->trim_id = s->last_id;
+        s->trim_id.seq++;
+        if (s->trim_id.seq == 0) s->trim_id.ms++;
+    }
+
+    if (s->trim_dead_nodes) streamTrimRegister(s);
     return deleted;
 }
 
@@ -496,13 +717,18 @@ int64_t streamTrimByLength(stream *s, size_t maxlen, int approx) {
  *  streamIteratorStop(&myiterator); */
 void streamIteratorStart(streamIterator *si, stream *s, streamID *start, streamID *end, int rev) {
     /* Initialize the iterator and translates the iteration start/stop
-     * elements into a 128 big big-endian number. */
+     * elements into a 128 big big-endian number. Entries below the trim
+     * watermark are logically deleted even if their radix tree node was
+     * not released yet, so the start of the iteration is clamped to it. */
+    streamID startid;
     if (start) {
-        streamEncodeID(si->start_key,start);
+        startid = *start;
     } else {
-        si->start_key[0] = 0;
-        si->start_key[1] = 0;
+        startid.ms = 0;
+        startid.seq = 0;
     }
+    if (streamCompareID(&startid,&s->trim_id) < 0) startid = s->trim_id;
+    streamEncodeID(si->start_key,&startid);
 
     if (end) {
         streamEncodeID(si->end_key,end);
@@ -514,7 +740,7 @@ void streamIteratorStart(streamIterator *si, stream *s, streamID *start, streamI
     /* Seek the correct node in the radix tree. */
     raxStart(&si->ri,s->rax);
     if (!rev) {
-        if (start && (start->ms || start->seq)) {
+        if (startid.ms || startid.seq) {
             raxSeek(&si->ri,"<=",(unsigned char*)si->start_key,
                     sizeof(si->start_key));
             if (raxEOF(&si->ri)) raxSeek(&si->ri,"^",NULL,0);
@@ -688,6 +914,14 @@ void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsign
     if (si->entry_flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
         *fieldptr = lpGet(si->master_fields_ptr,fieldlen,si->field_buf);
         si->master_fields_ptr = lpNext(si->lp,si->master_fields_ptr);
+    } else if (si->entry_flags & STREAM_ITEM_FLAG_INDEXED) {
+        /* The entry stores the index of the field inside the master entry
+         * field table: resolve it seeking the table from its start. */
+        int64_t idx = lpGetInteger(si->lp_ele);
+        si->lp_ele = lpNext(si->lp,si->lp_ele);
+        unsigned char *mf = si->master_fields_start;
+        while(idx--) mf = lpNext(si->lp,mf);
+        *fieldptr = lpGet(mf,fieldlen,si->field_buf);
     } else {
         *fieldptr = lpGet(si->lp_ele,fieldlen,si->field_buf);
         si->lp_ele = lpNext(si->lp,si->lp_ele);
@@ -710,6 +944,10 @@ void streamIteratorRemoveEntry(streamIterator *si, streamID *current) {
     unsigned char *lp = si->lp;
     int64_t aux;
 
+    /* The deletion may remove or rewrite any node, including the tail:
+     * drop the append write cursor. */
+    si->stream->tail_lp = NULL;
+
     /* We do not really delete the entry here. Instead we mark it as
      * deleted flagging it, and also incrementing the count of the
      * deleted entries in the listpack header.
@@ -964,7 +1202,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
             /* Try to add a new NACK. Most of the time this will work and
              * will not require extra lookups. We'll fix the problem later
              * if we find that there is already a entry for this ID. */
-            streamNACK *nack = streamCreateNACK(consumer);
+            streamNACK *nack = streamCreateNACK(group,consumer);
             int group_inserted =
                 raxTryInsert(group->pel,buf,sizeof(buf),nack,NULL);
             int consumer_inserted =
@@ -974,7 +1212,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
              * in that case reassign the entry to the new consumer,
              * or update it if the consumer is the same as before. */
             if (group_inserted == 0) {
-                streamFreeNACK(nack);
+                streamFreeNACK(group,nack);
                 nack = raxFind(group->pel,buf,sizeof(buf));
                 serverAssert(nack != raxNotFound);
                 raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
@@ -1590,18 +1828,40 @@ cleanup: /* Cleanup. */
 
 /* Create a NACK entry setting the delivery count to 1 and the delivery
  * time to the current time. The NACK consumer will be set to the one
- * specified as argument of the function. */
-streamNACK *streamCreateNACK(streamConsumer *consumer) {
-    streamNACK *nack = zmalloc(sizeof(*nack));
+ * specified as argument of the function.
+ *
+ * The entry is carved from the arena of the consumer group 'cg': either
+ * recycling a previously acknowledged NACK from the free list, or from
+ * the most recent arena block, allocating a new block only once every
+ * STREAM_NACK_BLOCK_SIZE entries. This way delivering a batch of entries
+ * costs at most one allocation instead of one per entry. */
+streamNACK *streamCreateNACK(streamCG *cg, streamConsumer *consumer) {
+    streamNACK *nack;
+
+    if (cg->nack_freelist) {
+        nack = cg->nack_freelist;
+        cg->nack_freelist = (streamNACK*)nack->consumer;
+    } else {
+        streamNACKBlock *block = cg->nack_blocks;
+        if (block == NULL || block->used == STREAM_NACK_BLOCK_SIZE) {
+            block = zmalloc(sizeof(*block));
+            block->used = 0;
+            block->next = cg->nack_blocks;
+            cg->nack_blocks = block;
+        }
+        nack = &block->nacks[block->used++];
+    }
     nack->delivery_time = mstime();
     nack->delivery_count = 1;
     nack->consumer = consumer;
     return nack;
 }
 
-/* Free a NACK entry. */
-void streamFreeNACK(streamNACK *na) {
-    zfree(na);
+/* Free a NACK entry: the memory goes back to the free list of the group
+ * arena, ready to be reused by the next delivery. */
+void streamFreeNACK(streamCG *cg, streamNACK *na) {
+    na->consumer = (streamConsumer*)cg->nack_freelist;
+    cg->nack_freelist = na;
 }
 
 /* Free a consumer and associated data structures. Note that this function
@@ -1629,14 +1889,23 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
     cg->pel = raxNew();
     cg->consumers = raxNew();
     cg->last_id = *id;
+    cg->nack_blocks = NULL;
+    cg->nack_freelist = NULL;
     raxInsert(s->cgroups,(unsigned char*)name,namelen,cg,NULL);
     return cg;
 }
 
 /* Free a consumer group and all its associated data. */
 void streamFreeCG(streamCG *cg) {
-    raxFreeWithCallback(cg->pel,(void(*)(void*))streamFreeNACK);
+    raxFree(cg->pel); /* No value free callback: the NACKs are carved from
+                         the group arena, released below in one pass. */
     raxFreeWithCallback(cg->consumers,(void(*)(void*))streamFreeConsumer);
+    streamNACKBlock *block = cg->nack_blocks;
+    while (block) {
+        streamNACKBlock *next = block->next;
+        zfree(block);
+        block = next;
+    }
     zfree(cg);
 }
 
@@ -1685,7 +1954,7 @@ uint64_t streamDelConsumer(streamCG *cg, sds name) {
     while(raxNext(&ri)) {
         streamNACK *nack = ri.data;
         raxRemove(cg->pel,ri.key,ri.key_len,NULL);
-        streamFreeNACK(nack);
+        streamFreeNACK(cg,nack);
     }
     raxStop(&ri);
 
@@ -1904,7 +2173,7 @@ void xackCommand(client *c) {
         if (nack != raxNotFound) {
             raxRemove(group->pel,buf,sizeof(buf),NULL);
             raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-            streamFreeNACK(nack);
+            streamFreeNACK(group,nack);
             acknowledged++;
             server.dirty++;
         }
@@ -2255,7 +2524,7 @@ void xclaimCommand(client *c) {
             if (!found) continue;
 
             /* Create the NACK. */
-            nack = streamCreateNACK(NULL);
+            nack = streamCreateNACK(group,NULL);
             raxInsert(group->pel,buf,sizeof(buf),nack,NULL);
         }
 
@@ -63,6 +63,9 @@ static int checkStringLength(client *c, long long size) {
 #define OBJ_SET_XX (1<<1)     /* Set if key exists. */
 #define OBJ_SET_EX (1<<2)     /* Set if time in seconds is given */
 #define OBJ_SET_PX (1<<3)     /* Set if time in ms in given */
+#define OBJ_SET_PERSIST (1<<4) /* GETEX only: clear the TTL if any */
+#define OBJ_SET_EXAT (1<<5)   /* GETEX only: absolute deadline in seconds */
+#define OBJ_SET_PXAT (1<<6)   /* GETEX only: absolute deadline in ms */
 
 void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire, int unit, robj *ok_reply, robj *abort_reply) {
     long long milliseconds = 0; /* initialized to avoid any harmness warning */
@@ -164,7 +167,8 @@ int getGenericCommand(client *c) {
         addReply(c,shared.wrongtypeerr);
         return C_ERR;
     } else {
-        addReplyBulk(c,o);
+        if (!replyCacheAddReply(c,c->db,c->argv[1]->ptr,o))
+            addReplyBulk(c,o);
         return C_OK;
     }
 }
@@ -181,6 +185,129 @@ void getsetCommand(client *c) {
     server.dirty++;
 }
 
+/* GETDEL key
+ *
+ * Get the value of key and remove the key, in a single command. This saves
+ * the cache-aside pattern a round trip and a second keyspace lookup
+ * compared to issuing GET followed by DEL. */
+void getdelCommand(client *c) {
+    robj *o;
+
+    if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.null[c->resp])) == NULL)
+        return;
+    if (checkType(c,o,OBJ_STRING)) return;
+    addReplyBulk(c,o);
+
+    serverAssertWithInfo(c,c->argv[1],dbSyncDelete(c->db,c->argv[1]));
+    server.dirty++;
+    /* Propagate as an explicit DEL: the read half has no effect on
+     * replicas, and a verbatim GETDEL would waste their output buffers. */
+    rewriteClientCommandVector(c,2,shared.del,c->argv[1]);
+    signalModifiedKey(c->db,c->argv[1]);
+    notifyKeyspaceEvent(NOTIFY_GENERIC,"del",c->argv[1],c->db->id);
+}
+
+/* GETEX key [EX <seconds> | PX <milliseconds> | PERSIST]
+ *
+ * Get the value of key and optionally alter its time to live, sharing a
+ * single keyspace lookup between the read and the expire update. With no
+ * options it behaves as a plain GET and propagates nothing. */
+void getexCommand(client *c) {
+    robj *expire = NULL;
+    int unit = UNIT_SECONDS;
+    int flags = OBJ_SET_NO_FLAGS;
+    long long milliseconds = 0;
+    int j;
+
+    for (j = 2; j < c->argc; j++) {
+        char *a = c->argv[j]->ptr;
+        robj *next = (j == c->argc-1) ? NULL : c->argv[j+1];
+
+        if ((a[0] == 'e' || a[0] == 'E') &&
+            (a[1] == 'x' || a[1] == 'X') && a[2] == '\0' &&
+            !(flags & (OBJ_SET_PX|OBJ_SET_EXAT|OBJ_SET_PXAT|
+                       OBJ_SET_PERSIST)) && next)
+        {
+            flags |= OBJ_SET_EX;
+            unit = UNIT_SECONDS;
+            expire = next;
+            j++;
+        } else if ((a[0] == 'p' || a[0] == 'P') &&
+                   (a[1] == 'x' || a[1] == 'X') && a[2] == '\0' &&
+                   !(flags & (OBJ_SET_EX|OBJ_SET_EXAT|OBJ_SET_PXAT|
+                              OBJ_SET_PERSIST)) && next)
+        {
+            flags |= OBJ_SET_PX;
+            unit = UNIT_MILLISECONDS;
+            expire = next;
+            j++;
+        } else if (!strcasecmp(a,"exat") &&
+                   !(flags & (OBJ_SET_EX|OBJ_SET_PX|OBJ_SET_PXAT|
+                              OBJ_SET_PERSIST)) && next)
+        {
+            flags |= OBJ_SET_EXAT;
+            unit = UNIT_SECONDS;
+            expire = next;
+            j++;
+        } else if (!strcasecmp(a,"pxat") &&
+                   !(flags & (OBJ_SET_EX|OBJ_SET_PX|OBJ_SET_EXAT|
+                              OBJ_SET_PERSIST)) && next)
+        {
+            flags |= OBJ_SET_PXAT;
+            unit = UNIT_MILLISECONDS;
+            expire = next;
+            j++;
+        } else if (!strcasecmp(a,"persist") &&
+                   !(flags & (OBJ_SET_EX|OBJ_SET_PX|OBJ_SET_EXAT|
+                              OBJ_SET_PXAT)))
+        {
+            flags |= OBJ_SET_PERSIST;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    if (expire) {
+        if (getLongLongFromObjectOrReply(c, expire, &milliseconds, NULL) != C_OK)
+            return;
+        if (milliseconds <= 0) {
+            addReplyErrorFormat(c,"invalid expire time in %s",c->cmd->name);
+            return;
+        }
+        if (unit == UNIT_SECONDS) milliseconds *= 1000;
+    }
+
+    robj *o;
+    if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.null[c->resp])) == NULL)
+        return;
+    if (checkType(c,o,OBJ_STRING)) return;
+    addReplyBulk(c,o);
+
+    if (expire) {
+        /* EXAT/PXAT carry the absolute deadline themselves. */
+        long long when = milliseconds;
+        if (!(flags & (OBJ_SET_EXAT|OBJ_SET_PXAT))) when += mstime();
+        robj *when_obj = createStringObjectFromLongLong(when);
+
+        setExpire(c,c->db,c->argv[1],when);
+        /* Propagate as PEXPIREAT so that master and replicas agree on
+         * the absolute deadline. */
+        rewriteClientCommandVector(c,3,shared.pexpireat,c->argv[1],when_obj);
+        decrRefCount(when_obj);
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"expire",c->argv[1],c->db->id);
+        server.dirty++;
+    } else if (flags & OBJ_SET_PERSIST) {
+        if (removeExpire(c->db,c->argv[1])) {
+            rewriteClientCommandVector(c,2,shared.persist,c->argv[1]);
+            signalModifiedKey(c->db,c->argv[1]);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"persist",c->argv[1],c->db->id);
+            server.dirty++;
+        }
+    }
+}
+
 void setrangeCommand(client *c) {
     robj *o;
     long offset;
@@ -277,15 +404,234 @@ void getrangeCommand(client *c) {
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         addReply(c,shared.emptybulk);
+    } else if (o->encoding == OBJ_ENCODING_RAW) {
+        /* Reference the range instead of copying it: for the huge values
+         * GETRANGE is typically used against, the copy dominates. */
+        addReplyBulkRange(c,o,start,end-start+1);
     } else {
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
     }
 }
 
+/* STRRANGE key [GET <start> <end>] [SET <offset> <value>] ...
+ *
+ * Batched ranged reads and writes against a single string key: this is to
+ * GETRANGE/SETRANGE what BITFIELD is to the single bit operations. The key
+ * is resolved once and a single array is emitted, with one entry per
+ * operation in the order given. GET entries follow GETRANGE semantics
+ * (negative indexes allowed, empty bulk on out of range), SET entries
+ * reply with the resulting string length like SETRANGE.
+ *
+ * As with BITFIELD, when the command contains writes the string is
+ * extended up front to the highest written offset, so GET operations
+ * observe the final length even when they precede a SET. */
+
+#define STRRANGEOP_GET 0
+#define STRRANGEOP_SET 1
+
+struct strrangeOp {
+    int opcode;         /* STRRANGEOP_GET or STRRANGEOP_SET. */
+    long long start;    /* GET range start, may be negative. */
+    long long end;      /* GET range end, may be negative. */
+    long offset;        /* SET destination offset. */
+    robj *value;        /* SET payload: points into argv, not owned. */
+};
+
+void strrangeCommand(client *c) {
+    robj *o;
+    struct strrangeOp *ops = NULL; /* Array of ops to execute at end. */
+    int j, numops = 0, changes = 0;
+    int readonly = 1;
+    long long highest_write_end = 0; /* Length implied by the farthest SET. */
+
+    for (j = 2; j < c->argc; j++) {
+        int remargs = c->argc-j-1; /* Remaining args other than current. */
+        char *subcmd = c->argv[j]->ptr;
+
+        if (!strcasecmp(subcmd,"get") && remargs >= 2) {
+            long long start, end;
+
+            if (getLongLongFromObjectOrReply(c,c->argv[j+1],&start,NULL)
+                    != C_OK ||
+                getLongLongFromObjectOrReply(c,c->argv[j+2],&end,NULL)
+                    != C_OK)
+            {
+                zfree(ops);
+                return;
+            }
+            ops = zrealloc(ops,sizeof(*ops)*(numops+1));
+            ops[numops].opcode = STRRANGEOP_GET;
+            ops[numops].start = start;
+            ops[numops].end = end;
+            ops[numops].offset = 0;
+            ops[numops].value = NULL;
+            numops++;
+        } else if (!strcasecmp(subcmd,"set") && remargs >= 2) {
+            long offset;
+            robj *value = c->argv[j+2];
+
+            if (getLongFromObjectOrReply(c,c->argv[j+1],&offset,NULL) != C_OK)
+            {
+                zfree(ops);
+                return;
+            }
+            if (offset < 0) {
+                addReplyError(c,"offset is out of range");
+                zfree(ops);
+                return;
+            }
+            if (checkStringLength(c,offset+sdslen(value->ptr)) != C_OK) {
+                zfree(ops);
+                return;
+            }
+            readonly = 0;
+            if (sdslen(value->ptr) &&
+                offset+(long long)sdslen(value->ptr) > highest_write_end)
+                highest_write_end = offset+sdslen(value->ptr);
+            ops = zrealloc(ops,sizeof(*ops)*(numops+1));
+            ops[numops].opcode = STRRANGEOP_SET;
+            ops[numops].start = 0;
+            ops[numops].end = 0;
+            ops[numops].offset = offset;
+            ops[numops].value = value;
+            numops++;
+        } else {
+            addReply(c,shared.syntaxerr);
+            zfree(ops);
+            return;
+        }
+        j += 2;
+    }
+
+    if (readonly) {
+        /* Lookup for read is ok if the key doesn't exist, but errors
+         * if it's not a string. */
+        o = lookupKeyRead(c->db,c->argv[1]);
+        if (o != NULL && checkType(c,o,OBJ_STRING)) {
+            zfree(ops);
+            return;
+        }
+    } else {
+        o = lookupKeyWrite(c->db,c->argv[1]);
+        if (o == NULL) {
+            /* Zero-length SETs on a missing key set nothing, exactly like
+             * SETRANGE: only create the string if something is written. */
+            if (highest_write_end) {
+                o = createObject(OBJ_STRING,
+                                 sdsnewlen(NULL,highest_write_end));
+                dbAdd(c->db,c->argv[1],o);
+            }
+        } else {
+            if (checkType(c,o,OBJ_STRING)) {
+                zfree(ops);
+                return;
+            }
+            /* Create a copy when the object is shared or encoded. */
+            if (highest_write_end) {
+                o = dbUnshareStringValue(c->db,c->argv[1],o);
+                if (highest_write_end > (long long)sdslen(o->ptr))
+                    o->ptr = sdsgrowzero(o->ptr,highest_write_end);
+            }
+        }
+    }
+
+    addReplyArrayLen(c,numops);
+
+    /* Actually process the operations. */
+    for (j = 0; j < numops; j++) {
+        struct strrangeOp *thisop = ops+j;
+
+        if (thisop->opcode == STRRANGEOP_GET) {
+            char *str, llbuf[32];
+            size_t strlen;
+            long long start = thisop->start, end = thisop->end;
+
+            if (o == NULL) {
+                addReply(c,shared.emptybulk);
+                continue;
+            }
+            if (o->encoding == OBJ_ENCODING_INT) {
+                str = llbuf;
+                strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+            } else {
+                str = o->ptr;
+                strlen = sdslen(str);
+            }
+
+            /* Convert negative indexes. */
+            if (start < 0 && end < 0 && start > end) {
+                addReply(c,shared.emptybulk);
+                continue;
+            }
+            if (start < 0) start = strlen+start;
+            if (end < 0) end = strlen+end;
+            if (start < 0) start = 0;
+            if (end < 0) end = 0;
+            if ((unsigned long long)end >= strlen) end = strlen-1;
+
+            if (start > end || strlen == 0) {
+                addReply(c,shared.emptybulk);
+            } else if (readonly && o->encoding == OBJ_ENCODING_RAW) {
+                /* Read only invocations reference the payload like
+                 * GETRANGE does: no SET in this command can touch the
+                 * string, and later commands duplicate shared values
+                 * before mutating them (see dbUnshareStringValue()), so
+                 * the pinned range stays valid until flushed. */
+                addReplyBulkRange(c,o,start,end-start+1);
+            } else {
+                /* When the command also writes we copy the range: a
+                 * later SET may overwrite the string in place before
+                 * the reply is flushed. */
+                addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
+            }
+        } else {
+            sds value = thisop->value->ptr;
+
+            if (sdslen(value) == 0) {
+                addReplyLongLong(c,o ? stringObjectLen(o) : 0);
+                continue;
+            }
+            /* 'o' exists, is raw, and was already grown to cover the
+             * farthest write above. */
+            memcpy((char*)o->ptr+thisop->offset,value,sdslen(value));
+            changes++;
+            addReplyLongLong(c,sdslen(o->ptr));
+        }
+    }
+
+    if (changes) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_STRING,"setrange",c->argv[1],c->db->id);
+        server.dirty += changes;
+    }
+    zfree(ops);
+}
+
 void mgetCommand(client *c) {
     int j;
 
     addReplyArrayLen(c,c->argc-1);
+
+    /* For large batches try to resolve the lookups in parallel on the
+     * I/O threads (see ioThreadsLookupKeys()), and only assemble the
+     * reply here: with hundreds of keys the lookups are a chain of
+     * dependent cache misses, so they scale with cores while building
+     * the reply does not. */
+    robj *statics[64];
+    robj **vals = (c->argc-1 <= 64) ? statics :
+                  zmalloc(sizeof(robj*)*(c->argc-1));
+    if (ioThreadsLookupKeys(c,c->argv+1,c->argc-1,vals)) {
+        for (j = 0; j < c->argc-1; j++) {
+            if (vals[j] == NULL || vals[j]->type != OBJ_STRING)
+                addReplyNull(c);
+            else
+                addReplyBulk(c,vals[j]);
+        }
+        if (vals != statics) zfree(vals);
+        return;
+    }
+    if (vals != statics) zfree(vals);
+
     for (j = 1; j < c->argc; j++) {
         robj *o = lookupKeyRead(c->db,c->argv[j]);
         if (o == NULL) {
@@ -319,9 +665,28 @@ void msetGenericCommand(client *c, int nx) {
         }
     }
 
+    /* Keys not present yet are inserted in bulk through dbAddBatch(),
+     * which sizes the destination hash table once for the whole command
+     * and amortizes the incremental rehash work; existing keys go through
+     * the usual overwrite path. */
+    int numnew = 0;
+    robj **newkeys = zmalloc(sizeof(robj*)*(c->argc-1));
+    robj **newvals = newkeys + (c->argc-1)/2;
     for (j = 1; j < c->argc; j += 2) {
         c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
-        setKey(c->db,c->argv[j],c->argv[j+1]);
+        incrRefCount(c->argv[j+1]);
+        if (lookupKeyWrite(c->db,c->argv[j]) == NULL) {
+            newkeys[numnew] = c->argv[j];
+            newvals[numnew++] = c->argv[j+1];
+        } else {
+            dbOverwrite(c->db,c->argv[j],c->argv[j+1]);
+            removeExpire(c->db,c->argv[j]);
+        }
+    }
+    dbAddBatch(c->db,newkeys,newvals,numnew);
+    zfree(newkeys);
+    for (j = 1; j < c->argc; j += 2) {
+        signalModifiedKey(c->db,c->argv[j]);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",c->argv[j],c->db->id);
     }
     server.dirty += (c->argc-1)/2;
@@ -452,8 +817,13 @@ void appendCommand(client *c) {
         if (checkStringLength(c,totlen) != C_OK)
             return;
 
-        /* Append the value */
+        /* Append the value. For strings past the preallocation limit grow
+         * geometrically (1.5x the resulting length), otherwise a long run of
+         * appends to a big string degrades to one realloc per call. */
         o = dbUnshareStringValue(c->db,c->argv[1],o);
+        if (totlen > SDS_MAX_PREALLOC)
+            o->ptr = sdsMakeRoomForHint(o->ptr,sdslen(append->ptr),
+                                        totlen+totlen/2);
         o->ptr = sdscatlen(o->ptr,append->ptr,sdslen(append->ptr));
         totlen = sdslen(o->ptr);
     }
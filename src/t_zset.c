@@ -40,12 +40,21 @@
  * At the same time the elements are added to a skip list mapping scores
  * to Redis objects (so objects are sorted by scores in this "view").
  *
- * Note that the SDS string representing the element is the same in both
- * the hash table and skiplist in order to save memory. What we do in order
- * to manage the shared SDS string more easily is to free the SDS string
- * only in zslFreeNode(). The dictionary has no value free method set.
- * So we should always remove an element from the dictionary, and later from
- * the skiplist.
+ * Note that the SDS string representing the element is stored inline in
+ * the skiplist node itself, and the hash table references that same copy
+ * as its key in order to save memory. The dictionary has no key or value
+ * free method set: the element storage is released together with the node
+ * by zslFreeNode(). So we should always remove an element from the
+ * dictionary, and later from the skiplist.
+ *
+ * Nodes are not allocated individually: each skiplist owns an arena of
+ * large blocks the nodes are carved from in insertion order, with per size
+ * class free lists to recycle deleted nodes. Since with skiplists elements
+ * are mostly inserted in already sorted batches (leaderboard updates, set
+ * operations results, RDB loading), forward traversals like ZRANGEBYSCORE
+ * largely touch sequential cache lines instead of pointer chasing across
+ * the whole heap, and the element string comes for free with the node's
+ * cache line.
  *
  * This skiplist implementation is almost a C translation of the original
  * algorithm described by William Pugh in "Skip Lists: A Probabilistic
@@ -66,13 +75,156 @@
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
-/* Create a skiplist node with the specified number of levels.
- * The SDS string 'ele' is referenced by the node after the call. */
-zskiplistNode *zslCreateNode(int level, double score, sds ele) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
+/* ----------------------------------------------------------------------
+ * Skiplist node arena.
+ *
+ * Every allocation is prefixed by a size_t header holding the rounded
+ * allocation size, or zero for oversized allocations served directly by
+ * the heap. Freed arena allocations are pushed on the free list of their
+ * size class and reused by later inserts; the memory goes back to the
+ * allocator only when the whole skiplist is released.
+ * ----------------------------------------------------------------------*/
+
+#define ZSL_ARENA_BLOCK_BYTES (16*1024)
+#define ZSL_ARENA_CLASS_STEP 16
+#define ZSL_ARENA_MAX_ALLOC 1024 /* Larger allocations go to the heap. */
+#define ZSL_ARENA_CLASSES (ZSL_ARENA_MAX_ALLOC/ZSL_ARENA_CLASS_STEP)
+
+typedef struct zslArenaBlock {
+    struct zslArenaBlock *next;
+    size_t used;
+    char buf[];
+} zslArenaBlock;
+
+typedef struct zslArena {
+    zslArenaBlock *blocks; /* All the blocks, current one first. */
+    void *freelist[ZSL_ARENA_CLASSES]; /* Recycled nodes by size class. */
+    size_t block_bytes; /* Total allocator bytes used by the blocks. */
+    size_t heap_bytes;  /* Allocator bytes used by oversized nodes. */
+} zslArena;
+
+static zslArena *zslArenaCreate(void) {
+    return zcalloc(sizeof(zslArena));
+}
+
+static void *zslArenaAlloc(zslArena *a, size_t size) {
+    size_t need = size + sizeof(size_t);
+    size_t *p;
+
+    if (need > ZSL_ARENA_MAX_ALLOC) {
+        p = zmalloc(need);
+        a->heap_bytes += zmalloc_size(p);
+        *p = 0;
+        return p+1;
+    }
+    need = (need + ZSL_ARENA_CLASS_STEP-1) & ~(size_t)(ZSL_ARENA_CLASS_STEP-1);
+    int cls = need/ZSL_ARENA_CLASS_STEP - 1;
+    if (a->freelist[cls]) {
+        p = (size_t*)a->freelist[cls] - 1;
+        a->freelist[cls] = *(void**)(p+1);
+        return p+1;
+    }
+    zslArenaBlock *b = a->blocks;
+    if (b == NULL || ZSL_ARENA_BLOCK_BYTES - b->used < need) {
+        b = zmalloc(sizeof(*b)+ZSL_ARENA_BLOCK_BYTES);
+        a->block_bytes += zmalloc_size(b);
+        b->used = 0;
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+    p = (size_t*)(b->buf+b->used);
+    b->used += need;
+    *p = need;
+    return p+1;
+}
+
+static void zslArenaFree(zslArena *a, void *ptr) {
+    size_t *p = (size_t*)ptr - 1;
+
+    if (*p == 0) {
+        a->heap_bytes -= zmalloc_size(p);
+        zfree(p);
+        return;
+    }
+    int cls = *p/ZSL_ARENA_CLASS_STEP - 1;
+    *(void**)ptr = a->freelist[cls];
+    a->freelist[cls] = ptr;
+}
+
+/* Release the arena with all its blocks. Oversized heap allocations are
+ * not tracked here and must have been freed one by one already. */
+static void zslArenaRelease(zslArena *a) {
+    zslArenaBlock *b = a->blocks, *next;
+
+    while(b) {
+        next = b->next;
+        zfree(b);
+        b = next;
+    }
+    zfree(a);
+}
+
+/* Total allocator bytes used for the skiplist nodes and their inline
+ * elements: used by objectComputeSize() for exact instead of sampled
+ * accounting. */
+size_t zslAllocatedBytes(zskiplist *zsl) {
+    return zsl->arena->block_bytes + zsl->arena->heap_bytes;
+}
+
+/* Bytes needed to store a copy of 'ele' as an inline sds string. */
+static size_t zslInlineEleSize(sds ele) {
+    size_t len = sdslen(ele);
+    size_t hdr = len < 1<<5 ? 1 :
+                 len < 1<<8 ? sizeof(struct sdshdr8) :
+                 len < 1<<16 ? sizeof(struct sdshdr16) :
+                               sizeof(struct sdshdr32);
+    return hdr+len+1;
+}
+
+/* Write a copy of 'ele' into 'buf' (zslInlineEleSize() bytes available)
+ * and return the inline sds string. */
+static sds zslInlineEleWrite(char *buf, sds ele) {
+    size_t len = sdslen(ele);
+    char *s;
+
+    if (len < 1<<5) {
+        buf[0] = SDS_TYPE_5 | (len << SDS_TYPE_BITS);
+        s = buf+1;
+    } else if (len < 1<<8) {
+        struct sdshdr8 *sh = (void*)buf;
+        sh->len = sh->alloc = len;
+        sh->flags = SDS_TYPE_8;
+        s = sh->buf;
+    } else if (len < 1<<16) {
+        struct sdshdr16 *sh = (void*)buf;
+        sh->len = sh->alloc = len;
+        sh->flags = SDS_TYPE_16;
+        s = sh->buf;
+    } else {
+        struct sdshdr32 *sh = (void*)buf;
+        sh->len = sh->alloc = len;
+        sh->flags = SDS_TYPE_32;
+        s = sh->buf;
+    }
+    memcpy(s,ele,len);
+    s[len] = '\0';
+    return s;
+}
+
+/* Create a skiplist node with the specified number of levels, allocated
+ * from the skiplist arena. A copy of the SDS string 'ele' is stored inline
+ * right after the levels array: the caller keeps the ownership of the
+ * passed string, and anything that must reference the element long term
+ * (like the zset hash table key) has to use the node's copy in node->ele. */
+zskiplistNode *zslCreateNode(zskiplist *zsl, int level, double score, sds ele) {
+    size_t size = sizeof(zskiplistNode)+level*sizeof(struct zskiplistLevel);
+    zskiplistNode *zn;
+
+    if (ele) size += zslInlineEleSize(ele);
+    zn = zslArenaAlloc(zsl->arena,size);
     zn->score = score;
-    zn->ele = ele;
+    zn->ele = ele ? zslInlineEleWrite((char*)zn +
+        sizeof(zskiplistNode)+level*sizeof(struct zskiplistLevel), ele) : NULL;
     return zn;
 }
 
@@ -82,9 +234,10 @@ zskiplist *zslCreate(void) {
     zskiplist *zsl;
 
     zsl = zmalloc(sizeof(*zsl));
+    zsl->arena = zslArenaCreate();
     zsl->level = 1;
     zsl->length = 0;
-    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL);
+    zsl->header = zslCreateNode(zsl,ZSKIPLIST_MAXLEVEL,0,NULL);
     for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
         zsl->header->level[j].forward = NULL;
         zsl->header->level[j].span = 0;
@@ -94,24 +247,22 @@ zskiplist *zslCreate(void) {
     return zsl;
 }
 
-/* Free the specified skiplist node. The referenced SDS string representation
- * of the element is freed too, unless node->ele is set to NULL before calling
- * this function. */
-void zslFreeNode(zskiplistNode *node) {
-    sdsfree(node->ele);
-    zfree(node);
+/* Free the specified skiplist node, together with the inline SDS string
+ * representing the element. */
+void zslFreeNode(zskiplist *zsl, zskiplistNode *node) {
+    zslArenaFree(zsl->arena,node);
 }
 
 /* Free a whole skiplist. */
 void zslFree(zskiplist *zsl) {
     zskiplistNode *node = zsl->header->level[0].forward, *next;
 
-    zfree(zsl->header);
     while(node) {
         next = node->level[0].forward;
-        zslFreeNode(node);
+        zslFreeNode(zsl,node);
         node = next;
     }
+    zslArenaRelease(zsl->arena);
     zfree(zsl);
 }
 
@@ -127,8 +278,10 @@ int zslRandomLevel(void) {
 }
 
 /* Insert a new node in the skiplist. Assumes the element does not already
- * exist (up to the caller to enforce that). The skiplist takes ownership
- * of the passed SDS string 'ele'. */
+ * exist (up to the caller to enforce that). A copy of the SDS string 'ele'
+ * is stored inline in the node, so the caller retains the ownership of the
+ * passed string: references that must outlive the call have to point to
+ * the copy of the returned node, that is node->ele. */
 zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
     unsigned int rank[ZSKIPLIST_MAXLEVEL];
@@ -162,7 +315,7 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
         }
         zsl->level = level;
     }
-    x = zslCreateNode(level,score,ele);
+    x = zslCreateNode(zsl,level,score,ele);
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
         update[i]->level[i].forward = x;
@@ -186,6 +339,119 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
     return x;
 }
 
+/* Append 'ele' with 'score' at the tail of the skiplist: the caller
+ * guarantees that (score,ele) sorts after every element already inside.
+ * 'update' and 'rank' carry the rightmost node at each level and its
+ * rank, exactly what the zslInsert() search would compute for a tail
+ * insertion: before the first append on an empty skiplist every update
+ * slot must point to the header with rank 0, and the arrays are kept up
+ * to date across calls. This makes a bulk load of N presorted elements
+ * cost O(N) in total instead of N placement searches of O(log N) each. */
+zskiplistNode *zslAppend(zskiplist *zsl, zskiplistNode **update,
+                         unsigned long *rank, double score, sds ele)
+{
+    zskiplistNode *x;
+    int i, level;
+
+    serverAssert(!isnan(score));
+    level = zslRandomLevel();
+    if (level > zsl->level) {
+        for (i = zsl->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = zsl->header;
+            update[i]->level[i].span = zsl->length;
+        }
+        zsl->level = level;
+    }
+    x = zslCreateNode(zsl,level,score,ele);
+    for (i = 0; i < level; i++) {
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
+
+        /* update span covered by update[i] as x is inserted here */
+        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    }
+
+    /* increment span for untouched levels */
+    for (i = level; i < zsl->level; i++) {
+        update[i]->level[i].span++;
+    }
+
+    x->backward = (update[0] == zsl->header) ? NULL : update[0];
+    zsl->tail = x;
+    zsl->length++;
+
+    /* The new node is now the rightmost one at all its levels. */
+    for (i = 0; i < level; i++) {
+        update[i] = x;
+        rank[i] = zsl->length;
+    }
+    return x;
+}
+
+/* Append-only skiplist builder. When the elements arrive already in sorted
+ * order (a range read from another sorted set, for instance), the search
+ * that zslInsert() performs for every insertion is pure overhead: the
+ * insertion point is always the tail. The appender caches the last node and
+ * its rank at every level, so each append is O(level) pointer updates and
+ * building a skiplist of N sorted elements is O(N) instead of O(N log N).
+ *
+ * The appender must be initialized on an EMPTY skiplist, and while it is
+ * in use no other insertion or deletion may touch the skiplist. */
+typedef struct zslAppender {
+    zskiplist *zsl;
+    zskiplistNode *tails[ZSKIPLIST_MAXLEVEL]; /* Last node per level. */
+    unsigned long ranks[ZSKIPLIST_MAXLEVEL];  /* Their 1-based ranks. */
+} zslAppender;
+
+static void zslAppenderInit(zslAppender *ap, zskiplist *zsl) {
+    serverAssert(zsl->length == 0);
+    ap->zsl = zsl;
+    for (int i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        ap->tails[i] = zsl->header;
+        ap->ranks[i] = 0;
+    }
+}
+
+/* Append an element that sorts after every element already in the list.
+ * Same ownership contract as zslInsert(): the node stores a copy of 'ele'. */
+static zskiplistNode *zslAppenderAdd(zslAppender *ap, double score, sds ele) {
+    zskiplist *zsl = ap->zsl;
+    unsigned long rank0 = zsl->length; /* Rank of the current tail. */
+    zskiplistNode *x, *prev = ap->tails[0];
+    int i, level;
+
+    serverAssert(!isnan(score));
+    level = zslRandomLevel();
+    if (level > zsl->level) {
+        for (i = zsl->level; i < level; i++) {
+            ap->ranks[i] = 0;
+            ap->tails[i] = zsl->header;
+            zsl->header->level[i].span = zsl->length;
+        }
+        zsl->level = level;
+    }
+    x = zslCreateNode(zsl,level,score,ele);
+    for (i = 0; i < level; i++) {
+        x->level[i].forward = NULL;
+        ap->tails[i]->level[i].forward = x;
+        /* Same span arithmetic as zslInsert(), with the cached tails in
+         * place of the searched update[] vector. */
+        x->level[i].span = ap->tails[i]->level[i].span - (rank0 - ap->ranks[i]);
+        ap->tails[i]->level[i].span = (rank0 - ap->ranks[i]) + 1;
+        ap->tails[i] = x;
+        ap->ranks[i] = rank0+1;
+    }
+    for (i = level; i < zsl->level; i++)
+        ap->tails[i]->level[i].span++;
+
+    x->backward = (prev == zsl->header) ? NULL : prev;
+    zsl->tail = x;
+    zsl->length++;
+    return x;
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     int i;
@@ -236,7 +502,7 @@ int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
     if (x && score == x->score && sdscmp(x->ele,ele) == 0) {
         zslDeleteNode(zsl, x, update);
         if (!node)
-            zslFreeNode(x);
+            zslFreeNode(zsl,x);
         else
             *node = x;
         return 1;
@@ -291,11 +557,12 @@ zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double n
     /* No way to reuse the old node: we need to remove and insert a new
      * one at a different place. */
     zslDeleteNode(zsl, x, update);
+    /* zslInsert() copies the element, so borrowing x->ele here is fine:
+     * the old node is released only after the new one was created. Note
+     * that the caller has to refresh any reference into the old node,
+     * like the hash table key and score pointers of the zset. */
     zskiplistNode *newnode = zslInsert(zsl,newscore,x->ele);
-    /* We reused the old node x->ele SDS string, free the node now
-     * since zslInsert created a new one. */
-    x->ele = NULL;
-    zslFreeNode(x);
+    zslFreeNode(zsl,x);
     return newnode;
 }
 
@@ -403,7 +670,7 @@ unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dic
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
         dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
+        zslFreeNode(zsl,x); /* Here is where the node storage is released. */
         removed++;
         x = next;
     }
@@ -432,7 +699,7 @@ unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *di
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
         dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
+        zslFreeNode(zsl,x); /* Here is where the node storage is released. */
         removed++;
         x = next;
     }
@@ -461,7 +728,7 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
         dictDelete(dict,x->ele);
-        zslFreeNode(x);
+        zslFreeNode(zsl,x);
         removed++;
         traversed++;
         x = next;
@@ -469,6 +736,55 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
     return removed;
 }
 
+/* Pop up to 'count' elements from the min or max end of the skiplist
+ * backed sorted set 'zs', storing copies of the elements and their scores
+ * into the 'eles' and 'scores' arrays, ordered from the first popped to
+ * the last (so descending scores when popping from the max end). The
+ * caller owns the returned sds strings.
+ *
+ * This is the bulk version of popping one element at a time: like
+ * zslDeleteRangeByRank(), the rank walk locating the elements is
+ * performed once, so popping K elements costs O(log N + K) instead of
+ * K deletions of O(log N) each. Returns the number of popped elements. */
+long zsetPopBatch(zset *zs, int where, sds *eles, double *scores, long count) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    zskiplist *zsl = zs->zsl;
+    unsigned long traversed = 0, start;
+    long popped = 0;
+    int i;
+
+    if (count <= 0) return 0;
+    if ((unsigned long)count > zsl->length) count = zsl->length;
+    start = (where == ZSET_MAX) ? zsl->length - count + 1 : 1;
+
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+
+    x = x->level[0].forward;
+    while (x && popped < count) {
+        zskiplistNode *next = x->level[0].forward;
+        /* The walk visits the range in ascending order: when popping
+         * from the max end fill the output arrays backwards, so that
+         * the first popped element is the maximum. */
+        long slot = (where == ZSET_MAX) ? count-1-popped : popped;
+
+        eles[slot] = sdsdup(x->ele);
+        scores[slot] = x->score;
+        dictDelete(zs->dict,x->ele);
+        zslDeleteNode(zsl,x,update);
+        zslFreeNode(zsl,x);
+        popped++;
+        x = next;
+    }
+    return popped;
+}
+
 /* Find the rank for an element by both score and key.
  * Returns 0 when the element cannot be found, rank otherwise.
  * Note that the rank is 1-based due to the span of zsl->header to the
@@ -716,7 +1032,7 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -727,7 +1043,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -740,14 +1056,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -764,7 +1080,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(eptr,&vlen,&vlong);
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -778,7 +1094,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -787,9 +1103,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -806,9 +1122,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -830,13 +1146,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -848,14 +1164,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -867,7 +1183,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -876,14 +1192,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -896,9 +1212,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -907,14 +1223,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -930,12 +1246,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -946,7 +1262,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -960,9 +1276,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -971,7 +1287,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -986,9 +1302,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -997,32 +1313,31 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
+        if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
             /* Matching element, pull out score. */
             if (score != NULL) *score = zzlGetScore(sptr);
             return eptr;
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
     return NULL;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,&p);
     return zl;
 }
 
@@ -1034,29 +1349,29 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
         /* Keep offset relative to zl, as it might be re-allocated. */
         offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,NULL);
         eptr = zl+offset;
 
         /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        serverAssert((sptr = lpNext(zl,eptr)) != NULL);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,sptr,LP_BEFORE,NULL);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1075,7 +1390,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1094,14 +1409,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr
+     * to NULL. */
+    while (eptr != NULL && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1122,13 +1437,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr
+     * to NULL. */
+    while (eptr != NULL && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1145,7 +1460,7 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1155,7 +1470,7 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
@@ -1172,7 +1487,7 @@ void zsetConvert(robj *zobj, int encoding) {
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1186,21 +1501,22 @@ void zsetConvert(robj *zobj, int encoding) {
         zs->dict = dictCreate(&zsetDictType,NULL);
         zs->zsl = zslCreate();
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
             node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            serverAssert(dictAdd(zs->dict,node->ele,&node->score) == DICT_OK);
+            sdsfree(ele);
             zzlNext(zl,&eptr,&sptr);
         }
 
@@ -1208,44 +1524,45 @@ void zsetConvert(robj *zobj, int encoding) {
         zobj->ptr = zs;
         zobj->encoding = OBJ_ENCODING_SKIPLIST;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        unsigned char *zl = lpNew();
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
         /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
+         * the same time as creating the listpack. */
         zs = zobj->ptr;
         dictRelease(zs->dict);
         node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
-        zfree(zs->zsl);
 
         while (node) {
             zl = zzlInsertAt(zl,NULL,node->ele,node->score);
             next = node->level[0].forward;
-            zslFreeNode(node);
+            zslFreeNode(zs->zsl,node);
             node = next;
         }
 
+        /* Releasing the arena frees the header and every block at once. */
+        zslArenaRelease(zs->zsl->arena);
+        zfree(zs->zsl);
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a listpack if it is not already in that
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
     zset *zset = zobj->ptr;
 
     if (zset->zsl->length <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1255,7 +1572,7 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
@@ -1282,6 +1599,10 @@ int zsetScore(robj *zobj, sds member, double *score) {
  *            assume 0 as previous score.
  * ZADD_NX:   Perform the operation only if the element does not exist.
  * ZADD_XX:   Perform the operation only if the element already exist.
+ * ZADD_GT:   Perform the operation on existing elements only if the new
+ *            score is greater than the current score.
+ * ZADD_LT:   Perform the operation on existing elements only if the new
+ *            score is less than the current score.
  *
  * When ZADD_INCR is used, the new score of the element is stored in
  * '*newscore' if 'newscore' is not NULL.
@@ -1305,7 +1626,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from listpack to hashtable+skiplist.
  *
  * Memory managemnet of 'ele':
  *
@@ -1316,6 +1637,8 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     int incr = (*flags & ZADD_INCR) != 0;
     int nx = (*flags & ZADD_NX) != 0;
     int xx = (*flags & ZADD_XX) != 0;
+    int gt = (*flags & ZADD_GT) != 0;
+    int lt = (*flags & ZADD_LT) != 0;
     *flags = 0; /* We'll return our response flags. */
     double curscore;
 
@@ -1326,7 +1649,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1343,9 +1666,16 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                     *flags |= ZADD_NAN;
                     return 0;
                 }
-                if (newscore) *newscore = score;
             }
 
+            /* GT/LT? Only update if score is greater/less than current. */
+            if ((lt && score >= curscore) || (gt && score <= curscore)) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+
+            if (incr && newscore) *newscore = score;
+
             /* Remove and re-insert when score changed. */
             if (score != curscore) {
                 zobj->ptr = zzlDelete(zobj->ptr,eptr);
@@ -1388,23 +1718,31 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                     *flags |= ZADD_NAN;
                     return 0;
                 }
-                if (newscore) *newscore = score;
             }
 
+            /* GT/LT? Only update if score is greater/less than current. */
+            if ((lt && score >= curscore) || (gt && score <= curscore)) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+
+            if (incr && newscore) *newscore = score;
+
             /* Remove and re-insert when score changes. */
             if (score != curscore) {
                 znode = zslUpdateScore(zs->zsl,curscore,ele,score);
                 /* Note that we did not removed the original element from
-                 * the hash table representing the sorted set, so we just
-                 * update the score. */
+                 * the hash table representing the sorted set: the node was
+                 * reallocated though, so both the key (the node inline
+                 * element) and the score pointer must be refreshed. */
+                dictSetKey(zs->dict,de,znode->ele);
                 dictGetVal(de) = &znode->score; /* Update score ptr. */
                 *flags |= ZADD_UPDATED;
             }
             return 1;
         } else if (!xx) {
-            ele = sdsdup(ele);
             znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            serverAssert(dictAdd(zs->dict,znode->ele,&znode->score) == DICT_OK);
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1421,7 +1759,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
@@ -1475,18 +1813,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1554,6 +1892,8 @@ void zaddGenericCommand(client *c, int flags) {
         else if (!strcasecmp(opt,"xx")) flags |= ZADD_XX;
         else if (!strcasecmp(opt,"ch")) flags |= ZADD_CH;
         else if (!strcasecmp(opt,"incr")) flags |= ZADD_INCR;
+        else if (!strcasecmp(opt,"gt")) flags |= ZADD_GT;
+        else if (!strcasecmp(opt,"lt")) flags |= ZADD_LT;
         else break;
         scoreidx++;
     }
@@ -1563,6 +1903,8 @@ void zaddGenericCommand(client *c, int flags) {
     int nx = (flags & ZADD_NX) != 0;
     int xx = (flags & ZADD_XX) != 0;
     int ch = (flags & ZADD_CH) != 0;
+    int gt = (flags & ZADD_GT) != 0;
+    int lt = (flags & ZADD_LT) != 0;
 
     /* After the options, we expect to have an even number of args, since
      * we expect any number of score-element pairs. */
@@ -1580,6 +1922,12 @@ void zaddGenericCommand(client *c, int flags) {
         return;
     }
 
+    if ((gt && nx) || (lt && nx) || (gt && lt)) {
+        addReplyError(c,
+            "GT, LT, and/or NX options at the same time are not compatible");
+        return;
+    }
+
     if (incr && elements > 1) {
         addReplyError(c,
             "INCR option supports a single increment-element pair");
@@ -1604,7 +1952,7 @@ void zaddGenericCommand(client *c, int flags) {
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
     } else {
@@ -1614,6 +1962,15 @@ void zaddGenericCommand(client *c, int flags) {
         }
     }
 
+    /* For skiplist encoded sets prefetch the hash table buckets of the
+     * whole batch upfront, so the per element dictFind() calls in
+     * zsetAdd() below are less likely to stall on cache misses. */
+    if (zobj->encoding == OBJ_ENCODING_SKIPLIST && elements > 1) {
+        zset *zs = zobj->ptr;
+        for (j = 0; j < elements; j++)
+            dictPrefetch(zs->dict,c->argv[scoreidx+1+j*2]->ptr);
+    }
+
     for (j = 0; j < elements; j++) {
         double newscore;
         score = scores[j];
@@ -1655,6 +2012,118 @@ void zaddCommand(client *c) {
     zaddGenericCommand(c,ZADD_NONE);
 }
 
+/* ZADDSORTED key score member [score member ...]
+ *
+ * Bulk load variant of ZADD for presorted payloads: the (score,member)
+ * pairs are declared in ascending order, by score and then by member.
+ * When the command creates the key, every pair extending the current
+ * tail is appended to the skiplist with zslAppend() -- no placement
+ * search -- and the hash table is presized once for the whole payload,
+ * so importing N elements costs O(N) instead of O(N log N).
+ *
+ * The sorted order is verified while loading: a pair found out of order,
+ * or a payload targeting an existing key, degrades transparently to
+ * normal ZADD insertions, so the command never fails on unsorted input,
+ * it is just slower. Replies with the number of new elements added. */
+void zaddsortedCommand(client *c) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL];
+    unsigned long rank[ZSKIPLIST_MAXLEVEL];
+    robj *key = c->argv[1];
+    robj *zobj;
+    int created = 0, appending = 0;
+    long added = 0, updated = 0;
+    int elements = (c->argc-2)/2, j;
+    size_t maxelelen = 0;
+    double *scores;
+
+    if (c->argc % 2 == 1) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    /* Parse every score before touching the key: no partial load is
+     * performed on a malformed payload. */
+    scores = zmalloc(sizeof(double)*elements);
+    for (j = 0; j < elements; j++) {
+        if (getDoubleFromObjectOrReply(c,c->argv[2+j*2],&scores[j],NULL)
+            != C_OK)
+        {
+            zfree(scores);
+            return;
+        }
+    }
+
+    zobj = lookupKeyWrite(c->db,key);
+    if (zobj && checkType(c,zobj,OBJ_ZSET)) {
+        zfree(scores);
+        return;
+    }
+    if (zobj == NULL) {
+        /* Build with the skiplist encoding right away: small payloads
+         * are converted back to a listpack at the end. */
+        zobj = createZsetObject();
+        dbAdd(c->db,key,zobj);
+        zset *zs = zobj->ptr;
+        dictExpand(zs->dict,elements);
+        for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
+            update[j] = zs->zsl->header;
+            rank[j] = 0;
+        }
+        created = appending = 1;
+    }
+
+    for (j = 0; j < elements; j++) {
+        double score = scores[j];
+        sds ele = c->argv[3+j*2]->ptr;
+
+        if (sdslen(ele) > maxelelen) maxelelen = sdslen(ele);
+        if (appending) {
+            zset *zs = zobj->ptr;
+            zskiplistNode *tail = zs->zsl->tail;
+
+            /* A member seen earlier in the payload can pass the tail
+             * order check when repeated with a higher score, but it must
+             * not be appended twice: treat it like out of order input. */
+            if ((tail == NULL || score > tail->score ||
+                 (score == tail->score && sdscmp(ele,tail->ele) > 0)) &&
+                dictFind(zs->dict,ele) == NULL)
+            {
+                zskiplistNode *znode = zslAppend(zs->zsl,update,rank,
+                                                 score,ele);
+                serverAssert(dictAdd(zs->dict,znode->ele,
+                                     &znode->score) == DICT_OK);
+                added++;
+                continue;
+            }
+            /* Out of order: fall back to regular insertions for the
+             * rest of the payload. */
+            appending = 0;
+        }
+
+        int retflags = ZADD_NONE;
+        if (zsetAdd(zobj,score,ele,&retflags,NULL) == 0) {
+            addReplyError(c,"score is not a valid float");
+            goto cleanup;
+        }
+        if (retflags & ZADD_ADDED) added++;
+        if (retflags & ZADD_UPDATED) updated++;
+    }
+
+    /* A payload below the listpack limits gets the same memory
+     * representation that loading it with ZADD would have produced. */
+    if (created) zsetConvertToListpackIfNeeded(zobj,maxelelen);
+
+    server.dirty += added+updated;
+    if (added || updated) {
+        signalModifiedKey(c->db,key);
+        notifyKeyspaceEvent(NOTIFY_ZSET,"zadd",key,c->db->id);
+    }
+    addReplyLongLong(c,added);
+
+cleanup:
+    zfree(scores);
+}
+
 void zincrbyCommand(client *c) {
     zaddGenericCommand(c,ZADD_INCR);
 }
@@ -1737,7 +2206,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1879,11 +2348,11 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -1912,7 +2381,7 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             UNUSED(it); /* skip */
@@ -1938,7 +2407,7 @@ unsigned long zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
@@ -1988,11 +2457,11 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            val->estr = lpGetValue(it->zl.eptr,&val->elen,&val->ell);
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
@@ -2106,7 +2575,7 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
@@ -2302,8 +2771,9 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
                     znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    dictAdd(dstzset->dict,znode->ele,&znode->score);
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
+                    sdsfree(tmp);
                 }
             }
             zuiClearIterator(&src[0]);
@@ -2337,7 +2807,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to convert to listpack
                      * at the end. */
                      if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                     /* Update the element with its initial score. */
@@ -2368,7 +2838,8 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             sds ele = dictGetKey(de);
             score = dictGetDoubleVal(de);
             znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+            dictAdd(dstzset->dict,znode->ele,&znode->score);
+            sdsfree(ele);
         }
         dictReleaseIterator(di);
         dictRelease(accumulator);
@@ -2379,7 +2850,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     if (dbDelete(c->db,dstkey))
         touched = 1;
     if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+        zsetConvertToListpackIfNeeded(dstobj,maxelelen);
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c->db,dstkey);
@@ -2444,6 +2915,11 @@ void zrangeGenericCommand(client *c, int reverse) {
     if (end >= llen) end = llen-1;
     rangelen = (end-start)+1;
 
+    /* Iterating below may be aborted by the execution deadline: partial
+     * output is rewound back to here so a clean error can be emitted. */
+    replyCheckpoint cp;
+    replyCheckpointSet(c,&cp);
+
     /* Return the result in form of a multi-bulk reply. RESP3 clients
      * will receive sub arrays with score->element, while RESP2 returned
      * a flat array. */
@@ -2452,7 +2928,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     else
         addReplyArrayLen(c, rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2460,16 +2936,22 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            if ((rangelen & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                addReply(c,shared.timeouterr);
+                return;
+            }
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             if (vstr == NULL)
@@ -2503,6 +2985,12 @@ void zrangeGenericCommand(client *c, int reverse) {
 
         while(rangelen--) {
             serverAssertWithInfo(c,zobj,ln != NULL);
+            if ((rangelen & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                addReply(c,shared.timeouterr);
+                return;
+            }
             ele = ln->ele;
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -2522,11 +3010,251 @@ void zrevrangeCommand(client *c) {
     zrangeGenericCommand(c,1);
 }
 
+/* Helper of ZRANGESTORE: add one element to the destination sorted set.
+ * Elements produced in ascending order go through the appender ('ap' not
+ * NULL); descending producers pass NULL and fall back to zslInsert(),
+ * which is cheap as well in that case since the insertion point is always
+ * right after the header. */
+static void zrangestoreAdd(zset *dstzset, zslAppender *ap, double score,
+                           sds ele, size_t *maxelelen)
+{
+    zskiplistNode *znode = ap ? zslAppenderAdd(ap,score,ele) :
+                                zslInsert(dstzset->zsl,score,ele);
+    serverAssert(dictAdd(dstzset->dict,znode->ele,&znode->score) == DICT_OK);
+    if (sdslen(znode->ele) > *maxelelen) *maxelelen = sdslen(znode->ele);
+}
+
+/* ZRANGESTORE dst src min max [BYSCORE|BYLEX] [REV] [LIMIT offset count]
+ *
+ * Store the result of a range query directly into the destination sorted
+ * set, saving the round trip of shipping the range to the client and
+ * pushing it back. The source is read with the same semantics as ZRANGE /
+ * ZRANGEBYSCORE / ZRANGEBYLEX (with REV the range bounds are given from
+ * the max end, like the reverse variants of those commands expect), and
+ * since a range read yields elements already in sorted order the
+ * destination skiplist is built by sequential appends instead of repeated
+ * searched inserts. The destination is overwritten, and deleted when the
+ * resulting range is empty. Replies with the cardinality stored. */
+void zrangestoreCommand(client *c) {
+    robj *dstkey = c->argv[1], *srckey = c->argv[2];
+    robj *zobj, *dstobj;
+    zset *dstzset;
+    zslAppender ap;
+    zrangespec range;
+    zlexrangespec lexrange;
+    int rangetype = ZRANGE_RANK, reverse = 0, touched = 0;
+    long start = 0, end = 0, offset = 0, limit = -1;
+    long llen = 0, rangelen;
+    size_t maxelelen = 0;
+
+    /* Parse optional arguments. */
+    for (int j = 5; j < c->argc; j++) {
+        int leftargs = c->argc-j-1;
+        if (!strcasecmp(c->argv[j]->ptr,"byscore")) {
+            rangetype = ZRANGE_SCORE;
+        } else if (!strcasecmp(c->argv[j]->ptr,"bylex")) {
+            rangetype = ZRANGE_LEX;
+        } else if (!strcasecmp(c->argv[j]->ptr,"rev")) {
+            reverse = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"limit") && leftargs >= 2) {
+            if (getLongFromObjectOrReply(c,c->argv[j+1],&offset,NULL)
+                    != C_OK ||
+                getLongFromObjectOrReply(c,c->argv[j+2],&limit,NULL)
+                    != C_OK) return;
+            j += 2;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+    if ((offset != 0 || limit != -1) && rangetype == ZRANGE_RANK) {
+        addReplyError(c,"syntax error, LIMIT is only supported in "
+                        "combination with either BYSCORE or BYLEX");
+        return;
+    }
+
+    /* Parse the range. With REV the first bound is the max end. */
+    robj *minobj = reverse ? c->argv[4] : c->argv[3];
+    robj *maxobj = reverse ? c->argv[3] : c->argv[4];
+    if (rangetype == ZRANGE_RANK) {
+        if (getLongFromObjectOrReply(c,c->argv[3],&start,NULL) != C_OK ||
+            getLongFromObjectOrReply(c,c->argv[4],&end,NULL) != C_OK) return;
+    } else if (rangetype == ZRANGE_SCORE) {
+        if (zslParseRange(minobj,maxobj,&range) != C_OK) {
+            addReplyError(c,"min or max is not a float");
+            return;
+        }
+    } else {
+        if (zslParseLexRange(minobj,maxobj,&lexrange) != C_OK) {
+            addReplyError(c,"min or max not valid string range item");
+            return;
+        }
+    }
+
+    zobj = lookupKeyRead(c->db,srckey);
+    if (zobj && checkType(c,zobj,OBJ_ZSET)) {
+        if (rangetype == ZRANGE_LEX) zslFreeLexRange(&lexrange);
+        return;
+    }
+
+    if (zobj && rangetype == ZRANGE_RANK) {
+        /* Sanitize the indexes as ZRANGE does, then map a reverse range
+         * onto the equivalent forward window: a rank range selects the
+         * same elements in both directions, so the store side can always
+         * traverse (and append) in ascending order. */
+        llen = zsetLength(zobj);
+        if (start < 0) start = llen+start;
+        if (end < 0) end = llen+end;
+        if (start < 0) start = 0;
+        if (end >= llen) end = llen-1;
+        if (reverse) {
+            long fstart = llen-1-end;
+            end = llen-1-start;
+            start = fstart;
+        }
+    }
+
+    dstobj = createZsetObject();
+    dstzset = dstobj->ptr;
+    zslAppenderInit(&ap,dstzset->zsl);
+
+    if (zobj && rangetype == ZRANGE_RANK && start <= end && start < llen) {
+        rangelen = (end-start)+1;
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+            unsigned char *zl = zobj->ptr;
+            unsigned char *eptr = lpSeek(zl,2*start), *sptr;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vlong;
+
+            serverAssertWithInfo(c,zobj,eptr != NULL);
+            sptr = lpNext(zl,eptr);
+            while (rangelen--) {
+                serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
+                vstr = lpGetValue(eptr,&vlen,&vlong);
+                sds ele = vstr ? sdsnewlen(vstr,vlen) :
+                                 sdsfromlonglong(vlong);
+                zrangestoreAdd(dstzset,&ap,zzlGetScore(sptr),ele,&maxelelen);
+                sdsfree(ele);
+                zzlNext(zl,&eptr,&sptr);
+            }
+        } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+            zset *zs = zobj->ptr;
+            zskiplistNode *ln = (start == 0) ?
+                zs->zsl->header->level[0].forward :
+                zslGetElementByRank(zs->zsl,start+1);
+
+            while (rangelen--) {
+                serverAssertWithInfo(c,zobj,ln != NULL);
+                zrangestoreAdd(dstzset,&ap,ln->score,ln->ele,&maxelelen);
+                ln = ln->level[0].forward;
+            }
+        } else {
+            serverPanic("Unknown sorted set encoding");
+        }
+    } else if (zobj && rangetype != ZRANGE_RANK) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+            unsigned char *zl = zobj->ptr;
+            unsigned char *eptr, *sptr;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vlong;
+
+            if (rangetype == ZRANGE_SCORE)
+                eptr = reverse ? zzlLastInRange(zl,&range) :
+                                 zzlFirstInRange(zl,&range);
+            else
+                eptr = reverse ? zzlLastInLexRange(zl,&lexrange) :
+                                 zzlFirstInLexRange(zl,&lexrange);
+            if (eptr) sptr = lpNext(zl,eptr);
+
+            while (eptr && limit != 0) {
+                double score = zzlGetScore(sptr);
+                if (rangetype == ZRANGE_SCORE) {
+                    if (reverse ? !zslValueGteMin(score,&range) :
+                                  !zslValueLteMax(score,&range)) break;
+                } else {
+                    if (reverse ? !zzlLexValueGteMin(eptr,&lexrange) :
+                                  !zzlLexValueLteMax(eptr,&lexrange)) break;
+                }
+                if (offset > 0) {
+                    offset--;
+                } else {
+                    vstr = lpGetValue(eptr,&vlen,&vlong);
+                    sds ele = vstr ? sdsnewlen(vstr,vlen) :
+                                     sdsfromlonglong(vlong);
+                    zrangestoreAdd(dstzset,reverse ? NULL : &ap,score,ele,
+                                   &maxelelen);
+                    sdsfree(ele);
+                    if (limit > 0) limit--;
+                }
+                if (reverse)
+                    zzlPrev(zl,&eptr,&sptr);
+                else
+                    zzlNext(zl,&eptr,&sptr);
+            }
+        } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+            zset *zs = zobj->ptr;
+            zskiplistNode *ln;
+
+            if (rangetype == ZRANGE_SCORE)
+                ln = reverse ? zslLastInRange(zs->zsl,&range) :
+                               zslFirstInRange(zs->zsl,&range);
+            else
+                ln = reverse ? zslLastInLexRange(zs->zsl,&lexrange) :
+                               zslFirstInLexRange(zs->zsl,&lexrange);
+
+            while (ln && limit != 0) {
+                if (rangetype == ZRANGE_SCORE) {
+                    if (reverse ? !zslValueGteMin(ln->score,&range) :
+                                  !zslValueLteMax(ln->score,&range)) break;
+                } else {
+                    if (reverse ? !zslLexValueGteMin(ln->ele,&lexrange) :
+                                  !zslLexValueLteMax(ln->ele,&lexrange)) break;
+                }
+                if (offset > 0) {
+                    offset--;
+                } else {
+                    zrangestoreAdd(dstzset,reverse ? NULL : &ap,ln->score,
+                                   ln->ele,&maxelelen);
+                    if (limit > 0) limit--;
+                }
+                ln = reverse ? ln->backward : ln->level[0].forward;
+            }
+        } else {
+            serverPanic("Unknown sorted set encoding");
+        }
+    }
+    if (rangetype == ZRANGE_LEX) zslFreeLexRange(&lexrange);
+
+    /* Install the result, exactly as ZUNIONSTORE does: overwrite the
+     * destination, or delete it when the range came out empty. */
+    if (dbDelete(c->db,dstkey))
+        touched = 1;
+    if (dstzset->zsl->length) {
+        zsetConvertToListpackIfNeeded(dstobj,maxelelen);
+        dbAdd(c->db,dstkey,dstobj);
+        addReplyLongLong(c,zsetLength(dstobj));
+        signalModifiedKey(c->db,dstkey);
+        notifyKeyspaceEvent(NOTIFY_ZSET,"zrangestore",dstkey,c->db->id);
+        server.dirty++;
+    } else {
+        decrRefCount(dstobj);
+        addReply(c,shared.czero);
+        if (touched) {
+            signalModifiedKey(c->db,dstkey);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",dstkey,c->db->id);
+            server.dirty++;
+        }
+    }
+}
+
 /* This command implements ZRANGEBYSCORE, ZREVRANGEBYSCORE. */
 void genericZrangebyscoreCommand(client *c, int reverse) {
     zrangespec range;
     robj *key = c->argv[1];
     robj *zobj;
+    robj *after = NULL;
     long offset = 0, limit = -1;
     int withscores = 0;
     unsigned long rangelen = 0;
@@ -2566,6 +3294,9 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                     return;
                 }
                 pos += 3; remaining -= 3;
+            } else if (remaining >= 2 && !strcasecmp(c->argv[pos]->ptr,"after")) {
+                after = c->argv[pos+1];
+                pos += 2; remaining -= 2;
             } else {
                 addReply(c,shared.syntaxerr);
                 return;
@@ -2577,7 +3308,12 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptyarray)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    /* Iterating below may be aborted by the execution deadline: partial
+     * output is rewound back to here so a clean error can be emitted. */
+    replyCheckpoint cp;
+    replyCheckpointSet(c,&cp);
+
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2592,6 +3328,26 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
             eptr = zzlFirstInRange(zl,&range);
         }
 
+        /* Resume from the page cursor when one was given: start right
+         * past the member the previous page ended with, unless that
+         * member now sorts before the natural start of the range. */
+        if (eptr && after) {
+            unsigned char *aptr = zzlFind(zl,after->ptr,NULL);
+            if (aptr == NULL) {
+                addReplyError(c,"AFTER member no longer exists");
+                return;
+            }
+            if (reverse ? (aptr <= eptr) : (aptr >= eptr)) {
+                eptr = aptr;
+                sptr = lpNext(zl,eptr);
+                if (reverse) {
+                    zzlPrev(zl,&eptr,&sptr);
+                } else {
+                    zzlNext(zl,&eptr,&sptr);
+                }
+            }
+        }
+
         /* No "first" element in the specified interval. */
         if (eptr == NULL) {
             addReply(c,shared.emptyarray);
@@ -2600,7 +3356,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2627,11 +3383,17 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
+            if ((rangelen & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                addReply(c,shared.timeouterr);
+                return;
+            }
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             if (vstr == NULL) {
                 addReplyBulkLongLong(c,vlong);
@@ -2659,6 +3421,32 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
             ln = zslFirstInRange(zsl,&range);
         }
 
+        /* Resume from the page cursor when one was given: locate the
+         * member the previous page ended with through the hash table and
+         * the rank machinery, and start right past it. If the cursor now
+         * sorts before the natural start of the range, the range start
+         * wins, so a cursor whose score changed can not leak elements
+         * that precede the requested interval. */
+        if (ln && after) {
+            dictEntry *de = dictFind(zs->dict,after->ptr);
+            if (de == NULL) {
+                addReplyError(c,"AFTER member no longer exists");
+                return;
+            }
+            double ascore = *(double*)dictGetVal(de);
+            unsigned long arank = zslGetRank(zsl,ascore,after->ptr);
+            unsigned long srank = zslGetRank(zsl,ln->score,ln->ele);
+            if (reverse) {
+                if (arank <= srank)
+                    ln = (arank <= 1) ? NULL :
+                         zslGetElementByRank(zsl,arank-1);
+            } else {
+                /* Past the tail zslGetElementByRank() returns NULL. */
+                if (arank >= srank)
+                    ln = zslGetElementByRank(zsl,arank+1);
+            }
+        }
+
         /* No "first" element in the specified interval. */
         if (ln == NULL) {
             addReply(c,shared.emptyarray);
@@ -2670,14 +3458,25 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = addReplyDeferredLen(c);
 
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
+        /* If there is an offset, use the skiplist span fields to jump over
+         * it level-wise in O(log(N)) instead of discarding the elements
+         * one by one at level zero, which made deep pagination O(offset)
+         * per page. The landing node may be past the end of the range,
+         * exactly as with the old linear walk: the emission loop below
+         * checks the range and stops. */
+        if (offset > 0) {
+            unsigned long rank = zslGetRank(zsl,ln->score,ln->ele);
             if (reverse) {
-                ln = ln->backward;
+                ln = ((unsigned long)offset >= rank) ? NULL :
+                     zslGetElementByRank(zsl,rank-offset);
             } else {
-                ln = ln->level[0].forward;
+                ln = zslGetElementByRank(zsl,rank+offset);
             }
+        } else if (offset < 0) {
+            /* A negative offset historically consumed the whole range and
+             * produced an empty reply: keep doing that, just without the
+             * walk. */
+            ln = NULL;
         }
 
         while (ln && limit--) {
@@ -2689,6 +3488,12 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
             }
 
             rangelen++;
+            if ((rangelen & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                addReply(c,shared.timeouterr);
+                return;
+            }
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
             if (withscores) addReplyDouble(c,ln->score);
@@ -2732,7 +3537,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2747,7 +3552,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2813,7 +3618,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2828,7 +3633,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2926,7 +3731,12 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    /* Iterating below may be aborted by the execution deadline: partial
+     * output is rewound back to here so a clean error can be emitted. */
+    replyCheckpoint cp;
+    replyCheckpointSet(c,&cp);
+
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2949,7 +3759,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2974,11 +3784,18 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
+            if ((rangelen & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                zslFreeLexRange(&range);
+                addReply(c,shared.timeouterr);
+                return;
+            }
             if (vstr == NULL) {
                 addReplyBulkLongLong(c,vlong);
             } else {
@@ -2995,7 +3812,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zskiplistNode *ln, *stop;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
@@ -3011,14 +3828,27 @@ void genericZrangebylexCommand(client *c, int reverse) {
             return;
         }
 
+        /* Locate the other end of the range as well, and iterate up to the
+         * node just past it. The extra O(log N) search pays for itself
+         * because the traversal below then needs no comparison at all:
+         * checking the range bound against every visited member costs a
+         * full string compare per node, and lexicographic indexes built
+         * out of members sharing long common prefixes make each of those
+         * compares scan the whole shared prefix. */
+        if (reverse) {
+            stop = zslFirstInLexRange(zsl,&range)->backward;
+        } else {
+            stop = zslLastInLexRange(zsl,&range)->level[0].forward;
+        }
+
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
          * length in the output buffer, and will "fix" it later */
         replylen = addReplyDeferredLen(c);
 
         /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
+         * checking them: the sentinel guards the end of the range. */
+        while (ln != stop && offset--) {
             if (reverse) {
                 ln = ln->backward;
             } else {
@@ -3026,15 +3856,15 @@ void genericZrangebylexCommand(client *c, int reverse) {
             }
         }
 
-        while (ln && limit--) {
-            /* Abort when the node is no longer in range. */
-            if (reverse) {
-                if (!zslLexValueGteMin(ln->ele,&range)) break;
-            } else {
-                if (!zslLexValueLteMax(ln->ele,&range)) break;
-            }
-
+        while (ln != stop && limit--) {
             rangelen++;
+            if ((rangelen & 63) == 0 && commandDeadlineReached() &&
+                replyCheckpointRewind(c,&cp) == C_OK)
+            {
+                zslFreeLexRange(&range);
+                addReply(c,shared.timeouterr);
+                return;
+            }
             addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
 
             /* Move to next node */
@@ -3170,9 +4000,44 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
     /* We emit the key only for the blocking variant. */
     if (emitkey) addReplyBulk(c,key);
 
+    /* When more than one element is requested and the sorted set is
+     * skiplist encoded, pop the whole batch with a single rank walk
+     * instead of performing one O(log N) deletion per element. */
+    if (zobj->encoding == OBJ_ENCODING_SKIPLIST && count > 1) {
+        long popped, j;
+
+        if ((unsigned long)count > zsetLength(zobj))
+            count = zsetLength(zobj);
+        sds *eles = zmalloc(sizeof(sds)*count);
+        double *scores = zmalloc(sizeof(double)*count);
+        popped = zsetPopBatch(zobj->ptr,where,eles,scores,count);
+        serverAssertWithInfo(c,zobj,popped == count);
+        server.dirty += popped;
+
+        char *events[2] = {"zpopmin","zpopmax"};
+        notifyKeyspaceEvent(NOTIFY_ZSET,events[where],key,c->db->id);
+        signalModifiedKey(c->db,key);
+
+        for (j = 0; j < popped; j++) {
+            addReplyBulkCBuffer(c,eles[j],sdslen(eles[j]));
+            addReplyDouble(c,scores[j]);
+            sdsfree(eles[j]);
+        }
+        arraylen = popped*2;
+        zfree(eles);
+        zfree(scores);
+
+        if (zsetLength(zobj) == 0) {
+            dbDelete(c->db,key);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,c->db->id);
+        }
+        setDeferredArrayLen(c,arraylen_ptr,arraylen + (emitkey != 0));
+        return;
+    }
+
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3180,16 +4045,16 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = lpSeek(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
         } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
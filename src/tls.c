@@ -166,6 +166,21 @@ int tlsConfigure(redisTLSContextConfig *ctx_config) {
     if (ctx_config->prefer_server_ciphers)
         SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 
+    if (ctx_config->ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        /* Let OpenSSL program the negotiated keys into the socket
+         * (TCP_ULP/TLS_TX/TLS_RX), so reads and writes bypass the
+         * user-space record layer. OpenSSL silently keeps using its
+         * own record layer when the kernel lacks the TLS ULP or the
+         * negotiated cipher is not offloadable, so there is nothing
+         * to check here. */
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        serverLog(LL_WARNING, "tls-ktls is enabled but this OpenSSL version "
+                "has no kernel TLS support, using user-space records.");
+#endif
+    }
+
     SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
     SSL_CTX_set_ecdh_auto(ctx, 1);
@@ -572,6 +587,48 @@ static int connTLSConnect(connection *conn_, const char *addr, int port, const c
     return C_OK;
 }
 
+static int connTLSWrite(connection *conn_, const void *data, size_t data_len);
+
+/* The maximum TLS record plaintext size: coalescing up to this amount
+ * per SSL_write() produces full size records without ever forcing the
+ * record layer to split a write. */
+#define TLS_MAX_RECORD_PLAINTEXT (16*1024)
+
+/* There is no gathered write in the SSL API: emulate writev(2) by
+ * coalescing the vector into full size records. Writing the elements one
+ * at a time would emit (and pad, MAC and frame) one record per element,
+ * which for the typical many-small-buffers reply vector costs both CPU
+ * and bytes on the wire. */
+static int connTLSWritev(connection *conn_, const struct iovec *iov, int iovcnt) {
+    if (iovcnt == 1)
+        return connTLSWrite(conn_, iov[0].iov_base, iov[0].iov_len);
+
+    char buf[TLS_MAX_RECORD_PLAINTEXT];
+    int totwritten = 0;
+    int i = 0;
+    size_t elem_offset = 0; /* Bytes of iov[i] already coalesced. */
+
+    while (i < iovcnt) {
+        size_t buflen = 0;
+        while (i < iovcnt && buflen < sizeof(buf)) {
+            size_t copy = iov[i].iov_len - elem_offset;
+            if (copy > sizeof(buf)-buflen) copy = sizeof(buf)-buflen;
+            memcpy(buf+buflen, (char*)iov[i].iov_base+elem_offset, copy);
+            buflen += copy;
+            elem_offset += copy;
+            if (elem_offset == iov[i].iov_len) {
+                i++;
+                elem_offset = 0;
+            }
+        }
+        int ret = connTLSWrite(conn_, buf, buflen);
+        if (ret <= 0) return totwritten > 0 ? totwritten : ret;
+        totwritten += ret;
+        if ((size_t)ret < buflen) break;
+    }
+    return totwritten;
+}
+
 static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
     tls_connection *conn = (tls_connection *) conn_;
     int ret, ssl_err;
@@ -751,6 +808,7 @@ ConnectionType CT_TLS = {
     .blocking_connect = connTLSBlockingConnect,
     .read = connTLSRead,
     .write = connTLSWrite,
+    .writev = connTLSWritev,
     .close = connTLSClose,
     .set_write_handler = connTLSSetWriteHandler,
     .set_read_handler = connTLSSetReadHandler,
@@ -63,6 +63,99 @@ rax **TrackingTable = NULL;
 unsigned long TrackingTableUsedSlots = 0;
 robj *TrackingChannelName;
 
+/* Clients with invalidation messages accumulated during the current event
+ * loop iteration: instead of sending one push message per invalidated
+ * caching slot, the slots are collected in the per client tracking_pending
+ * list and flushed as a single message from beforeSleep(). This bounds the
+ * invalidation traffic to one message per client per iteration even when a
+ * write touches many slots a client is tracking. */
+list *TrackingPendingClients = NULL;
+
+/* Bounded tracking mode: when tracking-fingerprint-entries is non zero, the
+ * per-slot radix trees above are replaced by a single fixed-size open
+ * addressing table of 64 bit key fingerprints, each tagged with the client
+ * ID and the client tracking epoch. Memory no longer depends on how many
+ * keys the clients fetch: insertion probes a short window starting at the
+ * fingerprint position, and when the window is full of live entries one of
+ * them is evicted by sending its owner a spurious invalidation, exactly as
+ * if the key was modified. The epoch makes entries from a previous tracking
+ * session of the same client ID stale without any scan: enableTracking()
+ * bumps it, so such entries are reclaimed lazily like the rax client IDs.
+ *
+ * Invalidation probes the same window and matches the full 64 bit
+ * fingerprint instead of the 24 bit caching slot, so as a side effect a
+ * client is only notified when a key it actually fetched (or a rare
+ * fingerprint-colliding one) is modified. */
+typedef struct trackingFpEntry {
+    uint64_t keyfp;     /* 64 bit key fingerprint. Zero means free slot. */
+    uint64_t client_id;
+    uint64_t epoch;     /* Client tracking epoch at insertion time. */
+} trackingFpEntry;
+
+#define TRACKING_FP_PROBES 16
+static trackingFpEntry *TrackingFpTable = NULL;
+static uint64_t NextTrackingEpoch = 0;
+
+static void trackingScheduleMessage(client *c, long long hash);
+
+/* Return true if the fingerprint table entry no longer references a live
+ * tracking session and can be overwritten. */
+static int trackingFpEntryStale(trackingFpEntry *e) {
+    if (e->keyfp == 0) return 1;
+    client *owner = lookupClientByID(e->client_id);
+    return owner == NULL || !(owner->flags & CLIENT_TRACKING) ||
+           owner->tracking_epoch != e->epoch;
+}
+
+/* Record in the fingerprint table that client 'c' may cache the key
+ * hashing to 'keyfp'. O(1): at most TRACKING_FP_PROBES slots are
+ * inspected, and on a full window a random live entry is evicted after
+ * scheduling an invalidation for its owner. */
+static void trackingFpRemember(client *c, uint64_t keyfp) {
+    long long size = server.tracking_fp_entries;
+    int probes = TRACKING_FP_PROBES < size ? TRACKING_FP_PROBES : size;
+    uint64_t start = keyfp % size;
+    trackingFpEntry *victim = NULL;
+
+    for (int j = 0; j < probes; j++) {
+        trackingFpEntry *e = &TrackingFpTable[(start+j) % size];
+        if (e->keyfp == keyfp && e->client_id == c->id &&
+            e->epoch == c->tracking_epoch) return; /* Already tracked. */
+        if (victim == NULL && trackingFpEntryStale(e)) victim = e;
+    }
+    if (victim == NULL) {
+        victim = &TrackingFpTable[(start + rand() % probes) % size];
+        client *owner = lookupClientByID(victim->client_id);
+        if (owner && (owner->flags & CLIENT_TRACKING))
+            trackingScheduleMessage(owner,
+                victim->keyfp & (TRACKING_TABLE_SIZE-1));
+    }
+    victim->keyfp = keyfp;
+    victim->client_id = c->id;
+    victim->epoch = c->tracking_epoch;
+}
+
+/* Invalidate the key hashing to 'keyfp' in the fingerprint table: every
+ * client with a live entry for this fingerprint gets the invalidation
+ * message for the corresponding caching slot, and the entries are freed. */
+static void trackingFpInvalidate(uint64_t keyfp) {
+    long long size = server.tracking_fp_entries;
+    int probes = TRACKING_FP_PROBES < size ? TRACKING_FP_PROBES : size;
+    uint64_t start = keyfp % size;
+
+    for (int j = 0; j < probes; j++) {
+        trackingFpEntry *e = &TrackingFpTable[(start+j) % size];
+        if (e->keyfp != keyfp) continue;
+        client *owner = lookupClientByID(e->client_id);
+        if (owner && (owner->flags & CLIENT_TRACKING) &&
+            owner->tracking_epoch == e->epoch)
+        {
+            trackingScheduleMessage(owner,keyfp & (TRACKING_TABLE_SIZE-1));
+        }
+        e->keyfp = 0;
+    }
+}
+
 /* Remove the tracking state from the client 'c'. Note that there is not much
  * to do for us here, if not to decrement the counter of the clients in
  * tracking mode, because we just store the ID of the client in the tracking
@@ -73,6 +166,15 @@ void disableTracking(client *c) {
     if (c->flags & CLIENT_TRACKING) {
         server.tracking_clients--;
         c->flags &= ~(CLIENT_TRACKING|CLIENT_TRACKING_BROKEN_REDIR);
+        /* Drop the invalidation messages not yet delivered: they are
+         * useless for a client that just stopped tracking (and this is
+         * also called when the client is freed). */
+        if (c->tracking_pending) {
+            listNode *ln = listSearchKey(TrackingPendingClients,c);
+            if (ln) listDelNode(TrackingPendingClients,ln);
+            listRelease(c->tracking_pending);
+            c->tracking_pending = NULL;
+        }
     }
 }
 
@@ -88,10 +190,16 @@ void enableTracking(client *c, uint64_t redirect_to) {
     c->flags |= CLIENT_TRACKING;
     c->flags &= ~CLIENT_TRACKING_BROKEN_REDIR;
     c->client_tracking_redirection = redirect_to;
+    c->tracking_epoch = ++NextTrackingEpoch;
     server.tracking_clients++;
-    if (TrackingTable == NULL) {
-        TrackingTable = zcalloc(sizeof(rax*) * TRACKING_TABLE_SIZE);
+    if (TrackingChannelName == NULL)
         TrackingChannelName = createStringObject("__redis__:invalidate",20);
+    if (server.tracking_fp_entries) {
+        if (TrackingFpTable == NULL)
+            TrackingFpTable = zcalloc(sizeof(trackingFpEntry) *
+                                      server.tracking_fp_entries);
+    } else if (TrackingTable == NULL) {
+        TrackingTable = zcalloc(sizeof(rax*) * TRACKING_TABLE_SIZE);
     }
 }
 
@@ -108,8 +216,13 @@ void trackingRememberKeys(client *c) {
     for(int j = 0; j < numkeys; j++) {
         int idx = keys[j];
         sds sdskey = c->argv[idx]->ptr;
-        uint64_t hash = crc64(0,
-            (unsigned char*)sdskey,sdslen(sdskey))&(TRACKING_TABLE_SIZE-1);
+        uint64_t keyfp = crc64(0,(unsigned char*)sdskey,sdslen(sdskey));
+        if (server.tracking_fp_entries) {
+            if (keyfp == 0) keyfp = 1; /* Zero marks free slots. */
+            trackingFpRemember(c,keyfp);
+            continue;
+        }
+        uint64_t hash = keyfp&(TRACKING_TABLE_SIZE-1);
         if (TrackingTable[hash] == NULL) {
             TrackingTable[hash] = raxNew();
             TrackingTableUsedSlots++;
@@ -120,8 +233,35 @@ void trackingRememberKeys(client *c) {
     getKeysFreeResult(keys);
 }
 
-void sendTrackingMessage(client *c, long long hash) {
+/* Queue the invalidation of caching slot 'hash' for client 'c'. The
+ * message itself is built and sent by trackingFlushPendingMessages() at
+ * the end of the current event loop iteration, so that a client tracking
+ * many of the slots touched by a write burst receives a single push
+ * message instead of one per slot. */
+static void trackingScheduleMessage(client *c, long long hash) {
+    if (c->tracking_pending == NULL) {
+        c->tracking_pending = listCreate();
+        if (TrackingPendingClients == NULL)
+            TrackingPendingClients = listCreate();
+        listAddNodeTail(TrackingPendingClients,c);
+    } else {
+        /* The same slot is often invalidated several times in a row (think
+         * of MSET against keys hashing to one slot): merging with the last
+         * queued slot is a cheap partial dedup. */
+        long long last = (long long)(intptr_t)
+            listNodeValue(listLast(c->tracking_pending));
+        if (last == hash) return;
+    }
+    listAddNodeTail(c->tracking_pending,(void*)(intptr_t)hash);
+}
+
+/* Send to 'c' (or to the client it redirects to) the invalidation
+ * messages accumulated in its tracking_pending list, as a single push
+ * message carrying the array of invalidated caching slots. */
+void sendTrackingMessage(client *c) {
     int using_redirection = 0;
+    list *slots = c->tracking_pending;
+
     if (c->client_tracking_redirection) {
         client *redir = lookupClientByID(c->client_tracking_redirection);
         if (!redir) {
@@ -144,13 +284,40 @@ void sendTrackingMessage(client *c, long long hash) {
      * in Pub/Sub mode, we can support the feature with RESP 2 as well,
      * by sending Pub/Sub messages in the __redis__:invalidate channel. */
     if (c->resp > 2) {
+        listIter li;
+        listNode *ln;
         addReplyPushLen(c,2);
         addReplyBulkCBuffer(c,"invalidate",10);
-        addReplyLongLong(c,hash);
+        addReplyArrayLen(c,listLength(slots));
+        listRewind(slots,&li);
+        while ((ln = listNext(&li)) != NULL)
+            addReplyLongLong(c,(long long)(intptr_t)listNodeValue(ln));
     } else if (using_redirection && c->flags & CLIENT_PUBSUB) {
-        robj *msg = createStringObjectFromLongLong(hash);
-        addReplyPubsubMessage(c,TrackingChannelName,msg);
-        decrRefCount(msg);
+        /* Pub/Sub messages carry a single payload: deliver the batch as
+         * one message per slot. */
+        listIter li;
+        listNode *ln;
+        listRewind(slots,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            robj *msg = createStringObjectFromLongLong(
+                (long long)(intptr_t)listNodeValue(ln));
+            addReplyPubsubMessage(c,TrackingChannelName,msg);
+            decrRefCount(msg);
+        }
+    }
+}
+
+/* Called from beforeSleep() to deliver the invalidation messages queued
+ * during this event loop iteration. */
+void trackingFlushPendingMessages(void) {
+    if (TrackingPendingClients == NULL) return;
+    listNode *ln;
+    while ((ln = listFirst(TrackingPendingClients)) != NULL) {
+        client *c = listNodeValue(ln);
+        sendTrackingMessage(c);
+        listRelease(c->tracking_pending);
+        c->tracking_pending = NULL;
+        listDelNode(TrackingPendingClients,ln);
     }
 }
 
@@ -167,7 +334,7 @@ void trackingInvalidateSlot(uint64_t slot) {
         memcpy(&id,ri.key,sizeof(id));
         client *c = lookupClientByID(id);
         if (c == NULL || !(c->flags & CLIENT_TRACKING)) continue;
-        sendTrackingMessage(c,slot);
+        trackingScheduleMessage(c,slot);
     }
     raxStop(&ri);
 
@@ -183,9 +350,17 @@ void trackingInvalidateSlot(uint64_t slot) {
  * to send a notification to every client that may have keys about such caching
  * slot. */
 void trackingInvalidateKey(robj *keyobj) {
-    if (TrackingTable == NULL || TrackingTableUsedSlots == 0) return;
-
     sds sdskey = keyobj->ptr;
+
+    if (server.tracking_fp_entries) {
+        if (TrackingFpTable == NULL) return;
+        uint64_t keyfp = crc64(0,(unsigned char*)sdskey,sdslen(sdskey));
+        if (keyfp == 0) keyfp = 1;
+        trackingFpInvalidate(keyfp);
+        return;
+    }
+
+    if (TrackingTable == NULL || TrackingTableUsedSlots == 0) return;
     uint64_t hash = crc64(0,
         (unsigned char*)sdskey,sdslen(sdskey))&(TRACKING_TABLE_SIZE-1);
     trackingInvalidateSlot(hash);
@@ -213,12 +388,23 @@ void trackingInvalidateKeysOnFlush(int dbid) {
         while ((ln = listNext(&li)) != NULL) {
             client *c = listNodeValue(ln);
             if (c->flags & CLIENT_TRACKING) {
-                sendTrackingMessage(c,-1);
+                trackingScheduleMessage(c,-1);
             }
         }
     }
 
-    /* In case of FLUSHALL, reclaim all the memory used by tracking. */
+    /* In case of FLUSHALL, reclaim all the memory used by tracking. The
+     * fingerprint table is small and fixed size, so just zeroing it (or
+     * freeing it when the last tracking client is gone) is cheap. */
+    if (dbid == -1 && TrackingFpTable) {
+        if (server.tracking_clients == 0) {
+            zfree(TrackingFpTable);
+            TrackingFpTable = NULL;
+        } else {
+            memset(TrackingFpTable,0,
+                sizeof(trackingFpEntry) * server.tracking_fp_entries);
+        }
+    }
     if (dbid == -1 && TrackingTable) {
         for (int j = 0; j < TRACKING_TABLE_SIZE && TrackingTableUsedSlots > 0; j++) {
             if (TrackingTable[j] != NULL) {
@@ -253,6 +439,7 @@ void trackingInvalidateKeysOnFlush(int dbid) {
 void trackingLimitUsedSlots(void) {
     static unsigned int timeout_counter = 0;
 
+    if (server.tracking_fp_entries) return; /* Bounded mode: fixed size. */
     if (server.tracking_table_max_fill == 0) return; /* No limits set. */
     unsigned int max_slots =
         (TRACKING_TABLE_SIZE/100) * server.tracking_table_max_fill;
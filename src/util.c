@@ -509,6 +509,337 @@ int string2d(const char *s, size_t slen, double *dp) {
     return 1;
 }
 
+/* ---------------------------------------------------------------------------
+ * Fast double to string conversion (Grisu2).
+ *
+ * snprintf("%.17g") costs microseconds per call and dominates the cost of
+ * every command replying with a double (ZSCORE and friends). The Grisu2
+ * algorithm of Florian Loitsch ("Printing floating-point numbers quickly
+ * and accurately with integers", PLDI 2010) produces, with only 64 bit
+ * integer arithmetic, the shortest sequence of digits that still converts
+ * back to exactly the same double, which is both an order of magnitude
+ * faster and nicer to read: 3.14 is printed as "3.14" and not as
+ * "3.1400000000000001".
+ * ------------------------------------------------------------------------ */
+
+typedef struct diyfp {
+    uint64_t frac;
+    int exp;
+} diyfp;
+
+#define DIYFP_FRAC_MASK 0x000fffffffffffffULL
+#define DIYFP_EXP_MASK 0x7ff0000000000000ULL
+#define DIYFP_HIDDEN_BIT 0x0010000000000000ULL
+#define DIYFP_EXP_BIAS 1075
+
+/* Cached normalized powers of ten: 10^k for k = -348 to 340 with step 8,
+ * each one as a normalized 64 bit significand and a binary exponent,
+ * correctly rounded (generated with exact integer arithmetic). */
+static const diyfp pow10cache[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 },
+    { 0x8b16fb203055ac76ULL, -1166 }, { 0xcf42894a5dce35eaULL, -1140 },
+    { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 },
+    { 0xbe5691ef416bd60cULL, -1007 }, { 0x8dd01fad907ffc3cULL, -980 },
+    { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+    { 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 },
+    { 0x823c12795db6ce57ULL, -847 }, { 0xc21094364dfb5637ULL, -821 },
+    { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+    { 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 },
+    { 0xb23867fb2a35b28eULL, -688 }, { 0x84c8d4dfd2c63f3bULL, -661 },
+    { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+    { 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 },
+    { 0xf3e2f893dec3f126ULL, -529 }, { 0xb5b5ada8aaff80b8ULL, -502 },
+    { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+    { 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 },
+    { 0xa6dfbd9fb8e5b88fULL, -369 }, { 0xf8a95fcf88747d94ULL, -343 },
+    { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+    { 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 },
+    { 0xe45c10c42a2b3b06ULL, -210 }, { 0xaa242499697392d3ULL, -183 },
+    { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+    { 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 },
+    { 0x9c40000000000000ULL, -50 }, { 0xe8d4a51000000000ULL, -24 },
+    { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+    { 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 },
+    { 0xd5d238a4abe98068ULL, 109 }, { 0x9f4f2726179a2245ULL, 136 },
+    { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+    { 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 },
+    { 0x924d692ca61be758ULL, 269 }, { 0xda01ee641a708deaULL, 295 },
+    { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+    { 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 },
+    { 0xc83553c5c8965d3dULL, 428 }, { 0x952ab45cfa97a0b3ULL, 455 },
+    { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+    { 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 },
+    { 0x88fcf317f22241e2ULL, 588 }, { 0xcc20ce9bd35c78a5ULL, 614 },
+    { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+    { 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 },
+    { 0xbb764c4ca7a44410ULL, 747 }, { 0x8bab8eefb6409c1aULL, 774 },
+    { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+    { 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 },
+    { 0x80444b5e7aa7cf85ULL, 907 }, { 0xbf21e44003acdd2dULL, 933 },
+    { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+    { 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 },
+    { 0xaf87023b9bf0ee6bULL, 1066 },
+};
+
+/* Return the cached power of ten that brings 'exp' (the binary exponent
+ * of the scaled number) into the [-60,-32] range the digit generation
+ * loop requires, and store the corresponding decimal exponent in 'k'. */
+static diyfp diyfpCachedPow10(int exp, int *k) {
+    /* 1/log2(10), to estimate the starting table index. */
+    const double one_log_ten = 0.30102999566398114;
+    int idx = (int)((-60 - exp - 64) * one_log_ten + 348) / 8;
+
+    while (1) {
+        int current = exp + pow10cache[idx].exp + 64;
+        if (current < -60) { idx++; continue; }
+        if (current > -32) { idx--; continue; }
+        *k = -348 + idx * 8;
+        return pow10cache[idx];
+    }
+}
+
+/* Full precision 64x64 -> high 64 bits multiply, with rounding of the
+ * discarded low half. */
+static diyfp diyfpMultiply(diyfp x, diyfp y) {
+    const uint64_t mask32 = 0xffffffffULL;
+    uint64_t a = x.frac >> 32, b = x.frac & mask32;
+    uint64_t c = y.frac >> 32, d = y.frac & mask32;
+    uint64_t ac = a*c, bc = b*c, ad = a*d, bd = b*d;
+    uint64_t mid = (bd >> 32) + (ad & mask32) + (bc & mask32);
+    diyfp r;
+
+    mid += 1ULL << 31; /* Round the discarded 32 bits. */
+    r.frac = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+    r.exp = x.exp + y.exp + 64;
+    return r;
+}
+
+/* Decompose a finite, non zero, positive double into significand and
+ * binary exponent. */
+static diyfp diyfpFromDouble(double d) {
+    uint64_t bits;
+    diyfp fp;
+
+    memcpy(&bits,&d,sizeof(bits));
+    fp.frac = bits & DIYFP_FRAC_MASK;
+    fp.exp = (int)((bits & DIYFP_EXP_MASK) >> 52);
+    if (fp.exp) {
+        fp.frac += DIYFP_HIDDEN_BIT;
+        fp.exp -= DIYFP_EXP_BIAS;
+    } else {
+        fp.exp = -DIYFP_EXP_BIAS + 1; /* Denormal. */
+    }
+    return fp;
+}
+
+/* Compute the normalized boundaries of 'fp': the values halfway to the
+ * previous and the next representable double. Any decimal inside
+ * (lower,upper) converts back to exactly the original double, which is
+ * what lets the digit generation stop as early as possible. */
+static void diyfpNormalizedBoundaries(diyfp fp, diyfp *lower, diyfp *upper) {
+    int lshift;
+
+    upper->frac = (fp.frac << 1) + 1;
+    upper->exp = fp.exp - 1;
+    while ((upper->frac & (DIYFP_HIDDEN_BIT << 1)) == 0) {
+        upper->frac <<= 1;
+        upper->exp--;
+    }
+    upper->frac <<= 64 - 54;
+    upper->exp -= 64 - 54;
+
+    /* The lower boundary is closer when the significand is a power of
+     * two, since the gap below shrinks by half. */
+    lshift = fp.frac == DIYFP_HIDDEN_BIT ? 2 : 1;
+    lower->frac = (fp.frac << lshift) - 1;
+    lower->exp = fp.exp - lshift;
+    lower->frac <<= lower->exp - upper->exp;
+    lower->exp = upper->exp;
+}
+
+/* If allowed by the boundaries, decrement the last generated digit
+ * towards the exact scaled value 'frac', so the result is as close as
+ * possible to the original double. */
+static void grisu2RoundDigit(char *digits, int ndigits, uint64_t delta,
+                             uint64_t rem, uint64_t kappa, uint64_t frac)
+{
+    while (rem < frac && delta - rem >= kappa &&
+           (rem + kappa < frac || frac - rem > rem + kappa - frac))
+    {
+        digits[ndigits-1]--;
+        rem += kappa;
+    }
+}
+
+/* Generate the decimal digits of the number scaled between the scaled
+ * boundaries, stopping as soon as the produced prefix identifies the
+ * double unambiguously. Returns the number of digits, and adjusts '*K'
+ * (the decimal exponent) accordingly. */
+static int grisu2Digits(diyfp fp, diyfp upper, diyfp lower, char *digits,
+                        int *K)
+{
+    static const uint64_t tens[] = {
+        10000000000000000000ULL, 1000000000000000000ULL,
+        100000000000000000ULL, 10000000000000000ULL, 1000000000000000ULL,
+        100000000000000ULL, 10000000000000ULL, 1000000000000ULL,
+        100000000000ULL, 10000000000ULL, 1000000000ULL, 100000000ULL,
+        10000000ULL, 1000000ULL, 100000ULL, 10000ULL, 1000ULL, 100ULL,
+        10ULL, 1ULL
+    };
+    uint64_t wfrac = upper.frac - fp.frac;
+    uint64_t delta = upper.frac - lower.frac;
+    uint64_t one_frac = 1ULL << -upper.exp;
+    uint64_t part1 = upper.frac >> -upper.exp;
+    uint64_t part2 = upper.frac & (one_frac - 1);
+    int idx = 0, kappa = 10;
+    const uint64_t *divp;
+
+    /* Integer part: part1 < 2^32 given the exponent range enforced by
+     * diyfpCachedPow10(), so ten divisors starting at 10^9 suffice. */
+    for (divp = tens + 10; kappa > 0; divp++) {
+        uint64_t div = *divp;
+        unsigned digit = part1 / div;
+
+        if (digit || idx) digits[idx++] = '0' + digit;
+        part1 -= digit * div;
+        kappa--;
+
+        uint64_t tmp = (part1 << -upper.exp) + part2;
+        if (tmp <= delta) {
+            *K += kappa;
+            grisu2RoundDigit(digits,idx,delta,tmp,div << -upper.exp,wfrac);
+            return idx;
+        }
+    }
+
+    /* Fractional part, one digit at a time. */
+    const uint64_t *unit = tens + 18;
+    while (1) {
+        unsigned digit;
+
+        part2 *= 10;
+        delta *= 10;
+        kappa--;
+        digit = (unsigned)(part2 >> -upper.exp);
+        if (digit || idx) digits[idx++] = '0' + digit;
+        part2 &= one_frac - 1;
+        if (part2 < delta) {
+            *K += kappa;
+            grisu2RoundDigit(digits,idx,delta,part2,one_frac,wfrac * *unit);
+            return idx;
+        }
+        unit--;
+    }
+}
+
+/* Run Grisu2 on the finite positive double 'd': store the shortest digit
+ * string identifying it in 'digits' (at most 18 of them, not zero
+ * terminated) and the decimal exponent in 'K', so that the value is
+ * 0.digits * 10^(K+ndigits). Returns the number of digits. */
+static int grisu2(double d, char *digits, int *K) {
+    diyfp w = diyfpFromDouble(d);
+    diyfp lower, upper, cp;
+    int k, shift;
+
+    diyfpNormalizedBoundaries(w,&lower,&upper);
+
+    /* Normalize w itself. */
+    while ((w.frac & DIYFP_HIDDEN_BIT) == 0) {
+        w.frac <<= 1;
+        w.exp--;
+    }
+    shift = 64 - 52 - 1;
+    w.frac <<= shift;
+    w.exp -= shift;
+
+    cp = diyfpCachedPow10(upper.exp,&k);
+    w = diyfpMultiply(w,cp);
+    upper = diyfpMultiply(upper,cp);
+    lower = diyfpMultiply(lower,cp);
+
+    /* Shrink the boundaries by one unit to account for the rounding of
+     * the multiplications: anything we produce inside them is then
+     * guaranteed to convert back to the original double. */
+    lower.frac++;
+    upper.frac--;
+
+    *K = -k;
+    return grisu2Digits(w,upper,lower,digits,K);
+}
+
+/* Format the digits produced by grisu2() into 'dst' using the shortest
+ * sensible notation: plain integer, fixed point, or scientific for very
+ * large and very small magnitudes. Returns the length, 'dst' is also
+ * zero terminated. */
+static int grisu2Emit(char *dst, char *digits, int ndigits, int K) {
+    int exp10 = K + ndigits - 1; /* Exponent of the leading digit. */
+    int idx = 0, j;
+
+    if (K >= 0 && exp10 < 21) {
+        /* Integral value: digits followed by K zeroes. */
+        memcpy(dst,digits,ndigits);
+        memset(dst+ndigits,'0',K);
+        idx = ndigits + K;
+    } else if (K < 0 && exp10 >= -5 && exp10 < 21) {
+        int intdigits = ndigits + K; /* Digits before the point. */
+        if (intdigits <= 0) {
+            /* 0.00ddd */
+            memcpy(dst,"0.",2);
+            memset(dst+2,'0',-intdigits);
+            memcpy(dst+2-intdigits,digits,ndigits);
+            idx = ndigits - intdigits + 2;
+        } else {
+            /* ddd.ddd */
+            memcpy(dst,digits,intdigits);
+            dst[intdigits] = '.';
+            memcpy(dst+intdigits+1,digits+intdigits,ndigits-intdigits);
+            idx = ndigits + 1;
+        }
+    } else {
+        /* Scientific notation: d.ddde[-]dd */
+        dst[idx++] = digits[0];
+        if (ndigits > 1) {
+            dst[idx++] = '.';
+            memcpy(dst+idx,digits+1,ndigits-1);
+            idx += ndigits-1;
+        }
+        dst[idx++] = 'e';
+        if (exp10 < 0) {
+            dst[idx++] = '-';
+            exp10 = -exp10;
+        } else {
+            dst[idx++] = '+';
+        }
+        char expbuf[4];
+        j = ll2string(expbuf,sizeof(expbuf),exp10);
+        /* strtod() and %g agree on at least two exponent digits. */
+        if (j < 2) dst[idx++] = '0';
+        memcpy(dst+idx,expbuf,j);
+        idx += j;
+    }
+    dst[idx] = '\0';
+    return idx;
+}
+
+/* Convert a finite double to its shortest string representation that
+ * converts back to exactly the same value. 'dst' must be at least
+ * DOUBLE_STR_SIZE bytes. Returns the length of the produced string,
+ * that is also zero terminated. This is the fast path of d2string() and
+ * of addReplyDouble(): see the comment at the top of this section. */
+int dtoa(char *dst, double value) {
+    char digits[20];
+    int K, ndigits, neg = 0;
+
+    if (value < 0) {
+        *dst++ = '-';
+        value = -value;
+        neg = 1;
+    }
+    ndigits = grisu2(value,digits,&K);
+    return grisu2Emit(dst,digits,ndigits,K) + neg;
+}
+
 /* Convert a double to a string representation. Returns the number of bytes
  * required. The representation should always be parsable by strtod(3).
  * This function does not support human-friendly formatting like ld2string
@@ -545,6 +876,9 @@ int d2string(char *buf, size_t len, double value) {
             len = ll2string(buf,len,(long long)value);
         else
 #endif
+        if (len >= DOUBLE_STR_SIZE)
+            len = dtoa(buf,value);
+        else
             len = snprintf(buf,len,"%.17g",value);
     }
 
@@ -38,6 +38,11 @@
  * This should be the size of the buffer given to ld2string */
 #define MAX_LONG_DOUBLE_CHARS 5*1024
 
+/* The maximum number of characters dtoa() may produce for a double,
+ * terminator included. This should be the size of the buffer given to
+ * dtoa(). */
+#define DOUBLE_STR_SIZE 32
+
 /* long double to string convertion options */
 typedef enum {
     LD_STR_AUTO,     /* %.17Lg */
@@ -57,6 +62,7 @@ int string2ull(const char *s, unsigned long long *value);
 int string2l(const char *s, size_t slen, long *value);
 int string2ld(const char *s, size_t slen, long double *dp);
 int string2d(const char *s, size_t slen, double *dp);
+int dtoa(char *dst, double value);
 int d2string(char *buf, size_t len, double value);
 int ld2string(char *buf, size_t len, long double value, ld2string_mode mode);
 sds getAbsolutePath(char *filename);
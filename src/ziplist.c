@@ -190,6 +190,10 @@
 #include "endianconv.h"
 #include "redisassert.h"
 
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #define ZIP_END 255         /* Special "end of ziplist" entry. */
 #define ZIP_BIG_PREVLEN 254 /* Max number of bytes of the previous entry, for
                                the "prevlen" field prefixing each entry, to be
@@ -577,7 +581,7 @@ void zipEntry(unsigned char *p, zlentry *e) {
 /* Create a new empty ziplist. */
 unsigned char *ziplistNew(void) {
     unsigned int bytes = ZIPLIST_HEADER_SIZE+ZIPLIST_END_SIZE;
-    unsigned char *zl = zmalloc(bytes);
+    unsigned char *zl = zmalloc_typed(ZMALLOC_TYPE_VALUE,bytes);
     ZIPLIST_BYTES(zl) = intrev32ifbe(bytes);
     ZIPLIST_TAIL_OFFSET(zl) = intrev32ifbe(ZIPLIST_HEADER_SIZE);
     ZIPLIST_LENGTH(zl) = 0;
@@ -587,7 +591,7 @@ unsigned char *ziplistNew(void) {
 
 /* Resize the ziplist. */
 unsigned char *ziplistResize(unsigned char *zl, unsigned int len) {
-    zl = zrealloc(zl,len);
+    zl = zrealloc_typed(ZMALLOC_TYPE_VALUE,zl,len);
     ZIPLIST_BYTES(zl) = intrev32ifbe(len);
     zl[len-1] = ZIP_END;
     return zl;
@@ -903,7 +907,7 @@ unsigned char *ziplistMerge(unsigned char **first, unsigned char **second) {
     size_t second_offset = intrev32ifbe(ZIPLIST_TAIL_OFFSET(*second));
 
     /* Extend target to new zlbytes then append or prepend source. */
-    target = zrealloc(target, zlbytes);
+    target = zrealloc_typed(ZMALLOC_TYPE_VALUE, target, zlbytes);
     if (append) {
         /* append == appending to target */
         /* Copy source after target (copying over original [END]):
@@ -1076,6 +1080,41 @@ unsigned char *ziplistDeleteRange(unsigned char *zl, int index, unsigned int num
     return (p == NULL) ? zl : __ziplistDelete(zl,p,num);
 }
 
+/* Equality test between the 'len' bytes at 'a' and 'b'.
+ *
+ * Entry boundaries inside a ziplist can only be located decoding the
+ * variable length headers sequentially, however once a candidate entry
+ * is found the content comparison itself is a fixed-size byte compare:
+ * for the short keys typically stored in ziplist encoded hashes and
+ * sorted sets this inline kernel avoids the libc memcmp() call overhead
+ * comparing 32 (AVX2) or 16 (SSE2) bytes per step, with a plain scalar
+ * loop on the other architectures. */
+static inline int zipByteArrayEq(const unsigned char *a,
+                                 const unsigned char *b,
+                                 unsigned int len)
+{
+#if defined(__AVX2__)
+    while (len >= 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)a);
+        __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va,vb)) != -1) return 0;
+        a += 32; b += 32; len -= 32;
+    }
+#endif
+#if defined(__SSE2__)
+    while (len >= 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)a);
+        __m128i vb = _mm_loadu_si128((const __m128i*)b);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va,vb)) != 0xffff) return 0;
+        a += 16; b += 16; len -= 16;
+    }
+#endif
+    while (len--) {
+        if (*a++ != *b++) return 0;
+    }
+    return 1;
+}
+
 /* Compare entry pointer to by 'p' with 'sstr' of length 'slen'. */
 /* Return 1 if equal. */
 unsigned int ziplistCompare(unsigned char *p, unsigned char *sstr, unsigned int slen) {
@@ -1088,7 +1127,7 @@ unsigned int ziplistCompare(unsigned char *p, unsigned char *sstr, unsigned int
     if (ZIP_IS_STR(entry.encoding)) {
         /* Raw compare */
         if (entry.len == slen) {
-            return memcmp(p+entry.headersize,sstr,slen) == 0;
+            return zipByteArrayEq(p+entry.headersize,sstr,slen);
         } else {
             return 0;
         }
@@ -1121,7 +1160,7 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
         if (skipcnt == 0) {
             /* Compare current entry with specified entry */
             if (ZIP_IS_STR(encoding)) {
-                if (len == vlen && memcmp(q, vstr, vlen) == 0) {
+                if (len == vlen && zipByteArrayEq(q, vstr, vlen)) {
                     return p;
                 }
             } else {
@@ -1187,6 +1226,95 @@ size_t ziplistBlobLen(unsigned char *zl) {
     return intrev32ifbe(ZIPLIST_BYTES(zl));
 }
 
+/* Validate the integrity of a serialized ziplist of 'size' bytes, so that
+ * it can be adopted as is from an untrusted source (a RESTORE payload).
+ * When 'deep' is zero only the header and the terminator are checked, in
+ * constant time. When non zero every entry is scanned, verifying that all
+ * the encodings are known and that every length stays inside the buffer:
+ * after that, a traversal with the normal API can't read out of bounds.
+ * Returns 1 if the ziplist is valid, 0 otherwise. */
+int ziplistValidateIntegrity(unsigned char *zl, size_t size, int deep) {
+    /* Must be long enough to hold the header and the terminator. */
+    if (size < ZIPLIST_HEADER_SIZE + ZIPLIST_END_SIZE) return 0;
+
+    /* The encoded size must match the buffer, and the terminator
+     * must be there. */
+    if (intrev32ifbe(ZIPLIST_BYTES(zl)) != size) return 0;
+    if (zl[size-1] != ZIP_END) return 0;
+
+    /* The tail offset can't point outside the buffer. */
+    if (intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl)) > size - ZIPLIST_END_SIZE)
+        return 0;
+
+    if (!deep) return 1;
+
+    unsigned int count = 0, prevlen = 0;
+    unsigned char *p = zl + ZIPLIST_HEADER_SIZE;
+    unsigned char *end = zl + size - ZIPLIST_END_SIZE; /* At the ZIP_END byte. */
+    unsigned char *header = p;
+
+    while (p < end) {
+        unsigned int prevrawlensize, prevrawlen, lensize, len;
+        unsigned char encoding;
+
+        /* Decode the prevlen, making sure all its bytes, and at least the
+         * first byte of the encoding, are inside the buffer. */
+        ZIP_DECODE_PREVLENSIZE(p, prevrawlensize);
+        if ((size_t)(end - p) < prevrawlensize + 1) return 0;
+        ZIP_DECODE_PREVLEN(p, prevrawlensize, prevrawlen);
+        if (prevrawlen != prevlen) return 0;
+
+        /* Decode the entry encoding by hand: ZIP_DECODE_LENGTH() panics
+         * on unknown encodings while here we want to fail gracefully. */
+        unsigned char *q = p + prevrawlensize;
+        encoding = q[0];
+        if (encoding < ZIP_STR_MASK) {
+            encoding &= ZIP_STR_MASK;
+            if (encoding == ZIP_STR_06B) {
+                lensize = 1;
+                len = q[0] & 0x3f;
+            } else if (encoding == ZIP_STR_14B) {
+                lensize = 2;
+                if ((size_t)(end - q) < 2) return 0;
+                len = ((q[0] & 0x3f) << 8) | q[1];
+            } else { /* ZIP_STR_32B, any '10......' byte maps here. */
+                lensize = 5;
+                if ((size_t)(end - q) < 5) return 0;
+                len = (q[1] << 24) | (q[2] << 16) | (q[3] << 8) | q[4];
+            }
+        } else {
+            lensize = 1;
+            if (encoding == ZIP_INT_8B) len = 1;
+            else if (encoding == ZIP_INT_16B) len = 2;
+            else if (encoding == ZIP_INT_24B) len = 3;
+            else if (encoding == ZIP_INT_32B) len = 4;
+            else if (encoding == ZIP_INT_64B) len = 8;
+            else if (encoding >= ZIP_INT_IMM_MIN && encoding <= ZIP_INT_IMM_MAX)
+                len = 0;
+            else return 0;
+        }
+
+        /* The whole entry must fit before the terminator. */
+        if ((size_t)(end - p) < (size_t)prevrawlensize + lensize + len)
+            return 0;
+        prevlen = prevrawlensize + lensize + len;
+        p += prevlen;
+        count++;
+    }
+    if (p != end) return 0;
+
+    /* The tail offset must point exactly to the start of the last entry,
+     * or right at the terminator for an empty ziplist. */
+    unsigned char *tail = zl + intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl));
+    if (tail != (count ? end - prevlen : header)) return 0;
+
+    /* When the length header is not saturated it must match the number
+     * of entries we walked. */
+    if (intrev16ifbe(ZIPLIST_LENGTH(zl)) != UINT16_MAX &&
+        count != intrev16ifbe(ZIPLIST_LENGTH(zl))) return 0;
+    return 1;
+}
+
 void ziplistRepr(unsigned char *zl) {
     unsigned char *p;
     int index = 0;
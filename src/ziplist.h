@@ -48,6 +48,7 @@ unsigned int ziplistCompare(unsigned char *p, unsigned char *s, unsigned int sle
 unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip);
 unsigned int ziplistLen(unsigned char *zl);
 size_t ziplistBlobLen(unsigned char *zl);
+int ziplistValidateIntegrity(unsigned char *zl, size_t size, int deep);
 void ziplistRepr(unsigned char *zl);
 
 #ifdef REDIS_TEST
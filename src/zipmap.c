@@ -370,6 +370,59 @@ size_t zipmapBlobLen(unsigned char *zm) {
     return totlen;
 }
 
+/* Validate the integrity of a serialized zipmap of 'size' bytes, so that
+ * it can be walked safely when it comes from an untrusted source (a
+ * RESTORE payload carrying a dump from Redis 2.4). When 'deep' is zero
+ * only the terminator is checked; when non zero every key/value pair is
+ * scanned verifying that all the length prefixes stay inside the buffer.
+ * Returns 1 if the zipmap is valid, 0 otherwise. */
+int zipmapValidateIntegrity(unsigned char *zm, size_t size, int deep) {
+    /* Must be long enough to hold the length byte and the terminator. */
+    if (size < 2) return 0;
+    if (zm[size-1] != ZIPMAP_END) return 0;
+
+    if (!deep) return 1;
+
+    unsigned int count = 0;
+    unsigned char *p = zm + 1;
+    unsigned char *end = zm + size - 1; /* At the ZIPMAP_END byte. */
+
+    while (p < end) {
+        unsigned int l;
+
+        /* Key: length prefix plus the key bytes. */
+        if (p[0] >= ZIPMAP_BIGLEN) {
+            if (p[0] == ZIPMAP_END) return 0; /* Stray terminator. */
+            if ((size_t)(end - p) < 5) return 0;
+        }
+        l = zipmapDecodeLength(p);
+        p += ZIPMAP_LEN_BYTES(l);
+        if ((size_t)(end - p) < l) return 0;
+        p += l;
+
+        /* Value: length prefix, free byte, then value and free bytes. */
+        if (p >= end) return 0;
+        if (p[0] >= ZIPMAP_BIGLEN) {
+            if (p[0] == ZIPMAP_END) return 0;
+            if ((size_t)(end - p) < 5) return 0;
+        }
+        l = zipmapDecodeLength(p);
+        p += ZIPMAP_LEN_BYTES(l);
+        if (p >= end) return 0; /* Make sure the free byte is there. */
+        unsigned int vfree = p[0];
+        p++;
+        if ((size_t)(end - p) < (size_t)l + vfree) return 0;
+        p += l + vfree;
+        count++;
+    }
+    if (p != end) return 0;
+
+    /* When the length byte is not saturated it must match the number of
+     * pairs we walked. */
+    if (zm[0] < ZIPMAP_BIGLEN && zm[0] != count) return 0;
+    return 1;
+}
+
 #ifdef REDIS_TEST
 static void zipmapRepr(unsigned char *p) {
     unsigned int l;
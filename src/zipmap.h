@@ -44,6 +44,7 @@ int zipmapGet(unsigned char *zm, unsigned char *key, unsigned int klen, unsigned
 int zipmapExists(unsigned char *zm, unsigned char *key, unsigned int klen);
 unsigned int zipmapLen(unsigned char *zm);
 size_t zipmapBlobLen(unsigned char *zm);
+int zipmapValidateIntegrity(unsigned char *zm, size_t size, int deep);
 void zipmapRepr(unsigned char *p);
 
 #ifdef REDIS_TEST
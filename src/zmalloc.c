@@ -42,6 +42,9 @@ void zlibc_free(void *ptr) {
 
 #include <string.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include "config.h"
 #include "zmalloc.h"
 #include "atomicvar.h"
@@ -68,9 +71,14 @@ void zlibc_free(void *ptr) {
 #define realloc(ptr,size) je_realloc(ptr,size)
 #define free(ptr) je_free(ptr)
 #define mallocx(size,flags) je_mallocx(size,flags)
+#define rallocx(ptr,size,flags) je_rallocx(ptr,size,flags)
 #define dallocx(ptr,flags) je_dallocx(ptr,flags)
 #endif
 
+/* Size of the explicit huge pages used by zmalloc_hugepage(). 2MB is the
+ * huge page size on every architecture we care about. */
+#define ZMALLOC_HUGEPAGE_SIZE ((size_t)2*1024*1024)
+
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
@@ -125,6 +133,24 @@ void zfree_no_tcache(void *ptr) {
     update_zmalloc_stat_free(zmalloc_size(ptr));
     dallocx(ptr, MALLOCX_TCACHE_NONE);
 }
+
+/* Like zmalloc_no_tcache(), but the copy is served from the same arena
+ * 'oldptr' lives in. The defragmenter must not migrate allocations out of
+ * the typed arenas (see zmalloc_typed() below): it would undo the class
+ * segregation, and the utilization hint that triggered the move was
+ * computed against the bins of the original arena anyway. */
+void *zmalloc_no_tcache_like(void *oldptr, size_t size) {
+    unsigned arena;
+    size_t sz = sizeof(arena);
+    void *ptr;
+
+    if (je_mallctl("arenas.lookup",&arena,&sz,&oldptr,sizeof(oldptr)))
+        return zmalloc_no_tcache(size);
+    ptr = mallocx(size+PREFIX_SIZE, MALLOCX_ARENA(arena)|MALLOCX_TCACHE_NONE);
+    if (!ptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+}
 #endif
 
 void *zcalloc(size_t size) {
@@ -217,6 +243,195 @@ char *zstrdup(const char *s) {
     return p;
 }
 
+/* ---------------------------- Typed allocations ---------------------------
+ *
+ * With jemalloc the main allocation classes of the server are segregated
+ * into dedicated arenas: keyspace metadata (dict entries, hash tables,
+ * object headers) is small and long lived, value payloads (ziplists,
+ * intsets, listpacks) are medium lived, and I/O buffers are gone within
+ * milliseconds. When the classes interleave in the same arena the short
+ * lived allocations punch holes between the long lived ones, and the
+ * active defrag cycle has to repair the damage afterwards. Keeping each
+ * class in its own arena makes extent populations uniform, so the
+ * fragmentation is structurally lower.
+ *
+ * The default thread cache is still used: refills are served from (and
+ * flushes returned to) the arena owning each object, so extent growth is
+ * strictly segregated, and only the handful of objects parked in a cache
+ * bin at any time can be recycled across classes of the same size.
+ *
+ * When arena creation fails, or jemalloc is not the allocator, the typed
+ * functions transparently degrade to the plain ones. Mixing is always
+ * safe: zfree() and zmalloc_size() work on a pointer no matter the arena
+ * that served it. */
+
+#if defined(USE_JEMALLOC)
+static unsigned zmalloc_typed_arena[ZMALLOC_TYPE_COUNT];
+static int zmalloc_typed_ready = 0;
+
+/* Create the per-class arenas. Called once at startup: allocations
+ * performed before this point just come from the default arenas. */
+void zmalloc_typed_init(void) {
+    int j;
+
+    for (j = 0; j < ZMALLOC_TYPE_COUNT; j++) {
+        size_t sz = sizeof(zmalloc_typed_arena[j]);
+        if (je_mallctl("arenas.create",&zmalloc_typed_arena[j],&sz,NULL,0))
+            return; /* Keep serving everything from the default arenas. */
+    }
+    zmalloc_typed_ready = 1;
+}
+
+void *zmalloc_typed(int type, size_t size) {
+    void *ptr;
+
+    if (!zmalloc_typed_ready) return zmalloc(size);
+    ptr = mallocx(size ? size : 1,
+                  MALLOCX_ARENA(zmalloc_typed_arena[type]));
+    if (!ptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+}
+
+void *zcalloc_typed(int type, size_t size) {
+    void *ptr;
+
+    if (!zmalloc_typed_ready) return zcalloc(size);
+    ptr = mallocx(size ? size : 1,
+                  MALLOCX_ARENA(zmalloc_typed_arena[type])|MALLOCX_ZERO);
+    if (!ptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+}
+
+void *zrealloc_typed(int type, void *ptr, size_t size) {
+    size_t oldsize;
+    void *newptr;
+
+    if (!zmalloc_typed_ready) return zrealloc(ptr,size);
+    if (size == 0 && ptr != NULL) {
+        zfree(ptr);
+        return NULL;
+    }
+    if (ptr == NULL) return zmalloc_typed(type,size);
+    oldsize = zmalloc_size(ptr);
+    newptr = rallocx(ptr,size,MALLOCX_ARENA(zmalloc_typed_arena[type]));
+    if (!newptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_free(oldsize);
+    update_zmalloc_stat_alloc(zmalloc_size(newptr));
+    return newptr;
+}
+
+/* Report the jemalloc statistics of the arena backing allocation class
+ * 'type', for MEMORY STATS. Returns 0 (with the counters zeroed) when the
+ * typed arenas are not in use. */
+int zmalloc_typed_arena_stats(int type, size_t *allocated, size_t *active,
+                              size_t *resident)
+{
+    uint64_t epoch = 1;
+    size_t sz, small = 0, large = 0, pactive = 0, page = 4096;
+    unsigned arena;
+    char ctl[80];
+
+    *allocated = *active = *resident = 0;
+    if (!zmalloc_typed_ready) return 0;
+    arena = zmalloc_typed_arena[type];
+    /* Update the statistics cached by mallctl. */
+    sz = sizeof(epoch);
+    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    sz = sizeof(size_t);
+    snprintf(ctl,sizeof(ctl),"stats.arenas.%u.small.allocated",arena);
+    je_mallctl(ctl, &small, &sz, NULL, 0);
+    snprintf(ctl,sizeof(ctl),"stats.arenas.%u.large.allocated",arena);
+    je_mallctl(ctl, &large, &sz, NULL, 0);
+    *allocated = small+large;
+    je_mallctl("arenas.page", &page, &sz, NULL, 0);
+    snprintf(ctl,sizeof(ctl),"stats.arenas.%u.pactive",arena);
+    je_mallctl(ctl, &pactive, &sz, NULL, 0);
+    *active = pactive*page;
+    snprintf(ctl,sizeof(ctl),"stats.arenas.%u.resident",arena);
+    je_mallctl(ctl, resident, &sz, NULL, 0);
+    return 1;
+}
+#else
+void zmalloc_typed_init(void) {}
+
+void *zmalloc_typed(int type, size_t size) {
+    ((void)type);
+    return zmalloc(size);
+}
+
+void *zcalloc_typed(int type, size_t size) {
+    ((void)type);
+    return zcalloc(size);
+}
+
+void *zrealloc_typed(int type, void *ptr, size_t size) {
+    ((void)type);
+    return zrealloc(ptr,size);
+}
+
+int zmalloc_typed_arena_stats(int type, size_t *allocated, size_t *active,
+                              size_t *resident)
+{
+    ((void)type);
+    *allocated = *active = *resident = 0;
+    return 0;
+}
+#endif
+
+/* Allocate a zeroed region backed by explicit 2MB huge pages when the
+ * kernel can provide them. This is meant for a few very large, long lived
+ * allocations (such as the bucket arrays of huge hash tables) that suffer
+ * measurable dTLB pressure on 4KB pages. Unlike transparent huge pages,
+ * which we tell users to disable because of fork() copy-on-write latency
+ * spikes, these mappings are requested explicitly for memory that is never
+ * touched after a fork, so the COW granularity concern does not apply.
+ *
+ * Returns NULL when huge pages are not available: callers must fall back
+ * to a normal allocation. On success the region must be released with
+ * zfree_hugepage() passing the same size. */
+void *zmalloc_hugepage(size_t size) {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    /* Round up to the huge page size: mmap() requires it for MAP_HUGETLB
+     * and we account for the whole mapping anyway. */
+    size = (size+ZMALLOC_HUGEPAGE_SIZE-1) & ~(ZMALLOC_HUGEPAGE_SIZE-1);
+    void *ptr = mmap(NULL,size,PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    if (ptr == MAP_FAILED) {
+        /* No pre-reserved huge pages in the kernel pool. Try a normal
+         * mapping with madvise(MADV_HUGEPAGE): it only has an effect when
+         * THP is in 'madvise' mode, and with THP set to 'never' (our
+         * recommended setting) the caller simply gets 4KB pages, which
+         * is no worse than the fallback allocation. */
+        ptr = mmap(NULL,size,PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if (ptr == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(ptr,size,MADV_HUGEPAGE);
+#endif
+    }
+    update_zmalloc_stat_alloc(size);
+    return ptr;
+#else
+    ((void)size);
+    return NULL;
+#endif
+}
+
+/* Release a region obtained from zmalloc_hugepage(). 'size' must be the
+ * size originally requested: it is rounded up the same way here. */
+void zfree_hugepage(void *ptr, size_t size) {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (ptr == NULL) return;
+    size = (size+ZMALLOC_HUGEPAGE_SIZE-1) & ~(ZMALLOC_HUGEPAGE_SIZE-1);
+    update_zmalloc_stat_free(size);
+    munmap(ptr,size);
+#else
+    ((void)ptr); ((void)size);
+#endif
+}
+
 size_t zmalloc_used_memory(void) {
     size_t um;
     atomicGet(used_memory,um);
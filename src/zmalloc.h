@@ -77,11 +77,29 @@
 #define HAVE_DEFRAG
 #endif
 
+/* Allocation classes served by dedicated jemalloc arenas, so that long
+ * lived keyspace metadata, value payloads and short lived I/O buffers do
+ * not interleave in the same extents (see the comment in zmalloc.c).
+ * With other allocators the typed functions behave as the plain ones.
+ * Pointers returned by them are released with the regular zfree(). */
+#define ZMALLOC_TYPE_METADATA  0 /* dict entries/tables, object headers. */
+#define ZMALLOC_TYPE_VALUE     1 /* ziplists, intsets, listpacks... */
+#define ZMALLOC_TYPE_TRANSIENT 2 /* reply buffers and the like. */
+#define ZMALLOC_TYPE_COUNT     3
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
+void zmalloc_typed_init(void);
+void *zmalloc_typed(int type, size_t size);
+void *zcalloc_typed(int type, size_t size);
+void *zrealloc_typed(int type, void *ptr, size_t size);
+int zmalloc_typed_arena_stats(int type, size_t *allocated, size_t *active,
+                              size_t *resident);
+void *zmalloc_hugepage(size_t size);
+void zfree_hugepage(void *ptr, size_t size);
 size_t zmalloc_used_memory(void);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 size_t zmalloc_get_rss(void);
@@ -96,6 +114,7 @@ void zlibc_free(void *ptr);
 #ifdef HAVE_DEFRAG
 void zfree_no_tcache(void *ptr);
 void *zmalloc_no_tcache(size_t size);
+void *zmalloc_no_tcache_like(void *oldptr, size_t size);
 #endif
 
 #ifndef HAVE_MALLOC_SIZE
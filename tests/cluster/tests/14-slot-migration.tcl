@@ -0,0 +1,77 @@
+# Background slot migration test.
+# Checks that CLUSTER MIGRATESLOT moves all the keys of a slot to the
+# target node, flips the slot ownership, and preserves values and TTLs,
+# while the source node keeps serving writes to the migrating slot.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 2 nodes cluster" {
+    create_cluster 2 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set numkeys 10000
+set slot [R 0 cluster keyslot "{slotmig}"]
+
+# Masters 0 and 1 split the slot space: find which one serves the slot.
+if {[catch {R 0 set "{slotmig}" probe}]} {
+    set src 1; set dst 0
+} else {
+    set src 0; set dst 1
+}
+R $src del "{slotmig}"
+
+test "Populate a single slot with $numkeys keys" {
+    for {set j 0} {$j < $numkeys} {incr j} {
+        R $src set "{slotmig}:$j" "value-$j"
+    }
+    # A few keys with a TTL to check that expires are migrated as well.
+    for {set j 0} {$j < 10} {incr j} {
+        R $src expire "{slotmig}:$j" 10000
+    }
+    assert {[R $src cluster countkeysinslot $slot] == $numkeys}
+}
+
+test "Start the background migration of the slot" {
+    R $dst cluster setslot $slot importing [dict get [get_myself $src] id]
+    R $src cluster migrateslot $slot [dict get [get_myself $dst] id]
+}
+
+test "The source keeps serving writes while migrating" {
+    # Overwrite keys that the migration likely did not reach yet (keys
+    # are moved in lexicographical order): the new values must not be
+    # lost. If a key was already moved the source replies with -ASK and
+    # we follow the redirection like a cluster aware client would.
+    for {set j [expr {$numkeys-100}]} {$j < $numkeys} {incr j} {
+        if {[catch {R $src set "{slotmig}:$j" "late-$j"}]} {
+            R $dst asking
+            R $dst set "{slotmig}:$j" "late-$j"
+        }
+    }
+}
+
+test "All the keys are moved and the slot changes owner" {
+    wait_for_condition 1000 50 {
+        [R $src cluster countkeysinslot $slot] == 0 &&
+        [R $dst cluster countkeysinslot $slot] == $numkeys
+    } else {
+        fail "Slot migration is not terminating after some time."
+    }
+}
+
+test "Cluster is up after the migration" {
+    assert_cluster_state ok
+}
+
+test "Verify the keys on the target node" {
+    for {set j 0} {$j < $numkeys-100} {incr j} {
+        assert {[R $dst get "{slotmig}:$j"] eq "value-$j"}
+    }
+    for {set j [expr {$numkeys-100}]} {$j < $numkeys} {incr j} {
+        assert {[R $dst get "{slotmig}:$j"] eq "late-$j"}
+    }
+    assert {[R $dst ttl "{slotmig}:0"] > 0}
+}
@@ -258,6 +258,32 @@ tags {"aof"} {
         }
     }
 
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} aof-async-write yes}} {
+        test {AOF with aof-async-write: data survives a restart} {
+            for {set i 0} {$i < 10000} {incr i} {
+                r set key:$i val:$i
+            }
+            # Wait for the background writes to land on disk, then make
+            # sure the file can be reloaded and nothing was lost.
+            wait_for_condition 50 100 {
+                [s aof_pending_bio_write] == 0
+            } else {
+                fail "AOF background writes not processed"
+            }
+            r debug loadaof
+            assert_equal 10000 [r dbsize]
+            assert_equal val:9999 [r get key:9999]
+        }
+
+        test {AOF with aof-async-write: BGREWRITEAOF works} {
+            r bgrewriteaof
+            waitForBgrewriteaof r
+            r set after-rewrite 1
+            r debug loadaof
+            assert_equal 1 [r get after-rewrite]
+        }
+    }
+
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} appendfsync always}} {
         test {AOF fsync always barrier issue} {
             set rd [redis_deferring_client]
@@ -116,6 +116,44 @@ start_server_and_kill_it [list "dir" $server_path] {
     }
 }
 
+set server_path [tmpdir "server.rdb-mmap-test"]
+
+start_server [list overrides [list "dir" $server_path "rdb-mmap-format" "yes"]] {
+    test {Test the memory mapped RDB format} {
+        r config set list-max-ziplist-size 4
+        r debug populate 1000
+        r rpush mylist a b c d e f g h i j
+        r sadd myset a b c d e f g h i j
+        r zadd myzset 1 a 2 b 3 c
+        r hset myhash f1 v1 f2 v2
+        r xadd mystream * field value
+        r set withttl foo
+        r expire withttl 10000
+        set ::mmap_digest [r debug digest]
+        # DEBUG RELOAD saves with the fixed-width headers and loads back
+        # through the memory mapped path, leaving the values lazy until
+        # the digest below materializes them again.
+        r debug reload
+        assert_equal $::mmap_digest [r debug digest]
+        assert {[r ttl withttl] > 0}
+        assert_equal {a b c d e f g h i j} [r lrange mylist 0 -1]
+        r save
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "rdb-mmap-format" "yes"]] {
+    test {The memory mapped RDB format survives a restart} {
+        assert_equal $::mmap_digest [r debug digest]
+        assert_equal {v1} [r hget myhash f1]
+    }
+}
+
+start_server [list overrides [list "dir" $server_path]] {
+    test {A memory mapped RDB file can also be loaded eagerly} {
+        assert_equal $::mmap_digest [r debug digest]
+    }
+}
+
 start_server {} {
     test {Test FLUSHALL aborts bgsave} {
         r config set rdb-key-save-delay 1000
@@ -128,4 +166,76 @@ start_server {} {
         # make sure the server is still writable
         r set x xx
     }
-}
\ No newline at end of file
+}
+set server_path [tmpdir "server.rdb-delta-test"]
+start_server [list overrides [list "dir" $server_path "rdb-incremental" "yes"]] {
+    test {SAVE DELTA chains changed and deleted keys to the base snapshot} {
+        r config set save ""
+        r mset k1 v1 k2 v2 k3 v3
+        r rpush mylist a b c
+        r save
+        r set k1 v1-changed
+        r del k2
+        r set k4 v4
+        r expire k4 10000
+        r save delta
+        r rpush mylist d
+        r del k3
+        r save delta
+        set ::delta_digest [r debug digest]
+        assert {[file exists $server_path/dump.rdb.delta.2]}
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "rdb-incremental" "yes"]] {
+    test {Delta RDB files are applied on top of the base at startup} {
+        assert_equal $::delta_digest [r debug digest]
+        assert_equal {v1-changed} [r get k1]
+        assert_equal 0 [r exists k2]
+        assert {[r ttl k4] > 0}
+        assert_equal {a b c d} [r lrange mylist 0 -1]
+    }
+
+    test {The delta chain keeps growing after a restart} {
+        r set k5 v5
+        r save delta
+        assert {[file exists $server_path/dump.rdb.delta.3]}
+    }
+
+    test {A full save starts a new chain and removes the old delta files} {
+        r save
+        assert_equal 0 [file exists $server_path/dump.rdb.delta.1]
+        r set k6 v6
+        r save delta
+        assert {[file exists $server_path/dump.rdb.delta.1]}
+        set ::delta_digest [r debug digest]
+    }
+
+    test {SAVE DELTA needs a base snapshot after a flush} {
+        r flushdb
+        assert_error "*base snapshot*" {r save delta}
+        r set k7 v7
+        r save
+        r set k8 v8
+        r save delta
+    }
+
+    test {Prepare a delta file of an older base} {
+        # Keep a copy of the last delta, take a new full snapshot (that
+        # removes and obsoletes it), and put it back: at the next startup
+        # it must not be applied on top of the new base.
+        exec cp $server_path/dump.rdb.delta.1 $server_path/stale.delta
+        r del k8
+        r save
+        exec cp $server_path/stale.delta $server_path/dump.rdb.delta.1
+        set ::delta_digest [r debug digest]
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "rdb-incremental" "yes"]] {
+    test {Delta files of an older base are not applied} {
+        # The stale delta would recreate k8 if it was wrongly applied.
+        assert_equal $::delta_digest [r debug digest]
+        assert_equal 0 [r exists k8]
+    }
+}
@@ -502,6 +502,9 @@ start_server {tags {"repl"}} {
     set master [srv 0 client]
     $master config set repl-diskless-sync yes
     $master config set repl-diskless-sync-delay 1
+    # don't buffer the rdb stream in the master, so that the transfer is
+    # throttled by the slowest replica and the fork child outlives the drops
+    $master config set repl-diskless-sync-buffer 0
     set master_host [srv 0 host]
     set master_port [srv 0 port]
     set master_pid [srv 0 pid]
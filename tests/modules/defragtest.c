@@ -0,0 +1,167 @@
+/* A module that implements defrag callback mechanisms. */
+
+#include "redismodule.h"
+#include <stdlib.h>
+
+static RedisModuleType *FragType;
+
+struct FragObject {
+    unsigned long len;
+    void **values;
+};
+
+/* Make sure we get the expected cursor */
+unsigned long int last_set_cursor = 0;
+
+unsigned long int datatype_attempts = 0;
+unsigned long int datatype_defragged = 0;
+unsigned long int datatype_resumes = 0;
+unsigned long int datatype_wrong_cursor = 0;
+
+/* FRAG.RESETSTATS */
+static int fragResetStatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    datatype_attempts = 0;
+    datatype_defragged = 0;
+    datatype_resumes = 0;
+    datatype_wrong_cursor = 0;
+    last_set_cursor = 0;
+
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    return REDISMODULE_OK;
+}
+
+/* FRAG.STATS */
+static int fragStatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    RedisModule_ReplyWithArray(ctx, 8);
+    RedisModule_ReplyWithSimpleString(ctx, "attempts");
+    RedisModule_ReplyWithLongLong(ctx, datatype_attempts);
+    RedisModule_ReplyWithSimpleString(ctx, "defragged");
+    RedisModule_ReplyWithLongLong(ctx, datatype_defragged);
+    RedisModule_ReplyWithSimpleString(ctx, "resumes");
+    RedisModule_ReplyWithLongLong(ctx, datatype_resumes);
+    RedisModule_ReplyWithSimpleString(ctx, "wrong_cursor");
+    RedisModule_ReplyWithLongLong(ctx, datatype_wrong_cursor);
+    return REDISMODULE_OK;
+}
+
+/* FRAG.CREATE key len size */
+static int fragCreateCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    long long len, size;
+    if (RedisModule_StringToLongLong(argv[2], &len) != REDISMODULE_OK ||
+        RedisModule_StringToLongLong(argv[3], &size) != REDISMODULE_OK)
+    {
+        RedisModule_ReplyWithError(ctx, "ERR invalid len or size");
+        return REDISMODULE_OK;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithError(ctx, "ERR key exists");
+        return REDISMODULE_OK;
+    }
+
+    struct FragObject *o = RedisModule_Alloc(sizeof(*o));
+    o->len = len;
+    o->values = RedisModule_Alloc(sizeof(void*) * len);
+    for (unsigned long i = 0; i < o->len; i++)
+        o->values[i] = RedisModule_Calloc(1, size);
+
+    RedisModule_ModuleTypeSetValue(key, FragType, o);
+    RedisModule_CloseKey(key);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    return REDISMODULE_OK;
+}
+
+static void FragFree(void *value) {
+    struct FragObject *o = value;
+
+    for (unsigned long i = 0; i < o->len; i++)
+        RedisModule_Free(o->values[i]);
+    RedisModule_Free(o->values);
+    RedisModule_Free(o);
+}
+
+/* Defrag callback: demonstrates both the synchronous one-shot mode and the
+ * cursor based incremental mode requested by returning 1. */
+static int FragDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key, void **value) {
+    REDISMODULE_NOT_USED(key);
+    unsigned long i = 0;
+    int steps = 0;
+
+    datatype_attempts++;
+
+    /* If we have a cursor we are in the time limited late defrag stage:
+     * fetch it and resume. Otherwise ask for it by returning 1, to
+     * exercise the two-stages flow. */
+    if (RedisModule_DefragCursorGet(ctx, &i) == REDISMODULE_ERR)
+        return 1;
+    if (i != last_set_cursor) datatype_wrong_cursor++;
+    if (i > 0) datatype_resumes++;
+
+    /* Attempt to defrag the object and the values array itself, but only
+     * when starting from scratch. */
+    if (i == 0) {
+        struct FragObject *o = *value;
+        void *newptr = RedisModule_DefragAlloc(ctx, o);
+        if (newptr) *value = o = newptr, datatype_defragged++;
+        if ((newptr = RedisModule_DefragAlloc(ctx, o->values)))
+            o->values = newptr, datatype_defragged++;
+    }
+
+    struct FragObject *o = *value;
+    for (; i < o->len; i++) {
+        if ((++steps % 16 == 0) && RedisModule_DefragShouldStop(ctx)) {
+            RedisModule_DefragCursorSet(ctx, i);
+            last_set_cursor = i;
+            return 1;
+        }
+        void *newptr = RedisModule_DefragAlloc(ctx, o->values[i]);
+        if (newptr) o->values[i] = newptr, datatype_defragged++;
+    }
+
+    last_set_cursor = 0;
+    return 0;
+}
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    if (RedisModule_Init(ctx, "defragtest", 1, REDISMODULE_APIVER_1)
+        == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+    RedisModuleTypeMethods frag_methods = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .free = FragFree,
+        .defrag = FragDefrag
+    };
+
+    FragType = RedisModule_CreateDataType(ctx, "frag_type", 0, &frag_methods);
+    if (FragType == NULL) return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "frag.create",
+                                  fragCreateCommand, "write deny-oom", 1, 1, 1)
+        == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "frag.stats",
+                                  fragStatsCommand, "readonly", 0, 0, 0)
+        == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "frag.resetstats",
+                                  fragResetStatsCommand, "write", 0, 0, 0)
+        == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+    return REDISMODULE_OK;
+}
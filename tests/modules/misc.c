@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define UNUSED(x) (void)(x)
 
@@ -182,6 +183,176 @@ int test_setlfu(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return REDISMODULE_OK;
 }
 
+/* TEST.OPENKEYS <key> ... -- Open all the keys at once and reply with an
+ * array of their types, so that RM_OpenKeys() can be verified against the
+ * one by one RM_OpenKey() behavior. */
+int test_openkeys(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if (argc < 2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    int count = argc-1;
+    RedisModuleKey **keys = RedisModule_Alloc(sizeof(RedisModuleKey*)*count);
+    RedisModule_OpenKeys(ctx, argv+1, count, REDISMODULE_READ, keys);
+    RedisModule_ReplyWithArray(ctx, count);
+    for (int j = 0; j < count; j++) {
+        RedisModule_ReplyWithLongLong(ctx, RedisModule_KeyType(keys[j]));
+        RedisModule_CloseKey(keys[j]);
+    }
+    RedisModule_Free(keys);
+    return REDISMODULE_OK;
+}
+
+/* TEST.HASHGETMULTI <key> <field> ... -- Fetch all the fields in one call
+ * and reply with their values (nil for missing fields). */
+int test_hashgetmulti(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if (argc < 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    int count = argc-2;
+    RedisModuleString **values =
+        RedisModule_Alloc(sizeof(RedisModuleString*)*count);
+    if (key == NULL ||
+        RedisModule_HashGetMulti(key, REDISMODULE_HASH_NONE, argv+2,
+                                 values, count) != REDISMODULE_OK)
+    {
+        RedisModule_Free(values);
+        if (key) RedisModule_CloseKey(key);
+        RedisModule_ReplyWithError(ctx, "not a hash");
+        return REDISMODULE_OK;
+    }
+    RedisModule_ReplyWithArray(ctx, count);
+    for (int j = 0; j < count; j++) {
+        if (values[j]) {
+            RedisModule_ReplyWithString(ctx, values[j]);
+            RedisModule_FreeString(ctx, values[j]);
+        } else {
+            RedisModule_ReplyWithNull(ctx);
+        }
+    }
+    RedisModule_Free(values);
+    RedisModule_CloseKey(key);
+    return REDISMODULE_OK;
+}
+
+/* TEST.CALLBATCH <n> -- Run "SET batch:<j> <j>" for every j < n plus a
+ * final unknown command with a single RM_CallBatch() call, and reply with
+ * the number of commands that produced a reply. */
+int test_callbatch(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if (argc != 2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    long long n;
+    if (RedisModule_StringToLongLong(argv[1], &n) != REDISMODULE_OK ||
+        n < 1 || n > 1024)
+    {
+        RedisModule_ReplyWithError(ctx, "invalid count");
+        return REDISMODULE_OK;
+    }
+    int count = n+1;
+    RedisModuleString ***cmdargv =
+        RedisModule_Alloc(sizeof(RedisModuleString**)*count);
+    int *cmdargc = RedisModule_Alloc(sizeof(int)*count);
+    RedisModuleCallReply **replies =
+        RedisModule_Alloc(sizeof(RedisModuleCallReply*)*count);
+    for (int j = 0; j < n; j++) {
+        cmdargv[j] = RedisModule_Alloc(sizeof(RedisModuleString*)*3);
+        cmdargv[j][0] = RedisModule_CreateString(ctx, "set", 3);
+        cmdargv[j][1] = RedisModule_CreateStringPrintf(ctx, "batch:%d", j);
+        cmdargv[j][2] = RedisModule_CreateStringPrintf(ctx, "%d", j);
+        cmdargc[j] = 3;
+    }
+    /* The last command of the batch does not exist: it must not prevent
+     * the others from running. */
+    cmdargv[n] = RedisModule_Alloc(sizeof(RedisModuleString*));
+    cmdargv[n][0] = RedisModule_CreateString(ctx, "nosuchcmd", 9);
+    cmdargc[n] = 1;
+
+    int done = RedisModule_CallBatch(ctx, "!", cmdargv, cmdargc, count,
+                                     replies);
+    for (int j = 0; j < count; j++) {
+        for (int i = 0; i < cmdargc[j]; i++)
+            RedisModule_FreeString(ctx, cmdargv[j][i]);
+        RedisModule_Free(cmdargv[j]);
+        if (replies[j]) RedisModule_FreeCallReply(replies[j]);
+    }
+    RedisModule_Free(cmdargv);
+    RedisModule_Free(cmdargc);
+    RedisModule_Free(replies);
+    RedisModule_ReplyWithLongLong(ctx, done);
+    return REDISMODULE_OK;
+}
+
+/* TEST.KEYSLOT <key> -- Reply with the slot of the key and the total
+ * number of slots. */
+int test_keyslot(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if (argc != 2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithLongLong(ctx, RedisModule_GetKeySlot(ctx, argv[1]));
+    RedisModule_ReplyWithLongLong(ctx, RedisModule_GetKeySlotCount(ctx));
+    return REDISMODULE_OK;
+}
+
+struct slotlock_set_args {
+    RedisModuleString *keyname;
+    RedisModuleString *value;
+    int slot;
+};
+
+/* Thread target for TEST.SLOTLOCKSET: write the key while holding only
+ * the lock of its slot. */
+void *slotlockSetThreadMain(void *arg) {
+    struct slotlock_set_args *targ = arg;
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+    RedisModule_SelectDb(ctx,9); /* Tests ran in database number 9. */
+    RedisModule_ThreadSafeContextLockSlot(ctx, targ->slot);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, targ->keyname,
+                                              REDISMODULE_WRITE);
+    RedisModule_StringSet(key, targ->value);
+    RedisModule_CloseKey(key);
+    RedisModule_ThreadSafeContextUnlockSlot(ctx, targ->slot);
+    RedisModule_FreeString(ctx, targ->keyname);
+    RedisModule_FreeString(ctx, targ->value);
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_Free(targ);
+    return NULL;
+}
+
+/* TEST.SLOTLOCKSET <key> <value> -- Set the key from another thread under
+ * the slot scoped lock, replying before the write happens. */
+int test_slotlockset(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if (argc != 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+    struct slotlock_set_args *targ = RedisModule_Alloc(sizeof(*targ));
+    targ->keyname = RedisModule_CreateStringFromString(NULL, argv[1]);
+    targ->value = RedisModule_CreateStringFromString(NULL, argv[2]);
+    targ->slot = RedisModule_GetKeySlot(ctx, argv[1]);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, slotlockSetThreadMain, targ) != 0) {
+        RedisModule_FreeString(NULL, targ->keyname);
+        RedisModule_FreeString(NULL, targ->value);
+        RedisModule_Free(targ);
+        RedisModule_ReplyWithError(ctx, "can't start thread");
+        return REDISMODULE_OK;
+    }
+    pthread_detach(tid);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    return REDISMODULE_OK;
+}
+
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     REDISMODULE_NOT_USED(argv);
     REDISMODULE_NOT_USED(argc);
@@ -208,6 +379,16 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         return REDISMODULE_ERR;
     if (RedisModule_CreateCommand(ctx,"test.getlfu", test_getlfu,"",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"test.openkeys", test_openkeys,"",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"test.hashgetmulti", test_hashgetmulti,"",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"test.keyslot", test_keyslot,"",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"test.slotlockset", test_slotlockset,"",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"test.callbatch", test_callbatch,"",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
 
     return REDISMODULE_OK;
 }
@@ -48,6 +48,8 @@ set ::all_tests {
     integration/psync2
     integration/psync2-reg
     unit/pubsub
+    unit/tracking
+    unit/fastpath
     unit/slowlog
     unit/scripting
     unit/maxmemory
@@ -81,6 +81,34 @@ start_server {tags {"acl"}} {
         set e
     } {*NOPERM*key*}
 
+    test {Many prefix patterns and exact patterns work together} {
+        r ACL setuser newuser allcommands resetkeys ~foo:* ~foobar:* ~exact
+        r SET foo:1 a
+        r SET foobar:2 b
+        r SET exact c
+        catch {r SET exacto d} e
+        assert_match {*NOPERM*key*} $e
+        catch {r SET fo:1 d} e
+        assert_match {*NOPERM*key*} $e
+        r ACL setuser newuser allkeys; # Undo keys ACL
+    }
+
+    test {Cached command verdicts are dropped when the ACL changes} {
+        r ACL setuser psuser on >pspass allkeys +get +set +select
+        set rd [redis [srv 0 host] [srv 0 port] 0 $::tls]
+        $rd AUTH psuser pspass
+        $rd SELECT 9
+        $rd SET cachedkey 1
+        $rd SET cachedkey 2; # Warm the client verdict cache.
+        r ACL setuser psuser -set
+        catch {$rd SET cachedkey 3} e
+        assert_match {*NOPERM*} $e
+        assert_equal 2 [$rd GET cachedkey]
+        $rd close
+        r ACL deluser psuser
+        r DEL cachedkey
+    } {1}
+
     test {Users can be configured to authenticate with any password} {
         r ACL setuser newuser nopass
         r AUTH newuser zipzapblabla
@@ -134,10 +134,10 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     }
 
     foreach d {string int} {
-        foreach e {ziplist hashtable} {
+        foreach e {listpack hashtable} {
             test "AOF rewrite of hash with $e encoding, $d data" {
                 r flushall
-                if {$e eq {ziplist}} {set len 10} else {set len 1000}
+                if {$e eq {listpack}} {set len 10} else {set len 1000}
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
                         set data [randstring 0 16 alpha]
@@ -160,10 +160,10 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     }
 
     foreach d {string int} {
-        foreach e {ziplist skiplist} {
+        foreach e {listpack skiplist} {
             test "AOF rewrite of zset with $e encoding, $d data" {
                 r flushall
-                if {$e eq {ziplist}} {set len 10} else {set len 1000}
+                if {$e eq {listpack}} {set len 10} else {set len 1000}
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
                         set data [randstring 0 16 alpha]
@@ -211,3 +211,67 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
         }
     }
 }
+
+start_server {tags {"aofrw"} overrides {aof-rewrite-no-fork yes}} {
+    test {Forkless AOF rewrite during write load} {
+        r config set appendonly yes
+        r config set auto-aof-rewrite-percentage 0 ; # Disable auto-rewrite.
+        waitForBgrewriteaof r
+
+        # Start a write load for 10 seconds
+        set master [srv 0 client]
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+        set load_handle0 [start_write_load $master_host $master_port 10]
+        set load_handle1 [start_write_load $master_host $master_port 10]
+        set load_handle2 [start_write_load $master_host $master_port 10]
+
+        # Make sure the instance is really receiving data
+        wait_for_condition 50 100 {
+            [r dbsize] > 0
+        } else {
+            fail "No write load detected."
+        }
+
+        # After 3 seconds, start a rewrite, while the write load is still
+        # active.
+        after 3000
+        r bgrewriteaof
+        waitForBgrewriteaof r
+
+        # Let it run a bit more so that we'll append some data to the new
+        # AOF.
+        after 1000
+
+        # Stop the processes generating the load if they are still active
+        stop_write_load $load_handle0
+        stop_write_load $load_handle1
+        stop_write_load $load_handle2
+
+        # Make sure that we remain the only connected client.
+        # This step is needed to make sure there are no pending writes
+        # that will be processed between the two "debug digest" calls.
+        wait_for_condition 50 100 {
+            [llength [split [string trim [r client list]] "\n"]] == 1
+        } else {
+            puts [r client list]
+            fail "Clients generating loads are not disconnecting"
+        }
+
+        # The rewritten AOF must rebuild the exact same data set.
+        set d1 [r debug digest]
+        r debug loadaof
+        set d2 [r debug digest]
+        assert {$d1 eq $d2}
+    }
+
+    test {Forkless AOF rewrite is restarted by FLUSHALL} {
+        r bgrewriteaof
+        r flushall
+        r set key-after-flush value
+        waitForBgrewriteaof r
+        assert_equal {ok} [s aof_last_bgrewrite_status]
+        r debug loadaof
+        assert_equal {value} [r get key-after-flush]
+    }
+}
@@ -0,0 +1,89 @@
+start_server {tags {"fastpath"} overrides {"fast-path-commands" "yes"}} {
+    test {Fast path SET and GET} {
+        r set x foobar
+        r get x
+    } {foobar}
+
+    test {Fast path GET of a missing key} {
+        r del missing
+        r get missing
+    } {}
+
+    test {Fast path GET of integer and raw encoded values} {
+        r set intkey 1234
+        assert_encoding int intkey
+        set big [string repeat x 100]
+        r set rawkey $big
+        assert_encoding raw rawkey
+        list [r get intkey] [string length [r get rawkey]]
+    } {1234 100}
+
+    test {Plain SET through the fast path removes the TTL} {
+        r set volatile v ex 100
+        assert {[r ttl volatile] > 0}
+        r set volatile v2
+        r ttl volatile
+    } {-1}
+
+    test {Fast path EXISTS} {
+        r set present v
+        r del absent
+        list [r exists present] [r exists absent]
+    } {1 0}
+
+    test {Fast path INCR against existing and missing keys} {
+        r set counter 100
+        r del newcounter
+        list [r incr counter] [r incr newcounter] [r get counter]
+    } {101 1 101}
+
+    test {INCR falls back on non integer values and overflows} {
+        r set str novalue
+        assert_error "*not an integer*" {r incr str}
+        r set maxint 9223372036854775807
+        assert_error "*increment or decrement would overflow*" {r incr maxint}
+        r get maxint
+    } {9223372036854775807}
+
+    test {Fast path commands fall back on wrong types} {
+        r del alist
+        r rpush alist a
+        assert_error "WRONGTYPE*" {r get alist}
+        assert_error "WRONGTYPE*" {r incr alist}
+        r exists alist
+    } {1}
+
+    test {Fast path GET collects an expired key} {
+        r set gone v px 50
+        after 100
+        list [r get gone] [r exists gone]
+    } {{} 0}
+
+    test {Fast path executions update commandstats and keyspace stats} {
+        r config resetstat
+        r set statkey v
+        r get statkey
+        r get missingstat
+        set stats [r info commandstats]
+        assert_match "*cmdstat_set:calls=1*" $stats
+        assert_match "*cmdstat_get:calls=2*" $stats
+        set stats [r info stats]
+        assert_match "*keyspace_hits:1*" $stats
+        assert_match "*keyspace_misses:1*" $stats
+    }
+
+    test {Fast path writes survive a reload} {
+        r set persisted hello
+        r incr persistedctr
+        r debug reload
+        list [r get persisted] [r get persistedctr]
+    } {hello 1}
+
+    test {Fast path can be disabled at runtime} {
+        r config set fast-path-commands no
+        r set toggled v
+        set res [r get toggled]
+        r config set fast-path-commands yes
+        set res
+    } {v}
+}
@@ -77,4 +77,56 @@ start_server {tags {"introspection"}} {
         assert_match {*calls=1,*} [cmdstat expire]
         assert_match {*calls=1,*} [cmdstat geoadd]
     }
+
+    test {MEMORY STATS tracks the number of keys per type} {
+        r flushall
+        r set mystr somevalue
+        r rpush mylist a b c
+        r sadd myset a b c
+        set stats [r memory stats]
+        set strstats [dict get $stats type.string]
+        set liststats [dict get $stats type.list]
+        set setstats [dict get $stats type.set]
+        assert_equal 1 [dict get $strstats count]
+        assert_equal 1 [dict get $liststats count]
+        assert_equal 1 [dict get $setstats count]
+        assert {[dict get $strstats bytes.estimate] > 0}
+        r del mylist
+        set stats [r memory stats]
+        assert_equal 0 [dict get [dict get $stats type.list] count]
+        assert_equal 0 [dict get [dict get $stats type.zset] count]
+    }
+
+    test {KEYINFO reports existence, type, ttl and encoding} {
+        r del mystr mylist
+        r set mystr 1234
+        r expire mystr 100
+        r rpush mylist a b c
+        lassign [r keyinfo mystr mylist] strinfo listinfo
+        assert_equal 1 [dict get $strinfo exists]
+        assert_equal string [dict get $strinfo type]
+        assert_equal int [dict get $strinfo encoding]
+        set ttl [dict get $strinfo ttl]
+        assert {$ttl > 90 && $ttl <= 100}
+        assert_equal 1 [dict get $listinfo exists]
+        assert_equal list [dict get $listinfo type]
+        assert_equal -1 [dict get $listinfo ttl]
+        assert_equal [r object encoding mylist] [dict get $listinfo encoding]
+    }
+
+    test {KEYINFO against a missing key} {
+        r del nosuchkey
+        set info [lindex [r keyinfo nosuchkey] 0]
+        assert_equal 0 [dict get $info exists]
+        assert_equal none [dict get $info type]
+        assert_equal -2 [dict get $info ttl]
+        assert_equal {} [dict get $info encoding]
+    }
+
+    test {KEYINFO does not alter the last access time of a key} {
+        r set foo bar
+        after 3000
+        r keyinfo foo
+        assert {[r object idletime foo] >= 2}
+    }
 }
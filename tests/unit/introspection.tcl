@@ -65,6 +65,20 @@ start_server {tags {"introspection"}} {
             rdbchecksum
             daemonize
             io-threads-do-reads
+            io-threads-do-execute
+            list-compress-codec
+            db-dict-shards
+            lazyfree-threads
+            server_cpulist
+            bio_cpulist
+            aof_rewrite_cpulist
+            bgsave_cpulist
+            cold-tier-file
+            repl-backlog-file
+            admin-port
+            audit-log
+            lru-clock-resolution
+            tracking-fingerprint-entries
             lua-replicate-commands
             always-show-logo
             syslog-enabled
@@ -79,8 +93,10 @@ start_server {tags {"introspection"}} {
             databases
             port
             io-threads
+            tcp-reuseport
             tls-port
             tls-prefer-server-ciphers
+            tls-ktls
             tls-cert-file
             tls-key-file
             tls-dh-params-file
@@ -24,6 +24,17 @@ start_server {tags {"keyspace"}} {
         lsort [r keys *]
     } {foo_a foo_b foo_c key_x key_y key_z}
 
+    test {KEYSASYNC with pattern} {
+        lsort [r keysasync foo*]
+    } {foo_a foo_b foo_c}
+
+    test {KEYSASYNC agrees with KEYS on a bigger keyspace} {
+        r debug populate 10000
+        assert_equal [llength [r keysasync *]] [llength [r keys *]]
+        assert_equal [lsort [r keysasync key:123*]] [lsort [r keys key:123*]]
+        r del {*}[r keys key:*]
+    }
+
     test {DBSIZE} {
         r dbsize
     } {6}
@@ -266,6 +277,48 @@ start_server {tags {"keyspace"}} {
         r randomkey
     } {}
 
+    test {UNLINKMATCH deletes the matching keys in the background} {
+        r flushdb
+        for {set i 0} {$i < 100} {incr i} { r set key:$i v }
+        for {set i 0} {$i < 50} {incr i} { r set other:$i v }
+        set id [r unlinkmatch start "key:*"]
+        assert {$id >= 1}
+        wait_for_condition 50 100 {
+            [dict get [r unlinkmatch status $id] state] eq "done"
+        } else {
+            fail "UNLINKMATCH job did not finish"
+        }
+        set st [r unlinkmatch status $id]
+        assert_equal "key:*" [dict get $st pattern]
+        assert_equal 100 [dict get $st deleted]
+        assert_equal 0 [llength [r keys key:*]]
+        # The keys not matching the pattern are left alone.
+        assert_equal 50 [r dbsize]
+    }
+
+    test {UNLINKMATCH with a pattern matching nothing} {
+        set id [r unlinkmatch start "nomatch:*"]
+        wait_for_condition 50 100 {
+            [dict get [r unlinkmatch status $id] state] eq "done"
+        } else {
+            fail "UNLINKMATCH job did not finish"
+        }
+        assert_equal 0 [dict get [r unlinkmatch status $id] deleted]
+        assert_equal 50 [r dbsize]
+    }
+
+    test {UNLINKMATCH CANCEL forgets the job} {
+        set id [r unlinkmatch start "other:*"]
+        assert_equal {OK} [r unlinkmatch cancel $id]
+        assert_error "*No such job*" {r unlinkmatch status $id}
+    }
+
+    test {UNLINKMATCH argument validation} {
+        assert_error "*No such job*" {r unlinkmatch status 999999}
+        assert_error "*No such job*" {r unlinkmatch cancel 0}
+        assert_error "*Unknown subcommand*" {r unlinkmatch bogus}
+    }
+
     test {KEYS * two times with long key, Github issue #1208} {
         r flushdb
         r set dlskeriewrioeuwqoirueioqwrueoqwrueqw test
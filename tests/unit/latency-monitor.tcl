@@ -48,6 +48,27 @@ start_server {tags {"latency-monitor"}} {
         assert {[r latency latest] eq {}}
     }
 
+    test {LATENCY HISTOGRAM per command statistics} {
+        r config resetstat
+        r set foo bar
+        for {set j 0} {$j < 100} {incr j} {
+            r get foo
+        }
+        set res [r latency histogram get]
+        set stats [dict get $res get]
+        assert_equal 100 [dict get $stats calls]
+        assert {[dict get $stats p50] <= [dict get $stats p99]}
+        assert {[dict get $stats p99] <= [dict get $stats p99.9]}
+        # The cumulative count of the last bucket is the total calls.
+        assert_equal 100 [lindex [dict get $stats histogram_usec] end]
+        # Unknown command names are refused.
+        catch {r latency histogram nosuchcommand} e
+        assert_match "ERR*" $e
+        # CONFIG RESETSTAT starts a new window.
+        r config resetstat
+        assert_equal 0 [dict get [dict get [r latency histogram get] get] calls]
+    }
+
     test {LATENCY of expire events are correctly collected} {
         r config set latency-monitor-threshold 20
         r eval {
@@ -36,4 +36,59 @@ start_server {tags {"lazyfree"}} {
             fail "Memory is not reclaimed by FLUSHDB ASYNC"
         }
     }
+
+    test "lazyfree-lazy-user-flush makes a plain FLUSHDB asynchronous" {
+        r config set lazyfree-lazy-user-flush yes
+        set orig_mem [s used_memory]
+        set args {}
+        for {set i 0} {$i < 100000} {incr i} {
+            lappend args $i
+        }
+        r sadd myset {*}$args
+        assert {[r scard myset] == 100000}
+        set peak_mem [s used_memory]
+        r flushdb
+        assert_equal 0 [r dbsize]
+        assert {$peak_mem > $orig_mem+1000000}
+        wait_for_condition 50 100 {
+            [s used_memory] < $peak_mem &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by lazy FLUSHDB"
+        }
+        r config set lazyfree-lazy-user-flush no
+    }
+
+    test "FLUSHDB and FLUSHALL accept the SYNC option" {
+        r set foo bar
+        r flushdb sync
+        assert_equal 0 [r dbsize]
+        r set foo bar
+        r flushall sync
+        assert_equal 0 [r dbsize]
+        assert_error "*syntax*" {r flushdb garbage}
+    }
+}
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "UNLINK reclaims a huge hash with parallel lazyfree workers" {
+        set orig_mem [s used_memory]
+        r eval {
+            for i=1,1200000 do redis.call('hset','myhash',i,i) end
+            return 1
+        } 0
+        assert {[r hlen myhash] == 1200000}
+        set peak_mem [s used_memory]
+        assert {[r unlink myhash] == 1}
+        r set foo bar
+        assert {[r unlink foo] == 1}
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $peak_mem &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by parallel UNLINK"
+        }
+        assert_equal 0 [r dbsize]
+    }
 }
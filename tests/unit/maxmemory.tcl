@@ -55,6 +55,26 @@ start_server {tags {"maxmemory"}} {
         }
     }
 
+    test "maxmemory - eviction time limit carries work over iterations" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-random
+        r config set maxmemory-eviction-time-limit 1
+        r debug populate 50000
+        set limit [expr {[s used_memory]/2}]
+        r config set maxmemory $limit
+        # Even with a one millisecond budget per event loop iteration, the
+        # work carried over across iterations should bring the memory back
+        # under the limit in a short time.
+        wait_for_condition 100 100 {
+            [s used_memory] < ($limit+4096)
+        } else {
+            fail "Memory not reclaimed with a bounded eviction time"
+        }
+        r config set maxmemory-eviction-time-limit 0
+        r config set maxmemory 0
+    }
+
     foreach policy {
         allkeys-random allkeys-lru volatile-lru volatile-random volatile-ttl
     } {
@@ -204,7 +224,9 @@ proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline}
             }
 
             set new_used [s -1 used_memory]
-            set slave_buf [s -1 mem_clients_slaves]
+            # the replicas stream from the shared replication buffer, which is
+            # reported as part of mem_replication_backlog
+            set slave_buf [s -1 mem_replication_backlog]
             set client_buf [s -1 mem_clients_normal]
             set mem_not_counted_for_evict [s -1 mem_not_counted_for_evict]
             set used_no_repl [expr {$new_used - $mem_not_counted_for_evict}]
@@ -217,11 +239,12 @@ proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline}
 
             $master client kill type slave
             set killed_used [s -1 used_memory]
-            set killed_slave_buf [s -1 mem_clients_slaves]
+            set killed_slave_buf [s -1 mem_replication_backlog]
             set killed_mem_not_counted_for_evict [s -1 mem_not_counted_for_evict]
             set killed_used_no_repl [expr {$killed_used - $killed_mem_not_counted_for_evict}]
             set delta_no_repl [expr {$killed_used_no_repl - $used_no_repl}]
-            assert {$killed_slave_buf == 0}
+            # with the replicas gone only the backlog window retains blocks
+            assert {$killed_slave_buf < 512*1024}
             assert {$delta_no_repl > -$delta_max && $delta_no_repl < $delta_max}
 
         }
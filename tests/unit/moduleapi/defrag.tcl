@@ -0,0 +1,61 @@
+set testmodule [file normalize tests/modules/defragtest.so]
+
+start_server {tags {"modules"} overrides {save ""}} {
+    r module load $testmodule
+    r config set hz 100
+    r config set active-defrag-ignore-bytes 1
+    r config set active-defrag-threshold-lower 0
+    r config set active-defrag-cycle-min 99
+
+    # try to enable active defrag, it will fail if redis was compiled without
+    # it or the allocator lacks the needed hint.
+    catch {r config set activedefrag yes} e
+    if {[r config get activedefrag] eq "activedefrag yes"} {
+
+        test {Module defrag: simple key defrag works} {
+            # Create fragmentation: the remaining module values sit in
+            # half empty allocator runs, so defrag has to move them.
+            for {set j 0} {$j < 10000} {incr j} {
+                r frag.create key:$j 1 100
+            }
+            for {set j 0} {$j < 10000} {incr j 2} {
+                r del key:$j
+            }
+
+            wait_for_condition 100 50 {
+                [dict get [r frag.stats] defragged] > 0
+            } else {
+                fail "Module values not defragged"
+            }
+            assert {[dict get [r frag.stats] attempts] > 0}
+        }
+
+        test {Module defrag: late defrag with cursor works} {
+            r flushdb
+            r frag.resetstats
+
+            # Punch holes in the allocator with short lived string keys, so
+            # that the values of the big key created in between end up in
+            # sparse runs. The key is too big to be defragged in one cycle,
+            # so the callback is expected to use the cursor and resume.
+            for {set j 0} {$j < 100000} {incr j} {
+                r setrange string:$j 100 x
+            }
+            for {set j 0} {$j < 100000} {incr j 2} {
+                r del string:$j
+            }
+            r frag.create bigkey 500000 100
+            for {set j 1} {$j < 100000} {incr j 2} {
+                r del string:$j
+            }
+
+            wait_for_condition 100 100 {
+                [dict get [r frag.stats] resumes] > 0 &&
+                [dict get [r frag.stats] defragged] > 0
+            } else {
+                fail "Big module value not defragged incrementally"
+            }
+            assert {[dict get [r frag.stats] wrong_cursor] == 0}
+        }
+    }
+}
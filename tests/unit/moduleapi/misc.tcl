@@ -30,6 +30,54 @@ start_server {tags {"modules"}} {
         assert_equal [r test.dbsize] 0
     }
 
+    test {test RM_OpenKeys} {
+        r flushall
+        r set str1 foo
+        r rpush list1 a b c
+        r hset hash1 f v
+        # Types as REDISMODULE_KEYTYPE_*: empty=0 string=1 list=2 hash=3
+        assert_equal {1 2 3 0} [r test.openkeys str1 list1 hash1 nosuchkey]
+    }
+
+    test {test RM_HashGetMulti} {
+        r del myhash
+        r hset myhash f1 v1 f2 2 f3 v3
+        assert_equal {v1 2 {} v3} \
+            [r test.hashgetmulti myhash f1 f2 nofield f3]
+        # Same test against the hash table encoding.
+        r config set hash-max-ziplist-entries 0
+        r del myhash
+        r hset myhash f1 v1 f2 2 f3 v3
+        assert_encoding hashtable myhash
+        assert_equal {v1 2 {} v3} \
+            [r test.hashgetmulti myhash f1 f2 nofield f3]
+        r config set hash-max-ziplist-entries 128
+        catch {r test.hashgetmulti str1 f1} e
+        r set str1 foo
+        catch {r test.hashgetmulti str1 f1} e
+        assert_match {*not a hash*} $e
+    }
+
+    test {test RM_CallBatch} {
+        r flushall
+        # 10 SET commands plus one unknown command in a single batch.
+        assert_equal 10 [r test.callbatch 10]
+        assert_equal 10 [r dbsize]
+        assert_equal 7 [r get batch:7]
+    }
+
+    test {test RM_GetKeySlot and slot scoped locks} {
+        # With the default single keyspace shard every key maps to slot 0.
+        assert_equal {0 1} [r test.keyslot anykey]
+        r del slotkey
+        r test.slotlockset slotkey slotval
+        wait_for_condition 50 100 {
+            [r get slotkey] eq {slotval}
+        } else {
+            fail "Key was not written under the slot lock"
+        }
+    }
+
     test {test modle lru api} {
         r config set maxmemory-policy allkeys-lru
         r set x foo
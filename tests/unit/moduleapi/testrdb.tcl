@@ -91,11 +91,14 @@ tags "modules" {
                             }
                         }]} {
                             puts "failed triggering short read"
-                            # force the replica to try another full sync
+                            # force the replica to try another full sync: resizing the
+                            # backlog no longer discards it, so instead push the replica's
+                            # offset out of the backlog window with fresh writes
                             $master client kill type replica
-                            $master set asdf asdf
-                            # the side effect of resizing the backlog is that it is flushed (16k is the min size)
-                            $master config set repl-backlog-size [expr {16384 + $i}]
+                            $master config set repl-backlog-size 16k
+                            for {set keyid 0} {$keyid < 10} {incr keyid} {
+                                $master set "key_$keyid" [string repeat A 16384]
+                            }
                         }
                         # wait for loading to stop (fail)
                         wait_for_condition 100 10 {
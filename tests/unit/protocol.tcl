@@ -104,6 +104,24 @@ start_server {tags {"protocol"}} {
     unset c
 }
 
+start_server {tags {"protocol"} overrides {resp-protocol-lock yes}} {
+    test "Locked RESP connection refuses inline commands" {
+        reconnect
+        r ping ;# Lock the connection to the multibulk protocol.
+        r write "PING\r\n"
+        r flush
+        assert_error "*expected '\\*', got an inline command*" {r read}
+    }
+
+    test "Locked RESP connection still accepts empty keepalive lines" {
+        reconnect
+        r ping
+        r write "\r\n"
+        r flush
+        assert_equal "PONG" [r ping]
+    }
+}
+
 start_server {tags {"regression"}} {
     test "Regression for a crash with blocking ops and pipelining" {
         set rd [redis_deferring_client]
@@ -176,6 +176,39 @@ start_server {tags {"pubsub"}} {
         $rd2 close
     }
 
+    test "PUBSUB NUMPAT counts unique patterns" {
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+
+        assert_equal {1} [psubscribe $rd1 {chan.*}]
+        assert_equal {1 2} [psubscribe $rd2 {chan.* other.*}]
+        assert_equal 2 [r pubsub numpat]
+        assert_equal 2 [r publish chan.foo hello]
+        assert_equal {pmessage chan.* chan.foo hello} [$rd1 read]
+        assert_equal {pmessage chan.* chan.foo hello} [$rd2 read]
+
+        # The shared pattern entry must survive as long as one
+        # subscriber is left.
+        assert_equal {1 0} [punsubscribe $rd2 {chan.* other.*}]
+        assert_equal 1 [r pubsub numpat]
+        assert_equal 1 [r publish chan.foo hello]
+        assert_equal {pmessage chan.* chan.foo hello} [$rd1 read]
+
+        $rd1 close
+        $rd2 close
+    }
+
+    test "PSUBSCRIBE with patterns starting with a wildcard" {
+        set rd1 [redis_deferring_client]
+        assert_equal {1 2} [psubscribe $rd1 {*.end ?ne.*}]
+        assert_equal 1 [r publish the.end hello]
+        assert_equal 1 [r publish one.two hello]
+        assert_equal 0 [r publish two.three hello]
+        assert_equal {pmessage *.end the.end hello} [$rd1 read]
+        assert_equal {pmessage ?ne.* one.two hello} [$rd1 read]
+        $rd1 close
+    }
+
     test "PUBLISH/PSUBSCRIBE after PUNSUBSCRIBE without arguments" {
         set rd1 [redis_deferring_client]
         assert_equal {1 2 3} [psubscribe $rd1 {chan1.* chan2.* chan3.*}]
@@ -253,6 +286,21 @@ start_server {tags {"pubsub"}} {
         $rd1 close
     }
 
+    test "Keyspace notifications: batched delivery to pattern subscribers" {
+        r config set notify-keyspace-events KEA
+        r config set notify-keyspace-batch yes
+        set rd1 [redis_deferring_client]
+        assert_equal {1} [psubscribe $rd1 *]
+        r set foo bar
+        assert_equal {pmessage * __keyspace@9__:foo set} [$rd1 read]
+        assert_equal {pmessage * __keyevent@9__:set foo} [$rd1 read]
+        r del foo
+        assert_equal {pmessage * __keyspace@9__:foo del} [$rd1 read]
+        assert_equal {pmessage * __keyevent@9__:del foo} [$rd1 read]
+        r config set notify-keyspace-batch no
+        $rd1 close
+    }
+
     test "Keyspace notifications: we are able to mask events" {
         r config set notify-keyspace-events KEl
         r del mylist
@@ -377,6 +425,27 @@ start_server {tags {"pubsub"}} {
         $rd1 close
     }
 
+    test "Keyspace notifications: hotkey events" {
+        r config set notify-keyspace-events En
+        r config set hotkeys-sample-rate 1
+        r config set hotkeys-report-period 1
+        r hotkeys reset
+        r set foo bar
+        for {set j 0} {$j < 100} {incr j} {
+            r get foo
+        }
+        set hot [lindex [r hotkeys] 0]
+        assert_equal {foo} [lindex $hot 0]
+        # The counter may have decayed already, but foo is the only key.
+        assert {[lindex $hot 2] > 0}
+        set rd1 [redis_deferring_client]
+        assert_equal {1} [psubscribe $rd1 *]
+        assert_equal {pmessage * __keyevent@9__:hotkey foo} [$rd1 read]
+        $rd1 close
+        r config set hotkeys-sample-rate 0
+        r config set hotkeys-report-period 10
+    }
+
     test "Keyspace notifications: test CONFIG GET/SET of event flags" {
         r config set notify-keyspace-events gKE
         assert_equal {gKE} [lindex [r config get notify-keyspace-events] 1]
@@ -132,11 +132,11 @@ start_server {tags {"scan"}} {
         }
     }
 
-    foreach enc {ziplist hashtable} {
+    foreach enc {listpack hashtable} {
         test "HSCAN with encoding $enc" {
             # Create the Hash
             r del hash
-            if {$enc eq {ziplist}} {
+            if {$enc eq {listpack}} {
                 set count 30
             } else {
                 set count 1000
@@ -172,11 +172,11 @@ start_server {tags {"scan"}} {
         }
     }
 
-    foreach enc {ziplist skiplist} {
+    foreach enc {listpack skiplist} {
         test "ZSCAN with encoding $enc" {
             # Create the Sorted Set
             r del zset
-            if {$enc eq {ziplist}} {
+            if {$enc eq {listpack}} {
                 set count 30
             } else {
                 set count 1000
@@ -328,3 +328,148 @@ start_server {tags {"scan"}} {
         }
     }
 }
+
+start_server {tags {"scan"}} {
+    test "STATEFUL scan sessions are disabled by default" {
+        r del myhash
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        assert_encoding hashtable myhash
+        assert_error "*scan-sessions-max*" {r hscan myhash 0 stateful}
+    }
+
+    test "HSCAN STATEFUL iterates to exhaustion without duplicates" {
+        r config set scan-sessions-max 4
+        r del myhash
+        array unset found
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        assert_encoding hashtable myhash
+        set cursor 0
+        set iterations 0
+        set last_cursor 0
+        while 1 {
+            lassign [r hscan myhash $cursor stateful count 100] cursor items
+            incr iterations
+            foreach {k v} $items {
+                assert {![info exists found($k)]}
+                assert_equal "value:[string range $k 6 end]" $v
+                set found($k) 1
+            }
+            if {$cursor == 0} break
+            set last_cursor $cursor
+        }
+        assert_equal 1000 [array size found]
+        assert {$iterations > 1}
+        # An exhausted session is released right away...
+        assert_equal 0 [s scan_sessions]
+        # ...so its id cannot be replayed.
+        assert_error "NOSESSION*" {r hscan myhash $last_cursor stateful}
+    }
+
+    test "SSCAN STATEFUL iterates to exhaustion without duplicates" {
+        r del myset
+        array unset found
+        for {set i 0} {$i < 1000} {incr i} { r sadd myset element:$i }
+        assert_encoding hashtable myset
+        set cursor 0
+        while 1 {
+            lassign [r sscan myset $cursor stateful count 100] cursor items
+            foreach e $items {
+                assert {![info exists found($e)]}
+                set found($e) 1
+            }
+            if {$cursor == 0} break
+        }
+        assert_equal 1000 [array size found]
+    }
+
+    test "ZSCAN STATEFUL iterates to exhaustion without duplicates" {
+        r del myzset
+        r config set zset-max-ziplist-entries 0
+        array unset found
+        for {set i 0} {$i < 1000} {incr i} { r zadd myzset $i member:$i }
+        assert_encoding skiplist myzset
+        set cursor 0
+        while 1 {
+            lassign [r zscan myzset $cursor stateful count 100] cursor items
+            foreach {e score} $items {
+                assert {![info exists found($e)]}
+                assert_equal "member:$score" $e
+                set found($e) 1
+            }
+            if {$cursor == 0} break
+        }
+        assert_equal 1000 [array size found]
+    }
+
+    test "A write to the key invalidates its STATEFUL scan session" {
+        r del myhash
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        lassign [r hscan myhash 0 stateful count 100] cursor items
+        assert {$cursor != 0}
+        assert_equal 1 [s scan_sessions]
+        r hset myhash extra value
+        assert_equal 0 [s scan_sessions]
+        assert_error "NOSESSION*" {r hscan myhash $cursor stateful}
+    }
+
+    test "Deleting the key invalidates its STATEFUL scan session" {
+        r del myhash
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        lassign [r hscan myhash 0 stateful count 100] cursor items
+        assert_equal 1 [s scan_sessions]
+        r del myhash
+        assert_equal 0 [s scan_sessions]
+    }
+
+    test "Key expiration invalidates its STATEFUL scan session" {
+        r del myhash
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        lassign [r hscan myhash 0 stateful count 100] cursor items
+        assert_equal 1 [s scan_sessions]
+        r pexpire myhash 10
+        wait_for_condition 50 100 {
+            [s scan_sessions] == 0
+        } else {
+            fail "Session not reclaimed after the key expired"
+        }
+    }
+
+    test "FLUSHDB invalidates every STATEFUL scan session" {
+        r del myhash
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        lassign [r hscan myhash 0 stateful count 100] cursor items
+        assert_equal 1 [s scan_sessions]
+        r flushdb
+        assert_equal 0 [s scan_sessions]
+    }
+
+    test "STATEFUL scan sessions are bounded by scan-sessions-max" {
+        r config set scan-sessions-max 2
+        r del myhash
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        set rd [redis_deferring_client]
+        $rd hscan myhash 0 stateful count 10
+        $rd read
+        $rd hscan myhash 0 stateful count 10
+        $rd read
+        assert_equal 2 [s scan_sessions]
+        assert_error "*too many*" {r hscan myhash 0 stateful count 10}
+        # Sessions die with their client.
+        $rd close
+        wait_for_condition 50 100 {
+            [s scan_sessions] == 0
+        } else {
+            fail "Sessions not reclaimed after their client went away"
+        }
+        r config set scan-sessions-max 4
+    }
+
+    test "STATEFUL scan argument validation" {
+        r del myhash mystr
+        for {set i 0} {$i < 1000} {incr i} { r hset myhash field:$i value:$i }
+        r set mystr value
+        assert_error "*MATCH is not supported*" {r hscan myhash 0 stateful match "f*"}
+        assert_error "NOSESSION*" {r hscan myhash 12345678 stateful}
+        assert_error "WRONGTYPE*" {r hscan mystr 0 stateful}
+    }
+}
@@ -316,3 +316,25 @@ start_server {
         }
     }
 }
+
+start_server {tags {"sort"}} {
+    test "SORT with sort-threads matches the single threaded output" {
+        r del biglist
+        set items {}
+        for {set i 0} {$i < 20000} {incr i} {
+            lappend items [expr {int(rand()*1000000)}]
+        }
+        r rpush biglist {*}$items
+
+        r config set sort-threads 1
+        set serial [r sort biglist]
+        set serial_alpha [r sort biglist ALPHA]
+        set serial_desc [r sort biglist DESC LIMIT 100 50]
+
+        r config set sort-threads 8
+        assert_equal $serial [r sort biglist]
+        assert_equal $serial_alpha [r sort biglist ALPHA]
+        assert_equal $serial_desc [r sort biglist DESC LIMIT 100 50]
+        r config set sort-threads 1
+    }
+}
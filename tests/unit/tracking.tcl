@@ -0,0 +1,71 @@
+start_server {tags {"tracking"}} {
+    # Keyspace tracking invalidation messages use RESP3 push messages for
+    # direct delivery, but the test client speaks RESP2: use the redirection
+    # mode, where the messages are delivered to a Pub/Sub client subscribed
+    # to __redis__:invalidate, to observe them.
+    proc setup_tracking {} {
+        set rd [redis_deferring_client]
+        $rd client id
+        set redir [$rd read]
+        $rd subscribe __redis__:invalidate
+        $rd read ; # Consume the SUBSCRIBE reply.
+        r client tracking off
+        r client tracking on redirect $redir
+        return $rd
+    }
+
+    test {Clients are able to enable tracking and redirect it} {
+        set rd [setup_tracking]
+        $rd close
+    }
+
+    test {The other connection is able to get invalidations} {
+        set rd [setup_tracking]
+        r set foo bar
+        r get foo
+        r set foo bar2
+        set msg [$rd read]
+        assert_equal {message __redis__:invalidate} [lrange $msg 0 1]
+        assert {[lindex $msg 2] >= 0}
+        $rd close
+    }
+
+    test {Invalidations of the same iteration are batched} {
+        set rd [setup_tracking]
+        r mset ik1 a ik2 b ik3 c
+        r mget ik1 ik2 ik3
+        # The three slots are invalidated by a single command: the messages
+        # are delivered together at the end of that event loop iteration.
+        r mset ik1 x ik2 y ik3 z
+        set slots {}
+        for {set i 0} {$i < 3} {incr i} {
+            set msg [$rd read]
+            assert_equal {message __redis__:invalidate} [lrange $msg 0 1]
+            lappend slots [lindex $msg 2]
+        }
+        assert_equal 3 [llength [lsort -unique $slots]]
+        $rd close
+    }
+
+    test {Invalidation message sent when a key is expired} {
+        set rd [setup_tracking]
+        r set tokill foo px 50
+        r get tokill
+        after 100
+        # Trigger the synchronous expire of the key.
+        r exists tokill
+        set msg [$rd read]
+        assert_equal {message __redis__:invalidate} [lrange $msg 0 1]
+        $rd close
+    }
+
+    test {FLUSHALL generates a single -1 invalidation message} {
+        set rd [setup_tracking]
+        r set flushit 1
+        r get flushit
+        r flushall
+        set msg [$rd read]
+        assert_equal {message __redis__:invalidate -1} $msg
+        $rd close
+    }
+}
@@ -14,8 +14,8 @@ start_server {tags {"hash"}} {
         list [r hlen smallhash]
     } {8}
 
-    test {Is the small hash encoded with a ziplist?} {
-        assert_encoding ziplist smallhash
+    test {Is the small hash encoded with a listpack?} {
+        assert_encoding listpack smallhash
     }
 
     test {HSET/HLEN - Big hash creation} {
@@ -252,7 +252,7 @@ start_server {tags {"hash"}} {
         lappend rv [r hexists bighash nokey]
     } {1 0 1 0}
 
-    test {Is a ziplist encoded Hash promoted on big payload?} {
+    test {Is a listpack encoded Hash promoted on big payload?} {
         r hset smallhash foo [string repeat a 1024]
         r debug object smallhash
     } {*hashtable*}
@@ -533,4 +533,104 @@ start_server {tags {"hash"}} {
             assert {[r hincrbyfloat myhash float -0.1] eq {1.9}}
         }
     }
+
+    test {HEXPIRE - reply codes for existing, missing and dead fields} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        # 1: deadline set, -2: no such field.
+        assert_equal {1 -2} [r hexpire myhash 100 fields 2 f1 nosuchfield]
+        # 2: a deadline already in the past deletes the field right away.
+        assert_equal {2} [r hexpire myhash -1 fields 1 f2]
+        assert_equal 0 [r hexists myhash f2]
+        # -2 for every field when the key does not exist at all.
+        assert_equal {-2 -2} [r hexpire nosuchhash 100 fields 2 f1 f2]
+    }
+
+    test {HEXPIRE - mandatory FIELDS keyword and numfields validation} {
+        r del myhash
+        r hset myhash f1 v1
+        assert_error "*FIELDS*" {r hexpire myhash 100 bogus 1 f1}
+        assert_error "*numFields*" {r hexpire myhash 100 fields 2 f1}
+        assert_error "*numFields*" {r hexpire myhash 100 fields 0 f1}
+    }
+
+    test {HTTL/HPTTL - TTL queries} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        r hexpire myhash 100 fields 1 f1
+        set ttl [lindex [r httl myhash fields 1 f1] 0]
+        assert {$ttl > 90 && $ttl <= 100}
+        set pttl [lindex [r hpttl myhash fields 1 f1] 0]
+        assert {$pttl > 90000 && $pttl <= 100000}
+        # -1 for a field without a TTL, -2 for a missing field/key.
+        assert_equal {-1} [r httl myhash fields 1 f2]
+        assert_equal {-2} [r httl myhash fields 1 nosuchfield]
+        assert_equal {-2} [r httl nosuchhash fields 1 f1]
+    }
+
+    test {HPEXPIRE - field expires and the rest of the hash survives} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        assert_equal {1} [r hpexpire myhash 50 fields 1 f1]
+        wait_for_condition 50 100 {
+            [r hexists myhash f1] == 0
+        } else {
+            fail "Field f1 did not expire"
+        }
+        assert_equal {v2} [r hget myhash f2]
+        assert_equal 1 [r hlen myhash]
+    }
+
+    test {HPERSIST - removes the TTL, field no longer expires} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        r hpexpire myhash 100 fields 1 f1
+        # 1: TTL removed, -1: no TTL to remove, -2: no such field.
+        assert_equal {1 -1 -2} [r hpersist myhash fields 3 f1 f2 nosuchfield]
+        assert_equal {-1} [r httl myhash fields 1 f1]
+        after 150
+        assert_equal {v1} [r hget myhash f1]
+    }
+
+    test {HSET on a field with a TTL discards the TTL} {
+        r del myhash
+        r hset myhash f1 v1
+        r hexpire myhash 100 fields 1 f1
+        r hset myhash f1 v2
+        assert_equal {-1} [r httl myhash fields 1 f1]
+    }
+
+    test {Hash field TTLs survive the listpack -> hashtable conversion} {
+        r del myhash
+        r config set hash-max-ziplist-entries 32
+        r hset myhash f1 v1
+        r hexpire myhash 100 fields 1 f1
+        r hpexpire myhash 50 fields 1 f1
+        for {set i 0} {$i < 64} {incr i} {
+            r hset myhash field:$i value:$i
+        }
+        assert_encoding hashtable myhash
+        set pttl [lindex [r hpttl myhash fields 1 f1] 0]
+        assert {$pttl > 0 && $pttl <= 50}
+        wait_for_condition 50 100 {
+            [r hexists myhash f1] == 0
+        } else {
+            fail "Field f1 did not expire after the encoding conversion"
+        }
+        assert_equal 64 [r hlen myhash]
+    }
+
+    test {Expiring the last field removes the key itself} {
+        r del myhash
+        r hset myhash f1 v1
+        assert_equal {2} [r hexpire myhash -1 fields 1 f1]
+        assert_equal 0 [r exists myhash]
+        r hset myhash f1 v1
+        r hpexpire myhash 50 fields 1 f1
+        wait_for_condition 50 100 {
+            [r exists myhash] == 0
+        } else {
+            fail "Key was not removed when its last field expired"
+        }
+    }
 }
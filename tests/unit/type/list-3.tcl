@@ -120,3 +120,59 @@ start_server {
         }
     }
 }
+
+start_server {
+    tags {list}
+    overrides {
+        "list-max-ziplist-size" 4
+        "list-compress-depth" 1
+    }
+} {
+    test {Async compression of quicklist nodes} {
+        r del mylist
+        for {set i 0} {$i < 100} {incr i} {
+            r rpush mylist [string repeat x 500]$i
+        }
+        # Interior nodes are compressed by a background thread: wait for
+        # the compressed blobs to be installed.
+        wait_for_condition 50 100 {
+            [string match "*ql_compressed:1*" [r debug object mylist]]
+        } else {
+            fail "quicklist nodes not compressed in the background"
+        }
+        for {set i 0} {$i < 100} {incr i} {
+            assert_equal [string repeat x 500]$i [r lindex mylist $i]
+        }
+    }
+
+    test {Writes racing async compression keep the list consistent} {
+        r del mylist
+        set l {}
+        for {set j 0} {$j < 5000} {incr j} {
+            set ele [string repeat x [randomInt 500]][randomInt 1000]
+            randpath {
+                lappend l $ele
+                r rpush mylist $ele
+            } {
+                set l [concat [list $ele] $l]
+                r lpush mylist $ele
+            } {
+                if {[llength $l] > 0} {
+                    set k [randomInt [llength $l]]
+                    set l [lreplace $l $k $k $ele]
+                    r lset mylist $k $ele
+                }
+            } {
+                if {[llength $l] > 0} {
+                    set l [lrange $l 1 end]
+                    r lpop mylist
+                }
+            }
+        }
+        assert_equal [llength $l] [r llen mylist]
+        assert_equal $l [r lrange mylist 0 -1]
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+}
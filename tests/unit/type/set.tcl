@@ -66,6 +66,44 @@ start_server {
         assert_equal [lsort {A a b c B}] [lsort [r smembers myset]]
     }
 
+    test {SADDSORTED with ascending integers keeps the intset encoding} {
+        r del myset
+        set args {}
+        for {set i 0} {$i < 100} {incr i} { lappend args $i }
+        assert_equal 100 [r saddsorted myset {*}$args]
+        assert_encoding intset myset
+        assert_equal 100 [r scard myset]
+        assert_equal 1 [r sismember myset 50]
+        assert_equal 0 [r sismember myset 100]
+    }
+
+    test {SADDSORTED converts to hashtable up front for large payloads} {
+        r del myset
+        set args {}
+        for {set i 0} {$i < 1000} {incr i} { lappend args $i }
+        assert_equal 1000 [r saddsorted myset {*}$args]
+        assert_encoding hashtable myset
+        for {set i 0} {$i < 1000} {incr i 100} {
+            assert_equal 1 [r sismember myset $i]
+        }
+        r debug reload
+        assert_equal 1000 [r scard myset]
+    }
+
+    test {SADDSORTED with misordered or duplicate input behaves like SADD} {
+        r del myset
+        assert_equal 3 [r saddsorted myset b a c a]
+        assert_equal {a b c} [lsort [r smembers myset]]
+        assert_equal 1 [r saddsorted myset c d]
+        assert_equal {a b c d} [lsort [r smembers myset]]
+    }
+
+    test {SADDSORTED against non set} {
+        r del mylist
+        r rpush mylist foo
+        assert_error "WRONGTYPE*" {r saddsorted mylist bar}
+    }
+
     test "Set encoding after DEBUG RELOAD" {
         r del myintset myhashset mylargeintset
         for {set i 0} {$i <  100} {incr i} { r sadd myintset $i }
@@ -184,6 +222,18 @@ start_server {
             assert_equal [list 195 199 $large] [lsort [r smembers setres]]
         }
 
+        test "SINTERCARD with two sets - $type" {
+            assert_equal 6 [r sintercard 2 set1 set2]
+        }
+
+        test "SINTERCARD with LIMIT - $type" {
+            # LIMIT 0 means unlimited.
+            assert_equal 6 [r sintercard 2 set1 set2 limit 0]
+            assert_equal 3 [r sintercard 2 set1 set2 limit 3]
+            # A LIMIT larger than the cardinality returns the cardinality.
+            assert_equal 6 [r sintercard 2 set1 set2 limit 100]
+        }
+
         test "SUNION with non existing keys - $type" {
             set expected [lsort -uniq "[r smembers set1] [r smembers set2]"]
             assert_equal $expected [lsort [r sunion nokey1 set1 set2 nokey2]]
@@ -263,6 +313,18 @@ start_server {
         r sinter set1 set2 set3
     } {}
 
+    test "SINTERCARD should handle non existing key as empty" {
+        assert_equal 0 [r sintercard 3 set1 set2 set3]
+        assert_equal 0 [r sintercard 1 non-existing-key]
+    }
+
+    test "SINTERCARD arguments validation" {
+        assert_error "*LIMIT can't be negative*" {r sintercard 2 set1 set2 limit -1}
+        assert_error "*numkeys*" {r sintercard 0 set1}
+        assert_error "*Number of keys*" {r sintercard 3 set1 set2}
+        assert_error "*syntax*" {r sintercard 2 set1 set2 limit}
+    }
+
     test "SINTER with same integer elements but different encoding" {
         r del set1 set2
         r sadd set1 1 2 3
@@ -376,6 +376,54 @@ start_server {tags {"stream"} overrides {appendonly yes stream-node-max-entries
     }
 }
 
+start_server {tags {"stream"} overrides {stream-node-max-entries 10}} {
+    test {Exact XTRIM is immediately visible to XLEN and XRANGE} {
+        r del mystream
+        for {set j 0} {$j < 1000} {incr j} {
+            r XADD mystream * xitem $j
+        }
+        assert_equal 950 [r XTRIM mystream MAXLEN 50]
+        assert_equal 50 [r xlen mystream]
+        set res [r XRANGE mystream - +]
+        assert_equal 50 [llength $res]
+        assert_equal {xitem 950} [lindex $res 0 1]
+        set res [r XREVRANGE mystream + -]
+        assert_equal 50 [llength $res]
+        assert_equal {xitem 999} [lindex $res 0 1]
+    }
+
+    test {Deferred trim nodes are released over time} {
+        wait_for_condition 50 100 {
+            [dict get [r xinfo stream mystream] radix-tree-keys] <= 6
+        } else {
+            fail "Trimmed radix tree nodes were not released"
+        }
+    }
+
+    test {Stream with a pending deferred trim survives DEBUG RELOAD} {
+        r del mystream
+        for {set j 0} {$j < 1000} {incr j} {
+            r XADD mystream * xitem $j
+        }
+        r XTRIM mystream MAXLEN 30
+        r debug reload
+        assert_equal 30 [r xlen mystream]
+        assert_equal {xitem 970} [lindex [r XRANGE mystream - +] 0 1]
+    }
+
+    test {XADD right after a full exact XTRIM works} {
+        r del mystream
+        for {set j 0} {$j < 500} {incr j} {
+            r XADD mystream * xitem $j
+        }
+        r XTRIM mystream MAXLEN 0
+        assert_equal 0 [r xlen mystream]
+        r XADD mystream * xitem new
+        assert_equal 1 [r xlen mystream]
+        assert_equal {xitem new} [lindex [r XRANGE mystream - +] 0 1]
+    }
+}
+
 start_server {tags {"xsetid"}} {
     test {XADD can CREATE an empty stream} {
         r XADD mystream MAXLEN 0 * a b
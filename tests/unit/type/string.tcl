@@ -139,6 +139,12 @@ start_server {tags {"string"}} {
         format $err
     } {*wrong number*}
 
+    test {MSET with repeated keys, the last value wins} {
+        r del xr1 xr2
+        r mset xr1 a xr2 b xr1 c xr2 d xr1 e
+        r mget xr1 xr2
+    } {e d}
+
     test {MSETNX with already existent key} {
         list [r msetnx x1 xxx y2 yyy x 20] [r exists x1] [r exists y2]
     } {0 0 0}
@@ -419,4 +425,174 @@ start_server {tags {"string"}} {
         r set foo bar
         r getrange foo 0 4294967297
     } {bar}
+
+    test {GETDEL command} {
+        r del foo
+        r set foo bar
+        assert_equal bar [r getdel foo]
+        assert_equal 0 [r exists foo]
+        # A second GETDEL finds nothing.
+        assert_equal {} [r getdel foo]
+    }
+
+    test {GETDEL against key of the wrong type} {
+        r del mylist
+        r rpush mylist a
+        assert_error "WRONGTYPE*" {r getdel mylist}
+    }
+
+    test {GETEX without options is a plain GET} {
+        r del foo
+        r set foo bar ex 100
+        assert_equal bar [r getex foo]
+        # The TTL is left untouched.
+        assert {[r ttl foo] > 90}
+        assert_equal {} [r getex nosuchkey]
+    }
+
+    test {GETEX EX option} {
+        r del foo
+        r set foo bar
+        assert_equal bar [r getex foo ex 10]
+        set ttl [r ttl foo]
+        assert {$ttl <= 10 && $ttl > 5}
+    }
+
+    test {GETEX PX option} {
+        r del foo
+        r set foo bar
+        assert_equal bar [r getex foo px 10000]
+        set ttl [r ttl foo]
+        assert {$ttl <= 10 && $ttl > 5}
+    }
+
+    test {GETEX EXAT option} {
+        r del foo
+        r set foo bar
+        assert_equal bar [r getex foo exat [expr [clock seconds]+10]]
+        set ttl [r ttl foo]
+        assert {$ttl <= 10 && $ttl > 5}
+    }
+
+    test {GETEX PXAT option} {
+        r del foo
+        r set foo bar
+        assert_equal bar [r getex foo pxat [expr [clock milliseconds]+10000]]
+        set ttl [r ttl foo]
+        assert {$ttl <= 10 && $ttl > 5}
+    }
+
+    test {GETEX PERSIST option} {
+        r del foo
+        r set foo bar ex 100
+        assert_equal bar [r getex foo persist]
+        assert_equal -1 [r ttl foo]
+        # PERSIST with no TTL to remove is a no-op.
+        assert_equal bar [r getex foo persist]
+        assert_equal -1 [r ttl foo]
+    }
+
+    test {GETEX overwrites an existing TTL} {
+        r del foo
+        r set foo bar ex 100
+        assert_equal bar [r getex foo ex 10]
+        assert {[r ttl foo] <= 10}
+    }
+
+    test {GETEX can detect syntax errors} {
+        r set foo bar
+        assert_error "*syntax*" {r getex foo badopt}
+        assert_error "*syntax*" {r getex foo ex}
+        assert_error "*syntax*" {r getex foo ex 10 px 10000}
+        assert_error "*syntax*" {r getex foo ex 10 exat 100}
+        assert_error "*syntax*" {r getex foo persist ex 10}
+        assert_error "*invalid expire*" {r getex foo ex 0}
+        assert_error "*invalid expire*" {r getex foo px -1}
+    }
+
+    test {STRRANGE GET basics} {
+        r del mykey
+        r set mykey "Hello World"
+        assert_equal {Hell} [r strrange mykey get 0 3]
+        assert_equal {Hell World} [r strrange mykey get 0 3 get 6 10]
+        assert_equal {{Hello World}} [r strrange mykey get 0 -1]
+    }
+
+    test {STRRANGE GET with negative indices} {
+        r set mykey "Hello World"
+        assert_equal {World} [r strrange mykey get -5 -1]
+        assert_equal {d} [r strrange mykey get -1 -1]
+        assert_equal {} [lindex [r strrange mykey get -1 -5] 0]
+    }
+
+    test {STRRANGE GET with out of range indices} {
+        r set mykey "Hello World"
+        assert_equal " World" [lindex [r strrange mykey get 5 10000] 0]
+        assert_equal {} [lindex [r strrange mykey get 100 200] 0]
+        # Both indices clamp to the start of the string, like GETRANGE.
+        assert_equal {H} [r strrange mykey get -100 -50]
+    }
+
+    test {STRRANGE GET against non-existing key} {
+        r del mykey
+        assert_equal {} [lindex [r strrange mykey get 0 -1] 0]
+    }
+
+    test {STRRANGE GET against integer-encoded value} {
+        r del mykey
+        r set mykey 1234567
+        assert_encoding int mykey
+        assert_equal {234} [r strrange mykey get 1 3]
+    }
+
+    test {STRRANGE GET shares the payload of a raw string} {
+        r del mykey
+        set payload [string repeat "0123456789" 1000]
+        r set mykey $payload
+        assert_encoding raw mykey
+        # Two ranges of the same reply both reference the stored string.
+        lassign [r strrange mykey get 0 9 get 9990 9999] first last
+        assert_equal "0123456789" $first
+        assert_equal "0123456789" $last
+        assert_equal [string range $payload 5000 5999] \
+            [lindex [r strrange mykey get 5000 5999] 0]
+    }
+
+    test {STRRANGE SET basics} {
+        r del mykey
+        r set mykey "Hello World"
+        assert_equal {11} [r strrange mykey set 6 "Redis"]
+        assert_equal "Hello Redis" [r get mykey]
+    }
+
+    test {STRRANGE SET extends the string zero padded} {
+        r del mykey
+        assert_equal {6} [r strrange mykey set 5 "x"]
+        assert_equal "\x00\x00\x00\x00\x00x" [r get mykey]
+    }
+
+    test {STRRANGE SET with empty value does not create the key} {
+        r del mykey
+        assert_equal {0} [r strrange mykey set 0 ""]
+        assert_equal 0 [r exists mykey]
+    }
+
+    test {STRRANGE mixed GET and SET are executed in order} {
+        r del mykey
+        r set mykey "Hello World"
+        assert_equal {Hello 11 Jello} \
+            [r strrange mykey get 0 4 set 0 "Jello" get 0 4]
+        assert_equal "Jello World" [r get mykey]
+    }
+
+    test {STRRANGE argument errors} {
+        r del mykey mylist
+        r set mykey "Hello World"
+        r rpush mylist a
+        assert_error "WRONGTYPE*" {r strrange mylist get 0 -1}
+        assert_error "WRONGTYPE*" {r strrange mylist set 0 x}
+        assert_error "*offset is out of range*" {r strrange mykey set -1 x}
+        assert_error "*syntax*" {r strrange mykey get 0}
+        assert_error "*syntax*" {r strrange mykey bogus 0 1}
+    }
 }
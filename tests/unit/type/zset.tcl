@@ -7,7 +7,7 @@ start_server {tags {"zset"}} {
     }
 
     proc basics {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             r config set zset-max-ziplist-entries 128
             r config set zset-max-ziplist-value 64
         } elseif {$encoding == "skiplist"} {
@@ -376,6 +376,30 @@ start_server {tags {"zset"}} {
             assert_equal {d 3 c 2} [r zrevrangebyscore zset 5 2 LIMIT 2 3 WITHSCORES]
         }
 
+        test "ZRANGEBYSCORE with AFTER cursor" {
+            create_default_zset
+            assert_equal {d e}   [r zrangebyscore zset 0 10 LIMIT 0 2 AFTER c]
+            assert_equal {e f}   [r zrangebyscore zset 0 10 LIMIT 1 2 AFTER c]
+            assert_equal {}      [r zrangebyscore zset 0 10 LIMIT 0 2 AFTER f]
+            assert_equal {c b}   [r zrevrangebyscore zset 10 0 LIMIT 0 2 AFTER d]
+            assert_equal {}      [r zrevrangebyscore zset 10 0 LIMIT 0 2 AFTER b]
+            # A cursor sorting before the start of the range cannot leak
+            # elements that precede the requested interval.
+            assert_equal {d e}   [r zrangebyscore zset 3 4 LIMIT 0 5 AFTER b]
+            assert_error "*AFTER member*" {r zrangebyscore zset 0 10 LIMIT 0 2 AFTER nosuchmember}
+        }
+
+        test "ZRANGEBYSCORE AFTER cursor paginates the whole set" {
+            create_default_zset
+            set page [r zrangebyscore zset -inf +inf LIMIT 0 2]
+            set all $page
+            while {[llength $page] == 2} {
+                set page [r zrangebyscore zset -inf +inf LIMIT 0 2 AFTER [lindex $page end]]
+                set all [concat $all $page]
+            }
+            assert_equal [r zrangebyscore zset -inf +inf] $all
+        }
+
         test "ZRANGEBYSCORE with non-value min or max" {
             assert_error "*not*float*" {r zrangebyscore fooz str 1}
             assert_error "*not*float*" {r zrangebyscore fooz 1 str}
@@ -689,6 +713,48 @@ start_server {tags {"zset"}} {
             assert_equal {d 3 c 2} [r zpopmax z1 2]
         }
 
+        test "ZPOP with count larger than the sorted set - $encoding" {
+            create_zset z1 {0 a 1 b 2 c 3 d}
+            assert_equal {a 0 b 1 c 2 d 3} [r zpopmin z1 10]
+            assert_equal 0 [r exists z1]
+            create_zset z1 {0 a 1 b 2 c 3 d}
+            assert_equal {d 3 c 2 b 1 a 0} [r zpopmax z1 10]
+            assert_equal 0 [r exists z1]
+        }
+
+        test "ZPOP with non positive count - $encoding" {
+            create_zset z1 {0 a 1 b}
+            assert_equal {} [r zpopmin z1 0]
+            assert_equal {} [r zpopmax z1 -1]
+            assert_equal 2 [r zcard z1]
+        }
+
+        test "ZPOP with count pops every element in order - $encoding" {
+            r del z1
+            set args {}
+            set expmin {}
+            set expmax {}
+            for {set i 0} {$i < 100} {incr i} {
+                lappend args $i e:[format %03d $i]
+                lappend expmin e:[format %03d $i] $i
+            }
+            for {set i 99} {$i >= 0} {incr i -1} {
+                lappend expmax e:[format %03d $i] $i
+            }
+            r zadd z1 {*}$args
+            set popped {}
+            while {[r exists z1]} {
+                lappend popped {*}[r zpopmin z1 7]
+            }
+            assert_equal $expmin $popped
+            r zadd z1 {*}$args
+            set popped {}
+            while {[r exists z1]} {
+                lappend popped {*}[r zpopmax z1 7]
+            }
+            assert_equal $expmax $popped
+        }
+
         test "BZPOP with a single existing sorted set - $encoding" {
             set rd [redis_deferring_client]
             create_zset zset {0 a 1 b 2 c}
@@ -735,9 +801,149 @@ start_server {tags {"zset"}} {
         }
     }
 
-    basics ziplist
+    basics listpack
     basics skiplist
 
+    proc zrangestore_tests {encoding} {
+        if {$encoding == "listpack"} {
+            r config set zset-max-ziplist-entries 128
+            r config set zset-max-ziplist-value 64
+        } else {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+        }
+
+        r del zsrc zlexsrc
+        r zadd zsrc 1 a 2 b 3 c 4 d 5 e
+        r zadd zlexsrc 0 a 0 b 0 c 0 d 0 e
+
+        test "ZRANGESTORE basic - $encoding" {
+            assert_encoding $encoding zsrc
+            assert_equal 5 [r zrangestore zdst zsrc 0 -1]
+            assert_encoding $encoding zdst
+            assert_equal {a 1 b 2 c 3 d 4 e 5} [r zrange zdst 0 -1 withscores]
+        }
+
+        test "ZRANGESTORE with negative indexes - $encoding" {
+            assert_equal 3 [r zrangestore zdst zsrc -3 -1]
+            assert_equal {c d e} [r zrange zdst 0 -1]
+        }
+
+        test "ZRANGESTORE REV - $encoding" {
+            assert_equal 3 [r zrangestore zdst zsrc 0 2 rev]
+            assert_equal {c 3 d 4 e 5} [r zrange zdst 0 -1 withscores]
+        }
+
+        test "ZRANGESTORE BYSCORE - $encoding" {
+            assert_equal 2 [r zrangestore zdst zsrc 2 3 byscore]
+            assert_equal {b 2 c 3} [r zrange zdst 0 -1 withscores]
+        }
+
+        test "ZRANGESTORE BYSCORE REV - $encoding" {
+            assert_equal 2 [r zrangestore zdst zsrc 3 2 byscore rev]
+            assert_equal {b c} [r zrange zdst 0 -1]
+        }
+
+        test "ZRANGESTORE BYSCORE with exclusive range and LIMIT - $encoding" {
+            assert_equal 2 [r zrangestore zdst zsrc (1 +inf byscore limit 1 2]
+            assert_equal {c d} [r zrange zdst 0 -1]
+        }
+
+        test "ZRANGESTORE BYLEX - $encoding" {
+            assert_equal 3 [r zrangestore zdst zlexsrc \[b \[d bylex]
+            assert_equal {b c d} [r zrange zdst 0 -1]
+        }
+
+        test "ZRANGESTORE BYLEX REV with LIMIT - $encoding" {
+            assert_equal 2 [r zrangestore zdst zlexsrc \[d \[a bylex rev limit 1 2]
+            assert_equal {b c} [r zrange zdst 0 -1]
+        }
+
+        test "ZRANGESTORE overwrites the destination - $encoding" {
+            r del zdst
+            r zadd zdst 100 old1 200 old2
+            assert_equal 2 [r zrangestore zdst zsrc 0 1]
+            assert_equal {a 1 b 2} [r zrange zdst 0 -1 withscores]
+        }
+
+        test "ZRANGESTORE deletes the destination on an empty result - $encoding" {
+            r del zdst
+            r zadd zdst 1 x
+            assert_equal 0 [r zrangestore zdst zsrc 10 20]
+            assert_equal 0 [r exists zdst]
+        }
+
+        test "ZRANGESTORE with non existing source - $encoding" {
+            r del zdst nosrc
+            r zadd zdst 1 x
+            assert_equal 0 [r zrangestore zdst nosrc 0 -1]
+            assert_equal 0 [r exists zdst]
+        }
+    }
+
+    zrangestore_tests listpack
+    zrangestore_tests skiplist
+
+    test "ZRANGESTORE invalid arguments" {
+        assert_error "*LIMIT*" {r zrangestore zdst zsrc 0 -1 limit 0 10}
+        assert_error "*syntax*" {r zrangestore zdst zsrc 0 -1 badarg}
+        assert_error "*not a float*" {r zrangestore zdst zsrc notafloat 5 byscore}
+        assert_error "*not valid string range*" {r zrangestore zdst zsrc a b bylex}
+    }
+
+    test "ZADDSORTED with sorted input builds the same zset as ZADD" {
+        r del znew zref
+        r config set zset-max-ziplist-entries 128
+        r config set zset-max-ziplist-value 64
+        set args {}
+        for {set i 0} {$i < 1000} {incr i} {
+            lappend args $i ele:[format %05d $i]
+        }
+        assert_equal 1000 [r zaddsorted znew {*}$args]
+        r zadd zref {*}$args
+        assert_encoding skiplist znew
+        assert_equal [r zrange zref 0 -1 withscores] [r zrange znew 0 -1 withscores]
+        assert_equal 500 [r zscore znew ele:00500]
+        r debug reload
+        assert_equal [r zrange zref 0 -1 withscores] [r zrange znew 0 -1 withscores]
+    }
+
+    test "ZADDSORTED small payload is stored as a listpack" {
+        r del znew
+        assert_equal 3 [r zaddsorted znew 1 a 2 b 3 c]
+        assert_encoding listpack znew
+    }
+
+    test "ZADDSORTED with misordered input falls back without corruption" {
+        r del znew
+        assert_equal 5 [r zaddsorted znew 5 e 1 a 3 c 2 b 4 d]
+        assert_equal {a 1 b 2 c 3 d 4 e 5} [r zrange znew 0 -1 withscores]
+        # Same score with descending members is out of order too.
+        r del znew
+        assert_equal 2 [r zaddsorted znew 1 b 1 a]
+        assert_equal {a 1 b 1} [r zrange znew 0 -1 withscores]
+        # A member repeated in the payload degrades to an update.
+        r del znew
+        assert_equal 1 [r zaddsorted znew 1 a 2 a]
+        assert_equal {a 2} [r zrange znew 0 -1 withscores]
+        r debug reload
+        assert_equal {a 2} [r zrange znew 0 -1 withscores]
+    }
+
+    test "ZADDSORTED against an existing key behaves like ZADD" {
+        r del znew
+        r zadd znew 1 a 2 b
+        assert_equal 1 [r zaddsorted znew 0 a 3 c]
+        assert_equal {a 0 b 2 c 3} [r zrange znew 0 -1 withscores]
+    }
+
+    test "ZADDSORTED argument errors leave the key untouched" {
+        r del znew
+        assert_error "*syntax*" {r zaddsorted znew 1 a 2}
+        assert_error "*not a valid float*" {r zaddsorted znew 1 a notafloat b}
+        assert_equal 0 [r exists znew]
+    }
+
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
         r sadd set1 a
@@ -786,7 +992,7 @@ start_server {tags {"zset"}} {
     }
 
     proc stressers {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
             r config set zset-max-ziplist-entries 256
             r config set zset-max-ziplist-value 64
@@ -811,7 +1017,10 @@ start_server {tags {"zset"}} {
 
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                # Compare numerically: the server replies with the shortest
+                # representation that round trips, Tcl may format the same
+                # double with more digits.
+                assert {[lindex $aux $i] == [r zscore zscoretest $i]}
             }
         }
 
@@ -827,7 +1036,10 @@ start_server {tags {"zset"}} {
             r debug reload
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                # Compare numerically: the server replies with the shortest
+                # representation that round trips, Tcl may format the same
+                # double with more digits.
+                assert {[lindex $aux $i] == [r zscore zscoretest $i]}
             }
         }
 
@@ -1198,7 +1410,7 @@ start_server {tags {"zset"}} {
     }
 
     tags {"slow"} {
-        stressers ziplist
+        stressers listpack
         stressers skiplist
     }
 